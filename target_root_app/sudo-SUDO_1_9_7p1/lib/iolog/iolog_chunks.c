@@ -0,0 +1,424 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * This is an open source non-commercial project. Dear PVS-Studio, please check it.
+ * PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_iolog.h"
+#include "sudo_util.h"
+#include "iolog_chunks.h"
+
+/*
+ * Returns true if the file open on fd is a deduplicated stream.
+ */
+bool
+iolog_chunks_probe(int fd)
+{
+    char magic[IOLOG_CHUNKS_MAGIC_LEN];
+    debug_decl(iolog_chunks_probe, SUDO_DEBUG_UTIL);
+
+    if (pread(fd, magic, sizeof(magic), 0) != ssizeof(magic))
+	debug_return_bool(false);
+    debug_return_bool(memcmp(magic, IOLOG_CHUNKS_MAGIC, sizeof(magic)) == 0);
+}
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+
+struct chunk_entry {
+    off_t offset;		/* offset of the data in the stream */
+    off_t inline_data;		/* offset in the manifest, -1 for a chunk */
+    size_t len;
+    char name[IOLOG_CHUNK_NAME_LEN + 1];
+};
+
+struct chunks_reader {
+    struct chunk_entry *entries;
+    size_t nentries;
+    size_t cur;			/* entry containing pos */
+    size_t chunk_entry;		/* entry chunk_fd is open for */
+    off_t size;			/* size of the reassembled stream */
+    off_t pos;
+    FILE *manifest;
+    int chunks_dfd;
+    int chunk_fd;
+};
+
+static void
+chunks_free(struct chunks_reader *r)
+{
+    debug_decl(chunks_free, SUDO_DEBUG_UTIL);
+
+    if (r->chunk_fd != -1)
+	close(r->chunk_fd);
+    if (r->chunks_dfd != -1)
+	close(r->chunks_dfd);
+    if (r->manifest != NULL)
+	fclose(r->manifest);
+    free(r->entries);
+    free(r);
+
+    debug_return;
+}
+
+static bool
+valid_chunk_name(const char *name, size_t len)
+{
+    size_t i;
+
+    if (len != IOLOG_CHUNK_NAME_LEN)
+	return false;
+    for (i = 0; i < len; i++) {
+	if (!((name[i] >= '0' && name[i] <= '9') ||
+		(name[i] >= 'a' && name[i] <= 'f')))
+	    return false;
+    }
+    return true;
+}
+
+/*
+ * Read the manifest and build the list of entries.  A truncated
+ * final record, as left by a crash, ends the stream.  A provisional
+ * tail record is replaced by the complete record that follows it.
+ */
+static bool
+chunks_parse(struct chunks_reader *r)
+{
+    size_t linesize = 0, entries_size = 0;
+    char *cp, *line = NULL;
+    const char *errstr;
+    struct stat sb;
+    ssize_t len;
+    bool tail = false, ret = false;
+    debug_decl(chunks_parse, SUDO_DEBUG_UTIL);
+
+    if (fstat(fileno(r->manifest), &sb) == -1 ||
+	    fseeko(r->manifest, IOLOG_CHUNKS_MAGIC_LEN, SEEK_SET) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to read chunk manifest");
+	goto done;
+    }
+
+    while ((len = getdelim(&line, &linesize, '\n', r->manifest)) != -1) {
+	struct chunk_entry *ce;
+
+	if (line[len - 1] != '\n') {
+	    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+		"truncated chunk manifest record");
+	    break;
+	}
+	line[--len] = '\0';
+
+	if (r->nentries == entries_size) {
+	    void *tmp;
+
+	    entries_size = entries_size ? entries_size * 2 : 64;
+	    tmp = reallocarray(r->entries, entries_size, sizeof(*r->entries));
+	    if (tmp == NULL) {
+		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		    "unable to allocate memory");
+		goto done;
+	    }
+	    r->entries = tmp;
+	}
+	ce = &r->entries[r->nentries];
+
+	if (line[0] == 'c' && line[1] == ' ') {
+	    cp = strchr(line + 2, ' ');
+	    if (cp == NULL || !valid_chunk_name(line + 2, cp - (line + 2)))
+		goto bad;
+	    memcpy(ce->name, line + 2, IOLOG_CHUNK_NAME_LEN);
+	    ce->name[IOLOG_CHUNK_NAME_LEN] = '\0';
+	    ce->len = sudo_strtonum(cp + 1, 1, IOLOG_CHUNK_MAX, &errstr);
+	    if (errstr != NULL)
+		goto bad;
+	    ce->inline_data = -1;
+	} else if ((line[0] == 'd' || line[0] == 't') && line[1] == ' ') {
+	    ce->len = sudo_strtonum(line + 2, 1, IOLOG_CHUNK_MAX, &errstr);
+	    if (errstr != NULL)
+		goto bad;
+	    ce->name[0] = '\0';
+	    ce->inline_data = ftello(r->manifest);
+	    if (ce->inline_data == -1 ||
+		    ce->inline_data + (off_t)ce->len > sb.st_size) {
+		sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+		    "truncated chunk manifest data");
+		break;
+	    }
+	    if (fseeko(r->manifest, ce->len, SEEK_CUR) == -1)
+		goto bad;
+	} else {
+	    goto bad;
+	}
+	if (tail) {
+	    /* This record starts where the provisional tail did. */
+	    r->nentries--;
+	    r->size -= r->entries[r->nentries].len;
+	    r->entries[r->nentries] = *ce;
+	    ce = &r->entries[r->nentries];
+	}
+	tail = line[0] == 't';
+	ce->offset = r->size;
+	r->size += ce->len;
+	r->nentries++;
+    }
+    ret = true;
+    goto done;
+
+bad:
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	"invalid chunk manifest record: %s", line);
+    errno = EINVAL;
+done:
+    free(line);
+    debug_return_bool(ret);
+}
+
+static ssize_t
+chunks_read(void *v, char *buf, size_t len)
+{
+    struct chunks_reader *r = v;
+    size_t total = 0;
+    debug_decl(chunks_read, SUDO_DEBUG_UTIL);
+
+    while (total < len && r->pos < r->size) {
+	struct chunk_entry *ce;
+	off_t skip;
+	ssize_t nread;
+	size_t n;
+	int fd;
+
+	while (r->entries[r->cur].offset + (off_t)r->entries[r->cur].len <=
+		r->pos)
+	    r->cur++;
+	ce = &r->entries[r->cur];
+	skip = r->pos - ce->offset;
+	n = MIN(len - total, ce->len - (size_t)skip);
+
+	if (ce->inline_data != -1) {
+	    fd = fileno(r->manifest);
+	    skip += ce->inline_data;
+	} else {
+	    if (r->chunk_entry != r->cur) {
+		if (r->chunk_fd != -1)
+		    close(r->chunk_fd);
+		r->chunk_fd = openat(r->chunks_dfd, ce->name, O_RDONLY);
+		if (r->chunk_fd == -1) {
+		    sudo_debug_printf(
+			SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+			"unable to open chunk %s", ce->name);
+		    debug_return_ssize_t(-1);
+		}
+		r->chunk_entry = r->cur;
+	    }
+	    fd = r->chunk_fd;
+	}
+
+	nread = pread(fd, buf + total, n, skip);
+	if (nread == -1) {
+	    if (errno == EINTR)
+		continue;
+	    debug_return_ssize_t(-1);
+	}
+	if (nread == 0) {
+	    /* Chunk is shorter than the manifest says. */
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"short chunk %s", ce->name);
+	    errno = EIO;
+	    debug_return_ssize_t(-1);
+	}
+	total += nread;
+	r->pos += nread;
+    }
+
+    debug_return_ssize_t(total);
+}
+
+static bool
+chunks_seek(struct chunks_reader *r, off_t *offset, int whence)
+{
+    size_t lo, hi;
+    off_t target;
+
+    switch (whence) {
+    case SEEK_SET:
+	target = *offset;
+	break;
+    case SEEK_CUR:
+	target = r->pos + *offset;
+	break;
+    case SEEK_END:
+	target = r->size + *offset;
+	break;
+    default:
+	errno = EINVAL;
+	return false;
+    }
+    if (target < 0 || target > r->size) {
+	errno = EINVAL;
+	return false;
+    }
+
+    /* Binary search for the entry containing the target. */
+    lo = 0;
+    hi = r->nentries;
+    while (hi - lo > 1) {
+	const size_t mid = lo + (hi - lo) / 2;
+
+	if (r->entries[mid].offset <= target)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    r->cur = lo;
+    r->pos = target;
+    *offset = target;
+    return true;
+}
+
+static int
+chunks_close(void *v)
+{
+    chunks_free(v);
+    return 0;
+}
+
+#ifdef HAVE_FOPENCOOKIE
+static int
+chunks_seek_cookie(void *v, off64_t *offset, int whence)
+{
+    off_t pos = (off_t)*offset;
+
+    if (!chunks_seek(v, &pos, whence))
+	return -1;
+    *offset = pos;
+    return 0;
+}
+
+static cookie_io_functions_t chunks_funcs = {
+    chunks_read, NULL, chunks_seek_cookie, chunks_close
+};
+#else
+static int
+chunks_read_funopen(void *v, char *buf, int len)
+{
+    return (int)chunks_read(v, buf, (size_t)len);
+}
+
+static fpos_t
+chunks_seek_funopen(void *v, fpos_t offset, int whence)
+{
+    off_t pos = (off_t)offset;
+
+    if (!chunks_seek(v, &pos, whence))
+	return -1;
+    return (fpos_t)pos;
+}
+#endif /* HAVE_FOPENCOOKIE */
+
+/*
+ * Open a read-only stream that reassembles the deduplicated I/O log
+ * stream whose manifest is open on fd.  Chunks are read from the
+ * "chunks" subdirectory of dfd.  On success, fd is owned by the
+ * returned stream.
+ */
+FILE *
+iolog_chunks_fdopen(int dfd, int fd)
+{
+    struct chunks_reader *r;
+    FILE *fp = NULL;
+    int mfd;
+    debug_decl(iolog_chunks_fdopen, SUDO_DEBUG_UTIL);
+
+    if ((r = calloc(1, sizeof(*r))) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	debug_return_ptr(NULL);
+    }
+    r->chunk_fd = -1;
+    r->chunks_dfd = -1;
+    r->chunk_entry = (size_t)-1;
+    if ((mfd = dup(fd)) == -1 || (r->manifest = fdopen(mfd, "r")) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open chunk manifest");
+	if (mfd != -1)
+	    close(mfd);
+	goto bad;
+    }
+    (void)fcntl(mfd, F_SETFD, FD_CLOEXEC);
+    r->chunks_dfd = iolog_openat(dfd, IOLOG_CHUNKS_DIR, O_RDONLY);
+    if (r->chunks_dfd == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s directory", IOLOG_CHUNKS_DIR);
+	goto bad;
+    }
+    if (!chunks_parse(r))
+	goto bad;
+
+#ifdef HAVE_FOPENCOOKIE
+    fp = fopencookie(r, "r", chunks_funcs);
+#else
+    fp = funopen(r, chunks_read_funopen, NULL, chunks_seek_funopen,
+	chunks_close);
+#endif
+    if (fp == NULL)
+	goto bad;
+    close(fd);
+
+    debug_return_ptr(fp);
+bad:
+    chunks_free(r);
+    debug_return_ptr(NULL);
+}
+
+#else /* !HAVE_FOPENCOOKIE && !HAVE_FUNOPEN */
+
+FILE *
+iolog_chunks_fdopen(int dfd, int fd)
+{
+    debug_decl(iolog_chunks_fdopen, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	"deduplicated I/O logs are not supported on this system");
+    errno = ENOTSUP;
+    debug_return_ptr(NULL);
+}
+
+#endif /* HAVE_FOPENCOOKIE || HAVE_FUNOPEN */
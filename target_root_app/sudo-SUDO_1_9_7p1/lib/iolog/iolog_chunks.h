@@ -0,0 +1,64 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IOLOG_CHUNKS_H
+#define IOLOG_CHUNKS_H
+
+/*
+ * Deduplicated I/O log streams.
+ *
+ * A deduplicated stream is stored as a manifest that starts with
+ * IOLOG_CHUNKS_MAGIC followed by a sequence of records:
+ *
+ *   c <sha256> <length>\n	data stored in a shared chunk
+ *   d <length>\n<data>		data stored inline in the manifest
+ *   t <length>\n<data>		provisional tail, stored inline
+ *
+ * A "t" record holds data that has not reached a chunk boundary yet
+ * and is written when a commit point is sent.  It is superseded by
+ * the record that follows it, which starts at the same offset in the
+ * stream, so it only contributes data when it is the last complete
+ * record in the manifest.
+ *
+ * Chunks are named by the hex SHA-256 digest of their contents and
+ * are hard-linked into the "chunks" subdirectory of the I/O log
+ * directory from a shared chunk store.  The link count of a chunk in
+ * the store is therefore one more than the number of sessions that
+ * reference it, and removing an expired session directory is enough
+ * to drop its references.
+ *
+ * Chunk boundaries are chosen based on content using a gear hash so
+ * that identical output in different sessions produces identical
+ * chunks even when preceded by different data.  The minimum chunk
+ * size is kept small so that a short session, such as one that only
+ * displays a login banner, is still stored as a shared chunk.
+ */
+
+#define IOLOG_CHUNKS_MAGIC	"\0sudo-chunks 1\n"
+#define IOLOG_CHUNKS_MAGIC_LEN	(sizeof(IOLOG_CHUNKS_MAGIC) - 1)
+#define IOLOG_CHUNKS_DIR	"chunks"
+#define IOLOG_CHUNK_NAME_LEN	64	/* hex SHA-256 */
+#define IOLOG_CHUNK_MIN		256
+#define IOLOG_CHUNK_MAX		(64 * 1024)
+#define IOLOG_CHUNK_MASK	0xfff8000000000000ULL	/* 8K average */
+
+/* iolog_chunks.c */
+bool iolog_chunks_probe(int fd);
+FILE *iolog_chunks_fdopen(int dfd, int fd);
+
+#endif /* IOLOG_CHUNKS_H */
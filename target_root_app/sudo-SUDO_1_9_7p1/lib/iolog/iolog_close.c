@@ -37,6 +37,7 @@
 #include "sudo_compat.h"
 #include "sudo_debug.h"
 #include "sudo_iolog.h"
+#include "iolog_fault.h"
 
 /*
  * Close an I/O log.
@@ -45,8 +46,15 @@ bool
 iolog_close(struct iolog_file *iol, const char **errstr)
 {
     bool ret = true;
+    int fault_errno = 0;
     debug_decl(iolog_close, SUDO_DEBUG_UTIL);
 
+    /* Test mode: the file is still closed on an injected error. */
+    if (iolog_fault_enabled) {
+	if (iolog_fault_inject(IOLOG_FAULT_CLOSE, NULL) == -1)
+	    fault_errno = errno;
+    }
+
 #ifdef HAVE_ZLIB_H
     if (iol->compressed) {
 	int errnum;
@@ -75,6 +83,11 @@ iolog_close(struct iolog_file *iol, const char **errstr)
 	if (errstr != NULL)
 	    *errstr = strerror(errno);
     }
+    if (ret && fault_errno != 0) {
+	ret = false;
+	if (errstr != NULL)
+	    *errstr = strerror(fault_errno);
+    }
 
     debug_return_bool(ret);
 }
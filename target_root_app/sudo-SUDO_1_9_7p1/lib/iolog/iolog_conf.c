@@ -38,15 +38,28 @@
 #include "sudo_debug.h"
 #include "sudo_util.h"
 #include "sudo_iolog.h"
+#include "iolog_ctx.h"
 
-static unsigned int sessid_max = SESSID_MAX;
-static mode_t iolog_filemode = S_IRUSR|S_IWUSR;
-static mode_t iolog_dirmode = S_IRWXU;
-static uid_t iolog_uid = ROOT_UID;
-static gid_t iolog_gid = ROOT_GID;
-static bool iolog_gid_set;
-static bool iolog_compress;
-static bool iolog_flush;
+/* Settings used by the functions that don't take a context. */
+struct iolog_ctx iolog_default_ctx = {
+    SESSID_MAX, S_IRUSR|S_IWUSR, S_IRWXU, ROOT_UID, ROOT_GID
+};
+
+/*
+ * Initialize a context with the default I/O log settings.
+ */
+void
+iolog_ctx_init(struct iolog_ctx *ctx)
+{
+    ctx->sessid_max = SESSID_MAX;
+    ctx->filemode = S_IRUSR|S_IWUSR;
+    ctx->dirmode = S_IRWXU;
+    ctx->uid = ROOT_UID;
+    ctx->gid = ROOT_GID;
+    ctx->gid_set = false;
+    ctx->compress = false;
+    ctx->flush = false;
+}
 
 /*
  * Reset I/O log settings to default values.
@@ -54,149 +67,178 @@ static bool iolog_flush;
 void
 iolog_set_defaults(void)
 {
-    sessid_max = SESSID_MAX;
-    iolog_filemode = S_IRUSR|S_IWUSR;
-    iolog_dirmode = S_IRWXU;
-    iolog_uid = ROOT_UID;
-    iolog_gid = ROOT_GID;
-    iolog_gid_set = false;
-    iolog_compress = false;
-    iolog_flush = false;
+    iolog_ctx_init(&iolog_default_ctx);
 }
 
 /*
  * Set max sequence number (aka session ID)
  */
 void
-iolog_set_maxseq(unsigned int newval)
+iolog_ctx_set_maxseq(struct iolog_ctx *ctx, unsigned int newval)
 {
-    debug_decl(iolog_set_maxseq, SUDO_DEBUG_UTIL);
+    debug_decl(iolog_ctx_set_maxseq, SUDO_DEBUG_UTIL);
 
     /* Clamp to SESSID_MAX as documented. */
     if (newval > SESSID_MAX)
 	newval = SESSID_MAX;
-    sessid_max = newval;
+    ctx->sessid_max = newval;
 
     debug_return;
 }
 
+void
+iolog_set_maxseq(unsigned int newval)
+{
+    iolog_ctx_set_maxseq(&iolog_default_ctx, newval);
+}
+
 /*
- * Set iolog_uid (and iolog_gid if gid not explicitly set).
+ * Set the I/O log uid (and gid if gid not explicitly set).
  */
 void
-iolog_set_owner(uid_t uid, gid_t gid)
+iolog_ctx_set_owner(struct iolog_ctx *ctx, uid_t uid, gid_t gid)
 {
-    debug_decl(iolog_set_owner, SUDO_DEBUG_UTIL);
+    debug_decl(iolog_ctx_set_owner, SUDO_DEBUG_UTIL);
 
-    iolog_uid = uid;
-    if (!iolog_gid_set)
-	iolog_gid = gid;
+    ctx->uid = uid;
+    if (!ctx->gid_set)
+	ctx->gid = gid;
 
     debug_return;
 }
 
+void
+iolog_set_owner(uid_t uid, gid_t gid)
+{
+    iolog_ctx_set_owner(&iolog_default_ctx, uid, gid);
+}
+
 /*
- * Set iolog_gid.
+ * Set the I/O log gid.
  */
 void
-iolog_set_gid(gid_t gid)
+iolog_ctx_set_gid(struct iolog_ctx *ctx, gid_t gid)
 {
-    debug_decl(iolog_set_gid, SUDO_DEBUG_UTIL);
+    debug_decl(iolog_ctx_set_gid, SUDO_DEBUG_UTIL);
 
-    iolog_gid = gid;
-    iolog_gid_set = true;
+    ctx->gid = gid;
+    ctx->gid_set = true;
 
     debug_return;
 }
 
+void
+iolog_set_gid(gid_t gid)
+{
+    iolog_ctx_set_gid(&iolog_default_ctx, gid);
+}
+
 /*
- * Set iolog_filemode and iolog_dirmode.
+ * Set the I/O log file and directory modes.
  */
 void
-iolog_set_mode(mode_t mode)
+iolog_ctx_set_mode(struct iolog_ctx *ctx, mode_t mode)
 {
-    debug_decl(iolog_set_mode, SUDO_DEBUG_UTIL);
+    debug_decl(iolog_ctx_set_mode, SUDO_DEBUG_UTIL);
 
     /* I/O log files must be readable and writable by owner. */
-    iolog_filemode = S_IRUSR|S_IWUSR;
+    ctx->filemode = S_IRUSR|S_IWUSR;
 
     /* Add in group and other read/write if specified. */
-    iolog_filemode |= mode & (S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+    ctx->filemode |= mode & (S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
 
     /* For directory mode, add execute bits as needed. */
-    iolog_dirmode = iolog_filemode | S_IXUSR;
-    if (iolog_dirmode & (S_IRGRP|S_IWGRP))
-	iolog_dirmode |= S_IXGRP;
-    if (iolog_dirmode & (S_IROTH|S_IWOTH))
-	iolog_dirmode |= S_IXOTH;
+    ctx->dirmode = ctx->filemode | S_IXUSR;
+    if (ctx->dirmode & (S_IRGRP|S_IWGRP))
+	ctx->dirmode |= S_IXGRP;
+    if (ctx->dirmode & (S_IROTH|S_IWOTH))
+	ctx->dirmode |= S_IXOTH;
 
     debug_return;
 }
 
+void
+iolog_set_mode(mode_t mode)
+{
+    iolog_ctx_set_mode(&iolog_default_ctx, mode);
+}
+
 /*
- * Set iolog_compress
+ * Set whether new I/O log files are compressed.
  */
 void
-iolog_set_compress(bool newval)
+iolog_ctx_set_compress(struct iolog_ctx *ctx, bool newval)
 {
-    debug_decl(iolog_set_compress, SUDO_DEBUG_UTIL);
-    iolog_compress = newval;
+    debug_decl(iolog_ctx_set_compress, SUDO_DEBUG_UTIL);
+    ctx->compress = newval;
     debug_return;
 }
 
+void
+iolog_set_compress(bool newval)
+{
+    iolog_ctx_set_compress(&iolog_default_ctx, newval);
+}
+
 /*
- * Set iolog_flush
+ * Set whether I/O log files are flushed after each write.
  */
 void
-iolog_set_flush(bool newval)
+iolog_ctx_set_flush(struct iolog_ctx *ctx, bool newval)
 {
-    debug_decl(iolog_set_flush, SUDO_DEBUG_UTIL);
-    iolog_flush = newval;
+    debug_decl(iolog_ctx_set_flush, SUDO_DEBUG_UTIL);
+    ctx->flush = newval;
     debug_return;
 }
 
+void
+iolog_set_flush(bool newval)
+{
+    iolog_ctx_set_flush(&iolog_default_ctx, newval);
+}
+
 /*
- * Getters.
+ * Getters for the default context.
  */
 
 unsigned int
 iolog_get_maxseq(void)
 {
-    return sessid_max;
+    return iolog_default_ctx.sessid_max;
 }
 
 uid_t
 iolog_get_uid(void)
 {
-    return iolog_uid;
+    return iolog_default_ctx.uid;
 }
 
 gid_t
 iolog_get_gid(void)
 {
-    return iolog_gid;
+    return iolog_default_ctx.gid;
 }
 
 mode_t
 iolog_get_file_mode(void)
 {
-    return iolog_filemode;
+    return iolog_default_ctx.filemode;
 }
 
 mode_t
 iolog_get_dir_mode(void)
 {
-    return iolog_dirmode;
+    return iolog_default_ctx.dirmode;
 }
 
 bool
 iolog_get_compress(void)
 {
-    return iolog_compress;
+    return iolog_default_ctx.compress;
 }
 
 bool
 iolog_get_flush(void)
 {
-    return iolog_flush;
+    return iolog_default_ctx.flush;
 }
@@ -0,0 +1,95 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IOLOG_CTX_H
+#define IOLOG_CTX_H
+
+/*
+ * Explicit I/O log settings and timing file parser state.
+ *
+ * The iolog_set_*() and iolog_get_*() functions, and the functions that
+ * depend on them, operate on iolog_default_ctx.  Each has an iolog_ctx_*()
+ * counterpart that takes its settings from the caller instead, so that
+ * sessions with different settings may be handled in parallel.  A context
+ * is only read once it has been set up and may be shared freely.
+ *
+ * The timing file parser remembers whether a log was written by sudo
+ * 1.8.7, which used the wrong event number for terminal output.  This
+ * is per-log state; each reader should use its own iolog_timing_parser.
+ */
+
+struct iolog_ctx {
+    unsigned int sessid_max;	/* maximum sequence number */
+    mode_t filemode;		/* mode of I/O log files */
+    mode_t dirmode;		/* mode of I/O log directories */
+    uid_t uid;			/* I/O log owner */
+    gid_t gid;			/* I/O log group */
+    bool gid_set;		/* gid set explicitly, not from owner */
+    bool compress;		/* gzip new I/O log files */
+    bool flush;			/* flush after each write */
+};
+
+struct iolog_timing_parser {
+    int event_adj;		/* subtracted from each event number */
+};
+
+#define IOLOG_TIMING_PARSER_INITIALIZER { 0 }
+
+extern struct iolog_ctx iolog_default_ctx;
+
+/* iolog_conf.c */
+void iolog_ctx_init(struct iolog_ctx *ctx);
+void iolog_ctx_set_maxseq(struct iolog_ctx *ctx, unsigned int newval);
+void iolog_ctx_set_owner(struct iolog_ctx *ctx, uid_t uid, gid_t gid);
+void iolog_ctx_set_gid(struct iolog_ctx *ctx, gid_t gid);
+void iolog_ctx_set_mode(struct iolog_ctx *ctx, mode_t mode);
+void iolog_ctx_set_compress(struct iolog_ctx *ctx, bool newval);
+void iolog_ctx_set_flush(struct iolog_ctx *ctx, bool newval);
+
+/* iolog_loginfo.c */
+bool iolog_ctx_write_info_file(const struct iolog_ctx *ctx, int dfd, struct eventlog *evlog);
+
+/* iolog_mkdirs.c */
+bool iolog_ctx_mkdirs(const struct iolog_ctx *ctx, char *path);
+
+/* iolog_mkdtemp.c */
+bool iolog_ctx_mkdtemp(const struct iolog_ctx *ctx, char *path);
+
+/* iolog_mkpath.c */
+bool iolog_ctx_mkpath(const struct iolog_ctx *ctx, char *path);
+
+/* iolog_nextid.c */
+bool iolog_ctx_nextid(const struct iolog_ctx *ctx, char *iolog_dir, char sessid[7]);
+
+/* iolog_open.c */
+bool iolog_ctx_open(const struct iolog_ctx *ctx, struct iolog_file *iol, int dfd, int iofd, const char *mode);
+
+/* iolog_openat.c */
+int iolog_ctx_openat(const struct iolog_ctx *ctx, int dfd, const char *path, int flags);
+
+/* iolog_swapids.c */
+bool iolog_ctx_swapids(const struct iolog_ctx *ctx, bool restore);
+
+/* iolog_timing.c */
+bool iolog_parse_timing_r(struct iolog_timing_parser *parser, const char *line, struct timing_closure *timing);
+int iolog_read_timing_record_r(struct iolog_timing_parser *parser, struct iolog_file *iol, struct timing_closure *timing);
+
+/* iolog_write.c */
+ssize_t iolog_ctx_write(const struct iolog_ctx *ctx, struct iolog_file *iol, const void *buf, size_t len, const char **errstr);
+
+#endif /* IOLOG_CTX_H */
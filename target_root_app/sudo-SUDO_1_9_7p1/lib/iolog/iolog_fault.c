@@ -0,0 +1,542 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * This is an open source non-commercial project. Dear PVS-Studio, please check it.
+ * PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_iolog.h"
+#include "sudo_util.h"
+#include "iolog_fault.h"
+
+#define FAULT_MAX_EFFECTS	8
+#define FAULT_PROB_SCALE	1000000U	/* probabilities in millionths */
+#define FAULT_DEFAULT_SEED	0x5eed5eed5eed5eedULL
+
+enum fault_kind {
+    FAULT_DELAY,
+    FAULT_SHORT,
+    FAULT_ERROR
+};
+
+/*
+ * Latency distribution; all times are in nanoseconds.
+ * A fixed delay has lo == hi, a uniform one picks from [lo, hi].
+ * The percentile form interpolates linearly between the median,
+ * the 99th percentile and the maximum.
+ */
+struct fault_dist {
+    bool percentiles;
+    unsigned long long lo;	/* minimum or p50 */
+    unsigned long long mid;	/* p99 */
+    unsigned long long hi;	/* maximum */
+};
+
+struct fault_effect {
+    enum fault_kind kind;
+    unsigned int prob;		/* in millionths */
+    int errnum;
+    struct fault_dist dist;
+};
+
+struct fault_rules {
+    unsigned int neffects;
+    struct fault_effect effects[FAULT_MAX_EFFECTS];
+};
+
+struct fault_stats {
+    unsigned long long calls;
+    unsigned long long delayed;
+    unsigned long long delay_total;	/* nanoseconds */
+    unsigned long long delay_max;	/* nanoseconds */
+    unsigned long long shortened;
+    unsigned long long errors;
+};
+
+static const char *point_names[IOLOG_FAULT_NPOINTS] = {
+    "write", "flush", "close", "relay_send", "relay_recv"
+};
+
+static const struct fault_errno {
+    const char *name;
+    int errnum;
+} fault_errnos[] = {
+    { "EIO", EIO },
+    { "ENOSPC", ENOSPC },
+#ifdef EDQUOT
+    { "EDQUOT", EDQUOT },
+#endif
+    { "EROFS", EROFS },
+    { "EAGAIN", EAGAIN },
+    { "ECONNRESET", ECONNRESET },
+    { "EPIPE", EPIPE },
+    { "ETIMEDOUT", ETIMEDOUT },
+    { NULL, 0 }
+};
+
+#ifdef FAULT_INJECTION
+bool iolog_fault_enabled;
+#endif
+static struct fault_rules fault_rules[IOLOG_FAULT_NPOINTS];
+static struct fault_stats fault_stats[IOLOG_FAULT_NPOINTS];
+static unsigned long long fault_seed = FAULT_DEFAULT_SEED;
+
+/*
+ * Splitmix64 pseudo-random generator.  Not cryptographically secure
+ * but fast and, given the same seed, reproducible across platforms.
+ */
+static unsigned long long
+fault_random(void)
+{
+    unsigned long long z;
+
+    z = (fault_seed += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * Return a random number in the range [0, bound).
+ */
+static unsigned long long
+fault_uniform(unsigned long long bound)
+{
+    if (bound == 0)
+	return 0;
+    return fault_random() % bound;
+}
+
+/*
+ * Pick a random value in [lo, hi] where frac is the offset into
+ * the range in millionths.
+ */
+static unsigned long long
+fault_interp(unsigned long long lo, unsigned long long hi, unsigned int frac)
+{
+    if (hi <= lo)
+	return lo;
+    return lo + (hi - lo) / FAULT_PROB_SCALE * frac +
+	(hi - lo) % FAULT_PROB_SCALE * frac / FAULT_PROB_SCALE;
+}
+
+/*
+ * Sample a delay from the distribution.
+ * The percentile form is a piecewise-linear inverse CDF through
+ * (0, 0), (0.5, p50), (0.99, p99) and (1, max).
+ */
+static unsigned long long
+fault_sample(const struct fault_dist *dist)
+{
+    unsigned int u;
+
+    if (!dist->percentiles) {
+	if (dist->hi <= dist->lo)
+	    return dist->lo;
+	return dist->lo + fault_uniform(dist->hi - dist->lo + 1);
+    }
+
+    u = (unsigned int)fault_uniform(FAULT_PROB_SCALE);
+    if (u < FAULT_PROB_SCALE / 2) {
+	return fault_interp(0, dist->lo, u * 2);
+    }
+    if (u < FAULT_PROB_SCALE / 100 * 99) {
+	return fault_interp(dist->lo, dist->mid,
+	    (u - FAULT_PROB_SCALE / 2) / 49 * 100);
+    }
+    return fault_interp(dist->mid, dist->hi,
+	(u - FAULT_PROB_SCALE / 100 * 99) * 100);
+}
+
+/*
+ * Parse a time value with an optional ns, us, ms or s suffix.
+ * The default unit is milliseconds.
+ */
+static bool
+fault_parse_time(const char *str, size_t len, unsigned long long *nsec)
+{
+    unsigned long long val = 0, mult = 1000000ULL;
+    size_t i;
+    debug_decl(fault_parse_time, SUDO_DEBUG_UTIL);
+
+    for (i = 0; i < len && str[i] >= '0' && str[i] <= '9'; i++) {
+	if (val > (0xffffffffffffffffULL - 9) / 10)
+	    debug_return_bool(false);
+	val = val * 10 + (unsigned long long)(str[i] - '0');
+    }
+    if (i == 0)
+	debug_return_bool(false);
+
+    str += i;
+    len -= i;
+    if (len == 2 && strncmp(str, "ns", 2) == 0) {
+	mult = 1;
+    } else if (len == 2 && strncmp(str, "us", 2) == 0) {
+	mult = 1000ULL;
+    } else if (len == 2 && strncmp(str, "ms", 2) == 0) {
+	mult = 1000000ULL;
+    } else if (len == 1 && *str == 's') {
+	mult = 1000000000ULL;
+    } else if (len != 0) {
+	debug_return_bool(false);
+    }
+
+    /* Limit delays to one hour. */
+    if (val > 3600000000000ULL / mult)
+	debug_return_bool(false);
+    *nsec = val * mult;
+    debug_return_bool(true);
+}
+
+/*
+ * Parse a delay distribution: T, T-T or T/T/T.
+ */
+static bool
+fault_parse_dist(const char *str, size_t len, struct fault_dist *dist)
+{
+    const char *sep;
+    debug_decl(fault_parse_dist, SUDO_DEBUG_UTIL);
+
+    memset(dist, 0, sizeof(*dist));
+    if ((sep = memchr(str, '/', len)) != NULL) {
+	const char *sep2;
+	const size_t rem = len - (size_t)(sep + 1 - str);
+
+	sep2 = memchr(sep + 1, '/', rem);
+	if (sep2 == NULL)
+	    debug_return_bool(false);
+	dist->percentiles = true;
+	if (!fault_parse_time(str, (size_t)(sep - str), &dist->lo))
+	    debug_return_bool(false);
+	if (!fault_parse_time(sep + 1, (size_t)(sep2 - sep - 1), &dist->mid))
+	    debug_return_bool(false);
+	if (!fault_parse_time(sep2 + 1, len - (size_t)(sep2 + 1 - str),
+		&dist->hi))
+	    debug_return_bool(false);
+	if (dist->mid < dist->lo || dist->hi < dist->mid)
+	    debug_return_bool(false);
+    } else if ((sep = memchr(str, '-', len)) != NULL) {
+	if (!fault_parse_time(str, (size_t)(sep - str), &dist->lo))
+	    debug_return_bool(false);
+	if (!fault_parse_time(sep + 1, len - (size_t)(sep + 1 - str),
+		&dist->hi))
+	    debug_return_bool(false);
+	if (dist->hi < dist->lo)
+	    debug_return_bool(false);
+    } else {
+	if (!fault_parse_time(str, len, &dist->lo))
+	    debug_return_bool(false);
+	dist->hi = dist->lo;
+    }
+    debug_return_bool(true);
+}
+
+/*
+ * Parse a probability such as "5%" or "0.25%" into millionths.
+ */
+static bool
+fault_parse_prob(const char *str, size_t len, unsigned int *prob)
+{
+    unsigned int whole = 0, frac = 0, scale = FAULT_PROB_SCALE / 100;
+    size_t i = 0;
+    debug_decl(fault_parse_prob, SUDO_DEBUG_UTIL);
+
+    if (len < 2 || str[len - 1] != '%')
+	debug_return_bool(false);
+    len--;
+
+    while (i < len && str[i] >= '0' && str[i] <= '9') {
+	whole = whole * 10 + (unsigned int)(str[i++] - '0');
+	if (whole > 100)
+	    debug_return_bool(false);
+    }
+    if (i == 0)
+	debug_return_bool(false);
+    if (i < len && str[i] == '.') {
+	for (i++; i < len && str[i] >= '0' && str[i] <= '9'; i++) {
+	    scale /= 10;
+	    frac += (unsigned int)(str[i] - '0') * scale;
+	}
+    }
+    if (i != len)
+	debug_return_bool(false);
+
+    *prob = whole * (FAULT_PROB_SCALE / 100) + frac;
+    if (*prob > FAULT_PROB_SCALE)
+	debug_return_bool(false);
+    debug_return_bool(true);
+}
+
+/*
+ * Parse a single effect and append it to rules.
+ */
+static bool
+fault_parse_effect(const char *str, size_t len, struct fault_rules *rules)
+{
+    struct fault_effect *effect;
+    const char *at, *eq;
+    size_t namelen;
+    debug_decl(fault_parse_effect, SUDO_DEBUG_UTIL);
+
+    if (rules->neffects == FAULT_MAX_EFFECTS) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "too many fault effects, max %d", FAULT_MAX_EFFECTS);
+	debug_return_bool(false);
+    }
+    effect = &rules->effects[rules->neffects];
+    memset(effect, 0, sizeof(*effect));
+    effect->prob = FAULT_PROB_SCALE;
+
+    /* Optional probability suffix. */
+    if ((at = memchr(str, '@', len)) != NULL) {
+	if (!fault_parse_prob(at + 1, len - (size_t)(at + 1 - str),
+		&effect->prob))
+	    debug_return_bool(false);
+	len = (size_t)(at - str);
+    }
+
+    eq = memchr(str, '=', len);
+    namelen = eq ? (size_t)(eq - str) : len;
+    if (namelen == 5 && strncmp(str, "delay", 5) == 0) {
+	effect->kind = FAULT_DELAY;
+	if (eq == NULL)
+	    debug_return_bool(false);
+	if (!fault_parse_dist(eq + 1, len - namelen - 1, &effect->dist))
+	    debug_return_bool(false);
+    } else if (namelen == 5 && strncmp(str, "short", 5) == 0) {
+	effect->kind = FAULT_SHORT;
+	if (eq != NULL)
+	    debug_return_bool(false);
+    } else if (namelen == 5 && strncmp(str, "error", 5) == 0) {
+	effect->kind = FAULT_ERROR;
+	effect->errnum = EIO;
+	if (eq != NULL) {
+	    const struct fault_errno *fe;
+	    const size_t elen = len - namelen - 1;
+
+	    for (fe = fault_errnos; fe->name != NULL; fe++) {
+		if (strlen(fe->name) == elen &&
+			strncmp(fe->name, eq + 1, elen) == 0)
+		    break;
+	    }
+	    if (fe->name == NULL)
+		debug_return_bool(false);
+	    effect->errnum = fe->errnum;
+	}
+    } else {
+	debug_return_bool(false);
+    }
+
+    rules->neffects++;
+    debug_return_bool(true);
+}
+
+/*
+ * Parse a fault specification of the form "point:effect[,effect...]"
+ * or "seed=N".  Effects are:
+ *   delay=DIST[@P%]	add latency drawn from DIST
+ *   short[@P%]		transfer a random fraction of the data
+ *   error[=ENAME][@P%]	fail with errno ENAME (default EIO)
+ * May be called more than once, effects are appended.
+ */
+bool
+iolog_fault_parse(const char *spec)
+{
+    struct fault_rules *rules, tmp;
+    const char *cp, *ep;
+    int point;
+    debug_decl(iolog_fault_parse, SUDO_DEBUG_UTIL);
+
+#ifndef FAULT_INJECTION
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	"fault injection support not enabled");
+    debug_return_bool(false);
+#endif
+
+    if (strncmp(spec, "seed=", 5) == 0) {
+	const char *errstr;
+	long long seed;
+
+	seed = sudo_strtonum(spec + 5, 0, LLONG_MAX, &errstr);
+	if (errstr != NULL)
+	    debug_return_bool(false);
+	fault_seed = (unsigned long long)seed;
+	debug_return_bool(true);
+    }
+
+    if ((cp = strchr(spec, ':')) == NULL || cp[1] == '\0')
+	debug_return_bool(false);
+    for (point = 0; point < IOLOG_FAULT_NPOINTS; point++) {
+	if (strlen(point_names[point]) == (size_t)(cp - spec) &&
+		strncmp(point_names[point], spec, (size_t)(cp - spec)) == 0)
+	    break;
+    }
+    if (point == IOLOG_FAULT_NPOINTS)
+	debug_return_bool(false);
+
+    /* Parse into a copy so a bad spec leaves the rules unchanged. */
+    rules = &fault_rules[point];
+    tmp = *rules;
+    for (cp++; *cp != '\0'; cp = *ep ? ep + 1 : ep) {
+	if ((ep = strchr(cp, ',')) == NULL)
+	    ep = cp + strlen(cp);
+	if (!fault_parse_effect(cp, (size_t)(ep - cp), &tmp)) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"invalid fault effect in %s", spec);
+	    debug_return_bool(false);
+	}
+    }
+    *rules = tmp;
+#ifdef FAULT_INJECTION
+    iolog_fault_enabled = true;
+#endif
+
+    debug_return_bool(true);
+}
+
+/*
+ * Decide which faults, if any, apply to an operation of len bytes
+ * at the specified point.  Each effect fires independently with its
+ * own probability; delays accumulate.  Does not sleep.
+ */
+void
+iolog_fault_check(enum iolog_fault_point point, size_t len,
+    struct iolog_fault *fault)
+{
+    struct fault_rules *rules = &fault_rules[point];
+    struct fault_stats *stats = &fault_stats[point];
+    unsigned long long delay = 0;
+    unsigned int i;
+    debug_decl(iolog_fault_check, SUDO_DEBUG_UTIL);
+
+    fault->len = len;
+    fault->errnum = 0;
+    stats->calls++;
+
+    for (i = 0; i < rules->neffects; i++) {
+	struct fault_effect *effect = &rules->effects[i];
+
+	if (effect->prob < FAULT_PROB_SCALE &&
+		fault_uniform(FAULT_PROB_SCALE) >= effect->prob)
+	    continue;
+	switch (effect->kind) {
+	case FAULT_DELAY:
+	    delay += fault_sample(&effect->dist);
+	    break;
+	case FAULT_SHORT:
+	    if (fault->len > 1)
+		fault->len = 1 + (size_t)fault_uniform(fault->len - 1);
+	    break;
+	case FAULT_ERROR:
+	    fault->errnum = effect->errnum;
+	    break;
+	}
+    }
+
+    if (delay != 0) {
+	stats->delayed++;
+	stats->delay_total += delay;
+	if (delay > stats->delay_max)
+	    stats->delay_max = delay;
+    }
+    if (fault->errnum != 0)
+	stats->errors++;
+    else if (fault->len != len)
+	stats->shortened++;
+
+    fault->delay.tv_sec = (time_t)(delay / 1000000000ULL);
+    fault->delay.tv_nsec = (long)(delay % 1000000000ULL);
+
+    debug_return;
+}
+
+/*
+ * Apply faults at the specified point synchronously: sleep for any
+ * injected delay, shorten *lenp if it is non-NULL and return -1 with
+ * errno set for an injected error.  Returns 0 otherwise.
+ */
+int
+iolog_fault_inject(enum iolog_fault_point point, size_t *lenp)
+{
+    struct iolog_fault fault;
+    debug_decl(iolog_fault_inject, SUDO_DEBUG_UTIL);
+
+    iolog_fault_check(point, lenp ? *lenp : 0, &fault);
+    if (sudo_timespecisset(&fault.delay)) {
+	while (nanosleep(&fault.delay, &fault.delay) == -1) {
+	    if (errno != EINTR)
+		break;
+	}
+    }
+    if (fault.errnum != 0) {
+	sudo_debug_printf(SUDO_DEBUG_INFO,
+	    "injecting %s fault: %s", point_names[point],
+	    strerror(fault.errnum));
+	errno = fault.errnum;
+	debug_return_int(-1);
+    }
+    if (lenp != NULL)
+	*lenp = fault.len;
+    debug_return_int(0);
+}
+
+/*
+ * Log fault injection statistics.
+ */
+void
+iolog_fault_dump(void)
+{
+    int point;
+    debug_decl(iolog_fault_dump, SUDO_DEBUG_UTIL);
+
+    if (!iolog_fault_enabled)
+	debug_return;
+
+    for (point = 0; point < IOLOG_FAULT_NPOINTS; point++) {
+	struct fault_stats *stats = &fault_stats[point];
+
+	if (fault_rules[point].neffects == 0)
+	    continue;
+	sudo_debug_printf(SUDO_DEBUG_INFO,
+	    "fault %s: %llu calls, %llu delayed (%llu ms total, %llu us max), "
+	    "%llu short, %llu errors", point_names[point], stats->calls,
+	    stats->delayed, stats->delay_total / 1000000ULL,
+	    stats->delay_max / 1000ULL, stats->shortened, stats->errors);
+    }
+
+    debug_return;
+}
@@ -0,0 +1,61 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IOLOG_FAULT_H
+#define IOLOG_FAULT_H
+
+/*
+ * Fault injection for performance testing.
+ *
+ * Rules are attached to points in the I/O paths and can add latency,
+ * shorten a transfer or make it fail.  Decisions come from a seeded
+ * pseudo-random generator so a test run can be repeated exactly.
+ * Nothing is injected unless a rule has been added, and rules may
+ * only be added if sudo was configured with --enable-fault-injection.
+ */
+
+enum iolog_fault_point {
+    IOLOG_FAULT_WRITE,		/* I/O log and journal writes */
+    IOLOG_FAULT_FLUSH,		/* flushing and syncing to disk */
+    IOLOG_FAULT_CLOSE,		/* closing I/O log files */
+    IOLOG_FAULT_RELAY_SEND,	/* sending to a relay */
+    IOLOG_FAULT_RELAY_RECV,	/* receiving from a relay */
+    IOLOG_FAULT_NPOINTS
+};
+
+/* The outcome of a fault check. */
+struct iolog_fault {
+    struct timespec delay;	/* latency to add */
+    size_t len;			/* bytes to transfer, may be shortened */
+    int errnum;			/* error to fail with, or 0 */
+};
+
+#ifdef FAULT_INJECTION
+extern bool iolog_fault_enabled;
+#else
+/* The fault checks compile away unless configured with fault injection. */
+# define iolog_fault_enabled	false
+#endif
+
+/* iolog_fault.c */
+bool iolog_fault_parse(const char *spec);
+void iolog_fault_check(enum iolog_fault_point point, size_t len, struct iolog_fault *fault);
+int iolog_fault_inject(enum iolog_fault_point point, size_t *lenp);
+void iolog_fault_dump(void);
+
+#endif /* IOLOG_FAULT_H */
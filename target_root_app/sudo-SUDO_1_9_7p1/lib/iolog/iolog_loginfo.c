@@ -42,6 +42,7 @@
 #include "sudo_json.h"
 #include "sudo_iolog.h"
 #include "sudo_util.h"
+#include "iolog_ctx.h"
 
 struct eventlog *
 iolog_parse_loginfo(int dfd, const char *iolog_dir)
@@ -100,14 +101,15 @@ bad:
  * This file is not compressed.
  */
 static bool
-iolog_write_info_file_legacy(int dfd, struct eventlog *evlog)
+iolog_write_info_file_legacy(const struct iolog_ctx *ctx, int dfd,
+    struct eventlog *evlog)
 {
     char * const *av;
     FILE *fp;
     int error, fd;
     debug_decl(iolog_info_write_log, SUDO_DEBUG_UTIL);
 
-    fd = iolog_openat(dfd, "log", O_CREAT|O_TRUNC|O_WRONLY);
+    fd = iolog_ctx_openat(ctx, dfd, "log", O_CREAT|O_TRUNC|O_WRONLY);
     if (fd == -1 || (fp = fdopen(fd, "w")) == NULL) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
 	    "unable to open %s/log", evlog->iolog_path);
@@ -115,10 +117,10 @@ iolog_write_info_file_legacy(int dfd, struct eventlog *evlog)
 	    close(fd);
 	debug_return_bool(false);
     }
-    if (fchown(fd, iolog_get_uid(), iolog_get_gid()) != 0) {
+    if (fchown(fd, ctx->uid, ctx->gid) != 0) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
 	    "%s: unable to fchown %d:%d %s/log", __func__,
-	    (int)iolog_get_uid(), (int)iolog_get_gid(), evlog->iolog_path);
+	    (int)ctx->uid, (int)ctx->gid, evlog->iolog_path);
     }
 
     fprintf(fp, "%lld:%s:%s:%s:%s:%d:%d\n%s\n",
@@ -150,7 +152,8 @@ iolog_write_info_file_legacy(int dfd, struct eventlog *evlog)
  * This file is not compressed.
  */
 static bool
-iolog_write_info_file_json(int dfd, struct eventlog *evlog)
+iolog_write_info_file_json(const struct iolog_ctx *ctx, int dfd,
+    struct eventlog *evlog)
 {
     struct json_container json;
     struct json_value json_value;
@@ -182,16 +185,16 @@ iolog_write_info_file_json(int dfd, struct eventlog *evlog)
     if (!eventlog_store_json(&json, evlog))
 	goto done;
 
-    fd = iolog_openat(dfd, "log.json", O_CREAT|O_TRUNC|O_WRONLY);
+    fd = iolog_ctx_openat(ctx, dfd, "log.json", O_CREAT|O_TRUNC|O_WRONLY);
     if (fd == -1 || (fp = fdopen(fd, "w")) == NULL) {
         sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
             "unable to open %s/log.json", evlog->iolog_path);
         goto done;
     }
-    if (fchown(fd, iolog_get_uid(), iolog_get_gid()) != 0) {
+    if (fchown(fd, ctx->uid, ctx->gid) != 0) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
 	    "%s: unable to fchown %d:%d %s/log.json", __func__,
-	    (int)iolog_get_uid(), (int)iolog_get_gid(), evlog->iolog_path);
+	    (int)ctx->uid, (int)ctx->gid, evlog->iolog_path);
     }
     fd = -1;
 
@@ -223,14 +226,21 @@ done:
  * These files are not compressed.
  */
 bool
-iolog_write_info_file(int dfd, struct eventlog *evlog)
+iolog_ctx_write_info_file(const struct iolog_ctx *ctx, int dfd,
+    struct eventlog *evlog)
 {
-    debug_decl(iolog_write_info_file, SUDO_DEBUG_UTIL);
+    debug_decl(iolog_ctx_write_info_file, SUDO_DEBUG_UTIL);
 
-    if (!iolog_write_info_file_legacy(dfd, evlog))
+    if (!iolog_write_info_file_legacy(ctx, dfd, evlog))
 	debug_return_bool(false);
-    if (!iolog_write_info_file_json(dfd, evlog))
+    if (!iolog_write_info_file_json(ctx, dfd, evlog))
 	debug_return_bool(false);
 
     debug_return_bool(true);
 }
+
+bool
+iolog_write_info_file(int dfd, struct eventlog *evlog)
+{
+    return iolog_ctx_write_info_file(&iolog_default_ctx, dfd, evlog);
+}
@@ -41,29 +41,33 @@
 #include "sudo_gettext.h"
 #include "sudo_iolog.h"
 #include "sudo_util.h"
+#include "iolog_ctx.h"
+#include "iolog_privsep.h"
 
 /*
  * Create directory and any parent directories as needed.
  */
 bool
-iolog_mkdirs(char *path)
+iolog_ctx_mkdirs(const struct iolog_ctx *ctx, char *path)
 {
-    const mode_t iolog_filemode = iolog_get_file_mode();
-    const mode_t iolog_dirmode = iolog_get_dir_mode();
-    const uid_t iolog_uid = iolog_get_uid();
-    const gid_t iolog_gid = iolog_get_gid();
-    bool ok = true, uid_changed = false;
+    const mode_t iolog_filemode = ctx->filemode;
+    const mode_t iolog_dirmode = ctx->dirmode;
+    const uid_t iolog_uid = ctx->uid;
+    const gid_t iolog_gid = ctx->gid;
+    bool ok = true, uid_changed = false, privsep = false;
     struct stat sb;
     mode_t omask;
     int dfd;
-    debug_decl(iolog_mkdirs, SUDO_DEBUG_UTIL);
+    debug_decl(iolog_ctx_mkdirs, SUDO_DEBUG_UTIL);
 
     dfd = open(path, O_RDONLY|O_NONBLOCK);
     if (dfd == -1 && errno == EACCES) {
 	/* Try again as the I/O log owner (for NFS). */
-	if (iolog_swapids(false)) {
+	if (iolog_privsep_running(iolog_uid, iolog_gid)) {
+	    dfd = iolog_privsep_openat(AT_FDCWD, path, O_RDONLY|O_NONBLOCK, 0);
+	} else if (iolog_ctx_swapids(ctx, false)) {
 	    dfd = open(path, O_RDONLY|O_NONBLOCK);
-	    if (!iolog_swapids(true)) {
+	    if (!iolog_ctx_swapids(ctx, true)) {
 		ok = false;
 		goto done;
 	    }
@@ -93,31 +97,50 @@ iolog_mkdirs(char *path)
 	goto done;
     }
 
-    /* umask must not be more restrictive than the file modes. */
+    /*
+     * umask must not be more restrictive than the file modes.
+     * The umask is process-wide but sudo_mkdir_parents() has no other
+     * way to set the mode of parent directories.  Directories are only
+     * created once per session so this is rarely reached.
+     */
     omask = umask(ACCESSPERMS & ~(iolog_filemode|iolog_dirmode));
 
     ok = sudo_mkdir_parents(path, iolog_uid, iolog_gid, iolog_dirmode, true);
     if (!ok && errno == EACCES) {
 	/* Try again as the I/O log owner (for NFS). */
-	uid_changed = iolog_swapids(false);
-	if (uid_changed)
-	    ok = sudo_mkdir_parents(path, -1, -1, iolog_dirmode, false);
+	if (iolog_privsep_running(iolog_uid, iolog_gid)) {
+	    privsep = true;
+	    ok = iolog_privsep_mkdir(path, iolog_dirmode, true);
+	} else {
+	    uid_changed = iolog_ctx_swapids(ctx, false);
+	    if (uid_changed)
+		ok = sudo_mkdir_parents(path, -1, -1, iolog_dirmode, false);
+	}
     }
     if (ok) {
 	/* Create final path component. */
 	sudo_debug_printf(SUDO_DEBUG_DEBUG|SUDO_DEBUG_LINENO,
 	    "mkdir %s, mode 0%o", path, (unsigned int) iolog_dirmode);
-	ok = mkdir(path, iolog_dirmode) == 0 || errno == EEXIST;
+	if (privsep)
+	    ok = iolog_privsep_mkdir(path, iolog_dirmode, false);
+	else
+	    ok = mkdir(path, iolog_dirmode) == 0 || errno == EEXIST;
 	if (!ok) {
-	    if (errno == EACCES && !uid_changed) {
+	    if (errno == EACCES && !uid_changed && !privsep) {
 		/* Try again as the I/O log owner (for NFS). */
-		uid_changed = iolog_swapids(false);
-		if (uid_changed)
-		    ok = mkdir(path, iolog_dirmode) == 0 || errno == EEXIST;
+		if (iolog_privsep_running(iolog_uid, iolog_gid)) {
+		    ok = iolog_privsep_mkdir(path, iolog_dirmode, false);
+		} else {
+		    uid_changed = iolog_ctx_swapids(ctx, false);
+		    if (uid_changed) {
+			ok = mkdir(path, iolog_dirmode) == 0 ||
+			    errno == EEXIST;
+		    }
+		}
 	    }
 	    if (!ok)
 		sudo_warn(U_("unable to mkdir %s"), path);
-	} else {
+	} else if (!privsep) {
 	    if (chown(path, iolog_uid, iolog_gid) != 0) {
 		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
 		    "%s: unable to chown %d:%d %s", __func__,
@@ -126,7 +149,7 @@ iolog_mkdirs(char *path)
 	}
     }
     if (uid_changed) {
-	if (!iolog_swapids(true))
+	if (!iolog_ctx_swapids(ctx, true))
 	    ok = false;
     }
 
@@ -137,3 +160,9 @@ done:
 	close(dfd);
     debug_return_bool(ok);
 }
+
+bool
+iolog_mkdirs(char *path)
+{
+    return iolog_ctx_mkdirs(&iolog_default_ctx, path);
+}
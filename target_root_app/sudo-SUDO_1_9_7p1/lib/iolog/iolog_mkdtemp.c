@@ -41,33 +41,46 @@
 #include "sudo_gettext.h"
 #include "sudo_util.h"
 #include "sudo_iolog.h"
+#include "iolog_ctx.h"
+#include "iolog_privsep.h"
 
 /*
  * Create temporary directory and any parent directories as needed.
  */
 bool
-iolog_mkdtemp(char *path)
+iolog_ctx_mkdtemp(const struct iolog_ctx *ctx, char *path)
 {
-    const mode_t iolog_dirmode = iolog_get_dir_mode();
-    const uid_t iolog_uid = iolog_get_uid();
-    const gid_t iolog_gid = iolog_get_gid();
+    const mode_t iolog_dirmode = ctx->dirmode;
+    const uid_t iolog_uid = ctx->uid;
+    const gid_t iolog_gid = ctx->gid;
     bool ok, uid_changed = false;
-    debug_decl(iolog_mkdtemp, SUDO_DEBUG_UTIL);
+    debug_decl(iolog_ctx_mkdtemp, SUDO_DEBUG_UTIL);
 
     ok = sudo_mkdir_parents(path, iolog_uid, iolog_gid, iolog_dirmode, true);
     if (!ok && errno == EACCES) {
 	/* Try again as the I/O log owner (for NFS). */
-	uid_changed = iolog_swapids(false);
-	if (uid_changed)
-	    ok = sudo_mkdir_parents(path, -1, -1, iolog_dirmode, false);
+	if (iolog_privsep_running(iolog_uid, iolog_gid)) {
+	    ok = iolog_privsep_mkdir(path, iolog_dirmode, true);
+	} else {
+	    uid_changed = iolog_ctx_swapids(ctx, false);
+	    if (uid_changed)
+		ok = sudo_mkdir_parents(path, -1, -1, iolog_dirmode, false);
+	}
     }
-    if (ok) {
+    if (ok && iolog_privsep_running(iolog_uid, iolog_gid)) {
+	/* Create final path component as the I/O log owner. */
+	sudo_debug_printf(SUDO_DEBUG_DEBUG|SUDO_DEBUG_LINENO,
+	    "mkdtemp %s (privsep)", path);
+	ok = iolog_privsep_mkdtemp(path, iolog_dirmode);
+	if (!ok)
+	    sudo_warn(U_("unable to mkdir %s"), path);
+    } else if (ok) {
 	/* Create final path component. */
 	sudo_debug_printf(SUDO_DEBUG_DEBUG|SUDO_DEBUG_LINENO,
 	    "mkdtemp %s", path);
 	/* We cannot retry mkdtemp() so always open as iolog user */
 	if (!uid_changed)
-	    uid_changed = iolog_swapids(false);
+	    uid_changed = iolog_ctx_swapids(ctx, false);
 	if (mkdtemp(path) == NULL) {
 	    sudo_warn(U_("unable to mkdir %s"), path);
 	    ok = false;
@@ -80,8 +93,14 @@ iolog_mkdtemp(char *path)
     }
 
     if (uid_changed) {
-	if (!iolog_swapids(true))
+	if (!iolog_ctx_swapids(ctx, true))
 	    ok = false;
     }
     debug_return_bool(ok);
 }
+
+bool
+iolog_mkdtemp(char *path)
+{
+    return iolog_ctx_mkdtemp(&iolog_default_ctx, path);
+}
@@ -36,17 +36,18 @@
 #include "sudo_compat.h"
 #include "sudo_debug.h"
 #include "sudo_iolog.h"
+#include "iolog_ctx.h"
 
 /*
  * Create path and any intermediate directories.
  * If path ends in 'XXXXXX', use mkdtemp().
  */
 bool
-iolog_mkpath(char *path)
+iolog_ctx_mkpath(const struct iolog_ctx *ctx, char *path)
 {
     size_t len;
     bool ret;
-    debug_decl(iolog_mkpath, SUDO_DEBUG_UTIL);
+    debug_decl(iolog_ctx_mkpath, SUDO_DEBUG_UTIL);
 
     /*
      * Create path and intermediate subdirs as needed.
@@ -55,11 +56,17 @@ iolog_mkpath(char *path)
      */
     len = strlen(path);
     if (len >= 6 && strcmp(&path[len - 6], "XXXXXX") == 0)
-	ret = iolog_mkdtemp(path);
+	ret = iolog_ctx_mkdtemp(ctx, path);
     else
-	ret = iolog_mkdirs(path);
+	ret = iolog_ctx_mkdirs(ctx, path);
 
     sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO, "iolog path %s", path);
 
     debug_return_bool(ret);
 }
+
+bool
+iolog_mkpath(char *path)
+{
+    return iolog_ctx_mkpath(&iolog_default_ctx, path);
+}
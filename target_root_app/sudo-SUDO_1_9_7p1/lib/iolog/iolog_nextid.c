@@ -42,6 +42,7 @@
 #include "sudo_fatal.h"
 #include "sudo_gettext.h"
 #include "sudo_iolog.h"
+#include "iolog_ctx.h"
 #include "sudo_util.h"
 
 /*
@@ -50,7 +51,7 @@
  * Uses file locking to avoid sequence number collisions.
  */
 bool
-iolog_nextid(char *iolog_dir, char sessid[7])
+iolog_ctx_nextid(const struct iolog_ctx *ctx, char *iolog_dir, char sessid[7])
 {
     char buf[32], *ep;
     int i, len, fd = -1;
@@ -59,14 +60,14 @@ iolog_nextid(char *iolog_dir, char sessid[7])
     bool ret = false;
     char pathbuf[PATH_MAX];
     static const char b36char[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-    const uid_t iolog_uid = iolog_get_uid();
-    const gid_t iolog_gid = iolog_get_gid();
-    debug_decl(iolog_nextid, SUDO_DEBUG_UTIL);
+    const uid_t iolog_uid = ctx->uid;
+    const gid_t iolog_gid = ctx->gid;
+    debug_decl(iolog_ctx_nextid, SUDO_DEBUG_UTIL);
 
     /*
      * Create I/O log directory if it doesn't already exist.
      */
-    if (!iolog_mkdirs(iolog_dir))
+    if (!iolog_ctx_mkdirs(ctx, iolog_dir))
 	goto done;
 
     /*
@@ -79,7 +80,7 @@ iolog_nextid(char *iolog_dir, char sessid[7])
 	    "%s: %s/seq", __func__, iolog_dir);
 	goto done;
     }
-    fd = iolog_openat(AT_FDCWD, pathbuf, O_RDWR|O_CREAT);
+    fd = iolog_ctx_openat(ctx, AT_FDCWD, pathbuf, O_RDWR|O_CREAT);
     if (fd == -1) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
 	    "%s: unable to open %s", __func__, pathbuf);
@@ -106,7 +107,7 @@ iolog_nextid(char *iolog_dir, char sessid[7])
 	    nread--;
 	buf[nread] = '\0';
 	id = strtoul(buf, &ep, 36);
-	if (ep == buf || *ep != '\0' || id >= iolog_get_maxseq()) {
+	if (ep == buf || *ep != '\0' || id >= ctx->sessid_max) {
 	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 		"%s: bad sequence number: %s", pathbuf, buf);
 	    id = 0;
@@ -141,3 +142,9 @@ done:
 	close(fd);
     debug_return_bool(ret);
 }
+
+bool
+iolog_nextid(char *iolog_dir, char sessid[7])
+{
+    return iolog_ctx_nextid(&iolog_default_ctx, iolog_dir, sessid);
+}
@@ -39,6 +39,9 @@
 #include "sudo_debug.h"
 #include "sudo_iolog.h"
 #include "sudo_util.h"
+#include "iolog_chunks.h"
+#include "iolog_ctx.h"
+#include "iolog_zdict.h"
 
 static unsigned char const gzip_magic[2] = {0x1f, 0x8b};
 
@@ -47,14 +50,17 @@ static unsigned char const gzip_magic[2] = {0x1f, 0x8b};
  * Stores the open file handle which has the close-on-exec flag set.
  */
 bool
-iolog_open(struct iolog_file *iol, int dfd, int iofd, const char *mode)
+iolog_ctx_open(const struct iolog_ctx *ctx, struct iolog_file *iol, int dfd,
+    int iofd, const char *mode)
 {
     int flags;
     const char *file;
     unsigned char magic[2];
-    const uid_t iolog_uid = iolog_get_uid();
-    const gid_t iolog_gid = iolog_get_gid();
-    debug_decl(iolog_open, SUDO_DEBUG_UTIL);
+    bool chunked = false, zdict = false;
+    unsigned int dictid = 0;
+    const uid_t iolog_uid = ctx->uid;
+    const gid_t iolog_gid = ctx->gid;
+    debug_decl(iolog_ctx_open, SUDO_DEBUG_UTIL);
 
     if (mode[0] == 'r') {
 	flags = mode[1] == '+' ? O_RDWR : O_RDONLY;
@@ -75,7 +81,7 @@ iolog_open(struct iolog_file *iol, int dfd, int iofd, const char *mode)
     iol->writable = false;
     iol->compressed = false;
     if (iol->enabled) {
-	int fd = iolog_openat(dfd, file, flags);
+	int fd = iolog_ctx_openat(ctx, dfd, file, flags);
 	if (fd != -1) {
 	    if (*mode == 'w') {
 		if (fchown(fd, iolog_uid, iolog_gid) != 0) {
@@ -83,13 +89,19 @@ iolog_open(struct iolog_file *iol, int dfd, int iofd, const char *mode)
 			"%s: unable to fchown %d:%d %s", __func__,
 			(int)iolog_uid, (int)iolog_gid, file);
 		}
-		iol->compressed = iolog_get_compress();
+		iol->compressed = ctx->compress;
 	    } else {
 		/* check for gzip magic number */
 		if (pread(fd, magic, sizeof(magic), 0) == ssizeof(magic)) {
 		    if (magic[0] == gzip_magic[0] && magic[1] == gzip_magic[1])
 			iol->compressed = true;
 		}
+		/* check for deduplicated stream manifest */
+		if (!iol->compressed)
+		    chunked = iolog_chunks_probe(fd);
+		/* check for zlib stream with a preset dictionary */
+		if (!iol->compressed && !chunked)
+		    zdict = iolog_zdict_probe(dfd, fd, &dictid);
 	    }
 	    if (fcntl(fd, F_SETFD, FD_CLOEXEC) != -1) {
 #ifdef HAVE_ZLIB_H
@@ -97,10 +109,16 @@ iolog_open(struct iolog_file *iol, int dfd, int iofd, const char *mode)
 		    iol->fd.g = gzdopen(fd, mode);
 		else
 #endif
+		if (chunked)
+		    iol->fd.f = iolog_chunks_fdopen(dfd, fd);
+		else if (zdict)
+		    iol->fd.f = iolog_zdict_fdopen(dfd, fd, dictid);
+		else
 		    iol->fd.f = fdopen(fd, mode);
 	    }
 	    if (iol->fd.v != NULL) {
-		switch ((flags & O_ACCMODE)) {
+		/* deduplicated and dictionary streams are read-only */
+		switch (chunked || zdict ? O_RDONLY : (flags & O_ACCMODE)) {
 		case O_WRONLY:
 		case O_RDWR:
 		    iol->writable = true;
@@ -125,3 +143,9 @@ iolog_open(struct iolog_file *iol, int dfd, int iofd, const char *mode)
     }
     debug_return_bool(true);
 }
+
+bool
+iolog_open(struct iolog_file *iol, int dfd, int iofd, const char *mode)
+{
+    return iolog_ctx_open(&iolog_default_ctx, iol, dfd, iofd, mode);
+}
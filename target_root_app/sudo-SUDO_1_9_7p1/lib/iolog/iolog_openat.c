@@ -41,25 +41,58 @@
 #include "sudo_gettext.h"
 #include "sudo_iolog.h"
 #include "sudo_util.h"
+#include "iolog_ctx.h"
+#include "iolog_privsep.h"
 
 /*
- * Wrapper for openat(2) that sets umask and retries as iolog_uid/iolog_gid
- * if openat(2) returns EACCES.
+ * Like openat(2) but a newly created file gets exactly the specified mode.
+ * Rather than changing the process-wide umask, the mode of a new file is
+ * set after it has been created, so this is safe to use from multiple
+ * threads.  An existing file keeps its mode.
  */
-int
-iolog_openat(int dfd, const char *path, int flags)
+static int
+openat_mode(int dfd, const char *path, int flags, mode_t mode)
 {
-    const mode_t iolog_filemode = iolog_get_file_mode();
-    const mode_t iolog_dirmode = iolog_get_dir_mode();
-    mode_t omask = S_IRWXG|S_IRWXO;
     int fd;
-    debug_decl(iolog_openat, SUDO_DEBUG_UTIL);
+    debug_decl(openat_mode, SUDO_DEBUG_UTIL);
+
+    if (!ISSET(flags, O_CREAT))
+	debug_return_int(openat(dfd, path, flags));
 
-    if (ISSET(flags, O_CREAT)) {
-	/* umask must not be more restrictive than the file modes. */
-	omask = umask(ACCESSPERMS & ~(iolog_filemode|iolog_dirmode));
+    for (;;) {
+	fd = openat(dfd, path, flags|O_EXCL, mode);
+	if (fd != -1) {
+	    /* The umask may have cleared some of the mode bits. */
+	    if (fchmod(fd, mode) != 0) {
+		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
+		    "%s: unable to chmod 0%o %s", __func__,
+		    (unsigned int)mode, path);
+	    }
+	    break;
+	}
+	if (errno != EEXIST || ISSET(flags, O_EXCL))
+	    break;
+	fd = openat(dfd, path, flags & ~O_CREAT);
+	if (fd != -1 || errno != ENOENT)
+	    break;
+	/* Removed after we checked, try to create it again. */
     }
-    fd = openat(dfd, path, flags, iolog_filemode);
+    debug_return_int(fd);
+}
+
+/*
+ * Wrapper for openat(2) that creates files with the I/O log file mode
+ * and retries as the I/O log owner if openat(2) returns EACCES.
+ */
+int
+iolog_ctx_openat(const struct iolog_ctx *ctx, int dfd, const char *path,
+    int flags)
+{
+    const mode_t iolog_filemode = ctx->filemode;
+    int fd;
+    debug_decl(iolog_ctx_openat, SUDO_DEBUG_UTIL);
+
+    fd = openat_mode(dfd, path, flags, iolog_filemode);
     if (fd == -1 && errno == EACCES) {
 	/* Enable write bit if it is missing. */
 	struct stat sb;
@@ -67,15 +100,17 @@ iolog_openat(int dfd, const char *path, int flags)
 	    mode_t write_bits = iolog_filemode & (S_IWUSR|S_IWGRP|S_IWOTH);
 	    if ((sb.st_mode & write_bits) != write_bits) {
 		if (fchmodat(dfd, path, iolog_filemode, 0) == 0)
-		    fd = openat(dfd, path, flags, iolog_filemode);
+		    fd = openat_mode(dfd, path, flags, iolog_filemode);
 	    }
 	}
     }
     if (fd == -1 && errno == EACCES) {
 	/* Try again as the I/O log owner (for NFS). */
-	if (iolog_swapids(false)) {
-	    fd = openat(dfd, path, flags, iolog_filemode);
-	    if (!iolog_swapids(true)) {
+	if (iolog_privsep_running(ctx->uid, ctx->gid)) {
+	    fd = iolog_privsep_openat(dfd, path, flags, iolog_filemode);
+	} else if (iolog_ctx_swapids(ctx, false)) {
+	    fd = openat_mode(dfd, path, flags, iolog_filemode);
+	    if (!iolog_ctx_swapids(ctx, true)) {
 		/* iolog_swapids() warns on error. */
 		if (fd != -1) {
 		    close(fd);
@@ -84,7 +119,11 @@ iolog_openat(int dfd, const char *path, int flags)
 	    }
 	}
     }
-    if (ISSET(flags, O_CREAT))
-	umask(omask);
     debug_return_int(fd);
 }
+
+int
+iolog_openat(int dfd, const char *path, int flags)
+{
+    return iolog_ctx_openat(&iolog_default_ctx, dfd, path, flags);
+}
@@ -0,0 +1,617 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * This is an open source non-commercial project. Dear PVS-Studio, please check it.
+ * PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_fatal.h"
+#include "sudo_gettext.h"
+#include "sudo_iolog.h"
+#include "sudo_util.h"
+#include "iolog_privsep.h"
+
+enum privsep_op {
+    PRIVSEP_OPENAT,
+    PRIVSEP_MKDIR,
+    PRIVSEP_MKDTEMP,
+    PRIVSEP_RENAME
+};
+
+/*
+ * A request is followed by one or two NUL-terminated paths.
+ * The directory descriptor for PRIVSEP_OPENAT, if any, is passed
+ * as ancillary data.
+ */
+struct privsep_request {
+    int op;
+    int flags;			/* open(2) flags, or parents for mkdir */
+    mode_t mode;		/* file or directory mode */
+    unsigned int len1;		/* length of first path, including NUL */
+    unsigned int len2;		/* length of second path, including NUL */
+};
+
+/*
+ * A reply to PRIVSEP_OPENAT carries the new descriptor as ancillary
+ * data, a reply to PRIVSEP_MKDTEMP is followed by the new path.
+ */
+struct privsep_reply {
+    int result;			/* 0 on success, -1 on error */
+    int errnum;			/* errno on error */
+    int warnnum;		/* errno from a non-fatal chmod(2) */
+};
+
+static struct privsep_helper {
+    pid_t pid;			/* helper process */
+    pid_t owner;		/* process that started the helper */
+    int sock;			/* our end of the socket pair */
+    uid_t uid;			/* I/O log owner the helper runs as */
+    gid_t gid;
+    unsigned long long requests;
+    unsigned long long failures;
+    unsigned long long restarts;
+} helper = { -1, -1, -1 };
+
+/*
+ * Send len bytes from each of the iovecs, passing fd if it is not -1.
+ */
+static bool
+privsep_send(int sock, struct iovec *iov, int iovcnt, int fd)
+{
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } cmsgbuf;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    ssize_t nwritten;
+    size_t len = 0;
+    int i;
+    debug_decl(privsep_send, SUDO_DEBUG_UTIL);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    for (i = 0; i < iovcnt; i++)
+	len += iov[i].iov_len;
+    if (fd != -1) {
+	memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    /* Messages are small, a short write means the peer is gone. */
+    do {
+	nwritten = sendmsg(sock, &msg, 0);
+    } while (nwritten == -1 && errno == EINTR);
+    if (nwritten != (ssize_t)len) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to send %zu bytes to privsep peer", len);
+	debug_return_bool(false);
+    }
+    debug_return_bool(true);
+}
+
+/*
+ * Receive exactly len bytes.  If fdp is not NULL, a descriptor
+ * passed along with the data is stored there, else it is -1.
+ * Returns false on error or end of file.
+ */
+static bool
+privsep_recv(int sock, void *buf, size_t len, int *fdp)
+{
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } cmsgbuf;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t nread;
+    debug_decl(privsep_recv, SUDO_DEBUG_UTIL);
+
+    if (fdp != NULL)
+	*fdp = -1;
+    while (len > 0) {
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+	nread = recvmsg(sock, &msg, 0);
+	if (nread == -1 && errno == EINTR)
+	    continue;
+	if (nread <= 0) {
+	    if (nread == -1) {
+		sudo_debug_printf(
+		    SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		    "unable to receive from privsep peer");
+	    }
+	    goto bad;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	    int fd;
+
+	    if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS ||
+		    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+		continue;
+	    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	    if (fdp != NULL && *fdp == -1) {
+		*fdp = fd;
+	    } else {
+		close(fd);
+	    }
+	}
+	buf = (char *)buf + nread;
+	len -= nread;
+    }
+    debug_return_bool(true);
+bad:
+    if (fdp != NULL && *fdp != -1) {
+	close(*fdp);
+	*fdp = -1;
+    }
+    debug_return_bool(false);
+}
+
+/*
+ * Perform a single request as the I/O log owner.
+ * The umask is zero, callers pass the exact mode they want.
+ */
+static void
+privsep_perform(struct privsep_request *req, int dfd, char *path1,
+    const char *path2, struct privsep_reply *reply, int *fdp)
+{
+    debug_decl(privsep_perform, SUDO_DEBUG_UTIL);
+
+    switch (req->op) {
+    case PRIVSEP_OPENAT:
+	*fdp = openat(dfd != -1 ? dfd : AT_FDCWD, path1, req->flags,
+	    req->mode);
+	if (*fdp == -1)
+	    reply->result = -1;
+	break;
+    case PRIVSEP_MKDIR:
+	if (req->flags) {
+	    if (!sudo_mkdir_parents(path1, -1, -1, req->mode, false))
+		reply->result = -1;
+	} else {
+	    if (mkdir(path1, req->mode) == -1 && errno != EEXIST)
+		reply->result = -1;
+	}
+	break;
+    case PRIVSEP_MKDTEMP:
+	if (mkdtemp(path1) == NULL) {
+	    reply->result = -1;
+	} else if (chmod(path1, req->mode) != 0) {
+	    reply->warnnum = errno;
+	}
+	break;
+    case PRIVSEP_RENAME:
+	if (rename(path1, path2) == -1)
+	    reply->result = -1;
+	break;
+    default:
+	errno = EINVAL;
+	reply->result = -1;
+	break;
+    }
+    if (reply->result == -1)
+	reply->errnum = errno;
+
+    debug_return;
+}
+
+/*
+ * Main loop of the helper process, runs until the socket is closed.
+ */
+static int
+privsep_main(int sock, uid_t uid, gid_t gid)
+{
+    char path1[PATH_MAX], path2[PATH_MAX];
+    struct privsep_request req;
+    struct privsep_reply reply;
+    struct iovec iov[2];
+    int dfd, fd, iovcnt;
+    debug_decl(privsep_main, SUDO_DEBUG_UTIL);
+
+    /* Permanently become the I/O log owner. */
+    if (setgroups(1, &gid) == -1 || setgid(gid) == -1 || setuid(uid) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to change to uid %d, gid %d", (int)uid, (int)gid);
+	debug_return_int(EXIT_FAILURE);
+    }
+    umask(0);
+
+    for (;;) {
+	if (!privsep_recv(sock, &req, sizeof(req), &dfd))
+	    break;
+	if (req.len1 == 0 || req.len1 > sizeof(path1) ||
+		req.len2 > sizeof(path2)) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"invalid privsep request, path lengths %u and %u",
+		req.len1, req.len2);
+	    break;
+	}
+	if (!privsep_recv(sock, path1, req.len1, NULL))
+	    break;
+	if (req.len2 != 0 && !privsep_recv(sock, path2, req.len2, NULL))
+	    break;
+	path1[req.len1 - 1] = '\0';
+	if (req.len2 != 0)
+	    path2[req.len2 - 1] = '\0';
+
+	memset(&reply, 0, sizeof(reply));
+	fd = -1;
+	privsep_perform(&req, dfd, path1, path2, &reply, &fd);
+	if (dfd != -1)
+	    close(dfd);
+
+	iov[0].iov_base = &reply;
+	iov[0].iov_len = sizeof(reply);
+	iovcnt = 1;
+	if (req.op == PRIVSEP_MKDTEMP && reply.result == 0) {
+	    iov[1].iov_base = path1;
+	    iov[1].iov_len = req.len1;
+	    iovcnt = 2;
+	}
+	if (!privsep_send(sock, iov, iovcnt, fd))
+	    break;
+	if (fd != -1)
+	    close(fd);
+    }
+
+    debug_return_int(EXIT_SUCCESS);
+}
+
+/*
+ * Start the helper process if the I/O log owner is not root and we
+ * are, restarting it if the owner has changed.  When we are not root
+ * there is no way to act as the owner so no helper is needed.
+ */
+bool
+iolog_privsep_start(void)
+{
+    const uid_t iolog_uid = iolog_get_uid();
+    const gid_t iolog_gid = iolog_get_gid();
+    int sv[2];
+    pid_t pid;
+    debug_decl(iolog_privsep_start, SUDO_DEBUG_UTIL);
+
+    if (iolog_privsep_running(iolog_uid, iolog_gid))
+	debug_return_bool(true);
+    iolog_privsep_stop();
+
+    if (geteuid() != ROOT_UID || iolog_uid == ROOT_UID)
+	debug_return_bool(true);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create privsep socket pair");
+	debug_return_bool(false);
+    }
+
+    switch (pid = sudo_debug_fork()) {
+    case -1:
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to fork privsep helper");
+	close(sv[0]);
+	close(sv[1]);
+	debug_return_bool(false);
+    case 0:
+	/*
+	 * The helper must not keep the server's listeners and client
+	 * connections open, or signal the server's event loop.
+	 */
+	if (sv[1] != STDERR_FILENO + 1) {
+	    if (dup2(sv[1], STDERR_FILENO + 1) == -1)
+		_exit(EXIT_FAILURE);
+	}
+	closefrom(STDERR_FILENO + 2);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	_exit(privsep_main(STDERR_FILENO + 1, iolog_uid, iolog_gid));
+    default:
+	break;
+    }
+    close(sv[1]);
+    if (fcntl(sv[0], F_SETFD, FD_CLOEXEC) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to set close-on-exec flag on privsep socket");
+    }
+
+    helper.pid = pid;
+    helper.owner = getpid();
+    helper.sock = sv[0];
+    helper.uid = iolog_uid;
+    helper.gid = iolog_gid;
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"started privsep helper %d as uid %d, gid %d", (int)pid,
+	(int)iolog_uid, (int)iolog_gid);
+
+    debug_return_bool(true);
+}
+
+/*
+ * Stop the helper process; it exits when its end of the socket is closed.
+ */
+void
+iolog_privsep_stop(void)
+{
+    debug_decl(iolog_privsep_stop, SUDO_DEBUG_UTIL);
+
+    if (helper.sock == -1)
+	debug_return;
+
+    close(helper.sock);
+    helper.sock = -1;
+    if (helper.owner == getpid()) {
+	while (waitpid(helper.pid, NULL, 0) == -1) {
+	    if (errno != EINTR)
+		break;
+	}
+    }
+    helper.pid = -1;
+    helper.owner = -1;
+
+    debug_return;
+}
+
+/*
+ * Collect the helper if it has exited and start a new one.
+ * Called when SIGCHLD is received.  If the helper cannot be
+ * restarted, callers fall back to iolog_swapids().
+ */
+void
+iolog_privsep_reap(void)
+{
+    int status;
+    pid_t pid;
+    debug_decl(iolog_privsep_reap, SUDO_DEBUG_UTIL);
+
+    if (helper.pid == -1 || helper.owner != getpid())
+	debug_return;
+    do {
+	pid = waitpid(helper.pid, &status, WNOHANG);
+    } while (pid == -1 && errno == EINTR);
+    if (pid != helper.pid)
+	debug_return;
+
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	"privsep helper %d exited, status 0x%x", (int)pid, status);
+    close(helper.sock);
+    helper.sock = -1;
+    helper.pid = -1;
+    helper.owner = -1;
+
+    helper.restarts++;
+    if (!iolog_privsep_start())
+	sudo_warnx("%s", U_("unable to restart I/O log owner helper"));
+
+    debug_return;
+}
+
+/*
+ * Returns true if requests for the given I/O log owner can be sent
+ * to the helper.  A forked child must not share the helper with its
+ * parent.
+ */
+bool
+iolog_privsep_running(uid_t uid, gid_t gid)
+{
+    return helper.sock != -1 && helper.owner == getpid() &&
+	helper.uid == uid && helper.gid == gid;
+}
+
+/*
+ * Send a request to the helper and wait for the reply.
+ * If the helper has gone away, it is stopped so that callers fall
+ * back to iolog_swapids().  Returns the result with errno set.
+ */
+static int
+privsep_request(struct privsep_request *req, int dfd, const char *path1,
+    const char *path2, char *newpath, int *fdp)
+{
+    struct privsep_reply reply;
+    struct iovec iov[3];
+    int iovcnt = 2;
+    debug_decl(privsep_request, SUDO_DEBUG_UTIL);
+
+    helper.requests++;
+    req->len1 = strlen(path1) + 1;
+    req->len2 = path2 ? strlen(path2) + 1 : 0;
+    if (req->len1 > PATH_MAX || req->len2 > PATH_MAX) {
+	errno = ENAMETOOLONG;
+	goto bad;
+    }
+
+    iov[0].iov_base = req;
+    iov[0].iov_len = sizeof(*req);
+    iov[1].iov_base = (char *)path1;
+    iov[1].iov_len = req->len1;
+    if (path2 != NULL) {
+	iov[2].iov_base = (char *)path2;
+	iov[2].iov_len = req->len2;
+	iovcnt = 3;
+    }
+    if (!privsep_send(helper.sock, iov, iovcnt,
+	    dfd != AT_FDCWD ? dfd : -1))
+	goto lost;
+    if (!privsep_recv(helper.sock, &reply, sizeof(reply), fdp))
+	goto lost;
+    if (newpath != NULL && reply.result == 0) {
+	if (!privsep_recv(helper.sock, newpath, req->len1, NULL))
+	    goto lost;
+    }
+    if (reply.warnnum != 0) {
+	errno = reply.warnnum;
+	sudo_warn(U_("unable to change mode of %s to 0%o"), path1,
+	    (unsigned int)req->mode);
+    }
+    if (reply.result == -1) {
+	errno = reply.errnum;
+	goto bad;
+    }
+    debug_return_int(0);
+
+lost:
+    sudo_warnx("%s", U_("lost connection to I/O log owner helper"));
+    iolog_privsep_stop();
+    errno = EACCES;
+bad:
+    helper.failures++;
+    debug_return_int(-1);
+}
+
+/*
+ * Like openat(2) but runs as the I/O log owner.
+ */
+int
+iolog_privsep_openat(int dfd, const char *path, int flags, mode_t mode)
+{
+    struct privsep_request req;
+    int fd = -1;
+    debug_decl(iolog_privsep_openat, SUDO_DEBUG_UTIL);
+
+    memset(&req, 0, sizeof(req));
+    req.op = PRIVSEP_OPENAT;
+    req.flags = flags;
+    req.mode = mode;
+    if (privsep_request(&req, dfd, path, NULL, NULL, &fd) == -1)
+	debug_return_int(-1);
+    if (fd == -1) {
+	/* Success without a descriptor, should not happen. */
+	errno = EBADF;
+	debug_return_int(-1);
+    }
+#ifdef O_CLOEXEC
+    /* The close-on-exec flag is not passed along with the descriptor. */
+    if (ISSET(flags, O_CLOEXEC))
+	(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    debug_return_int(fd);
+}
+
+/*
+ * Create the parent directories of path, or path itself, as the
+ * I/O log owner.  An existing directory is not an error.
+ */
+bool
+iolog_privsep_mkdir(const char *path, mode_t mode, bool parents)
+{
+    struct privsep_request req;
+    debug_decl(iolog_privsep_mkdir, SUDO_DEBUG_UTIL);
+
+    memset(&req, 0, sizeof(req));
+    req.op = PRIVSEP_MKDIR;
+    req.flags = parents;
+    req.mode = mode;
+    debug_return_bool(privsep_request(&req, AT_FDCWD, path, NULL, NULL,
+	NULL) == 0);
+}
+
+/*
+ * Like mkdtemp(3) but runs as the I/O log owner and sets the mode.
+ */
+bool
+iolog_privsep_mkdtemp(char *path, mode_t mode)
+{
+    struct privsep_request req;
+    debug_decl(iolog_privsep_mkdtemp, SUDO_DEBUG_UTIL);
+
+    memset(&req, 0, sizeof(req));
+    req.op = PRIVSEP_MKDTEMP;
+    req.mode = mode;
+    debug_return_bool(privsep_request(&req, AT_FDCWD, path, NULL, path,
+	NULL) == 0);
+}
+
+/*
+ * Like rename(2) but runs as the I/O log owner.
+ */
+bool
+iolog_privsep_rename(const char *from, const char *to)
+{
+    struct privsep_request req;
+    debug_decl(iolog_privsep_rename, SUDO_DEBUG_UTIL);
+
+    memset(&req, 0, sizeof(req));
+    req.op = PRIVSEP_RENAME;
+    debug_return_bool(privsep_request(&req, AT_FDCWD, from, to, NULL,
+	NULL) == 0);
+}
+
+/*
+ * Write helper statistics to the debug file.
+ */
+void
+iolog_privsep_dump(void)
+{
+    debug_decl(iolog_privsep_dump, SUDO_DEBUG_UTIL);
+
+    if (helper.requests == 0 && helper.sock == -1)
+	debug_return;
+
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"privsep helper %d (uid %d, gid %d): %llu requests, %llu failed, "
+	"%llu restarts", (int)helper.pid, (int)helper.uid, (int)helper.gid,
+	helper.requests, helper.failures, helper.restarts);
+
+    debug_return;
+}
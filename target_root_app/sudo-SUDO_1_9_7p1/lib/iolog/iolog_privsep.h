@@ -0,0 +1,45 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IOLOG_PRIVSEP_H
+#define IOLOG_PRIVSEP_H
+
+/*
+ * Privilege-separated file system access for the I/O log owner.
+ *
+ * When root is denied access to the I/O log directory (for example,
+ * NFS with root squashing), operations that fail with EACCES are
+ * retried as the I/O log owner.  Rather than switching the effective
+ * uid and gid of the whole process for each retry, the operation is
+ * sent to a helper process that runs permanently as the I/O log owner.
+ * Newly opened descriptors are passed back over a UNIX domain socket.
+ * If the helper is not running, iolog_swapids() is used instead.
+ */
+
+/* iolog_privsep.c */
+bool iolog_privsep_start(void);
+void iolog_privsep_stop(void);
+void iolog_privsep_reap(void);
+bool iolog_privsep_running(uid_t uid, gid_t gid);
+int iolog_privsep_openat(int dfd, const char *path, int flags, mode_t mode);
+bool iolog_privsep_mkdir(const char *path, mode_t mode, bool parents);
+bool iolog_privsep_mkdtemp(char *path, mode_t mode);
+bool iolog_privsep_rename(const char *from, const char *to);
+void iolog_privsep_dump(void);
+
+#endif /* IOLOG_PRIVSEP_H */
@@ -38,20 +38,23 @@
 #include "sudo_fatal.h"
 #include "sudo_gettext.h"
 #include "sudo_iolog.h"
+#include "iolog_ctx.h"
 
 /*
- * Set effective user and group-IDs to iolog_uid and iolog_gid.
+ * Set effective user and group-IDs to the I/O log owner and group.
  * If restore flag is set, swap them back.
+ * The effective IDs are process-wide; this is a last resort when the
+ * privilege separation helper is not running.
  */
 bool
-iolog_swapids(bool restore)
+iolog_ctx_swapids(const struct iolog_ctx *ctx, bool restore)
 {
 #ifdef HAVE_SETEUID
     static uid_t user_euid = (uid_t)-1;
     static gid_t user_egid = (gid_t)-1;
-    const uid_t iolog_uid = iolog_get_uid();
-    const gid_t iolog_gid = iolog_get_gid();
-    debug_decl(io_swapids, SUDO_DEBUG_UTIL);
+    const uid_t iolog_uid = ctx->uid;
+    const gid_t iolog_gid = ctx->gid;
+    debug_decl(iolog_ctx_swapids, SUDO_DEBUG_UTIL);
 
     if (user_euid == (uid_t)-1)
 	user_euid = geteuid();
@@ -93,3 +96,9 @@ iolog_swapids(bool restore)
     return false;
 #endif
 }
+
+bool
+iolog_swapids(bool restore)
+{
+    return iolog_ctx_swapids(&iolog_default_ctx, restore);
+}
@@ -46,8 +46,11 @@
 #include "sudo_gettext.h"
 #include "sudo_iolog.h"
 #include "sudo_util.h"
+#include "iolog_ctx.h"
 
-static int timing_event_adj;
+/* Parser state used by iolog_parse_timing() and iolog_read_timing_record(). */
+static struct iolog_timing_parser default_parser =
+    IOLOG_TIMING_PARSER_INITIALIZER;
 
 void
 iolog_adjust_delay(struct timespec *delay, struct timespec *max_delay,
@@ -169,11 +172,12 @@ iolog_parse_delay(const char *cp, struct timespec *delay,
  * Returns true on success and false on failure.
  */
 bool
-iolog_parse_timing(const char *line, struct timing_closure *timing)
+iolog_parse_timing_r(struct iolog_timing_parser *parser, const char *line,
+    struct timing_closure *timing)
 {
     unsigned long ulval;
     char *cp, *ep;
-    debug_decl(iolog_parse_timing, SUDO_DEBUG_UTIL);
+    debug_decl(iolog_parse_timing_r, SUDO_DEBUG_UTIL);
 
     /* Clear iolog descriptor. */
     timing->iol = NULL;
@@ -186,9 +190,9 @@ iolog_parse_timing(const char *line, struct timing_closure *timing)
 	goto bad;
     if (ulval == IO_EVENT_TTYOUT_1_8_7) {
 	/* work around a bug in timing files generated by sudo 1.8.7 */
-	timing_event_adj = 2;
+	parser->event_adj = 2;
     }
-    timing->event = (int)ulval - timing_event_adj;
+    timing->event = (int)ulval - parser->event_adj;
     for (cp = ep + 1; isspace((unsigned char) *cp); cp++)
 	continue;
 
@@ -236,16 +240,23 @@ bad:
     debug_return_bool(false);
 }
 
+bool
+iolog_parse_timing(const char *line, struct timing_closure *timing)
+{
+    return iolog_parse_timing_r(&default_parser, line, timing);
+}
+
 /*
  * Read the next record from the timing file.
  * Return 0 on success, 1 on EOF and -1 on error.
  */
 int
-iolog_read_timing_record(struct iolog_file *iol, struct timing_closure *timing)
+iolog_read_timing_record_r(struct iolog_timing_parser *parser,
+    struct iolog_file *iol, struct timing_closure *timing)
 {
     char line[LINE_MAX];
     const char *errstr;
-    debug_decl(iolog_read_timing_record, SUDO_DEBUG_UTIL);
+    debug_decl(iolog_read_timing_record_r, SUDO_DEBUG_UTIL);
 
     /* Read next record from timing file. */
     if (iolog_gets(iol, line, sizeof(line), &errstr) == NULL) {
@@ -258,10 +269,16 @@ iolog_read_timing_record(struct iolog_file *iol, struct timing_closure *timing)
 
     /* Parse timing file record. */
     line[strcspn(line, "\n")] = '\0';
-    if (!iolog_parse_timing(line, timing)) {
+    if (!iolog_parse_timing_r(parser, line, timing)) {
 	sudo_warnx(U_("invalid timing file line: %s"), line);
 	debug_return_int(-1);
     }
 
     debug_return_int(0);
 }
+
+int
+iolog_read_timing_record(struct iolog_file *iol, struct timing_closure *timing)
+{
+    return iolog_read_timing_record_r(&default_parser, iol, timing);
+}
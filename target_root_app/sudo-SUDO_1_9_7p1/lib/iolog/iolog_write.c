@@ -37,16 +37,18 @@
 #include "sudo_compat.h"
 #include "sudo_debug.h"
 #include "sudo_iolog.h"
+#include "iolog_ctx.h"
+#include "iolog_fault.h"
 
 /*
  * Write to an I/O log, optionally compressing.
  */
 ssize_t
-iolog_write(struct iolog_file *iol, const void *buf, size_t len,
-    const char **errstr)
+iolog_ctx_write(const struct iolog_ctx *ctx, struct iolog_file *iol,
+    const void *buf, size_t len, const char **errstr)
 {
     ssize_t ret;
-    debug_decl(iolog_write, SUDO_DEBUG_UTIL);
+    debug_decl(iolog_ctx_write, SUDO_DEBUG_UTIL);
 
     if (len > UINT_MAX) {
 	errno = EINVAL;
@@ -55,6 +57,17 @@ iolog_write(struct iolog_file *iol, const void *buf, size_t len,
 	debug_return_ssize_t(-1);
     }
 
+    /* Test mode: inject write and flush faults. */
+    if (iolog_fault_enabled) {
+	if (iolog_fault_inject(IOLOG_FAULT_WRITE, &len) == -1 ||
+		(ctx->flush &&
+		iolog_fault_inject(IOLOG_FAULT_FLUSH, NULL) == -1)) {
+	    if (errstr != NULL)
+		*errstr = strerror(errno);
+	    debug_return_ssize_t(-1);
+	}
+    }
+
 #ifdef HAVE_ZLIB_H
     if (iol->compressed) {
 	int errnum;
@@ -69,7 +82,7 @@ iolog_write(struct iolog_file *iol, const void *buf, size_t len,
 	    }
 	    goto done;
 	}
-	if (iolog_get_flush()) {
+	if (ctx->flush) {
 	    if (gzflush(iol->fd.g, Z_SYNC_FLUSH) != Z_OK) {
 		ret = -1;
 		if (errstr != NULL) {
@@ -90,7 +103,7 @@ iolog_write(struct iolog_file *iol, const void *buf, size_t len,
 		*errstr = strerror(errno);
 	    goto done;
 	}
-	if (iolog_get_flush()) {
+	if (ctx->flush) {
 	    if (fflush(iol->fd.f) != 0) {
 		ret = -1;
 		if (errstr != NULL)
@@ -103,3 +116,10 @@ iolog_write(struct iolog_file *iol, const void *buf, size_t len,
 done:
     debug_return_ssize_t(ret);
 }
+
+ssize_t
+iolog_write(struct iolog_file *iol, const void *buf, size_t len,
+    const char **errstr)
+{
+    return iolog_ctx_write(&iolog_default_ctx, iol, buf, len, errstr);
+}
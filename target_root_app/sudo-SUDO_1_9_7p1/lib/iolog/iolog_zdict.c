@@ -0,0 +1,350 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * This is an open source non-commercial project. Dear PVS-Studio, please check it.
+ * PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_iolog.h"
+#include "sudo_util.h"
+#include "iolog_zdict.h"
+
+/*
+ * Format the name of the dictionary file for dictid.
+ */
+void
+iolog_zdict_name(unsigned int dictid, char *name, size_t namesize)
+{
+    (void)snprintf(name, namesize, IOLOG_ZDICT_PREFIX "%08x", dictid);
+}
+
+#if defined(HAVE_ZLIB_H) && (defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN))
+
+#define ZDICT_INBUF_SIZE	(64 * 1024)
+
+struct zdict_reader {
+    z_stream strm;
+    off_t pos;			/* uncompressed offset */
+    bool eof;
+    int fd;
+    size_t dictlen;
+    unsigned char dict[IOLOG_ZDICT_MAX];
+    unsigned char inbuf[ZDICT_INBUF_SIZE];
+};
+
+/*
+ * Returns true if the file open on fd is a zlib stream with a preset
+ * dictionary that is present in the I/O log directory dfd.
+ * On success, the dictionary ID is stored in dictidp.
+ */
+bool
+iolog_zdict_probe(int dfd, int fd, unsigned int *dictidp)
+{
+    unsigned char hdr[6];
+    char name[IOLOG_ZDICT_NAME_LEN + 1];
+    unsigned int dictid;
+    debug_decl(iolog_zdict_probe, SUDO_DEBUG_UTIL);
+
+    if (pread(fd, hdr, sizeof(hdr), 0) != ssizeof(hdr))
+	debug_return_bool(false);
+
+    /* Deflate with a window of at most 32K, FDICT set and a valid check. */
+    if ((hdr[0] & 0x0f) != Z_DEFLATED || (hdr[0] >> 4) > 7 ||
+	    (hdr[1] & 0x20) == 0 || ((hdr[0] << 8) | hdr[1]) % 31 != 0)
+	debug_return_bool(false);
+
+    /* A plain stream could match by chance, so the dictionary must exist. */
+    dictid = ((unsigned int)hdr[2] << 24) | ((unsigned int)hdr[3] << 16) |
+	((unsigned int)hdr[4] << 8) | (unsigned int)hdr[5];
+    iolog_zdict_name(dictid, name, sizeof(name));
+    if (faccessat(dfd, name, F_OK, 0) != 0)
+	debug_return_bool(false);
+
+    *dictidp = dictid;
+    debug_return_bool(true);
+}
+
+static void
+zdict_free(struct zdict_reader *r)
+{
+    if (r->fd != -1)
+	close(r->fd);
+    (void)inflateEnd(&r->strm);
+    free(r);
+}
+
+/*
+ * Load the dictionary for dictid from dfd and check its Adler-32.
+ */
+static bool
+zdict_load(struct zdict_reader *r, int dfd, unsigned int dictid)
+{
+    char name[IOLOG_ZDICT_NAME_LEN + 1];
+    ssize_t nread;
+    int fd;
+    debug_decl(zdict_load, SUDO_DEBUG_UTIL);
+
+    iolog_zdict_name(dictid, name, sizeof(name));
+    if ((fd = iolog_openat(dfd, name, O_RDONLY)) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s", name);
+	debug_return_bool(false);
+    }
+    nread = read(fd, r->dict, sizeof(r->dict));
+    close(fd);
+    if (nread <= 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to read %s", name);
+	debug_return_bool(false);
+    }
+    r->dictlen = (size_t)nread;
+    if (adler32(adler32(0, NULL, 0), r->dict, r->dictlen) != dictid) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "%s: dictionary checksum mismatch", name);
+	errno = EINVAL;
+	debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
+static ssize_t
+zdict_read(void *v, char *buf, size_t len)
+{
+    struct zdict_reader *r = v;
+    ssize_t nread;
+    int rc;
+    debug_decl(zdict_read, SUDO_DEBUG_UTIL);
+
+    r->strm.next_out = (unsigned char *)buf;
+    r->strm.avail_out = len;
+    while (r->strm.avail_out > 0 && !r->eof) {
+	if (r->strm.avail_in == 0) {
+	    nread = read(r->fd, r->inbuf, sizeof(r->inbuf));
+	    if (nread == -1) {
+		if (errno == EINTR)
+		    continue;
+		debug_return_ssize_t(-1);
+	    }
+	    /* A log that is still being written ends at the last flush. */
+	    if (nread == 0)
+		break;
+	    r->strm.next_in = r->inbuf;
+	    r->strm.avail_in = (unsigned int)nread;
+	}
+	rc = inflate(&r->strm, Z_NO_FLUSH);
+	switch (rc) {
+	case Z_NEED_DICT:
+	    if (inflateSetDictionary(&r->strm, r->dict, r->dictlen) != Z_OK) {
+		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		    "unable to set dictionary: %s", r->strm.msg ? r->strm.msg :
+		    "unknown error");
+		errno = EIO;
+		debug_return_ssize_t(-1);
+	    }
+	    break;
+	case Z_STREAM_END:
+	    r->eof = true;
+	    break;
+	case Z_OK:
+	case Z_BUF_ERROR:
+	    break;
+	default:
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"inflate: %s", r->strm.msg ? r->strm.msg : "unknown error");
+	    errno = EIO;
+	    debug_return_ssize_t(-1);
+	}
+    }
+    nread = (ssize_t)(len - r->strm.avail_out);
+    r->pos += nread;
+
+    debug_return_ssize_t(nread);
+}
+
+/*
+ * Seeking backwards restarts decompression from the beginning;
+ * seeking forwards decompresses and discards the intervening data.
+ */
+static bool
+zdict_seek(struct zdict_reader *r, off_t *offset, int whence)
+{
+    char discard[8192];
+    off_t target;
+    ssize_t nread;
+
+    switch (whence) {
+    case SEEK_SET:
+	target = *offset;
+	break;
+    case SEEK_CUR:
+	target = r->pos + *offset;
+	break;
+    default:
+	errno = EINVAL;
+	return false;
+    }
+    if (target < 0) {
+	errno = EINVAL;
+	return false;
+    }
+    if (target < r->pos) {
+	if (inflateReset(&r->strm) != Z_OK || lseek(r->fd, 0, SEEK_SET) == -1)
+	    return false;
+	r->strm.avail_in = 0;
+	r->pos = 0;
+	r->eof = false;
+    }
+    while (r->pos < target) {
+	nread = zdict_read(r, discard,
+	    (size_t)MIN(target - r->pos, ssizeof(discard)));
+	if (nread <= 0) {
+	    if (nread == 0)
+		errno = EINVAL;
+	    return false;
+	}
+    }
+    *offset = r->pos;
+    return true;
+}
+
+static int
+zdict_close(void *v)
+{
+    zdict_free(v);
+    return 0;
+}
+
+#ifdef HAVE_FOPENCOOKIE
+static int
+zdict_seek_cookie(void *v, off64_t *offset, int whence)
+{
+    off_t pos = (off_t)*offset;
+
+    if (!zdict_seek(v, &pos, whence))
+	return -1;
+    *offset = pos;
+    return 0;
+}
+
+static cookie_io_functions_t zdict_funcs = {
+    zdict_read, NULL, zdict_seek_cookie, zdict_close
+};
+#else
+static int
+zdict_read_funopen(void *v, char *buf, int len)
+{
+    return (int)zdict_read(v, buf, (size_t)len);
+}
+
+static fpos_t
+zdict_seek_funopen(void *v, fpos_t offset, int whence)
+{
+    off_t pos = (off_t)offset;
+
+    if (!zdict_seek(v, &pos, whence))
+	return -1;
+    return (fpos_t)pos;
+}
+#endif /* HAVE_FOPENCOOKIE */
+
+/*
+ * Open a read-only stream that decompresses the I/O log open on fd
+ * using the dictionary dictid from the I/O log directory dfd.
+ * On success, fd is owned by the returned stream.
+ */
+FILE *
+iolog_zdict_fdopen(int dfd, int fd, unsigned int dictid)
+{
+    struct zdict_reader *r;
+    FILE *fp;
+    debug_decl(iolog_zdict_fdopen, SUDO_DEBUG_UTIL);
+
+    if ((r = calloc(1, sizeof(*r))) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	debug_return_ptr(NULL);
+    }
+    r->fd = -1;
+    if (inflateInit(&r->strm) != Z_OK) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to initialize zlib stream");
+	free(r);
+	debug_return_ptr(NULL);
+    }
+    if (!zdict_load(r, dfd, dictid))
+	goto bad;
+    if (lseek(fd, 0, SEEK_SET) == -1)
+	goto bad;
+
+#ifdef HAVE_FOPENCOOKIE
+    fp = fopencookie(r, "r", zdict_funcs);
+#else
+    fp = funopen(r, zdict_read_funopen, NULL, zdict_seek_funopen,
+	zdict_close);
+#endif
+    if (fp == NULL)
+	goto bad;
+    r->fd = fd;
+
+    debug_return_ptr(fp);
+bad:
+    zdict_free(r);
+    debug_return_ptr(NULL);
+}
+
+#else /* !HAVE_ZLIB_H || (!HAVE_FOPENCOOKIE && !HAVE_FUNOPEN) */
+
+bool
+iolog_zdict_probe(int dfd, int fd, unsigned int *dictidp)
+{
+    return false;
+}
+
+FILE *
+iolog_zdict_fdopen(int dfd, int fd, unsigned int dictid)
+{
+    debug_decl(iolog_zdict_fdopen, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	"dictionary-compressed I/O logs are not supported on this system");
+    errno = ENOTSUP;
+    debug_return_ptr(NULL);
+}
+
+#endif /* HAVE_ZLIB_H && (HAVE_FOPENCOOKIE || HAVE_FUNOPEN) */
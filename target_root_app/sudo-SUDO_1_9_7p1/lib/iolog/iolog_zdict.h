@@ -0,0 +1,47 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IOLOG_ZDICT_H
+#define IOLOG_ZDICT_H
+
+/*
+ * Compressed I/O log streams with a preset dictionary.
+ *
+ * Small streams compress poorly on their own since the compressor
+ * has no history to match against.  A stream may instead be written
+ * as a zlib (RFC 1950) stream that uses a preset dictionary trained
+ * from earlier sessions.  The FDICT bit is set in the stream header
+ * and is followed by the DICTID, the Adler-32 checksum of the
+ * dictionary.
+ *
+ * The dictionary is stored in the I/O log directory as
+ * "dict.<dictid>", where dictid is 8 lowercase hex digits.  It is
+ * normally a hard link to a versioned dictionary in a shared store
+ * so the per-session cost is a directory entry.
+ */
+
+#define IOLOG_ZDICT_PREFIX	"dict."
+#define IOLOG_ZDICT_NAME_LEN	(sizeof(IOLOG_ZDICT_PREFIX) - 1 + 8)
+#define IOLOG_ZDICT_MAX		(32 * 1024)	/* zlib window size */
+
+/* iolog_zdict.c */
+bool iolog_zdict_probe(int dfd, int fd, unsigned int *dictidp);
+void iolog_zdict_name(unsigned int dictid, char *name, size_t namesize);
+FILE *iolog_zdict_fdopen(int dfd, int fd, unsigned int dictid);
+
+#endif /* IOLOG_ZDICT_H */
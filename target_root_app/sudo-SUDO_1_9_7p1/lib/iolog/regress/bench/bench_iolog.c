@@ -0,0 +1,336 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * This is an open source non-commercial project. Dear PVS-Studio, please check it.
+ * PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_fatal.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "iolog_json.h"
+#include "bench_util.h"
+
+/*
+ * Microbenchmarks for the I/O log parsing, path and write functions.
+ */
+
+sudo_dso_public int main(int argc, char *argv[]);
+
+/* Reopen the file after this many bytes to bound disk usage. */
+#define WRITE_LIMIT	(64 * 1024 * 1024)
+
+static const char log_json[] =
+    "{\n"
+    "    \"timestamp\": {\n"
+    "        \"seconds\": 1623700000,\n"
+    "        \"nanoseconds\": 123456789\n"
+    "    },\n"
+    "    \"columns\": 80,\n"
+    "    \"command\": \"/usr/bin/make\",\n"
+    "    \"lines\": 24,\n"
+    "    \"runargv\": [\n"
+    "        \"make\",\n"
+    "        \"-j8\",\n"
+    "        \"install\"\n"
+    "    ],\n"
+    "    \"runenv\": [\n"
+    "        \"HOME=/root\",\n"
+    "        \"LOGNAME=root\",\n"
+    "        \"PATH=/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin\",\n"
+    "        \"SHELL=/bin/sh\",\n"
+    "        \"TERM=xterm-256color\",\n"
+    "        \"USER=root\"\n"
+    "    ],\n"
+    "    \"rungid\": 0,\n"
+    "    \"rungroup\": \"wheel\",\n"
+    "    \"runuid\": 0,\n"
+    "    \"runuser\": \"root\",\n"
+    "    \"submitcwd\": \"/home/millert/src/sudo\",\n"
+    "    \"submithost\": \"build.example.com\",\n"
+    "    \"submituser\": \"millert\",\n"
+    "    \"ttyname\": \"/dev/pts/3\"\n"
+    "}\n";
+
+struct timing_bench {
+    const char *line;
+    struct timing_closure timing;
+};
+
+struct write_bench {
+    struct iolog_file iol;
+    int dfd;
+    bool compress;
+    size_t len;
+    size_t written;
+    const char *buf;
+};
+
+static void
+bench_parse_timing(void *v)
+{
+    struct timing_bench *tb = v;
+
+    if (!iolog_parse_timing(tb->line, &tb->timing))
+	sudo_fatalx("unable to parse timing line: %s", tb->line);
+    bench_sink += tb->timing.u.nbytes;
+}
+
+static void
+bench_parse_json(void *v)
+{
+    FILE *fp = v;
+    struct json_object root;
+
+    rewind(fp);
+    if (!iolog_parse_json(fp, "log.json", &root))
+	sudo_fatalx("unable to parse log.json");
+    bench_sink += TAILQ_FIRST(&root.items) != NULL;
+    free_json_items(&root.items);
+}
+
+static size_t
+fill_seq(char *str, size_t strsize, void *unused)
+{
+    return strlcpy(str, "00/00/01", strsize);
+}
+
+static size_t
+fill_user(char *str, size_t strsize, void *unused)
+{
+    return strlcpy(str, "millert", strsize);
+}
+
+static size_t
+fill_group(char *str, size_t strsize, void *unused)
+{
+    return strlcpy(str, "staff", strsize);
+}
+
+static size_t
+fill_runas_user(char *str, size_t strsize, void *unused)
+{
+    return strlcpy(str, "root", strsize);
+}
+
+static size_t
+fill_hostname(char *str, size_t strsize, void *unused)
+{
+    return strlcpy(str, "build.example.com", strsize);
+}
+
+static size_t
+fill_command(char *str, size_t strsize, void *unused)
+{
+    return strlcpy(str, "make", strsize);
+}
+
+static struct iolog_path_escape path_escapes[] = {
+    { "seq", fill_seq },
+    { "user", fill_user },
+    { "group", fill_group },
+    { "runas_user", fill_runas_user },
+    { "hostname", fill_hostname },
+    { "command", fill_command },
+    { NULL, NULL }
+};
+
+static void
+bench_expand_path(void *v)
+{
+    const char *inpath = v;
+    char path[PATH_MAX];
+
+    if (!expand_iolog_path(inpath, path, sizeof(path), path_escapes, NULL))
+	sudo_fatalx("unable to expand %s", inpath);
+    bench_sink += path[0];
+}
+
+static void
+write_bench_open(struct write_bench *wb)
+{
+    iolog_set_compress(wb->compress);
+    wb->iol.enabled = true;
+    if (!iolog_open(&wb->iol, wb->dfd, IOFD_TTYOUT, "w"))
+	sudo_fatal("unable to open %s", iolog_fd_to_name(IOFD_TTYOUT));
+    wb->written = 0;
+}
+
+static void
+write_bench_close(struct write_bench *wb)
+{
+    const char *errstr = NULL;
+
+    if (!iolog_close(&wb->iol, &errstr))
+	sudo_fatalx("unable to close %s: %s", iolog_fd_to_name(IOFD_TTYOUT),
+	    errstr ? errstr : "unknown error");
+}
+
+static void
+bench_write(void *v)
+{
+    struct write_bench *wb = v;
+    const char *errstr = NULL;
+
+    if (iolog_write(&wb->iol, wb->buf, wb->len, &errstr) != (ssize_t)wb->len)
+	sudo_fatalx("unable to write %s: %s", iolog_fd_to_name(IOFD_TTYOUT),
+	    errstr ? errstr : "short write");
+    wb->written += wb->len;
+    if (wb->written >= WRITE_LIMIT) {
+	write_bench_close(wb);
+	write_bench_open(wb);
+    }
+}
+
+/*
+ * Fill buf with something that looks like terminal output so
+ * that the compressed case does a realistic amount of work.
+ */
+static void
+fill_ttyout(char *buf, size_t len)
+{
+    size_t off = 0;
+    unsigned int n = 0;
+
+    while (off < len) {
+	char line[128];
+	int linelen;
+
+	linelen = snprintf(line, sizeof(line),
+	    "-rw-r--r--  1 millert  staff  %6u Jun %2u %02u:%02u "
+	    "file%05u.c\r\n", (n * 7919) % 100000, n % 30 + 1, n % 24,
+	    n % 60, n);
+	if ((size_t)linelen > len - off)
+	    linelen = (int)(len - off);
+	memcpy(buf + off, line, linelen);
+	off += linelen;
+	n++;
+    }
+}
+
+static void
+run_write_benchmarks(void)
+{
+    static const size_t sizes[] = { 64, 1024, 16384 };
+    char dir[] = "/tmp/bench_iolog.XXXXXX";
+    struct write_bench wb;
+    char name[64], *buf;
+    size_t i;
+    int pass;
+
+    if (mkdtemp(dir) == NULL)
+	sudo_fatal("unable to create %s", dir);
+    memset(&wb, 0, sizeof(wb));
+    if ((wb.dfd = open(dir, O_RDONLY)) == -1)
+	sudo_fatal("unable to open %s", dir);
+    iolog_set_owner(geteuid(), getegid());
+
+    if ((buf = malloc(sizes[nitems(sizes) - 1])) == NULL)
+	sudo_fatalx("%s: %s", __func__, "unable to allocate memory");
+    fill_ttyout(buf, sizes[nitems(sizes) - 1]);
+    wb.buf = buf;
+
+    for (pass = 0; pass < 2; pass++) {
+	wb.compress = pass != 0;
+#ifndef HAVE_ZLIB_H
+	if (wb.compress)
+	    break;
+#endif
+	for (i = 0; i < nitems(sizes); i++) {
+	    wb.len = sizes[i];
+	    (void)snprintf(name, sizeof(name), "iolog_write/%s/%zu",
+		wb.compress ? "gzip" : "plain", wb.len);
+	    write_bench_open(&wb);
+	    bench_run(name, wb.len, bench_write, &wb);
+	    write_bench_close(&wb);
+	}
+    }
+
+    (void)unlinkat(wb.dfd, iolog_fd_to_name(IOFD_TTYOUT), 0);
+    close(wb.dfd);
+    (void)rmdir(dir);
+    iolog_set_compress(false);
+    free(buf);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const struct {
+	const char *name;
+	const char *path;
+    } paths[] = {
+	{ "expand_iolog_path/default", "/var/log/sudo-io/%{seq}" },
+	{ "expand_iolog_path/escapes",
+	    "/var/log/sudo-io/%{hostname}/%{user}/%{command}/%Y%m%d-%H%M%S" }
+    };
+    struct timing_bench tb;
+    size_t i;
+    FILE *fp;
+
+    bench_init(argc, argv);
+
+    /* Timing file records. */
+    memset(&tb, 0, sizeof(tb));
+    tb.timing.decimal = ".";
+    tb.line = "4 0.123456789 42";
+    bench_run("iolog_parse_timing/ttyout", strlen(tb.line),
+	bench_parse_timing, &tb);
+    tb.line = "5 1.000000001 24 80";
+    bench_run("iolog_parse_timing/winsize", strlen(tb.line),
+	bench_parse_timing, &tb);
+
+    /* The log.json file, read from a temporary file. */
+    if ((fp = tmpfile()) == NULL)
+	sudo_fatal("unable to create temporary file");
+    if (fwrite(log_json, 1, sizeof(log_json) - 1, fp) != sizeof(log_json) - 1)
+	sudo_fatal("unable to write temporary file");
+    bench_run("iolog_parse_json/log.json", sizeof(log_json) - 1,
+	bench_parse_json, fp);
+    fclose(fp);
+
+    /* I/O log directory and file path escapes. */
+    for (i = 0; i < nitems(paths); i++) {
+	bench_run(paths[i].name, strlen(paths[i].path), bench_expand_path,
+	    (void *)paths[i].path);
+    }
+
+    /* Writing I/O log data, plain and compressed. */
+    run_write_benchmarks();
+
+    return bench_finish();
+}
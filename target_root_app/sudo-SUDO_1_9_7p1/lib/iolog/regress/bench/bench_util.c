@@ -0,0 +1,382 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * This is an open source non-commercial project. Dear PVS-Studio, please check it.
+ * PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_fatal.h"
+#include "sudo_json.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "iolog_json.h"
+#include "bench_util.h"
+
+struct bench_result {
+    char *name;
+    size_t bytes;
+    unsigned long long iters;
+    long long ps_per_op;
+};
+
+volatile size_t bench_sink;
+
+static struct bench_result *results;
+static size_t nresults, results_size;
+static struct json_object baseline;
+static bool have_baseline;
+static const char *filter;
+static const char *output_file;
+static long long batch_nsec = 20000000LL;
+static unsigned int repetitions = 9;
+static unsigned int threshold = 10;
+static unsigned int regressions;
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: %s [-b baseline] [-f prefix] [-o output] "
+	"[-r repetitions] [-T msec] [-t percent]\n", getprogname());
+    exit(EXIT_FAILURE);
+}
+
+static unsigned int
+bench_strtonum(const char *str, unsigned int maxval, const char *what)
+{
+    const char *errstr;
+    unsigned int ret;
+
+    ret = sudo_strtonum(str, 1, maxval, &errstr);
+    if (errstr != NULL)
+	sudo_fatalx("invalid %s %s: %s", what, str, errstr);
+    return ret;
+}
+
+/*
+ * Load a baseline written by an earlier run with the -o option.
+ * A missing baseline is not an error, there is just nothing to compare.
+ */
+static bool
+bench_load_baseline(const char *path)
+{
+    FILE *fp;
+    bool ret;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+	if (errno != ENOENT)
+	    sudo_warn("%s", path);
+	return false;
+    }
+    ret = iolog_parse_json(fp, path, &baseline);
+    fclose(fp);
+    return ret;
+}
+
+/*
+ * Look up the picoseconds per operation for the named benchmark
+ * in the baseline.  Returns -1 if not present.
+ */
+static long long
+bench_baseline_lookup(const char *name)
+{
+    struct json_item *item;
+    struct json_object *object;
+
+    if (!have_baseline)
+	return -1;
+
+    /* The first object holds all the actual data. */
+    item = TAILQ_FIRST(&baseline.items);
+    if (item == NULL || item->type != JSON_OBJECT)
+	return -1;
+    object = &item->u.child;
+
+    TAILQ_FOREACH(item, &object->items, entries) {
+	if (item->type == JSON_OBJECT && strcmp(item->name, "benchmarks") == 0)
+	    break;
+    }
+    if (item == NULL)
+	return -1;
+    object = &item->u.child;
+
+    TAILQ_FOREACH(item, &object->items, entries) {
+	if (item->type == JSON_OBJECT && strcmp(item->name, name) == 0)
+	    break;
+    }
+    if (item == NULL)
+	return -1;
+    object = &item->u.child;
+
+    TAILQ_FOREACH(item, &object->items, entries) {
+	if (item->type == JSON_NUMBER && strcmp(item->name, "ps_per_op") == 0)
+	    return item->u.number;
+    }
+    return -1;
+}
+
+void
+bench_init(int argc, char *argv[])
+{
+    const char *baseline_file = NULL;
+    int ch;
+
+    initprogname(argc > 0 ? argv[0] : "bench");
+
+    while ((ch = getopt(argc, argv, "b:f:o:r:T:t:")) != -1) {
+	switch (ch) {
+	case 'b':
+	    baseline_file = optarg;
+	    break;
+	case 'f':
+	    filter = optarg;
+	    break;
+	case 'o':
+	    output_file = optarg;
+	    break;
+	case 'r':
+	    repetitions = bench_strtonum(optarg, 1000, "repetition count");
+	    break;
+	case 'T':
+	    batch_nsec = bench_strtonum(optarg, 60000, "batch time") *
+		1000000LL;
+	    break;
+	case 't':
+	    threshold = bench_strtonum(optarg, 1000, "threshold");
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc != optind)
+	usage();
+
+    TAILQ_INIT(&baseline.items);
+    if (baseline_file != NULL)
+	have_baseline = bench_load_baseline(baseline_file);
+
+    printf("%-36s %10s %12s %10s %9s\n", "benchmark", "bytes/op",
+	"ns/op", "MB/s", "baseline");
+}
+
+/*
+ * Run fn iters times, returning the elapsed time in nanoseconds.
+ */
+static long long
+bench_batch(bench_func_t fn, void *closure, unsigned long long iters)
+{
+    struct timespec start, stop;
+
+    sudo_gettime_mono(&start);
+    while (iters-- > 0)
+	fn(closure);
+    sudo_gettime_mono(&stop);
+    sudo_timespecsub(&stop, &start, &stop);
+    return (long long)stop.tv_sec * 1000000000LL + stop.tv_nsec;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+void
+bench_run(const char *name, size_t bytes, bench_func_t fn, void *closure)
+{
+    struct bench_result *result;
+    unsigned long long iters = 1;
+    long long nsec, base;
+    double *samples, median;
+    unsigned int i;
+
+    if (filter != NULL && strncmp(name, filter, strlen(filter)) != 0)
+	return;
+
+    /*
+     * Find a batch size that runs for at least batch_nsec.
+     * This also serves to warm up the caches and the allocator.
+     */
+    for (;;) {
+	nsec = bench_batch(fn, closure, iters);
+	if (nsec >= batch_nsec)
+	    break;
+	if (nsec < batch_nsec / 100)
+	    iters *= 100;
+	else
+	    iters = iters * batch_nsec * 11 / (nsec * 10) + 1;
+    }
+
+    samples = reallocarray(NULL, repetitions, sizeof(*samples));
+    if (samples == NULL)
+	sudo_fatalx("%s: %s", __func__, "unable to allocate memory");
+    for (i = 0; i < repetitions; i++)
+	samples[i] = (double)bench_batch(fn, closure, iters) / (double)iters;
+    qsort(samples, repetitions, sizeof(*samples), bench_cmp);
+    median = samples[repetitions / 2];
+    free(samples);
+
+    if (nresults == results_size) {
+	result = reallocarray(results, results_size + 32, sizeof(*results));
+	if (result == NULL)
+	    sudo_fatalx("%s: %s", __func__, "unable to allocate memory");
+	results = result;
+	results_size += 32;
+    }
+    result = &results[nresults++];
+    if ((result->name = strdup(name)) == NULL)
+	sudo_fatalx("%s: %s", __func__, "unable to allocate memory");
+    result->bytes = bytes;
+    result->iters = iters;
+    result->ps_per_op = (long long)(median * 1000.0 + 0.5);
+
+    printf("%-36s %10zu %12.1f ", name, bytes, median);
+    if (bytes != 0)
+	printf("%10.1f ", (double)bytes * 1000.0 / median);
+    else
+	printf("%10s ", "-");
+    base = bench_baseline_lookup(name);
+    if (base > 0) {
+	const double delta =
+	    (double)(result->ps_per_op - base) * 100.0 / (double)base;
+
+	printf("%+8.1f%%", delta);
+	if (delta > (double)threshold) {
+	    printf(" REGRESSION");
+	    regressions++;
+	}
+    } else {
+	printf("%9s", "-");
+    }
+    putchar('\n');
+    fflush(stdout);
+}
+
+/*
+ * Write results in JSON format, suitable for use as a baseline.
+ * Times are stored as integer picoseconds per operation since
+ * the I/O log JSON parser only supports integer numbers.
+ */
+static bool
+bench_write_json(const char *path)
+{
+    struct json_container json;
+    struct json_value json_value;
+    bool ret = false;
+    FILE *fp = NULL;
+    size_t i;
+
+    if (!sudo_json_init(&json, 4, false, false))
+	return false;
+
+    json_value.type = JSON_STRING;
+    json_value.u.string = getprogname();
+    if (!sudo_json_add_value(&json, "program", &json_value))
+	goto done;
+    json_value.type = JSON_NUMBER;
+    json_value.u.number = repetitions;
+    if (!sudo_json_add_value(&json, "repetitions", &json_value))
+	goto done;
+
+    if (!sudo_json_open_object(&json, "benchmarks"))
+	goto done;
+    for (i = 0; i < nresults; i++) {
+	struct bench_result *result = &results[i];
+
+	if (!sudo_json_open_object(&json, result->name))
+	    goto done;
+	json_value.type = JSON_NUMBER;
+	json_value.u.number = (long long)result->iters;
+	if (!sudo_json_add_value(&json, "iterations", &json_value))
+	    goto done;
+	json_value.u.number = (long long)result->bytes;
+	if (!sudo_json_add_value(&json, "bytes_per_op", &json_value))
+	    goto done;
+	json_value.u.number = result->ps_per_op;
+	if (!sudo_json_add_value(&json, "ps_per_op", &json_value))
+	    goto done;
+	if (!sudo_json_close_object(&json))
+	    goto done;
+    }
+    if (!sudo_json_close_object(&json))
+	goto done;
+
+    if ((fp = fopen(path, "w")) == NULL) {
+	sudo_warn("%s", path);
+	goto done;
+    }
+    fprintf(fp, "{%s\n}\n", sudo_json_get_buf(&json));
+    fflush(fp);
+    if (ferror(fp)) {
+	sudo_warn("%s", path);
+	goto done;
+    }
+    ret = true;
+
+done:
+    if (fp != NULL)
+	fclose(fp);
+    sudo_json_free(&json);
+    return ret;
+}
+
+/*
+ * Write the results file (if any) and free resources.
+ * Returns the exit value for the benchmark program.
+ */
+int
+bench_finish(void)
+{
+    int ret = EXIT_SUCCESS;
+    size_t i;
+
+    if (output_file != NULL && !bench_write_json(output_file))
+	ret = EXIT_FAILURE;
+    if (regressions != 0) {
+	printf("%u benchmark(s) more than %u%% slower than the baseline\n",
+	    regressions, threshold);
+	ret = EXIT_FAILURE;
+    }
+
+    for (i = 0; i < nresults; i++)
+	free(results[i].name);
+    free(results);
+    free_json_items(&baseline.items);
+
+    return ret;
+}
@@ -0,0 +1,38 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SUDO_BENCH_UTIL_H
+#define SUDO_BENCH_UTIL_H
+
+/*
+ * Minimal microbenchmark harness shared by the lib/iolog and logsrvd
+ * benchmarks.  Each case is a function that performs one operation.
+ * The reported time is the median of several timed batches, which
+ * is much less sensitive to scheduler noise than a single long run.
+ */
+
+typedef void (*bench_func_t)(void *closure);
+
+/* Prevent the compiler from discarding results. */
+extern volatile size_t bench_sink;
+
+void bench_init(int argc, char *argv[]);
+void bench_run(const char *name, size_t bytes, bench_func_t fn, void *closure);
+int bench_finish(void);
+
+#endif /* SUDO_BENCH_UTIL_H */
@@ -0,0 +1,526 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SUDO_ERROR_WRAP 0
+
+#include "sudo_compat.h"
+#include "sudo_digest.h"
+#include "sudo_fatal.h"
+#include "sudo_iolog.h"
+#include "sudo_util.h"
+#include "iolog_chunks.h"
+
+sudo_dso_public int main(int argc, char *argv[]);
+
+static int ntests, errors;
+
+/* Manifest under construction, see iolog_chunks.h for the format. */
+struct manifest {
+    char buf[8192];
+    size_t len;
+};
+
+static void
+manifest_init(struct manifest *m)
+{
+    memcpy(m->buf, IOLOG_CHUNKS_MAGIC, IOLOG_CHUNKS_MAGIC_LEN);
+    m->len = IOLOG_CHUNKS_MAGIC_LEN;
+}
+
+static void
+manifest_add(struct manifest *m, const void *data, size_t len,
+    const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(m->buf + m->len, sizeof(m->buf) - m->len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n + len >= sizeof(m->buf) - m->len)
+	sudo_fatalx("manifest too large");
+    m->len += n;
+    if (len != 0) {
+	memcpy(m->buf + m->len, data, len);
+	m->len += len;
+    }
+}
+
+static void
+write_file(int dfd, const char *name, const void *buf, size_t len)
+{
+    int fd;
+
+    fd = openat(dfd, name, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd == -1)
+	sudo_fatal("%s", name);
+    if (write(fd, buf, len) != (ssize_t)len)
+	sudo_fatal("%s", name);
+    close(fd);
+}
+
+/*
+ * Create an I/O log directory with an empty "chunks" subdirectory.
+ */
+static int
+make_session(int testfd, const char *name)
+{
+    int dfd;
+
+    if (mkdirat(testfd, name, S_IRWXU) == -1)
+	sudo_fatal("%s", name);
+    dfd = openat(testfd, name, O_RDONLY|O_DIRECTORY);
+    if (dfd == -1)
+	sudo_fatal("%s", name);
+    if (mkdirat(dfd, IOLOG_CHUNKS_DIR, S_IRWXU) == -1)
+	sudo_fatal("%s/%s", name, IOLOG_CHUNKS_DIR);
+    return dfd;
+}
+
+/*
+ * Store a chunk named by its SHA-256 digest in the chunk store, the
+ * way sudo_logsrvd does, and hard-link it into the I/O log directory.
+ */
+static void
+store_chunk(int storefd, int dfd, const void *data, size_t len, char *name)
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    unsigned char md[32];
+    struct sudo_digest *dig;
+    char subdir[3], path[3 + IOLOG_CHUNK_NAME_LEN + 1];
+    int fd, i;
+
+    if ((dig = sudo_digest_alloc(SUDO_DIGEST_SHA256)) == NULL)
+	sudo_fatalx("unable to allocate digest");
+    sudo_digest_update(dig, data, len);
+    sudo_digest_final(dig, md);
+    sudo_digest_free(dig);
+    for (i = 0; i < 32; i++) {
+	name[i * 2] = hexdigits[md[i] >> 4];
+	name[i * 2 + 1] = hexdigits[md[i] & 0x0f];
+    }
+    name[IOLOG_CHUNK_NAME_LEN] = '\0';
+
+    memcpy(subdir, name, 2);
+    subdir[2] = '\0';
+    if (mkdirat(storefd, subdir, S_IRWXU) == -1 && errno != EEXIST)
+	sudo_fatal("store/%s", subdir);
+    (void)snprintf(path, sizeof(path), "%s/%s", subdir, name);
+    fd = openat(storefd, path, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
+    if (fd != -1) {
+	if (write(fd, data, len) != (ssize_t)len)
+	    sudo_fatal("store/%s", path);
+	close(fd);
+    } else if (errno != EEXIST) {
+	sudo_fatal("store/%s", path);
+    }
+    if (dfd != -1) {
+	fd = openat(dfd, IOLOG_CHUNKS_DIR, O_RDONLY|O_DIRECTORY);
+	if (fd == -1)
+	    sudo_fatal("%s", IOLOG_CHUNKS_DIR);
+	if (linkat(storefd, path, fd, name, 0) == -1 && errno != EEXIST)
+	    sudo_fatal("link %s", name);
+	close(fd);
+    }
+}
+
+/*
+ * Returns the link count of a chunk in the store, 0 if it is gone.
+ */
+static nlink_t
+chunk_nlink(int storefd, const char *name)
+{
+    char path[3 + IOLOG_CHUNK_NAME_LEN + 1];
+    struct stat sb;
+
+    (void)snprintf(path, sizeof(path), "%.2s/%s", name, name);
+    if (fstatat(storefd, path, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+	if (errno != ENOENT)
+	    sudo_fatal("store/%s", path);
+	return 0;
+    }
+    return sb.st_nlink;
+}
+
+/*
+ * Read the stdout stream of an I/O log directory.  Returns the number
+ * of bytes read, or -1 if the stream could not be opened or read.
+ */
+static ssize_t
+read_stream(int dfd, off_t offset, char *buf, size_t bufsize)
+{
+    struct iolog_file iol;
+    const char *errstr;
+    size_t len = 0;
+    ssize_t nread;
+
+    memset(&iol, 0, sizeof(iol));
+    iol.enabled = true;
+    if (!iolog_open(&iol, dfd, IOFD_STDOUT, "r"))
+	return -1;
+    if (offset != 0 && iolog_seek(&iol, offset, SEEK_SET) == -1) {
+	iolog_close(&iol, NULL);
+	return -1;
+    }
+    while (len < bufsize) {
+	nread = iolog_read(&iol, buf + len, bufsize - len, &errstr);
+	if (nread == 0)
+	    break;
+	if (nread == -1) {
+	    iolog_close(&iol, NULL);
+	    return -1;
+	}
+	len += nread;
+    }
+    iolog_close(&iol, NULL);
+    return len;
+}
+
+/*
+ * Check that the stream reassembled from the manifest, starting at
+ * offset, matches the expected data.
+ */
+static void
+check_stream(int dfd, const char *desc, off_t offset, const char *expected,
+    size_t expected_len)
+{
+    char buf[64 * 1024];
+    ssize_t len;
+
+    ntests++;
+    len = read_stream(dfd, offset, buf, sizeof(buf));
+    if (len == -1) {
+	sudo_warnx("%s: unable to read stream", desc);
+	errors++;
+    } else if ((size_t)len != expected_len) {
+	sudo_warnx("%s: expected %zu bytes, got %zd", desc, expected_len, len);
+	errors++;
+    } else if (memcmp(buf, expected, expected_len) != 0) {
+	sudo_warnx("%s: stream does not match", desc);
+	errors++;
+    }
+}
+
+/*
+ * Check that a corrupt manifest or chunk is an error, not short data.
+ */
+static void
+check_corrupt(int testfd, const char *desc, const struct manifest *m)
+{
+    char buf[64 * 1024];
+    int dfd;
+
+    dfd = make_session(testfd, desc);
+    write_file(dfd, "stdout", m->buf, m->len);
+
+    ntests++;
+    if (read_stream(dfd, 0, buf, sizeof(buf)) != -1) {
+	sudo_warnx("%s: read succeeded", desc);
+	errors++;
+    }
+    close(dfd);
+}
+
+static void
+check_nlink(int storefd, const char *desc, const char *name, nlink_t expected)
+{
+    nlink_t nlink;
+
+    ntests++;
+    nlink = chunk_nlink(storefd, name);
+    if (nlink != expected) {
+	sudo_warnx("%s: expected link count %u, got %u", desc,
+	    (unsigned int)expected, (unsigned int)nlink);
+	errors++;
+    }
+}
+
+/*
+ * Run sudo_chunkgc with no grace period on the store.
+ */
+static void
+run_chunkgc(const char *chunkgc, const char *store)
+{
+    const char *argv[5];
+    int status;
+    pid_t pid;
+
+    argv[0] = "sudo_chunkgc";
+    argv[1] = "-g";
+    argv[2] = "0";
+    argv[3] = store;
+    argv[4] = NULL;
+
+    ntests++;
+    switch (pid = fork()) {
+    case -1:
+	sudo_fatal("fork");
+    case 0:
+	execv(chunkgc, (char **)argv);
+	_exit(127);
+    default:
+	break;
+    }
+    if (waitpid(pid, &status, 0) == -1)
+	sudo_fatal("waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	sudo_warnx("%s: exited with status 0x%x", chunkgc, status);
+	errors++;
+    }
+}
+
+static void
+remove_testdir(char *testdir)
+{
+    const char *rmargs[] = { "rm", "-rf", NULL, NULL };
+    int status;
+
+    /* Clean up (avoid running via shell) */
+    rmargs[2] = testdir;
+    switch (fork()) {
+    case -1:
+	sudo_warn("fork");
+	break;
+    case 0:
+	execvp("rm", (char **)rmargs);
+	_exit(1);
+    default:
+	wait(&status);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	    errors++;
+	break;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    char testdir[] = "/tmp/check_iolog_chunks.XXXXXX";
+    char name_a[IOLOG_CHUNK_NAME_LEN + 1], name_b[IOLOG_CHUNK_NAME_LEN + 1];
+    char name_c[IOLOG_CHUNK_NAME_LEN + 1], bad_name[IOLOG_CHUNK_NAME_LEN + 1];
+    char chunk_a[300], chunk_b[1000], chunk_c[IOLOG_CHUNK_MIN];
+    char expected[4096], store[PATH_MAX];
+    const char *chunkgc = NULL;
+    struct manifest m;
+    size_t len, i;
+    int testfd, storefd, dfd;
+
+    initprogname(argc > 0 ? argv[0] : "check_iolog_chunks");
+
+    /* The path to sudo_chunkgc is optional, the gc tests need it. */
+    if (argc > 1 && access(argv[1], X_OK) == 0)
+	chunkgc = argv[1];
+
+    if (mkdtemp(testdir) == NULL)
+	sudo_fatal("unable to create test dir");
+    if ((testfd = open(testdir, O_RDONLY|O_DIRECTORY)) == -1)
+	sudo_fatal("%s", testdir);
+    if (mkdirat(testfd, "store", S_IRWXU) == -1)
+	sudo_fatal("%s/store", testdir);
+    if ((storefd = openat(testfd, "store", O_RDONLY|O_DIRECTORY)) == -1)
+	sudo_fatal("%s/store", testdir);
+    (void)snprintf(store, sizeof(store), "%s/store", testdir);
+
+    for (i = 0; i < sizeof(chunk_a); i++)
+	chunk_a[i] = 'a' + (i % 26);
+    for (i = 0; i < sizeof(chunk_b); i++)
+	chunk_b[i] = '0' + (i % 10);
+    memset(chunk_c, 'c', sizeof(chunk_c));
+
+    /*
+     * Round trip: shared chunks, a chunk used twice, inline data and
+     * a provisional tail at the end that still contributes its data.
+     */
+    dfd = make_session(testfd, "roundtrip");
+    store_chunk(storefd, dfd, chunk_a, sizeof(chunk_a), name_a);
+    store_chunk(storefd, dfd, chunk_b, sizeof(chunk_b), name_b);
+    manifest_init(&m);
+    manifest_add(&m, NULL, 0, "c %s %zu\n", name_a, sizeof(chunk_a));
+    manifest_add(&m, "hello, world\n", 13, "d %d\n", 13);
+    manifest_add(&m, NULL, 0, "c %s %zu\n", name_b, sizeof(chunk_b));
+    manifest_add(&m, NULL, 0, "c %s %zu\n", name_a, sizeof(chunk_a));
+    manifest_add(&m, "partial", 7, "t %d\n", 7);
+    write_file(dfd, "stdout", m.buf, m.len);
+    len = 0;
+    memcpy(expected + len, chunk_a, sizeof(chunk_a));
+    len += sizeof(chunk_a);
+    memcpy(expected + len, "hello, world\n", 13);
+    len += 13;
+    memcpy(expected + len, chunk_b, sizeof(chunk_b));
+    len += sizeof(chunk_b);
+    memcpy(expected + len, chunk_a, sizeof(chunk_a));
+    len += sizeof(chunk_a);
+    memcpy(expected + len, "partial", 7);
+    len += 7;
+    check_stream(dfd, "round trip", 0, expected, len);
+    check_stream(dfd, "seek into inline data", 305, expected + 305,
+	len - 305);
+    check_stream(dfd, "seek into second chunk", 700, expected + 700,
+	len - 700);
+    check_nlink(storefd, "chunk in one session", name_a, 2);
+
+    /* A provisional tail is replaced by the record that follows it. */
+    close(dfd);
+    dfd = make_session(testfd, "tail");
+    store_chunk(storefd, dfd, chunk_a, sizeof(chunk_a), name_a);
+    store_chunk(storefd, dfd, chunk_b, sizeof(chunk_b), name_b);
+    manifest_init(&m);
+    manifest_add(&m, NULL, 0, "c %s %zu\n", name_a, sizeof(chunk_a));
+    manifest_add(&m, "0123", 4, "t %d\n", 4);
+    manifest_add(&m, NULL, 0, "c %s %zu\n", name_b, sizeof(chunk_b));
+    write_file(dfd, "stdout", m.buf, m.len);
+    memcpy(expected, chunk_a, sizeof(chunk_a));
+    memcpy(expected + sizeof(chunk_a), chunk_b, sizeof(chunk_b));
+    check_stream(dfd, "superseded tail", 0, expected,
+	sizeof(chunk_a) + sizeof(chunk_b));
+    check_nlink(storefd, "chunk in two sessions", name_a, 3);
+
+    /* A record truncated by a crash ends the stream. */
+    close(dfd);
+    dfd = make_session(testfd, "truncated");
+    store_chunk(storefd, dfd, chunk_a, sizeof(chunk_a), name_a);
+    manifest_init(&m);
+    manifest_add(&m, NULL, 0, "c %s %zu\n", name_a, sizeof(chunk_a));
+    manifest_add(&m, NULL, 0, "c %.20s", name_b);
+    write_file(dfd, "stdout", m.buf, m.len);
+    check_stream(dfd, "truncated record", 0, chunk_a, sizeof(chunk_a));
+    manifest_init(&m);
+    manifest_add(&m, NULL, 0, "c %s %zu\n", name_a, sizeof(chunk_a));
+    manifest_add(&m, "short", 5, "d %d\n", 100);
+    write_file(dfd, "stdout", m.buf, m.len);
+    check_stream(dfd, "truncated inline data", 0, chunk_a, sizeof(chunk_a));
+    close(dfd);
+
+    /* Corrupt manifests and chunks are errors. */
+    manifest_init(&m);
+    manifest_add(&m, "xyz", 3, "x %d\n", 3);
+    check_corrupt(testfd, "bad record type", &m);
+    memset(bad_name, 'G', IOLOG_CHUNK_NAME_LEN);
+    bad_name[IOLOG_CHUNK_NAME_LEN] = '\0';
+    manifest_init(&m);
+    manifest_add(&m, NULL, 0, "c %s %zu\n", bad_name, sizeof(chunk_a));
+    check_corrupt(testfd, "bad chunk name", &m);
+    manifest_init(&m);
+    manifest_add(&m, NULL, 0, "c %s %d\n", name_a, IOLOG_CHUNK_MAX + 1);
+    check_corrupt(testfd, "bad chunk length", &m);
+    manifest_init(&m);
+    manifest_add(&m, NULL, 0, "c %s %zu\n", name_b, sizeof(chunk_b));
+    check_corrupt(testfd, "missing chunk", &m);
+    manifest_init(&m);
+    manifest_add(&m, NULL, 0, "c %s %zu\n", name_a, sizeof(chunk_a) + 1);
+    dfd = make_session(testfd, "short chunk");
+    store_chunk(storefd, dfd, chunk_a, sizeof(chunk_a), name_a);
+    write_file(dfd, "stdout", m.buf, m.len);
+    ntests++;
+    if (read_stream(dfd, 0, expected, sizeof(expected)) != -1) {
+	sudo_warnx("short chunk: read succeeded");
+	errors++;
+    }
+    close(dfd);
+
+    /*
+     * sudo_chunkgc removes chunks only referenced by the store and
+     * stale temporary files but leaves chunks that are still in use.
+     */
+    if (chunkgc != NULL) {
+	store_chunk(storefd, -1, chunk_c, sizeof(chunk_c), name_c);
+	(void)snprintf(expected, sizeof(expected), "%.2s/.tmp.chunk", name_c);
+	write_file(storefd, expected, "x", 1);
+	check_nlink(storefd, "unreferenced chunk", name_c, 1);
+	check_nlink(storefd, "chunk before gc", name_a, 5);
+
+	run_chunkgc(chunkgc, store);
+	check_nlink(storefd, "unreferenced chunk after gc", name_c, 0);
+	check_nlink(storefd, "chunk after gc", name_a, 5);
+	check_nlink(storefd, "chunk in one session after gc", name_b, 3);
+	ntests++;
+	if (faccessat(storefd, expected, F_OK, 0) == 0) {
+	    sudo_warnx("stale temporary file not removed");
+	    errors++;
+	}
+	if ((dfd = openat(testfd, "roundtrip", O_RDONLY|O_DIRECTORY)) == -1)
+	    sudo_fatal("roundtrip");
+	len = 0;
+	memcpy(expected + len, chunk_a, sizeof(chunk_a));
+	len += sizeof(chunk_a);
+	memcpy(expected + len, "hello, world\n", 13);
+	len += 13;
+	memcpy(expected + len, chunk_b, sizeof(chunk_b));
+	len += sizeof(chunk_b);
+	memcpy(expected + len, chunk_a, sizeof(chunk_a));
+	len += sizeof(chunk_a);
+	memcpy(expected + len, "partial", 7);
+	len += 7;
+	check_stream(dfd, "round trip after gc", 0, expected, len);
+	close(dfd);
+
+	/* Removing the sessions drops their references. */
+	close(storefd);
+	close(testfd);
+	remove_testdir(testdir);
+	if (mkdir(testdir, S_IRWXU) == -1 ||
+		(testfd = open(testdir, O_RDONLY|O_DIRECTORY)) == -1)
+	    sudo_fatal("%s", testdir);
+	if (mkdirat(testfd, "store", S_IRWXU) == -1 ||
+		(storefd = openat(testfd, "store", O_RDONLY|O_DIRECTORY)) == -1)
+	    sudo_fatal("%s/store", testdir);
+	dfd = make_session(testfd, "expire");
+	store_chunk(storefd, dfd, chunk_a, sizeof(chunk_a), name_a);
+	check_nlink(storefd, "chunk in expiring session", name_a, 2);
+	(void)snprintf(expected, sizeof(expected), "%s/%s", IOLOG_CHUNKS_DIR,
+	    name_a);
+	if (unlinkat(dfd, expected, 0) == -1)
+	    sudo_fatal("%s", expected);
+	close(dfd);
+	check_nlink(storefd, "chunk of expired session", name_a, 1);
+	run_chunkgc(chunkgc, store);
+	check_nlink(storefd, "chunk of expired session after gc", name_a, 0);
+    } else {
+	printf("%s: sudo_chunkgc not found, skipping gc tests\n",
+	    getprogname());
+    }
+
+    close(storefd);
+    close(testfd);
+    remove_testdir(testdir);
+
+    if (ntests != 0) {
+	printf("%s: %d tests run, %d errors, %d%% success rate\n",
+	    getprogname(), ntests, errors, (ntests - errors) * 100 / ntests);
+    }
+    exit(errors);
+}
@@ -0,0 +1,315 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SUDO_ERROR_WRAP 0
+
+#include "sudo_compat.h"
+#include "sudo_fatal.h"
+#include "sudo_iolog.h"
+#include "sudo_util.h"
+#include "iolog_ctx.h"
+
+sudo_dso_public int main(int argc, char *argv[]);
+
+static int ntests, errors;
+
+/*
+ * For winsize records, val1 and val2 are the lines and columns.
+ * For suspend records, val1 is the signal number.
+ * For all other records, val1 is the number of bytes.
+ */
+static struct parse_timing_test {
+    const char *line;
+    bool valid;
+    int event;
+    struct timespec delay;
+    long val1, val2;
+} parse_timing_tests[] = {
+    { "0 0.000001 5", true, IO_EVENT_STDIN, { 0, 1000 }, 5, 0 },
+    { "1 1.5 1024", true, IO_EVENT_STDOUT, { 1, 500000000 }, 1024, 0 },
+    { "2 0.0 1", true, IO_EVENT_STDERR, { 0, 0 }, 1, 0 },
+    { "3 0.25 2", true, IO_EVENT_TTYIN, { 0, 250000000 }, 2, 0 },
+    { "4 12.000000001 80", true, IO_EVENT_TTYOUT, { 12, 1 }, 80, 0 },
+    { "5 0.1 24 80", true, IO_EVENT_WINSIZE, { 0, 100000000 }, 24, 80 },
+    { "7 2.0 TSTP", true, IO_EVENT_SUSPEND, { 2, 0 }, SIGTSTP, 0 },
+    { "7 0.5 CONT", true, IO_EVENT_SUSPEND, { 0, 500000000 }, SIGCONT, 0 },
+    { "", false },
+    { "4", false },
+    { "4 0.5", false },
+    { "4 0 10", false },
+    { "x 0.5 10", false },
+    { "8 0.5 10", false },
+    { "4 x 10", false },
+    { "4 0.5 10x", false },
+    { "4 0.5 -", false },
+    { "5 0.5 24", false },
+    { "5 0.5 24 x", false },
+    { "7 0.5 NOTASIGNAL", false },
+    { NULL }
+};
+
+static void
+check_timing(struct iolog_timing_parser *parser, const char *desc,
+    const char *line, int expected_event)
+{
+    struct timing_closure timing;
+
+    ntests++;
+    memset(&timing, 0, sizeof(timing));
+    timing.decimal = ".";
+    if (!iolog_parse_timing_r(parser, line, &timing)) {
+	sudo_warnx("%s: unable to parse \"%s\"", desc, line);
+	errors++;
+    } else if (timing.event != expected_event) {
+	sudo_warnx("%s: \"%s\": expected event %d, got %d", desc, line,
+	    expected_event, timing.event);
+	errors++;
+    }
+}
+
+static void
+test_parse_timing(void)
+{
+    struct iolog_timing_parser parser = IOLOG_TIMING_PARSER_INITIALIZER;
+    struct iolog_timing_parser other = IOLOG_TIMING_PARSER_INITIALIZER;
+    struct parse_timing_test *test;
+    struct timing_closure timing;
+    bool ok;
+
+    for (test = parse_timing_tests; test->line != NULL; test++) {
+	ntests++;
+	memset(&timing, 0, sizeof(timing));
+	timing.decimal = ".";
+	ok = iolog_parse_timing_r(&parser, test->line, &timing);
+	if (ok != test->valid) {
+	    sudo_warnx("\"%s\": expected %s, got %s", test->line,
+		test->valid ? "success" : "failure",
+		ok ? "success" : "failure");
+	    errors++;
+	    continue;
+	}
+	if (!ok)
+	    continue;
+	if (timing.event != test->event) {
+	    sudo_warnx("\"%s\": expected event %d, got %d", test->line,
+		test->event, timing.event);
+	    errors++;
+	    continue;
+	}
+	if (timing.delay.tv_sec != test->delay.tv_sec ||
+		timing.delay.tv_nsec != test->delay.tv_nsec) {
+	    sudo_warnx("\"%s\": expected delay %lld.%09ld, got %lld.%09ld",
+		test->line, (long long)test->delay.tv_sec,
+		test->delay.tv_nsec, (long long)timing.delay.tv_sec,
+		timing.delay.tv_nsec);
+	    errors++;
+	    continue;
+	}
+	switch (test->event) {
+	case IO_EVENT_WINSIZE:
+	    ok = timing.u.winsize.lines == test->val1 &&
+		timing.u.winsize.cols == test->val2;
+	    break;
+	case IO_EVENT_SUSPEND:
+	    ok = timing.u.signo == test->val1;
+	    break;
+	default:
+	    ok = timing.u.nbytes == (size_t)test->val1;
+	    break;
+	}
+	if (!ok) {
+	    sudo_warnx("\"%s\": unexpected record value", test->line);
+	    errors++;
+	}
+    }
+
+    /*
+     * Sudo 1.8.7 wrote terminal output as event 6; once seen, later
+     * events in that log are shifted by two.  This must only affect
+     * the parser that read the 1.8.7 record.
+     */
+    check_timing(&parser, "sudo 1.8.7 log", "6 0.5 10", IO_EVENT_TTYOUT);
+    check_timing(&parser, "sudo 1.8.7 log", "3 0.5 10", IO_EVENT_STDOUT);
+    check_timing(&other, "other log", "3 0.5 10", IO_EVENT_TTYIN);
+    check_timing(&other, "other log", "4 0.5 10", IO_EVENT_TTYOUT);
+    ntests++;
+    if (other.event_adj != 0) {
+	sudo_warnx("other log: event adjustment changed to %d",
+	    other.event_adj);
+	errors++;
+    }
+}
+
+static void
+check_mode(int dfd, const char *desc, const char *path, mode_t expected)
+{
+    struct stat sb;
+
+    ntests++;
+    if (fstatat(dfd, path, &sb, 0) == -1) {
+	sudo_warn("%s: %s", desc, path);
+	errors++;
+	return;
+    }
+    if ((sb.st_mode & ALLPERMS) != expected) {
+	sudo_warnx("%s: expected mode 0%o, got 0%o", desc,
+	    (unsigned int)expected, (unsigned int)(sb.st_mode & ALLPERMS));
+	errors++;
+    }
+}
+
+static void
+check_openat(const struct iolog_ctx *ctx, int dfd, const char *desc,
+    const char *path, int flags, int expected_errno)
+{
+    int fd;
+
+    ntests++;
+    fd = iolog_ctx_openat(ctx, dfd, path, flags);
+    if (expected_errno == 0) {
+	if (fd == -1) {
+	    sudo_warn("%s: unable to open %s", desc, path);
+	    errors++;
+	}
+    } else {
+	if (fd != -1) {
+	    sudo_warnx("%s: open of %s succeeded", desc, path);
+	    errors++;
+	} else if (errno != expected_errno) {
+	    sudo_warn("%s: expected %s, got", desc, strerror(expected_errno));
+	    errors++;
+	}
+    }
+    if (fd != -1)
+	close(fd);
+}
+
+static void
+test_openat(int dfd)
+{
+    struct iolog_ctx ctx;
+    mode_t omask;
+    int fd;
+
+    /* New files must get the I/O log mode regardless of the umask. */
+    omask = umask(S_IRWXG|S_IRWXO);
+
+    iolog_ctx_init(&ctx);
+    check_openat(&ctx, dfd, "default mode", "default", O_WRONLY|O_CREAT, 0);
+    check_mode(dfd, "default mode", "default", S_IRUSR|S_IWUSR);
+
+    iolog_ctx_set_mode(&ctx, S_IRUSR|S_IWUSR|S_IRGRP);
+    check_openat(&ctx, dfd, "mode 0640", "group", O_WRONLY|O_CREAT, 0);
+    check_mode(dfd, "mode 0640", "group", S_IRUSR|S_IWUSR|S_IRGRP);
+
+    iolog_ctx_set_mode(&ctx,
+	S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+    check_openat(&ctx, dfd, "mode 0666", "world", O_RDWR|O_CREAT|O_TRUNC, 0);
+    check_mode(dfd, "mode 0666", "world",
+	S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+
+    /* An existing file keeps its mode. */
+    fd = openat(dfd, "existing", O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
+    if (fd == -1)
+	sudo_fatal("existing");
+    close(fd);
+    check_openat(&ctx, dfd, "existing file", "existing",
+	O_WRONLY|O_CREAT|O_TRUNC, 0);
+    check_mode(dfd, "existing file", "existing", S_IRUSR|S_IWUSR);
+
+    /* O_EXCL from the caller is honored. */
+    check_openat(&ctx, dfd, "exclusive create", "existing",
+	O_WRONLY|O_CREAT|O_EXCL, EEXIST);
+    check_openat(&ctx, dfd, "exclusive create", "exclusive",
+	O_WRONLY|O_CREAT|O_EXCL, 0);
+    check_mode(dfd, "exclusive create", "exclusive",
+	S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+
+    /* Without O_CREAT, a missing file is not created. */
+    check_openat(&ctx, dfd, "no create", "missing", O_RDONLY, ENOENT);
+
+    (void)umask(omask);
+}
+
+static void
+remove_testdir(char *testdir)
+{
+    const char *rmargs[] = { "rm", "-rf", NULL, NULL };
+    int status;
+
+    /* Clean up (avoid running via shell) */
+    rmargs[2] = testdir;
+    switch (fork()) {
+    case -1:
+	sudo_warn("fork");
+	break;
+    case 0:
+	execvp("rm", (char **)rmargs);
+	_exit(1);
+    default:
+	wait(&status);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	    errors++;
+	break;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    char testdir[] = "/tmp/check_iolog_ctx.XXXXXX";
+    int dfd;
+
+    initprogname(argc > 0 ? argv[0] : "check_iolog_ctx");
+
+    test_parse_timing();
+
+    if (mkdtemp(testdir) == NULL)
+	sudo_fatal("unable to create test dir");
+    if ((dfd = open(testdir, O_RDONLY|O_DIRECTORY)) == -1)
+	sudo_fatal("%s", testdir);
+    test_openat(dfd);
+    close(dfd);
+    remove_testdir(testdir);
+
+    if (ntests != 0) {
+	printf("%s: %d tests run, %d errors, %d%% success rate\n",
+	    getprogname(), ntests, errors, (ntests - errors) * 100 / ntests);
+    }
+    exit(errors);
+}
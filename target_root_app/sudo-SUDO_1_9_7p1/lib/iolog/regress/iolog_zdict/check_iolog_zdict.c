@@ -0,0 +1,337 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <fcntl.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB_H
+# include <zlib.h>
+#endif
+
+#define SUDO_ERROR_WRAP 0
+
+#include "sudo_compat.h"
+#include "sudo_fatal.h"
+#include "sudo_iolog.h"
+#include "sudo_util.h"
+#include "iolog_zdict.h"
+
+sudo_dso_public int main(int argc, char *argv[]);
+
+#if defined(HAVE_ZLIB_H) && (defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN))
+
+static int ntests, errors;
+
+static const char dictionary[] =
+    "\033[01;34m\033[0m\033[01;32m\r\nroot@localhost:~# ls -l total drwxr-xr-x";
+
+static const char session[] =
+    "\033[01;34mbin\033[0m  \033[01;32mconfigure\033[0m\r\n"
+    "root@localhost:~# ls -l\r\ntotal 8\r\n"
+    "drwxr-xr-x 2 root root 4096 Jan  1 00:00 \033[01;34mbin\033[0m\r\n"
+    "-rwxr-xr-x 1 root root 4096 Jan  1 00:00 \033[01;32mconfigure\033[0m\r\n"
+    "root@localhost:~# exit\r\n";
+
+/*
+ * Compress data using the preset dictionary into buf, the way
+ * sudo_logsrvd writes a dictionary stream.  If finish is false,
+ * the stream ends at a sync flush as if it were still being written.
+ */
+static size_t
+compress_stream(const char *dict, size_t dictlen, const char *data,
+    size_t len, bool finish, unsigned char *buf, size_t bufsize)
+{
+    z_stream strm;
+    int rc;
+
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit(&strm, Z_BEST_COMPRESSION) != Z_OK)
+	sudo_fatalx("unable to initialize zlib stream");
+    if (dict != NULL) {
+	if (deflateSetDictionary(&strm, (const unsigned char *)dict,
+		(unsigned int)dictlen) != Z_OK)
+	    sudo_fatalx("unable to set dictionary");
+    }
+    strm.next_in = (unsigned char *)data;
+    strm.avail_in = (unsigned int)len;
+    strm.next_out = buf;
+    strm.avail_out = (unsigned int)bufsize;
+    rc = deflate(&strm, finish ? Z_FINISH : Z_SYNC_FLUSH);
+    if (rc != (finish ? Z_STREAM_END : Z_OK))
+	sudo_fatalx("unable to compress stream");
+    len = bufsize - strm.avail_out;
+    deflateEnd(&strm);
+
+    return len;
+}
+
+static void
+write_file(int dfd, const char *name, const void *buf, size_t len)
+{
+    int fd;
+
+    fd = openat(dfd, name, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd == -1)
+	sudo_fatal("%s", name);
+    if (write(fd, buf, len) != (ssize_t)len)
+	sudo_fatal("%s", name);
+    close(fd);
+}
+
+/*
+ * Create an I/O log directory whose stdout is buf and, if dict is
+ * not NULL, store the dictionary under the given dictionary ID.
+ */
+static int
+make_session(int testfd, const char *name, const void *buf, size_t len,
+    const char *dict, size_t dictlen, unsigned int dictid)
+{
+    char dictname[IOLOG_ZDICT_NAME_LEN + 1];
+    int dfd;
+
+    if (mkdirat(testfd, name, S_IRWXU) == -1)
+	sudo_fatal("%s", name);
+    dfd = openat(testfd, name, O_RDONLY|O_DIRECTORY);
+    if (dfd == -1)
+	sudo_fatal("%s", name);
+    write_file(dfd, "stdout", buf, len);
+    if (dict != NULL) {
+	iolog_zdict_name(dictid, dictname, sizeof(dictname));
+	write_file(dfd, dictname, dict, dictlen);
+    }
+    return dfd;
+}
+
+/*
+ * Read the stdout stream of an I/O log directory, seeking to offset
+ * first.  Returns the number of bytes read, or -1 on error.
+ */
+static ssize_t
+read_stream(int dfd, off_t offset, char *buf, size_t bufsize)
+{
+    struct iolog_file iol;
+    const char *errstr;
+    size_t len = 0;
+    ssize_t nread;
+
+    memset(&iol, 0, sizeof(iol));
+    iol.enabled = true;
+    if (!iolog_open(&iol, dfd, IOFD_STDOUT, "r"))
+	return -1;
+    if (offset != 0) {
+	/* Read past the target first so the seek has to go backwards. */
+	nread = iolog_read(&iol, buf, bufsize, &errstr);
+	if (nread == -1 || iolog_seek(&iol, offset, SEEK_SET) == -1) {
+	    iolog_close(&iol, NULL);
+	    return -1;
+	}
+    }
+    while (len < bufsize) {
+	nread = iolog_read(&iol, buf + len, bufsize - len, &errstr);
+	if (nread == 0)
+	    break;
+	if (nread == -1) {
+	    iolog_close(&iol, NULL);
+	    return -1;
+	}
+	len += nread;
+    }
+    iolog_close(&iol, NULL);
+    return len;
+}
+
+static void
+check_stream(int dfd, const char *desc, off_t offset, const void *expected,
+    size_t expected_len)
+{
+    char buf[8192];
+    ssize_t len;
+
+    ntests++;
+    len = read_stream(dfd, offset, buf, sizeof(buf));
+    if (len == -1) {
+	sudo_warnx("%s: unable to read stream", desc);
+	errors++;
+    } else if ((size_t)len != expected_len) {
+	sudo_warnx("%s: expected %zu bytes, got %zd", desc, expected_len, len);
+	errors++;
+    } else if (memcmp(buf, expected, expected_len) != 0) {
+	sudo_warnx("%s: stream does not match", desc);
+	errors++;
+    }
+}
+
+static void
+check_probe(int dfd, const char *desc, bool expected,
+    unsigned int expected_dictid)
+{
+    unsigned int dictid = 0;
+    bool ret;
+    int fd;
+
+    if ((fd = openat(dfd, "stdout", O_RDONLY)) == -1)
+	sudo_fatal("%s: stdout", desc);
+    ntests++;
+    ret = iolog_zdict_probe(dfd, fd, &dictid);
+    if (ret != expected) {
+	sudo_warnx("%s: probe returned %s, expected %s", desc,
+	    ret ? "true" : "false", expected ? "true" : "false");
+	errors++;
+    } else if (ret && dictid != expected_dictid) {
+	sudo_warnx("%s: dictionary ID %08x, expected %08x", desc, dictid,
+	    expected_dictid);
+	errors++;
+    }
+    close(fd);
+}
+
+static void
+remove_testdir(char *testdir)
+{
+    const char *rmargs[] = { "rm", "-rf", NULL, NULL };
+    int status;
+
+    /* Clean up (avoid running via shell) */
+    rmargs[2] = testdir;
+    switch (fork()) {
+    case -1:
+	sudo_warn("fork");
+	break;
+    case 0:
+	execvp("rm", (char **)rmargs);
+	_exit(1);
+    default:
+	wait(&status);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	    errors++;
+	break;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    char testdir[] = "/tmp/check_iolog_zdict.XXXXXX";
+    const size_t dictlen = sizeof(dictionary) - 1;
+    const size_t sesslen = sizeof(session) - 1;
+    unsigned char zbuf[4096];
+    char buf[8192];
+    unsigned int dictid;
+    int testfd, dfd;
+    size_t zlen;
+
+    initprogname(argc > 0 ? argv[0] : "check_iolog_zdict");
+
+    if (mkdtemp(testdir) == NULL)
+	sudo_fatal("unable to create test dir");
+    if ((testfd = open(testdir, O_RDONLY|O_DIRECTORY)) == -1)
+	sudo_fatal("%s", testdir);
+
+    dictid = adler32(adler32(0, NULL, 0), (const unsigned char *)dictionary,
+	(unsigned int)dictlen);
+
+    /* Round trip, including a backwards seek that restarts inflate. */
+    zlen = compress_stream(dictionary, dictlen, session, sesslen, true,
+	zbuf, sizeof(zbuf));
+    dfd = make_session(testfd, "roundtrip", zbuf, zlen, dictionary, dictlen,
+	dictid);
+    check_probe(dfd, "round trip", true, dictid);
+    check_stream(dfd, "round trip", 0, session, sesslen);
+    check_stream(dfd, "seek backwards", 42, session + 42, sesslen - 42);
+    close(dfd);
+
+    /* A log that is still being written ends at the last flush. */
+    zlen = compress_stream(dictionary, dictlen, session, sesslen, false,
+	zbuf, sizeof(zbuf));
+    dfd = make_session(testfd, "unfinished", zbuf, zlen, dictionary, dictlen,
+	dictid);
+    check_stream(dfd, "unfinished stream", 0, session, sesslen);
+    close(dfd);
+
+    /* A dictionary that does not match its DICTID is an error. */
+    zlen = compress_stream(dictionary, dictlen, session, sesslen, true,
+	zbuf, sizeof(zbuf));
+    dfd = make_session(testfd, "mismatch", zbuf, zlen, session, sesslen,
+	dictid);
+    check_probe(dfd, "dictionary mismatch", true, dictid);
+    ntests++;
+    if (read_stream(dfd, 0, buf, sizeof(buf)) != -1) {
+	sudo_warnx("dictionary mismatch: read succeeded");
+	errors++;
+    }
+    close(dfd);
+
+    /* Without the dictionary, the stream is not treated as compressed. */
+    dfd = make_session(testfd, "missing", zbuf, zlen, NULL, 0, 0);
+    check_probe(dfd, "missing dictionary", false, 0);
+    check_stream(dfd, "missing dictionary", 0, zbuf, zlen);
+    close(dfd);
+
+    /* A zlib stream without FDICT is not a dictionary stream. */
+    zlen = compress_stream(NULL, 0, session, sesslen, true, zbuf,
+	sizeof(zbuf));
+    dfd = make_session(testfd, "nodict", zbuf, zlen, dictionary, dictlen,
+	dictid);
+    check_probe(dfd, "FDICT clear", false, 0);
+    close(dfd);
+
+    /* Nor is a header that fails the check bits. */
+    zlen = compress_stream(dictionary, dictlen, session, sesslen, true,
+	zbuf, sizeof(zbuf));
+    zbuf[1] ^= 0x01;
+    dfd = make_session(testfd, "badcheck", zbuf, zlen, dictionary, dictlen,
+	dictid);
+    check_probe(dfd, "bad header check", false, 0);
+    close(dfd);
+
+    close(testfd);
+    remove_testdir(testdir);
+
+    if (ntests != 0) {
+	printf("%s: %d tests run, %d errors, %d%% success rate\n",
+	    getprogname(), ntests, errors, (ntests - errors) * 100 / ntests);
+    }
+    exit(errors);
+}
+
+#else
+
+int
+main(int argc, char *argv[])
+{
+    initprogname(argc > 0 ? argv[0] : "check_iolog_zdict");
+
+    printf("%s: dictionary-compressed I/O logs not supported, skipping\n",
+	getprogname());
+    exit(0);
+}
+
+#endif /* HAVE_ZLIB_H && (HAVE_FOPENCOOKIE || HAVE_FUNOPEN) */
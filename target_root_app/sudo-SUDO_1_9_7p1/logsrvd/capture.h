@@ -0,0 +1,53 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SUDO_CAPTURE_H
+#define SUDO_CAPTURE_H
+
+/*
+ * Traffic capture files.
+ *
+ * If capture_dir is set, sudo_logsrvd stores the ClientMessage stream
+ * of each client connection in its own file, suitable for replaying
+ * with sudo_logreplay.  All integers are in network byte order.
+ *
+ *   header: uint32 magic, uint32 version,
+ *	     int64 seconds, uint32 nanoseconds (wall clock time of the
+ *	     first message)
+ *   record: uint32 seconds, uint32 nanoseconds (arrival time relative
+ *	     to the first message), followed by the message as framed
+ *	     on the wire: uint32 length + ClientMessage
+ *
+ * Apart from the time stamp, a record is the same as a journal record.
+ * Captures contain everything the client sent, including I/O log data,
+ * and are only readable by root.
+ */
+
+#define CAPTURE_MAGIC		0x53434150U	/* "SCAP" */
+#define CAPTURE_VERSION		1
+#define CAPTURE_SUFFIX		".cap"
+#define CAPTURE_HEADER_SIZE	(2 * 4 + 8 + 4)
+#define CAPTURE_RECORD_SIZE	(2 * 4)
+
+/* logsrvd_capture.c */
+struct connection_closure;
+void capture_message(struct connection_closure *closure, const struct timespec *arrival, const uint8_t *buf, size_t len);
+void capture_close(struct connection_closure *closure);
+void capture_dump(void);
+
+#endif /* SUDO_CAPTURE_H */
@@ -0,0 +1,763 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <limits.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_util.h"
+
+#include "evstore.h"
+
+#define EVSTORE_STRING_MAX	0xffff
+
+/*
+ * String dictionary for a single column of a block.
+ * The hash table stores index + 1 so that zero means empty.
+ */
+struct evstore_dict {
+    char **strings;
+    size_t *lengths;
+    unsigned int count;
+    unsigned int size;
+    unsigned int *table;
+    unsigned int table_size;
+    size_t bytes;
+};
+
+struct evstore_block {
+    unsigned int nrows;
+    time_t min_time;
+    time_t max_time;
+    struct timespec times[EVSTORE_BLOCK_ROWS];
+    unsigned char types[EVSTORE_BLOCK_ROWS];
+    unsigned int indices[EVSTORE_NCOLS][EVSTORE_BLOCK_ROWS];
+    struct evstore_dict dicts[EVSTORE_NCOLS];
+};
+
+/* Dictionary entry in a block being read. */
+struct evstore_string {
+    const char *str;
+};
+
+static const char *evstore_type_names[] = {
+    "accept",
+    "reject",
+    "alert"
+};
+
+static const char *evstore_column_names[] = {
+    "user",
+    "host",
+    "runuser",
+    "command",
+    "reason"
+};
+
+const char *
+evstore_type_name(enum evstore_type type)
+{
+    if ((unsigned int)type >= EVSTORE_NTYPES)
+	return "unknown";
+    return evstore_type_names[type];
+}
+
+const char *
+evstore_column_name(enum evstore_column col)
+{
+    if ((unsigned int)col >= EVSTORE_NCOLS)
+	return "unknown";
+    return evstore_column_names[col];
+}
+
+/* FNV-1a hash */
+static unsigned int
+evstore_hash(const char *str, size_t len)
+{
+    unsigned int h = 2166136261U;
+
+    while (len--) {
+	h ^= (unsigned char)*str++;
+	h *= 16777619U;
+    }
+    return h;
+}
+
+/*
+ * Number of bytes used to store an index into a dictionary of size count.
+ */
+static unsigned int
+evstore_index_width(unsigned int count)
+{
+    if (count <= 0x100)
+	return 1;
+    if (count <= 0x10000)
+	return 2;
+    return 4;
+}
+
+static void
+evstore_dict_reset(struct evstore_dict *dict)
+{
+    unsigned int i;
+
+    for (i = 0; i < dict->count; i++)
+	free(dict->strings[i]);
+    if (dict->table != NULL)
+	memset(dict->table, 0, dict->table_size * sizeof(*dict->table));
+    dict->count = 0;
+    dict->bytes = 0;
+}
+
+static void
+evstore_dict_free(struct evstore_dict *dict)
+{
+    evstore_dict_reset(dict);
+    free(dict->strings);
+    free(dict->lengths);
+    free(dict->table);
+}
+
+/*
+ * Grow the dictionary hash table, keeping the load factor under 1/2.
+ */
+static bool
+evstore_dict_grow(struct evstore_dict *dict)
+{
+    unsigned int i, new_size = dict->table_size ? dict->table_size * 2 : 64;
+    unsigned int *new_table;
+    debug_decl(evstore_dict_grow, SUDO_DEBUG_UTIL);
+
+    new_table = calloc(new_size, sizeof(*new_table));
+    if (new_table == NULL)
+	debug_return_bool(false);
+    for (i = 0; i < dict->count; i++) {
+	unsigned int slot = evstore_hash(dict->strings[i], dict->lengths[i]);
+
+	for (slot &= new_size - 1; new_table[slot] != 0;
+		slot = (slot + 1) & (new_size - 1))
+	    continue;
+	new_table[slot] = i + 1;
+    }
+    free(dict->table);
+    dict->table = new_table;
+    dict->table_size = new_size;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Look up str in the dictionary, adding it if not present.
+ * Returns the index or -1 on error.
+ */
+static int
+evstore_dict_insert(struct evstore_dict *dict, const char *str)
+{
+    size_t len;
+    unsigned int slot, idx;
+    debug_decl(evstore_dict_insert, SUDO_DEBUG_UTIL);
+
+    if (str == NULL)
+	str = "";
+    len = strlen(str);
+    if (len > EVSTORE_STRING_MAX)
+	len = EVSTORE_STRING_MAX;
+
+    if (dict->count * 2 >= dict->table_size) {
+	if (!evstore_dict_grow(dict))
+	    goto oom;
+    }
+    slot = evstore_hash(str, len) & (dict->table_size - 1);
+    while ((idx = dict->table[slot]) != 0) {
+	idx--;
+	if (dict->lengths[idx] == len &&
+		memcmp(dict->strings[idx], str, len) == 0)
+	    debug_return_int(idx);
+	slot = (slot + 1) & (dict->table_size - 1);
+    }
+
+    if (dict->count == dict->size) {
+	unsigned int new_size = dict->size ? dict->size * 2 : 64;
+	char **strings;
+	size_t *lengths;
+
+	strings = reallocarray(dict->strings, new_size, sizeof(*strings));
+	if (strings == NULL)
+	    goto oom;
+	dict->strings = strings;
+	lengths = reallocarray(dict->lengths, new_size, sizeof(*lengths));
+	if (lengths == NULL)
+	    goto oom;
+	dict->lengths = lengths;
+	dict->size = new_size;
+    }
+    if ((dict->strings[dict->count] = strndup(str, len)) == NULL)
+	goto oom;
+    dict->lengths[dict->count] = len;
+    dict->bytes += 2 + len;
+    dict->table[slot] = dict->count + 1;
+    debug_return_int(dict->count++);
+oom:
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	"unable to allocate memory");
+    debug_return_int(-1);
+}
+
+struct evstore_block *
+evstore_block_alloc(void)
+{
+    struct evstore_block *block;
+    debug_decl(evstore_block_alloc, SUDO_DEBUG_UTIL);
+
+    block = calloc(1, sizeof(*block));
+    if (block == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+    }
+    debug_return_ptr(block);
+}
+
+void
+evstore_block_free(struct evstore_block *block)
+{
+    int col;
+    debug_decl(evstore_block_free, SUDO_DEBUG_UTIL);
+
+    if (block != NULL) {
+	for (col = 0; col < EVSTORE_NCOLS; col++)
+	    evstore_dict_free(&block->dicts[col]);
+	free(block);
+    }
+
+    debug_return;
+}
+
+unsigned int
+evstore_block_rows(const struct evstore_block *block)
+{
+    return block->nrows;
+}
+
+/*
+ * Add an event to a block.  The caller must write the block
+ * when it contains EVSTORE_BLOCK_ROWS events.
+ */
+bool
+evstore_block_add(struct evstore_block *block,
+    const struct evstore_event *event)
+{
+    const unsigned int row = block->nrows;
+    int col, idx;
+    debug_decl(evstore_block_add, SUDO_DEBUG_UTIL);
+
+    if (row >= EVSTORE_BLOCK_ROWS) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "event store block is full");
+	debug_return_bool(false);
+    }
+
+    for (col = 0; col < EVSTORE_NCOLS; col++) {
+	idx = evstore_dict_insert(&block->dicts[col], event->strings[col]);
+	if (idx == -1)
+	    debug_return_bool(false);
+	block->indices[col][row] = idx;
+    }
+    block->times[row] = event->event_time;
+    block->types[row] = event->type;
+    if (row == 0 || event->event_time.tv_sec < block->min_time)
+	block->min_time = event->event_time.tv_sec;
+    if (row == 0 || event->event_time.tv_sec > block->max_time)
+	block->max_time = event->event_time.tv_sec;
+    block->nrows++;
+
+    debug_return_bool(true);
+}
+
+static uint8_t *
+put_u8(uint8_t *cp, unsigned int val)
+{
+    *cp++ = val & 0xff;
+    return cp;
+}
+
+static uint8_t *
+put_u16(uint8_t *cp, unsigned int val)
+{
+    *cp++ = (val >> 8) & 0xff;
+    *cp++ = val & 0xff;
+    return cp;
+}
+
+static uint8_t *
+put_u32(uint8_t *cp, uint32_t val)
+{
+    *cp++ = (val >> 24) & 0xff;
+    *cp++ = (val >> 16) & 0xff;
+    *cp++ = (val >> 8) & 0xff;
+    *cp++ = val & 0xff;
+    return cp;
+}
+
+static uint8_t *
+put_u64(uint8_t *cp, uint64_t val)
+{
+    cp = put_u32(cp, (uint32_t)(val >> 32));
+    return put_u32(cp, (uint32_t)val);
+}
+
+static uint32_t
+get_u32(const uint8_t *cp)
+{
+    return ((uint32_t)cp[0] << 24) | ((uint32_t)cp[1] << 16) |
+	((uint32_t)cp[2] << 8) | (uint32_t)cp[3];
+}
+
+static uint64_t
+get_u64(const uint8_t *cp)
+{
+    return ((uint64_t)get_u32(cp) << 32) | get_u32(cp + 4);
+}
+
+static unsigned int
+get_index(const uint8_t *cp, unsigned int width)
+{
+    switch (width) {
+    case 1:
+	return cp[0];
+    case 2:
+	return ((unsigned int)cp[0] << 8) | cp[1];
+    default:
+	return get_u32(cp);
+    }
+}
+
+/*
+ * Serialize the block and append it to fd with a single write.
+ * The block is reset on success.
+ */
+bool
+evstore_block_write(struct evstore_block *block, int fd)
+{
+    size_t len = EVSTORE_HEADER_SIZE, off;
+    unsigned int row, i;
+    uint8_t *buf, *cp;
+    struct stat sb;
+    int col;
+    debug_decl(evstore_block_write, SUDO_DEBUG_UTIL);
+
+    if (block->nrows == 0)
+	debug_return_bool(true);
+
+    /* Compute the serialized size. */
+    len += block->nrows * (8 + 4 + 1);
+    for (col = 0; col < EVSTORE_NCOLS; col++) {
+	const struct evstore_dict *dict = &block->dicts[col];
+	len += 4 + dict->bytes;
+	len += block->nrows * evstore_index_width(dict->count);
+    }
+    if (len > EVSTORE_BLOCK_MAX) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "event store block too large: %zu", len);
+	debug_return_bool(false);
+    }
+    if ((buf = malloc(len)) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	debug_return_bool(false);
+    }
+
+    cp = put_u32(buf, EVSTORE_MAGIC);
+    cp = put_u32(cp, (uint32_t)len);
+    cp = put_u32(cp, block->nrows);
+    cp = put_u64(cp, (uint64_t)block->min_time);
+    cp = put_u64(cp, (uint64_t)block->max_time);
+    for (col = 0; col < EVSTORE_NCOLS; col++) {
+	const struct evstore_dict *dict = &block->dicts[col];
+
+	cp = put_u32(cp, dict->count);
+	for (i = 0; i < dict->count; i++) {
+	    cp = put_u16(cp, dict->lengths[i]);
+	    memcpy(cp, dict->strings[i], dict->lengths[i]);
+	    cp += dict->lengths[i];
+	}
+    }
+    for (row = 0; row < block->nrows; row++) {
+	cp = put_u64(cp, (uint64_t)block->times[row].tv_sec);
+	cp = put_u32(cp, (uint32_t)block->times[row].tv_nsec);
+    }
+    for (row = 0; row < block->nrows; row++)
+	cp = put_u8(cp, block->types[row]);
+    for (col = 0; col < EVSTORE_NCOLS; col++) {
+	const unsigned int width = evstore_index_width(block->dicts[col].count);
+
+	for (row = 0; row < block->nrows; row++) {
+	    const unsigned int idx = block->indices[col][row];
+
+	    switch (width) {
+	    case 1:
+		cp = put_u8(cp, idx);
+		break;
+	    case 2:
+		cp = put_u16(cp, idx);
+		break;
+	    default:
+		cp = put_u32(cp, idx);
+		break;
+	    }
+	}
+    }
+
+    /*
+     * If the write fails part way through, truncate the file back to
+     * where the block started so the next block is not appended after
+     * a torn one, which would hide it and every block after it.
+     */
+    if (fstat(fd, &sb) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to stat event store");
+	free(buf);
+	debug_return_bool(false);
+    }
+    for (off = 0; off < len; ) {
+	ssize_t nwritten = write(fd, buf + off, len - off);
+	if (nwritten == -1) {
+	    const int serrno = errno;
+
+	    if (errno == EINTR)
+		continue;
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to write event store block");
+	    if (off != 0 && ftruncate(fd, sb.st_size) == -1) {
+		sudo_debug_printf(
+		    SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		    "unable to truncate event store to %lld",
+		    (long long)sb.st_size);
+	    }
+	    free(buf);
+	    errno = serrno;
+	    debug_return_bool(false);
+	}
+	off += nwritten;
+    }
+    free(buf);
+
+    for (col = 0; col < EVSTORE_NCOLS; col++)
+	evstore_dict_reset(&block->dicts[col]);
+    block->nrows = 0;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Read exactly len bytes.  Returns the number of bytes read, which is
+ * less than len only at end of file, or -1 on error.
+ */
+static ssize_t
+evstore_read(int fd, void *buf, size_t len)
+{
+    size_t off = 0;
+
+    while (off < len) {
+	ssize_t nread = read(fd, (char *)buf + off, len - off);
+	if (nread == -1) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (nread == 0)
+	    break;
+	off += nread;
+    }
+    return off;
+}
+
+/*
+ * Remove a partial block left at the end of an event store file by a
+ * crash or a failed write so that blocks appended later can be read.
+ * Only a torn tail is removed; a file with an invalid block header in
+ * the middle is left alone.  Returns false on error.
+ */
+bool
+evstore_trim(int fd)
+{
+    uint8_t header[EVSTORE_HEADER_SIZE];
+    struct stat sb;
+    off_t pos = 0;
+    debug_decl(evstore_trim, SUDO_DEBUG_UTIL);
+
+    if (fstat(fd, &sb) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to stat event store");
+	debug_return_bool(false);
+    }
+    while (sb.st_size - pos >= EVSTORE_HEADER_SIZE) {
+	uint32_t len;
+	ssize_t nread;
+
+	nread = pread(fd, header, sizeof(header), pos);
+	if (nread == -1) {
+	    if (errno == EINTR)
+		continue;
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to read event store block header");
+	    debug_return_bool(false);
+	}
+	if (nread != ssizeof(header))
+	    break;
+	len = get_u32(header + 4);
+	if (get_u32(header) != EVSTORE_MAGIC || len < EVSTORE_HEADER_SIZE ||
+		len > EVSTORE_BLOCK_MAX) {
+	    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+		"invalid event store block header at %lld, not trimming",
+		(long long)pos);
+	    debug_return_bool(true);
+	}
+	if (sb.st_size - pos < (off_t)len)
+	    break;
+	pos += len;
+    }
+    if (pos != sb.st_size) {
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+	    "removing %lld bytes of partial event store block at %lld",
+	    (long long)(sb.st_size - pos), (long long)pos);
+	if (ftruncate(fd, pos) == -1) {
+	    sudo_debug_printf(
+		SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to truncate event store to %lld", (long long)pos);
+	    debug_return_bool(false);
+	}
+    }
+    debug_return_bool(true);
+}
+
+/*
+ * Scan a block body, calling match for each row that satisfies filter.
+ * Dictionary strings are NUL-terminated in place.
+ * Returns false if the block is corrupt or match returns false.
+ */
+static bool
+evstore_scan_block(uint8_t *buf, size_t len, unsigned int nrows,
+    const struct evstore_filter *filter, evstore_match_fn_t match,
+    void *closure, struct evstore_scan_stats *stats)
+{
+    struct evstore_string *dicts[EVSTORE_NCOLS] = { NULL };
+    unsigned int counts[EVSTORE_NCOLS], widths[EVSTORE_NCOLS];
+    unsigned int wanted[EVSTORE_NCOLS];
+    const uint8_t *index_cols[EVSTORE_NCOLS];
+    const uint8_t *times, *types;
+    uint8_t *cp = buf, *ep = buf + len;
+    struct evstore_event event;
+    unsigned int row, i;
+    bool skip = false, ret = false;
+    int col;
+    debug_decl(evstore_scan_block, SUDO_DEBUG_UTIL);
+
+    /* Dictionaries; check predicates before decoding any columns. */
+    for (col = 0; col < EVSTORE_NCOLS; col++) {
+	if (ep - cp < 4)
+	    goto corrupt;
+	counts[col] = get_u32(cp);
+	cp += 4;
+	if (counts[col] > nrows)
+	    goto corrupt;
+	dicts[col] = reallocarray(NULL, counts[col] ? counts[col] : 1,
+	    sizeof(struct evstore_string));
+	if (dicts[col] == NULL) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to allocate memory");
+	    goto done;
+	}
+	wanted[col] = UINT_MAX;
+	for (i = 0; i < counts[col]; i++) {
+	    size_t slen;
+
+	    if (ep - cp < 2)
+		goto corrupt;
+	    slen = ((size_t)cp[0] << 8) | cp[1];
+	    if ((size_t)(ep - cp) < 2 + slen)
+		goto corrupt;
+	    /* Shift the string over its length prefix to NUL-terminate it. */
+	    memmove(cp, cp + 2, slen);
+	    cp[slen] = '\0';
+	    dicts[col][i].str = (char *)cp;
+	    if (filter->strings[col] != NULL &&
+		    strcmp((char *)cp, filter->strings[col]) == 0)
+		wanted[col] = i;
+	    cp += 2 + slen;
+	}
+	if (filter->strings[col] != NULL && wanted[col] == UINT_MAX)
+	    skip = true;
+	widths[col] = evstore_index_width(counts[col]);
+    }
+    if (skip) {
+	stats->blocks_skipped++;
+	ret = true;
+	goto done;
+    }
+
+    /* Column offsets. */
+    if ((size_t)(ep - cp) < (size_t)nrows * 13)
+	goto corrupt;
+    times = cp;
+    cp += nrows * 12;
+    types = cp;
+    cp += nrows;
+    for (col = 0; col < EVSTORE_NCOLS; col++) {
+	if ((size_t)(ep - cp) < (size_t)nrows * widths[col])
+	    goto corrupt;
+	index_cols[col] = cp;
+	cp += nrows * widths[col];
+    }
+
+    stats->rows += nrows;
+    for (row = 0; row < nrows; row++) {
+	const uint8_t *tp = times + row * 12;
+
+	if (filter->type != -1 && types[row] != filter->type)
+	    continue;
+	event.event_time.tv_sec = (time_t)get_u64(tp);
+	event.event_time.tv_nsec = get_u32(tp + 8);
+	if (filter->start != 0 && event.event_time.tv_sec < filter->start)
+	    continue;
+	if (filter->end != 0 && event.event_time.tv_sec > filter->end)
+	    continue;
+	for (col = 0; col < EVSTORE_NCOLS; col++) {
+	    const unsigned int idx =
+		get_index(index_cols[col] + row * widths[col], widths[col]);
+
+	    if (idx >= counts[col])
+		goto corrupt;
+	    if (wanted[col] != UINT_MAX && idx != wanted[col])
+		break;
+	    event.strings[col] = dicts[col][idx].str;
+	}
+	if (col != EVSTORE_NCOLS)
+	    continue;
+	event.type = types[row];
+
+	stats->rows_matched++;
+	if (!match(&event, closure))
+	    goto done;
+    }
+    ret = true;
+    goto done;
+
+corrupt:
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	"corrupt event store block");
+    errno = EINVAL;
+done:
+    for (col = 0; col < EVSTORE_NCOLS; col++)
+	free(dicts[col]);
+    debug_return_bool(ret);
+}
+
+/*
+ * Scan an event store file, calling match for each event that
+ * satisfies filter.  Blocks outside the filter's time range or
+ * whose dictionaries do not contain the wanted strings are skipped.
+ * A truncated block at the end of the file is ignored.
+ */
+bool
+evstore_scan(int fd, const struct evstore_filter *filter,
+    evstore_match_fn_t match, void *closure, struct evstore_scan_stats *stats)
+{
+    uint8_t header[EVSTORE_HEADER_SIZE];
+    uint8_t *buf = NULL;
+    size_t bufsize = 0;
+    bool ret = false;
+    debug_decl(evstore_scan, SUDO_DEBUG_UTIL);
+
+    for (;;) {
+	uint32_t magic, len, nrows;
+	time_t min_time, max_time;
+	ssize_t nread;
+
+	nread = evstore_read(fd, header, sizeof(header));
+	if (nread == -1)
+	    goto done;
+	if (nread != ssizeof(header))
+	    break;
+	magic = get_u32(header);
+	len = get_u32(header + 4);
+	nrows = get_u32(header + 8);
+	min_time = (time_t)get_u64(header + 12);
+	max_time = (time_t)get_u64(header + 20);
+	if (magic != EVSTORE_MAGIC || len < EVSTORE_HEADER_SIZE ||
+		len > EVSTORE_BLOCK_MAX || nrows > EVSTORE_BLOCK_ROWS) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"invalid event store block header");
+	    errno = EINVAL;
+	    goto done;
+	}
+	len -= EVSTORE_HEADER_SIZE;
+	stats->blocks++;
+
+	/* Skip blocks outside the time range without reading them. */
+	if ((filter->start != 0 && max_time < filter->start) ||
+		(filter->end != 0 && min_time > filter->end)) {
+	    stats->blocks_skipped++;
+	    if (lseek(fd, len, SEEK_CUR) == -1)
+		goto done;
+	    continue;
+	}
+
+	if (len > bufsize) {
+	    free(buf);
+	    bufsize = sudo_pow2_roundup(len);
+	    if ((buf = malloc(bufsize)) == NULL) {
+		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		    "unable to allocate memory");
+		goto done;
+	    }
+	}
+	nread = evstore_read(fd, buf, len);
+	if (nread == -1)
+	    goto done;
+	if (nread != (ssize_t)len)
+	    break;
+	if (!evstore_scan_block(buf, len, nrows, filter, match, closure, stats))
+	    goto done;
+    }
+    ret = true;
+
+done:
+    free(buf);
+    debug_return_bool(ret);
+}
@@ -0,0 +1,110 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SUDO_EVSTORE_H
+#define SUDO_EVSTORE_H
+
+/*
+ * Columnar event store.
+ *
+ * Events are stored in one file per day (UTC), named YYYYMMDD.sev.
+ * Each file is a sequence of self-contained blocks of up to
+ * EVSTORE_BLOCK_ROWS events.  All integers are in network byte order.
+ *
+ *   uint32 magic, block length (including header), number of rows
+ *   int64  minimum and maximum event time (seconds)
+ *   string dictionaries for each EVSTORE_COL_* column:
+ *	uint32 number of entries, then entries as uint16 length + bytes
+ *   time column: nrows x (int64 seconds, uint32 nanoseconds)
+ *   type column: nrows x uint8
+ *   for each string column: nrows x dictionary index, stored in
+ *	1, 2 or 4 bytes depending on the size of the dictionary
+ *
+ * The time range and dictionaries let a reader skip blocks that
+ * cannot match a query without decoding the columns.
+ */
+
+#define EVSTORE_MAGIC		0x53455642U	/* "SEVB" */
+#define EVSTORE_BLOCK_ROWS	4096
+#define EVSTORE_SUFFIX		".sev"
+#define EVSTORE_HEADER_SIZE	(3 * 4 + 2 * 8)
+#define EVSTORE_BLOCK_MAX	(64 * 1024 * 1024)
+
+enum evstore_type {
+    EVSTORE_ACCEPT,
+    EVSTORE_REJECT,
+    EVSTORE_ALERT,
+    EVSTORE_NTYPES
+};
+
+enum evstore_column {
+    EVSTORE_COL_USER,
+    EVSTORE_COL_HOST,
+    EVSTORE_COL_RUNUSER,
+    EVSTORE_COL_COMMAND,
+    EVSTORE_COL_REASON,
+    EVSTORE_NCOLS
+};
+
+/* A single event; strings may be NULL. */
+struct evstore_event {
+    struct timespec event_time;
+    enum evstore_type type;
+    const char *strings[EVSTORE_NCOLS];
+};
+
+/* Query predicates; unset values match everything. */
+struct evstore_filter {
+    time_t start;		/* 0 for no lower bound */
+    time_t end;			/* 0 for no upper bound */
+    int type;			/* -1 for any type */
+    const char *strings[EVSTORE_NCOLS];
+};
+
+struct evstore_scan_stats {
+    unsigned long long blocks;
+    unsigned long long blocks_skipped;
+    unsigned long long rows;
+    unsigned long long rows_matched;
+};
+
+typedef bool (*evstore_match_fn_t)(const struct evstore_event *event, void *closure);
+
+struct evstore_block;
+
+/* evstore.c */
+const char *evstore_type_name(enum evstore_type type);
+const char *evstore_column_name(enum evstore_column col);
+struct evstore_block *evstore_block_alloc(void);
+void evstore_block_free(struct evstore_block *block);
+bool evstore_block_add(struct evstore_block *block, const struct evstore_event *event);
+unsigned int evstore_block_rows(const struct evstore_block *block);
+bool evstore_block_write(struct evstore_block *block, int fd);
+bool evstore_trim(int fd);
+bool evstore_scan(int fd, const struct evstore_filter *filter, evstore_match_fn_t match, void *closure, struct evstore_scan_stats *stats);
+
+/* logsrvd_evstore.c */
+struct eventlog;
+struct sudo_event_base;
+bool logsrvd_evstore_init(struct sudo_event_base *evbase);
+void logsrvd_evstore_add(enum evstore_type type, const struct eventlog *evlog, const char *reason, const struct timespec *event_time);
+void logsrvd_evstore_flush(void);
+void logsrvd_evstore_close(void);
+void logsrvd_evstore_dump(void);
+
+#endif /* SUDO_EVSTORE_H */
@@ -0,0 +1,302 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+
+#include "log_server.pb-c.h"
+#include "logsrv_util.h"
+
+/*
+ * Hand-written encoder and decoder for ClientMessages that contain an
+ * IoBuffer, by far the most common message type.  Unlike protobuf-c,
+ * decoding does not allocate and the data is not copied, the view
+ * points into the packed message.  Only the canonical encoding that
+ * protobuf-c (and iobuf_pack) produce is recognized; anything else,
+ * including unknown or repeated fields, is left to protobuf-c so the
+ * semantics of the two decoders cannot differ.
+ *
+ *   ClientMessage { IoBuffer ttyin_buf = 6; ... IoBuffer stderr_buf = 10; }
+ *   IoBuffer { TimeSpec delay = 1; bytes data = 2; }
+ *   TimeSpec { int64 tv_sec = 1; int32 tv_nsec = 2; }
+ */
+
+#define WIRE_VARINT	0
+#define WIRE_LEN	2
+
+#define FIELD_KEY(f, w)	(((f) << 3) | (w))
+
+/*
+ * Decode a base 128 varint, returning a pointer to the next byte
+ * or NULL if the varint is truncated or too long.
+ */
+static const uint8_t *
+get_varint(const uint8_t *cp, const uint8_t *ep, uint64_t *valp)
+{
+    uint64_t val = 0;
+    unsigned int shift;
+
+    for (shift = 0; shift < 64 && cp < ep; shift += 7) {
+	const uint8_t byte = *cp++;
+
+	val |= (uint64_t)(byte & 0x7f) << shift;
+	if ((byte & 0x80) == 0) {
+	    *valp = val;
+	    return cp;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Decode a length prefix and check that it fits in the buffer.
+ */
+static const uint8_t *
+get_length(const uint8_t *cp, const uint8_t *ep, size_t *lenp)
+{
+    uint64_t len;
+
+    cp = get_varint(cp, ep, &len);
+    if (cp == NULL || len > (uint64_t)(ep - cp))
+	return NULL;
+    *lenp = (size_t)len;
+    return cp;
+}
+
+static size_t
+varint_size(uint64_t val)
+{
+    size_t size = 1;
+
+    while (val >= 0x80) {
+	val >>= 7;
+	size++;
+    }
+    return size;
+}
+
+static uint8_t *
+put_varint(uint8_t *cp, uint64_t val)
+{
+    while (val >= 0x80) {
+	*cp++ = (uint8_t)(val | 0x80);
+	val >>= 7;
+    }
+    *cp++ = (uint8_t)val;
+    return cp;
+}
+
+/*
+ * Decode a TimeSpec, zero values are omitted by the encoder.
+ */
+static bool
+decode_timespec(const uint8_t *cp, const uint8_t *ep, struct iobuf_view *view)
+{
+    bool have_sec = false, have_nsec = false;
+    uint64_t key, val;
+
+    view->delay_sec = 0;
+    view->delay_nsec = 0;
+    while (cp < ep) {
+	if ((cp = get_varint(cp, ep, &key)) == NULL)
+	    return false;
+	switch (key) {
+	case FIELD_KEY(1, WIRE_VARINT):
+	    if (have_sec || (cp = get_varint(cp, ep, &val)) == NULL)
+		return false;
+	    view->delay_sec = (int64_t)val;
+	    have_sec = true;
+	    break;
+	case FIELD_KEY(2, WIRE_VARINT):
+	    if (have_nsec || (cp = get_varint(cp, ep, &val)) == NULL)
+		return false;
+	    /* Like protobuf-c, use the low 32 bits. */
+	    view->delay_nsec = (int32_t)(uint32_t)val;
+	    have_nsec = true;
+	    break;
+	default:
+	    return false;
+	}
+    }
+    return true;
+}
+
+/*
+ * Decode a packed ClientMessage if it holds an IoBuffer.
+ * On success, fills in view and returns true.  Returns false if the
+ * message is some other type or not in canonical form, in which case
+ * the caller should use client_message__unpack().
+ */
+bool
+iobuf_decode(const uint8_t *buf, size_t len, struct iobuf_view *view)
+{
+    const uint8_t *cp = buf, *ep = buf + len;
+    bool have_delay = false, have_data = false;
+    size_t fieldlen;
+    uint64_t key;
+    debug_decl(iobuf_decode, SUDO_DEBUG_UTIL);
+
+    /* Exactly one IoBuffer field spanning the whole message. */
+    if ((cp = get_varint(cp, ep, &key)) == NULL)
+	debug_return_bool(false);
+    switch (key) {
+    case FIELD_KEY(CLIENT_MESSAGE__TYPE_TTYIN_BUF, WIRE_LEN):
+	view->iofd = IOFD_TTYIN;
+	break;
+    case FIELD_KEY(CLIENT_MESSAGE__TYPE_TTYOUT_BUF, WIRE_LEN):
+	view->iofd = IOFD_TTYOUT;
+	break;
+    case FIELD_KEY(CLIENT_MESSAGE__TYPE_STDIN_BUF, WIRE_LEN):
+	view->iofd = IOFD_STDIN;
+	break;
+    case FIELD_KEY(CLIENT_MESSAGE__TYPE_STDOUT_BUF, WIRE_LEN):
+	view->iofd = IOFD_STDOUT;
+	break;
+    case FIELD_KEY(CLIENT_MESSAGE__TYPE_STDERR_BUF, WIRE_LEN):
+	view->iofd = IOFD_STDERR;
+	break;
+    default:
+	debug_return_bool(false);
+    }
+    view->type_case = (int)(key >> 3);
+    if ((cp = get_length(cp, ep, &fieldlen)) == NULL || cp + fieldlen != ep)
+	debug_return_bool(false);
+
+    view->data = NULL;
+    view->len = 0;
+    while (cp < ep) {
+	if ((cp = get_varint(cp, ep, &key)) == NULL)
+	    debug_return_bool(false);
+	switch (key) {
+	case FIELD_KEY(1, WIRE_LEN):
+	    if (have_delay || (cp = get_length(cp, ep, &fieldlen)) == NULL)
+		debug_return_bool(false);
+	    if (!decode_timespec(cp, cp + fieldlen, view))
+		debug_return_bool(false);
+	    have_delay = true;
+	    break;
+	case FIELD_KEY(2, WIRE_LEN):
+	    if (have_data || (cp = get_length(cp, ep, &fieldlen)) == NULL)
+		debug_return_bool(false);
+	    if (fieldlen != 0)
+		view->data = cp;
+	    view->len = fieldlen;
+	    have_data = true;
+	    break;
+	default:
+	    debug_return_bool(false);
+	}
+	cp += fieldlen;
+    }
+
+    /* The handlers require a delay, let protobuf-c report its absence. */
+    debug_return_bool(have_delay);
+}
+
+static size_t
+timespec_packed_size(const struct timespec *ts)
+{
+    size_t size = 0;
+
+    if (ts->tv_sec != 0)
+	size += 1 + varint_size((uint64_t)(int64_t)ts->tv_sec);
+    if (ts->tv_nsec != 0)
+	size += 1 + varint_size((uint64_t)(int64_t)(int32_t)ts->tv_nsec);
+    return size;
+}
+
+static size_t
+iobuf_body_size(const struct timespec *delay, size_t len)
+{
+    const size_t tslen = timespec_packed_size(delay);
+    size_t size;
+
+    size = 1 + varint_size(tslen) + tslen;
+    if (len != 0)
+	size += 1 + varint_size(len) + len;
+    return size;
+}
+
+/*
+ * Returns the size of a ClientMessage holding an IoBuffer with the
+ * given delay and len bytes of data, as encoded by iobuf_pack().
+ */
+size_t
+iobuf_packed_size(const struct timespec *delay, size_t len)
+{
+    const size_t bodylen = iobuf_body_size(delay, len);
+
+    return 1 + varint_size(bodylen) + bodylen;
+}
+
+/*
+ * Encode a ClientMessage holding an IoBuffer into out, which must have
+ * room for iobuf_packed_size() bytes.  The output is identical to
+ * client_message__pack().  Returns the number of bytes written.
+ */
+size_t
+iobuf_pack(int type_case, const struct timespec *delay, const uint8_t *data,
+    size_t len, uint8_t *out)
+{
+    const size_t tslen = timespec_packed_size(delay);
+    uint8_t *cp = out;
+    debug_decl(iobuf_pack, SUDO_DEBUG_UTIL);
+
+    *cp++ = (uint8_t)FIELD_KEY(type_case, WIRE_LEN);
+    cp = put_varint(cp, iobuf_body_size(delay, len));
+
+    *cp++ = FIELD_KEY(1, WIRE_LEN);
+    cp = put_varint(cp, tslen);
+    if (delay->tv_sec != 0) {
+	*cp++ = FIELD_KEY(1, WIRE_VARINT);
+	cp = put_varint(cp, (uint64_t)(int64_t)delay->tv_sec);
+    }
+    if (delay->tv_nsec != 0) {
+	*cp++ = FIELD_KEY(2, WIRE_VARINT);
+	cp = put_varint(cp, (uint64_t)(int64_t)(int32_t)delay->tv_nsec);
+    }
+
+    if (len != 0) {
+	*cp++ = FIELD_KEY(2, WIRE_LEN);
+	cp = put_varint(cp, len);
+	memcpy(cp, data, len);
+	cp += len;
+    }
+
+    debug_return_size_t((size_t)(cp - out));
+}
@@ -0,0 +1,671 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Deduplicated I/O log writer.
+ *
+ * Stream data is split into content-defined chunks which are stored
+ * once in a shared chunk store and hard-linked into the I/O log
+ * directory; the stream file itself is a manifest of chunk references.
+ * See lib/iolog/iolog_chunks.h for the format.
+ *
+ * Data that has not yet reached a chunk boundary is written inline
+ * in the manifest as a provisional tail when a commit point is sent,
+ * so acknowledged data is never held only in memory.  The data stays
+ * in the chunk buffer along with the gear hash state, so chunk
+ * boundaries depend only on the content and not on commit timing.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_digest.h"
+#include "sudo_eventlog.h"
+#include "sudo_gettext.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrvd.h"
+#include "iolog_chunks.h"
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+
+struct iolog_dedup {
+    unsigned char buf[IOLOG_CHUNK_MAX];
+    size_t len;			/* bytes in buf */
+    size_t tail;		/* bytes of buf in the provisional tail */
+    size_t scanned;		/* bytes of buf checked for a boundary */
+    uint64_t hash;		/* gear hash of the scanned bytes */
+    off_t offset;		/* bytes written to the stream */
+    struct sudo_digest *digest;
+    const char *name;
+    unsigned long long chunks;
+    unsigned long long stored;
+    unsigned long long inline_bytes;
+    unsigned long long tail_bytes;
+    int fd;			/* manifest */
+    int store_fd;		/* shared chunk store */
+    int chunks_fd;		/* chunks subdirectory of the I/O log dir */
+    char store_path[PATH_MAX];
+};
+
+/*
+ * Gear hash table, generated with splitmix64 from a fixed seed.
+ * It must never change or existing chunks will no longer match.
+ */
+static uint64_t gear[256];
+
+static void
+gear_init(void)
+{
+    static bool initialized;
+    uint64_t z, x = 0;
+    int i;
+
+    if (initialized)
+	return;
+    for (i = 0; i < 256; i++) {
+	z = (x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	gear[i] = z ^ (z >> 31);
+    }
+    initialized = true;
+}
+
+static bool
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *cp = buf;
+    ssize_t nwritten;
+
+    while (len > 0) {
+	nwritten = write(fd, cp, len);
+	if (nwritten == -1) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	cp += nwritten;
+	len -= nwritten;
+    }
+    return true;
+}
+
+/*
+ * Store a new chunk in the shared store.  The chunk is written to a
+ * temporary file first so a partial chunk is never visible.
+ */
+static bool
+dedup_store_chunk(struct iolog_dedup *dd, const char *name, const char *path,
+    const unsigned char *data, size_t len)
+{
+    char tmp[sizeof("xx/.") + IOLOG_CHUNK_NAME_LEN + 16];
+    char dir[PATH_MAX];
+    int fd;
+    debug_decl(dedup_store_chunk, SUDO_DEBUG_UTIL);
+
+    (void)snprintf(tmp, sizeof(tmp), "%.2s/.%s.%d", name, name, (int)getpid());
+    fd = iolog_openat(dd->store_fd, tmp, O_CREAT|O_TRUNC|O_WRONLY);
+    if (fd == -1 && errno == ENOENT) {
+	/* Chunks are spread over subdirectories by their first byte. */
+	if (snprintf(dir, sizeof(dir), "%s/%.2s", dd->store_path, name) <
+		ssizeof(dir) && iolog_mkdirs(dir)) {
+	    fd = iolog_openat(dd->store_fd, tmp, O_CREAT|O_TRUNC|O_WRONLY);
+	}
+    }
+    if (fd == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create %s/%s", dd->store_path, tmp);
+	debug_return_bool(false);
+    }
+    if (fchown(fd, iolog_get_uid(), iolog_get_gid()) != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
+	    "%s: unable to fchown %d:%d %s/%s", __func__,
+	    (int)iolog_get_uid(), (int)iolog_get_gid(), dd->store_path, tmp);
+    }
+    if (!write_all(fd, data, len) || fdatasync(fd) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to write %s/%s", dd->store_path, tmp);
+	close(fd);
+	(void)unlinkat(dd->store_fd, tmp, 0);
+	debug_return_bool(false);
+    }
+    close(fd);
+
+    /* Another process may have stored the same chunk in the meantime. */
+    if (linkat(dd->store_fd, tmp, dd->store_fd, path, 0) == -1 &&
+	    errno != EEXIST) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to link %s/%s", dd->store_path, path);
+	(void)unlinkat(dd->store_fd, tmp, 0);
+	debug_return_bool(false);
+    }
+    (void)unlinkat(dd->store_fd, tmp, 0);
+    dd->stored++;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Store a chunk (if new) and add a reference to it in the manifest.
+ */
+static bool
+dedup_write_chunk(struct iolog_dedup *dd, const unsigned char *data,
+    size_t len)
+{
+    unsigned char md[IOLOG_CHUNK_NAME_LEN / 2];
+    char name[IOLOG_CHUNK_NAME_LEN + 1];
+    char path[sizeof("xx/") + IOLOG_CHUNK_NAME_LEN];
+    char line[sizeof("c  \n") + IOLOG_CHUNK_NAME_LEN + 16];
+    static const char hex[] = "0123456789abcdef";
+    struct stat sb;
+    size_t i;
+    int n;
+    debug_decl(dedup_write_chunk, SUDO_DEBUG_UTIL);
+
+    sudo_digest_reset(dd->digest);
+    sudo_digest_update(dd->digest, data, len);
+    sudo_digest_final(dd->digest, md);
+    for (i = 0; i < sizeof(md); i++) {
+	name[i * 2] = hex[md[i] >> 4];
+	name[i * 2 + 1] = hex[md[i] & 0x0f];
+    }
+    name[IOLOG_CHUNK_NAME_LEN] = '\0';
+    (void)snprintf(path, sizeof(path), "%.2s/%s", name, name);
+
+    /* Take a reference unless this session already has one. */
+    if (fstatat(dd->chunks_fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+	if (linkat(dd->store_fd, path, dd->chunks_fd, name, 0) == -1) {
+	    if (errno != ENOENT ||
+		    !dedup_store_chunk(dd, name, path, data, len) ||
+		    linkat(dd->store_fd, path, dd->chunks_fd, name, 0) == -1) {
+		sudo_debug_printf(
+		    SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		    "unable to reference chunk %s for %s", name, dd->name);
+		debug_return_bool(false);
+	    }
+	}
+    }
+
+    n = snprintf(line, sizeof(line), "c %s %zu\n", name, len);
+    if (n < 0 || n >= ssizeof(line) || !write_all(dd->fd, line, n)) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to write manifest for %s", dd->name);
+	debug_return_bool(false);
+    }
+    dd->chunks++;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Store data in the manifest, either because it is too small to be
+ * worth deduplicating (type 'd') or as a provisional tail (type 't').
+ */
+static bool
+dedup_write_inline(struct iolog_dedup *dd, int type,
+    const unsigned char *data, size_t len)
+{
+    char line[sizeof("d \n") + 16];
+    int n;
+    debug_decl(dedup_write_inline, SUDO_DEBUG_UTIL);
+
+    n = snprintf(line, sizeof(line), "%c %zu\n", type, len);
+    if (n < 0 || n >= ssizeof(line) || !write_all(dd->fd, line, n) ||
+	    !write_all(dd->fd, data, len)) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to write manifest for %s", dd->name);
+	debug_return_bool(false);
+    }
+    if (type == 't')
+	dd->tail_bytes += len;
+    else
+	dd->inline_bytes += len;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Write the first len bytes of the buffer as a chunk, or inline
+ * if shorter than the minimum chunk size.  If part of the
+ * provisional tail is left over, it is written again since the
+ * new record supersedes the old tail.
+ */
+static bool
+dedup_emit(struct iolog_dedup *dd, size_t len)
+{
+    bool ok;
+    debug_decl(dedup_emit, SUDO_DEBUG_UTIL);
+
+    if (len < IOLOG_CHUNK_MIN)
+	ok = dedup_write_inline(dd, 'd', dd->buf, len);
+    else
+	ok = dedup_write_chunk(dd, dd->buf, len);
+    if (!ok)
+	debug_return_bool(false);
+
+    dd->len -= len;
+    memmove(dd->buf, dd->buf + len, dd->len);
+    dd->scanned = 0;
+    dd->hash = 0;
+
+    if (dd->tail > len) {
+	dd->tail -= len;
+	if (!dedup_write_inline(dd, 't', dd->buf, dd->tail))
+	    debug_return_bool(false);
+    } else {
+	dd->tail = 0;
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Find the next chunk boundary in the buffer, returning its offset
+ * or 0 if there is none yet.
+ */
+static size_t
+dedup_boundary(struct iolog_dedup *dd)
+{
+    /* The hash only depends on the last 64 bytes seen. */
+    if (dd->scanned < IOLOG_CHUNK_MIN - 64)
+	dd->scanned = MIN(dd->len, IOLOG_CHUNK_MIN - 64);
+
+    while (dd->scanned < dd->len) {
+	dd->hash = (dd->hash << 1) + gear[dd->buf[dd->scanned++]];
+	if (dd->scanned >= IOLOG_CHUNK_MIN &&
+		(dd->hash & IOLOG_CHUNK_MASK) == 0)
+	    return dd->scanned;
+    }
+    return dd->len == IOLOG_CHUNK_MAX ? IOLOG_CHUNK_MAX : 0;
+}
+
+static ssize_t
+dedup_write(void *v, const char *buf, size_t len)
+{
+    struct iolog_dedup *dd = v;
+    size_t cut, n, remainder = len;
+    debug_decl(dedup_write, SUDO_DEBUG_UTIL);
+
+    while (remainder > 0) {
+	n = MIN(remainder, IOLOG_CHUNK_MAX - dd->len);
+	memcpy(dd->buf + dd->len, buf, n);
+	dd->len += n;
+	buf += n;
+	remainder -= n;
+	while ((cut = dedup_boundary(dd)) != 0) {
+	    if (!dedup_emit(dd, cut))
+		debug_return_ssize_t(-1);
+	}
+    }
+    dd->offset += len;
+
+    debug_return_ssize_t((ssize_t)len);
+}
+
+/*
+ * Only supports querying the current position.
+ */
+static bool
+dedup_seek(struct iolog_dedup *dd, off_t *offset, int whence)
+{
+    off_t target;
+
+    switch (whence) {
+    case SEEK_SET:
+	target = *offset;
+	break;
+    case SEEK_CUR:
+    case SEEK_END:
+	target = dd->offset + *offset;
+	break;
+    default:
+	target = -1;
+	break;
+    }
+    if (target != dd->offset) {
+	errno = EINVAL;
+	return false;
+    }
+    *offset = dd->offset;
+    return true;
+}
+
+static void
+dedup_free(struct iolog_dedup *dd)
+{
+    if (dd->fd != -1)
+	close(dd->fd);
+    if (dd->store_fd != -1)
+	close(dd->store_fd);
+    if (dd->chunks_fd != -1)
+	close(dd->chunks_fd);
+    if (dd->digest != NULL)
+	sudo_digest_free(dd->digest);
+    free(dd);
+}
+
+static int
+dedup_close(void *v)
+{
+    struct iolog_dedup *dd = v;
+    int ret = 0;
+    debug_decl(dedup_close, SUDO_DEBUG_UTIL);
+
+    if (dd->len != 0 && !dedup_emit(dd, dd->len))
+	ret = -1;
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"%s: %lld bytes, %llu chunks (%llu new), %llu bytes inline, "
+	"%llu bytes in provisional tails", dd->name, (long long)dd->offset,
+	dd->chunks, dd->stored, dd->inline_bytes, dd->tail_bytes);
+    dedup_free(dd);
+
+    debug_return_int(ret);
+}
+
+#ifdef HAVE_FOPENCOOKIE
+static int
+dedup_seek_cookie(void *v, off64_t *offset, int whence)
+{
+    off_t pos = (off_t)*offset;
+
+    if (!dedup_seek(v, &pos, whence))
+	return -1;
+    *offset = pos;
+    return 0;
+}
+
+static cookie_io_functions_t dedup_funcs = {
+    NULL, dedup_write, dedup_seek_cookie, dedup_close
+};
+#else
+static int
+dedup_write_funopen(void *v, const char *buf, int len)
+{
+    return (int)dedup_write(v, buf, (size_t)len);
+}
+
+static fpos_t
+dedup_seek_funopen(void *v, fpos_t offset, int whence)
+{
+    off_t pos = (off_t)offset;
+
+    if (!dedup_seek(v, &pos, whence))
+	return -1;
+    return (fpos_t)pos;
+}
+#endif /* HAVE_FOPENCOOKIE */
+
+/*
+ * Open the chunk store, creating it as needed.  It must be on the
+ * same file system as the I/O log directory since chunks are
+ * referenced via hard links.
+ */
+static bool
+dedup_open_store(struct iolog_dedup *dd, struct connection_closure *closure)
+{
+    const char *store = logsrvd_conf_iolog_chunk_store();
+    struct stat sb1, sb2;
+    debug_decl(dedup_open_store, SUDO_DEBUG_UTIL);
+
+    if (strlcpy(dd->store_path, store, sizeof(dd->store_path)) >=
+	    sizeof(dd->store_path)) {
+	errno = ENAMETOOLONG;
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "%s", store);
+	debug_return_bool(false);
+    }
+    dd->store_fd = iolog_openat(AT_FDCWD, store, O_RDONLY);
+    if (dd->store_fd == -1 && errno == ENOENT) {
+	char path[PATH_MAX];
+
+	/* iolog_mkdirs() modifies its argument. */
+	memcpy(path, dd->store_path, sizeof(path));
+	if (iolog_mkdirs(path))
+	    dd->store_fd = iolog_openat(AT_FDCWD, store, O_RDONLY);
+    }
+    if (dd->store_fd == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open chunk store %s", store);
+	debug_return_bool(false);
+    }
+    (void)fcntl(dd->store_fd, F_SETFD, FD_CLOEXEC);
+
+    if (fstat(dd->store_fd, &sb1) == -1 ||
+	    fstat(closure->iolog_dir_fd, &sb2) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to stat chunk store %s", store);
+	debug_return_bool(false);
+    }
+    if (sb1.st_dev != sb2.st_dev) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "chunk store %s is not on the same file system as %s", store,
+	    closure->evlog->iolog_path);
+	debug_return_bool(false);
+    }
+
+    /* Per-session chunk references. */
+    if (mkdirat(closure->iolog_dir_fd, IOLOG_CHUNKS_DIR,
+	    iolog_get_dir_mode()) == 0) {
+	if (fchownat(closure->iolog_dir_fd, IOLOG_CHUNKS_DIR,
+		iolog_get_uid(), iolog_get_gid(), AT_SYMLINK_NOFOLLOW) != 0) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
+		"%s: unable to fchown %d:%d %s/%s", __func__,
+		(int)iolog_get_uid(), (int)iolog_get_gid(),
+		closure->evlog->iolog_path, IOLOG_CHUNKS_DIR);
+	}
+    } else if (errno != EEXIST) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create %s/%s", closure->evlog->iolog_path,
+	    IOLOG_CHUNKS_DIR);
+	debug_return_bool(false);
+    }
+    dd->chunks_fd = iolog_openat(closure->iolog_dir_fd, IOLOG_CHUNKS_DIR,
+	O_RDONLY);
+    if (dd->chunks_fd == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s/%s", closure->evlog->iolog_path,
+	    IOLOG_CHUNKS_DIR);
+	debug_return_bool(false);
+    }
+    (void)fcntl(dd->chunks_fd, F_SETFD, FD_CLOEXEC);
+
+    debug_return_bool(true);
+}
+
+/*
+ * Create an I/O log file written via the deduplicating writer.
+ */
+bool
+iolog_dedup_create(int iofd, struct connection_closure *closure)
+{
+    struct iolog_file *iol = &closure->iolog_files[iofd];
+    struct iolog_dedup *dd;
+    FILE *fp;
+    debug_decl(iolog_dedup_create, SUDO_DEBUG_UTIL);
+
+    if ((dd = calloc(1, sizeof(*dd))) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	goto bad;
+    }
+    dd->fd = dd->store_fd = dd->chunks_fd = -1;
+    if ((dd->name = iolog_fd_to_name(iofd)) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "invalid iofd %d", iofd);
+	goto bad;
+    }
+    if ((dd->digest = sudo_digest_alloc(SUDO_DIGEST_SHA256)) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate digest");
+	goto bad;
+    }
+    gear_init();
+
+    if (!dedup_open_store(dd, closure))
+	goto bad;
+
+    dd->fd = iolog_openat(closure->iolog_dir_fd, dd->name,
+	O_CREAT|O_TRUNC|O_WRONLY);
+    if (dd->fd == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s/%s", closure->evlog->iolog_path, dd->name);
+	goto bad;
+    }
+    if (fchown(dd->fd, iolog_get_uid(), iolog_get_gid()) != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
+	    "%s: unable to fchown %d:%d %s", __func__,
+	    (int)iolog_get_uid(), (int)iolog_get_gid(), dd->name);
+    }
+    (void)fcntl(dd->fd, F_SETFD, FD_CLOEXEC);
+    if (!write_all(dd->fd, IOLOG_CHUNKS_MAGIC, IOLOG_CHUNKS_MAGIC_LEN)) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to write %s/%s", closure->evlog->iolog_path, dd->name);
+	goto bad;
+    }
+
+#ifdef HAVE_FOPENCOOKIE
+    fp = fopencookie(dd, "w", dedup_funcs);
+#else
+    fp = funopen(dd, NULL, dedup_write_funopen, dedup_seek_funopen,
+	dedup_close);
+#endif
+    if (fp == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create stream for %s/%s", closure->evlog->iolog_path,
+	    dd->name);
+	goto bad;
+    }
+    /* The chunk buffer replaces the stdio buffer. */
+    (void)setvbuf(fp, NULL, _IONBF, 0);
+
+    iol->fd.f = fp;
+    iol->enabled = true;
+    iol->writable = true;
+    iol->compressed = false;
+    closure->iolog_dedup[iofd] = dd;
+
+    debug_return_bool(true);
+bad:
+    if (dd != NULL)
+	dedup_free(dd);
+    iol->enabled = false;
+    debug_return_bool(false);
+}
+
+/*
+ * Write data that has not yet reached a chunk boundary to the
+ * manifest as a provisional tail, and the manifest and chunk
+ * references to stable storage if sync is set.  New chunks are
+ * synced as they are stored.  The data is kept in the chunk buffer
+ * so the chunk boundary is the same as if there was no commit point.
+ */
+bool
+iolog_dedup_flush(struct iolog_dedup *dd, bool sync)
+{
+    debug_decl(iolog_dedup_flush, SUDO_DEBUG_UTIL);
+
+    if (dd->len > dd->tail) {
+	if (!dedup_write_inline(dd, 't', dd->buf, dd->len))
+	    debug_return_bool(false);
+	dd->tail = dd->len;
+    }
+    if (sync) {
+	if (fdatasync(dd->fd) == -1 || fsync(dd->chunks_fd) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to sync %s", dd->name);
+	    debug_return_bool(false);
+	}
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Write buffered data for all of a connection's deduplicated
+ * I/O log files before a commit point is sent.
+ */
+bool
+iolog_dedup_flush_all(struct connection_closure *closure)
+{
+    int iofd;
+    debug_decl(iolog_dedup_flush_all, SUDO_DEBUG_UTIL);
+
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	if (closure->iolog_dedup[iofd] == NULL)
+	    continue;
+	if (!iolog_dedup_flush(closure->iolog_dedup[iofd], false))
+	    debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
+#else /* !HAVE_FOPENCOOKIE && !HAVE_FUNOPEN */
+
+bool
+iolog_dedup_create(int iofd, struct connection_closure *closure)
+{
+    debug_decl(iolog_dedup_create, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	"deduplicated I/O logs are not supported on this system");
+    debug_return_bool(false);
+}
+
+bool
+iolog_dedup_flush(struct iolog_dedup *dd, bool sync)
+{
+    return true;
+}
+
+bool
+iolog_dedup_flush_all(struct connection_closure *closure)
+{
+    return true;
+}
+
+#endif /* HAVE_FOPENCOOKIE || HAVE_FUNOPEN */
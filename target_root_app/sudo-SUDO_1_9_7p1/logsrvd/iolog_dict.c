@@ -0,0 +1,1210 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Dictionary-compressed I/O logs.
+ *
+ * Most sessions only produce a few kilobytes of output, which gzip
+ * compresses poorly since it has no history to match against.  When
+ * iolog_dict_dir is set, compressed I/O log files are instead written
+ * as zlib streams with a preset dictionary trained from a sample of
+ * recent sessions.  See lib/iolog/iolog_zdict.h for the format.
+ *
+ * Dictionaries are versioned by their Adler-32 checksum and stored
+ * in iolog_dict_dir as "dict.<id>"; "current" is a hard link to the
+ * one used for new sessions.  Each session hard-links the dictionary
+ * it was written with into its I/O log directory so readers can find
+ * it and old versions stay around as long as they are referenced.
+ *
+ * Training runs periodically in a child process so the event loop is
+ * not blocked.  A new dictionary is only installed if it compresses
+ * the sample better than the current one.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_event.h"
+#include "sudo_eventlog.h"
+#include "sudo_gettext.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrvd.h"
+#include "iolog_zdict.h"
+
+#if defined(HAVE_ZLIB_H) && (defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN))
+
+#define DICT_CURRENT		"current"
+#define DICT_INITIAL_DELAY	60	/* first training if no dictionary */
+#define DICT_SAMPLE_SESSIONS	256	/* most recent sessions to sample */
+#define DICT_SAMPLE_STREAM	(16 * 1024)
+#define DICT_SAMPLE_MAX		(4 * 1024 * 1024)
+#define DICT_SAMPLE_MIN		(64 * 1024)
+#define DICT_WALK_DEPTH		8
+#define DICT_DMER		8	/* bytes per k-mer */
+#define DICT_SEGMENT		64	/* bytes per dictionary segment */
+#define DICT_HASH_BITS		20
+#define DICT_OUTBUF_SIZE	(16 * 1024)
+
+/* Exit status of the training process if the dictionary didn't improve. */
+#define DICT_EXIT_UNCHANGED	2
+
+struct iolog_dict_writer {
+    z_stream strm;
+    off_t offset;		/* uncompressed bytes written */
+    const char *name;
+    int fd;
+    unsigned char outbuf[DICT_OUTBUF_SIZE];
+};
+
+static struct dict_store {
+    struct sudo_event_base *evbase;
+    struct sudo_event *train_ev;
+    pid_t child;
+    int dfd;
+    unsigned int id;
+    size_t len;			/* 0 if there is no current dictionary */
+    unsigned long long trainings;
+    unsigned long long installs;
+    unsigned long long failures;
+    unsigned long long streams;
+    unsigned char data[IOLOG_ZDICT_MAX];
+} dict = { NULL, NULL, -1, -1 };
+
+/* I/O log streams used to train the dictionary. */
+static const int sample_streams[] = {
+    IOFD_TTYOUT, IOFD_STDOUT, IOFD_STDERR, IOFD_TIMING
+};
+
+struct dict_session {
+    time_t mtime;
+    char *path;
+};
+
+struct dict_samples {
+    struct dict_session *sessions;
+    size_t nsessions;
+    unsigned char *data;
+    size_t len;
+    size_t *offsets;		/* nsamples + 1 entries */
+    size_t nsamples;
+};
+
+struct dict_segment {
+    size_t pos;
+    unsigned long long score;
+};
+
+static bool
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *cp = buf;
+    ssize_t nwritten;
+
+    while (len > 0) {
+	nwritten = write(fd, cp, len);
+	if (nwritten == -1) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	cp += nwritten;
+	len -= nwritten;
+    }
+    return true;
+}
+
+/*
+ * Open the dictionary store, creating it as needed.
+ */
+static bool
+dict_open_store(void)
+{
+    const char *path = logsrvd_conf_iolog_dict_dir();
+    debug_decl(dict_open_store, SUDO_DEBUG_UTIL);
+
+    if (dict.dfd != -1)
+	debug_return_bool(true);
+    if (path == NULL)
+	debug_return_bool(false);
+
+    dict.dfd = iolog_openat(AT_FDCWD, path, O_RDONLY);
+    if (dict.dfd == -1 && errno == ENOENT) {
+	char tmp[PATH_MAX];
+
+	/* iolog_mkdirs() modifies its argument. */
+	if (strlcpy(tmp, path, sizeof(tmp)) < sizeof(tmp) && iolog_mkdirs(tmp))
+	    dict.dfd = iolog_openat(AT_FDCWD, path, O_RDONLY);
+    }
+    if (dict.dfd == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open dictionary store %s", path);
+	debug_return_bool(false);
+    }
+    (void)fcntl(dict.dfd, F_SETFD, FD_CLOEXEC);
+
+    debug_return_bool(true);
+}
+
+/*
+ * Load the current dictionary, if there is one.
+ */
+static bool
+dict_load(void)
+{
+    char name[IOLOG_ZDICT_NAME_LEN + 1];
+    ssize_t nread;
+    int fd;
+    debug_decl(dict_load, SUDO_DEBUG_UTIL);
+
+    dict.len = 0;
+    if (!dict_open_store())
+	debug_return_bool(false);
+
+    fd = iolog_openat(dict.dfd, DICT_CURRENT, O_RDONLY);
+    if (fd == -1) {
+	if (errno == ENOENT) {
+	    sudo_debug_printf(SUDO_DEBUG_INFO,
+		"no dictionary in %s yet", logsrvd_conf_iolog_dict_dir());
+	} else {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to open %s/%s", logsrvd_conf_iolog_dict_dir(),
+		DICT_CURRENT);
+	}
+	debug_return_bool(false);
+    }
+    nread = read(fd, dict.data, sizeof(dict.data));
+    close(fd);
+    if (nread <= 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to read %s/%s", logsrvd_conf_iolog_dict_dir(),
+	    DICT_CURRENT);
+	debug_return_bool(false);
+    }
+    dict.id = adler32(adler32(0, NULL, 0), dict.data, (unsigned int)nread);
+
+    /* Sessions link to the versioned name, not "current". */
+    iolog_zdict_name(dict.id, name, sizeof(name));
+    if (faccessat(dict.dfd, name, F_OK, 0) != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "missing %s/%s", logsrvd_conf_iolog_dict_dir(), name);
+	debug_return_bool(false);
+    }
+    dict.len = (size_t)nread;
+    sudo_debug_printf(SUDO_DEBUG_INFO, "loaded dictionary %08x, %zu bytes",
+	dict.id, dict.len);
+
+    debug_return_bool(true);
+}
+
+/*
+ * Returns true if new compressed I/O logs should use a dictionary.
+ */
+bool
+iolog_dict_available(void)
+{
+    return dict.len != 0 && logsrvd_conf_iolog_dict_dir() != NULL;
+}
+
+/*
+ * Run deflate with the specified flush mode, writing any output.
+ */
+static bool
+dict_deflate(struct iolog_dict_writer *w, int flush)
+{
+    size_t len;
+    int rc;
+    debug_decl(dict_deflate, SUDO_DEBUG_UTIL);
+
+    do {
+	w->strm.next_out = w->outbuf;
+	w->strm.avail_out = sizeof(w->outbuf);
+	rc = deflate(&w->strm, flush);
+	if (rc == Z_STREAM_ERROR) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"%s: deflate failed", w->name);
+	    errno = EIO;
+	    debug_return_bool(false);
+	}
+	len = sizeof(w->outbuf) - w->strm.avail_out;
+	if (len != 0 && !write_all(w->fd, w->outbuf, len)) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to write %s", w->name);
+	    debug_return_bool(false);
+	}
+    } while (w->strm.avail_out == 0);
+
+    debug_return_bool(true);
+}
+
+static ssize_t
+dict_write(void *v, const char *buf, size_t len)
+{
+    struct iolog_dict_writer *w = v;
+    debug_decl(dict_write, SUDO_DEBUG_UTIL);
+
+    w->strm.next_in = (unsigned char *)buf;
+    w->strm.avail_in = (unsigned int)len;
+    if (!dict_deflate(w, Z_NO_FLUSH))
+	debug_return_ssize_t(-1);
+    w->offset += len;
+
+    debug_return_ssize_t((ssize_t)len);
+}
+
+/*
+ * Only supports querying the current position.
+ */
+static bool
+dict_seek(struct iolog_dict_writer *w, off_t *offset, int whence)
+{
+    off_t target;
+
+    switch (whence) {
+    case SEEK_SET:
+	target = *offset;
+	break;
+    case SEEK_CUR:
+    case SEEK_END:
+	target = w->offset + *offset;
+	break;
+    default:
+	target = -1;
+	break;
+    }
+    if (target != w->offset) {
+	errno = EINVAL;
+	return false;
+    }
+    *offset = w->offset;
+    return true;
+}
+
+static void
+dict_writer_free(struct iolog_dict_writer *w)
+{
+    if (w->fd != -1)
+	close(w->fd);
+    (void)deflateEnd(&w->strm);
+    free(w);
+}
+
+static int
+dict_close(void *v)
+{
+    struct iolog_dict_writer *w = v;
+    int ret = 0;
+    debug_decl(dict_close, SUDO_DEBUG_UTIL);
+
+    if (!dict_deflate(w, Z_FINISH))
+	ret = -1;
+    sudo_debug_printf(SUDO_DEBUG_INFO, "%s: %lld bytes, %lu compressed",
+	w->name, (long long)w->offset, w->strm.total_out);
+    if (close(w->fd) == -1)
+	ret = -1;
+    w->fd = -1;
+    dict_writer_free(w);
+
+    debug_return_int(ret);
+}
+
+#ifdef HAVE_FOPENCOOKIE
+static int
+dict_seek_cookie(void *v, off64_t *offset, int whence)
+{
+    off_t pos = (off_t)*offset;
+
+    if (!dict_seek(v, &pos, whence))
+	return -1;
+    *offset = pos;
+    return 0;
+}
+
+static cookie_io_functions_t dict_funcs = {
+    NULL, dict_write, dict_seek_cookie, dict_close
+};
+#else
+static int
+dict_write_funopen(void *v, const char *buf, int len)
+{
+    return (int)dict_write(v, buf, (size_t)len);
+}
+
+static fpos_t
+dict_seek_funopen(void *v, fpos_t offset, int whence)
+{
+    off_t pos = (off_t)offset;
+
+    if (!dict_seek(v, &pos, whence))
+	return -1;
+    return (fpos_t)pos;
+}
+#endif /* HAVE_FOPENCOOKIE */
+
+/*
+ * Make the current dictionary available in the I/O log directory.
+ * A hard link is used when possible, otherwise it is copied.
+ */
+static bool
+dict_link(struct connection_closure *closure)
+{
+    char name[IOLOG_ZDICT_NAME_LEN + 1];
+    int fd;
+    debug_decl(dict_link, SUDO_DEBUG_UTIL);
+
+    iolog_zdict_name(dict.id, name, sizeof(name));
+    if (linkat(dict.dfd, name, closure->iolog_dir_fd, name, 0) == 0 ||
+	    errno == EEXIST)
+	debug_return_bool(true);
+
+    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	"unable to link %s into %s, copying", name,
+	closure->evlog->iolog_path);
+    fd = iolog_openat(closure->iolog_dir_fd, name, O_CREAT|O_EXCL|O_WRONLY);
+    if (fd == -1) {
+	if (errno == EEXIST)
+	    debug_return_bool(true);
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create %s/%s", closure->evlog->iolog_path, name);
+	debug_return_bool(false);
+    }
+    if (fchown(fd, iolog_get_uid(), iolog_get_gid()) != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
+	    "%s: unable to fchown %d:%d %s", __func__,
+	    (int)iolog_get_uid(), (int)iolog_get_gid(), name);
+    }
+    if (!write_all(fd, dict.data, dict.len)) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to write %s/%s", closure->evlog->iolog_path, name);
+	close(fd);
+	(void)unlinkat(closure->iolog_dir_fd, name, 0);
+	debug_return_bool(false);
+    }
+    close(fd);
+
+    debug_return_bool(true);
+}
+
+/*
+ * Create a compressed I/O log file that uses the current dictionary.
+ */
+bool
+iolog_dict_create(int iofd, struct connection_closure *closure)
+{
+    struct iolog_file *iol = &closure->iolog_files[iofd];
+    struct iolog_dict_writer *w;
+    FILE *fp;
+    debug_decl(iolog_dict_create, SUDO_DEBUG_UTIL);
+
+    if ((w = calloc(1, sizeof(*w))) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	goto bad;
+    }
+    w->fd = -1;
+    if ((w->name = iolog_fd_to_name(iofd)) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "invalid iofd %d", iofd);
+	goto bad;
+    }
+    if (!dict_link(closure))
+	goto bad;
+
+    w->fd = iolog_openat(closure->iolog_dir_fd, w->name,
+	O_CREAT|O_TRUNC|O_WRONLY);
+    if (w->fd == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s/%s", closure->evlog->iolog_path, w->name);
+	goto bad;
+    }
+    if (fchown(w->fd, iolog_get_uid(), iolog_get_gid()) != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
+	    "%s: unable to fchown %d:%d %s", __func__,
+	    (int)iolog_get_uid(), (int)iolog_get_gid(), w->name);
+    }
+    (void)fcntl(w->fd, F_SETFD, FD_CLOEXEC);
+
+    /* Same settings as gzip, but with a zlib header and preset dictionary. */
+    if (deflateInit2(&w->strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK ||
+	    deflateSetDictionary(&w->strm, dict.data, dict.len) != Z_OK) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to initialize zlib stream for %s", w->name);
+	goto bad;
+    }
+
+#ifdef HAVE_FOPENCOOKIE
+    fp = fopencookie(w, "w", dict_funcs);
+#else
+    fp = funopen(w, NULL, dict_write_funopen, dict_seek_funopen, dict_close);
+#endif
+    if (fp == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create stream for %s/%s", closure->evlog->iolog_path,
+	    w->name);
+	goto bad;
+    }
+    /* zlib does its own buffering. */
+    (void)setvbuf(fp, NULL, _IONBF, 0);
+
+    iol->fd.f = fp;
+    iol->enabled = true;
+    iol->writable = true;
+    iol->compressed = false;
+    closure->iolog_dict[iofd] = w;
+    dict.streams++;
+
+    debug_return_bool(true);
+bad:
+    if (w != NULL)
+	dict_writer_free(w);
+    iol->enabled = false;
+    debug_return_bool(false);
+}
+
+/*
+ * Write pending compressed data, and sync it to stable storage
+ * if sync is set.
+ */
+bool
+iolog_dict_flush(struct iolog_dict_writer *w, bool sync)
+{
+    debug_decl(iolog_dict_flush, SUDO_DEBUG_UTIL);
+
+    if (!dict_deflate(w, Z_SYNC_FLUSH))
+	debug_return_bool(false);
+    if (sync && fdatasync(w->fd) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to sync %s", w->name);
+	debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Write pending compressed data for all of a connection's
+ * dictionary-compressed I/O log files before a commit point is sent.
+ */
+bool
+iolog_dict_flush_all(struct connection_closure *closure)
+{
+    int iofd;
+    debug_decl(iolog_dict_flush_all, SUDO_DEBUG_UTIL);
+
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	if (closure->iolog_dict[iofd] == NULL)
+	    continue;
+	if (!iolog_dict_flush(closure->iolog_dict[iofd], false))
+	    debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Add an I/O log directory to the sample, keeping the most recent ones.
+ */
+static void
+dict_add_session(struct dict_samples *s, const char *path, time_t mtime)
+{
+    size_t i, oldest = 0;
+    char *copy;
+    debug_decl(dict_add_session, SUDO_DEBUG_UTIL);
+
+    if (s->nsessions == DICT_SAMPLE_SESSIONS) {
+	for (i = 1; i < s->nsessions; i++) {
+	    if (s->sessions[i].mtime < s->sessions[oldest].mtime)
+		oldest = i;
+	}
+	if (mtime <= s->sessions[oldest].mtime)
+	    debug_return;
+    } else {
+	oldest = s->nsessions;
+    }
+    if ((copy = strdup(path)) == NULL)
+	debug_return;
+    if (oldest == s->nsessions)
+	s->nsessions++;
+    else
+	free(s->sessions[oldest].path);
+    s->sessions[oldest].path = copy;
+    s->sessions[oldest].mtime = mtime;
+
+    debug_return;
+}
+
+/*
+ * Find I/O log directories (those with a timing file) under path.
+ */
+static void
+dict_walk(struct dict_samples *s, const char *path, int depth)
+{
+    char child[PATH_MAX], timing[PATH_MAX];
+    struct dirent *dp;
+    struct stat sb;
+    DIR *dirp;
+    int len;
+    debug_decl(dict_walk, SUDO_DEBUG_UTIL);
+
+    if ((dirp = opendir(path)) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s", path);
+	debug_return;
+    }
+    while ((dp = readdir(dirp)) != NULL) {
+	if (dp->d_name[0] == '.')
+	    continue;
+	if (fstatat(dirfd(dirp), dp->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1 ||
+		!S_ISDIR(sb.st_mode))
+	    continue;
+	len = snprintf(child, sizeof(child), "%s/%s", path, dp->d_name);
+	if (len < 0 || len >= ssizeof(child))
+	    continue;
+	len = snprintf(timing, sizeof(timing), "%s/timing", dp->d_name);
+	if (len < 0 || len >= ssizeof(timing))
+	    continue;
+	if (fstatat(dirfd(dirp), timing, &sb, 0) == 0) {
+	    dict_add_session(s, child, sb.st_mtime);
+	} else if (depth < DICT_WALK_DEPTH) {
+	    dict_walk(s, child, depth + 1);
+	}
+    }
+    closedir(dirp);
+
+    debug_return;
+}
+
+/*
+ * Read the start of each sampled I/O log stream.
+ * Existing logs are read via iolog_open() so any format may be used.
+ */
+static bool
+dict_read_samples(struct dict_samples *s)
+{
+    struct iolog_file iol;
+    const char *errstr;
+    size_t i, j, want;
+    ssize_t nread;
+    int dfd;
+    debug_decl(dict_read_samples, SUDO_DEBUG_UTIL);
+
+    s->data = malloc(DICT_SAMPLE_MAX);
+    s->offsets = reallocarray(NULL,
+	s->nsessions * nitems(sample_streams) + 1, sizeof(size_t));
+    if (s->data == NULL || s->offsets == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	debug_return_bool(false);
+    }
+    s->offsets[0] = 0;
+
+    for (i = 0; i < s->nsessions && s->len < DICT_SAMPLE_MAX; i++) {
+	dfd = iolog_openat(AT_FDCWD, s->sessions[i].path, O_RDONLY);
+	if (dfd == -1)
+	    continue;
+	for (j = 0; j < nitems(sample_streams); j++) {
+	    memset(&iol, 0, sizeof(iol));
+	    iol.enabled = true;
+	    if (!iolog_open(&iol, dfd, sample_streams[j], "r"))
+		continue;
+	    want = MIN(DICT_SAMPLE_STREAM, DICT_SAMPLE_MAX - s->len);
+	    nread = iolog_read(&iol, s->data + s->len, want, &errstr);
+	    (void)iolog_close(&iol, &errstr);
+	    if (nread > 0) {
+		s->len += (size_t)nread;
+		s->offsets[++s->nsamples] = s->len;
+	    }
+	}
+	close(dfd);
+    }
+
+    debug_return_bool(true);
+}
+
+static inline size_t
+dict_hash(const unsigned char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (size_t)((v * 0x9e3779b97f4a7c15ULL) >> (64 - DICT_HASH_BITS));
+}
+
+static int
+dict_segment_cmp(const void *v1, const void *v2)
+{
+    const struct dict_segment *seg1 = v1;
+    const struct dict_segment *seg2 = v2;
+
+    if (seg1->score < seg2->score)
+	return -1;
+    return seg1->score > seg2->score;
+}
+
+/*
+ * Build a dictionary from the samples, returning its length.
+ *
+ * This is a simplified version of the "cover" algorithm: the
+ * samples are divided into epochs, one segment is chosen from each
+ * epoch based on how many samples contain its k-mers, and those
+ * k-mers no longer count toward later segments.  The best segments
+ * go at the end of the dictionary where matches are cheapest.
+ */
+static size_t
+dict_cover(const struct dict_samples *s, unsigned char *out)
+{
+    const size_t nsegments = IOLOG_ZDICT_MAX / DICT_SEGMENT;
+    const size_t nkmers = DICT_SEGMENT - DICT_DMER + 1;
+    struct dict_segment *segments = NULL;
+    uint32_t *counts = NULL, *seen = NULL;
+    size_t i, p, nselected = 0, len = 0;
+    size_t epoch, start, end;
+    debug_decl(dict_cover, SUDO_DEBUG_UTIL);
+
+    if (s->len < DICT_SAMPLE_MIN || s->nsamples < 2) {
+	sudo_debug_printf(SUDO_DEBUG_INFO,
+	    "not enough sample data to train (%zu bytes, %zu samples)",
+	    s->len, s->nsamples);
+	debug_return_size_t(0);
+    }
+
+    counts = calloc((size_t)1 << DICT_HASH_BITS, sizeof(*counts));
+    seen = calloc((size_t)1 << DICT_HASH_BITS, sizeof(*seen));
+    segments = reallocarray(NULL, nsegments, sizeof(*segments));
+    if (counts == NULL || seen == NULL || segments == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	goto done;
+    }
+
+    /* Count the number of samples each k-mer appears in. */
+    for (i = 0; i < s->nsamples; i++) {
+	for (p = s->offsets[i]; p + DICT_DMER <= s->offsets[i + 1]; p++) {
+	    const size_t h = dict_hash(s->data + p);
+
+	    if (seen[h] != i + 1) {
+		seen[h] = i + 1;
+		counts[h]++;
+	    }
+	}
+    }
+
+    epoch = MAX(s->len / nsegments, DICT_SEGMENT);
+    for (start = 0; start + DICT_SEGMENT <= s->len && nselected < nsegments;
+	    start += epoch) {
+	unsigned long long score = 0, best_score = 0;
+	size_t best = 0;
+
+	end = MIN(start + epoch, s->len);
+	if (end - start < DICT_SEGMENT)
+	    break;
+
+	/* Slide a window over the epoch; only shared k-mers count. */
+	for (i = 0; i < nkmers; i++) {
+	    const uint32_t c = counts[dict_hash(s->data + start + i)];
+	    score += c > 1 ? c : 0;
+	}
+	best_score = score;
+	best = start;
+	for (p = start + 1; p + DICT_SEGMENT <= end; p++) {
+	    const uint32_t c_out = counts[dict_hash(s->data + p - 1)];
+	    const uint32_t c_in = counts[dict_hash(s->data + p + nkmers - 1)];
+
+	    score -= c_out > 1 ? c_out : 0;
+	    score += c_in > 1 ? c_in : 0;
+	    if (score > best_score) {
+		best_score = score;
+		best = p;
+	    }
+	}
+	if (best_score == 0)
+	    continue;
+
+	segments[nselected].pos = best;
+	segments[nselected].score = best_score;
+	nselected++;
+	for (i = 0; i < nkmers; i++)
+	    counts[dict_hash(s->data + best + i)] = 0;
+    }
+
+    qsort(segments, nselected, sizeof(*segments), dict_segment_cmp);
+    for (i = 0; i < nselected; i++) {
+	memcpy(out + len, s->data + segments[i].pos, DICT_SEGMENT);
+	len += DICT_SEGMENT;
+    }
+
+done:
+    free(counts);
+    free(seen);
+    free(segments);
+    debug_return_size_t(len);
+}
+
+/*
+ * Compress each sample individually, as a small session would be,
+ * and return the total size.
+ */
+static size_t
+dict_compressed_size(const struct dict_samples *s, const unsigned char *data,
+    size_t len)
+{
+    unsigned char *outbuf = NULL;
+    size_t i, outsize, total = SIZE_MAX;
+    z_stream strm;
+    debug_decl(dict_compressed_size, SUDO_DEBUG_UTIL);
+
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+	debug_return_size_t(SIZE_MAX);
+    outsize = deflateBound(&strm, DICT_SAMPLE_STREAM);
+    if ((outbuf = malloc(outsize)) == NULL)
+	goto done;
+
+    total = 0;
+    for (i = 0; i < s->nsamples; i++) {
+	if (deflateReset(&strm) != Z_OK)
+	    goto bad;
+	if (len != 0 && deflateSetDictionary(&strm, data, len) != Z_OK)
+	    goto bad;
+	strm.next_in = s->data + s->offsets[i];
+	strm.avail_in = (unsigned int)(s->offsets[i + 1] - s->offsets[i]);
+	strm.next_out = outbuf;
+	strm.avail_out = (unsigned int)outsize;
+	if (deflate(&strm, Z_FINISH) != Z_STREAM_END)
+	    goto bad;
+	total += strm.total_out;
+    }
+    goto done;
+bad:
+    total = SIZE_MAX;
+done:
+    free(outbuf);
+    (void)deflateEnd(&strm);
+    debug_return_size_t(total);
+}
+
+/*
+ * Remove dictionary versions that are no longer current and are not
+ * referenced by any I/O log.
+ */
+static void
+dict_prune(unsigned int current)
+{
+    char name[IOLOG_ZDICT_NAME_LEN + 1];
+    struct dirent *dp;
+    struct stat sb;
+    DIR *dirp;
+    int fd;
+    debug_decl(dict_prune, SUDO_DEBUG_UTIL);
+
+    iolog_zdict_name(current, name, sizeof(name));
+    if ((fd = dup(dict.dfd)) == -1 || (dirp = fdopendir(fd)) == NULL) {
+	if (fd != -1)
+	    close(fd);
+	debug_return;
+    }
+    rewinddir(dirp);
+    while ((dp = readdir(dirp)) != NULL) {
+	if (strncmp(dp->d_name, IOLOG_ZDICT_PREFIX,
+		sizeof(IOLOG_ZDICT_PREFIX) - 1) != 0 ||
+		strlen(dp->d_name) != IOLOG_ZDICT_NAME_LEN ||
+		strcmp(dp->d_name, name) == 0)
+	    continue;
+	if (fstatat(dict.dfd, dp->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+		S_ISREG(sb.st_mode) && sb.st_nlink == 1) {
+	    sudo_debug_printf(SUDO_DEBUG_INFO, "removing unused dictionary %s",
+		dp->d_name);
+	    (void)unlinkat(dict.dfd, dp->d_name, 0);
+	}
+    }
+    closedir(dirp);
+
+    debug_return;
+}
+
+/*
+ * Store a new dictionary version and make it current.
+ */
+static bool
+dict_install(const unsigned char *data, size_t len)
+{
+    char name[IOLOG_ZDICT_NAME_LEN + 1];
+    char tmp[sizeof(".") + IOLOG_ZDICT_NAME_LEN + 16];
+    unsigned int id;
+    int fd;
+    debug_decl(dict_install, SUDO_DEBUG_UTIL);
+
+    id = adler32(adler32(0, NULL, 0), data, (unsigned int)len);
+    iolog_zdict_name(id, name, sizeof(name));
+    (void)snprintf(tmp, sizeof(tmp), ".%s.%d", name, (int)getpid());
+
+    fd = iolog_openat(dict.dfd, tmp, O_CREAT|O_TRUNC|O_WRONLY);
+    if (fd == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create %s/%s", logsrvd_conf_iolog_dict_dir(), tmp);
+	debug_return_bool(false);
+    }
+    if (fchown(fd, iolog_get_uid(), iolog_get_gid()) != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
+	    "%s: unable to fchown %d:%d %s", __func__,
+	    (int)iolog_get_uid(), (int)iolog_get_gid(), tmp);
+    }
+    if (!write_all(fd, data, len) || fdatasync(fd) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to write %s/%s", logsrvd_conf_iolog_dict_dir(), tmp);
+	close(fd);
+	goto bad;
+    }
+    close(fd);
+
+    /* The versioned name must exist before "current" points to it. */
+    if (linkat(dict.dfd, tmp, dict.dfd, name, 0) == -1 && errno != EEXIST) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to link %s/%s", logsrvd_conf_iolog_dict_dir(), name);
+	goto bad;
+    }
+    if (renameat(dict.dfd, tmp, dict.dfd, DICT_CURRENT) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to rename %s/%s", logsrvd_conf_iolog_dict_dir(), tmp);
+	goto bad;
+    }
+    (void)fsync(dict.dfd);
+    sudo_debug_printf(SUDO_DEBUG_INFO, "installed dictionary %s, %zu bytes",
+	name, len);
+
+    dict_prune(id);
+    debug_return_bool(true);
+bad:
+    (void)unlinkat(dict.dfd, tmp, 0);
+    debug_return_bool(false);
+}
+
+/*
+ * Train a new dictionary from recent sessions.
+ * Runs in a child process; returns its exit status.
+ */
+static int
+dict_train(void)
+{
+    unsigned char *trained = NULL;
+    struct dict_samples s;
+    char base[PATH_MAX];
+    size_t i, len, old_size, new_size;
+    int ret = EXIT_FAILURE;
+    debug_decl(dict_train, SUDO_DEBUG_UTIL);
+
+    memset(&s, 0, sizeof(s));
+    if (!dict_open_store())
+	goto done;
+    if (!storage_base_dir(logsrvd_conf_iolog_dir(), base, sizeof(base))) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to determine base of %s", logsrvd_conf_iolog_dir());
+	goto done;
+    }
+    s.sessions = reallocarray(NULL, DICT_SAMPLE_SESSIONS, sizeof(*s.sessions));
+    if (s.sessions == NULL || (trained = malloc(IOLOG_ZDICT_MAX)) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	goto done;
+    }
+    dict_walk(&s, base, 0);
+    if (!dict_read_samples(&s))
+	goto done;
+
+    if ((len = dict_cover(&s, trained)) == 0) {
+	ret = DICT_EXIT_UNCHANGED;
+	goto done;
+    }
+
+    /* Only replace the current dictionary if the new one is 1% better. */
+    old_size = dict_compressed_size(&s, dict.data, dict.len);
+    new_size = dict_compressed_size(&s, trained, len);
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"%zu sessions, %zu samples, %zu bytes: %zu compressed with %s, "
+	"%zu with new %zu byte dictionary", s.nsessions, s.nsamples, s.len,
+	old_size, dict.len ? "current dictionary" : "no dictionary",
+	new_size, len);
+    if (new_size >= old_size - old_size / 100) {
+	ret = DICT_EXIT_UNCHANGED;
+	goto done;
+    }
+    if (dict_install(trained, len))
+	ret = EXIT_SUCCESS;
+
+done:
+    for (i = 0; i < s.nsessions; i++)
+	free(s.sessions[i].path);
+    free(s.sessions);
+    free(s.data);
+    free(s.offsets);
+    free(trained);
+    debug_return_int(ret);
+}
+
+static void
+dict_schedule(time_t secs)
+{
+    struct timespec tv = { secs, 0 };
+    debug_decl(dict_schedule, SUDO_DEBUG_UTIL);
+
+    if (sudo_ev_add(dict.evbase, dict.train_ev, &tv, false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add dictionary training event");
+    }
+
+    debug_return;
+}
+
+/*
+ * Periodically train a new dictionary in a child process.
+ */
+static void
+dict_train_cb(int unused, int what, void *v)
+{
+    const time_t interval = logsrvd_conf_iolog_dict_interval();
+    pid_t pid;
+    debug_decl(dict_train_cb, SUDO_DEBUG_UTIL);
+
+    if (logsrvd_conf_iolog_dict_dir() == NULL || interval == 0)
+	debug_return;
+
+    if (dict.child == -1) {
+	switch (pid = sudo_debug_fork()) {
+	case -1:
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to fork dictionary training process");
+	    dict.failures++;
+	    break;
+	case 0:
+	    /*
+	     * Training may take a while, the child must not keep the
+	     * server's listeners and client connections open, or run
+	     * the server's signal handlers.
+	     */
+	    closefrom(STDERR_FILENO + 1);
+	    signal(SIGHUP, SIG_IGN);
+	    signal(SIGINT, SIG_IGN);
+	    signal(SIGUSR1, SIG_IGN);
+	    signal(SIGPIPE, SIG_IGN);
+	    signal(SIGTERM, SIG_DFL);
+	    signal(SIGCHLD, SIG_DFL);
+	    _exit(dict_train());
+	default:
+	    dict.child = pid;
+	    dict.trainings++;
+	    break;
+	}
+    }
+    dict_schedule(interval);
+
+    debug_return;
+}
+
+/*
+ * Collect the training process, loading the new dictionary if
+ * one was installed.  Called when SIGCHLD is received.
+ */
+void
+iolog_dict_reap(void)
+{
+    int status;
+    pid_t pid;
+    debug_decl(iolog_dict_reap, SUDO_DEBUG_UTIL);
+
+    if (dict.child == -1)
+	debug_return;
+    do {
+	pid = waitpid(dict.child, &status, WNOHANG);
+    } while (pid == -1 && errno == EINTR);
+    if (pid != dict.child)
+	debug_return;
+    dict.child = -1;
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+	dict.installs++;
+	(void)dict_load();
+    } else if (!WIFEXITED(status) ||
+	    WEXITSTATUS(status) != DICT_EXIT_UNCHANGED) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "dictionary training failed, status 0x%x", status);
+	dict.failures++;
+    }
+
+    debug_return;
+}
+
+/*
+ * (Re)load the current dictionary and training schedule
+ * after the configuration has been read.
+ */
+void
+iolog_dict_reload(void)
+{
+    debug_decl(iolog_dict_reload, SUDO_DEBUG_UTIL);
+
+    if (dict.dfd != -1) {
+	close(dict.dfd);
+	dict.dfd = -1;
+    }
+    dict.len = 0;
+    if (dict.train_ev != NULL)
+	sudo_ev_del(dict.evbase, dict.train_ev);
+
+    if (logsrvd_conf_iolog_dict_dir() == NULL)
+	debug_return;
+    (void)dict_load();
+    if (dict.train_ev != NULL && logsrvd_conf_iolog_dict_interval() != 0) {
+	dict_schedule(dict.len ? logsrvd_conf_iolog_dict_interval() :
+	    DICT_INITIAL_DELAY);
+    }
+
+    debug_return;
+}
+
+/*
+ * Allocate the training timer and load the current dictionary.
+ */
+bool
+iolog_dict_init(struct sudo_event_base *evbase)
+{
+    debug_decl(iolog_dict_init, SUDO_DEBUG_UTIL);
+
+    if (dict.train_ev == NULL) {
+	dict.train_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT, dict_train_cb,
+	    NULL);
+	if (dict.train_ev == NULL)
+	    debug_return_bool(false);
+    }
+    dict.evbase = evbase;
+    iolog_dict_reload();
+
+    debug_return_bool(true);
+}
+
+/*
+ * Dump dictionary state to the debug file.
+ */
+void
+iolog_dict_dump(void)
+{
+    debug_decl(iolog_dict_dump, SUDO_DEBUG_UTIL);
+
+    if (logsrvd_conf_iolog_dict_dir() == NULL)
+	debug_return;
+
+    sudo_debug_printf(SUDO_DEBUG_INFO, "dictionary store: %s",
+	logsrvd_conf_iolog_dict_dir());
+    if (dict.len != 0) {
+	sudo_debug_printf(SUDO_DEBUG_INFO, "  current: %08x, %zu bytes",
+	    dict.id, dict.len);
+    }
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"  %llu trainings, %llu installed, %llu failed, %llu streams written",
+	dict.trainings, dict.installs, dict.failures, dict.streams);
+
+    debug_return;
+}
+
+#else /* !HAVE_ZLIB_H || (!HAVE_FOPENCOOKIE && !HAVE_FUNOPEN) */
+
+bool
+iolog_dict_init(struct sudo_event_base *evbase)
+{
+    return true;
+}
+
+void
+iolog_dict_reload(void)
+{
+    return;
+}
+
+void
+iolog_dict_reap(void)
+{
+    return;
+}
+
+void
+iolog_dict_dump(void)
+{
+    return;
+}
+
+bool
+iolog_dict_available(void)
+{
+    return false;
+}
+
+bool
+iolog_dict_create(int iofd, struct connection_closure *closure)
+{
+    debug_decl(iolog_dict_create, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	"dictionary-compressed I/O logs are not supported on this system");
+    debug_return_bool(false);
+}
+
+bool
+iolog_dict_flush(struct iolog_dict_writer *w, bool sync)
+{
+    return true;
+}
+
+bool
+iolog_dict_flush_all(struct connection_closure *closure)
+{
+    return true;
+}
+
+#endif /* HAVE_ZLIB_H && (HAVE_FOPENCOOKIE || HAVE_FUNOPEN) */
@@ -0,0 +1,686 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_digest.h"
+#include "sudo_eventlog.h"
+#include "sudo_fatal.h"
+#include "sudo_gettext.h"
+#include "sudo_iolog.h"
+#include "sudo_json.h"
+#include "sudo_util.h"
+
+#include "iolog_digest.h"
+
+struct iolog_digest_stream {
+    struct sudo_digest *ctx;	/* digest of the current chunk */
+    unsigned long long offset;	/* number of bytes hashed */
+    unsigned long long chunks;	/* number of checkpoints written */
+    size_t fill;		/* bytes in the current chunk */
+    unsigned char chain[IOLOG_DIGEST_MAX_LEN];
+};
+
+struct iolog_digest {
+    struct sudo_digest *chain_ctx;
+    char *iolog_path;
+    int fd;
+    int md_len;
+    bool keyed;
+    unsigned char key[IOLOG_DIGEST_BLOCK];
+    struct iolog_digest_stream streams[IOFD_MAX];
+};
+
+/* Secret used to key new digest chains, see iolog_digest_set_key(). */
+static unsigned char digest_key[IOLOG_DIGEST_BLOCK];
+static bool digest_keyed;
+
+void
+iolog_digest_to_hex(const unsigned char *md, int md_len, char *hex)
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < md_len; i++) {
+	*hex++ = hexdigits[md[i] >> 4];
+	*hex++ = hexdigits[md[i] & 0x0f];
+    }
+    *hex = '\0';
+}
+
+/*
+ * Compute HMAC(key, buf1 || buf2) as described in RFC 2104.
+ * The key has already been padded (or hashed) to the block size.
+ */
+static void
+digest_hmac(struct sudo_digest *ctx, const unsigned char *key, int md_len,
+    const void *buf1, size_t len1, const void *buf2, size_t len2,
+    unsigned char *md)
+{
+    unsigned char pad[IOLOG_DIGEST_BLOCK];
+    unsigned char inner[IOLOG_DIGEST_MAX_LEN];
+    int i;
+
+    for (i = 0; i < IOLOG_DIGEST_BLOCK; i++)
+	pad[i] = key[i] ^ 0x36;
+    sudo_digest_reset(ctx);
+    sudo_digest_update(ctx, pad, sizeof(pad));
+    sudo_digest_update(ctx, buf1, len1);
+    if (len2 != 0)
+	sudo_digest_update(ctx, buf2, len2);
+    sudo_digest_final(ctx, inner);
+
+    for (i = 0; i < IOLOG_DIGEST_BLOCK; i++)
+	pad[i] = key[i] ^ 0x5c;
+    sudo_digest_reset(ctx);
+    sudo_digest_update(ctx, pad, sizeof(pad));
+    sudo_digest_update(ctx, inner, md_len);
+    sudo_digest_final(ctx, md);
+
+    explicit_bzero(pad, sizeof(pad));
+    explicit_bzero(inner, sizeof(inner));
+}
+
+/*
+ * Extend a hash chain by one chunk digest, using the key if specified.
+ * The new chain value may be stored over the previous one.
+ */
+static void
+digest_chain(struct sudo_digest *ctx, const unsigned char *key, int md_len,
+    const unsigned char *prev, const unsigned char *md, unsigned char *chain)
+{
+    if (key != NULL) {
+	digest_hmac(ctx, key, md_len, prev, md_len, md, md_len, chain);
+    } else {
+	sudo_digest_reset(ctx);
+	sudo_digest_update(ctx, prev, md_len);
+	sudo_digest_update(ctx, md, md_len);
+	sudo_digest_final(ctx, chain);
+    }
+}
+
+/*
+ * Read the secret used to key new digest chains from path, or stop
+ * keying them if path is NULL.  Keys longer than the hash block size
+ * are hashed first, as in RFC 2104.  On error, the previous key, if
+ * any, is left in place.
+ */
+bool
+iolog_digest_set_key(const char *path)
+{
+    unsigned char buf[IOLOG_DIGEST_KEY_MAX];
+    struct sudo_digest *ctx;
+    struct stat sb;
+    size_t len = 0;
+    ssize_t nread;
+    bool ret = false;
+    int fd;
+    debug_decl(iolog_digest_set_key, SUDO_DEBUG_UTIL);
+
+    if (path == NULL) {
+	explicit_bzero(digest_key, sizeof(digest_key));
+	digest_keyed = false;
+	debug_return_bool(true);
+    }
+
+    fd = open(path, O_RDONLY|O_NOFOLLOW);
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+	sudo_warn(U_("unable to open %s"), path);
+	if (fd != -1)
+	    close(fd);
+	debug_return_bool(false);
+    }
+    if (!S_ISREG(sb.st_mode) || ISSET(sb.st_mode, S_IRWXO)) {
+	sudo_warnx(U_("%s: digest key must be a regular file that is not "
+	    "accessible by other users"), path);
+	goto done;
+    }
+    while (len < sizeof(buf)) {
+	nread = read(fd, buf + len, sizeof(buf) - len);
+	if (nread == 0)
+	    break;
+	if (nread == -1) {
+	    if (errno == EINTR)
+		continue;
+	    sudo_warn(U_("unable to read %s"), path);
+	    goto done;
+	}
+	len += nread;
+    }
+    if (len < IOLOG_DIGEST_KEY_MIN || len == sizeof(buf)) {
+	sudo_warnx(U_("%s: digest key must be between %d and %d bytes"),
+	    path, IOLOG_DIGEST_KEY_MIN, IOLOG_DIGEST_KEY_MAX - 1);
+	goto done;
+    }
+
+    memset(digest_key, 0, sizeof(digest_key));
+    if (len > IOLOG_DIGEST_BLOCK) {
+	if ((ctx = sudo_digest_alloc(IOLOG_DIGEST_TYPE)) == NULL) {
+	    sudo_warnx(U_("%s: %s"), __func__,
+		U_("unable to allocate memory"));
+	    goto done;
+	}
+	sudo_digest_update(ctx, buf, len);
+	sudo_digest_final(ctx, digest_key);
+	sudo_digest_free(ctx);
+    } else {
+	memcpy(digest_key, buf, len);
+    }
+    digest_keyed = true;
+    ret = true;
+
+done:
+    explicit_bzero(buf, sizeof(buf));
+    close(fd);
+    debug_return_bool(ret);
+}
+
+/*
+ * Returns true if a key has been set with iolog_digest_set_key().
+ */
+bool
+iolog_digest_keyed(void)
+{
+    return digest_keyed;
+}
+
+/*
+ * Extend a hash chain by one chunk digest, keyed if a key has been
+ * set.  Used to verify the checkpoints in an existing digest file.
+ */
+void
+iolog_digest_chain(struct sudo_digest *ctx, const unsigned char *prev,
+    const unsigned char *md, unsigned char *chain)
+{
+    digest_chain(ctx, digest_keyed ? digest_key : NULL,
+	sudo_digest_getlen(IOLOG_DIGEST_TYPE), prev, md, chain);
+}
+
+/*
+ * Compute the seal of a keyed log, the HMAC of the final state of each
+ * stream formatted with IOLOG_DIGEST_SEAL_FMT.  A key must have been set.
+ */
+void
+iolog_digest_mac(struct sudo_digest *ctx, const char *str, unsigned char *mac)
+{
+    digest_hmac(ctx, digest_key, sudo_digest_getlen(IOLOG_DIGEST_TYPE),
+	str, strlen(str), NULL, 0, mac);
+}
+
+/*
+ * Finish the current chunk of the specified stream, extend its
+ * hash chain and append a checkpoint to the digest file.
+ */
+static bool
+digest_checkpoint(struct iolog_digest *dig, int iofd)
+{
+    struct iolog_digest_stream *ds = &dig->streams[iofd];
+    unsigned char md[IOLOG_DIGEST_MAX_LEN];
+    char md_hex[IOLOG_DIGEST_MAX_LEN * 2 + 1];
+    char chain_hex[IOLOG_DIGEST_MAX_LEN * 2 + 1];
+    char line[64 + IOLOG_DIGEST_MAX_LEN * 4];
+    const char *cp;
+    ssize_t nwritten;
+    int len;
+    debug_decl(digest_checkpoint, SUDO_DEBUG_UTIL);
+
+    sudo_digest_final(ds->ctx, md);
+    sudo_digest_reset(ds->ctx);
+
+    digest_chain(dig->chain_ctx, dig->keyed ? dig->key : NULL, dig->md_len,
+	ds->chain, md, ds->chain);
+
+    iolog_digest_to_hex(md, dig->md_len, md_hex);
+    iolog_digest_to_hex(ds->chain, dig->md_len, chain_hex);
+    len = snprintf(line, sizeof(line), "%d %llu %llu %zu %s %s\n", iofd,
+	ds->chunks, ds->offset - ds->fill, ds->fill, md_hex, chain_hex);
+    if (len < 0 || len >= ssizeof(line)) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to format checkpoint, len %d", len);
+	debug_return_bool(false);
+    }
+    for (cp = line; len > 0; cp += nwritten, len -= nwritten) {
+	nwritten = write(dig->fd, cp, len);
+	if (nwritten == -1) {
+	    if (errno == EINTR)
+		nwritten = 0;
+	    else {
+		sudo_debug_printf(
+		    SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		    "unable to write to %s/%s", dig->iolog_path,
+		    IOLOG_DIGEST_FILE);
+		debug_return_bool(false);
+	    }
+	}
+    }
+    ds->chunks++;
+    ds->fill = 0;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Create the digest file in the I/O log directory, truncating any
+ * existing one, and allocate the digest state.  If a key is set,
+ * the chain is keyed with a copy of it so a key reloaded while the
+ * session is running does not change the chain part way through.
+ */
+struct iolog_digest *
+iolog_digest_open(int dfd, const char *iolog_path)
+{
+    struct iolog_digest *dig;
+    char header[64];
+    int len;
+    debug_decl(iolog_digest_open, SUDO_DEBUG_UTIL);
+
+    if ((dig = calloc(1, sizeof(*dig))) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "calloc(1, %zu)", sizeof(*dig));
+	debug_return_ptr(NULL);
+    }
+    dig->fd = -1;
+    dig->md_len = sudo_digest_getlen(IOLOG_DIGEST_TYPE);
+    if (dig->md_len <= 0 || dig->md_len > IOLOG_DIGEST_MAX_LEN) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unsupported digest length %d", dig->md_len);
+	goto bad;
+    }
+    if ((dig->iolog_path = strdup(iolog_path)) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "strdup");
+	goto bad;
+    }
+    if ((dig->chain_ctx = sudo_digest_alloc(IOLOG_DIGEST_TYPE)) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate digest");
+	goto bad;
+    }
+    if (digest_keyed) {
+	memcpy(dig->key, digest_key, sizeof(dig->key));
+	dig->keyed = true;
+    }
+
+    dig->fd = iolog_openat(dfd, IOLOG_DIGEST_FILE, O_CREAT|O_TRUNC|O_WRONLY);
+    if (dig->fd == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s/%s", iolog_path, IOLOG_DIGEST_FILE);
+	goto bad;
+    }
+    if (fchown(dig->fd, iolog_get_uid(), iolog_get_gid()) != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
+	    "%s: unable to fchown %d:%d %s/%s", __func__,
+	    (int)iolog_get_uid(), (int)iolog_get_gid(), iolog_path,
+	    IOLOG_DIGEST_FILE);
+    }
+    len = snprintf(header, sizeof(header), "%s %d%s\n", IOLOG_DIGEST_NAME,
+	IOLOG_DIGEST_CHUNK, dig->keyed ? " " IOLOG_DIGEST_KEYED : "");
+    if (write(dig->fd, header, len) != len) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to write to %s/%s", iolog_path, IOLOG_DIGEST_FILE);
+	goto bad;
+    }
+
+    debug_return_ptr(dig);
+bad:
+    iolog_digest_free(dig);
+    debug_return_ptr(NULL);
+}
+
+/*
+ * Start tracking the specified stream.  Streams that have been added
+ * are recorded when the log is sealed, even if they are empty.
+ */
+bool
+iolog_digest_add(struct iolog_digest *dig, int iofd)
+{
+    struct iolog_digest_stream *ds = &dig->streams[iofd];
+    debug_decl(iolog_digest_add, SUDO_DEBUG_UTIL);
+
+    if (ds->ctx == NULL) {
+	if ((ds->ctx = sudo_digest_alloc(IOLOG_DIGEST_TYPE)) == NULL) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to allocate digest");
+	    debug_return_bool(false);
+	}
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Add data written to the specified stream to its digest.
+ */
+bool
+iolog_digest_update(struct iolog_digest *dig, int iofd, const void *buf,
+    size_t len)
+{
+    struct iolog_digest_stream *ds = &dig->streams[iofd];
+    const unsigned char *cp = buf;
+    debug_decl(iolog_digest_update, SUDO_DEBUG_UTIL);
+
+    if (!iolog_digest_add(dig, iofd))
+	debug_return_bool(false);
+
+    while (len > 0) {
+	const size_t n = MIN(len, IOLOG_DIGEST_CHUNK - ds->fill);
+
+	sudo_digest_update(ds->ctx, cp, n);
+	ds->offset += n;
+	ds->fill += n;
+	cp += n;
+	len -= n;
+
+	if (ds->fill == IOLOG_DIGEST_CHUNK) {
+	    if (!digest_checkpoint(dig, iofd))
+		debug_return_bool(false);
+	}
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Hash the first len bytes of an existing, uncompressed I/O log file.
+ * Used when a log is restarted to rebuild the digest state without
+ * disturbing the file offset.
+ */
+bool
+iolog_digest_rehash(struct iolog_digest *dig, int iofd, int fd, off_t len)
+{
+    char buf[64 * 1024];
+    off_t off = 0;
+    ssize_t nread;
+    debug_decl(iolog_digest_rehash, SUDO_DEBUG_UTIL);
+
+    if (!iolog_digest_add(dig, iofd))
+	debug_return_bool(false);
+
+    while (off < len) {
+	nread = pread(fd, buf, MIN(len - off, ssizeof(buf)), off);
+	if (nread <= 0) {
+	    if (nread == -1 && errno == EINTR)
+		continue;
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to read %s/%s at %lld", dig->iolog_path,
+		iolog_fd_to_name(iofd), (long long)off);
+	    debug_return_bool(false);
+	}
+	if (!iolog_digest_update(dig, iofd, buf, nread))
+	    debug_return_bool(false);
+	off += nread;
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Write checkpoints to stable storage.
+ */
+bool
+iolog_digest_sync(struct iolog_digest *dig)
+{
+    debug_decl(iolog_digest_sync, SUDO_DEBUG_UTIL);
+
+    if (fdatasync(dig->fd) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to sync %s/%s", dig->iolog_path, IOLOG_DIGEST_FILE);
+	debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Format the final digest of each stream as a JSON object.
+ * A keyed log is sealed with an HMAC of the final state of every
+ * stream so the object cannot be rolled back to an earlier checkpoint.
+ */
+static bool
+digest_format_json(struct iolog_digest *dig, struct json_container *json)
+{
+    char chain_hex[IOLOG_DIGEST_MAX_LEN * 2 + 1];
+    char seal[IOFD_MAX * (64 + IOLOG_DIGEST_MAX_LEN * 2)];
+    unsigned char mac[IOLOG_DIGEST_MAX_LEN];
+    struct json_value json_value;
+    size_t seal_len = 0;
+    int iofd, len;
+    debug_decl(digest_format_json, SUDO_DEBUG_UTIL);
+
+    if (!sudo_json_open_object(json, "digest"))
+	debug_return_bool(false);
+
+    json_value.type = JSON_STRING;
+    json_value.u.string = IOLOG_DIGEST_NAME;
+    if (!sudo_json_add_value(json, "algorithm", &json_value))
+	debug_return_bool(false);
+
+    json_value.type = JSON_NUMBER;
+    json_value.u.number = IOLOG_DIGEST_CHUNK;
+    if (!sudo_json_add_value(json, "chunk_size", &json_value))
+	debug_return_bool(false);
+
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	struct iolog_digest_stream *ds = &dig->streams[iofd];
+
+	if (ds->ctx == NULL)
+	    continue;
+	if (!sudo_json_open_object(json, iolog_fd_to_name(iofd)))
+	    debug_return_bool(false);
+
+	json_value.type = JSON_NUMBER;
+	json_value.u.number = ds->offset;
+	if (!sudo_json_add_value(json, "length", &json_value))
+	    debug_return_bool(false);
+
+	json_value.type = JSON_NUMBER;
+	json_value.u.number = ds->chunks;
+	if (!sudo_json_add_value(json, "chunks", &json_value))
+	    debug_return_bool(false);
+
+	iolog_digest_to_hex(ds->chain, dig->md_len, chain_hex);
+	json_value.type = JSON_STRING;
+	json_value.u.string = chain_hex;
+	if (!sudo_json_add_value(json, "chain", &json_value))
+	    debug_return_bool(false);
+
+	if (!sudo_json_close_object(json))
+	    debug_return_bool(false);
+
+	len = snprintf(seal + seal_len, sizeof(seal) - seal_len,
+	    IOLOG_DIGEST_SEAL_FMT, iofd, ds->offset, ds->chunks, chain_hex);
+	if (len < 0 || (size_t)len >= sizeof(seal) - seal_len)
+	    debug_return_bool(false);
+	seal_len += len;
+    }
+
+    if (dig->keyed) {
+	json_value.type = JSON_BOOL;
+	json_value.u.boolean = true;
+	if (!sudo_json_add_value(json, "keyed", &json_value))
+	    debug_return_bool(false);
+
+	digest_hmac(dig->chain_ctx, dig->key, dig->md_len, seal, seal_len,
+	    NULL, 0, mac);
+	iolog_digest_to_hex(mac, dig->md_len, chain_hex);
+	json_value.type = JSON_STRING;
+	json_value.u.string = chain_hex;
+	if (!sudo_json_add_value(json, "seal", &json_value))
+	    debug_return_bool(false);
+    }
+
+    if (!sudo_json_close_object(json))
+	debug_return_bool(false);
+
+    debug_return_bool(true);
+}
+
+/*
+ * Checkpoint any partial chunks and store the final digest of each
+ * stream in log.json.  A copy of log.json with the "digest" object
+ * added at the end is written to a temporary file which then replaces
+ * the original, so a crash or full disk never leaves it half-written.
+ */
+bool
+iolog_digest_seal(struct iolog_digest *dig, int dfd)
+{
+    struct json_container json;
+    char *old = NULL, *end;
+    char tmp[sizeof(".log.json.") + 16];
+    bool ret = false;
+    FILE *fp = NULL;
+    struct stat sb;
+    ssize_t nread;
+    int iofd, fd;
+    debug_decl(iolog_digest_seal, SUDO_DEBUG_UTIL);
+
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	struct iolog_digest_stream *ds = &dig->streams[iofd];
+
+	if (ds->ctx != NULL && ds->fill != 0) {
+	    if (!digest_checkpoint(dig, iofd))
+		debug_return_bool(false);
+	}
+    }
+    if (!iolog_digest_sync(dig))
+	debug_return_bool(false);
+
+    if (!sudo_json_init(&json, 4, false, false))
+	debug_return_bool(false);
+    if (!digest_format_json(dig, &json)) {
+	sudo_warnx(U_("%s: %s"), __func__, U_("unable to allocate memory"));
+	goto done;
+    }
+
+    /* Read the existing log.json, which ends with a closing brace. */
+    fd = openat(dfd, "log.json", O_RDONLY|O_NOFOLLOW);
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s/log.json", dig->iolog_path);
+	if (fd != -1)
+	    close(fd);
+	goto done;
+    }
+    if (sb.st_size <= 0 || sb.st_size > 1024 * 1024 ||
+	    (old = malloc(sb.st_size + 1)) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to read %s/log.json, size %lld", dig->iolog_path,
+	    (long long)sb.st_size);
+	close(fd);
+	goto done;
+    }
+    nread = read(fd, old, sb.st_size);
+    close(fd);
+    if (nread != sb.st_size) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to read %s/log.json", dig->iolog_path);
+	goto done;
+    }
+    old[nread] = '\0';
+    end = strrchr(old, '}');
+    if (end == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "%s/log.json: missing closing brace", dig->iolog_path);
+	goto done;
+    }
+    while (end > old && (end[-1] == '\n' || end[-1] == ' '))
+	end--;
+    *end = '\0';
+
+    (void)snprintf(tmp, sizeof(tmp), ".log.json.%d", (int)getpid());
+    fd = iolog_openat(dfd, tmp, O_CREAT|O_TRUNC|O_WRONLY);
+    if (fd == -1 || (fp = fdopen(fd, "w")) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create %s/%s", dig->iolog_path, tmp);
+	if (fd != -1) {
+	    close(fd);
+	    (void)unlinkat(dfd, tmp, 0);
+	}
+	goto done;
+    }
+    if (fchown(fd, iolog_get_uid(), iolog_get_gid()) != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
+	    "%s: unable to fchown %d:%d %s", __func__,
+	    (int)iolog_get_uid(), (int)iolog_get_gid(), tmp);
+    }
+    fprintf(fp, "%s,%s\n}\n", old, sudo_json_get_buf(&json));
+    fflush(fp);
+    if (ferror(fp) || fsync(fd) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to write to I/O log file %s/%s", dig->iolog_path, tmp);
+	(void)unlinkat(dfd, tmp, 0);
+	goto done;
+    }
+    if (renameat(dfd, tmp, dfd, "log.json") == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to rename %s/%s to log.json", dig->iolog_path, tmp);
+	(void)unlinkat(dfd, tmp, 0);
+	goto done;
+    }
+    (void)fsync(dfd);
+
+    ret = true;
+done:
+    sudo_json_free(&json);
+    if (fp != NULL)
+	fclose(fp);
+    free(old);
+
+    debug_return_bool(ret);
+}
+
+void
+iolog_digest_free(struct iolog_digest *dig)
+{
+    int iofd;
+    debug_decl(iolog_digest_free, SUDO_DEBUG_UTIL);
+
+    if (dig != NULL) {
+	for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	    if (dig->streams[iofd].ctx != NULL)
+		sudo_digest_free(dig->streams[iofd].ctx);
+	}
+	if (dig->chain_ctx != NULL)
+	    sudo_digest_free(dig->chain_ctx);
+	if (dig->fd != -1)
+	    close(dig->fd);
+	explicit_bzero(dig->key, sizeof(dig->key));
+	free(dig->iolog_path);
+	free(dig);
+    }
+
+    debug_return;
+}
@@ -0,0 +1,85 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SUDO_IOLOG_DIGEST_H
+#define SUDO_IOLOG_DIGEST_H
+
+/*
+ * Tamper-evident I/O log digests.
+ *
+ * Each I/O log stream is split into IOLOG_DIGEST_CHUNK byte chunks of
+ * uncompressed data.  Every chunk is hashed on its own and the chunk
+ * digests are linked in a hash chain:
+ *
+ *   chain[0] = all zero bytes
+ *   chain[n] = H(chain[n - 1] || H(chunk[n]))
+ *
+ * A checkpoint is appended to the "digest" file in the I/O log
+ * directory as each chunk is completed, and for the trailing partial
+ * chunk when the log is sealed.  The first line of the file is the
+ * hash algorithm and chunk size, followed by one line per checkpoint:
+ *
+ *   iofd chunk offset length chunk-digest chain-digest
+ *
+ * Since the chunk digests are stored, chunks may be verified in
+ * parallel and the chain checked afterward.  When the command exits,
+ * the final chain value and length of each stream are stored in the
+ * "digest" object in log.json.
+ *
+ * An unkeyed chain only detects accidental damage; anyone who can
+ * write the log can recompute it.  If iolog_digest_key is set, the
+ * chain is keyed with a secret that only the server holds:
+ *
+ *   chain[n] = HMAC(key, chain[n - 1] || H(chunk[n]))
+ *
+ * The digest file header ends with "hmac" and the "digest" object in
+ * log.json is sealed with an HMAC of the final length, chunk count
+ * and chain of every stream.  sudo_logverify -k checks both.
+ */
+
+#define IOLOG_DIGEST_FILE	"digest"
+#define IOLOG_DIGEST_TYPE	SUDO_DIGEST_SHA256
+#define IOLOG_DIGEST_NAME	"sha256"
+#define IOLOG_DIGEST_KEYED	"hmac"
+#define IOLOG_DIGEST_CHUNK	(1024 * 1024)
+#define IOLOG_DIGEST_MAX_LEN	64
+#define IOLOG_DIGEST_BLOCK	64
+#define IOLOG_DIGEST_KEY_MIN	16
+#define IOLOG_DIGEST_KEY_MAX	1024
+
+/* Each stream's line in the seal: iofd length chunks chain-digest */
+#define IOLOG_DIGEST_SEAL_FMT	"%d %llu %llu %s\n"
+
+struct iolog_digest;
+struct sudo_digest;
+
+/* iolog_digest.c */
+bool iolog_digest_set_key(const char *path);
+bool iolog_digest_keyed(void);
+void iolog_digest_chain(struct sudo_digest *ctx, const unsigned char *prev, const unsigned char *md, unsigned char *chain);
+void iolog_digest_mac(struct sudo_digest *ctx, const char *str, unsigned char *mac);
+void iolog_digest_to_hex(const unsigned char *md, int md_len, char *hex);
+struct iolog_digest *iolog_digest_open(int dfd, const char *iolog_path);
+bool iolog_digest_add(struct iolog_digest *dig, int iofd);
+bool iolog_digest_update(struct iolog_digest *dig, int iofd, const void *buf, size_t len);
+bool iolog_digest_rehash(struct iolog_digest *dig, int iofd, int fd, off_t len);
+bool iolog_digest_sync(struct iolog_digest *dig);
+bool iolog_digest_seal(struct iolog_digest *dig, int dfd);
+void iolog_digest_free(struct iolog_digest *dig);
+
+#endif /* SUDO_IOLOG_DIGEST_H */
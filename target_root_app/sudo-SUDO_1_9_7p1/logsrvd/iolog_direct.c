@@ -0,0 +1,518 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * High-volume I/O log writer.
+ *
+ * Uncompressed I/O log files are written through a stdio stream whose
+ * data is collected in an aligned staging buffer and written with
+ * O_DIRECT (or F_NOCACHE) in large chunks, bypassing the page cache.
+ * Space is preallocated in extents as the file grows and any unused
+ * preallocation is released when the file is closed.
+ *
+ * When a partial buffer must be made visible, the whole blocks are
+ * written with direct I/O and the unaligned tail through a second
+ * descriptor opened without O_DIRECT, so the file never contains
+ * padding and its preallocation is kept.  The tail stays in the
+ * staging buffer and is rewritten with direct I/O once it fills.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_eventlog.h"
+#include "sudo_gettext.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrvd.h"
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+
+#define IOLOG_DIRECT_ALIGN	4096
+#define IOLOG_DIRECT_BUFSIZE	(128 * 1024)
+
+struct iolog_direct {
+    unsigned char *buf;		/* staging buffer, IOLOG_DIRECT_ALIGN aligned */
+    size_t len;			/* bytes in buf */
+    off_t base;			/* file offset of buf[0] */
+    off_t prealloc_end;		/* end of preallocated space */
+    off_t extent;		/* preallocation size, 0 to disable */
+    int fd;
+    int tail_fd;		/* buffered fd for the unaligned tail, or -1 */
+    bool odirect;		/* fd opened with O_DIRECT */
+};
+
+static off_t
+round_up(off_t val, off_t multiple)
+{
+    return ((val + multiple - 1) / multiple) * multiple;
+}
+
+/*
+ * Preallocate space up to at least end without changing the file size.
+ */
+static void
+direct_prealloc(struct iolog_direct *d, off_t end)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+    off_t len;
+    debug_decl(direct_prealloc, SUDO_DEBUG_UTIL);
+
+    if (d->extent == 0 || end <= d->prealloc_end)
+	debug_return;
+
+    if (d->prealloc_end < d->base)
+	d->prealloc_end = d->base;
+    len = round_up(end - d->prealloc_end, d->extent);
+    if (fallocate(d->fd, FALLOC_FL_KEEP_SIZE, d->prealloc_end, len) == -1) {
+	/* Not fatal, the file is just not preallocated. */
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to preallocate %lld bytes at %lld", (long long)len,
+	    (long long)d->prealloc_end);
+	d->extent = 0;
+	debug_return;
+    }
+    d->prealloc_end += len;
+
+    debug_return;
+#endif
+}
+
+/*
+ * Release preallocated space past the logical end of the file.
+ */
+static bool
+direct_trim(struct iolog_direct *d)
+{
+    const off_t end = d->base + (off_t)d->len;
+    debug_decl(direct_trim, SUDO_DEBUG_UTIL);
+
+    if (d->prealloc_end <= end)
+	debug_return_bool(true);
+
+    /*
+     * Truncating to the current size frees blocks preallocated past
+     * the end of file.  Punching a hole there is not used, some file
+     * systems (ext4) silently ignore holes past the end of file.
+     */
+    if (ftruncate(d->fd, end) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to truncate I/O log to %lld", (long long)end);
+	debug_return_bool(false);
+    }
+    d->prealloc_end = end;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Write the staging buffer from off to end via fd, at the corresponding
+ * offset in the file.  If the file system rejects direct I/O, fall back
+ * to buffered writes.
+ */
+static bool
+direct_pwrite(struct iolog_direct *d, int fd, size_t off, size_t end)
+{
+    ssize_t nwritten;
+    debug_decl(direct_pwrite, SUDO_DEBUG_UTIL);
+
+    while (off < end) {
+	nwritten = pwrite(fd, d->buf + off, end - off, d->base + off);
+	if (nwritten == -1) {
+	    if (errno == EINTR)
+		continue;
+#ifdef O_DIRECT
+	    if (errno == EINVAL && d->odirect && fd == d->fd) {
+		int flags = fcntl(d->fd, F_GETFL, 0);
+
+		if (flags != -1 &&
+			fcntl(d->fd, F_SETFL, flags & ~O_DIRECT) != -1) {
+		    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+			"direct I/O not supported, using buffered writes");
+		    d->odirect = false;
+		    continue;
+		}
+	    }
+#endif
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to write %zu bytes at %lld", end - off,
+		(long long)(d->base + off));
+	    debug_return_bool(false);
+	}
+	off += (size_t)nwritten;
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Write a full staging buffer.
+ */
+static bool
+direct_write_full(struct iolog_direct *d)
+{
+    debug_decl(direct_write_full, SUDO_DEBUG_UTIL);
+
+    direct_prealloc(d, d->base + (off_t)d->len);
+    if (!direct_pwrite(d, d->fd, 0, d->len))
+	debug_return_bool(false);
+    d->base += (off_t)d->len;
+    d->len = 0;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Write a partially-filled staging buffer so the data is visible
+ * to readers.  With direct I/O only whole blocks can be written,
+ * the unaligned tail is written through the buffered descriptor
+ * and kept in the staging buffer to be rewritten once it fills.
+ */
+static bool
+direct_write_partial(struct iolog_direct *d)
+{
+    size_t whole;
+    debug_decl(direct_write_partial, SUDO_DEBUG_UTIL);
+
+    if (d->len == 0)
+	debug_return_bool(true);
+
+    direct_prealloc(d, d->base + (off_t)d->len);
+    if (!d->odirect) {
+	if (!direct_pwrite(d, d->fd, 0, d->len))
+	    debug_return_bool(false);
+	d->base += (off_t)d->len;
+	d->len = 0;
+	debug_return_bool(true);
+    }
+
+    whole = d->len & ~((size_t)IOLOG_DIRECT_ALIGN - 1);
+    if (!direct_pwrite(d, d->fd, 0, whole))
+	debug_return_bool(false);
+    if (!d->odirect) {
+	/* Direct I/O was just disabled, write the rest the same way. */
+	if (!direct_pwrite(d, d->fd, whole, d->len))
+	    debug_return_bool(false);
+	d->base += (off_t)d->len;
+	d->len = 0;
+	debug_return_bool(true);
+    }
+    if (!direct_pwrite(d, d->tail_fd, whole, d->len))
+	debug_return_bool(false);
+
+    /* Keep the partial block in the buffer, it will be rewritten. */
+    memmove(d->buf, d->buf + whole, d->len - whole);
+    d->base += (off_t)whole;
+    d->len -= whole;
+
+    debug_return_bool(true);
+}
+
+static ssize_t
+direct_write(void *v, const char *buf, size_t len)
+{
+    struct iolog_direct *d = v;
+    size_t n, remainder = len;
+    debug_decl(direct_write, SUDO_DEBUG_UTIL);
+
+    while (remainder > 0) {
+	n = MIN(remainder, IOLOG_DIRECT_BUFSIZE - d->len);
+	memcpy(d->buf + d->len, buf, n);
+	d->len += n;
+	buf += n;
+	remainder -= n;
+	if (d->len == IOLOG_DIRECT_BUFSIZE) {
+	    if (!direct_write_full(d))
+		debug_return_ssize_t(-1);
+	}
+    }
+
+    debug_return_ssize_t((ssize_t)len);
+}
+
+/*
+ * Only supports querying the current position.
+ */
+static bool
+direct_seek(struct iolog_direct *d, off_t *offset, int whence)
+{
+    const off_t pos = d->base + (off_t)d->len;
+    off_t target;
+
+    switch (whence) {
+    case SEEK_SET:
+	target = *offset;
+	break;
+    case SEEK_CUR:
+    case SEEK_END:
+	target = pos + *offset;
+	break;
+    default:
+	target = -1;
+	break;
+    }
+    if (target != pos) {
+	errno = EINVAL;
+	return false;
+    }
+    *offset = pos;
+    return true;
+}
+
+static int
+direct_close(void *v)
+{
+    struct iolog_direct *d = v;
+    int ret = 0, save_errno;
+    debug_decl(direct_close, SUDO_DEBUG_UTIL);
+
+    if (!direct_write_partial(d) || !direct_trim(d))
+	ret = -1;
+    save_errno = errno;
+    if (close(d->fd) == -1 && ret == 0) {
+	save_errno = errno;
+	ret = -1;
+    }
+    if (d->tail_fd != -1)
+	close(d->tail_fd);
+    free(d->buf);
+    free(d);
+    errno = save_errno;
+
+    debug_return_int(ret);
+}
+
+#ifdef HAVE_FOPENCOOKIE
+static int
+direct_seek_cookie(void *v, off64_t *offset, int whence)
+{
+    off_t pos = (off_t)*offset;
+
+    if (!direct_seek(v, &pos, whence))
+	return -1;
+    *offset = pos;
+    return 0;
+}
+
+static cookie_io_functions_t direct_funcs = {
+    NULL, direct_write, direct_seek_cookie, direct_close
+};
+#else
+static int
+direct_write_funopen(void *v, const char *buf, int len)
+{
+    return (int)direct_write(v, buf, (size_t)len);
+}
+
+static fpos_t
+direct_seek_funopen(void *v, fpos_t offset, int whence)
+{
+    off_t pos = (off_t)offset;
+
+    if (!direct_seek(v, &pos, whence))
+	return -1;
+    return (fpos_t)pos;
+}
+#endif /* HAVE_FOPENCOOKIE */
+
+/*
+ * Create an uncompressed I/O log file written via the high-volume writer.
+ */
+bool
+iolog_direct_create(int iofd, struct connection_closure *closure)
+{
+    struct iolog_file *iol = &closure->iolog_files[iofd];
+    struct iolog_direct *d = NULL;
+    const char *file;
+    void *buf = NULL;
+    int fd = -1, flags = O_CREAT|O_TRUNC|O_WRONLY;
+    FILE *fp;
+    debug_decl(iolog_direct_create, SUDO_DEBUG_UTIL);
+
+    if ((file = iolog_fd_to_name(iofd)) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "invalid iofd %d", iofd);
+	debug_return_bool(false);
+    }
+    if ((d = calloc(1, sizeof(*d))) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	goto bad;
+    }
+    d->tail_fd = -1;
+    if (posix_memalign(&buf, IOLOG_DIRECT_ALIGN, IOLOG_DIRECT_BUFSIZE) != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	goto bad;
+    }
+    d->buf = buf;
+    d->extent = logsrvd_conf_iolog_extent_size();
+
+#ifdef O_DIRECT
+    fd = iolog_openat(closure->iolog_dir_fd, file, flags|O_DIRECT);
+    if (fd != -1) {
+	/* Unaligned data is written through a buffered descriptor. */
+	d->tail_fd = iolog_openat(closure->iolog_dir_fd, file, O_WRONLY);
+	if (d->tail_fd == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to open %s/%s", closure->evlog->iolog_path, file);
+	    goto bad;
+	}
+	(void)fcntl(d->tail_fd, F_SETFD, FD_CLOEXEC);
+	d->odirect = true;
+    } else if (errno == EINVAL) {
+	/* File system does not support O_DIRECT. */
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+	    "O_DIRECT not supported for %s/%s", closure->evlog->iolog_path,
+	    file);
+	fd = iolog_openat(closure->iolog_dir_fd, file, flags);
+    }
+#else
+    fd = iolog_openat(closure->iolog_dir_fd, file, flags);
+#endif
+    if (fd == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s/%s", closure->evlog->iolog_path, file);
+	goto bad;
+    }
+    d->fd = fd;
+    if (fchown(fd, iolog_get_uid(), iolog_get_gid()) != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_ERRNO,
+	    "%s: unable to fchown %d:%d %s", __func__,
+	    (int)iolog_get_uid(), (int)iolog_get_gid(), file);
+    }
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef F_NOCACHE
+    /* macOS equivalent of O_DIRECT, no alignment restrictions. */
+    (void)fcntl(fd, F_NOCACHE, 1);
+#endif
+
+#ifdef HAVE_FOPENCOOKIE
+    fp = fopencookie(d, "w", direct_funcs);
+#else
+    fp = funopen(d, NULL, direct_write_funopen, direct_seek_funopen,
+	direct_close);
+#endif
+    if (fp == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create stream for %s/%s", closure->evlog->iolog_path,
+	    file);
+	goto bad;
+    }
+    /* The staging buffer replaces the stdio buffer. */
+    (void)setvbuf(fp, NULL, _IONBF, 0);
+
+    iol->fd.f = fp;
+    iol->enabled = true;
+    iol->writable = true;
+    iol->compressed = false;
+    closure->iolog_direct[iofd] = d;
+
+    debug_return_bool(true);
+bad:
+    if (fd != -1)
+	close(fd);
+    if (d != NULL) {
+	if (d->tail_fd != -1)
+	    close(d->tail_fd);
+	free(d->buf);
+	free(d);
+    }
+    iol->enabled = false;
+    debug_return_bool(false);
+}
+
+/*
+ * Write any staged data for a high-volume I/O log file to the kernel,
+ * and to stable storage if sync is set.
+ */
+bool
+iolog_direct_flush(struct iolog_direct *d, bool sync)
+{
+    debug_decl(iolog_direct_flush, SUDO_DEBUG_UTIL);
+
+    if (!direct_write_partial(d))
+	debug_return_bool(false);
+    if (sync && fdatasync(d->fd) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to sync I/O log");
+	debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Write staged data for all of a connection's high-volume I/O log files.
+ * Called before a commit point is sent so that acknowledged data is
+ * never held only in a staging buffer.
+ */
+bool
+iolog_direct_flush_all(struct connection_closure *closure)
+{
+    int iofd;
+    debug_decl(iolog_direct_flush_all, SUDO_DEBUG_UTIL);
+
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	if (closure->iolog_direct[iofd] == NULL)
+	    continue;
+	if (!iolog_direct_flush(closure->iolog_direct[iofd], false))
+	    debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
+#else /* !HAVE_FOPENCOOKIE && !HAVE_FUNOPEN */
+
+bool
+iolog_direct_flush(struct iolog_direct *d, bool sync)
+{
+    return true;
+}
+
+bool
+iolog_direct_flush_all(struct connection_closure *closure)
+{
+    return true;
+}
+
+#endif /* HAVE_FOPENCOOKIE || HAVE_FUNOPEN */
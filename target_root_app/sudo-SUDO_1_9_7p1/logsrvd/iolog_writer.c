@@ -48,6 +48,9 @@
 
 #include "log_server.pb-c.h"
 #include "logsrvd.h"
+#include "iolog_digest.h"
+#include "iolog_fault.h"
+#include "iolog_privsep.h"
 
 static inline bool
 has_numval(InfoMessage *info)
@@ -111,7 +114,7 @@ bad:
  */
 struct eventlog *
 evlog_new(TimeSpec *submit_time, InfoMessage **info_msgs, size_t infolen,
-    struct connection_closure *closure)
+    const char *peeraddr)
 {
     struct eventlog *evlog;
     size_t idx;
@@ -125,7 +128,7 @@ evlog_new(TimeSpec *submit_time, InfoMessage **info_msgs, size_t infolen,
     }
 
     /* Client/peer IP address. */
-    evlog->peeraddr = closure->ipaddr;
+    evlog->peeraddr = (char *)peeraddr;
 
     /* Submit time. */
     if (submit_time != NULL) {
@@ -645,11 +648,65 @@ iolog_create(int iofd, struct connection_closure *closure)
 	debug_return_bool(false);
     }
 
+    if (closure->iolog_digest != NULL) {
+	if (!iolog_digest_add(closure->iolog_digest, iofd))
+	    debug_return_bool(false);
+    }
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+    /* Compressed logs are always written via zlib. */
+    if (iolog_get_compress()) {
+	/* Small streams compress much better with a trained dictionary. */
+	if (iolog_dict_available())
+	    debug_return_bool(iolog_dict_create(iofd, closure));
+    } else {
+	/* The timing file is small and unique to the session. */
+	if (logsrvd_conf_iolog_chunk_store() != NULL && iofd != IOFD_TIMING)
+	    debug_return_bool(iolog_dedup_create(iofd, closure));
+	if (logsrvd_conf_iolog_direct())
+	    debug_return_bool(iolog_direct_create(iofd, closure));
+    }
+#endif
+
     closure->iolog_files[iofd].enabled = true;
     debug_return_bool(iolog_open(&closure->iolog_files[iofd],
 	closure->iolog_dir_fd, iofd, "w"));
 }
 
+/*
+ * Write to an I/O log file, adding the data to the digest if enabled.
+ * A short write (only possible with fault injection) is retried.
+ * The digest is per connection and only sudo_logsrvd keeps one, so it
+ * is updated here rather than in iolog_write(), which only sees the
+ * struct iolog_file and is shared with the sudoers I/O log plugin.
+ */
+bool
+iolog_write_data(int iofd, const void *buf, size_t len,
+    struct connection_closure *closure, const char **errstr)
+{
+    const char *cp = buf;
+    size_t remainder = len;
+    debug_decl(iolog_write_data, SUDO_DEBUG_UTIL);
+
+    while (remainder > 0) {
+	ssize_t nwritten = iolog_write(&closure->iolog_files[iofd], cp,
+	    remainder, errstr);
+	if (nwritten == -1)
+	    debug_return_bool(false);
+	cp += nwritten;
+	remainder -= (size_t)nwritten;
+    }
+    if (closure->iolog_digest != NULL) {
+	if (!iolog_digest_update(closure->iolog_digest, iofd, buf, len)) {
+	    if (errstr != NULL)
+		*errstr = _("unable to update I/O log digest");
+	    debug_return_bool(false);
+	}
+    }
+
+    debug_return_bool(true);
+}
+
 void
 iolog_close_all(struct connection_closure *closure)
 {
@@ -664,13 +721,114 @@ iolog_close_all(struct connection_closure *closure)
 	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 		"error closing iofd %d: %s", i, errstr);
 	}
+	/* Freed by iolog_close() via fclose(). */
+	closure->iolog_direct[i] = NULL;
+	closure->iolog_dedup[i] = NULL;
+	closure->iolog_dict[i] = NULL;
     }
+    iolog_digest_free(closure->iolog_digest);
+    closure->iolog_digest = NULL;
     if (closure->iolog_dir_fd != -1)
 	close(closure->iolog_dir_fd);
 
     debug_return;
 }
 
+/*
+ * Flush buffered I/O log data and write it to stable storage.
+ * Compressed files are synced via a separate descriptor since
+ * zlib does not expose the one it is using.
+ * The I/O log directory and its parent are synced the first time
+ * through so the new session directory is durable before the first
+ * commit point is sent.
+ */
+bool
+iolog_sync_all(struct connection_closure *closure)
+{
+    const char *name;
+    int fd, iofd;
+    debug_decl(iolog_sync_all, SUDO_DEBUG_UTIL);
+
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	struct iolog_file *iol = &closure->iolog_files[iofd];
+
+	if (!iol->enabled)
+	    continue;
+	name = iolog_fd_to_name(iofd);
+	if (iolog_fault_enabled) {
+	    if (iolog_fault_inject(IOLOG_FAULT_FLUSH, NULL) == -1) {
+		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		    "unable to sync %s/%s", closure->evlog->iolog_path, name);
+		debug_return_bool(false);
+	    }
+	}
+#ifdef HAVE_ZLIB_H
+	if (iol->compressed) {
+	    if (gzflush(iol->fd.g, Z_SYNC_FLUSH) != Z_OK) {
+		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		    "unable to flush %s/%s", closure->evlog->iolog_path, name);
+		debug_return_bool(false);
+	    }
+	    fd = openat(closure->iolog_dir_fd, name, O_RDONLY|O_NOFOLLOW);
+	    if (fd == -1 || fdatasync(fd) == -1) {
+		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		    "unable to sync %s/%s", closure->evlog->iolog_path, name);
+		if (fd != -1)
+		    close(fd);
+		debug_return_bool(false);
+	    }
+	    close(fd);
+	} else
+#endif
+	if (closure->iolog_direct[iofd] != NULL) {
+	    if (fflush(iol->fd.f) != 0 ||
+		    !iolog_direct_flush(closure->iolog_direct[iofd], true)) {
+		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		    "unable to sync %s/%s", closure->evlog->iolog_path, name);
+		debug_return_bool(false);
+	    }
+	} else if (closure->iolog_dedup[iofd] != NULL) {
+	    if (fflush(iol->fd.f) != 0 ||
+		    !iolog_dedup_flush(closure->iolog_dedup[iofd], true)) {
+		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		    "unable to sync %s/%s", closure->evlog->iolog_path, name);
+		debug_return_bool(false);
+	    }
+	} else if (closure->iolog_dict[iofd] != NULL) {
+	    if (fflush(iol->fd.f) != 0 ||
+		    !iolog_dict_flush(closure->iolog_dict[iofd], true)) {
+		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		    "unable to sync %s/%s", closure->evlog->iolog_path, name);
+		debug_return_bool(false);
+	    }
+	} else {
+	    if (fflush(iol->fd.f) != 0 || fdatasync(fileno(iol->fd.f)) == -1) {
+		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		    "unable to sync %s/%s", closure->evlog->iolog_path, name);
+		debug_return_bool(false);
+	    }
+	}
+    }
+
+    if (closure->iolog_digest != NULL) {
+	if (!iolog_digest_sync(closure->iolog_digest))
+	    debug_return_bool(false);
+    }
+
+    if (!closure->iolog_dir_synced && closure->iolog_dir_fd != -1) {
+	if (fsync(closure->iolog_dir_fd) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to sync %s", closure->evlog->iolog_path);
+	    debug_return_bool(false);
+	}
+	if (!sync_parent_dir(closure->evlog->iolog_path))
+	    debug_return_bool(false);
+	closure->iolog_dir_synced = true;
+    }
+
+    debug_return_bool(true);
+}
+
 bool
 iolog_init(AcceptMessage *msg, struct connection_closure *closure)
 {
@@ -685,6 +843,14 @@ iolog_init(AcceptMessage *msg, struct connection_closure *closure)
     if (!iolog_write_info_file(closure->iolog_dir_fd, evlog))
 	debug_return_bool(false);
 
+    /* Digests are computed as the I/O log files are written. */
+    if (logsrvd_conf_iolog_digest()) {
+	closure->iolog_digest =
+	    iolog_digest_open(closure->iolog_dir_fd, evlog->iolog_path);
+	if (closure->iolog_digest == NULL)
+	    debug_return_bool(false);
+    }
+
     /*
      * Create timing, stdout, stderr and ttyout files for sudoreplay.
      * Others will be created on demand.
@@ -704,10 +870,10 @@ iolog_init(AcceptMessage *msg, struct connection_closure *closure)
  */
 static bool
 iolog_copy(struct iolog_file *src, struct iolog_file *dst, off_t remainder,
-    const char **errstr)
+    struct iolog_digest *dig, int iofd, const char **errstr)
 {
     char buf[64 * 1024];
-    ssize_t nread;
+    ssize_t nread, off;
     debug_decl(iolog_copy, SUDO_DEBUG_UTIL);
 
     sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
@@ -718,20 +884,24 @@ iolog_copy(struct iolog_file *src, struct iolog_file *dst, off_t remainder,
 	if (nread == -1)
 	    debug_return_bool(false);
 	remainder -= nread;
+	if (dig != NULL && !iolog_digest_update(dig, iofd, buf, nread)) {
+	    *errstr = _("unable to update I/O log digest");
+	    debug_return_bool(false);
+	}
 
-	do {
-	    ssize_t nwritten = iolog_write(dst, buf, nread, errstr);
+	for (off = 0; off < nread; ) {
+	    ssize_t nwritten = iolog_write(dst, buf + off, nread - off, errstr);
 	    if (nwritten == -1)
 		debug_return_bool(false);
-	    nread -= nwritten;
-	} while (nread > 0);
+	    off += nwritten;
+	}
     }
 
     debug_return_bool(true);
 }
 
 /*
- * Like rename(2) but changes UID as needed.
+ * Like rename(2) but runs as the I/O log owner as needed.
  */
 static bool
 iolog_rename(const char *from, const char *to)
@@ -741,9 +911,13 @@ iolog_rename(const char *from, const char *to)
 
     ok = rename(from, to) == 0;
     if (!ok && errno == EACCES) {
-	uid_changed = iolog_swapids(false);
-	if (uid_changed)
-	    ok = rename(from, to) == 0;
+	if (iolog_privsep_running(iolog_get_uid(), iolog_get_gid())) {
+	    ok = iolog_privsep_rename(from, to);
+	} else {
+	    uid_changed = iolog_swapids(false);
+	    if (uid_changed)
+		ok = rename(from, to) == 0;
+	}
     }
 
     if (uid_changed) {
@@ -841,7 +1015,7 @@ iolog_rewrite(const struct timespec *target, struct connection_closure *closure)
 	if (!closure->iolog_files[iofd].enabled)
 	    continue;
 	if (!iolog_copy(&closure->iolog_files[iofd], &new_iolog_files[iofd],
-		iolog_file_sizes[iofd], &errstr)) {
+		iolog_file_sizes[iofd], closure->iolog_digest, iofd, &errstr)) {
 	    name = iolog_fd_to_name(iofd);
 	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 		"unable to copy %s/%s to %s/%s: %s",
@@ -906,6 +1080,37 @@ done:
     debug_return_bool(ret);
 }
 
+/*
+ * Rebuild the digest of a restarted log by hashing the data that
+ * precedes the resume point.  Compressed logs are instead hashed
+ * by iolog_rewrite() as they are copied.
+ */
+bool
+iolog_digest_restart(struct connection_closure *closure)
+{
+    int iofd;
+    debug_decl(iolog_digest_restart, SUDO_DEBUG_UTIL);
+
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	struct iolog_file *iol = &closure->iolog_files[iofd];
+	off_t pos;
+
+	if (!iol->enabled)
+	    continue;
+	if ((pos = iolog_seek(iol, 0, SEEK_CUR)) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"%s/%s: unable to get file position", closure->evlog->iolog_path,
+		iolog_fd_to_name(iofd));
+	    debug_return_bool(false);
+	}
+	if (!iolog_digest_rehash(closure->iolog_digest, iofd,
+		fileno(iol->fd.f), pos))
+	    debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
 /*
  * Add given delta to elapsed time.
  * We cannot use timespecadd here since delta is not struct timespec.
@@ -19,8 +19,15 @@
 #include "config.h"
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #ifdef HAVE_STDBOOL_H
 # include <stdbool.h>
 #else
@@ -81,6 +88,63 @@ expand_buf(struct connection_buffer *buf, unsigned int needed)
     debug_return_bool(true);
 }
 
+/*
+ * Call msg_cb for each complete length-prefixed message in buf.
+ * The length word (uint32_t in network byte order) directly precedes
+ * the message.  Any partial message is moved to the start of buf,
+ * which is expanded to fit it, to be completed by the next read.
+ * A buffer with a size of zero borrows its data (e.g. a mapped
+ * journal), which is never modified; any partial message is left
+ * in place at buf->off.
+ * Returns false if a message is too large, memory is exhausted (with
+ * errstr set) or msg_cb fails (errstr is left unchanged).
+ */
+bool
+dispatch_frames(struct connection_buffer *buf,
+    bool (*msg_cb)(uint8_t *msg, uint32_t msg_len, void *v), void *v,
+    const char **errstr)
+{
+    uint32_t msg_len;
+    debug_decl(dispatch_frames, SUDO_DEBUG_UTIL);
+
+    while (buf->len - buf->off >= sizeof(msg_len)) {
+	memcpy(&msg_len, buf->data + buf->off, sizeof(msg_len));
+	msg_len = ntohl(msg_len);
+
+	if (msg_len > MESSAGE_SIZE_MAX) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"message too large: %u", msg_len);
+	    *errstr = N_("client message too large");
+	    debug_return_bool(false);
+	}
+
+	if (msg_len + sizeof(msg_len) > buf->len - buf->off) {
+	    /* Incomplete message, we'll read the rest next time. */
+	    if (buf->size == 0)
+		debug_return_bool(true);
+	    if (!expand_buf(buf, msg_len + sizeof(msg_len))) {
+		*errstr = N_("unable to allocate memory");
+		debug_return_bool(false);
+	    }
+	    debug_return_bool(true);
+	}
+
+	/* The message could be zero bytes. */
+	buf->off += sizeof(msg_len);
+	if (!msg_cb(buf->data + buf->off, msg_len, v))
+	    debug_return_bool(false);
+	buf->off += msg_len;
+    }
+
+    /* Keep any partial length word. */
+    if (buf->size != 0 && !expand_buf(buf, 0)) {
+	*errstr = N_("unable to allocate memory");
+	debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
 /*
  * Open any I/O log files that are present.
  * The timing file must always exist.
@@ -112,6 +176,8 @@ iolog_open_all(int dfd, const char *iolog_dir, struct iolog_file *iolog_files,
 
 /*
  * Seek to the specified point in time in the I/O logs.
+ * The timing file is parsed first and each I/O log file is then
+ * seeked once, rather than once per record.
  */
 bool
 iolog_seekto(int iolog_dir_fd, const char *iolog_path,
@@ -119,7 +185,8 @@ iolog_seekto(int iolog_dir_fd, const char *iolog_path,
     const struct timespec *target)
 {
     struct timing_closure timing;
-    off_t pos;
+    off_t skip[IOFD_MAX] = { 0 };
+    int iofd;
     debug_decl(iolog_seekto, SUDO_DEBUG_UTIL);
 
     /* Parse timing file until we reach the target point. */
@@ -134,13 +201,7 @@ iolog_seekto(int iolog_dir_fd, const char *iolog_path,
 		    iolog_fd_to_name(timing.event));
 		goto bad;
 	    }
-	    pos = iolog_seek(&iolog_files[timing.event], timing.u.nbytes,
-		SEEK_CUR);
-	    if (pos == -1) {
-		sudo_warn(U_("%s/%s: unable to seek forward %zu"), iolog_path,
-		    iolog_fd_to_name(timing.event), timing.u.nbytes);
-		goto bad;
-	    }
+	    skip[timing.event] += timing.u.nbytes;
 	}
 	if (sudo_timespeccmp(elapsed_time, target, >=)) {
 	    if (sudo_timespeccmp(elapsed_time, target, ==))
@@ -153,7 +214,190 @@ iolog_seekto(int iolog_dir_fd, const char *iolog_path,
 	    goto bad;
 	}
     }
+
+    for (iofd = 0; iofd < IOFD_TIMING; iofd++) {
+	if (skip[iofd] == 0)
+	    continue;
+	if (iolog_seek(&iolog_files[iofd], skip[iofd], SEEK_CUR) == -1) {
+	    sudo_warn(U_("%s/%s: unable to seek forward %lld"), iolog_path,
+		iolog_fd_to_name(iofd), (long long)skip[iofd]);
+	    goto bad;
+	}
+    }
     debug_return_bool(true);
 bad:
     debug_return_bool(false);
 }
+
+/*
+ * Sync the directory containing path so that a newly created
+ * file or directory entry survives a crash.
+ */
+bool
+sync_parent_dir(const char *path)
+{
+    char dir[PATH_MAX];
+    const char *slash;
+    int fd, len;
+    debug_decl(sync_parent_dir, SUDO_DEBUG_UTIL);
+
+    if ((slash = strrchr(path, '/')) == NULL) {
+	dir[0] = '.';
+	dir[1] = '\0';
+    } else {
+	len = slash == path ? 1 : (int)(slash - path);
+	if (len >= ssizeof(dir)) {
+	    errno = ENAMETOOLONG;
+	    debug_return_bool(false);
+	}
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+    }
+
+    if ((fd = open(dir, O_RDONLY|O_NONBLOCK)) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s", dir);
+	debug_return_bool(false);
+    }
+    if (fsync(fd) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to sync %s", dir);
+	close(fd);
+	debug_return_bool(false);
+    }
+    close(fd);
+
+    debug_return_bool(true);
+}
+
+/* Release consumed pages of a mapped file once this much has been read. */
+#define MAPPED_FILE_RELEASE_SIZE	(1024 * 1024)
+
+/*
+ * Map the file open on fd for sequential reading, starting at off.
+ * Returns false if the file is empty or cannot be mapped, in which
+ * case the caller should fall back to read(2).
+ */
+bool
+mapped_file_open(struct mapped_file *mf, int fd, off_t off)
+{
+    struct stat sb;
+    void *base;
+    debug_decl(mapped_file_open, SUDO_DEBUG_UTIL);
+
+    memset(mf, 0, sizeof(*mf));
+    if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to map fd %d", fd);
+	debug_return_bool(false);
+    }
+    if (sb.st_size == 0 || off > sb.st_size ||
+	    (unsigned long long)sb.st_size > SIZE_MAX) {
+	debug_return_bool(false);
+    }
+    base = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to map %lld bytes of fd %d", (long long)sb.st_size, fd);
+	debug_return_bool(false);
+    }
+#ifdef MADV_SEQUENTIAL
+    (void)madvise(base, (size_t)sb.st_size, MADV_SEQUENTIAL);
+#endif
+    mf->base = base;
+    mf->size = (size_t)sb.st_size;
+    mf->off = (size_t)off;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Return a pointer to the next len bytes of a mapped file, or NULL
+ * if fewer than len bytes remain.  Pages that have been consumed are
+ * released periodically so the mapping does not pin the whole file.
+ */
+const uint8_t *
+mapped_file_next(struct mapped_file *mf, size_t len)
+{
+    const uint8_t *ret;
+    debug_decl(mapped_file_next, SUDO_DEBUG_UTIL);
+
+    if (len > mf->size - mf->off)
+	debug_return_const_ptr(NULL);
+    ret = mf->base + mf->off;
+    mf->off += len;
+
+#ifdef MADV_DONTNEED
+    if (mf->off - mf->released >= MAPPED_FILE_RELEASE_SIZE) {
+	const size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t end = mf->off - (mf->off % pagesize);
+
+	if (end > mf->released) {
+	    (void)madvise(mf->base + mf->released, end - mf->released,
+		MADV_DONTNEED);
+	    mf->released = end;
+	}
+    }
+#endif
+
+    debug_return_const_ptr(ret);
+}
+
+void
+mapped_file_close(struct mapped_file *mf)
+{
+    debug_decl(mapped_file_close, SUDO_DEBUG_UTIL);
+
+    if (mf->base != NULL) {
+	munmap(mf->base, mf->size);
+	memset(mf, 0, sizeof(*mf));
+    }
+
+    debug_return;
+}
+
+/*
+ * Parse an interval in seconds, optionally with an s, m, h or d suffix,
+ * e.g. "30m", "12h" or "7d".  Returns false if str is not valid.
+ */
+bool
+parse_interval(const char *str, time_t *result)
+{
+    const char *errstr;
+    char *copy;
+    long long mult = 1;
+    long long val;
+    size_t len = strlen(str);
+    debug_decl(parse_interval, SUDO_DEBUG_UTIL);
+
+    if (len == 0)
+	debug_return_bool(false);
+    if (isdigit((unsigned char)str[len - 1])) {
+	*result = sudo_strtonum(str, 0, LLONG_MAX, &errstr);
+	debug_return_bool(errstr == NULL);
+    }
+    switch (str[len - 1]) {
+    case 'd':
+	mult *= 24;
+	FALLTHROUGH;
+    case 'h':
+	mult *= 60;
+	FALLTHROUGH;
+    case 'm':
+	mult *= 60;
+	FALLTHROUGH;
+    case 's':
+	break;
+    default:
+	debug_return_bool(false);
+    }
+    if ((copy = strdup(str)) == NULL)
+	sudo_fatalx(U_("%s: %s"), __func__, U_("unable to allocate memory"));
+    copy[len - 1] = '\0';
+    val = sudo_strtonum(copy, 0, LLONG_MAX / mult, &errstr);
+    free(copy);
+    if (errstr != NULL)
+	debug_return_bool(false);
+    *result = (time_t)(val * mult);
+    debug_return_bool(true);
+}
@@ -43,14 +43,50 @@ struct connection_buffer {
     unsigned int size;
     unsigned int len;
     unsigned int off;
+    unsigned long long trace_seq;	/* logsrvd trace sample, 0 if none */
 };
 TAILQ_HEAD(connection_buffer_list, connection_buffer);
 
+/*
+ * Read-only mapping of an uncompressed I/O log file or journal,
+ * consumed sequentially.
+ */
+struct mapped_file {
+    uint8_t *base;
+    size_t size;
+    size_t off;			/* current read offset */
+    size_t released;		/* pages below this offset were released */
+};
+
+/*
+ * An IoBuffer ClientMessage decoded in place by iobuf_decode().
+ * The data points into the packed message.
+ */
+struct iobuf_view {
+    int iofd;			/* IOFD_TTYIN, IOFD_STDOUT, etc */
+    int type_case;		/* CLIENT_MESSAGE__TYPE_*_BUF */
+    int64_t delay_sec;
+    int32_t delay_nsec;
+    const uint8_t *data;
+    size_t len;
+};
+
+/* iobuf_codec.c */
+bool iobuf_decode(const uint8_t *buf, size_t len, struct iobuf_view *view);
+size_t iobuf_packed_size(const struct timespec *delay, size_t len);
+size_t iobuf_pack(int type_case, const struct timespec *delay, const uint8_t *data, size_t len, uint8_t *out);
+
 /* logsrv_util.c */
 struct iolog_file;
 bool expand_buf(struct connection_buffer *buf, unsigned int needed);
+bool dispatch_frames(struct connection_buffer *buf, bool (*msg_cb)(uint8_t *msg, uint32_t msg_len, void *v), void *v, const char **errstr);
 bool iolog_open_all(int dfd, const char *iolog_dir, struct iolog_file *iolog_files, const char *mode);
 bool iolog_seekto(int iolog_dir_fd, const char *iolog_path, struct iolog_file *iolog_files, struct timespec *elapsed_time, const struct timespec *target);
+bool mapped_file_open(struct mapped_file *mf, int fd, off_t off);
+const uint8_t *mapped_file_next(struct mapped_file *mf, size_t len);
+void mapped_file_close(struct mapped_file *mf);
+bool parse_interval(const char *str, time_t *result);
+bool sync_parent_dir(const char *path);
 
 
 #endif /* SUDO_LOGSRV_UTIL_H */
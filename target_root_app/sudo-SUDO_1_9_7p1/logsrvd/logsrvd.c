@@ -73,6 +73,10 @@
 #include "log_server.pb-c.h"
 #include "hostcheck.h"
 #include "logsrvd.h"
+#include "evstore.h"
+#include "capture.h"
+#include "iolog_fault.h"
+#include "iolog_privsep.h"
 
 #ifndef O_NOFOLLOW
 # define O_NOFOLLOW 0
@@ -84,14 +88,29 @@
 static int logsrvd_debug_instance = SUDO_DEBUG_INSTANCE_INITIALIZER;
 TAILQ_HEAD(connection_list, connection_closure);
 static struct connection_list connections = TAILQ_HEAD_INITIALIZER(connections);
+static struct connection_list commit_queue = TAILQ_HEAD_INITIALIZER(commit_queue);
+static struct sudo_event *commit_sync_ev;
+static struct commit_stats {
+    unsigned long long batches;
+    unsigned long long synced;
+    unsigned long long errors;
+} commit_stats;
 static struct listener_list listeners = TAILQ_HEAD_INITIALIZER(listeners);
 static const char server_id[] = "Sudo Audit Server " PACKAGE_VERSION;
+static struct sudo_event *listener_resume_ev;
+static bool listeners_paused;
+static struct listener_stats {
+    unsigned long long accepted;
+    unsigned long long dropped;
+    unsigned long long paused;
+} listener_stats;
 static const char *conf_file = _PATH_SUDO_LOGSRVD_CONF;
 
 /* Event loop callbacks. */
 static void client_msg_cb(int fd, int what, void *v);
 static void server_msg_cb(int fd, int what, void *v);
 static void server_commit_cb(int fd, int what, void *v);
+static void client_throttle_cb(int fd, int what, void *v);
 #if defined(HAVE_OPENSSL)
 static void tls_handshake_cb(int fd, int what, void *v);
 #endif
@@ -107,16 +126,22 @@ connection_closure_free(struct connection_closure *closure)
     if (closure != NULL) {
 	bool shutting_down = closure->state == SHUTDOWN;
 	struct sudo_event_base *evbase = closure->evbase;
+	struct relay_closure *relay_closure;
 	struct connection_buffer *buf;
 
 	TAILQ_REMOVE(&connections, closure, entries);
+	if (closure->commit_queued)
+	    TAILQ_REMOVE(&commit_queue, closure, commit_entries);
 
 	if (closure->state == CONNECTING && closure->journal != NULL) {
 	    /* Failed to relay journal file, retry later. */
 	    logsrvd_queue_insert(closure);
 	}
-	if (closure->relay_closure != NULL)
-	    relay_closure_free(closure->relay_closure);
+	while ((relay_closure = TAILQ_FIRST(&closure->relay_closures)) != NULL) {
+	    TAILQ_REMOVE(&closure->relay_closures, relay_closure, entries);
+	    relay_closure_free(relay_closure);
+	}
+	closure->relay_closure = NULL;
 #if defined(HAVE_OPENSSL)
 	if (closure->ssl != NULL) {
 	    /* Must call SSL_shutdown() before closing closure->sock. */
@@ -128,14 +153,21 @@ connection_closure_free(struct connection_closure *closure)
 #endif
 	if (closure->sock != -1)
 	    close(closure->sock);
-	iolog_close_all(closure);
+	/* A dropped session may be kept open for a quick restart. */
+	if (!resume_cache_stash(closure))
+	    iolog_close_all(closure);
+	capture_close(closure);
+	trace_close(closure);
 	sudo_ev_free(closure->commit_ev);
 	sudo_ev_free(closure->read_ev);
 	sudo_ev_free(closure->write_ev);
+	sudo_ev_free(closure->throttle_ev);
 #if defined(HAVE_OPENSSL)
 	sudo_ev_free(closure->ssl_accept_ev);
 #endif
+	source_limit_release(closure->source);
 	eventlog_free(closure->evlog);
+	free(closure->accept_buf);
 	free(closure->read_buf.data);
 	while ((buf = TAILQ_FIRST(&closure->write_bufs)) != NULL) {
 	    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
@@ -150,6 +182,11 @@ connection_closure_free(struct connection_closure *closure)
 	    free(buf);
 	}
 	free(closure->journal_path);
+#ifdef HAVE_ZLIB_H
+	if (closure->journal_gz != NULL)
+	    gzclose(closure->journal_gz);
+#endif
+	mapped_file_close(&closure->journal_map);
 	if (closure->journal != NULL)
 	    fclose(closure->journal);
 	free(closure);
@@ -179,11 +216,16 @@ connection_closure_alloc(int fd, bool tls, bool relay_only,
     closure->evbase = base;
     TAILQ_INIT(&closure->write_bufs);
     TAILQ_INIT(&closure->free_bufs);
+    TAILQ_INIT(&closure->relay_closures);
 
-    /* Use different message handlers depending on the operating mode. */
+    /*
+     * Use different message handlers depending on the operating mode.
+     * If the relay_dir volume is full, relay directly instead of journaling.
+     */
     if (relay_only) {
 	closure->cms = &cms_relay;
-    } else if (logsrvd_conf_relay_store_first()) {
+    } else if (logsrvd_conf_relay_store_first() &&
+	    storage_state(STORAGE_RELAY_DIR) != STORAGE_HARD) {
 	closure->store_first = true;
 	closure->cms = &cms_journal;
     } else {
@@ -212,6 +254,11 @@ connection_closure_alloc(int fd, bool tls, bool relay_only,
 	    server_commit_cb, closure);
 	if (closure->commit_ev == NULL)
 	    goto bad;
+
+	closure->throttle_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT,
+	    client_throttle_cb, closure);
+	if (closure->throttle_ev == NULL)
+	    goto bad;
     }
 #if defined(HAVE_OPENSSL)
     if (tls) {
@@ -264,10 +311,16 @@ connection_close(struct connection_closure *closure)
 	    new_closure->journal_path = closure->journal_path;
 	    closure->journal_path = NULL;
 
+	    /* The manifest record is skipped while this is in progress. */
+	    logsrvd_queue_inflight(new_closure->journal_path);
+
 	    /* Connect to the first relay available asynchronously. */
 	    if (!connect_relay(new_closure)) {
 		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 		    "unable to connect to relay");
+		/* If not requeued, retry when its manifest record is read. */
+		if (new_closure->state != CONNECTING)
+		    logsrvd_queue_remove(new_closure->journal_path);
 		connection_closure_free(new_closure);
 	    }
 	}
@@ -276,6 +329,7 @@ connection_close(struct connection_closure *closure)
 	/* Journal relayed successfully, remove backing file. */
 	sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
 	    "removing journal file %s", closure->journal_path);
+	logsrvd_queue_remove(closure->journal_path);
 	unlink(closure->journal_path);
 
 	/* Process the next outgoing file (if any). */
@@ -297,6 +351,8 @@ get_free_buf(size_t len, struct connection_closure *closure)
         TAILQ_REMOVE(&closure->free_bufs, buf, entries);
     else
         buf = calloc(1, sizeof(*buf));
+    if (buf != NULL)
+	buf->trace_seq = 0;
 
     if (buf != NULL && len > buf->size) {
 	free(buf->data);
@@ -406,6 +462,8 @@ schedule_error_message(const char *errstr, struct connection_closure *closure)
 
     /* Prevent further reads from the client, just write the error. */
     sudo_ev_del(closure->evbase, closure->read_ev);
+    if (closure->throttle_ev != NULL)
+	sudo_ev_del(closure->evbase, closure->throttle_ev);
 
     if (errstr == NULL || closure->error || closure->write_ev == NULL)
 	goto done;
@@ -456,6 +514,7 @@ handle_accept(AcceptMessage *msg, uint8_t *buf, size_t len,
     sudo_debug_printf(SUDO_DEBUG_INFO, "%s: received AcceptMessage from %s",
 	__func__, source);
 
+    trace_accept(msg, closure);
     ret = closure->cms->accept(msg, buf, len, closure);
     if (ret) {
 	if (msg->expect_iobufs)
@@ -548,6 +607,8 @@ handle_exit(ExitMessage *msg, uint8_t *buf, size_t len,
 	}
     }
     sudo_ev_del(closure->evbase, closure->read_ev);
+    if (closure->throttle_ev != NULL)
+	sudo_ev_del(closure->evbase, closure->throttle_ev);
 
     debug_return_bool(ret);
 }
@@ -610,6 +671,63 @@ handle_alert(AlertMessage *msg, uint8_t *buf, size_t len,
     debug_return_bool(closure->cms->alert(msg, buf, len, closure));
 }
 
+/*
+ * Send commit points for all sessions with data written since the
+ * last batch.  The data is synced to stable storage first so the
+ * commit point is only sent for data that is actually on disk.
+ */
+static void
+commit_sync_cb(int unused, int what, void *v)
+{
+    struct connection_closure *closure, *next;
+    debug_decl(commit_sync_cb, SUDO_DEBUG_UTIL);
+
+    if (TAILQ_EMPTY(&commit_queue))
+	debug_return;
+
+    commit_stats.batches++;
+    TAILQ_FOREACH_SAFE(closure, &commit_queue, commit_entries, next) {
+	server_commit_cb(-1, SUDO_EV_TIMEOUT, closure);
+    }
+
+    debug_return;
+}
+
+/*
+ * Queue closure for the next batched commit point, starting
+ * the batch timer if it is not already running.
+ */
+static bool
+commit_queue_insert(struct connection_closure *closure)
+{
+    debug_decl(commit_queue_insert, SUDO_DEBUG_UTIL);
+
+    if (closure->commit_queued)
+	debug_return_bool(true);
+
+    if (commit_sync_ev == NULL) {
+	commit_sync_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT, commit_sync_cb,
+	    NULL);
+	if (commit_sync_ev == NULL) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to allocate commit sync event");
+	    debug_return_bool(false);
+	}
+    }
+    if (!ISSET(commit_sync_ev->flags, SUDO_EVQ_INSERTED)) {
+	struct timespec tv = { ACK_FREQUENCY, 0 };
+	if (sudo_ev_add(closure->evbase, commit_sync_ev, &tv, false) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to add commit sync event");
+	    debug_return_bool(false);
+	}
+    }
+    TAILQ_INSERT_TAIL(&commit_queue, closure, commit_entries);
+    closure->commit_queued = true;
+
+    debug_return_bool(true);
+}
+
 /* Enable a commit event if not relaying and it is not already pending. */
 static bool
 enable_commit(struct connection_closure *closure)
@@ -617,6 +735,10 @@ enable_commit(struct connection_closure *closure)
     debug_decl(enable_commit, SUDO_DEBUG_UTIL);
 
     if (closure->relay_closure == NULL) {
+	/* Durable commit points are sent in batches. */
+	if (logsrvd_conf_server_commit_sync())
+	    debug_return_bool(commit_queue_insert(closure));
+
 	if (!ISSET(closure->commit_ev->flags, SUDO_EVQ_INSERTED)) {
 	    struct timespec tv = { ACK_FREQUENCY, 0 };
 	    if (sudo_ev_add(closure->evbase, closure->commit_ev, &tv, false) == -1) {
@@ -653,6 +775,7 @@ handle_iobuf(int iofd, IoBuffer *iobuf, uint8_t *buf, size_t len,
     sudo_debug_printf(SUDO_DEBUG_INFO, "%s: received IoBuffer from %s",
 	source, __func__);
 
+    trace_delay(iobuf->delay, true, closure);
     if (!closure->cms->iobuf(iofd, iobuf, buf, len, closure))
 	debug_return_bool(false);
     if (!enable_commit(closure))
@@ -685,6 +808,7 @@ handle_winsize(ChangeWindowSize *msg, uint8_t *buf, size_t len,
     sudo_debug_printf(SUDO_DEBUG_INFO, "%s: received ChangeWindowSize from %s",
 	source, __func__);
 
+    trace_delay(msg->delay, false, closure);
     if (!closure->cms->winsize(msg, buf, len, closure))
 	debug_return_bool(false);
     if (!enable_commit(closure))
@@ -717,6 +841,7 @@ handle_suspend(CommandSuspend *msg, uint8_t *buf, size_t len,
     sudo_debug_printf(SUDO_DEBUG_INFO, "%s: received CommandSuspend from %s",
 	source, __func__);
 
+    trace_delay(msg->delay, false, closure);
     if (!closure->cms->suspend(msg, buf, len, closure))
 	debug_return_bool(false);
     if (!enable_commit(closure))
@@ -750,10 +875,24 @@ static bool
 handle_client_message(uint8_t *buf, size_t len,
     struct connection_closure *closure)
 {
+    struct iobuf_view view;
     ClientMessage *msg;
     bool ret = false;
     debug_decl(handle_client_message, SUDO_DEBUG_UTIL);
 
+    /* Decode IoBuffer messages in place, without allocating. */
+    if (iobuf_decode(buf, len, &view)) {
+	IoBuffer iobuf = IO_BUFFER__INIT;
+	TimeSpec delay = TIME_SPEC__INIT;
+
+	delay.tv_sec = view.delay_sec;
+	delay.tv_nsec = view.delay_nsec;
+	iobuf.delay = &delay;
+	iobuf.data.data = (uint8_t *)view.data;
+	iobuf.data.len = view.len;
+	debug_return_bool(handle_iobuf(view.iofd, &iobuf, buf, len, closure));
+    }
+
     /* TODO: can we extract type_case without unpacking for relay case? */
     msg = client_message__unpack(NULL, len, buf);
     if (msg == NULL) {
@@ -835,6 +974,13 @@ server_shutdown(struct sudo_event_base *base)
     struct timespec tv = { 0, 0 };
     debug_decl(server_shutdown, SUDO_DEBUG_UTIL);
 
+    /* Write any queued event log entries. */
+    logsrvd_eventlog_flush();
+    logsrvd_evstore_flush();
+
+    /* Close sessions that were waiting for a restart. */
+    resume_cache_flush();
+
     if (TAILQ_EMPTY(&connections)) {
 	sudo_ev_loopbreak(base);
 	debug_return;
@@ -843,6 +989,8 @@ server_shutdown(struct sudo_event_base *base)
     TAILQ_FOREACH_SAFE(closure, &connections, entries, next) {
 	closure->state = SHUTDOWN;
 	sudo_ev_del(base, closure->read_ev);
+	if (closure->throttle_ev != NULL)
+	    sudo_ev_del(base, closure->throttle_ev);
 	if (closure->relay_closure != NULL) {
 	    /* Connection being relayed, check for pending I/O. */
 	    relay_shutdown(closure);
@@ -978,6 +1126,130 @@ finished:
     debug_return;
 }
 
+/*
+ * Resume reading from a client that was paused for exceeding
+ * its source address byte rate or due to storage or event log
+ * backpressure.
+ */
+static void
+client_throttle_cb(int unused, int what, void *v)
+{
+    struct connection_closure *closure = v;
+    debug_decl(client_throttle_cb, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"resuming reads from %s", closure->ipaddr);
+    if (sudo_ev_add(closure->evbase, closure->read_ev, NULL, false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add client read event");
+	connection_close(closure);
+    }
+
+    debug_return;
+}
+
+struct client_frame {
+    struct connection_closure *closure;
+    struct timespec arrival;
+};
+
+/*
+ * Handle one ClientMessage framed by dispatch_frames().
+ */
+static bool
+client_frame_cb(uint8_t *msg, uint32_t msg_len, void *v)
+{
+    struct client_frame *fc = v;
+    struct connection_closure *closure = fc->closure;
+    debug_decl(client_frame_cb, SUDO_DEBUG_UTIL);
+
+    /* Record the message as framed on the wire if capturing. */
+    if (closure->sock != -1) {
+	capture_message(closure, &fc->arrival, msg - sizeof(msg_len),
+	    msg_len + sizeof(msg_len));
+    }
+
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"%s: parsing ClientMessage, size %u", __func__, msg_len);
+    if (!handle_client_message(msg, msg_len, closure)) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to parse ClientMessage, size %u", msg_len);
+	closure->errstr = _("invalid ClientMessage");
+	debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
+/* Maximum number of bytes of a mapped journal to parse per callback. */
+#define JOURNAL_REPLAY_CHUNK	(64 * 1024)
+
+/*
+ * Parse messages directly from a mapped journal being relayed.
+ * The messages are framed in place by dispatch_frames(), at least
+ * one but no more than JOURNAL_REPLAY_CHUNK bytes' worth at a time.
+ */
+static void
+replay_mapped_journal(struct connection_closure *closure)
+{
+    struct mapped_file *mf = &closure->journal_map;
+    struct connection_buffer view = { 0 };
+    const char *errstr = NULL;
+    struct client_frame fc;
+    size_t window = mf->size - mf->off;
+    uint32_t msg_len;
+    debug_decl(replay_mapped_journal, SUDO_DEBUG_UTIL);
+
+    if (window == 0) {
+	if (closure->state != FINISHED) {
+	    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+		"unexpected EOF");
+	}
+	goto close_connection;
+    }
+    if (window > JOURNAL_REPLAY_CHUNK) {
+	/* Always include the whole of the first message. */
+	memcpy(&msg_len, mf->base + mf->off, sizeof(msg_len));
+	msg_len = ntohl(msg_len);
+	if (msg_len <= MESSAGE_SIZE_MAX &&
+		msg_len + sizeof(msg_len) > JOURNAL_REPLAY_CHUNK)
+	    window = MIN(window, msg_len + sizeof(msg_len));
+	else
+	    window = JOURNAL_REPLAY_CHUNK;
+    }
+
+    /* A zero-sized buffer borrows the mapped data read-only. */
+    view.data = mf->base + mf->off;
+    view.len = (unsigned int)window;
+    fc.closure = closure;
+    sudo_timespecclear(&fc.arrival);
+    if (!dispatch_frames(&view, client_frame_cb, &fc, &errstr)) {
+	if (errstr != NULL)
+	    closure->errstr = _(errstr);
+	goto send_error;
+    }
+    if (view.off == 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "%s: truncated message at offset %zu", closure->journal_path,
+	    mf->off);
+	closure->errstr = _("invalid ClientMessage");
+	goto send_error;
+    }
+    (void)mapped_file_next(mf, view.off);
+
+    if (closure->state == FINISHED)
+	goto close_connection;
+
+    debug_return;
+
+send_error:
+    if (schedule_error_message(closure->errstr, closure))
+	debug_return;
+close_connection:
+    connection_close(closure);
+    debug_return;
+}
+
 /*
  * Receive client message(s).
  */
@@ -986,7 +1258,8 @@ client_msg_cb(int fd, int what, void *v)
 {
     struct connection_closure *closure = v;
     struct connection_buffer *buf = &closure->read_buf;
-    uint32_t msg_len;
+    struct client_frame fc;
+    const char *errstr = NULL;
     ssize_t nread;
     debug_decl(client_msg_cb, SUDO_DEBUG_UTIL);
 
@@ -1058,7 +1331,15 @@ client_msg_cb(int fd, int what, void *v)
         }
     } else
 #endif
-    {
+    if (closure->sock == -1 && closure->journal != NULL) {
+	/* Replaying a journal file, which may be compressed or mapped. */
+	if (journal_mapped(closure)) {
+	    replay_mapped_journal(closure);
+	    debug_return;
+	}
+	nread = journal_read(closure, buf->data + buf->len,
+	    buf->size - buf->len);
+    } else {
         nread = read(fd, buf->data + buf->len, buf->size - buf->len);
     }
 
@@ -1081,42 +1362,40 @@ client_msg_cb(int fd, int what, void *v)
 	break;
     }
     buf->len += nread;
+    sudo_gettime_mono(&fc.arrival);
 
-    while (buf->len - buf->off >= sizeof(msg_len)) {
-	/* Read wire message size (uint32_t in network byte order). */
-	memcpy(&msg_len, buf->data + buf->off, sizeof(msg_len));
-	msg_len = ntohl(msg_len);
-
-	if (msg_len > MESSAGE_SIZE_MAX) {
-	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
-		"client message too large: %u", msg_len);
-	    closure->errstr = _("client message too large");
-	    goto send_error;
-	}
-
-	if (msg_len + sizeof(msg_len) > buf->len - buf->off) {
-	    /* Incomplete message, we'll read the rest next time. */
-	    if (!expand_buf(buf, msg_len + sizeof(msg_len))) {
+    /*
+     * Pause reading if the client's source address is over its byte rate
+     * or the volume we are storing to is running out of space.
+     */
+    if (closure->source != NULL) {
+	struct timespec delay;
+	bool pause = !source_limit_charge(closure->source, nread, &delay);
+
+	if (!pause && closure->cms == &cms_local)
+	    pause = storage_backpressure(STORAGE_IOLOG_DIR, &delay);
+	if (!pause && closure->cms == &cms_local)
+	    pause = logsrvd_eventlog_backpressure(&delay);
+	else if (!pause && closure->cms == &cms_journal)
+	    pause = storage_backpressure(STORAGE_RELAY_DIR, &delay);
+	if (pause) {
+	    sudo_ev_del(closure->evbase, closure->read_ev);
+	    if (sudo_ev_add(closure->evbase, closure->throttle_ev, &delay,
+		    false) == -1) {
+		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		    "unable to add throttle event");
 		closure->errstr = _("unable to allocate memory");
 		goto send_error;
 	    }
-	    debug_return;
 	}
+    }
 
-	/* Parse ClientMessage (could be zero bytes). */
-	sudo_debug_printf(SUDO_DEBUG_INFO,
-	    "%s: parsing ClientMessage, size %u", __func__, msg_len);
-	buf->off += sizeof(msg_len);
-	if (!handle_client_message(buf->data + buf->off, msg_len, closure)) {
-	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
-		"unable to parse ClientMessage, size %u", msg_len);
-	    closure->errstr = _("invalid ClientMessage");
-	    goto send_error;
-	}
-	buf->off += msg_len;
+    fc.closure = closure;
+    if (!dispatch_frames(buf, client_frame_cb, &fc, &errstr)) {
+	if (errstr != NULL)
+	    closure->errstr = _(errstr);
+	goto send_error;
     }
-    buf->len -= buf->off;
-    buf->off = 0;
 
     if (closure->state == FINISHED)
 	goto close_connection;
@@ -1145,6 +1424,8 @@ schedule_commit_point(TimeSpec *commit_point,
 {
     debug_decl(schedule_commit_point, SUDO_DEBUG_UTIL);
 
+    trace_commit(commit_point, closure);
+
     if (closure->write_ev != NULL) {
 	/* Send an acknowledgement of what we've committed to disk. */
 	ServerMessage msg = SERVER_MESSAGE__INIT;
@@ -1184,10 +1465,57 @@ server_commit_cb(int unused, int what, void *v)
 {
     struct connection_closure *closure = v;
     TimeSpec commit_point = TIME_SPEC__INIT;
+    struct timespec start;
+    bool synced;
     debug_decl(server_commit_cb, SUDO_DEBUG_UTIL);
 
+    if (closure->commit_queued) {
+	TAILQ_REMOVE(&commit_queue, closure, commit_entries);
+	closure->commit_queued = false;
+    }
+
+    /*
+     * The flush (or sync) below is where the data actually reaches the
+     * disk, so this is what the storage write latency measures.
+     */
+    sudo_gettime_mono(&start);
+
+    /* Only acknowledge data that has reached stable storage. */
+    if (logsrvd_conf_server_commit_sync()) {
+	if (closure->journal != NULL)
+	    synced = journal_sync(closure);
+	else
+	    synced = iolog_sync_all(closure);
+	if (!synced) {
+	    commit_stats.errors++;
+	    closure->errstr = _("unable to sync I/O log to disk");
+	    if (!schedule_error_message(closure->errstr, closure))
+		connection_close(closure);
+	    debug_return;
+	}
+	commit_stats.synced++;
+    } else if (closure->journal != NULL) {
+	/* Each commit point is a flush point for the journal. */
+	if (!journal_flush(closure)) {
+	    closure->errstr = _("unable to write journal file");
+	    if (!schedule_error_message(closure->errstr, closure))
+		connection_close(closure);
+	    debug_return;
+	}
+    } else if (!iolog_direct_flush_all(closure) ||
+	    !iolog_dedup_flush_all(closure) || !iolog_dict_flush_all(closure)) {
+	/* Acknowledged data must not be left in a staging buffer. */
+	closure->errstr = _("unable to write I/O log file");
+	if (!schedule_error_message(closure->errstr, closure))
+	    connection_close(closure);
+	debug_return;
+    }
+    storage_record_write(closure->journal != NULL ? STORAGE_RELAY_DIR :
+	STORAGE_IOLOG_DIR, &start);
+
     commit_point.tv_sec = closure->elapsed_time.tv_sec;
     commit_point.tv_nsec = closure->elapsed_time.tv_nsec;
+    resume_cache_mark(closure);
     if (!schedule_commit_point(&commit_point, closure))
 	connection_close(closure);
 
@@ -1203,13 +1531,17 @@ bool
 start_protocol(struct connection_closure *closure)
 {
     const struct timespec *timeout = logsrvd_conf_server_timeout();
+    struct relay_closure *relay_closure;
     debug_decl(start_protocol, SUDO_DEBUG_UTIL);
 
-    if (closure->relay_closure != NULL && closure->relay_closure->relays != NULL) {
-	/* No longer need the stashed relays list. */
-	address_list_delref(closure->relay_closure->relays);
-	closure->relay_closure->relays = NULL;
-	closure->relay_closure->relay_addr = NULL;
+    TAILQ_FOREACH(relay_closure, &closure->relay_closures, entries) {
+	if (relay_closure->relays != NULL) {
+	    /* No longer need the stashed relays list. */
+	    address_list_delref(relay_closure->relays);
+	    relay_closure->relays = NULL;
+	    relay_closure->relay_addr = NULL;
+	    relay_closure->relay_tried = NULL;
+	}
     }
 
     /* When replaying a journal there is no write event. */
@@ -1391,16 +1723,24 @@ bad:
 /*
  * New connection.
  * Allocate a connection closure and optionally perform TLS handshake.
+ * Returns 0 on success, else an errno value describing the failure.
+ * A connection rejected by the admission limits returns ECONNREFUSED.
  */
-static bool
+static int
 new_connection(int sock, bool tls, const struct sockaddr *sa,
     struct sudo_event_base *evbase)
 {
     struct connection_closure *closure;
+    const char *errstr;
+    int error = EIO;
     debug_decl(new_connection, SUDO_DEBUG_UTIL);
 
-    if ((closure = connection_closure_alloc(sock, tls, false, evbase)) == NULL)
+    errno = 0;
+    closure = connection_closure_alloc(sock, tls, false, evbase);
+    if (closure == NULL) {
+	error = errno ? errno : ENOMEM;
 	goto bad;
+    }
 
     /* store the peer's IP address in the closure object */
     if (sa->sa_family == AF_INET) {
@@ -1414,13 +1754,22 @@ new_connection(int sock, bool tls, const struct sockaddr *sa,
             sizeof(closure->ipaddr));
 #endif /* HAVE_STRUCT_IN6_ADDR */
     } else {
-	errno = EAFNOSUPPORT;
+	errno = error = EAFNOSUPPORT;
         sudo_warn("%s", U_("unable to get remote IP addr"));
         goto bad;
     }
     sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
 	"connection from %s", closure->ipaddr);
 
+    /* Apply session and per-source connection limits. */
+    closure->source = source_limit_acquire(sa, &errstr);
+    if (closure->source == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+	    "rejecting connection from %s: %s", closure->ipaddr, errstr);
+	error = ECONNREFUSED;
+	goto bad;
+    }
+
 #if defined(HAVE_OPENSSL)
     /* If TLS is enabled, perform the TLS handshake first. */
     if (tls) {
@@ -1429,6 +1778,7 @@ new_connection(int sock, bool tls, const struct sockaddr *sa,
             sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
                 "unable to create new ssl object: %s",
                 ERR_error_string(ERR_get_error(), NULL));
+	    error = ENOMEM;
             goto bad;
         }
 
@@ -1458,19 +1808,24 @@ new_connection(int sock, bool tls, const struct sockaddr *sa,
 #endif
     /* If no TLS handshake, start the protocol immediately. */
     if (!tls) {
-	if (!TAILQ_EMPTY(logsrvd_conf_relay_address()) && !closure->store_first) {
-	    if (!connect_relay(closure))
-		goto bad;
-	} else {
-	    if (!start_protocol(closure))
-		goto bad;
+	bool ok;
+
+	errno = 0;
+	if (!TAILQ_EMPTY(logsrvd_conf_relay_address()) && !closure->store_first)
+	    ok = connect_relay(closure);
+	else
+	    ok = start_protocol(closure);
+	if (!ok) {
+	    if (errno != 0)
+		error = errno;
+	    goto bad;
 	}
     }
 
-    debug_return_bool(true);
+    debug_return_int(0);
 bad:
     connection_close(closure);
-    debug_return_bool(false);
+    debug_return_int(error);
 }
 
 static int
@@ -1502,6 +1857,15 @@ create_listener(struct server_address *addr)
 	sudo_warn("%s (%s)", addr->sa_str, family);
 	goto bad;
     }
+#ifdef TCP_FASTOPEN
+    if (logsrvd_conf_server_tcp_fastopen()) {
+	/* Accept data in the SYN from clients with a Fast Open cookie. */
+	int qlen = SOMAXCONN;
+	if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &qlen,
+		sizeof(qlen)) == -1)
+	    sudo_warn("TCP_FASTOPEN");
+    }
+#endif
     if (listen(sock, SOMAXCONN) == -1) {
 	sudo_warn("listen");
 	goto bad;
@@ -1521,18 +1885,150 @@ bad:
     debug_return_int(-1);
 }
 
+/*
+ * Returns true if errnum indicates a (hopefully temporary) lack of
+ * resources, in which case we should stop accepting connections for a bit.
+ */
+static bool
+accept_resource_error(int errnum)
+{
+    switch (errnum) {
+    case EMFILE:
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+	return true;
+    default:
+	return false;
+    }
+}
+
+/*
+ * Re-enable all listeners after a pause.
+ */
+static void
+listener_resume_cb(int unused, int what, void *v)
+{
+    struct sudo_event_base *evbase = v;
+    struct listener *l;
+    debug_decl(listener_resume_cb, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"resuming accept on listen sockets");
+    listeners_paused = false;
+    TAILQ_FOREACH(l, &listeners, entries) {
+	if (sudo_ev_add(evbase, l->ev, NULL, false) == -1)
+	    sudo_fatal("%s", U_("unable to add event to queue"));
+    }
+
+    debug_return;
+}
+
+/*
+ * Stop accepting new connections on all listeners for ACCEPT_PAUSE_TIMEO
+ * seconds.  Pending connections remain in the kernel's listen queue.
+ */
+static void
+listener_pause(struct sudo_event_base *evbase, int errnum)
+{
+    struct timespec tv = { ACCEPT_PAUSE_TIMEO, 0 };
+    struct listener *l;
+    debug_decl(listener_pause, SUDO_DEBUG_UTIL);
+
+    if (listeners_paused)
+	debug_return;
+
+    if (listener_resume_ev == NULL) {
+	listener_resume_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT,
+	    listener_resume_cb, evbase);
+	if (listener_resume_ev == NULL) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to allocate listener resume event");
+	    debug_return;
+	}
+    }
+    if (sudo_ev_add(evbase, listener_resume_ev, &tv, false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add listener resume event");
+	debug_return;
+    }
+
+    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+	"pausing accept for %d second(s): %s", ACCEPT_PAUSE_TIMEO,
+	strerror(errnum));
+    TAILQ_FOREACH(l, &listeners, entries) {
+	sudo_ev_del(evbase, l->ev);
+    }
+    listeners_paused = true;
+    listener_stats.paused++;
+
+    debug_return;
+}
+
+/*
+ * Accept a single connection, returning the new non-blocking,
+ * close-on-exec socket or -1 on error.
+ */
+static int
+accept_nonblock(int fd, struct sockaddr *sa, socklen_t *salen)
+{
+    int sock;
+#ifndef HAVE_ACCEPT4
+    int flags;
+#endif
+    debug_decl(accept_nonblock, SUDO_DEBUG_UTIL);
+
+#ifdef HAVE_ACCEPT4
+    sock = accept4(fd, sa, salen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+    sock = accept(fd, sa, salen);
+    if (sock != -1) {
+	flags = fcntl(sock, F_GETFL, 0);
+	if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1 ||
+		fcntl(sock, F_SETFD, FD_CLOEXEC) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to set socket flags");
+	    close(sock);
+	    sock = -1;
+	}
+    }
+#endif
+
+    debug_return_int(sock);
+}
+
+/*
+ * Accept up to ACCEPT_BATCH_MAX new connections.
+ * If we run out of file descriptors or memory, stop accepting
+ * for a bit instead of spinning on the listen socket.
+ */
 static void
 listener_cb(int fd, int what, void *v)
 {
     struct listener *l = v;
     struct sudo_event_base *evbase = sudo_ev_get_base(l->ev);
     union sockaddr_union s_un;
-    socklen_t salen = sizeof(s_un);
-    int sock;
+    socklen_t salen;
+    int error, n, sock;
     debug_decl(listener_cb, SUDO_DEBUG_UTIL);
 
-    sock = accept(fd, &s_un.sa, &salen);
-    if (sock != -1) {
+    for (n = 0; n < ACCEPT_BATCH_MAX; n++) {
+	salen = sizeof(s_un);
+	sock = accept_nonblock(fd, &s_un.sa, &salen);
+	if (sock == -1) {
+	    error = errno;
+	    if (error == EINTR || error == ECONNABORTED)
+		continue;
+	    if (error == EAGAIN || error == EWOULDBLOCK)
+		break;
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to accept new connection");
+	    if (accept_resource_error(error))
+		listener_pause(evbase, error);
+	    break;
+	}
+	listener_stats.accepted++;
+
 	if (logsrvd_conf_server_tcp_keepalive()) {
 	    int keepalive = 1;
 	    if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepalive,
@@ -1541,17 +2037,15 @@ listener_cb(int fd, int what, void *v)
 		    "unable to set SO_KEEPALIVE option");
 	    }
 	}
-	if (!new_connection(sock, l->tls, &s_un.sa, evbase)) {
-	    /* TODO: pause accepting on ENOMEM */
+	if ((error = new_connection(sock, l->tls, &s_un.sa, evbase)) != 0) {
 	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
-		"unable to start new connection");
-	}
-    } else {
-	if (errno != EAGAIN) {
-	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
-		"unable to accept new connection");
+		"unable to start new connection: %s", strerror(error));
+	    listener_stats.dropped++;
+	    if (accept_resource_error(error)) {
+		listener_pause(evbase, error);
+		break;
+	    }
 	}
-	/* TODO: pause accepting on ENFILE and EMFILE */
     }
 
     debug_return;
@@ -1595,6 +2089,11 @@ server_setup(struct sudo_event_base *base)
     bool ret;
     debug_decl(server_setup, SUDO_DEBUG_UTIL);
 
+    /* Cancel pending resume, new listeners are enabled immediately. */
+    if (listener_resume_ev != NULL)
+	sudo_ev_del(base, listener_resume_ev);
+    listeners_paused = false;
+
     /* Free old listeners (if any) and register new ones. */
     while ((l = TAILQ_FIRST(&listeners)) != NULL) {
 	TAILQ_REMOVE(&listeners, l, entries);
@@ -1624,11 +2123,30 @@ server_reload(struct sudo_event_base *evbase)
     debug_decl(server_reload, SUDO_DEBUG_UTIL);
 
     sudo_debug_printf(SUDO_DEBUG_INFO, "reloading server config");
+
+    /* Queued events must be written with the old log settings. */
+    logsrvd_eventlog_flush();
+    logsrvd_evstore_close();
+
     if (logsrvd_conf_read(conf_file)) {
 	/* Re-initialize listeners. */
 	if (!server_setup(evbase))
 	    sudo_fatalx("%s", U_("unable to setup listen socket"));
 
+	/* The dictionary store or training interval may have changed. */
+	iolog_dict_reload();
+
+	/* The I/O log owner may have changed. */
+	if (!iolog_privsep_start())
+	    sudo_warnx("%s", U_("unable to start I/O log owner helper"));
+
+	/* The trace file may have been rotated. */
+	trace_reload();
+
+	/* The relay hosts or TLS settings may have changed. */
+	logsrvd_resolve_reload();
+	logsrvd_standby_reload();
+
 	/* Re-read sudo.conf and re-initialize debugging. */
 	sudo_debug_deregister(logsrvd_debug_instance);
 	logsrvd_debug_instance = SUDO_DEBUG_INSTANCE_INITIALIZER;
@@ -1676,12 +2194,16 @@ server_dump_stats(void)
 	sudo_debug_printf(SUDO_DEBUG_INFO, "  %d: %s [%s]", ++n,
 	    addr->sa_str, ipaddr);
     }
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"accepted %llu, dropped %llu, paused %llu%s", listener_stats.accepted,
+	listener_stats.dropped, listener_stats.paused,
+	listeners_paused ? " (currently paused)" : "");
 
     if (!TAILQ_EMPTY(&connections)) {
 	n = 0;
 	sudo_debug_printf(SUDO_DEBUG_INFO, "client connections:");
 	TAILQ_FOREACH(closure, &connections, entries) {
-	    struct relay_closure *relay_closure = closure->relay_closure;
+	    struct relay_closure *relay_closure;
 
 	    n++;
 	    if (closure->sock == -1) {
@@ -1695,12 +2217,17 @@ server_dump_stats(void)
 		sudo_debug_printf(SUDO_DEBUG_INFO, "  %2d: sock %d", n,
 		    closure->sock);
 	    }
-	    if (relay_closure != NULL) {
-		sudo_debug_printf(SUDO_DEBUG_INFO, "      relay: %s (%s)",
+	    TAILQ_FOREACH(relay_closure, &closure->relay_closures, entries) {
+		sudo_debug_printf(SUDO_DEBUG_INFO, "      relay: %s (%s)%s",
 		    relay_closure->relay_name.name,
-		    relay_closure->relay_name.ipaddr);
+		    relay_closure->relay_name.ipaddr,
+		    relay_closure == closure->relay_closure ? " (primary)" : "");
 		sudo_debug_printf(SUDO_DEBUG_INFO, "      relay sock: %d",
 		    relay_closure->sock);
+		sudo_debug_printf(SUDO_DEBUG_INFO,
+		    "      relay commit point: [%lld, %ld]",
+		    (long long)relay_closure->commit_point.tv_sec,
+		    relay_closure->commit_point.tv_nsec);
 	    }
 	    sudo_debug_printf(SUDO_DEBUG_INFO, "      state: %d", closure->state);
 	    if (closure->errstr != NULL) {
@@ -1720,7 +2247,24 @@ server_dump_stats(void)
 	}
 	sudo_debug_printf(SUDO_DEBUG_INFO, "%d client connection(s)\n", n);
     }
+    if (logsrvd_conf_server_commit_sync()) {
+	sudo_debug_printf(SUDO_DEBUG_INFO,
+	    "commit sync: %llu batches, %llu sessions synced, %llu errors",
+	    commit_stats.batches, commit_stats.synced, commit_stats.errors);
+    }
+    source_limit_dump();
+    storage_dump();
     logsrvd_queue_dump();
+    logsrvd_eventlog_dump();
+    logsrvd_evstore_dump();
+    capture_dump();
+    trace_dump();
+    iolog_dict_dump();
+    iolog_fault_dump();
+    iolog_privsep_dump();
+    resume_cache_dump();
+    logsrvd_standby_dump();
+    logsrvd_resolve_dump();
 
     debug_return;
 }
@@ -1743,6 +2287,12 @@ signal_cb(int signo, int what, void *v)
 	case SIGUSR1:
 	    server_dump_stats();
 	    break;
+	case SIGCHLD:
+	    iolog_dict_reap();
+	    iolog_privsep_reap();
+	    logsrvd_resolve_reap();
+	    logsrvd_eventlog_reap();
+	    break;
 	default:
 	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 		"unexpected signal %d", signo);
@@ -1853,8 +2403,8 @@ daemonize(bool nofork)
 static void
 usage(bool fatal)
 {
-    fprintf(stderr, "usage: %s [-n] [-f conf_file] [-R percentage]\n",
-	getprogname());
+    fprintf(stderr, "usage: %s [-n] [-F fault] [-f conf_file] "
+	"[-R percentage]\n", getprogname());
     if (fatal)
 	exit(EXIT_FAILURE);
 }
@@ -1865,6 +2415,8 @@ help(void)
     printf("%s - %s\n\n", getprogname(), _("sudo log server"));
     usage(false);
     printf("\n%s\n", _("Options:"));
+    printf("  -F, --fault           %s\n",
+	_("inject storage or relay faults (testing)"));
     printf("  -f, --file            %s\n",
 	_("path to configuration file"));
     printf("  -h, --help            %s\n",
@@ -1879,8 +2431,9 @@ help(void)
     exit(EXIT_SUCCESS);
 }
 
-static const char short_opts[] = "f:hnR:V";
+static const char short_opts[] = "f:F:hnR:V";
 static struct option long_opts[] = {
+    { "fault",		required_argument,	NULL,	'F' },
     { "file",		required_argument,	NULL,	'f' },
     { "help",		no_argument,		NULL,	'h' },
     { "no-fork",	no_argument,		NULL,	'n' },
@@ -1931,6 +2484,11 @@ main(int argc, char *argv[])
 	case 'f':
 	    conf_file = optarg;
 	    break;
+	case 'F':
+	    /* storage and relay fault injection (debug) */
+	    if (!iolog_fault_parse(optarg))
+		sudo_fatalx(U_("invalid fault specification: %s"), optarg);
+	    break;
 	case 'h':
 	    help();
 	    break;
@@ -1962,17 +2520,37 @@ main(int argc, char *argv[])
     if (!server_setup(evbase))
 	sudo_fatalx("%s", U_("unable to setup listen socket"));
 
+    /* Monitor free space on the I/O log and relay volumes. */
+    if (!storage_monitor_init(evbase))
+	sudo_fatal(NULL);
+    if (!logsrvd_evstore_init(evbase))
+	sudo_fatal(NULL);
+    if (!iolog_dict_init(evbase))
+	sudo_fatal(NULL);
+
     register_signal(SIGHUP, evbase);
     register_signal(SIGINT, evbase);
     register_signal(SIGTERM, evbase);
     register_signal(SIGUSR1, evbase);
+    register_signal(SIGCHLD, evbase);
 
     /* Point of no return. */
     daemonize(nofork);
     signal(SIGPIPE, SIG_IGN);
 
+    /* Started after daemonize() so the helper is our child. */
+    if (!iolog_privsep_start())
+	sudo_warnx("%s", U_("unable to start I/O log owner helper"));
+
     logsrvd_queue_scan(evbase);
+    if (!logsrvd_resolve_init(evbase) || !logsrvd_standby_init(evbase))
+	sudo_fatal(NULL);
     sudo_ev_dispatch(evbase);
+    logsrvd_standby_close();
+    logsrvd_resolve_close();
+    logsrvd_eventlog_flush();
+    logsrvd_evstore_close();
+    iolog_privsep_stop();
     if (!nofork && logsrvd_conf_pid_file() != NULL)
 	unlink(logsrvd_conf_pid_file());
     logsrvd_conf_cleanup();
@@ -41,9 +41,71 @@
 /* Shutdown timeout (in seconds) in case client connections time out. */
 #define SHUTDOWN_TIMEO	10
 
+/* Maximum number of connections to accept per listener wakeup. */
+#define ACCEPT_BATCH_MAX	32
+
+/* How long (in seconds) to stop accepting when out of resources. */
+#define ACCEPT_PAUSE_TIMEO	1
+
+/* How often (in seconds) to check free space on the log volumes. */
+#define STORAGE_CHECK_INTERVAL	5
+
+/* How long to stop reading from a client when over a soft storage limit. */
+#define STORAGE_SOFT_DELAY_MSEC	100
+
+#ifndef HAVE_FDATASYNC
+# define fdatasync(_fd)	fsync(_fd)
+#endif
+
+/* Maximum number of relay hosts a connection is replicated to. */
+#define RELAY_REPLICAS_MAX	8
+
+/* Maximum number of parallel connection attempts for a single replica. */
+#define RELAY_ATTEMPTS_MAX	4
+
+/* Default delay (in milliseconds) before racing the next relay address. */
+#define RELAY_CONNECT_DELAY_MSEC	250
+
+/* Maximum number of warm standby relay connections. */
+#define RELAY_STANDBY_MAX	32
+
+/*
+ * Standby relay connections idle for longer (in seconds) are discarded.
+ * Must be less than the relay's server timeout (DEFAULT_SOCKET_TIMEOUT_SEC
+ * by default) so we replace the connection before the relay drops it.
+ */
+#define RELAY_STANDBY_IDLE_MAX	20
+
+/* Default interval (in seconds) between relay host name lookups. */
+#define RELAY_RESOLVE_INTERVAL	300
+
+/* Minimum time (in seconds) between lookups after a connection failure. */
+#define RELAY_RESOLVE_MIN	10
+
+/*
+ * Separates the per-relay "logid/relayhost" entries in the log ID
+ * passed to the client when a connection is replicated.
+ */
+#define RELAY_LOG_ID_SEP	';'
+
 /* Template for mkstemp(3) when creating temporary files. */
 #define RELAY_TEMPLATE	"relay.XXXXXXXX"
 
+/*
+ * Storage volumes we monitor and their health.
+ */
+enum storage_volume_id {
+    STORAGE_IOLOG_DIR,
+    STORAGE_RELAY_DIR,
+    STORAGE_NVOLUMES
+};
+
+enum storage_state {
+    STORAGE_OK,
+    STORAGE_SOFT,
+    STORAGE_HARD
+};
+
 /*
  * Connection status.
  * In the RUNNING state we expect I/O log buffers.
@@ -57,25 +119,65 @@ enum connection_status {
     FINISHED
 };
 
+/*
+ * A connection attempt to a single relay address.
+ * Attempts to different addresses may race each other, the first
+ * one to connect is used and the others are abandoned.
+ */
+struct relay_attempt {
+    struct relay_closure *relay_closure;
+    struct server_address *addr;
+    struct sudo_event *ev;
+    int sock;
+};
+
 /*
  * Per-connection relay state.
+ * A connection may be replicated to more than one relay host,
+ * each with its own socket and write queue.
  */
 struct relay_closure {
+    TAILQ_ENTRY(relay_closure) entries;
+    struct connection_closure *parent;
     struct server_address_list *relays;
     struct server_address *relay_addr;
+    struct server_address *relay_tried;	/* last address attempted */
+    struct relay_attempt attempts[RELAY_ATTEMPTS_MAX];
+    unsigned int nattempts;		/* attempts in progress */
     struct sudo_event *read_ev;
     struct sudo_event *write_ev;
-    struct sudo_event *connect_ev;
+    struct sudo_event *stagger_ev;
+    struct sudo_event *buffered_ev;
+    struct sudo_event *fault_read_ev;
+    struct sudo_event *fault_write_ev;
     struct connection_buffer read_buf;
     struct connection_buffer_list write_bufs;
     struct peer_info relay_name;
 #if defined(HAVE_OPENSSL)
     struct tls_client_closure tls_client;
 #endif
+    struct timespec commit_point;
+    char *log_id;			/* log ID assigned by the relay */
     int sock;
+    bool ready;
+    bool finished;
     bool read_instead_of_write;
     bool write_instead_of_read;
     bool temporary_write_event;
+    bool fault_read_resume;
+    bool fault_write_resume;
+};
+TAILQ_HEAD(relay_closure_list, relay_closure);
+
+/*
+ * I/O log file offsets at a commit point we sent, used to rewind a
+ * cached session to the client's resume point.  An offset of -1 means
+ * the stream cannot be rewound.
+ */
+#define RESUME_POINTS_MAX	4
+struct resume_point {
+    struct timespec elapsed_time;
+    off_t offsets[IOFD_MAX];
 };
 
 /*
@@ -83,9 +185,14 @@ struct relay_closure {
  */
 struct connection_closure {
     TAILQ_ENTRY(connection_closure) entries;
+    TAILQ_ENTRY(connection_closure) commit_entries;
     struct client_message_switch *cms;
-    struct relay_closure *relay_closure;
+    struct relay_closure *relay_closure;	/* primary relay */
+    struct relay_closure_list relay_closures;
+    struct timespec relay_commit;
     struct eventlog *evlog;
+    uint8_t *accept_buf;		/* packed AcceptMessage, if queued */
+    size_t accept_len;
     struct timespec elapsed_time;
     struct connection_buffer read_buf;
     struct connection_buffer_list write_bufs;
@@ -94,6 +201,8 @@ struct connection_closure {
     struct sudo_event *commit_ev;
     struct sudo_event *read_ev;
     struct sudo_event *write_ev;
+    struct sudo_event *throttle_ev;
+    struct source_limit *source;
 #if defined(HAVE_OPENSSL)
     struct sudo_event *ssl_accept_ev;
     SSL *ssl;
@@ -101,7 +210,19 @@ struct connection_closure {
     const char *errstr;
     FILE *journal;
     char *journal_path;
+#ifdef HAVE_ZLIB_H
+    gzFile journal_gz;
+#endif
+    struct mapped_file journal_map;
     struct iolog_file iolog_files[IOFD_MAX];
+    struct iolog_direct *iolog_direct[IOFD_MAX];
+    struct iolog_dedup *iolog_dedup[IOFD_MAX];
+    struct iolog_dict_writer *iolog_dict[IOFD_MAX];
+    struct iolog_digest *iolog_digest;
+    struct resume_point resume_points[RESUME_POINTS_MAX];
+    unsigned int nresume_points;
+    struct capture_file *capture;
+    struct session_trace *trace;
     int iolog_dir_fd;
     int sock;
     enum connection_status state;
@@ -109,6 +230,13 @@ struct connection_closure {
     bool tls;
     bool log_io;
     bool store_first;
+    bool commit_queued;
+    bool iolog_dir_synced;
+    bool journal_dir_synced;
+    bool journal_probed;
+    bool capture_disabled;
+    bool relays_ready;
+    bool log_id_sent;
     bool read_instead_of_write;
     bool write_instead_of_read;
     bool temporary_write_event;
@@ -181,13 +309,39 @@ struct outgoing_journal {
 TAILQ_HEAD(outgoing_journal_queue, outgoing_journal);
 
 /* iolog_writer.c */
-struct eventlog *evlog_new(TimeSpec *submit_time, InfoMessage **info_msgs, size_t infolen, struct connection_closure *closure);
+struct eventlog *evlog_new(TimeSpec *submit_time, InfoMessage **info_msgs, size_t infolen, const char *peeraddr);
 bool iolog_init(AcceptMessage *msg, struct connection_closure *closure);
 bool iolog_create(int iofd, struct connection_closure *closure);
+bool iolog_write_data(int iofd, const void *buf, size_t len, struct connection_closure *closure, const char **errstr);
+bool iolog_digest_restart(struct connection_closure *closure);
 void iolog_close_all(struct connection_closure *closure);
+bool iolog_sync_all(struct connection_closure *closure);
 bool iolog_rewrite(const struct timespec *target, struct connection_closure *closure);
 void update_elapsed_time(TimeSpec *delta, struct timespec *elapsed);
 
+/* iolog_direct.c */
+struct iolog_direct;
+bool iolog_direct_create(int iofd, struct connection_closure *closure);
+bool iolog_direct_flush(struct iolog_direct *d, bool sync);
+bool iolog_direct_flush_all(struct connection_closure *closure);
+
+/* iolog_dedup.c */
+struct iolog_dedup;
+bool iolog_dedup_create(int iofd, struct connection_closure *closure);
+bool iolog_dedup_flush(struct iolog_dedup *dd, bool sync);
+bool iolog_dedup_flush_all(struct connection_closure *closure);
+
+/* iolog_dict.c */
+struct iolog_dict_writer;
+bool iolog_dict_init(struct sudo_event_base *evbase);
+void iolog_dict_reload(void);
+void iolog_dict_reap(void);
+void iolog_dict_dump(void);
+bool iolog_dict_available(void);
+bool iolog_dict_create(int iofd, struct connection_closure *closure);
+bool iolog_dict_flush(struct iolog_dict_writer *w, bool sync);
+bool iolog_dict_flush_all(struct connection_closure *closure);
+
 /* logsrvd.c */
 extern struct client_message_switch cms_local;
 bool start_protocol(struct connection_closure *closure);
@@ -207,12 +361,37 @@ struct server_address_list *logsrvd_conf_relay_address(void);
 const char *logsrvd_conf_relay_dir(void);
 bool logsrvd_conf_relay_store_first(void);
 bool logsrvd_conf_relay_tcp_keepalive(void);
+bool logsrvd_conf_relay_tcp_fastopen(void);
+struct timespec *logsrvd_conf_relay_connect_delay(void);
+unsigned int logsrvd_conf_relay_standby(void);
+bool logsrvd_conf_relay_compress_journal(void);
 bool logsrvd_conf_server_tcp_keepalive(void);
+bool logsrvd_conf_server_tcp_fastopen(void);
 const char *logsrvd_conf_pid_file(void);
 struct timespec *logsrvd_conf_server_timeout(void);
+unsigned int logsrvd_conf_server_max_sessions(void);
+unsigned int logsrvd_conf_server_max_source_connections(void);
+unsigned int logsrvd_conf_server_source_rate(void);
+unsigned int logsrvd_conf_server_source_burst(void);
+unsigned int logsrvd_conf_server_source_prefix(int family);
+unsigned int logsrvd_conf_server_free_space_soft(void);
+unsigned int logsrvd_conf_server_free_space_hard(void);
+unsigned int logsrvd_conf_server_write_latency_max(void);
+bool logsrvd_conf_server_commit_sync(void);
+const char *logsrvd_conf_server_capture_dir(void);
+const char *logsrvd_conf_server_trace_file(void);
+bool logsrvd_conf_server_trace_sessions(void);
+struct timespec *logsrvd_conf_server_resume_timeout(void);
 struct timespec *logsrvd_conf_relay_connect_timeout(void);
 struct timespec *logsrvd_conf_relay_timeout(void);
 time_t logsrvd_conf_relay_retry_interval(void);
+time_t logsrvd_conf_relay_resolve_interval(void);
+void logsrvd_conf_relay_set_address(struct server_address_list *relays);
+unsigned int logsrvd_conf_relay_replicas(void);
+unsigned int logsrvd_conf_relay_commit_quorum(void);
+struct timespec *logsrvd_conf_eventlog_flush_interval(void);
+unsigned int logsrvd_conf_eventlog_max_pending(void);
+const char *logsrvd_conf_eventlog_store_dir(void);
 #if defined(HAVE_OPENSSL)
 bool logsrvd_conf_server_tls_check_peer(void);
 SSL_CTX *logsrvd_server_tls_ctx(void);
@@ -220,16 +399,38 @@ bool logsrvd_conf_relay_tls_check_peer(void);
 SSL_CTX *logsrvd_relay_tls_ctx(void);
 #endif
 mode_t logsrvd_conf_iolog_mode(void);
+bool logsrvd_conf_iolog_direct(void);
+const char *logsrvd_conf_iolog_chunk_store(void);
+const char *logsrvd_conf_iolog_dict_dir(void);
+time_t logsrvd_conf_iolog_dict_interval(void);
+bool logsrvd_conf_iolog_digest(void);
+off_t logsrvd_conf_iolog_extent_size(void);
 void address_list_addref(struct server_address_list *);
 void address_list_delref(struct server_address_list *);
+struct server_address_list *address_list_alloc(void);
+bool address_list_resolve(struct server_address_list *al, const char *str);
 void logsrvd_conf_cleanup(void);
 
 /* logsrvd_journal.c */
 extern struct client_message_switch cms_journal;
+bool journal_flush(struct connection_closure *closure);
+bool journal_sync(struct connection_closure *closure);
+ssize_t journal_read(struct connection_closure *closure, void *buf, size_t len);
+bool journal_mapped(struct connection_closure *closure);
+
+/* logsrvd_limits.c */
+struct source_limit *source_limit_acquire(const struct sockaddr *sa, const char **errstr);
+void source_limit_release(struct source_limit *src);
+bool source_limit_charge(struct source_limit *src, size_t nbytes, struct timespec *delay);
+void source_limit_dump(void);
 
 /* logsrvd_local.c */
 extern struct client_message_switch cms_local;
 bool set_random_drop(const char *dropstr);
+void logsrvd_eventlog_flush(void);
+void logsrvd_eventlog_reap(void);
+bool logsrvd_eventlog_backpressure(struct timespec *delay);
+void logsrvd_eventlog_dump(void);
 bool store_accept_local(AcceptMessage *msg, uint8_t *buf, size_t len, struct connection_closure *closure);
 bool store_reject_local(RejectMessage *msg, uint8_t *buf, size_t len, struct connection_closure *closure);
 bool store_exit_local(ExitMessage *msg, uint8_t *buf, size_t len, struct connection_closure *closure);
@@ -242,6 +443,9 @@ bool store_suspend_local(CommandSuspend *msg, uint8_t *buf, size_t len, struct c
 /* logsrvd_queue.c */
 bool logsrvd_queue_enable(time_t timeout, struct sudo_event_base *evbase);
 bool logsrvd_queue_insert(struct connection_closure *closure);
+bool logsrvd_queue_append(const char *journal_path);
+void logsrvd_queue_inflight(const char *journal_path);
+void logsrvd_queue_remove(const char *journal_path);
 bool logsrvd_queue_scan(struct sudo_event_base *evbase);
 void logsrvd_queue_dump(void);
 
@@ -250,5 +454,50 @@ extern struct client_message_switch cms_relay;
 void relay_closure_free(struct relay_closure *relay_closure);
 bool connect_relay(struct connection_closure *closure);
 bool relay_shutdown(struct connection_closure *closure);
+bool relay_host_in_use(struct relay_closure *relay_closure, struct server_address *relay);
+bool relay_format_addr(struct server_address *relay, char *buf, size_t bufsize);
+int relay_connect_start(struct server_address *relay, bool fastopen, bool *connected);
+
+/* logsrvd_resolve.c */
+bool logsrvd_resolve_init(struct sudo_event_base *evbase);
+void logsrvd_resolve_reload(void);
+void logsrvd_resolve_retry(void);
+void logsrvd_resolve_reap(void);
+void logsrvd_resolve_close(void);
+void logsrvd_resolve_dump(void);
+
+/* logsrvd_resume.c */
+bool resume_cache_stash(struct connection_closure *closure);
+bool resume_cache_restore(const char *log_id, const struct timespec *target, struct connection_closure *closure);
+void resume_cache_mark(struct connection_closure *closure);
+void resume_cache_flush(void);
+void resume_cache_dump(void);
+
+/* logsrvd_standby.c */
+bool logsrvd_standby_init(struct sudo_event_base *evbase);
+void logsrvd_standby_reload(void);
+bool logsrvd_standby_take(struct relay_closure *relay_closure);
+void logsrvd_standby_close(void);
+void logsrvd_standby_dump(void);
+
+/* logsrvd_trace.c */
+void trace_accept(AcceptMessage *msg, struct connection_closure *closure);
+uint8_t *trace_pack_accept(AcceptMessage *msg, struct connection_closure *closure, size_t *lenp);
+void trace_delay(TimeSpec *delay, bool iobuf, struct connection_closure *closure);
+unsigned long long trace_enqueue(struct connection_closure *closure);
+void trace_forwarded(struct connection_closure *closure, unsigned long long seq);
+void trace_unqueued(struct connection_closure *closure, unsigned long long seq);
+void trace_commit(TimeSpec *commit_point, struct connection_closure *closure);
+void trace_close(struct connection_closure *closure);
+void trace_reload(void);
+void trace_dump(void);
+
+/* logsrvd_storage.c */
+bool storage_monitor_init(struct sudo_event_base *evbase);
+bool storage_base_dir(const char *path, char *dir, size_t dirsize);
+void storage_record_write(enum storage_volume_id id, const struct timespec *start);
+enum storage_state storage_state(enum storage_volume_id id);
+bool storage_backpressure(enum storage_volume_id id, struct timespec *delay);
+void storage_dump(void);
 
 #endif /* SUDO_LOGSRVD_H */
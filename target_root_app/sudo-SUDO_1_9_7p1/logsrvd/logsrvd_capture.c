@@ -0,0 +1,259 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_event.h"
+#include "sudo_eventlog.h"
+#include "sudo_gettext.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrvd.h"
+#include "capture.h"
+
+/*
+ * An open capture file.  Record times are relative to the arrival
+ * of the first message so they are not affected by clock changes.
+ */
+struct capture_file {
+    FILE *fp;
+    struct timespec start;
+    unsigned long long messages;
+    char path[PATH_MAX];
+};
+
+static struct capture_stats {
+    unsigned long long files;
+    unsigned long long messages;
+    unsigned long long bytes;
+    unsigned long long errors;
+} capture_stats;
+
+static uint8_t *
+put_u32(uint8_t *cp, uint32_t val)
+{
+    *cp++ = (val >> 24) & 0xff;
+    *cp++ = (val >> 16) & 0xff;
+    *cp++ = (val >> 8) & 0xff;
+    *cp++ = val & 0xff;
+    return cp;
+}
+
+/*
+ * Create a new capture file for the connection and write the header.
+ * The file name includes the client address and connection time.
+ */
+static struct capture_file *
+capture_open(const char *capture_dir, const char *ipaddr,
+    const struct timespec *arrival)
+{
+    struct capture_file *cap;
+    uint8_t header[CAPTURE_HEADER_SIZE], *cp;
+    char stamp[sizeof("YYYYMMDDHHMMSS")];
+    struct timespec now;
+    struct tm tm;
+    int fd, len;
+    debug_decl(capture_open, SUDO_DEBUG_UTIL);
+
+    if ((cap = calloc(1, sizeof(*cap))) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	debug_return_ptr(NULL);
+    }
+    cap->start = *arrival;
+
+    if (sudo_gettime_real(&now) == -1 ||
+	    gmtime_r(&now.tv_sec, &tm) == NULL ||
+	    strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm) == 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to format current time");
+	goto bad;
+    }
+    len = snprintf(cap->path, sizeof(cap->path), "%s/%s-%s.XXXXXX%s",
+	capture_dir, stamp, ipaddr, CAPTURE_SUFFIX);
+    if (len >= ssizeof(cap->path)) {
+	errno = ENAMETOOLONG;
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "%s/%s-%s.XXXXXX%s", capture_dir, stamp, ipaddr, CAPTURE_SUFFIX);
+	goto bad;
+    }
+    if (!sudo_mkdir_parents(cap->path, ROOT_UID, ROOT_GID, S_IRWXU, false)) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create parent dir for %s", cap->path);
+	goto bad;
+    }
+    fd = mkstemps(cap->path, sizeof(CAPTURE_SUFFIX) - 1);
+    if (fd == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create capture file %s", cap->path);
+	goto bad;
+    }
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if ((cap->fp = fdopen(fd, "w")) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to fdopen capture file %s", cap->path);
+	close(fd);
+	unlink(cap->path);
+	goto bad;
+    }
+
+    cp = put_u32(header, CAPTURE_MAGIC);
+    cp = put_u32(cp, CAPTURE_VERSION);
+    cp = put_u32(cp, (uint32_t)((uint64_t)now.tv_sec >> 32));
+    cp = put_u32(cp, (uint32_t)now.tv_sec);
+    put_u32(cp, (uint32_t)now.tv_nsec);
+    if (fwrite(header, 1, sizeof(header), cap->fp) != sizeof(header)) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to write capture file %s", cap->path);
+	fclose(cap->fp);
+	unlink(cap->path);
+	goto bad;
+    }
+
+    sudo_debug_printf(SUDO_DEBUG_INFO, "%s: capturing %s to %s", __func__,
+	ipaddr, cap->path);
+    capture_stats.files++;
+    debug_return_ptr(cap);
+bad:
+    free(cap);
+    debug_return_ptr(NULL);
+}
+
+/*
+ * Append a framed ClientMessage (length prefix included) to the
+ * connection's capture file, creating it for the first message.
+ * Capturing is best effort; on error it is disabled for the connection
+ * and the client is not affected.
+ */
+void
+capture_message(struct connection_closure *closure,
+    const struct timespec *arrival, const uint8_t *buf, size_t len)
+{
+    struct capture_file *cap = closure->capture;
+    const char *capture_dir;
+    uint8_t record[CAPTURE_RECORD_SIZE], *cp;
+    struct timespec delta;
+    debug_decl(capture_message, SUDO_DEBUG_UTIL);
+
+    if (cap == NULL) {
+	if (closure->capture_disabled)
+	    debug_return;
+	if ((capture_dir = logsrvd_conf_server_capture_dir()) == NULL)
+	    debug_return;
+	cap = capture_open(capture_dir, closure->ipaddr, arrival);
+	if (cap == NULL) {
+	    closure->capture_disabled = true;
+	    capture_stats.errors++;
+	    debug_return;
+	}
+	closure->capture = cap;
+    }
+
+    sudo_timespecsub(arrival, &cap->start, &delta);
+    if (delta.tv_sec < 0)
+	sudo_timespecclear(&delta);
+    cp = put_u32(record, (uint32_t)delta.tv_sec);
+    put_u32(cp, (uint32_t)delta.tv_nsec);
+    if (fwrite(record, 1, sizeof(record), cap->fp) != sizeof(record) ||
+	    fwrite(buf, 1, len, cap->fp) != len) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to write capture file %s", cap->path);
+	capture_stats.errors++;
+	capture_close(closure);
+	closure->capture_disabled = true;
+	debug_return;
+    }
+    cap->messages++;
+    capture_stats.messages++;
+    capture_stats.bytes += sizeof(record) + len;
+
+    debug_return;
+}
+
+/*
+ * Flush and close the connection's capture file, if any.
+ */
+void
+capture_close(struct connection_closure *closure)
+{
+    struct capture_file *cap = closure->capture;
+    debug_decl(capture_close, SUDO_DEBUG_UTIL);
+
+    if (cap == NULL)
+	debug_return;
+
+    if (fclose(cap->fp) != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to write capture file %s", cap->path);
+	capture_stats.errors++;
+    } else {
+	sudo_debug_printf(SUDO_DEBUG_INFO, "%s: %s: %llu messages", __func__,
+	    cap->path, cap->messages);
+    }
+    free(cap);
+    closure->capture = NULL;
+
+    debug_return;
+}
+
+void
+capture_dump(void)
+{
+    debug_decl(capture_dump, SUDO_DEBUG_UTIL);
+
+    if (logsrvd_conf_server_capture_dir() == NULL && capture_stats.files == 0)
+	debug_return;
+
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"traffic capture %s: %llu files, %llu messages, %llu bytes, %llu errors",
+	logsrvd_conf_server_capture_dir() ? logsrvd_conf_server_capture_dir() :
+	"(disabled)", capture_stats.files, capture_stats.messages,
+	capture_stats.bytes, capture_stats.errors);
+
+    debug_return;
+}
@@ -57,6 +57,7 @@
 
 #include "log_server.pb-c.h"
 #include "logsrvd.h"
+#include "iolog_digest.h"
 
 #if defined(HAVE_OPENSSL)
 # define DEFAULT_CA_CERT_PATH       "/etc/ssl/sudo/cacert.pem"
@@ -99,10 +100,25 @@ struct address_list_container {
 
 static struct logsrvd_config {
     struct logsrvd_config_server {
-        struct address_list_container addresses;
+        struct server_address_list *addresses;
         struct timespec timeout;
         bool tcp_keepalive;
+	bool tcp_fastopen;
 	char *pid_file;
+	unsigned int max_sessions;
+	unsigned int max_source_connections;
+	unsigned int source_rate;
+	unsigned int source_burst;
+	unsigned int source_prefix4;
+	unsigned int source_prefix6;
+	unsigned int free_space_soft;
+	unsigned int free_space_hard;
+	unsigned int write_latency_max;
+	bool commit_sync;
+	char *capture_dir;
+	char *trace_file;
+	bool trace_sessions;
+	struct timespec resume_timeout;
 #if defined(HAVE_OPENSSL)
 	char *tls_key_path;
 	char *tls_cert_path;
@@ -116,13 +132,20 @@ static struct logsrvd_config {
 #endif
     } server;
     struct logsrvd_config_relay {
-        struct address_list_container relays;
+        struct server_address_list *relays;
         struct timespec connect_timeout;
+        struct timespec connect_delay;
         struct timespec timeout;
 	time_t retry_interval;
+	time_t resolve_interval;
 	char *relay_dir;
         bool tcp_keepalive;
+	bool tcp_fastopen;
+	unsigned int standby;
 	bool store_first;
+	bool compress_journal;
+	unsigned int replicas;
+	unsigned int commit_quorum;
 #if defined(HAVE_OPENSSL)
 	char *tls_key_path;
 	char *tls_cert_path;
@@ -138,17 +161,27 @@ static struct logsrvd_config {
     struct logsrvd_config_iolog {
 	bool compress;
 	bool flush;
+	bool direct;
+	bool digest;
 	bool gid_set;
+	off_t extent_size;
+	time_t dict_interval;
 	uid_t uid;
 	gid_t gid;
 	mode_t mode;
 	unsigned int maxseq;
 	char *iolog_dir;
 	char *iolog_file;
+	char *chunk_store;
+	char *dict_dir;
+	char *digest_key;
     } iolog;
     struct logsrvd_config_eventlog {
 	int log_type;
 	enum eventlog_format log_format;
+	struct timespec flush_interval;
+	unsigned int max_pending;
+	char *store_dir;
     } eventlog;
     struct logsrvd_config_syslog {
 	unsigned int maxlen;
@@ -183,11 +216,47 @@ logsrvd_conf_iolog_file(void)
     return logsrvd_config->iolog.iolog_file;
 }
 
+const char *
+logsrvd_conf_iolog_chunk_store(void)
+{
+    return logsrvd_config->iolog.chunk_store;
+}
+
+const char *
+logsrvd_conf_iolog_dict_dir(void)
+{
+    return logsrvd_config->iolog.dict_dir;
+}
+
+time_t
+logsrvd_conf_iolog_dict_interval(void)
+{
+    return logsrvd_config->iolog.dict_interval;
+}
+
+bool
+logsrvd_conf_iolog_direct(void)
+{
+    return logsrvd_config->iolog.direct;
+}
+
+bool
+logsrvd_conf_iolog_digest(void)
+{
+    return logsrvd_config->iolog.digest;
+}
+
+off_t
+logsrvd_conf_iolog_extent_size(void)
+{
+    return logsrvd_config->iolog.extent_size;
+}
+
 /* server getters */
 struct server_address_list *
 logsrvd_conf_server_listen_address(void)
 {
-    return &logsrvd_config->server.addresses.addrs;
+    return logsrvd_config->server.addresses;
 }
 
 bool
@@ -196,6 +265,12 @@ logsrvd_conf_server_tcp_keepalive(void)
     return logsrvd_config->server.tcp_keepalive;
 }
 
+bool
+logsrvd_conf_server_tcp_fastopen(void)
+{
+    return logsrvd_config->server.tcp_fastopen;
+}
+
 const char *
 logsrvd_conf_pid_file(void)
 {
@@ -212,6 +287,93 @@ logsrvd_conf_server_timeout(void)
     return NULL;
 }
 
+unsigned int
+logsrvd_conf_server_max_sessions(void)
+{
+    return logsrvd_config->server.max_sessions;
+}
+
+unsigned int
+logsrvd_conf_server_max_source_connections(void)
+{
+    return logsrvd_config->server.max_source_connections;
+}
+
+unsigned int
+logsrvd_conf_server_source_rate(void)
+{
+    return logsrvd_config->server.source_rate;
+}
+
+/* Burst size defaults to one second's worth of data. */
+unsigned int
+logsrvd_conf_server_source_burst(void)
+{
+    if (logsrvd_config->server.source_burst != 0)
+	return logsrvd_config->server.source_burst;
+    return logsrvd_config->server.source_rate;
+}
+
+unsigned int
+logsrvd_conf_server_source_prefix(int family)
+{
+    if (family == AF_INET)
+	return logsrvd_config->server.source_prefix4;
+    return logsrvd_config->server.source_prefix6;
+}
+
+unsigned int
+logsrvd_conf_server_free_space_soft(void)
+{
+    return logsrvd_config->server.free_space_soft;
+}
+
+unsigned int
+logsrvd_conf_server_free_space_hard(void)
+{
+    return logsrvd_config->server.free_space_hard;
+}
+
+unsigned int
+logsrvd_conf_server_write_latency_max(void)
+{
+    return logsrvd_config->server.write_latency_max;
+}
+
+bool
+logsrvd_conf_server_commit_sync(void)
+{
+    return logsrvd_config->server.commit_sync;
+}
+
+const char *
+logsrvd_conf_server_capture_dir(void)
+{
+    return logsrvd_config->server.capture_dir;
+}
+
+const char *
+logsrvd_conf_server_trace_file(void)
+{
+    return logsrvd_config->server.trace_file;
+}
+
+bool
+logsrvd_conf_server_trace_sessions(void)
+{
+    return logsrvd_config->server.trace_sessions;
+}
+
+struct timespec *
+logsrvd_conf_server_resume_timeout(void)
+{
+    if (sudo_timespecisset(&logsrvd_config->server.resume_timeout)) {
+	return &logsrvd_config->server.resume_timeout;
+    }
+
+    return NULL;
+}
+
 #if defined(HAVE_OPENSSL)
 SSL_CTX *
 logsrvd_server_tls_ctx(void)
@@ -230,7 +392,7 @@ logsrvd_conf_server_tls_check_peer(void)
 struct server_address_list *
 logsrvd_conf_relay_address(void)
 {
-    return &logsrvd_config->relay.relays.addrs;
+    return logsrvd_config->relay.relays;
 }
 
 const char *
@@ -251,6 +413,36 @@ logsrvd_conf_relay_tcp_keepalive(void)
     return logsrvd_config->relay.tcp_keepalive;
 }
 
+bool
+logsrvd_conf_relay_tcp_fastopen(void)
+{
+    return logsrvd_config->relay.tcp_fastopen;
+}
+
+/*
+ * Delay before racing another relay address while a connection
+ * attempt is still in progress.  Returns NULL if racing is disabled.
+ */
+struct timespec *
+logsrvd_conf_relay_connect_delay(void)
+{
+    if (sudo_timespecisset(&logsrvd_config->relay.connect_delay))
+	return &logsrvd_config->relay.connect_delay;
+    return NULL;
+}
+
+unsigned int
+logsrvd_conf_relay_standby(void)
+{
+    return logsrvd_config->relay.standby;
+}
+
+bool
+logsrvd_conf_relay_compress_journal(void)
+{
+    return logsrvd_config->relay.compress_journal;
+}
+
 struct timespec *
 logsrvd_conf_relay_timeout(void)
 {
@@ -277,6 +469,70 @@ logsrvd_conf_relay_retry_interval(void)
     return logsrvd_config->relay.retry_interval;
 }
 
+time_t
+logsrvd_conf_relay_resolve_interval(void)
+{
+    return logsrvd_config->relay.resolve_interval;
+}
+
+/*
+ * Replace the relay addresses with a re-resolved list.
+ * Takes ownership of the caller's reference to relays.  Connections
+ * still using the old list hold their own reference to it.
+ */
+void
+logsrvd_conf_relay_set_address(struct server_address_list *relays)
+{
+    debug_decl(logsrvd_conf_relay_set_address, SUDO_DEBUG_UTIL);
+
+    address_list_delref(logsrvd_config->relay.relays);
+    logsrvd_config->relay.relays = relays;
+
+    debug_return;
+}
+
+unsigned int
+logsrvd_conf_relay_replicas(void)
+{
+    return logsrvd_config->relay.replicas;
+}
+
+/*
+ * Number of relays that must acknowledge data before the commit
+ * point is passed back to the client.  Defaults to all replicas.
+ */
+unsigned int
+logsrvd_conf_relay_commit_quorum(void)
+{
+    const unsigned int quorum = logsrvd_config->relay.commit_quorum;
+
+    if (quorum == 0 || quorum > logsrvd_config->relay.replicas)
+	return logsrvd_config->relay.replicas;
+    return quorum;
+}
+
+struct timespec *
+logsrvd_conf_eventlog_flush_interval(void)
+{
+    if (sudo_timespecisset(&logsrvd_config->eventlog.flush_interval)) {
+	return &logsrvd_config->eventlog.flush_interval;
+    }
+
+    return NULL;
+}
+
+unsigned int
+logsrvd_conf_eventlog_max_pending(void)
+{
+    return logsrvd_config->eventlog.max_pending;
+}
+
+const char *
+logsrvd_conf_eventlog_store_dir(void)
+{
+    return logsrvd_config->eventlog.store_dir;
+}
+
 #if defined(HAVE_OPENSSL)
 SSL_CTX *
 logsrvd_relay_tls_ctx(void)
@@ -348,6 +604,150 @@ cb_iolog_flush(struct logsrvd_config *config, const char *str, size_t offset)
     debug_return_bool(true);
 }
 
+static bool
+cb_iolog_direct(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    int val;
+    debug_decl(cb_iolog_direct, SUDO_DEBUG_UTIL);
+
+    if ((val = sudo_strtobool(str)) == -1)
+	debug_return_bool(false);
+
+    config->iolog.direct = val;
+    debug_return_bool(true);
+}
+
+static bool
+cb_iolog_chunk_store(struct logsrvd_config *config, const char *path, size_t offset)
+{
+    debug_decl(cb_iolog_chunk_store, SUDO_DEBUG_UTIL);
+
+    if (*path != '/') {
+	debug_return_bool(false);
+    }
+    free(config->iolog.chunk_store);
+    if ((config->iolog.chunk_store = strdup(path)) == NULL) {
+	sudo_warn(NULL);
+	debug_return_bool(false);
+    }
+    debug_return_bool(true);
+}
+
+static bool
+cb_iolog_dict_dir(struct logsrvd_config *config, const char *path, size_t offset)
+{
+    debug_decl(cb_iolog_dict_dir, SUDO_DEBUG_UTIL);
+
+    if (*path != '/') {
+	debug_return_bool(false);
+    }
+    free(config->iolog.dict_dir);
+    if ((config->iolog.dict_dir = strdup(path)) == NULL) {
+	sudo_warn(NULL);
+	debug_return_bool(false);
+    }
+    debug_return_bool(true);
+}
+
+/*
+ * Interval in seconds between dictionary training runs, 0 to disable.
+ */
+static bool
+cb_iolog_dict_interval(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    int interval;
+    const char *errstr;
+    debug_decl(cb_iolog_dict_interval, SUDO_DEBUG_UTIL);
+
+    interval = sudo_strtonum(str, 0, 30 * 24 * 60 * 60, &errstr);
+    if (errstr != NULL)
+	debug_return_bool(false);
+
+    config->iolog.dict_interval = interval;
+
+    debug_return_bool(true);
+}
+
+static bool
+cb_iolog_digest(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    int val;
+    debug_decl(cb_iolog_digest, SUDO_DEBUG_UTIL);
+
+    if ((val = sudo_strtobool(str)) == -1)
+	debug_return_bool(false);
+
+    config->iolog.digest = val;
+    debug_return_bool(true);
+}
+
+/*
+ * Path to the secret used to key the I/O log digest chain.
+ * The key itself is read when the configuration is applied.
+ */
+static bool
+cb_iolog_digest_key(struct logsrvd_config *config, const char *path, size_t offset)
+{
+    debug_decl(cb_iolog_digest_key, SUDO_DEBUG_UTIL);
+
+    if (*path != '/') {
+	debug_return_bool(false);
+    }
+    free(config->iolog.digest_key);
+    if ((config->iolog.digest_key = strdup(path)) == NULL) {
+	sudo_warn(NULL);
+	debug_return_bool(false);
+    }
+    debug_return_bool(true);
+}
+
+/*
+ * Parse a preallocation size in bytes with an optional K, M or G suffix.
+ * A size of 0 disables preallocation.
+ */
+static bool
+cb_iolog_extent_size(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    const char *errstr;
+    long long mult = 1;
+    char *copy;
+    long long value;
+    size_t len = strlen(str);
+    debug_decl(cb_iolog_extent_size, SUDO_DEBUG_UTIL);
+
+    if (len == 0)
+	debug_return_bool(false);
+    switch (str[len - 1]) {
+    case 'g':
+    case 'G':
+	mult *= 1024;
+	FALLTHROUGH;
+    case 'm':
+    case 'M':
+	mult *= 1024;
+	FALLTHROUGH;
+    case 'k':
+    case 'K':
+	mult *= 1024;
+	len--;
+	break;
+    }
+    if ((copy = strndup(str, len)) == NULL) {
+	sudo_warn(NULL);
+	debug_return_bool(false);
+    }
+    value = sudo_strtonum(copy, 0, (1024LL * 1024 * 1024) / mult, &errstr);
+    free(copy);
+    if (errstr != NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "bad extent size: %s: %s", str, errstr);
+	debug_return_bool(false);
+    }
+    config->iolog.extent_size = (off_t)(value * mult);
+
+    debug_return_bool(true);
+}
+
 static bool
 cb_iolog_user(struct logsrvd_config *config, const char *user, size_t offset)
 {
@@ -421,15 +821,27 @@ cb_iolog_maxseq(struct logsrvd_config *config, const char *str, size_t offset)
     debug_return_bool(true);
 }
 
+/*
+ * Returns the first entry in res, or any of its successors, whose
+ * address family is (or, if same is false, is not) family.
+ */
+static struct addrinfo *
+next_family(struct addrinfo *res, int family, bool same)
+{
+    while (res != NULL && (res->ai_family == family) != same)
+	res = res->ai_next;
+    return res;
+}
+
 /* Server callbacks */
 static bool
 append_address(struct server_address_list *addresses, const char *str,
     bool allow_wildcard)
 {
-    struct addrinfo hints, *res, *res0 = NULL;
+    struct addrinfo hints, *res, *res0 = NULL, *pref, *other;
     char *sa_str = NULL, *sa_host = NULL;
     char *copy, *host, *port;
-    bool tls, ret = false;
+    bool tls, ret = false, turn = true;
     int error;
     debug_decl(append_address, SUDO_DEBUG_UTIL);
 
@@ -475,9 +887,26 @@ append_address(struct server_address_list *addresses, const char *str,
 	sudo_gai_warn(error, U_("%s:%s"), host ? host : "*", port);
 	goto done;
     }
-    for (res = res0; res != NULL; res = res->ai_next) {
+
+    /*
+     * Alternate between the preferred address family and the other one
+     * (RFC 8305, section 4) so that a relay connection does not have
+     * to wait for every address of one family to time out.
+     */
+    pref = res0;
+    other = next_family(res0, res0->ai_family, false);
+    while (pref != NULL || other != NULL) {
 	struct server_address *addr;
 
+	if ((turn && pref != NULL) || other == NULL) {
+	    res = pref;
+	    pref = next_family(pref->ai_next, res0->ai_family, true);
+	} else {
+	    res = other;
+	    other = next_family(other->ai_next, res0->ai_family, false);
+	}
+	turn = !turn;
+
 	if ((addr = malloc(sizeof(*addr))) == NULL) {
 	    sudo_warn(NULL);
 	    goto done;
@@ -504,7 +933,7 @@ done:
 static bool
 cb_server_listen_address(struct logsrvd_config *config, const char *str, size_t offset)
 {
-    return append_address(&config->server.addresses.addrs, str, true);
+    return append_address(config->server.addresses, str, true);
 }
 
 static bool
@@ -536,6 +965,32 @@ cb_server_keepalive(struct logsrvd_config *config, const char *str, size_t offse
     debug_return_bool(true);
 }
 
+static bool
+cb_server_fastopen(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    int val;
+    debug_decl(cb_server_fastopen, SUDO_DEBUG_UTIL);
+
+    if ((val = sudo_strtobool(str)) == -1)
+	debug_return_bool(false);
+
+    config->server.tcp_fastopen = val;
+    debug_return_bool(true);
+}
+
+static bool
+cb_server_commit_sync(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    int val;
+    debug_decl(cb_server_commit_sync, SUDO_DEBUG_UTIL);
+
+    if ((val = sudo_strtobool(str)) == -1)
+	debug_return_bool(false);
+
+    config->server.commit_sync = val;
+    debug_return_bool(true);
+}
+
 static bool
 cb_server_pid_file(struct logsrvd_config *config, const char *str, size_t offset)
 {
@@ -560,6 +1015,169 @@ cb_server_pid_file(struct logsrvd_config *config, const char *str, size_t offset
     debug_return_bool(true);
 }
 
+static bool
+cb_server_capture_dir(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    char *copy = NULL;
+    debug_decl(cb_server_capture_dir, SUDO_DEBUG_UTIL);
+
+    /* An empty value means to disable traffic capture. */
+    if (*str != '\0') {
+	if (*str != '/') {
+	    sudo_warnx(U_("%s: not a fully qualified path"), str);
+	    debug_return_bool(false);
+	}
+	if ((copy = strdup(str)) == NULL) {
+	    sudo_warn(NULL);
+	    debug_return_bool(false);
+	}
+    }
+
+    free(config->server.capture_dir);
+    config->server.capture_dir = copy;
+
+    debug_return_bool(true);
+}
+
+static bool
+cb_server_trace_file(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    char *copy = NULL;
+    debug_decl(cb_server_trace_file, SUDO_DEBUG_UTIL);
+
+    /* An empty value means to disable latency tracing. */
+    if (*str != '\0') {
+	if (*str != '/') {
+	    sudo_warnx(U_("%s: not a fully qualified path"), str);
+	    debug_return_bool(false);
+	}
+	if ((copy = strdup(str)) == NULL) {
+	    sudo_warn(NULL);
+	    debug_return_bool(false);
+	}
+    }
+
+    free(config->server.trace_file);
+    config->server.trace_file = copy;
+
+    debug_return_bool(true);
+}
+
+static bool
+cb_server_trace_sessions(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    int val;
+    debug_decl(cb_server_trace_sessions, SUDO_DEBUG_UTIL);
+
+    if ((val = sudo_strtobool(str)) == -1)
+	debug_return_bool(false);
+
+    config->server.trace_sessions = val;
+    debug_return_bool(true);
+}
+
+/*
+ * Number of seconds to keep the state of a dropped I/O log session
+ * open for a quick restart, 0 disables the resume cache.
+ */
+static bool
+cb_server_resume_timeout(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    int timeout;
+    const char* errstr;
+    debug_decl(cb_server_resume_timeout, SUDO_DEBUG_UTIL);
+
+    timeout = sudo_strtonum(str, 0, 3600, &errstr);
+    if (errstr != NULL)
+	debug_return_bool(false);
+
+    config->server.resume_timeout.tv_sec = timeout;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Parse an unsigned integer limit where 0 means unlimited.
+ * The offset is the location of the unsigned int in struct logsrvd_config.
+ */
+static bool
+cb_server_limit(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    unsigned int *p = (unsigned int *)((char *)config + offset);
+    unsigned int value;
+    const char *errstr;
+    debug_decl(cb_server_limit, SUDO_DEBUG_UTIL);
+
+    value = sudo_strtonum(str, 0, UINT_MAX, &errstr);
+    if (errstr != NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "bad limit: %s: %s", str, errstr);
+	debug_return_bool(false);
+    }
+    *p = value;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Parse a free space percentage where 0 disables the check.
+ * The offset is the location of the unsigned int in struct logsrvd_config.
+ */
+static bool
+cb_server_free_space(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    unsigned int *p = (unsigned int *)((char *)config + offset);
+    unsigned int value;
+    const char *errstr;
+    debug_decl(cb_server_free_space, SUDO_DEBUG_UTIL);
+
+    value = sudo_strtonum(str, 0, 100, &errstr);
+    if (errstr != NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "bad free space percentage: %s: %s", str, errstr);
+	debug_return_bool(false);
+    }
+    *p = value;
+
+    debug_return_bool(true);
+}
+
+static bool
+cb_server_source_prefix4(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    unsigned int value;
+    const char *errstr;
+    debug_decl(cb_server_source_prefix4, SUDO_DEBUG_UTIL);
+
+    value = sudo_strtonum(str, 0, 32, &errstr);
+    if (errstr != NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "bad IPv4 prefix length: %s: %s", str, errstr);
+	debug_return_bool(false);
+    }
+    config->server.source_prefix4 = value;
+
+    debug_return_bool(true);
+}
+
+static bool
+cb_server_source_prefix6(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    unsigned int value;
+    const char *errstr;
+    debug_decl(cb_server_source_prefix6, SUDO_DEBUG_UTIL);
+
+    value = sudo_strtonum(str, 0, 128, &errstr);
+    if (errstr != NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "bad IPv6 prefix length: %s: %s", str, errstr);
+	debug_return_bool(false);
+    }
+    config->server.source_prefix6 = value;
+
+    debug_return_bool(true);
+}
+
 #if defined(HAVE_OPENSSL)
 static bool
 cb_tls_key(struct logsrvd_config *config, const char *path, size_t offset)
@@ -678,7 +1296,7 @@ cb_tls_checkpeer(struct logsrvd_config *config, const char *str, size_t offset)
 static bool
 cb_relay_host(struct logsrvd_config *config, const char *str, size_t offset)
 {
-    return append_address(&config->relay.relays.addrs, str, false);
+    return append_address(config->relay.relays, str, false);
 }
 
 static bool
@@ -713,6 +1331,29 @@ cb_relay_connect_timeout(struct logsrvd_config *config, const char *str, size_t
     debug_return_bool(true);
 }
 
+/*
+ * Delay in milliseconds before a connection attempt to the next relay
+ * address is started in parallel; 0 tries one address at a time.
+ */
+static bool
+cb_relay_connect_delay(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    unsigned int msec;
+    const char *errstr;
+    debug_decl(cb_relay_connect_delay, SUDO_DEBUG_UTIL);
+
+    msec = sudo_strtonum(str, 0, 60000, &errstr);
+    if (errstr != NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "bad relay connect delay: %s: %s", str, errstr);
+	debug_return_bool(false);
+    }
+    config->relay.connect_delay.tv_sec = msec / 1000;
+    config->relay.connect_delay.tv_nsec = (msec % 1000) * 1000000;
+
+    debug_return_bool(true);
+}
+
 static bool
 cb_relay_dir(struct logsrvd_config *config, const char *str, size_t offset)
 {
@@ -756,6 +1397,104 @@ cb_relay_keepalive(struct logsrvd_config *config, const char *str, size_t offset
     debug_return_bool(true);
 }
 
+static bool
+cb_relay_fastopen(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    int val;
+    debug_decl(cb_relay_fastopen, SUDO_DEBUG_UTIL);
+
+    if ((val = sudo_strtobool(str)) == -1)
+	debug_return_bool(false);
+
+    config->relay.tcp_fastopen = val;
+    debug_return_bool(true);
+}
+
+static bool
+cb_relay_standby(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    unsigned int value;
+    const char *errstr;
+    debug_decl(cb_relay_standby, SUDO_DEBUG_UTIL);
+
+    value = sudo_strtonum(str, 0, RELAY_STANDBY_MAX, &errstr);
+    if (errstr != NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "bad number of standby relay connections: %s: %s", str, errstr);
+	debug_return_bool(false);
+    }
+    config->relay.standby = value;
+
+    debug_return_bool(true);
+}
+
+static bool
+cb_relay_resolve_interval(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    const char *errstr;
+    time_t interval;
+    debug_decl(cb_relay_resolve_interval, SUDO_DEBUG_UTIL);
+
+    interval = sudo_strtonum(str, 0, 24 * 60 * 60, &errstr);
+    if (errstr != NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "bad relay resolve interval: %s: %s", str, errstr);
+	debug_return_bool(false);
+    }
+    config->relay.resolve_interval = interval;
+
+    debug_return_bool(true);
+}
+
+static bool
+cb_relay_compress_journal(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    int val;
+    debug_decl(cb_relay_compress_journal, SUDO_DEBUG_UTIL);
+
+    if ((val = sudo_strtobool(str)) == -1)
+	debug_return_bool(false);
+
+    config->relay.compress_journal = val;
+    debug_return_bool(true);
+}
+
+static bool
+cb_relay_replicas(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    unsigned int value;
+    const char *errstr;
+    debug_decl(cb_relay_replicas, SUDO_DEBUG_UTIL);
+
+    value = sudo_strtonum(str, 1, RELAY_REPLICAS_MAX, &errstr);
+    if (errstr != NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "bad number of relay replicas: %s: %s", str, errstr);
+	debug_return_bool(false);
+    }
+    config->relay.replicas = value;
+
+    debug_return_bool(true);
+}
+
+static bool
+cb_relay_commit_quorum(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    unsigned int value;
+    const char *errstr;
+    debug_decl(cb_relay_commit_quorum, SUDO_DEBUG_UTIL);
+
+    value = sudo_strtonum(str, 0, RELAY_REPLICAS_MAX, &errstr);
+    if (errstr != NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "bad relay commit quorum: %s: %s", str, errstr);
+	debug_return_bool(false);
+    }
+    config->relay.commit_quorum = value;
+
+    debug_return_bool(true);
+}
+
 /* eventlog callbacks */
 static bool
 cb_eventlog_type(struct logsrvd_config *config, const char *str, size_t offset)
@@ -789,6 +1528,54 @@ cb_eventlog_format(struct logsrvd_config *config, const char *str, size_t offset
     debug_return_bool(true);
 }
 
+static bool
+cb_eventlog_flush_interval(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    int interval;
+    const char* errstr;
+    debug_decl(cb_eventlog_flush_interval, SUDO_DEBUG_UTIL);
+
+    interval = sudo_strtonum(str, 0, 3600, &errstr);
+    if (errstr != NULL)
+	debug_return_bool(false);
+
+    config->eventlog.flush_interval.tv_sec = interval;
+
+    debug_return_bool(true);
+}
+
+static bool
+cb_eventlog_max_pending(struct logsrvd_config *config, const char *str, size_t offset)
+{
+    unsigned int value;
+    const char *errstr;
+    debug_decl(cb_eventlog_max_pending, SUDO_DEBUG_UTIL);
+
+    value = sudo_strtonum(str, 1, UINT_MAX, &errstr);
+    if (errstr != NULL)
+	debug_return_bool(false);
+
+    config->eventlog.max_pending = value;
+
+    debug_return_bool(true);
+}
+
+static bool
+cb_eventlog_store_dir(struct logsrvd_config *config, const char *path, size_t offset)
+{
+    debug_decl(cb_eventlog_store_dir, SUDO_DEBUG_UTIL);
+
+    if (*path != '/') {
+	debug_return_bool(false);
+    }
+    free(config->eventlog.store_dir);
+    if ((config->eventlog.store_dir = strdup(path)) == NULL) {
+	sudo_warn(NULL);
+	debug_return_bool(false);
+    }
+    debug_return_bool(true);
+}
+
 /* syslog callbacks */
 static bool
 cb_syslog_maxlen(struct logsrvd_config *config, const char *str, size_t offset)
@@ -932,14 +1719,55 @@ address_list_delref(struct server_address_list *al)
 	    sudo_rcstr_delref(addr->sa_host);
 	    free(addr);
 	}
+	free(container);
     }
 }
 
+/*
+ * Returns a new, empty address list with a reference count of 1.
+ */
+struct server_address_list *
+address_list_alloc(void)
+{
+    struct address_list_container *container;
+
+    if ((container = malloc(sizeof(*container))) == NULL)
+	return NULL;
+    container->refcnt = 1;
+    TAILQ_INIT(&container->addrs);
+    return &container->addrs;
+}
+
+/*
+ * Resolve a relay_host setting, appending its addresses to the list.
+ * Used to refresh the relay addresses after the config has been read.
+ */
+bool
+address_list_resolve(struct server_address_list *al, const char *str)
+{
+    return append_address(al, str, false);
+}
+
 static struct logsrvd_config_entry server_conf_entries[] = {
     { "listen_address", cb_server_listen_address },
     { "timeout", cb_server_timeout },
     { "tcp_keepalive", cb_server_keepalive },
+    { "tcp_fastopen", cb_server_fastopen },
     { "pid_file", cb_server_pid_file },
+    { "commit_sync", cb_server_commit_sync },
+    { "max_sessions", cb_server_limit, offsetof(struct logsrvd_config, server.max_sessions) },
+    { "max_connections_per_source", cb_server_limit, offsetof(struct logsrvd_config, server.max_source_connections) },
+    { "source_rate_limit", cb_server_limit, offsetof(struct logsrvd_config, server.source_rate) },
+    { "source_rate_burst", cb_server_limit, offsetof(struct logsrvd_config, server.source_burst) },
+    { "source_prefix_ipv4", cb_server_source_prefix4 },
+    { "source_prefix_ipv6", cb_server_source_prefix6 },
+    { "free_space_soft", cb_server_free_space, offsetof(struct logsrvd_config, server.free_space_soft) },
+    { "free_space_hard", cb_server_free_space, offsetof(struct logsrvd_config, server.free_space_hard) },
+    { "max_write_latency", cb_server_limit, offsetof(struct logsrvd_config, server.write_latency_max) },
+    { "capture_dir", cb_server_capture_dir },
+    { "trace_file", cb_server_trace_file },
+    { "trace_sessions", cb_server_trace_sessions },
+    { "resume_timeout", cb_server_resume_timeout },
 #if defined(HAVE_OPENSSL)
     { "tls_key", cb_tls_key, offsetof(struct logsrvd_config, server.tls_key_path) },
     { "tls_cacert", cb_tls_cacert, offsetof(struct logsrvd_config, server.tls_cacert_path) },
@@ -957,9 +1785,16 @@ static struct logsrvd_config_entry relay_conf_entries[] = {
     { "relay_host", cb_relay_host },
     { "timeout", cb_relay_timeout },
     { "connect_timeout", cb_relay_connect_timeout },
+    { "connect_delay", cb_relay_connect_delay },
     { "relay_dir", cb_relay_dir },
     { "store_first", cb_relay_store_first },
+    { "compress_journal", cb_relay_compress_journal },
+    { "replicas", cb_relay_replicas },
+    { "commit_quorum", cb_relay_commit_quorum },
     { "tcp_keepalive", cb_relay_keepalive },
+    { "tcp_fastopen", cb_relay_fastopen },
+    { "standby_connections", cb_relay_standby },
+    { "resolve_interval", cb_relay_resolve_interval },
 #if defined(HAVE_OPENSSL)
     { "tls_key", cb_tls_key, offsetof(struct logsrvd_config, relay.tls_key_path) },
     { "tls_cacert", cb_tls_cacert, offsetof(struct logsrvd_config, relay.tls_cacert_path) },
@@ -978,6 +1813,13 @@ static struct logsrvd_config_entry iolog_conf_entries[] = {
     { "iolog_file", cb_iolog_file },
     { "iolog_flush", cb_iolog_flush },
     { "iolog_compress", cb_iolog_compress },
+    { "iolog_direct", cb_iolog_direct },
+    { "iolog_extent_size", cb_iolog_extent_size },
+    { "iolog_digest", cb_iolog_digest },
+    { "iolog_digest_key", cb_iolog_digest_key },
+    { "iolog_chunk_store", cb_iolog_chunk_store },
+    { "iolog_dict_dir", cb_iolog_dict_dir },
+    { "iolog_dict_interval", cb_iolog_dict_interval },
     { "iolog_user", cb_iolog_user },
     { "iolog_group", cb_iolog_group },
     { "iolog_mode", cb_iolog_mode },
@@ -988,6 +1830,9 @@ static struct logsrvd_config_entry iolog_conf_entries[] = {
 static struct logsrvd_config_entry eventlog_conf_entries[] = {
     { "log_type", cb_eventlog_type },
     { "log_format", cb_eventlog_format },
+    { "flush_interval", cb_eventlog_flush_interval },
+    { "max_pending", cb_eventlog_max_pending },
+    { "store_dir", cb_eventlog_store_dir },
     { NULL }
 };
 
@@ -1170,8 +2015,11 @@ logsrvd_conf_free(struct logsrvd_config *config)
 	debug_return;
 
     /* struct logsrvd_config_server */
-    address_list_delref(&config->server.addresses.addrs);
+    if (config->server.addresses != NULL)
+	address_list_delref(config->server.addresses);
     free(config->server.pid_file);
+    free(config->server.capture_dir);
+    free(config->server.trace_file);
 #if defined(HAVE_OPENSSL)
     free(config->server.tls_key_path);
     free(config->server.tls_cert_path);
@@ -1185,7 +2033,8 @@ logsrvd_conf_free(struct logsrvd_config *config)
 #endif
 
     /* struct logsrvd_config_relay */
-    address_list_delref(&config->relay.relays.addrs);
+    if (config->relay.relays != NULL)
+	address_list_delref(config->relay.relays);
     free(config->relay.relay_dir);
 #if defined(HAVE_OPENSSL)
     free(config->relay.tls_key_path);
@@ -1202,6 +2051,12 @@ logsrvd_conf_free(struct logsrvd_config *config)
     /* struct logsrvd_config_iolog */
     free(config->iolog.iolog_dir);
     free(config->iolog.iolog_file);
+    free(config->iolog.chunk_store);
+    free(config->iolog.dict_dir);
+    free(config->iolog.digest_key);
+
+    /* struct logsrvd_config_eventlog */
+    free(config->eventlog.store_dir);
 
     /* struct logsrvd_config_logfile */
     free(config->logfile.path);
@@ -1227,12 +2082,17 @@ logsrvd_conf_alloc(void)
     }
 
     /* Relay defaults */
-    TAILQ_INIT(&config->relay.relays.addrs);
-    config->relay.relays.refcnt = 1;
+    if ((config->relay.relays = address_list_alloc()) == NULL) {
+	sudo_warn(NULL);
+	goto bad;
+    }
     config->relay.timeout.tv_sec = DEFAULT_SOCKET_TIMEOUT_SEC;
     config->relay.connect_timeout.tv_sec = DEFAULT_SOCKET_TIMEOUT_SEC;
+    config->relay.connect_delay.tv_nsec = RELAY_CONNECT_DELAY_MSEC * 1000000;
     config->relay.tcp_keepalive = true;
     config->relay.retry_interval = 30;
+    config->relay.resolve_interval = RELAY_RESOLVE_INTERVAL;
+    config->relay.replicas = 1;
     if (!cb_relay_dir(config, _PATH_SUDO_RELAY_DIR, 0))
 	goto bad;
 #if defined(HAVE_OPENSSL)
@@ -1241,10 +2101,14 @@ logsrvd_conf_alloc(void)
 #endif
 
     /* Server defaults */
-    TAILQ_INIT(&config->server.addresses.addrs);
-    config->server.addresses.refcnt = 1;
+    if ((config->server.addresses = address_list_alloc()) == NULL) {
+	sudo_warn(NULL);
+	goto bad;
+    }
     config->server.timeout.tv_sec = DEFAULT_SOCKET_TIMEOUT_SEC;
     config->server.tcp_keepalive = true;
+    config->server.source_prefix4 = 32;
+    config->server.source_prefix6 = 128;
     config->server.pid_file = strdup(_PATH_SUDO_LOGSRVD_PID);
     if (config->server.pid_file == NULL) {
 	sudo_warn(NULL);
@@ -1282,6 +2146,9 @@ logsrvd_conf_alloc(void)
     /* I/O log defaults */
     config->iolog.compress = false;
     config->iolog.flush = true;
+    config->iolog.direct = false;
+    config->iolog.extent_size = 1024 * 1024;
+    config->iolog.dict_interval = 24 * 60 * 60;
     config->iolog.mode = S_IRUSR|S_IWUSR;
     config->iolog.maxseq = SESSID_MAX;
     if (!cb_iolog_dir(config, _PATH_SUDO_IO_LOGDIR, 0))
@@ -1295,6 +2162,7 @@ logsrvd_conf_alloc(void)
     /* Event log defaults */
     config->eventlog.log_type = EVLOG_SYSLOG;
     config->eventlog.log_format = EVLOG_SUDO;
+    config->eventlog.max_pending = 1024;
 
     /* Syslog defaults */
     config->syslog.maxlen = 960;
@@ -1336,7 +2204,7 @@ logsrvd_conf_apply(struct logsrvd_config *config)
     debug_decl(logsrvd_conf_apply, SUDO_DEBUG_UTIL);
 
     /* There can be multiple addresses so we can't set a default earlier. */
-    if (TAILQ_EMPTY(&config->server.addresses.addrs)) {
+    if (TAILQ_EMPTY(config->server.addresses)) {
 	/* Enable plaintext listender. */
 	if (!cb_server_listen_address(config, "*:" DEFAULT_PORT, 0))
 	    debug_return_bool(false);
@@ -1348,7 +2216,7 @@ logsrvd_conf_apply(struct logsrvd_config *config)
 	}
     } else {
 	/* Check that TLS configuration is valid. */
-	TAILQ_FOREACH(addr, &config->server.addresses.addrs, entries) {
+	TAILQ_FOREACH(addr, config->server.addresses, entries) {
 	    if (!addr->tls)
 		continue;
 	    /*
@@ -1369,7 +2237,7 @@ logsrvd_conf_apply(struct logsrvd_config *config)
     }
 
 #if defined(HAVE_OPENSSL)
-    TAILQ_FOREACH(addr, &config->server.addresses.addrs, entries) {
+    TAILQ_FOREACH(addr, config->server.addresses, entries) {
 	if (!addr->tls)
 	    continue;
         /* Create a TLS context for the server. */
@@ -1386,7 +2254,7 @@ logsrvd_conf_apply(struct logsrvd_config *config)
     }
 
     if (TLS_CONFIGURED(config->relay)) {
-	TAILQ_FOREACH(addr, &config->relay.relays.addrs, entries) {
+	TAILQ_FOREACH(addr, config->relay.relays, entries) {
 	    if (!addr->tls)
 		continue;
 	    /* Create a TLS context for the relay. */
@@ -1408,7 +2276,7 @@ logsrvd_conf_apply(struct logsrvd_config *config)
 #endif /* HAVE_OPENSSL */
 
     /* Clear store_first if not relaying. */
-    if (TAILQ_EMPTY(&config->relay.relays.addrs))
+    if (TAILQ_EMPTY(config->relay.relays))
 	config->relay.store_first = false;
 
     /* Open event log if specified. */
@@ -1429,6 +2297,10 @@ logsrvd_conf_apply(struct logsrvd_config *config)
 	break;
     }
 
+    /* A digest key that cannot be read leaves the old settings intact. */
+    if (!iolog_digest_set_key(config->iolog.digest_key))
+	debug_return_bool(false);
+
     /* Set I/O log library settings */
     iolog_set_defaults();
     iolog_set_compress(config->iolog.compress);
@@ -0,0 +1,282 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_event.h"
+#include "sudo_eventlog.h"
+#include "sudo_gettext.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrvd.h"
+#include "evstore.h"
+
+/*
+ * Events are buffered in a block until it is full, the day changes
+ * or the flush timer fires, then appended to that day's file.
+ */
+struct evstore_state {
+    struct evstore_block *block;
+    struct sudo_event_base *evbase;
+    struct sudo_event *flush_ev;
+    time_t day;			/* UTC day of the buffered events */
+    time_t fd_day;		/* UTC day of the open file */
+    int fd;
+    unsigned long long rows;
+    unsigned long long blocks;
+    unsigned long long errors;
+};
+
+static struct evstore_state evstore = { NULL, NULL, NULL, -1, -1, -1 };
+
+/*
+ * Open the event store file for the specified day.
+ */
+static bool
+evstore_open(time_t day)
+{
+    char path[PATH_MAX], name[sizeof("YYYYMMDD")];
+    const char *store_dir = logsrvd_conf_eventlog_store_dir();
+    struct tm tm;
+    int len;
+    debug_decl(evstore_open, SUDO_DEBUG_UTIL);
+
+    if (evstore.fd != -1 && evstore.fd_day == day)
+	debug_return_bool(true);
+    if (evstore.fd != -1) {
+	close(evstore.fd);
+	evstore.fd = -1;
+    }
+
+    if (gmtime_r(&day, &tm) == NULL ||
+	    strftime(name, sizeof(name), "%Y%m%d", &tm) == 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to format date %lld", (long long)day);
+	debug_return_bool(false);
+    }
+    len = snprintf(path, sizeof(path), "%s/%s%s", store_dir, name,
+	EVSTORE_SUFFIX);
+    if (len >= ssizeof(path)) {
+	errno = ENAMETOOLONG;
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "%s/%s%s", store_dir, name, EVSTORE_SUFFIX);
+	debug_return_bool(false);
+    }
+    if (!sudo_mkdir_parents(path, ROOT_UID, ROOT_GID,
+	    S_IRWXU|S_IXGRP|S_IXOTH, false)) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create parent dir for %s", path);
+	debug_return_bool(false);
+    }
+    /* Opened for reading too so a block torn by a crash can be trimmed. */
+    evstore.fd = open(path, O_RDWR|O_APPEND|O_CREAT, S_IRUSR|S_IWUSR);
+    if (evstore.fd == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s", path);
+	debug_return_bool(false);
+    }
+    (void)fcntl(evstore.fd, F_SETFD, FD_CLOEXEC);
+    if (!evstore_trim(evstore.fd)) {
+	close(evstore.fd);
+	evstore.fd = -1;
+	debug_return_bool(false);
+    }
+    evstore.fd_day = day;
+
+    debug_return_bool(true);
+}
+
+#define EVSTORE_FLUSH_INTERVAL	30
+
+/*
+ * Write buffered events to the event store.
+ */
+void
+logsrvd_evstore_flush(void)
+{
+    debug_decl(logsrvd_evstore_flush, SUDO_DEBUG_UTIL);
+
+    if (evstore.block == NULL || evstore_block_rows(evstore.block) == 0)
+	debug_return;
+
+    if (evstore.flush_ev != NULL)
+	sudo_ev_del(NULL, evstore.flush_ev);
+    if (!evstore_open(evstore.day) ||
+	    !evstore_block_write(evstore.block, evstore.fd)) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "discarding %u events", evstore_block_rows(evstore.block));
+	evstore.errors++;
+	evstore_block_free(evstore.block);
+	evstore.block = NULL;
+	debug_return;
+    }
+    evstore.blocks++;
+
+    debug_return;
+}
+
+/*
+ * Write buffered events and close the event store file.
+ * Used before the configuration is reloaded and at exit.
+ */
+void
+logsrvd_evstore_close(void)
+{
+    debug_decl(logsrvd_evstore_close, SUDO_DEBUG_UTIL);
+
+    logsrvd_evstore_flush();
+    if (evstore.fd != -1) {
+	close(evstore.fd);
+	evstore.fd = -1;
+    }
+
+    debug_return;
+}
+
+static void
+evstore_flush_cb(int unused, int what, void *v)
+{
+    logsrvd_evstore_flush();
+}
+
+/*
+ * Allocate the flush timer.
+ */
+bool
+logsrvd_evstore_init(struct sudo_event_base *evbase)
+{
+    debug_decl(logsrvd_evstore_init, SUDO_DEBUG_UTIL);
+
+    if (evstore.flush_ev == NULL) {
+	evstore.flush_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT,
+	    evstore_flush_cb, NULL);
+	if (evstore.flush_ev == NULL)
+	    debug_return_bool(false);
+    }
+    evstore.evbase = evbase;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Add an accept, reject or alert event to the event store, if enabled.
+ * Errors are logged but otherwise ignored; the event log is the
+ * authoritative record.
+ */
+void
+logsrvd_evstore_add(enum evstore_type type, const struct eventlog *evlog,
+    const char *reason, const struct timespec *event_time)
+{
+    struct evstore_event event;
+    time_t day;
+    debug_decl(logsrvd_evstore_add, SUDO_DEBUG_UTIL);
+
+    if (logsrvd_conf_eventlog_store_dir() == NULL)
+	debug_return;
+
+    /* Events are partitioned by UTC day. */
+    day = event_time->tv_sec - (event_time->tv_sec % (24 * 60 * 60));
+    if (evstore.block != NULL && evstore_block_rows(evstore.block) != 0 &&
+	    day != evstore.day) {
+	logsrvd_evstore_flush();
+    }
+    if (evstore.block == NULL) {
+	if ((evstore.block = evstore_block_alloc()) == NULL) {
+	    evstore.errors++;
+	    debug_return;
+	}
+    }
+    evstore.day = day;
+
+    memset(&event, 0, sizeof(event));
+    event.event_time = *event_time;
+    event.type = type;
+    if (evlog != NULL) {
+	event.strings[EVSTORE_COL_USER] = evlog->submituser;
+	event.strings[EVSTORE_COL_HOST] = evlog->submithost;
+	event.strings[EVSTORE_COL_RUNUSER] = evlog->runuser;
+	event.strings[EVSTORE_COL_COMMAND] = evlog->command;
+    }
+    event.strings[EVSTORE_COL_REASON] = reason;
+    if (!evstore_block_add(evstore.block, &event)) {
+	evstore.errors++;
+	debug_return;
+    }
+    evstore.rows++;
+
+    if (evstore_block_rows(evstore.block) == EVSTORE_BLOCK_ROWS) {
+	logsrvd_evstore_flush();
+    } else if (evstore_block_rows(evstore.block) == 1 &&
+	    evstore.flush_ev != NULL) {
+	struct timespec tv = { EVSTORE_FLUSH_INTERVAL, 0 };
+
+	if (sudo_ev_add(evstore.evbase, evstore.flush_ev, &tv,
+		false) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to add event store flush event");
+	}
+    }
+
+    debug_return;
+}
+
+/*
+ * Dump event store stats in response to SIGUSR1.
+ */
+void
+logsrvd_evstore_dump(void)
+{
+    debug_decl(logsrvd_evstore_dump, SUDO_DEBUG_UTIL);
+
+    if (logsrvd_conf_eventlog_store_dir() == NULL)
+	debug_return;
+
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"event store %s: %llu events, %llu blocks, %llu errors, %u buffered",
+	logsrvd_conf_eventlog_store_dir(), evstore.rows, evstore.blocks,
+	evstore.errors, evstore.block ? evstore_block_rows(evstore.block) : 0);
+
+    debug_return;
+}
@@ -55,6 +55,29 @@
 
 #include "log_server.pb-c.h"
 #include "logsrvd.h"
+#include "iolog_fault.h"
+
+static bool journal_write(uint8_t *buf, size_t len,
+    struct connection_closure *closure);
+
+#ifdef HAVE_ZLIB_H
+/*
+ * Compressed journals are gzip streams, which start with the gzip magic.
+ * An uncompressed journal starts with a 32-bit message length in network
+ * byte order which is always less than MESSAGE_SIZE_MAX so the first
+ * byte is always zero.
+ */
+static bool
+journal_compressed(int fd)
+{
+    unsigned char magic[2];
+    debug_decl(journal_compressed, SUDO_DEBUG_UTIL);
+
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+	debug_return_bool(false);
+    debug_return_bool(magic[0] == 0x1f && magic[1] == 0x8b);
+}
+#endif /* HAVE_ZLIB_H */
 
 /*
  * Helper function to set closure->journal and closure->journal_path.
@@ -142,6 +165,21 @@ journal_create(struct connection_closure *closure)
 	closure->errstr = _("unable to allocate memory");
 	debug_return_bool(false);
     }
+#ifdef HAVE_ZLIB_H
+    if (logsrvd_conf_relay_compress_journal()) {
+	/* The stream is flushed at each commit point, see journal_flush(). */
+	int gzfd = dup(fd);
+	if (gzfd == -1 || (closure->journal_gz = gzdopen(gzfd, "w")) == NULL) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to gzdopen journal file %s", journal_path);
+	    if (gzfd != -1)
+		close(gzfd);
+	    unlink(journal_path);
+	    closure->errstr = _("unable to create journal file");
+	    debug_return_bool(false);
+	}
+    }
+#endif
 
     debug_return_bool(true);
 }
@@ -159,6 +197,19 @@ journal_finish(struct connection_closure *closure)
     int fd;
     debug_decl(journal_finish, SUDO_DEBUG_UTIL);
 
+#ifdef HAVE_ZLIB_H
+    if (closure->journal_gz != NULL) {
+	int error = gzclose(closure->journal_gz);
+	closure->journal_gz = NULL;
+	if (error != Z_OK) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to close compressed journal %s: %d",
+		closure->journal_path, error);
+	    closure->errstr = _("unable to write journal file");
+	    debug_return_bool(false);
+	}
+    }
+#endif
     if (fflush(closure->journal) != 0) {
 	closure->errstr = _("unable to write journal file");
 	debug_return_bool(false);
@@ -172,6 +223,11 @@ journal_finish(struct connection_closure *closure)
 	debug_return_bool(false);
     }
     close(fd);
+    if (!logsrvd_queue_append(outgoing_path)) {
+	closure->errstr = _("unable to write journal file");
+	unlink(outgoing_path);
+	debug_return_bool(false);
+    }
     if (rename(closure->journal_path, outgoing_path) == -1) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
 	    "unable to rename %s -> %s", closure->journal_path, outgoing_path);
@@ -203,13 +259,16 @@ journal_finish(struct connection_closure *closure)
 
 /*
  * Seek ahead in the journal to the specified target time.
+ * If copy is set, each message read is also written to closure->journal.
  * Returns true if we reached the target time exactly, else false.
  */
 static bool
-journal_seek(struct timespec *target, struct connection_closure *closure)
+journal_seek(struct timespec *target, struct iolog_file *src, bool copy,
+    struct connection_closure *closure)
 {
     ClientMessage *msg = NULL;
-    size_t nread, bufsize = 0;
+    size_t bufsize = 0;
+    ssize_t nread;
     uint8_t *buf = NULL;
     uint32_t msg_len;
     bool ret = false;
@@ -219,11 +278,11 @@ journal_seek(struct timespec *target, struct connection_closure *closure)
 	TimeSpec *delay = NULL;
 
 	/* Read message size (uint32_t in network byte order). */
-	nread = fread(&msg_len, sizeof(msg_len), 1, closure->journal);
-	if (nread != 1) {
+	nread = iolog_read(src, &msg_len, sizeof(msg_len), NULL);
+	if (nread != sizeof(msg_len)) {
 	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 		"unable to read message length from %s", closure->journal_path);
-	    if (feof(closure->journal))
+	    if (iolog_eof(src))
 		closure->errstr = _("unexpected EOF reading journal file");
 	    else
 		closure->errstr = _("error reading journal file");
@@ -252,11 +311,11 @@ journal_seek(struct timespec *target, struct connection_closure *closure)
 		}
 	    }
 
-	    nread = fread(buf, msg_len, 1, closure->journal);
-	    if (nread != 1) {
+	    nread = iolog_read(src, buf, msg_len, NULL);
+	    if (nread != (ssize_t)msg_len) {
 		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 		    "unable to read message from %s", closure->journal_path);
-		if (feof(closure->journal))
+		if (iolog_eof(src))
 		    closure->errstr = _("unexpected EOF reading journal file");
 		else
 		    closure->errstr = _("error reading journal file");
@@ -272,6 +331,8 @@ journal_seek(struct timespec *target, struct connection_closure *closure)
 	    closure->errstr = _("invalid journal file, unable to restart");
 	    break;
 	}
+	if (copy && !journal_write(buf, msg_len, closure))
+	    break;
 
 	switch (msg->type_case) {
 	case CLIENT_MESSAGE__TYPE_HELLO_MSG:
@@ -384,8 +445,10 @@ static bool
 journal_restart(RestartMessage *msg, uint8_t *buf, size_t buflen,
     struct connection_closure *closure)
 {
+    struct iolog_file src = { true };
     struct timespec target;
     int fd, len;
+    bool ret = false;
     char *cp, journal_path[PATH_MAX];
     debug_decl(journal_restart, SUDO_DEBUG_UTIL);
 
@@ -411,6 +474,53 @@ journal_restart(RestartMessage *msg, uint8_t *buf, size_t buflen,
 	closure->errstr = _("unable to create journal file");
         debug_return_bool(false);
     }
+    target.tv_sec = msg->resume_point->tv_sec;
+    target.tv_nsec = msg->resume_point->tv_nsec;
+
+#ifdef HAVE_ZLIB_H
+    if (journal_compressed(fd)) {
+	/*
+	 * We cannot truncate a compressed stream at the resume point.
+	 * Instead, copy the journal up to the resume point into a new
+	 * file and rename it over the original, which is the log ID.
+	 */
+	src.compressed = true;
+	if ((src.fd.g = gzdopen(fd, "r")) == NULL) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to gzdopen journal file %s", journal_path);
+	    close(fd);
+	    closure->errstr = _("unable to allocate memory");
+	    debug_return_bool(false);
+	}
+	if (!journal_create(closure))
+	    goto done;
+	if (!journal_seek(&target, &src, true, closure)) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to seek to [%lld, %ld] in journal file %s",
+		(long long)target.tv_sec, target.tv_nsec, journal_path);
+	    unlink(closure->journal_path);
+	    goto done;
+	}
+	if (rename(closure->journal_path, journal_path) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to rename %s -> %s", closure->journal_path,
+		journal_path);
+	    unlink(closure->journal_path);
+	    closure->errstr = _("unable to rename journal file");
+	    goto done;
+	}
+	free(closure->journal_path);
+	if ((closure->journal_path = strdup(journal_path)) == NULL) {
+	    closure->errstr = _("unable to allocate memory");
+	    goto done;
+	}
+	ret = true;
+done:
+	gzclose(src.fd.g);
+	debug_return_bool(ret);
+    }
+#endif /* HAVE_ZLIB_H */
+
     if (!journal_fdopen(fd, journal_path, closure)) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
 	    "unable to fdopen journal file %s", journal_path);
@@ -420,16 +530,15 @@ journal_restart(RestartMessage *msg, uint8_t *buf, size_t buflen,
     }
 
     /* Seek forward to resume point. */
-    target.tv_sec = msg->resume_point->tv_sec;
-    target.tv_nsec = msg->resume_point->tv_nsec;
-    if (!journal_seek(&target, closure)) {
+    src.fd.f = closure->journal;
+    ret = journal_seek(&target, &src, false, closure);
+    if (!ret) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
 	    "unable to seek to [%lld, %ld] in journal file %s",
 	    (long long)target.tv_sec, target.tv_nsec, journal_path);
-	debug_return_bool(false);
     }
 
-    debug_return_bool(true);
+    debug_return_bool(ret);
 }
 
 static bool
@@ -438,9 +547,29 @@ journal_write(uint8_t *buf, size_t len, struct connection_closure *closure)
     uint32_t msg_len;
     debug_decl(journal_write, SUDO_DEBUG_UTIL);
 
+    /* Test mode: no short writes, they would corrupt the journal. */
+    if (iolog_fault_enabled) {
+	if (iolog_fault_inject(IOLOG_FAULT_WRITE, NULL) == -1) {
+	    closure->errstr = _("unable to write journal file");
+	    debug_return_bool(false);
+	}
+    }
+
     /* 32-bit message length in network byte order. */
     msg_len = htonl((uint32_t)len);
-    if (fwrite(&msg_len, 1, sizeof(msg_len), closure->journal) != sizeof(msg_len)) {
+#ifdef HAVE_ZLIB_H
+    if (closure->journal_gz != NULL) {
+	if (gzwrite(closure->journal_gz, &msg_len, sizeof(msg_len)) !=
+		sizeof(msg_len) || (len != 0 &&
+		gzwrite(closure->journal_gz, buf, len) != (int)len)) {
+	    closure->errstr = _("unable to write journal file");
+	    debug_return_bool(false);
+	}
+	debug_return_bool(true);
+    }
+#endif
+    if (fwrite(&msg_len, 1, sizeof(msg_len), closure->journal) !=
+	    sizeof(msg_len)) {
 	closure->errstr = _("unable to write journal file");
 	debug_return_bool(false);
     }
@@ -452,6 +581,144 @@ journal_write(uint8_t *buf, size_t len, struct connection_closure *closure)
     debug_return_bool(true);
 }
 
+/*
+ * Flush buffered journal data to the kernel.
+ * For compressed journals, this is a full flush point in the stream,
+ * everything written so far can be decompressed after a crash.
+ */
+bool
+journal_flush(struct connection_closure *closure)
+{
+    debug_decl(journal_flush, SUDO_DEBUG_UTIL);
+
+#ifdef HAVE_ZLIB_H
+    if (closure->journal_gz != NULL) {
+	if (gzflush(closure->journal_gz, Z_SYNC_FLUSH) != Z_OK) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to flush %s", closure->journal_path);
+	    debug_return_bool(false);
+	}
+	debug_return_bool(true);
+    }
+#endif
+    if (fflush(closure->journal) != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to flush %s", closure->journal_path);
+	debug_return_bool(false);
+    }
+    debug_return_bool(true);
+}
+
+/*
+ * Flush the journal and write it to stable storage.
+ */
+bool
+journal_sync(struct connection_closure *closure)
+{
+    debug_decl(journal_sync, SUDO_DEBUG_UTIL);
+
+    if (iolog_fault_enabled) {
+	if (iolog_fault_inject(IOLOG_FAULT_FLUSH, NULL) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to sync %s", closure->journal_path);
+	    debug_return_bool(false);
+	}
+    }
+
+    if (!journal_flush(closure) ||
+	    fdatasync(fileno(closure->journal)) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to sync %s", closure->journal_path);
+	debug_return_bool(false);
+    }
+
+    /* The new journal's directory entry must be durable too. */
+    if (!closure->journal_dir_synced) {
+	if (!sync_parent_dir(closure->journal_path))
+	    debug_return_bool(false);
+	closure->journal_dir_synced = true;
+    }
+    debug_return_bool(true);
+}
+
+/*
+ * Check whether a journal being relayed is compressed and, if not,
+ * try to map it so messages can be parsed in place.
+ */
+static bool
+journal_probe(struct connection_closure *closure)
+{
+    int fd = fileno(closure->journal);
+    off_t pos;
+    debug_decl(journal_probe, SUDO_DEBUG_UTIL);
+
+#ifdef HAVE_ZLIB_H
+    if (journal_compressed(fd)) {
+	int gzfd = dup(fd);
+	if (gzfd == -1 || (closure->journal_gz = gzdopen(gzfd, "r")) == NULL) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to gzdopen journal file %s", closure->journal_path);
+	    if (gzfd != -1)
+		close(gzfd);
+	    debug_return_bool(false);
+	}
+	closure->journal_probed = true;
+	debug_return_bool(true);
+    }
+#endif
+    /* If the journal cannot be mapped we fall back on read(2). */
+    if ((pos = lseek(fd, 0, SEEK_CUR)) != -1)
+	(void)mapped_file_open(&closure->journal_map, fd, pos);
+    closure->journal_probed = true;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Returns true if the journal being relayed is mapped, in which
+ * case messages are framed in place from closure->journal_map.
+ */
+bool
+journal_mapped(struct connection_closure *closure)
+{
+    debug_decl(journal_mapped, SUDO_DEBUG_UTIL);
+
+    if (!closure->journal_probed && !journal_probe(closure))
+	debug_return_bool(false);
+    debug_return_bool(closure->journal_map.base != NULL);
+}
+
+/*
+ * Read the next chunk of a journal being relayed.
+ * Compressed journals are detected on the first read.
+ */
+ssize_t
+journal_read(struct connection_closure *closure, void *buf, size_t len)
+{
+    int fd = fileno(closure->journal);
+    debug_decl(journal_read, SUDO_DEBUG_UTIL);
+
+    if (!closure->journal_probed && !journal_probe(closure))
+	debug_return_ssize_t(-1);
+#ifdef HAVE_ZLIB_H
+    if (closure->journal_gz != NULL) {
+	int nread, errnum;
+
+	if (len > UINT_MAX)
+	    len = UINT_MAX;
+	if ((nread = gzread(closure->journal_gz, buf, len)) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to read %s: %s", closure->journal_path,
+		gzerror(closure->journal_gz, &errnum));
+	    if (errnum != Z_ERRNO)
+		errno = EIO;
+	}
+	debug_return_ssize_t(nread);
+    }
+#endif
+    debug_return_ssize_t(read(fd, buf, len));
+}
+
 /*
  * Store an AcceptMessage from the client in the journal.
  */
@@ -461,6 +728,12 @@ journal_accept(AcceptMessage *msg, uint8_t *buf, size_t len,
 {
     debug_decl(journal_accept, SUDO_DEBUG_UTIL);
 
+    if (msg->expect_iobufs &&
+	    storage_state(STORAGE_RELAY_DIR) == STORAGE_HARD) {
+	closure->errstr = _("insufficient disk space, try again later");
+	debug_return_bool(false);
+    }
+
     /* Store message in a journal for later relaying. */
     if (!journal_create(closure))
 	debug_return_bool(false);
@@ -0,0 +1,324 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <limits.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NEED_INET_NTOP		/* to expose sudo_inet_ntop in sudo_compat.h */
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_event.h"
+#include "sudo_eventlog.h"
+#include "sudo_gettext.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrvd.h"
+
+/*
+ * Per-source connection and byte rate accounting.
+ * A source is a client address masked to the configured prefix length.
+ */
+struct source_limit {
+    TAILQ_ENTRY(source_limit) entries;
+    union sockaddr_union addr;
+    unsigned int prefix;
+    unsigned int nconns;
+    long long tokens;
+    struct timespec last_fill;
+    unsigned long long bytes;
+    unsigned long long throttled;
+    char addrstr[INET6_ADDRSTRLEN];
+};
+TAILQ_HEAD(source_limit_list, source_limit);
+
+static struct source_limit_list sources = TAILQ_HEAD_INITIALIZER(sources);
+
+static struct limit_stats {
+    unsigned int active_sessions;
+    unsigned long long rejected_sessions;
+    unsigned long long rejected_source;
+    unsigned long long throttled;
+} limit_stats;
+
+/*
+ * Clear all address bits past the first prefix bits.
+ */
+static void
+mask_addr(unsigned char *addr, size_t len, unsigned int prefix)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	if (prefix >= 8) {
+	    prefix -= 8;
+	} else {
+	    addr[i] &= (unsigned char)(0xff << (8 - prefix));
+	    prefix = 0;
+	}
+    }
+}
+
+/*
+ * Fill in the masked source address for sa.
+ * Returns false if the address family is not supported.
+ */
+static bool
+source_addr(const struct sockaddr *sa, union sockaddr_union *addr,
+    unsigned int *prefix)
+{
+    debug_decl(source_addr, SUDO_DEBUG_UTIL);
+
+    memset(addr, 0, sizeof(*addr));
+    switch (sa->sa_family) {
+    case AF_INET:
+	addr->sin.sin_family = AF_INET;
+	memcpy(&addr->sin.sin_addr, &((struct sockaddr_in *)sa)->sin_addr,
+	    sizeof(addr->sin.sin_addr));
+	*prefix = logsrvd_conf_server_source_prefix(AF_INET);
+	mask_addr((unsigned char *)&addr->sin.sin_addr,
+	    sizeof(addr->sin.sin_addr), *prefix);
+	break;
+#if defined(HAVE_STRUCT_IN6_ADDR)
+    case AF_INET6:
+	addr->sin6.sin6_family = AF_INET6;
+	memcpy(&addr->sin6.sin6_addr, &((struct sockaddr_in6 *)sa)->sin6_addr,
+	    sizeof(addr->sin6.sin6_addr));
+	*prefix = logsrvd_conf_server_source_prefix(AF_INET6);
+	mask_addr((unsigned char *)&addr->sin6.sin6_addr,
+	    sizeof(addr->sin6.sin6_addr), *prefix);
+	break;
+#endif /* HAVE_STRUCT_IN6_ADDR */
+    default:
+	debug_return_bool(false);
+    }
+    debug_return_bool(true);
+}
+
+static bool
+source_addr_equal(const union sockaddr_union *a, const union sockaddr_union *b)
+{
+    if (a->sa.sa_family != b->sa.sa_family)
+	return false;
+    switch (a->sa.sa_family) {
+    case AF_INET:
+	return memcmp(&a->sin.sin_addr, &b->sin.sin_addr,
+	    sizeof(a->sin.sin_addr)) == 0;
+#if defined(HAVE_STRUCT_IN6_ADDR)
+    case AF_INET6:
+	return memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr,
+	    sizeof(a->sin6.sin6_addr)) == 0;
+#endif /* HAVE_STRUCT_IN6_ADDR */
+    default:
+	return false;
+    }
+}
+
+/*
+ * Admit a new client connection from sa, subject to the global session
+ * limit and the per-source connection limit.
+ * Returns a reference to the source's accounting state on success.
+ * Returns NULL and sets errstr if the connection should be rejected.
+ */
+struct source_limit *
+source_limit_acquire(const struct sockaddr *sa, const char **errstr)
+{
+    unsigned int max_sessions = logsrvd_conf_server_max_sessions();
+    unsigned int max_conns = logsrvd_conf_server_max_source_connections();
+    union sockaddr_union addr;
+    struct source_limit *src;
+    unsigned int prefix;
+    debug_decl(source_limit_acquire, SUDO_DEBUG_UTIL);
+
+    if (max_sessions != 0 && limit_stats.active_sessions >= max_sessions) {
+	limit_stats.rejected_sessions++;
+	*errstr = "too many active sessions";
+	debug_return_ptr(NULL);
+    }
+    if (!source_addr(sa, &addr, &prefix)) {
+	*errstr = "unsupported address family";
+	debug_return_ptr(NULL);
+    }
+
+    TAILQ_FOREACH(src, &sources, entries) {
+	if (src->prefix == prefix && source_addr_equal(&src->addr, &addr))
+	    break;
+    }
+    if (src == NULL) {
+	if ((src = calloc(1, sizeof(*src))) == NULL) {
+	    *errstr = "unable to allocate memory";
+	    debug_return_ptr(NULL);
+	}
+	src->addr = addr;
+	src->prefix = prefix;
+	src->tokens = logsrvd_conf_server_source_burst();
+	sudo_gettime_mono(&src->last_fill);
+	if (addr.sa.sa_family == AF_INET) {
+	    inet_ntop(AF_INET, &addr.sin.sin_addr, src->addrstr,
+		sizeof(src->addrstr));
+#if defined(HAVE_STRUCT_IN6_ADDR)
+	} else {
+	    inet_ntop(AF_INET6, &addr.sin6.sin6_addr, src->addrstr,
+		sizeof(src->addrstr));
+#endif
+	}
+	TAILQ_INSERT_TAIL(&sources, src, entries);
+    } else if (max_conns != 0 && src->nconns >= max_conns) {
+	limit_stats.rejected_source++;
+	*errstr = "too many connections from client address";
+	debug_return_ptr(NULL);
+    }
+
+    src->nconns++;
+    limit_stats.active_sessions++;
+
+    debug_return_ptr(src);
+}
+
+/*
+ * Drop a reference to the source accounting state, freeing it
+ * when there are no more connections from that source.
+ */
+void
+source_limit_release(struct source_limit *src)
+{
+    debug_decl(source_limit_release, SUDO_DEBUG_UTIL);
+
+    if (src == NULL)
+	debug_return;
+
+    limit_stats.active_sessions--;
+    if (--src->nconns == 0) {
+	TAILQ_REMOVE(&sources, src, entries);
+	free(src);
+    }
+
+    debug_return;
+}
+
+/*
+ * Charge nbytes read from the client against the source's token bucket.
+ * The bucket is allowed to go negative since we only know how much
+ * was read after the fact.  Returns false if the source is over its
+ * byte rate, in which case delay is set to how long to stop reading.
+ */
+bool
+source_limit_charge(struct source_limit *src, size_t nbytes,
+    struct timespec *delay)
+{
+    const unsigned int rate = logsrvd_conf_server_source_rate();
+    const unsigned int burst = logsrvd_conf_server_source_burst();
+    struct timespec now, elapsed, used;
+    long long deficit, partial;
+    debug_decl(source_limit_charge, SUDO_DEBUG_UTIL);
+
+    src->bytes += nbytes;
+    if (rate == 0)
+	debug_return_bool(true);
+
+    /*
+     * Refill the bucket based on elapsed time since the last refill.
+     * Only the time that added whole tokens is used up, the remainder
+     * counts towards the next refill.
+     */
+    sudo_gettime_mono(&now);
+    sudo_timespecsub(&now, &src->last_fill, &elapsed);
+    partial = (long long)elapsed.tv_nsec * rate / 1000000000;
+    src->tokens += (long long)elapsed.tv_sec * rate + partial;
+    if (src->tokens >= burst) {
+	src->tokens = burst;
+	src->last_fill = now;
+    } else {
+	used.tv_sec = elapsed.tv_sec;
+	used.tv_nsec = (partial * 1000000000 + rate - 1) / rate;
+	sudo_timespecadd(&src->last_fill, &used, &src->last_fill);
+    }
+
+    src->tokens -= (long long)nbytes;
+    if (src->tokens >= 0)
+	debug_return_bool(true);
+
+    /* Over the limit, wait until the bucket is no longer in debt. */
+    deficit = -src->tokens;
+    delay->tv_sec = deficit / rate;
+    delay->tv_nsec = (deficit % rate) * 1000000000 / rate;
+    src->throttled++;
+    limit_stats.throttled++;
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"%s/%u over byte rate, pausing reads for [%lld, %ld]",
+	src->addrstr, src->prefix, (long long)delay->tv_sec,
+	delay->tv_nsec);
+
+    debug_return_bool(false);
+}
+
+/*
+ * Dump admission control and rate limit state to the debug file.
+ */
+void
+source_limit_dump(void)
+{
+    struct source_limit *src;
+    debug_decl(source_limit_dump, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"active sessions: %u (max %u)", limit_stats.active_sessions,
+	logsrvd_conf_server_max_sessions());
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"rejected: %llu (session limit), %llu (source limit), throttled: %llu",
+	limit_stats.rejected_sessions, limit_stats.rejected_source,
+	limit_stats.throttled);
+
+    if (TAILQ_EMPTY(&sources))
+	debug_return;
+
+    sudo_debug_printf(SUDO_DEBUG_INFO, "client sources:");
+    TAILQ_FOREACH(src, &sources, entries) {
+	sudo_debug_printf(SUDO_DEBUG_INFO,
+	    "  %s/%u: %u connection(s), %llu bytes, throttled %llu, tokens %lld",
+	    src->addrstr, src->prefix, src->nconns, src->bytes,
+	    src->throttled, src->tokens);
+    }
+
+    debug_return;
+}
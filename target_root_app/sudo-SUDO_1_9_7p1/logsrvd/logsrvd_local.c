@@ -20,6 +20,7 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -28,6 +29,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
 #ifdef HAVE_STDBOOL_H
 # include <stdbool.h>
 #else
@@ -52,17 +54,94 @@
 #include "sudo_gettext.h"
 #include "sudo_json.h"
 #include "sudo_iolog.h"
+#include "sudo_queue.h"
 #include "sudo_rand.h"
 #include "sudo_util.h"
 
 #include "log_server.pb-c.h"
 #include "logsrvd.h"
+#include "evstore.h"
+#include "iolog_digest.h"
 
 struct logsrvd_info_closure {
     InfoMessage **info_msgs;
     size_t infolen;
 };
 
+/*
+ * When the eventlog flush_interval is set, accept, reject and alert
+ * events are queued and written from a timer instead of when the
+ * message is received, so a slow syslogd or log file does not delay
+ * the client.  We keep a copy of the packed ClientMessage and
+ * re-create the event log entry when the queue is flushed.
+ *
+ * The queue is written by a long-lived child process (the sink), fed
+ * through a non-blocking pipe, so the event loop is not blocked while
+ * entries are written.  While max_pending or more entries are queued,
+ * clients are not read from, see logsrvd_eventlog_backpressure().
+ * lib/eventlog formats and writes one entry per call, so each entry
+ * is still a separate syslog(3) call or log file write.
+ *
+ * The client has already been told the event was logged by the time
+ * the sink runs, so a queued event that cannot be written is not
+ * reported to the client.  It is only counted in the stats and logged
+ * to the debug file.
+ */
+struct evlog_record {
+    TAILQ_ENTRY(evlog_record) entries;
+    uint8_t *buf;
+    size_t len;
+    uint8_t *accept_buf;	/* session's AcceptMessage, for alerts */
+    size_t accept_len;
+    char *iolog_path;
+    size_t iolog_file_off;
+    char sessid[sizeof(((struct eventlog *)0)->sessid)];
+    char peeraddr[INET6_ADDRSTRLEN];
+};
+TAILQ_HEAD(evlog_record_list, evlog_record);
+
+static struct evlog_record_list evlog_queue =
+    TAILQ_HEAD_INITIALIZER(evlog_queue);
+static unsigned int evlog_queue_len;
+static struct sudo_event *evlog_flush_ev;
+static struct evlog_queue_stats {
+    unsigned long long queued;
+    unsigned long long written;
+    unsigned long long errors;
+    unsigned long long batches;
+} evlog_stats;
+
+/* The sink exits with the number of entries it could not write. */
+#define EVLOG_SINK_ERRORS_MAX	254
+
+/* How long (in milliseconds) to stop reading while the queue is full. */
+#define EVLOG_BACKPRESSURE_MSEC	100
+
+/*
+ * A queued entry is sent to the sink as this header followed by the
+ * packed ClientMessage, the NUL-terminated I/O log path, if any, and
+ * the session's packed AcceptMessage, if any.
+ */
+struct evlog_sink_hdr {
+    size_t len;
+    size_t path_len;
+    size_t accept_len;
+    size_t iolog_file_off;
+    char sessid[sizeof(((struct eventlog *)0)->sessid)];
+    char peeraddr[INET6_ADDRSTRLEN];
+};
+
+static struct evlog_sink {
+    pid_t child;
+    int fd;			/* pipe to child, -1 if not running */
+    struct sudo_event *write_ev;
+    struct sudo_event_base *evbase;
+    uint8_t *buf;		/* entry being sent to child */
+    size_t len;
+    size_t off;
+    unsigned int nrecords;	/* entries sent to child */
+} evlog_sink = { -1, -1 };
+
 static double random_drop;
 
 bool
@@ -131,6 +210,712 @@ bad:
     debug_return_bool(false);
 }
 
+/*
+ * Re-create the event log details of the session a queued alert
+ * without info messages belongs to.  They come from a copy of the
+ * session's AcceptMessage or, for a restarted session, from the
+ * I/O log info file.
+ */
+static struct eventlog *
+evlog_record_session(struct evlog_record *rec)
+{
+    struct eventlog *evlog;
+    ClientMessage *msg;
+    debug_decl(evlog_record_session, SUDO_DEBUG_UTIL);
+
+    if (rec->accept_buf != NULL) {
+	msg = client_message__unpack(NULL, rec->accept_len, rec->accept_buf);
+	if (msg == NULL ||
+		msg->type_case != CLIENT_MESSAGE__TYPE_ACCEPT_MSG) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to unpack AcceptMessage size %zu", rec->accept_len);
+	    if (msg != NULL)
+		client_message__free_unpacked(msg, NULL);
+	    debug_return_ptr(NULL);
+	}
+	evlog = evlog_new(msg->u.accept_msg->submit_time,
+	    msg->u.accept_msg->info_msgs, msg->u.accept_msg->n_info_msgs,
+	    rec->peeraddr);
+	client_message__free_unpacked(msg, NULL);
+    } else {
+	evlog = iolog_parse_loginfo(-1, rec->iolog_path);
+    }
+    if (evlog == NULL)
+	debug_return_ptr(NULL);
+
+    if (rec->iolog_path != NULL) {
+	free(evlog->iolog_path);
+	evlog->iolog_path = rec->iolog_path;
+	evlog->iolog_file = evlog->iolog_path + rec->iolog_file_off;
+	rec->iolog_path = NULL;
+    }
+    memcpy(evlog->sessid, rec->sessid, sizeof(evlog->sessid));
+
+    debug_return_ptr(evlog);
+}
+
+/*
+ * Re-create the event log entry for a queued record and write it.
+ */
+static bool
+evlog_record_write(struct evlog_record *rec)
+{
+    struct logsrvd_info_closure info = { NULL, 0 };
+    struct eventlog *evlog = NULL;
+    struct timespec alert_time;
+    ClientMessage *msg;
+    bool ret = false;
+    debug_decl(evlog_record_write, SUDO_DEBUG_UTIL);
+
+    msg = client_message__unpack(NULL, rec->len, rec->buf);
+    if (msg == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to unpack ClientMessage size %zu", rec->len);
+	debug_return_bool(false);
+    }
+
+    switch (msg->type_case) {
+    case CLIENT_MESSAGE__TYPE_ACCEPT_MSG: {
+	AcceptMessage *accept_msg = msg->u.accept_msg;
+
+	evlog = evlog_new(accept_msg->submit_time, accept_msg->info_msgs,
+	    accept_msg->n_info_msgs, rec->peeraddr);
+	if (evlog == NULL)
+	    break;
+	if (rec->iolog_path != NULL) {
+	    evlog->iolog_path = rec->iolog_path;
+	    evlog->iolog_file = evlog->iolog_path + rec->iolog_file_off;
+	    rec->iolog_path = NULL;
+	}
+	memcpy(evlog->sessid, rec->sessid, sizeof(evlog->sessid));
+	info.info_msgs = accept_msg->info_msgs;
+	info.infolen = accept_msg->n_info_msgs;
+	ret = eventlog_accept(evlog, 0, logsrvd_json_log_cb, &info);
+	break;
+    }
+    case CLIENT_MESSAGE__TYPE_REJECT_MSG: {
+	RejectMessage *reject_msg = msg->u.reject_msg;
+
+	evlog = evlog_new(reject_msg->submit_time, reject_msg->info_msgs,
+	    reject_msg->n_info_msgs, rec->peeraddr);
+	if (evlog == NULL)
+	    break;
+	info.info_msgs = reject_msg->info_msgs;
+	info.infolen = reject_msg->n_info_msgs;
+	ret = eventlog_reject(evlog, 0, reject_msg->reason,
+	    logsrvd_json_log_cb, &info);
+	break;
+    }
+    case CLIENT_MESSAGE__TYPE_ALERT_MSG: {
+	AlertMessage *alert_msg = msg->u.alert_msg;
+
+	if (alert_msg->info_msgs != NULL && alert_msg->n_info_msgs != 0) {
+	    evlog = evlog_new(NULL, alert_msg->info_msgs,
+		alert_msg->n_info_msgs, rec->peeraddr);
+	    if (evlog == NULL)
+		break;
+	} else if (rec->accept_buf != NULL || rec->iolog_path != NULL) {
+	    if ((evlog = evlog_record_session(rec)) == NULL)
+		break;
+	}
+	alert_time.tv_sec = alert_msg->alert_time->tv_sec;
+	alert_time.tv_nsec = alert_msg->alert_time->tv_nsec;
+	ret = eventlog_alert(evlog, 0, &alert_time, alert_msg->reason, NULL);
+	break;
+    }
+    default:
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unexpected type_case value %d", msg->type_case);
+	break;
+    }
+
+    eventlog_free(evlog);
+    client_message__free_unpacked(msg, NULL);
+    debug_return_bool(ret);
+}
+
+static void
+evlog_record_free(struct evlog_record *rec)
+{
+    free(rec->buf);
+    free(rec->accept_buf);
+    free(rec->iolog_path);
+    free(rec);
+}
+
+/*
+ * Account for the entries written by a sink that has exited.
+ */
+static void
+evlog_sink_done(int status)
+{
+    unsigned int errors = evlog_sink.nrecords;
+    debug_decl(evlog_sink_done, SUDO_DEBUG_UTIL);
+
+    if (WIFEXITED(status) && (unsigned int)WEXITSTATUS(status) < errors)
+	errors = WEXITSTATUS(status);
+    if (errors != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to write %u of %u queued event log entries, status 0x%x",
+	    errors, evlog_sink.nrecords, status);
+    }
+    evlog_stats.written += evlog_sink.nrecords - errors;
+    evlog_stats.errors += errors;
+    evlog_sink.child = -1;
+    evlog_sink.nrecords = 0;
+
+    debug_return;
+}
+
+/*
+ * Read exactly len bytes from fd.
+ * Returns 1 on success, 0 on EOF before any data was read, else -1.
+ */
+static int
+evlog_sink_read(int fd, void *buf, size_t len)
+{
+    size_t off = 0;
+    ssize_t nread;
+
+    while (off < len) {
+	nread = read(fd, (char *)buf + off, len - off);
+	if (nread == -1) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (nread == 0)
+	    return off == 0 ? 0 : -1;
+	off += nread;
+    }
+    return 1;
+}
+
+/*
+ * Main loop of the sink process, writes each entry read from fd
+ * until the server closes the pipe.
+ * Returns the number of entries that could not be written.
+ */
+static int
+evlog_sink_main(int fd)
+{
+    struct evlog_sink_hdr hdr;
+    struct evlog_record rec;
+    int errors = 0, rc;
+    debug_decl(evlog_sink_main, SUDO_DEBUG_UTIL);
+
+    while ((rc = evlog_sink_read(fd, &hdr, sizeof(hdr))) == 1) {
+	memset(&rec, 0, sizeof(rec));
+	rc = -1;
+	if (hdr.len == 0 || hdr.len > MESSAGE_SIZE_MAX ||
+		hdr.accept_len > MESSAGE_SIZE_MAX ||
+		hdr.path_len > PATH_MAX || hdr.iolog_file_off > hdr.path_len)
+	    break;
+	if ((rec.buf = malloc(hdr.len)) == NULL)
+	    break;
+	rec.len = hdr.len;
+	if (evlog_sink_read(fd, rec.buf, rec.len) != 1)
+	    break;
+	if (hdr.path_len != 0) {
+	    if ((rec.iolog_path = malloc(hdr.path_len)) == NULL)
+		break;
+	    if (evlog_sink_read(fd, rec.iolog_path, hdr.path_len) != 1)
+		break;
+	    rec.iolog_path[hdr.path_len - 1] = '\0';
+	    rec.iolog_file_off = hdr.iolog_file_off;
+	}
+	if (hdr.accept_len != 0) {
+	    if ((rec.accept_buf = malloc(hdr.accept_len)) == NULL)
+		break;
+	    rec.accept_len = hdr.accept_len;
+	    if (evlog_sink_read(fd, rec.accept_buf, rec.accept_len) != 1)
+		break;
+	}
+	memcpy(rec.sessid, hdr.sessid, sizeof(rec.sessid));
+	memcpy(rec.peeraddr, hdr.peeraddr, sizeof(rec.peeraddr));
+	rec.peeraddr[sizeof(rec.peeraddr) - 1] = '\0';
+
+	if (!evlog_record_write(&rec) && errors < EVLOG_SINK_ERRORS_MAX)
+	    errors++;
+	free(rec.buf);
+	free(rec.accept_buf);
+	free(rec.iolog_path);
+	rc = 0;
+    }
+    if (rc == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to read event log entry");
+	free(rec.buf);
+	free(rec.accept_buf);
+	free(rec.iolog_path);
+	if (errors < EVLOG_SINK_ERRORS_MAX)
+	    errors++;
+    }
+
+    debug_return_int(errors);
+}
+
+/*
+ * Pack the first queued entry to be sent to the sink and free it.
+ */
+static bool
+evlog_sink_pack(void)
+{
+    struct evlog_record *rec = TAILQ_FIRST(&evlog_queue);
+    struct evlog_sink_hdr hdr;
+    size_t path_len = 0;
+    uint8_t *cp;
+    debug_decl(evlog_sink_pack, SUDO_DEBUG_UTIL);
+
+    if (rec->iolog_path != NULL)
+	path_len = strlen(rec->iolog_path) + 1;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.len = rec->len;
+    hdr.path_len = path_len;
+    hdr.accept_len = rec->accept_len;
+    hdr.iolog_file_off = rec->iolog_file_off;
+    memcpy(hdr.sessid, rec->sessid, sizeof(hdr.sessid));
+    memcpy(hdr.peeraddr, rec->peeraddr, sizeof(hdr.peeraddr));
+
+    evlog_sink.len = sizeof(hdr) + rec->len + path_len + rec->accept_len;
+    if ((cp = malloc(evlog_sink.len)) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	evlog_sink.len = 0;
+	debug_return_bool(false);
+    }
+    evlog_sink.buf = cp;
+    evlog_sink.off = 0;
+    memcpy(cp, &hdr, sizeof(hdr));
+    cp += sizeof(hdr);
+    memcpy(cp, rec->buf, rec->len);
+    cp += rec->len;
+    if (path_len != 0)
+	memcpy(cp, rec->iolog_path, path_len);
+    cp += path_len;
+    if (rec->accept_len != 0)
+	memcpy(cp, rec->accept_buf, rec->accept_len);
+
+    TAILQ_REMOVE(&evlog_queue, rec, entries);
+    evlog_queue_len--;
+    evlog_record_free(rec);
+    evlog_sink.nrecords++;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Close the pipe to the sink, which exits once it has written
+ * everything it was sent.  The sink is collected by
+ * logsrvd_eventlog_reap() or evlog_sink_finish().
+ */
+static void
+evlog_sink_stop(void)
+{
+    debug_decl(evlog_sink_stop, SUDO_DEBUG_UTIL);
+
+    if (evlog_sink.buf != NULL && evlog_sink.off == 0) {
+	/* Never sent, the sink doesn't know about it. */
+	evlog_sink.nrecords--;
+	evlog_stats.errors++;
+    }
+    free(evlog_sink.buf);
+    evlog_sink.buf = NULL;
+    evlog_sink.len = 0;
+    evlog_sink.off = 0;
+    sudo_ev_free(evlog_sink.write_ev);
+    evlog_sink.write_ev = NULL;
+    if (evlog_sink.fd != -1) {
+	close(evlog_sink.fd);
+	evlog_sink.fd = -1;
+    }
+
+    debug_return;
+}
+
+/*
+ * Send queued entries to the sink as the pipe has room for them.
+ */
+static void
+evlog_sink_write_cb(int fd, int what, void *v)
+{
+    ssize_t nwritten;
+    debug_decl(evlog_sink_write_cb, SUDO_DEBUG_UTIL);
+
+    for (;;) {
+	if (evlog_sink.off == evlog_sink.len) {
+	    free(evlog_sink.buf);
+	    evlog_sink.buf = NULL;
+	    if (TAILQ_EMPTY(&evlog_queue) || !evlog_sink_pack()) {
+		/* Wait for the next flush. */
+		sudo_ev_del(evlog_sink.evbase, evlog_sink.write_ev);
+		break;
+	    }
+	}
+	nwritten = write(fd, evlog_sink.buf + evlog_sink.off,
+	    evlog_sink.len - evlog_sink.off);
+	if (nwritten == -1) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN)
+		break;
+	    sudo_debug_printf(
+		SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to write to event log sink %d", (int)evlog_sink.child);
+	    evlog_sink_stop();
+	    break;
+	}
+	evlog_sink.off += nwritten;
+    }
+
+    debug_return;
+}
+
+/*
+ * Fork the sink process and set up the pipe used to feed it.
+ */
+static bool
+evlog_sink_spawn(void)
+{
+    int flags, pfd[2];
+    pid_t pid;
+    debug_decl(evlog_sink_spawn, SUDO_DEBUG_UTIL);
+
+    if (pipe(pfd) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create pipe");
+	debug_return_bool(false);
+    }
+
+    switch (pid = sudo_debug_fork()) {
+    case -1:
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to fork event log sink");
+	close(pfd[0]);
+	close(pfd[1]);
+	debug_return_bool(false);
+    case 0:
+	/*
+	 * The sink must not keep the server's listeners and client
+	 * connections open, or signal the server's event loop.
+	 */
+	if (pfd[0] != STDERR_FILENO + 1) {
+	    if (dup2(pfd[0], STDERR_FILENO + 1) == -1)
+		_exit(EXIT_FAILURE);
+	}
+	closefrom(STDERR_FILENO + 2);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	_exit(evlog_sink_main(STDERR_FILENO + 1));
+    default:
+	break;
+    }
+    close(pfd[0]);
+    evlog_sink.child = pid;
+    evlog_sink.nrecords = 0;
+
+    flags = fcntl(pfd[1], F_GETFL, 0);
+    if (flags == -1 || fcntl(pfd[1], F_SETFL, flags | O_NONBLOCK) == -1 ||
+	    fcntl(pfd[1], F_SETFD, FD_CLOEXEC) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to set flags on event log sink pipe");
+    }
+    evlog_sink.write_ev = sudo_ev_alloc(pfd[1], SUDO_EV_WRITE|SUDO_EV_PERSIST,
+	evlog_sink_write_cb, NULL);
+    if (evlog_sink.write_ev == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate event log sink write event");
+	/* The sink exits when it reads EOF. */
+	close(pfd[1]);
+	debug_return_bool(false);
+    }
+    evlog_sink.fd = pfd[1];
+
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"started event log sink %d", (int)pid);
+    debug_return_bool(true);
+}
+
+/*
+ * Send the queued entries to the sink, starting it if needed.
+ * A sink that is still exiting must finish before a new one is
+ * started, logsrvd_eventlog_reap() will call us again.
+ */
+static void
+evlog_sink_start(void)
+{
+    debug_decl(evlog_sink_start, SUDO_DEBUG_UTIL);
+
+    if (TAILQ_EMPTY(&evlog_queue))
+	debug_return;
+    if (evlog_sink.fd == -1) {
+	if (evlog_sink.child != -1)
+	    debug_return;
+	if (!evlog_sink_spawn())
+	    goto direct;
+    }
+
+    if (evlog_flush_ev != NULL)
+	sudo_ev_del(NULL, evlog_flush_ev);
+    if (!sudo_ev_pending(evlog_sink.write_ev, SUDO_EV_WRITE, NULL)) {
+	if (sudo_ev_add(evlog_sink.evbase, evlog_sink.write_ev, NULL,
+		false) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to add event log sink write event");
+	    evlog_sink_stop();
+	    goto direct;
+	}
+	sudo_debug_printf(SUDO_DEBUG_DEBUG|SUDO_DEBUG_LINENO,
+	    "sending %u queued event log entries to process %d",
+	    evlog_queue_len, (int)evlog_sink.child);
+	evlog_stats.batches++;
+    }
+    debug_return;
+
+direct:
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	"no event log sink, writing entries directly");
+    logsrvd_eventlog_flush();
+    debug_return;
+}
+
+/*
+ * Finish sending the current entry, close the pipe and wait for the
+ * sink to write everything it was sent.  Only used when flushing the
+ * queue at shutdown or before the configuration is reloaded.
+ */
+static void
+evlog_sink_finish(void)
+{
+    ssize_t nwritten;
+    int flags, status;
+    pid_t pid;
+    debug_decl(evlog_sink_finish, SUDO_DEBUG_UTIL);
+
+    if (evlog_sink.fd != -1 && evlog_sink.buf != NULL) {
+	flags = fcntl(evlog_sink.fd, F_GETFL, 0);
+	if (flags != -1)
+	    (void)fcntl(evlog_sink.fd, F_SETFL, flags & ~O_NONBLOCK);
+	while (evlog_sink.off < evlog_sink.len) {
+	    nwritten = write(evlog_sink.fd, evlog_sink.buf + evlog_sink.off,
+		evlog_sink.len - evlog_sink.off);
+	    if (nwritten == -1) {
+		if (errno == EINTR)
+		    continue;
+		break;
+	    }
+	    evlog_sink.off += nwritten;
+	}
+    }
+    evlog_sink_stop();
+
+    if (evlog_sink.child == -1)
+	debug_return;
+    do {
+	pid = waitpid(evlog_sink.child, &status, 0);
+    } while (pid == -1 && errno == EINTR);
+    if (pid == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to wait for event log sink %d", (int)evlog_sink.child);
+	status = 0xff00;
+    }
+    evlog_sink_done(status);
+
+    debug_return;
+}
+
+/*
+ * Collect the sink process and start a new one if entries were queued
+ * while it exited.  Called when SIGCHLD is received.
+ */
+void
+logsrvd_eventlog_reap(void)
+{
+    int status;
+    pid_t pid;
+    debug_decl(logsrvd_eventlog_reap, SUDO_DEBUG_UTIL);
+
+    if (evlog_sink.child == -1)
+	debug_return;
+    do {
+	pid = waitpid(evlog_sink.child, &status, WNOHANG);
+    } while (pid == -1 && errno == EINTR);
+    if (pid != evlog_sink.child)
+	debug_return;
+
+    if (evlog_sink.fd != -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "event log sink %d exited unexpectedly", (int)pid);
+	evlog_sink_stop();
+    }
+    evlog_sink_done(status);
+
+    if (evlog_queue_len >= logsrvd_conf_eventlog_max_pending() ||
+	    (evlog_flush_ev != NULL &&
+	    !sudo_ev_pending(evlog_flush_ev, SUDO_EV_TIMEOUT, NULL)))
+	evlog_sink_start();
+
+    debug_return;
+}
+
+/*
+ * Write all queued event log entries before returning.
+ * Used at shutdown and before the configuration is reloaded.
+ */
+void
+logsrvd_eventlog_flush(void)
+{
+    struct evlog_record *rec;
+    debug_decl(logsrvd_eventlog_flush, SUDO_DEBUG_UTIL);
+
+    /* Entries must be written in order. */
+    evlog_sink_finish();
+
+    if (TAILQ_EMPTY(&evlog_queue))
+	debug_return;
+
+    sudo_debug_printf(SUDO_DEBUG_DEBUG|SUDO_DEBUG_LINENO,
+	"writing %u queued event log entries", evlog_queue_len);
+    if (evlog_flush_ev != NULL)
+	sudo_ev_del(NULL, evlog_flush_ev);
+    while ((rec = TAILQ_FIRST(&evlog_queue)) != NULL) {
+	TAILQ_REMOVE(&evlog_queue, rec, entries);
+	evlog_queue_len--;
+	if (evlog_record_write(rec)) {
+	    evlog_stats.written++;
+	} else {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to write queued event log entry from %s",
+		rec->peeraddr);
+	    evlog_stats.errors++;
+	}
+	evlog_record_free(rec);
+    }
+    evlog_stats.batches++;
+
+    debug_return;
+}
+
+/*
+ * If max_pending or more event log entries are queued, returns true
+ * and sets delay to how long to stop reading from the client.
+ */
+bool
+logsrvd_eventlog_backpressure(struct timespec *delay)
+{
+    debug_decl(logsrvd_eventlog_backpressure, SUDO_DEBUG_UTIL);
+
+    if (evlog_queue_len < logsrvd_conf_eventlog_max_pending())
+	debug_return_bool(false);
+    delay->tv_sec = 0;
+    delay->tv_nsec = EVLOG_BACKPRESSURE_MSEC * 1000000;
+    debug_return_bool(true);
+}
+
+static void
+evlog_flush_cb(int unused, int what, void *v)
+{
+    evlog_sink_start();
+}
+
+/*
+ * Queue an event log entry to be written later.
+ * The queue is written when the flush interval expires or when
+ * max_pending entries are queued, whichever comes first.
+ * If session is true, the entry is an alert that is logged with
+ * the details of the session it belongs to.
+ */
+static bool
+evlog_queue_insert(uint8_t *buf, size_t len, bool session,
+    struct connection_closure *closure)
+{
+    const struct eventlog *evlog = closure->evlog;
+    struct evlog_record *rec;
+    debug_decl(evlog_queue_insert, SUDO_DEBUG_UTIL);
+
+    if ((rec = calloc(1, sizeof(*rec))) == NULL)
+	goto oom;
+    if ((rec->buf = malloc(len)) == NULL)
+	goto oom;
+    memcpy(rec->buf, buf, len);
+    rec->len = len;
+    if (session && closure->accept_buf != NULL) {
+	if ((rec->accept_buf = malloc(closure->accept_len)) == NULL)
+	    goto oom;
+	memcpy(rec->accept_buf, closure->accept_buf, closure->accept_len);
+	rec->accept_len = closure->accept_len;
+    }
+    (void)strlcpy(rec->peeraddr, closure->ipaddr, sizeof(rec->peeraddr));
+    if (evlog != NULL) {
+	/* Set by iolog_init(), not part of the message. */
+	memcpy(rec->sessid, evlog->sessid, sizeof(rec->sessid));
+	if (evlog->iolog_path != NULL) {
+	    if ((rec->iolog_path = strdup(evlog->iolog_path)) == NULL)
+		goto oom;
+	    if (evlog->iolog_file != NULL)
+		rec->iolog_file_off = evlog->iolog_file - evlog->iolog_path;
+	}
+    }
+
+    if (evlog_flush_ev == NULL) {
+	evlog_flush_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT, evlog_flush_cb,
+	    NULL);
+	if (evlog_flush_ev == NULL)
+	    goto oom;
+    }
+    if (TAILQ_EMPTY(&evlog_queue)) {
+	if (sudo_ev_add(closure->evbase, evlog_flush_ev,
+		logsrvd_conf_eventlog_flush_interval(), false) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to add event log flush event");
+	    evlog_record_free(rec);
+	    debug_return_bool(false);
+	}
+    }
+    TAILQ_INSERT_TAIL(&evlog_queue, rec, entries);
+    evlog_stats.queued++;
+    evlog_sink.evbase = closure->evbase;
+
+    /*
+     * Bound the number of events that could be lost in a crash.
+     * The client is not read from again until the queue drains.
+     */
+    if (++evlog_queue_len >= logsrvd_conf_eventlog_max_pending())
+	evlog_sink_start();
+
+    debug_return_bool(true);
+oom:
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	"unable to allocate memory");
+    if (rec != NULL)
+	evlog_record_free(rec);
+    debug_return_bool(false);
+}
+
+/*
+ * Dump event log queue stats in response to SIGUSR1.
+ */
+void
+logsrvd_eventlog_dump(void)
+{
+    debug_decl(logsrvd_eventlog_dump, SUDO_DEBUG_UTIL);
+
+    if (evlog_stats.queued == 0)
+	debug_return;
+
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"event log queue: %u pending, %u sent to sink, %llu queued, "
+	"%llu written, %llu errors, %llu batches", evlog_queue_len,
+	evlog_sink.nrecords, evlog_stats.queued, evlog_stats.written,
+	evlog_stats.errors, evlog_stats.batches);
+
+    debug_return;
+}
+
 /*
  * Parse and store an AcceptMessage locally.
  */
@@ -144,7 +929,7 @@ store_accept_local(AcceptMessage *msg, uint8_t *buf, size_t len,
 
     /* Store sudo-style event and I/O logs. */
     closure->evlog = evlog_new(msg->submit_time, msg->info_msgs,
-	msg->n_info_msgs, closure);
+	msg->n_info_msgs, closure->ipaddr);
     if (closure->evlog == NULL) {
 	closure->errstr = _("error parsing AcceptMessage");
 	debug_return_bool(false);
@@ -152,6 +937,10 @@ store_accept_local(AcceptMessage *msg, uint8_t *buf, size_t len,
 
     /* Create I/O log info file and parent directories. */
     if (msg->expect_iobufs) {
+	if (storage_state(STORAGE_IOLOG_DIR) == STORAGE_HARD) {
+	    closure->errstr = _("insufficient disk space, try again later");
+	    debug_return_bool(false);
+	}
 	if (!iolog_init(msg, closure)) {
 	    closure->errstr = _("error creating I/O log");
 	    debug_return_bool(false);
@@ -160,10 +949,24 @@ store_accept_local(AcceptMessage *msg, uint8_t *buf, size_t len,
 	log_id = closure->evlog->iolog_path;
     }
 
-    if (!eventlog_accept(closure->evlog, 0, logsrvd_json_log_cb, &info)) {
+    if (logsrvd_conf_eventlog_flush_interval() != NULL) {
+	if (!evlog_queue_insert(buf, len, false, closure)) {
+	    closure->errstr = _("error logging accept event");
+	    debug_return_bool(false);
+	}
+	/* Alerts without info messages are logged with these details. */
+	if ((closure->accept_buf = malloc(len)) == NULL) {
+	    closure->errstr = _("unable to allocate memory");
+	    debug_return_bool(false);
+	}
+	memcpy(closure->accept_buf, buf, len);
+	closure->accept_len = len;
+    } else if (!eventlog_accept(closure->evlog, 0, logsrvd_json_log_cb, &info)) {
 	closure->errstr = _("error logging accept event");
 	debug_return_bool(false);
     }
+    logsrvd_evstore_add(EVSTORE_ACCEPT, closure->evlog, NULL,
+	&closure->evlog->submit_time);
 
     if (log_id != NULL) {
 	/* Send log ID to client for restarting connections. */
@@ -191,17 +994,24 @@ store_reject_local(RejectMessage *msg, uint8_t *buf, size_t len,
     debug_decl(store_reject_local, SUDO_DEBUG_UTIL);
 
     closure->evlog = evlog_new(msg->submit_time, msg->info_msgs,
-	msg->n_info_msgs, closure);
+	msg->n_info_msgs, closure->ipaddr);
     if (closure->evlog == NULL) {
 	closure->errstr = _("error parsing RejectMessage");
 	debug_return_bool(false);
     }
 
-    if (!eventlog_reject(closure->evlog, 0, msg->reason,
+    if (logsrvd_conf_eventlog_flush_interval() != NULL) {
+	if (!evlog_queue_insert(buf, len, false, closure)) {
+	    closure->errstr = _("error logging reject event");
+	    debug_return_bool(false);
+	}
+    } else if (!eventlog_reject(closure->evlog, 0, msg->reason,
 	    logsrvd_json_log_cb, &info)) {
 	closure->errstr = _("error logging reject event");
 	debug_return_bool(false);
     }
+    logsrvd_evstore_add(EVSTORE_REJECT, closure->evlog, msg->reason,
+	&closure->evlog->submit_time);
 
     debug_return_bool(true);
 }
@@ -224,6 +1034,15 @@ store_exit_local(ExitMessage *msg, uint8_t *buf, size_t len,
     }
 
     if (closure->log_io) {
+	/* Seal the digest before the log is marked complete. */
+	if (closure->iolog_digest != NULL) {
+	    if (!iolog_digest_seal(closure->iolog_digest,
+		    closure->iolog_dir_fd)) {
+		closure->errstr = _("unable to seal I/O log digest");
+		debug_return_bool(false);
+	    }
+	}
+
 	/* Clear write bits from I/O timing file to indicate completion. */
 	mode = logsrvd_conf_iolog_mode();
 	CLR(mode, S_IWUSR|S_IWGRP|S_IWOTH);
@@ -248,6 +1067,10 @@ store_restart_local(RestartMessage *msg, uint8_t *buf, size_t len,
     target.tv_sec = msg->resume_point->tv_sec;
     target.tv_nsec = msg->resume_point->tv_nsec;
 
+    /* Pick up where we left off if the session is still open. */
+    if (resume_cache_restore(msg->log_id, &target, closure))
+	debug_return_bool(true);
+
     /* We must allocate closure->evlog for iolog_path. */
     closure->evlog = calloc(1, sizeof(*closure->evlog));
     if (closure->evlog == NULL) {
@@ -291,9 +1114,22 @@ store_restart_local(RestartMessage *msg, uint8_t *buf, size_t len,
 	    closure->iolog_files, "r+"))
 	goto bad;
 
-    /* Compressed logs don't support random access, so rewrite them. */
+    /* The digest is rebuilt from the data before the resume point. */
+    if (logsrvd_conf_iolog_digest()) {
+	closure->iolog_digest = iolog_digest_open(closure->iolog_dir_fd,
+	    closure->evlog->iolog_path);
+	if (closure->iolog_digest == NULL)
+	    goto bad;
+    }
+
+    /*
+     * Compressed and deduplicated logs don't support random access
+     * or appending, so rewrite them.
+     */
     for (iofd = 0; iofd < IOFD_MAX; iofd++) {
-	if (closure->iolog_files[iofd].compressed)
+	struct iolog_file *iol = &closure->iolog_files[iofd];
+
+	if (iol->enabled && (iol->compressed || !iol->writable))
 	    debug_return_bool(iolog_rewrite(&target, closure));
     }
 
@@ -308,6 +1144,10 @@ store_restart_local(RestartMessage *msg, uint8_t *buf, size_t len,
 	    "lseek(IOFD_TIMING, 0, SEEK_CUR)");
 	goto bad;
     }
+    if (closure->iolog_digest != NULL) {
+	if (!iolog_digest_restart(closure))
+	    goto bad;
+    }
 
     /* Ready to log I/O buffers. */
     debug_return_bool(true);
@@ -322,23 +1162,38 @@ store_alert_local(AlertMessage *msg, uint8_t *buf, size_t len,
     struct connection_closure *closure)
 {
     struct timespec alert_time;
+    bool session = false;
     debug_decl(store_alert_local, SUDO_DEBUG_UTIL);
 
     if (msg->info_msgs != NULL && msg->n_info_msgs != 0) {
 	closure->evlog = evlog_new(NULL, msg->info_msgs,
-	    msg->n_info_msgs, closure);
+	    msg->n_info_msgs, closure->ipaddr);
 	if (closure->evlog == NULL) {
 	    closure->errstr = _("error parsing AlertMessage");
 	    debug_return_bool(false);
 	}
+    } else if (closure->evlog != NULL) {
+	/*
+	 * An alert without info messages is logged using the event log
+	 * details of the session, see evlog_record_session().
+	 */
+	session = true;
     }
 
     alert_time.tv_sec = msg->alert_time->tv_sec;
     alert_time.tv_nsec = msg->alert_time->tv_nsec;
-    if (!eventlog_alert(closure->evlog, 0, &alert_time, msg->reason, NULL)) {
+    if (logsrvd_conf_eventlog_flush_interval() != NULL) {
+	if (!evlog_queue_insert(buf, len, session, closure)) {
+	    closure->errstr = _("error logging alert event");
+	    debug_return_bool(false);
+	}
+    } else if (!eventlog_alert(closure->evlog, 0, &alert_time, msg->reason,
+	    NULL)) {
 	closure->errstr = _("error logging alert event");
 	debug_return_bool(false);
     }
+    logsrvd_evstore_add(EVSTORE_ALERT, closure->evlog, msg->reason,
+	&alert_time);
 
     debug_return_bool(true);
 }
@@ -371,8 +1226,8 @@ store_iobuf_local(int iofd, IoBuffer *iobuf, uint8_t *buf, size_t buflen,
     }
 
     /* Write to specified I/O log file. */
-    if (!iolog_write(&closure->iolog_files[iofd], iobuf->data.data,
-	    iobuf->data.len, &errstr)) {
+    if (!iolog_write_data(iofd, iobuf->data.data, iobuf->data.len,
+	    closure, &errstr)) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 	    "unable to write to %s/%s: %s", evlog->iolog_path,
 	    iolog_fd_to_name(iofd), errstr);
@@ -380,8 +1235,7 @@ store_iobuf_local(int iofd, IoBuffer *iobuf, uint8_t *buf, size_t buflen,
     }
 
     /* Write timing data. */
-    if (!iolog_write(&closure->iolog_files[IOFD_TIMING], tbuf,
-	    len, &errstr)) {
+    if (!iolog_write_data(IOFD_TIMING, tbuf, len, closure, &errstr)) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 	    "unable to write to %s/%s: %s", evlog->iolog_path,
 	    iolog_fd_to_name(IOFD_TIMING), errstr);
@@ -427,8 +1281,7 @@ store_winsize_local(ChangeWindowSize *msg, uint8_t *buf, size_t buflen,
     }
 
     /* Write timing data. */
-    if (!iolog_write(&closure->iolog_files[IOFD_TIMING], tbuf,
-	    len, &errstr)) {
+    if (!iolog_write_data(IOFD_TIMING, tbuf, len, closure, &errstr)) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 	    "unable to write to %s/%s: %s", closure->evlog->iolog_path,
 	    iolog_fd_to_name(IOFD_TIMING), errstr);
@@ -465,8 +1318,7 @@ store_suspend_local(CommandSuspend *msg, uint8_t *buf, size_t buflen,
     }
 
     /* Write timing data. */
-    if (!iolog_write(&closure->iolog_files[IOFD_TIMING], tbuf,
-	    len, &errstr)) {
+    if (!iolog_write_data(IOFD_TIMING, tbuf, len, closure, &errstr)) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 	    "unable to write to %s/%s: %s", closure->evlog->iolog_path,
 	    iolog_fd_to_name(IOFD_TIMING), errstr);
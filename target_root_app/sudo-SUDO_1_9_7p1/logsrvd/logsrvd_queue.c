@@ -64,14 +64,416 @@
 # define NAMLEN(dirent) strlen((dirent)->d_name)
 #endif
 
+/*
+ * The outgoing queue is backed by an append-only manifest in the relay
+ * dir that lists journal files in the order they were finished, one
+ * file name per line.  Only a page of entries is kept in memory at a
+ * time; more are read in as the queue drains.  Entries that were relayed
+ * are not removed from the manifest, instead the consumed part of the
+ * manifest is discarded when it is compacted.
+ */
+#define QUEUE_MANIFEST		"outgoing.manifest"
+#define QUEUE_PAGE_SIZE		256
+#define QUEUE_COMPACT_MIN	(1024 * 1024)
+
+struct queue_manifest {
+    char path[PATH_MAX];
+    FILE *fp;		/* for reading records */
+    int fd;		/* for appending records */
+    off_t offset;	/* offset of the next unread record */
+    off_t size;
+    bool eof;
+};
+
+static struct queue_manifest manifest = { "", NULL, -1 };
+
 static struct outgoing_journal_queue outgoing_journal_queue =
     TAILQ_HEAD_INITIALIZER(outgoing_journal_queue);
 
+/* Journals handed off to a relay connection that are not yet finished. */
+static struct outgoing_journal_queue inflight_journal_queue =
+    TAILQ_HEAD_INITIALIZER(inflight_journal_queue);
+
 static struct sudo_event *outgoing_queue_event;
 
+/*
+ * Returns true if name looks like a relay temp file.
+ */
+static bool
+queue_valid_name(const char *name, size_t namelen)
+{
+    const size_t prefix_len = strcspn(RELAY_TEMPLATE, "X");
+
+    if (namelen != sizeof(RELAY_TEMPLATE) - 1)
+	return false;
+    if (strncmp(name, RELAY_TEMPLATE, prefix_len) != 0)
+	return false;
+    return memchr(name, '/', namelen) == NULL;
+}
+
+/*
+ * Allocate a queue entry for the named file in the outgoing directory.
+ */
+static struct outgoing_journal *
+queue_entry_alloc(const char *name)
+{
+    struct outgoing_journal *oj;
+    debug_decl(queue_entry_alloc, SUDO_DEBUG_UTIL);
+
+    if ((oj = malloc(sizeof(*oj))) == NULL)
+	goto oom;
+    if (asprintf(&oj->journal_path, "%s/outgoing/%s",
+	    logsrvd_conf_relay_dir(), name) == -1) {
+	free(oj);
+	goto oom;
+    }
+    debug_return_ptr(oj);
+oom:
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	"unable to allocate memory");
+    debug_return_ptr(NULL);
+}
+
+/*
+ * Returns true if the named journal is already queued in memory
+ * or being relayed.
+ */
+static bool
+queue_lookup(const char *name)
+{
+    struct outgoing_journal_queue *queues[] = {
+	&inflight_journal_queue, &outgoing_journal_queue
+    };
+    struct outgoing_journal *oj;
+    const char *base;
+    size_t i;
+    debug_decl(queue_lookup, SUDO_DEBUG_UTIL);
+
+    for (i = 0; i < nitems(queues); i++) {
+	TAILQ_FOREACH(oj, queues[i], entries) {
+	    base = strrchr(oj->journal_path, '/');
+	    base = base ? base + 1 : oj->journal_path;
+	    if (strcmp(base, name) == 0)
+		debug_return_bool(true);
+	}
+    }
+    debug_return_bool(false);
+}
+
+/*
+ * Remove the entry matching journal_path from the in-flight list.
+ */
+static void
+queue_inflight_remove(const char *journal_path)
+{
+    struct outgoing_journal *oj;
+    debug_decl(queue_inflight_remove, SUDO_DEBUG_UTIL);
+
+    TAILQ_FOREACH(oj, &inflight_journal_queue, entries) {
+	if (strcmp(oj->journal_path, journal_path) == 0) {
+	    TAILQ_REMOVE(&inflight_journal_queue, oj, entries);
+	    free(oj->journal_path);
+	    free(oj);
+	    break;
+	}
+    }
+
+    debug_return;
+}
+
+/*
+ * Discard a partial record at the end of the manifest left by a crash.
+ * Returns the new size or -1 on error.
+ */
+static off_t
+manifest_trim(int fd, off_t size)
+{
+    char buf[512];
+    off_t pos = size;
+    debug_decl(manifest_trim, SUDO_DEBUG_UTIL);
+
+    while (pos > 0) {
+	size_t len = pos > ssizeof(buf) ? sizeof(buf) : (size_t)pos;
+	ssize_t n;
+
+	pos -= len;
+	if (pread(fd, buf, len, pos) != (ssize_t)len)
+	    debug_return_ssize_t(-1);
+	for (n = len; n > 0; n--) {
+	    if (buf[n - 1] == '\n') {
+		pos += n;
+		goto done;
+	    }
+	}
+    }
+done:
+    if (pos != size) {
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+	    "%s: discarding %lld byte partial record", manifest.path,
+	    (long long)(size - pos));
+	if (ftruncate(fd, pos) == -1)
+	    debug_return_ssize_t(-1);
+    }
+    debug_return_ssize_t(pos);
+}
+
+static void
+manifest_close(void)
+{
+    debug_decl(manifest_close, SUDO_DEBUG_UTIL);
+
+    if (manifest.fp != NULL) {
+	fclose(manifest.fp);
+	manifest.fp = NULL;
+    }
+    if (manifest.fd != -1) {
+	close(manifest.fd);
+	manifest.fd = -1;
+    }
+
+    debug_return;
+}
+
+/*
+ * Open the queue manifest for reading and appending.
+ * If create is not set, the manifest must already exist.
+ */
+static bool
+manifest_open(bool create)
+{
+    struct stat sb;
+    int flags = O_RDWR|O_APPEND;
+    debug_decl(manifest_open, SUDO_DEBUG_UTIL);
+
+    if (manifest.fd != -1)
+	debug_return_bool(true);
+
+    if (create)
+	flags |= O_CREAT;
+    manifest.fd = open(manifest.path, flags, S_IRUSR|S_IWUSR);
+    if (manifest.fd == -1) {
+	if (!create && errno == ENOENT)
+	    debug_return_bool(false);
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s", manifest.path);
+	debug_return_bool(false);
+    }
+    if (fstat(manifest.fd, &sb) == -1 ||
+	    (manifest.size = manifest_trim(manifest.fd, sb.st_size)) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to read %s", manifest.path);
+	goto bad;
+    }
+    if ((manifest.fp = fopen(manifest.path, "r")) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s", manifest.path);
+	goto bad;
+    }
+    manifest.offset = 0;
+    manifest.eof = manifest.size == 0;
+
+    debug_return_bool(true);
+bad:
+    manifest_close();
+    debug_return_bool(false);
+}
+
+/*
+ * Write a journal file name to a manifest as a single record.
+ */
+static bool
+manifest_write_name(int fd, const char *journal_path, off_t *sizep)
+{
+    char record[sizeof(RELAY_TEMPLATE) + 1];
+    const char *name;
+    size_t len;
+    debug_decl(manifest_write_name, SUDO_DEBUG_UTIL);
+
+    name = strrchr(journal_path, '/');
+    name = name ? name + 1 : journal_path;
+    len = strlen(name);
+    if (!queue_valid_name(name, len)) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "invalid journal name %s", journal_path);
+	debug_return_bool(false);
+    }
+    memcpy(record, name, len);
+    record[len++] = '\n';
+    if (write(fd, record, len) != (ssize_t)len) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to write queue manifest record");
+	debug_return_bool(false);
+    }
+    *sizep += len;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Rewrite the manifest, discarding records that have been consumed.
+ * Journals that are queued in memory or being relayed are kept.
+ */
+static bool
+manifest_compact(void)
+{
+    char tmp_path[PATH_MAX], *line = NULL;
+    struct outgoing_journal *oj;
+    off_t size = 0, unread = 0;
+    size_t linesize = 0;
+    ssize_t nread;
+    int len, fd;
+    debug_decl(manifest_compact, SUDO_DEBUG_UTIL);
+
+    len = snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXXXX", manifest.path);
+    if (len >= ssizeof(tmp_path)) {
+	errno = ENAMETOOLONG;
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "%s.XXXXXXXX", manifest.path);
+	debug_return_bool(false);
+    }
+    if ((fd = mkstemp(tmp_path)) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create %s", tmp_path);
+	debug_return_bool(false);
+    }
+
+    TAILQ_FOREACH(oj, &inflight_journal_queue, entries) {
+	if (!manifest_write_name(fd, oj->journal_path, &size))
+	    goto bad;
+    }
+    TAILQ_FOREACH(oj, &outgoing_journal_queue, entries) {
+	if (!manifest_write_name(fd, oj->journal_path, &size))
+	    goto bad;
+    }
+
+    /*
+     * Copy the unread records, skipping journals written above.
+     * A journal that was relayed as soon as it was finished has
+     * a record here too.
+     */
+    if (fseeko(manifest.fp, manifest.offset, SEEK_SET) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to seek to %lld in %s", (long long)manifest.offset,
+	    manifest.path);
+	goto bad;
+    }
+    while ((nread = getdelim(&line, &linesize, '\n', manifest.fp)) != -1) {
+	if (line[nread - 1] != '\n')
+	    break;
+	line[nread - 1] = '\0';
+	if (queue_lookup(line))
+	    continue;
+	line[nread - 1] = '\n';
+	if (write(fd, line, nread) != nread) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to copy %s -> %s", manifest.path, tmp_path);
+	    goto bad;
+	}
+	unread += nread;
+    }
+    if (ferror(manifest.fp)) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to read %s", manifest.path);
+	goto bad;
+    }
+    free(line);
+    line = NULL;
+    if (fsync(fd) == -1 || rename(tmp_path, manifest.path) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to replace %s", manifest.path);
+	goto bad;
+    }
+    close(fd);
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"compacted %s from %lld to %lld bytes", manifest.path,
+	(long long)manifest.size, (long long)(size + unread));
+
+    /* Everything we have in memory precedes the unread records. */
+    manifest_close();
+    if (!manifest_open(false))
+	debug_return_bool(false);
+    manifest.offset = size;
+    manifest.eof = manifest.offset == manifest.size;
+
+    debug_return_bool(true);
+bad:
+    free(line);
+    unlink(tmp_path);
+    close(fd);
+    debug_return_bool(false);
+}
+
+/*
+ * Read the next page of entries from the manifest into the queue.
+ * Returns false on error.
+ */
+static bool
+queue_page_in(void)
+{
+    char *line = NULL;
+    size_t linesize = 0;
+    unsigned int count = 0;
+    ssize_t len;
+    debug_decl(queue_page_in, SUDO_DEBUG_UTIL);
+
+    if (manifest.fp == NULL || manifest.eof)
+	debug_return_bool(true);
+
+    /* Only compact when we don't have to hold the whole queue in memory. */
+    if (manifest.offset >= QUEUE_COMPACT_MIN &&
+	    manifest.offset > manifest.size / 2 &&
+	    TAILQ_EMPTY(&outgoing_journal_queue)) {
+	if (!manifest_compact())
+	    debug_return_bool(false);
+    }
+
+    if (fseeko(manifest.fp, manifest.offset, SEEK_SET) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to seek to %lld in %s", (long long)manifest.offset,
+	    manifest.path);
+	debug_return_bool(false);
+    }
+    while (count < QUEUE_PAGE_SIZE) {
+	struct outgoing_journal *oj;
+
+	len = getdelim(&line, &linesize, '\n', manifest.fp);
+	if (len == -1 || line[len - 1] != '\n') {
+	    /* Partial records are only possible after a crash. */
+	    manifest.eof = true;
+	    break;
+	}
+	manifest.offset += len;
+	line[--len] = '\0';
+
+	/* Skip anything that is not a relay temp file. */
+	if (!queue_valid_name(line, len))
+	    continue;
+	/* Already queued, e.g. a failed relay that was retried. */
+	if (queue_lookup(line))
+	    continue;
+	if ((oj = queue_entry_alloc(line)) == NULL) {
+	    free(line);
+	    debug_return_bool(false);
+	}
+	TAILQ_INSERT_TAIL(&outgoing_journal_queue, oj, entries);
+	count++;
+    }
+    free(line);
+
+    sudo_debug_printf(SUDO_DEBUG_DEBUG|SUDO_DEBUG_LINENO,
+	"paged in %u outgoing journals, manifest offset %lld of %lld",
+	count, (long long)manifest.offset, (long long)manifest.size);
+
+    debug_return_bool(true);
+}
+
 /*
  * Callback that runs when the outgoing queue retry timer fires.
  * Tries to relay the first entry in the outgoing queue.
+ * Journals that no longer exist are discarded; if that empties the
+ * queue, the event is re-armed to read in the next page of the manifest.
+ * If every journal left is locked by another relay connection (or could
+ * not be opened), the event is re-armed for the relay retry interval.
  */
 static void
 outgoing_queue_cb(int unused, int what, void *v)
@@ -79,13 +481,16 @@ outgoing_queue_cb(int unused, int what, void *v)
     struct connection_closure *closure;
     struct outgoing_journal *oj, *next;
     struct sudo_event_base *evbase = v;
-    bool success = false;
     debug_decl(outgoing_queue_cb, SUDO_DEBUG_UTIL);
 
     /* Must have at least one relay server. */
     if (TAILQ_EMPTY(logsrvd_conf_relay_address()))
 	debug_return;
 
+    /* Read in more entries from the manifest as needed. */
+    if (TAILQ_EMPTY(&outgoing_journal_queue))
+	queue_page_in();
+
     /* Process first journal. */
     TAILQ_FOREACH_SAFE(oj, &outgoing_journal_queue, entries, next) {
 	FILE *fp;
@@ -111,30 +516,44 @@ outgoing_queue_cb(int unused, int what, void *v)
 	    close(fd);
 	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
 		"unable to fdopen %s", oj->journal_path);
-	    break;
+	    debug_return;
 	}
 
 	/* Allocate a connection closure and fill in journal vars. */
 	closure = connection_closure_alloc(fd, false, true, evbase);
 	if (closure == NULL) {
 	    fclose(fp);
-	    break;
+	    debug_return;
 	}
 	closure->journal = fp;
-	closure->journal_path = oj->journal_path;
+	if ((closure->journal_path = strdup(oj->journal_path)) == NULL) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to allocate memory");
+	    connection_close(closure);
+	    debug_return;
+	}
 
-	/* Done with oj now, closure owns journal_path. */
+	/* Track oj until the relay finishes so compaction preserves it. */
 	TAILQ_REMOVE(&outgoing_journal_queue, oj, entries);
-	free(oj);
+	TAILQ_INSERT_TAIL(&inflight_journal_queue, oj, entries);
 
-	success = connect_relay(closure);
-	if (!success) {
+	if (!connect_relay(closure)) {
 	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 		"unable to connect to relay");
 	    connection_close(closure);
 	}
-	break;
+	debug_return;
+    }
+
+    if (TAILQ_EMPTY(&outgoing_journal_queue)) {
+	/* Every entry in the page was already relayed, try the next page. */
+	logsrvd_queue_enable(0, evbase);
+    } else {
+	/* The remaining journals are locked or unreadable, retry later. */
+	logsrvd_queue_enable(logsrvd_conf_relay_retry_interval(), evbase);
     }
+
+    debug_return;
 }
 
 /*
@@ -146,7 +565,8 @@ logsrvd_queue_enable(time_t timeout, struct sudo_event_base *evbase)
 {
     debug_decl(logsrvd_queue_enable, SUDO_DEBUG_UTIL);
 
-    if (!TAILQ_EMPTY(&outgoing_journal_queue)) {
+    if (!TAILQ_EMPTY(&outgoing_journal_queue) ||
+	    (manifest.fp != NULL && !manifest.eof)) {
 	struct timespec tv = { timeout, 0 };
 
 	if (outgoing_queue_event == NULL) {
@@ -189,6 +609,7 @@ logsrvd_queue_insert(struct connection_closure *closure)
 	    "unable to allocate memory");
 	debug_return_bool(false);
     }
+    queue_inflight_remove(closure->journal_path);
     oj->journal_path = closure->journal_path;
     closure->journal_path = NULL;
     TAILQ_INSERT_TAIL(&outgoing_journal_queue, oj, entries);
@@ -201,17 +622,190 @@ logsrvd_queue_insert(struct connection_closure *closure)
 }
 
 /*
- * Scan the outgoing queue at startup and populate the
- * outgoing_journal_queue.
+ * Record a journal file that is about to be moved to the outgoing
+ * directory in the queue manifest.  This must happen before the
+ * rename so a crash cannot leave a journal that is not in the manifest.
  */
 bool
-logsrvd_queue_scan(struct sudo_event_base *evbase)
+logsrvd_queue_append(const char *journal_path)
 {
-    char path[PATH_MAX];
+    debug_decl(logsrvd_queue_append, SUDO_DEBUG_UTIL);
+
+    if (manifest.fd == -1) {
+	if (!manifest_open(true))
+	    debug_return_bool(false);
+    }
+    if (!manifest_write_name(manifest.fd, journal_path, &manifest.size))
+	debug_return_bool(false);
+    if (logsrvd_conf_server_commit_sync() && fdatasync(manifest.fd) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to sync %s", manifest.path);
+	debug_return_bool(false);
+    }
+    manifest.eof = false;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Called when a finished journal is relayed right away instead of
+ * being read in from the manifest.  Tracking it as in-flight means
+ * that if the relay fails it is only queued once, and compaction
+ * keeps a single record for it.
+ */
+void
+logsrvd_queue_inflight(const char *journal_path)
+{
+    struct outgoing_journal *oj;
+    debug_decl(logsrvd_queue_inflight, SUDO_DEBUG_UTIL);
+
+    /* On failure, the manifest record is still read in later. */
+    if ((oj = malloc(sizeof(*oj))) == NULL ||
+	    (oj->journal_path = strdup(journal_path)) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	free(oj);
+	debug_return;
+    }
+    TAILQ_INSERT_TAIL(&inflight_journal_queue, oj, entries);
+
+    debug_return;
+}
+
+/*
+ * Called when a journal has been relayed and is about to be removed.
+ */
+void
+logsrvd_queue_remove(const char *journal_path)
+{
+    debug_decl(logsrvd_queue_remove, SUDO_DEBUG_UTIL);
+
+    queue_inflight_remove(journal_path);
+
+    debug_return;
+}
+
+struct queue_scan_entry {
+    struct timespec mtime;
+    char name[sizeof(RELAY_TEMPLATE)];
+};
+
+static int
+queue_scan_cmp(const void *va, const void *vb)
+{
+    const struct queue_scan_entry *a = va, *b = vb;
+
+    if (sudo_timespeccmp(&a->mtime, &b->mtime, <))
+	return -1;
+    if (sudo_timespeccmp(&a->mtime, &b->mtime, >))
+	return 1;
+    return strcmp(a->name, b->name);
+}
+
+/*
+ * Create the queue manifest from the contents of the outgoing directory,
+ * oldest journal first.  Only used when there is no existing manifest.
+ */
+static bool
+manifest_create(const char *outgoing_dir)
+{
+    struct queue_scan_entry *entries = NULL;
+    size_t nentries = 0, maxentries = 0, i;
+    char path[PATH_MAX], tmp_path[PATH_MAX];
     struct dirent *dent;
-    size_t prefix_len;
-    int dirlen;
+    off_t size = 0;
+    int fd = -1;
     DIR *dirp;
+    debug_decl(manifest_create, SUDO_DEBUG_UTIL);
+
+    dirp = opendir(outgoing_dir);
+    if (dirp == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to opendir %s", outgoing_dir);
+	debug_return_bool(false);
+    }
+    while ((dent = readdir(dirp)) != NULL) {
+	struct stat sb;
+
+	/* Skip anything that is not a relay temp file. */
+	if (!queue_valid_name(dent->d_name, NAMLEN(dent)))
+	    continue;
+	if (snprintf(path, sizeof(path), "%s%s", outgoing_dir,
+		dent->d_name) >= ssizeof(path))
+	    continue;
+	if (stat(path, &sb) == -1)
+	    continue;
+
+	if (nentries == maxentries) {
+	    struct queue_scan_entry *tmp;
+
+	    maxentries = maxentries ? maxentries * 2 : 64;
+	    tmp = reallocarray(entries, maxentries, sizeof(*entries));
+	    if (tmp == NULL) {
+		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		    "unable to allocate memory");
+		goto bad;
+	    }
+	    entries = tmp;
+	}
+	mtim_get(&sb, entries[nentries].mtime);
+	memcpy(entries[nentries].name, dent->d_name, sizeof(RELAY_TEMPLATE));
+	nentries++;
+    }
+    closedir(dirp);
+    dirp = NULL;
+    if (nentries > 1)
+	qsort(entries, nentries, sizeof(*entries), queue_scan_cmp);
+
+    /* Write to a temporary file so a partial manifest is never used. */
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXXXX",
+	    manifest.path) >= ssizeof(tmp_path)) {
+	errno = ENAMETOOLONG;
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "%s.XXXXXXXX", manifest.path);
+	goto bad;
+    }
+    if ((fd = mkstemp(tmp_path)) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create %s", tmp_path);
+	goto bad;
+    }
+    for (i = 0; i < nentries; i++) {
+	if (!manifest_write_name(fd, entries[i].name, &size))
+	    goto bad_unlink;
+    }
+    if (fsync(fd) == -1 || rename(tmp_path, manifest.path) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create %s", manifest.path);
+	goto bad_unlink;
+    }
+    close(fd);
+    free(entries);
+
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"created %s with %zu journals", manifest.path, nentries);
+    debug_return_bool(true);
+bad_unlink:
+    unlink(tmp_path);
+bad:
+    if (fd != -1)
+	close(fd);
+    if (dirp != NULL)
+	closedir(dirp);
+    free(entries);
+    debug_return_bool(false);
+}
+
+/*
+ * Open the outgoing queue manifest at startup, creating it from
+ * the outgoing directory if needed.  Journals are read in lazily,
+ * oldest first, as the queue is processed.
+ */
+bool
+logsrvd_queue_scan(struct sudo_event_base *evbase)
+{
+    char path[PATH_MAX];
+    int dirlen, len;
     debug_decl(logsrvd_queue_scan, SUDO_DEBUG_UTIL);
 
     /* Must have at least one relay server. */
@@ -229,46 +823,28 @@ logsrvd_queue_scan(struct sudo_event_base *evbase)
     dirlen -= sizeof(RELAY_TEMPLATE) - 1;
     path[dirlen] = '\0';
 
-    dirp = opendir(path);
-    if (dirp == NULL) {
+    len = snprintf(manifest.path, sizeof(manifest.path), "%s/%s",
+	logsrvd_conf_relay_dir(), QUEUE_MANIFEST);
+    if (len >= ssizeof(manifest.path)) {
+	errno = ENAMETOOLONG;
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
-	    "unable to opendir %s", path);
+	    "%s/%s", logsrvd_conf_relay_dir(), QUEUE_MANIFEST);
+	manifest.path[0] = '\0';
 	debug_return_bool(false);
     }
-    prefix_len = strcspn(RELAY_TEMPLATE, "X");
-    while ((dent = readdir(dirp)) != NULL) {
-	struct outgoing_journal *oj;
-
-	/* Skip anything that is not a relay temp file. */
-	if (NAMLEN(dent) != sizeof(RELAY_TEMPLATE) - 1)
-	    continue;
-	if (strncmp(dent->d_name, RELAY_TEMPLATE, prefix_len) != 0)
-	    continue;
 
-	/* Add to queue. */
-	path[dirlen] = '\0';
-	if (strlcat(path, dent->d_name, sizeof(path)) >= sizeof(path))
-	    continue;
-	if ((oj = malloc(sizeof(*oj))) == NULL)
-	    goto oom;
-	if ((oj->journal_path = strdup(path)) == NULL) {
-	    free(oj);
-	    goto oom;
-	}
-	TAILQ_INSERT_TAIL(&outgoing_journal_queue, oj, entries);
+    if (!manifest_open(false)) {
+	if (errno != ENOENT)
+	    debug_return_bool(false);
+	if (!manifest_create(path) || !manifest_open(false))
+	    debug_return_bool(false);
     }
-    closedir(dirp);
 
     /* Process the queue immediately. */
     if (!logsrvd_queue_enable(0, evbase))
 	debug_return_bool(false);
 
     debug_return_bool(true);
-oom:
-    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
-	"unable to allocate memory");
-    closedir(dirp);
-    debug_return_bool(false);
 }
 
 /*
@@ -280,6 +856,17 @@ logsrvd_queue_dump(void)
     struct outgoing_journal *oj;
     debug_decl(logsrvd_queue_dump, SUDO_DEBUG_UTIL);
 
+    if (manifest.fp != NULL) {
+	sudo_debug_printf(SUDO_DEBUG_INFO,
+	    "outgoing queue manifest %s: offset %lld of %lld bytes",
+	    manifest.path, (long long)manifest.offset, (long long)manifest.size);
+    }
+    if (!TAILQ_EMPTY(&inflight_journal_queue)) {
+	sudo_debug_printf(SUDO_DEBUG_INFO, "in-flight journals:");
+	TAILQ_FOREACH(oj, &inflight_journal_queue, entries) {
+	    sudo_debug_printf(SUDO_DEBUG_INFO, "  %s", oj->journal_path);
+	}
+    }
     if (TAILQ_EMPTY(&outgoing_journal_queue))
 	debug_return;
 
@@ -287,4 +874,6 @@ logsrvd_queue_dump(void)
     TAILQ_FOREACH(oj, &outgoing_journal_queue, entries) {
 	sudo_debug_printf(SUDO_DEBUG_INFO, "  %s", oj->journal_path);
     }
+
+    debug_return;
 }
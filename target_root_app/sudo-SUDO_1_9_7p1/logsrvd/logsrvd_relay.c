@@ -62,11 +62,14 @@
 
 #include "log_server.pb-c.h"
 #include "logsrvd.h"
+#include "iolog_fault.h"
 
 static void relay_client_msg_cb(int fd, int what, void *v);
 static void relay_server_msg_cb(int fd, int what, void *v);
 static void connect_cb(int sock, int what, void *v);
-static bool start_relay(int sock, struct connection_closure *closure);
+static bool start_relay(int sock, struct relay_closure *relay_closure);
+static int relay_attempt_start(struct relay_closure *relay_closure);
+static void relay_attempts_cancel(struct relay_closure *relay_closure);
 
 /*
  * Free a struct relay_closure container and its contents.
@@ -89,11 +92,17 @@ relay_closure_free(struct relay_closure *relay_closure)
     if (relay_closure->relays != NULL)
 	address_list_delref(relay_closure->relays);
     sudo_rcstr_delref(relay_closure->relay_name.name);
+    free(relay_closure->log_id);
     sudo_ev_free(relay_closure->read_ev);
     sudo_ev_free(relay_closure->write_ev);
-    sudo_ev_free(relay_closure->connect_ev);
+    sudo_ev_free(relay_closure->buffered_ev);
+    relay_attempts_cancel(relay_closure);
+    sudo_ev_free(relay_closure->fault_read_ev);
+    sudo_ev_free(relay_closure->fault_write_ev);
     free(relay_closure->read_buf.data);
     while ((buf = TAILQ_FIRST(&relay_closure->write_bufs)) != NULL) {
+	if (buf->trace_seq != 0)
+	    trace_unqueued(relay_closure->parent, buf->trace_seq);
 	TAILQ_REMOVE(&relay_closure->write_bufs, buf, entries);
 	free(buf->data);
 	free(buf);
@@ -106,20 +115,24 @@ relay_closure_free(struct relay_closure *relay_closure)
 }
 
 /*
- * Allocate a relay closure.
+ * Allocate a relay closure and add it to the connection's relay list.
  * Note that allocation of the events is deferred until we know the socket.
  */
 static struct relay_closure *
-relay_closure_alloc(void)
+relay_closure_alloc(struct connection_closure *closure)
 {
     struct relay_closure *relay_closure;
+    unsigned int i;
     debug_decl(relay_closure_alloc, SUDO_DEBUG_UTIL);
 
     if ((relay_closure = calloc(1, sizeof(*relay_closure))) == NULL)
 	debug_return_ptr(NULL);
 
     /* We take a reference to relays so it doesn't change while connecting. */
+    relay_closure->parent = closure;
     relay_closure->sock = -1;
+    for (i = 0; i < RELAY_ATTEMPTS_MAX; i++)
+	relay_closure->attempts[i].sock = -1;
     relay_closure->relays = logsrvd_conf_relay_address();
     address_list_addref(relay_closure->relays);
     TAILQ_INIT(&relay_closure->write_bufs);
@@ -129,6 +142,8 @@ relay_closure_alloc(void)
     if (relay_closure->read_buf.data == NULL)
 	goto bad;
 
+    TAILQ_INSERT_TAIL(&closure->relay_closures, relay_closure, entries);
+
     debug_return_ptr(relay_closure);
 bad:
     relay_closure_free(relay_closure);
@@ -136,18 +151,17 @@ bad:
 }
 
 /*
- * Allocate a new buffer, copy buf to it and insert on the write queue.
- * On success the relay write event is enabled.
+ * Allocate a new buffer for each relay, copy buf to it and insert it on
+ * that relay's write queue.  On success the relay write events are enabled.
  * The length parameter does not include space for the message's wire size.
  */
 static bool
 relay_enqueue_write(uint8_t *msgbuf, size_t len,
     struct connection_closure *closure)
 {
-    struct relay_closure *relay_closure = closure->relay_closure;
+    struct relay_closure *relay_closure;
     struct connection_buffer *buf;
     uint32_t msg_len;
-    bool ret = false;
     debug_decl(relay_enqueue_write, SUDO_DEBUG_UTIL);
 
     /* Wire message size is used for length encoding, precedes message. */
@@ -156,32 +170,36 @@ relay_enqueue_write(uint8_t *msgbuf, size_t len,
     sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
 	"size + client message %zu bytes", len);
 
-    if ((buf = get_free_buf(sizeof(msg_len) + len, closure)) == NULL) {
-	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
-	    "unable to allocate connection_buffer");
-	goto done;
-    }
-    memcpy(buf->data, &msg_len, sizeof(msg_len));
-    memcpy(buf->data + sizeof(msg_len), msgbuf, len);
-    buf->len = sizeof(msg_len) + len;
-
-    if (sudo_ev_add(closure->evbase, relay_closure->write_ev, NULL, false) == -1) {
-	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
-	    "unable to add server write event");
-	goto done;
-    }
-
-    TAILQ_INSERT_TAIL(&relay_closure->write_bufs, buf, entries);
-    buf = NULL;
+    TAILQ_FOREACH(relay_closure, &closure->relay_closures, entries) {
+	if ((buf = get_free_buf(sizeof(msg_len) + len, closure)) == NULL) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to allocate connection_buffer");
+	    debug_return_bool(false);
+	}
+	memcpy(buf->data, &msg_len, sizeof(msg_len));
+	memcpy(buf->data + sizeof(msg_len), msgbuf, len);
+	buf->len = sizeof(msg_len) + len;
+
+	/* The write event is re-enabled after an injected delay. */
+	if (relay_closure->fault_write_ev != NULL &&
+		sudo_ev_pending(relay_closure->fault_write_ev, SUDO_EV_TIMEOUT,
+		NULL)) {
+	    TAILQ_INSERT_TAIL(&relay_closure->write_bufs, buf, entries);
+	    continue;
+	}
 
-    ret = true;
+	if (sudo_ev_add(closure->evbase, relay_closure->write_ev, NULL, false) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to add server write event");
+	    free(buf->data);
+	    free(buf);
+	    debug_return_bool(false);
+	}
 
-done:
-    if (buf != NULL) {
-	free(buf->data);
-	free(buf);
+	TAILQ_INSERT_TAIL(&relay_closure->write_bufs, buf, entries);
     }
-    debug_return_bool(ret);
+
+    debug_return_bool(true);
 }
 
 /*
@@ -189,9 +207,9 @@ done:
  * Returns true on success, false on failure.
  */
 static bool
-fmt_client_message(struct connection_closure *closure, ClientMessage *msg)
+fmt_client_message(struct relay_closure *relay_closure, ClientMessage *msg)
 {
-    struct relay_closure *relay_closure = closure->relay_closure;
+    struct connection_closure *closure = relay_closure->parent;
     struct connection_buffer *buf = NULL;
     uint32_t msg_len;
     bool ret = false;
@@ -229,9 +247,9 @@ done:
 }
 
 static bool
-fmt_client_hello(struct connection_closure *closure)
+fmt_client_hello(struct relay_closure *relay_closure)
 {
-    struct relay_closure *relay_closure = closure->relay_closure;
+    struct connection_closure *closure = relay_closure->parent;
     ClientMessage client_msg = CLIENT_MESSAGE__INIT;
     ClientHello hello_msg = CLIENT_HELLO__INIT;
     bool ret;
@@ -242,7 +260,7 @@ fmt_client_hello(struct connection_closure *closure)
 
     client_msg.u.hello_msg = &hello_msg;
     client_msg.type_case = CLIENT_MESSAGE__TYPE_HELLO_MSG;
-    ret = fmt_client_message(closure, &client_msg);
+    ret = fmt_client_message(relay_closure, &client_msg);
     if (ret) {
 	if (sudo_ev_add(closure->evbase, relay_closure->read_ev, NULL, false) == -1) {
 	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
@@ -271,23 +289,23 @@ tls_client_start_fn(struct tls_client_closure *tls_client)
 
 /* Perform TLS connection to the relay host. */
 static bool
-connect_relay_tls(struct connection_closure *closure)
+connect_relay_tls(struct relay_closure *relay_closure)
 {
-    struct tls_client_closure *tls_client = &closure->relay_closure->tls_client;
+    struct tls_client_closure *tls_client = &relay_closure->tls_client;
     SSL_CTX *ssl_ctx = logsrvd_relay_tls_ctx();
     debug_decl(connect_relay_tls, SUDO_DEBUG_UTIL);
 
     /* Populate struct tls_client_closure. */
-    tls_client->parent_closure = closure;
-    tls_client->evbase = closure->evbase;
-    tls_client->tls_connect_ev = sudo_ev_alloc(closure->relay_closure->sock,
+    tls_client->parent_closure = relay_closure;
+    tls_client->evbase = relay_closure->parent->evbase;
+    tls_client->tls_connect_ev = sudo_ev_alloc(relay_closure->sock,
 	SUDO_EV_WRITE, tls_connect_cb, tls_client);
     if (tls_client->tls_connect_ev == NULL)
         goto bad;
-    tls_client->peer_name = &closure->relay_closure->relay_name;
+    tls_client->peer_name = &relay_closure->relay_name;
     tls_client->connect_timeout = *logsrvd_conf_relay_connect_timeout();
     tls_client->start_fn = tls_client_start_fn;
-    if (!tls_ctx_client_setup(ssl_ctx, closure->relay_closure->sock, tls_client))
+    if (!tls_ctx_client_setup(ssl_ctx, relay_closure->sock, tls_client))
         goto bad;
 
     debug_return_bool(true);
@@ -297,30 +315,76 @@ bad:
 #endif /* HAVE_OPENSSL */
 
 /*
- * Try to connect to the next relay host.
- * Returns 0 on success, -1 on error, setting errno.
- * If there is no next relay, errno is set to ENOENT.
+ * Returns true if another relay for the same connection is using
+ * (or trying to use) the same relay host as relay.
+ * Replicas must be stored on different hosts to be useful.
  */
-int
-connect_relay_next(struct connection_closure *closure)
+bool
+relay_host_in_use(struct relay_closure *relay_closure,
+    struct server_address *relay)
+{
+    struct relay_closure *rc;
+    unsigned int i;
+    debug_decl(relay_host_in_use, SUDO_DEBUG_UTIL);
+
+    TAILQ_FOREACH(rc, &relay_closure->parent->relay_closures, entries) {
+	if (rc == relay_closure)
+	    continue;
+	if (rc->relay_addr != NULL &&
+		strcmp(rc->relay_addr->sa_host, relay->sa_host) == 0)
+	    debug_return_bool(true);
+	for (i = 0; i < RELAY_ATTEMPTS_MAX; i++) {
+	    struct relay_attempt *attempt = &rc->attempts[i];
+
+	    if (attempt->sock != -1 &&
+		    strcmp(attempt->addr->sa_host, relay->sa_host) == 0)
+		debug_return_bool(true);
+	}
+    }
+    debug_return_bool(false);
+}
+
+/*
+ * Store the IP address of relay as a string in buf.
+ * Returns false if the address family is not supported.
+ */
+bool
+relay_format_addr(struct server_address *relay, char *buf, size_t bufsize)
 {
-    struct relay_closure *relay_closure = closure->relay_closure;
-    struct server_address *relay;
-    int ret, sock = -1;
     char *addr;
-    debug_decl(connect_relay_next, SUDO_DEBUG_UTIL);
+    debug_decl(relay_format_addr, SUDO_DEBUG_UTIL);
 
-    /* Get next relay or return ENOENT none are left. */
-    if (relay_closure->relay_addr != NULL) {
-	relay = TAILQ_NEXT(relay_closure->relay_addr, entries);
-    } else {
-	relay = TAILQ_FIRST(relay_closure->relays);
-    }
-    if (relay == NULL) {
-	errno = ENOENT;
-	goto bad;
+    switch (relay->sa_un.sa.sa_family) {
+    case AF_INET:
+	addr = (char *)&relay->sa_un.sin.sin_addr;
+	break;
+    case AF_INET6:
+	addr = (char *)&relay->sa_un.sin6.sin6_addr;
+	break;
+    default:
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unsupported address family from connect(): %d",
+	    relay->sa_un.sa.sa_family);
+	debug_return_bool(false);
     }
-    relay_closure->relay_addr = relay;
+    inet_ntop(relay->sa_un.sa.sa_family, addr, buf, bufsize);
+    debug_return_bool(true);
+}
+
+/*
+ * Create a non-blocking socket and start connecting it to relay.
+ * Returns the socket on success, or -1 on error, setting errno.
+ * If the connection completed without blocking, connected is set to true.
+ * With TCP Fast Open, a relay we have a cookie for connects immediately
+ * and the SYN is sent along with the first message, so it must not be
+ * used for attempts that are raced against each other.
+ */
+int
+relay_connect_start(struct server_address *relay, bool fastopen,
+    bool *connected)
+{
+    int flags, sock;
+    debug_decl(relay_connect_start, SUDO_DEBUG_UTIL);
 
     sock = socket(relay->sa_un.sa.sa_family, SOCK_STREAM, 0);
     if (sock == -1) {
@@ -336,86 +400,522 @@ connect_relay_next(struct connection_closure *closure)
 		"unable to set SO_KEEPALIVE option");
 	}
     }
-    ret = fcntl(sock, F_GETFL, 0);
-    if (ret == -1 || fcntl(sock, F_SETFL, ret | O_NONBLOCK) == -1) {
+#ifdef TCP_FASTOPEN_CONNECT
+    if (fastopen) {
+	int on = 1;
+	if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on,
+		sizeof(on)) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to set TCP_FASTOPEN_CONNECT option");
+	}
+    }
+#endif
+    flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
 	    "fcntl(O_NONBLOCK) failed");
 	goto bad;
     }
 
-    ret = connect(sock, &relay->sa_un.sa, relay->sa_size);
-    if (ret == -1 && errno != EINPROGRESS)
+    if (connect(sock, &relay->sa_un.sa, relay->sa_size) == 0) {
+	*connected = true;
+    } else if (errno == EINPROGRESS) {
+	*connected = false;
+    } else {
 	goto bad;
+    }
+    debug_return_int(sock);
 
-    switch (relay->sa_un.sa.sa_family) {
-    case AF_INET:
-	addr = (char *)&relay->sa_un.sin.sin_addr;
-	break;
-    case AF_INET6:
-	addr = (char *)&relay->sa_un.sin6.sin6_addr;
-	break;
-    default:
+bad:
+    if (sock != -1) {
+	int save_errno = errno;
+	close(sock);
+	errno = save_errno;
+    }
+    debug_return_int(-1);
+}
+
+/*
+ * Returns the next relay address after the last one attempted that is
+ * not used by another replica, or NULL if there are none left.
+ */
+static struct server_address *
+relay_next_addr(struct relay_closure *relay_closure)
+{
+    struct server_address *relay;
+    debug_decl(relay_next_addr, SUDO_DEBUG_UTIL);
+
+    if (relay_closure->relay_tried != NULL) {
+	relay = TAILQ_NEXT(relay_closure->relay_tried, entries);
+    } else {
+	relay = TAILQ_FIRST(relay_closure->relays);
+    }
+    while (relay != NULL && relay_host_in_use(relay_closure, relay))
+	relay = TAILQ_NEXT(relay, entries);
+    debug_return_ptr(relay);
+}
+
+/*
+ * Abandon all connection attempts that are still in progress.
+ */
+static void
+relay_attempts_cancel(struct relay_closure *relay_closure)
+{
+    unsigned int i;
+    debug_decl(relay_attempts_cancel, SUDO_DEBUG_UTIL);
+
+    for (i = 0; i < RELAY_ATTEMPTS_MAX; i++) {
+	struct relay_attempt *attempt = &relay_closure->attempts[i];
+
+	if (attempt->sock == -1)
+	    continue;
+	sudo_ev_free(attempt->ev);
+	attempt->ev = NULL;
+	close(attempt->sock);
+	attempt->sock = -1;
+	attempt->addr = NULL;
+    }
+    relay_closure->nattempts = 0;
+    sudo_ev_free(relay_closure->stagger_ev);
+    relay_closure->stagger_ev = NULL;
+
+    debug_return;
+}
+
+/*
+ * Returns true if any of the connection's relays is still connecting.
+ */
+static bool
+relay_connecting(struct connection_closure *closure)
+{
+    struct relay_closure *relay_closure;
+    debug_decl(relay_connecting, SUDO_DEBUG_UTIL);
+
+    TAILQ_FOREACH(relay_closure, &closure->relay_closures, entries) {
+	if (relay_closure->nattempts != 0)
+	    debug_return_bool(true);
+    }
+    debug_return_bool(false);
+}
+
+static unsigned int
+relay_count(struct connection_closure *closure)
+{
+    struct relay_closure *relay_closure;
+    unsigned int count = 0;
+
+    TAILQ_FOREACH(relay_closure, &closure->relay_closures, entries)
+	count++;
+    return count;
+}
+
+/*
+ * Returns true if any of the connection's relay sockets is still open.
+ */
+static bool
+relay_open(struct connection_closure *closure)
+{
+    struct relay_closure *relay_closure;
+    debug_decl(relay_open, SUDO_DEBUG_UTIL);
+
+    TAILQ_FOREACH(relay_closure, &closure->relay_closures, entries) {
+	if (relay_closure->sock != -1)
+	    debug_return_bool(true);
+    }
+    debug_return_bool(false);
+}
+
+/*
+ * Once every relay has said hello, start talking to the client.
+ * Returns false on error.
+ */
+static bool
+relay_check_ready(struct connection_closure *closure)
+{
+    struct relay_closure *relay_closure;
+    debug_decl(relay_check_ready, SUDO_DEBUG_UTIL);
+
+    if (closure->relays_ready)
+	debug_return_bool(true);
+    TAILQ_FOREACH(relay_closure, &closure->relay_closures, entries) {
+	if (!relay_closure->ready)
+	    debug_return_bool(true);
+    }
+    closure->relays_ready = true;
+    closure->state = INITIAL;
+
+    debug_return_bool(start_protocol(closure));
+}
+
+/*
+ * Pass the newest commit point acknowledged by a quorum of relays
+ * back to the client.  After the command has exited, the final commit
+ * point is not sent until a quorum of relays have sent theirs.
+ * Returns false on error.
+ */
+static bool
+relay_update_commit(struct connection_closure *closure)
+{
+    const unsigned int quorum = logsrvd_conf_relay_commit_quorum();
+    struct timespec points[RELAY_REPLICAS_MAX];
+    struct relay_closure *relay_closure;
+    TimeSpec commit_point = TIME_SPEC__INIT;
+    unsigned int i, n = 0, nfinished = 0;
+    debug_decl(relay_update_commit, SUDO_DEBUG_UTIL);
+
+    /* Sort relay commit points, newest first. */
+    TAILQ_FOREACH(relay_closure, &closure->relay_closures, entries) {
+	if (n == RELAY_REPLICAS_MAX)
+	    break;
+	if (relay_closure->finished)
+	    nfinished++;
+	for (i = n++; i > 0; i--) {
+	    if (sudo_timespeccmp(&points[i - 1], &relay_closure->commit_point, >=))
+		break;
+	    points[i] = points[i - 1];
+	}
+	points[i] = relay_closure->commit_point;
+    }
+    if (n < quorum)
+	debug_return_bool(true);
+
+    if (closure->state == EXITED) {
+	if (nfinished < quorum)
+	    debug_return_bool(true);
+    } else if (sudo_timespeccmp(&points[quorum - 1], &closure->relay_commit, <=)) {
+	/* No new data committed by a quorum of relays. */
+	debug_return_bool(true);
+    }
+    closure->relay_commit = points[quorum - 1];
+
+    commit_point.tv_sec = closure->relay_commit.tv_sec;
+    commit_point.tv_nsec = (int32_t)closure->relay_commit.tv_nsec;
+    debug_return_bool(schedule_commit_point(&commit_point, closure));
+}
+
+/*
+ * Name used to match a relay with its entry in a replicated log ID.
+ */
+static const char *
+relay_host(struct relay_closure *relay_closure)
+{
+    if (relay_closure->relay_name.name != NULL)
+	return relay_closure->relay_name.name;
+    return relay_closure->relay_name.ipaddr;
+}
+
+/*
+ * Once every relay has assigned a log ID, pass them to the client
+ * as "logid/relayhost" entries separated by RELAY_LOG_ID_SEP.
+ * relay_restart() splits them up again.
+ * Returns false on error.
+ */
+static bool
+relay_send_log_id(struct connection_closure *closure)
+{
+    struct relay_closure *relay_closure;
+    char *new_id, *cp;
+    size_t len = 0;
+    int n;
+    debug_decl(relay_send_log_id, SUDO_DEBUG_UTIL);
+
+    /* No client connection when replaying a journaled entry. */
+    if (closure->write_ev == NULL || closure->log_id_sent)
+	debug_return_bool(true);
+
+    TAILQ_FOREACH(relay_closure, &closure->relay_closures, entries) {
+	if (relay_closure->log_id == NULL)
+	    debug_return_bool(true);
+	len += strlen(relay_closure->log_id) +
+	    strlen(relay_host(relay_closure)) + 2;
+    }
+    if (len == 0)
+	debug_return_bool(true);
+
+    if ((new_id = malloc(len)) == NULL) {
+	closure->errstr = _("unable to allocate memory");
+	debug_return_bool(false);
+    }
+    cp = new_id;
+    TAILQ_FOREACH(relay_closure, &closure->relay_closures, entries) {
+	if (cp != new_id)
+	    *cp++ = RELAY_LOG_ID_SEP;
+	n = snprintf(cp, len - (size_t)(cp - new_id), "%s/%s",
+	    relay_closure->log_id, relay_host(relay_closure));
+	cp += n;
+    }
+
+    if (!fmt_log_id_message(new_id, closure)) {
+	free(new_id);
+	debug_return_bool(false);
+    }
+    free(new_id);
+    if (sudo_ev_add(closure->evbase, closure->write_ev,
+	    logsrvd_conf_relay_timeout(), false) == -1) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
-	    "unsupported address family from connect(): %d",
-	    relay->sa_un.sa.sa_family);
-	goto bad;
+	    "unable to add server write event");
+	closure->errstr = _("unable to allocate memory");
+	debug_return_bool(false);
+    }
+    closure->log_id_sent = true;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Remove a relay from the connection and free it.
+ */
+static void
+relay_drop(struct relay_closure *relay_closure, const char *reason)
+{
+    struct connection_closure *closure = relay_closure->parent;
+    debug_decl(relay_drop, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+	"dropping relay %s (%s): %s",
+	relay_closure->relay_name.name ? relay_closure->relay_name.name :
+	"unknown", relay_closure->relay_name.ipaddr,
+	reason ? reason : "unknown error");
+    TAILQ_REMOVE(&closure->relay_closures, relay_closure, entries);
+    if (closure->relay_closure == relay_closure)
+	closure->relay_closure = TAILQ_FIRST(&closure->relay_closures);
+    relay_closure_free(relay_closure);
+
+    debug_return;
+}
+
+/*
+ * A relay connection failed or the relay host reported an error.
+ * If the remaining relays can still satisfy the commit quorum the
+ * failed relay is dropped, otherwise the error is sent to the client.
+ * The caller must not use relay_closure after calling this function.
+ */
+static void
+relay_failed(struct relay_closure *relay_closure, const char *errstr)
+{
+    struct connection_closure *closure = relay_closure->parent;
+    debug_decl(relay_failed, SUDO_DEBUG_UTIL);
+
+    /* Stop talking to the failed relay. */
+    if (relay_closure->read_ev != NULL)
+	sudo_ev_del(closure->evbase, relay_closure->read_ev);
+    if (relay_closure->write_ev != NULL)
+	sudo_ev_del(closure->evbase, relay_closure->write_ev);
+
+    if (!closure->error &&
+	    relay_count(closure) > logsrvd_conf_relay_commit_quorum()) {
+	relay_drop(relay_closure, errstr);
+	closure->errstr = NULL;
+
+	/*
+	 * The remaining relays may now be ready, have all sent
+	 * their log IDs or satisfy the quorum.
+	 */
+	if (closure->state == CONNECTING && !relay_connecting(closure))
+	    closure->state = INITIAL;
+	if (relay_check_ready(closure) && relay_send_log_id(closure) &&
+		relay_update_commit(closure))
+	    debug_return;
+	errstr = closure->errstr;
     }
-    inet_ntop(relay->sa_un.sa.sa_family, addr,
-	relay_closure->relay_name.ipaddr,
+
+    /*
+     * Try to send client an error message before closing connection.
+     * If we are already in an error state, just give up.
+     */
+    if (!schedule_error_message(errstr, closure))
+	connection_close(closure);
+
+    debug_return;
+}
+
+/*
+ * A connection to relay succeeded, abandon any other attempts and
+ * start the TLS handshake or the conversation with the relay host.
+ * Returns false on error, setting closure->errstr.
+ */
+static bool
+relay_connected(struct relay_closure *relay_closure,
+    struct server_address *relay, int sock)
+{
+    struct connection_closure *closure = relay_closure->parent;
+    debug_decl(relay_connected, SUDO_DEBUG_UTIL);
+
+    relay_attempts_cancel(relay_closure);
+    relay_closure->relay_addr = relay;
+    relay_closure->sock = sock;
+    (void)relay_format_addr(relay, relay_closure->relay_name.ipaddr,
 	sizeof(relay_closure->relay_name.ipaddr));
     relay_closure->relay_name.name = sudo_rcstr_addref(relay->sa_host);
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"connected to relay %s (%s)", relay_closure->relay_name.name,
+	relay_closure->relay_name.ipaddr);
+
+    /* Other replicas may still be connecting. */
+    if (closure->state == CONNECTING && !relay_connecting(closure))
+	closure->state = INITIAL;
 
-    if (ret == 0) {
-	if (relay_closure->sock != -1)
-	    close(relay_closure->sock);
-	relay_closure->sock = sock;
 #if defined(HAVE_OPENSSL)
-	/* Relay connection succeeded, start TLS handshake. */
-	if (relay_closure->relay_addr->tls) {
-	    if (!connect_relay_tls(closure))
-		goto bad;
-	} else
+    /* Relay connection succeeded, start TLS handshake. */
+    if (relay->tls) {
+	if (!connect_relay_tls(relay_closure)) {
+	    closure->errstr = _("TLS handshake with relay host failed");
+	    debug_return_bool(false);
+	}
+	debug_return_bool(true);
+    }
 #endif
-	{
-	    /* Connection succeeded without blocking. */
-	    if (!start_relay(sock, closure))
-		goto bad;
+    /* Relay connection succeeded, start talking to the relay. */
+    if (!start_relay(sock, relay_closure)) {
+	closure->errstr = _("unable to allocate memory");
+	debug_return_bool(false);
+    }
+    debug_return_bool(true);
+}
+
+/*
+ * No connection by the time the connection attempt delay expired,
+ * race the next relay address against the attempts in progress.
+ */
+static void
+relay_stagger_cb(int unused, int what, void *v)
+{
+    struct relay_closure *relay_closure = v;
+    struct connection_closure *closure = relay_closure->parent;
+    debug_decl(relay_stagger_cb, SUDO_DEBUG_UTIL);
+
+    if (relay_attempt_start(relay_closure) == -1) {
+	if (relay_closure->nattempts == 0)
+	    relay_failed(relay_closure, closure->errstr);
+    }
+
+    debug_return;
+}
+
+/*
+ * Schedule another connection attempt if the attempts in progress
+ * have not connected within the connection attempt delay.
+ * This is the "Happy Eyeballs" algorithm from RFC 8305.
+ */
+static void
+relay_stagger_arm(struct relay_closure *relay_closure)
+{
+    struct connection_closure *closure = relay_closure->parent;
+    struct timespec *delay = logsrvd_conf_relay_connect_delay();
+    debug_decl(relay_stagger_arm, SUDO_DEBUG_UTIL);
+
+    if (delay == NULL || relay_closure->nattempts >= RELAY_ATTEMPTS_MAX)
+	debug_return;
+    if (relay_next_addr(relay_closure) == NULL)
+	debug_return;
+
+    if (relay_closure->stagger_ev == NULL) {
+	relay_closure->stagger_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT,
+	    relay_stagger_cb, relay_closure);
+    }
+    if (relay_closure->stagger_ev == NULL || sudo_ev_add(closure->evbase,
+	    relay_closure->stagger_ev, delay, false) == -1) {
+	/* Not fatal, the next address is tried when this attempt fails. */
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add relay connect delay event");
+    }
+
+    debug_return;
+}
+
+/*
+ * Start a connection attempt to the next relay address not used by
+ * another replica.  Returns 1 if the relay connected without blocking,
+ * 0 if the attempt is in progress, or -1 if no attempt was started.
+ * If -1 is returned and no other attempts are in progress,
+ * closure->errstr is set.
+ */
+static int
+relay_attempt_start(struct relay_closure *relay_closure)
+{
+    struct connection_closure *closure = relay_closure->parent;
+    struct relay_attempt *attempt = NULL;
+    struct server_address *relay;
+    bool connected, fastopen;
+    unsigned int i;
+    int sock;
+    debug_decl(relay_attempt_start, SUDO_DEBUG_UTIL);
+
+    for (i = 0; i < RELAY_ATTEMPTS_MAX; i++) {
+	if (relay_closure->attempts[i].sock == -1) {
+	    attempt = &relay_closure->attempts[i];
+	    break;
 	}
-    } else {
-	/* Connection will be completed in connect_cb(). */
-	relay_closure->connect_ev = sudo_ev_alloc(sock, SUDO_EV_WRITE,
-	    connect_cb, closure);
-	if (relay_closure->connect_ev == NULL)
-	    goto bad;
-	if (sudo_ev_add(closure->evbase, relay_closure->connect_ev,
-		logsrvd_conf_relay_connect_timeout(), false) == -1) {
-	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
-		"unable to add server connect event");
+    }
+    if (attempt == NULL)
+	debug_return_int(-1);
+
+    /* Get next relay address or fail if none are left. */
+    for (;;) {
+	relay = relay_next_addr(relay_closure);
+	if (relay == NULL)
 	    goto bad;
-	}
-	if (relay_closure->sock != -1)
-	    close(relay_closure->sock);
-	relay_closure->sock = sock;
-	closure->state = CONNECTING;
+	relay_closure->relay_tried = relay;
+
+	/*
+	 * A Fast Open connect() completes before the relay has answered,
+	 * so a dead relay would win any race.  Only use it when this is
+	 * the one address being tried.
+	 */
+	fastopen = logsrvd_conf_relay_tcp_fastopen() &&
+	    (logsrvd_conf_relay_connect_delay() == NULL ||
+	    (relay_closure->nattempts == 0 &&
+	    relay_next_addr(relay_closure) == NULL));
+	sock = relay_connect_start(relay, fastopen, &connected);
+	if (sock != -1)
+	    break;
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to connect to relay %s", relay->sa_str);
     }
-    debug_return_int(ret);
 
-bad:
-    /* Connection or system error. */
-    if (sock != -1)
+    if (connected) {
+	/* Connection succeeded without blocking. */
+	if (!relay_connected(relay_closure, relay, sock))
+	    debug_return_int(-1);
+	debug_return_int(1);
+    }
+
+    /* Connection will be completed in connect_cb(). */
+    attempt->ev = sudo_ev_alloc(sock, SUDO_EV_WRITE, connect_cb, attempt);
+    if (attempt->ev == NULL || sudo_ev_add(closure->evbase, attempt->ev,
+	    logsrvd_conf_relay_connect_timeout(), false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add server connect event");
+	sudo_ev_free(attempt->ev);
+	attempt->ev = NULL;
 	close(sock);
-    sudo_rcstr_delref(relay_closure->relay_name.name);
-    relay_closure->relay_name.name = NULL;
-    sudo_ev_free(relay_closure->connect_ev);
-    relay_closure->connect_ev = NULL;
+	goto bad;
+    }
+    attempt->relay_closure = relay_closure;
+    attempt->addr = relay;
+    attempt->sock = sock;
+    relay_closure->nattempts++;
+    closure->state = CONNECTING;
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"connecting to relay %s, %u attempt(s) in progress", relay->sa_str,
+	relay_closure->nattempts);
+
+    relay_stagger_arm(relay_closure);
+    debug_return_int(0);
+
+bad:
+    if (relay_closure->nattempts == 0)
+	closure->errstr = _("unable to connect to relay host");
     debug_return_int(-1);
 }
 
 static void
 connect_cb(int sock, int what, void *v)
 {
-    struct connection_closure *closure = v;
-    struct relay_closure *relay_closure = closure->relay_closure;
+    struct relay_attempt *attempt = v;
+    struct relay_closure *relay_closure = attempt->relay_closure;
+    struct connection_closure *closure = relay_closure->parent;
+    struct server_address *relay = attempt->addr;
     int errnum, optval, ret;
     socklen_t optlen = sizeof(optval);
     debug_decl(connect_cb, SUDO_DEBUG_UTIL);
@@ -426,70 +926,75 @@ connect_cb(int sock, int what, void *v)
 	ret = getsockopt(sock, SOL_SOCKET, SO_ERROR, &optval, &optlen);
 	errnum = ret == 0 ? optval : errno;
     }
+
+    /* This attempt is over either way. */
+    sudo_ev_free(attempt->ev);
+    attempt->ev = NULL;
+    attempt->sock = -1;
+    attempt->addr = NULL;
+    relay_closure->nattempts--;
+
     if (errnum == 0) {
-	closure->state = INITIAL;
-#if defined(HAVE_OPENSSL)
-	/* Relay connection succeeded, start TLS handshake. */
-	if (relay_closure->relay_addr->tls) {
-	    if (!connect_relay_tls(closure)) {
-		closure->errstr = _("TLS handshake with relay host failed");
-		if (!schedule_error_message(closure->errstr, closure))
-		    connection_close(closure);
-	    }
-	} else
-#endif
-	{
-	    /* Relay connection succeeded, start talking to the client.  */
-	    if (!start_relay(sock, closure)) {
-		closure->errstr = _("unable to allocate memory");
-		if (!schedule_error_message(closure->errstr, closure))
-		    connection_close(closure);
-	    }
-	}
-    } else {
-	/* Connection failed, try next relay (if any). */
-	int res;
-	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
-	    "unable to connect to relay %s (%s): %s",
-	    relay_closure->relay_name.name, relay_closure->relay_name.ipaddr,
-	    strerror(errnum));
-	while ((res = connect_relay_next(closure)) == -1) {
-	    if (errno == ENOENT || errno == EINPROGRESS) {
-		/* Out of relays or connecting asynchronously. */
-		break;
-	    }
-	}
-	if (res == -1 && errno != EINPROGRESS) {
-	    closure->errstr = _("unable to connect to relay host");
-	    if (!schedule_error_message(closure->errstr, closure))
-		connection_close(closure);
-	}
+	if (!relay_connected(relay_closure, relay, sock))
+	    relay_failed(relay_closure, closure->errstr);
+	debug_return;
+    }
+
+    /* Connection failed, try the next relay address (if any) now. */
+    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+	"unable to connect to relay %s: %s", relay->sa_str, strerror(errnum));
+    close(sock);
+    logsrvd_resolve_retry();
+    if (relay_attempt_start(relay_closure) == -1) {
+	/* Out of relays, unless another attempt is still in progress. */
+	if (relay_closure->nattempts == 0)
+	    relay_failed(relay_closure, closure->errstr);
     }
 
     debug_return;
 }
 
-/* Connect to the first available relay host. */
+/*
+ * Connect to the first available relay host, or to as many different
+ * relay hosts as there are replicas configured.  A standby connection
+ * is used if available, otherwise the relay addresses are raced.
+ */
 bool
 connect_relay(struct connection_closure *closure)
 {
+    const unsigned int replicas = logsrvd_conf_relay_replicas();
     struct relay_closure *relay_closure;
-    int res;
+    unsigned int i;
     debug_decl(connect_relay, SUDO_DEBUG_UTIL);
 
-    relay_closure = closure->relay_closure = relay_closure_alloc();
-    if (relay_closure == NULL)
-	debug_return_bool(false);
+    for (i = 0; i < replicas; i++) {
+	relay_closure = relay_closure_alloc(closure);
+	if (relay_closure == NULL)
+	    debug_return_bool(false);
+
+	if (logsrvd_standby_take(relay_closure)) {
+	    /* Connection (and TLS handshake) already done. */
+	    if (!start_relay(relay_closure->sock, relay_closure))
+		debug_return_bool(false);
+	    continue;
+	}
 
-    while ((res = connect_relay_next(closure)) == -1) {
-	if (errno == ENOENT || errno == EINPROGRESS) {
-	    /* Out of relays or connecting asynchronously. */
+	if (relay_attempt_start(relay_closure) == -1) {
+	    /* No relay host left for this replica. */
+	    TAILQ_REMOVE(&closure->relay_closures, relay_closure, entries);
+	    relay_closure_free(relay_closure);
+	    closure->errstr = NULL;
 	    break;
 	}
     }
+    closure->relay_closure = TAILQ_FIRST(&closure->relay_closures);
 
-    if (res == -1 && errno != EINPROGRESS)
+    if (relay_count(closure) < logsrvd_conf_relay_commit_quorum()) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "only able to connect to %u of %u relay hosts, need %u",
+	    relay_count(closure), replicas, logsrvd_conf_relay_commit_quorum());
 	debug_return_bool(false);
+    }
 
     /* Switch to relay client message handlers. */
     closure->cms = &cms_relay;
@@ -501,12 +1006,12 @@ connect_relay(struct connection_closure *closure)
  * Returns true on success, false on error.
  */
 static bool
-handle_server_hello(ServerHello *msg, struct connection_closure *closure)
+handle_server_hello(ServerHello *msg, struct relay_closure *relay_closure)
 {
-    struct relay_closure *relay_closure = closure->relay_closure;
+    struct connection_closure *closure = relay_closure->parent;
     debug_decl(handle_server_hello, SUDO_DEBUG_UTIL);
 
-    if (closure->state != INITIAL) {
+    if (relay_closure->ready || closure->relays_ready) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 	    "unexpected state %d", closure->state);
 	closure->errstr = _("state machine error");
@@ -527,16 +1032,20 @@ handle_server_hello(ServerHello *msg, struct connection_closure *closure)
 
     /* TODO: handle redirect */
 
+    relay_closure->ready = true;
     debug_return_bool(true);
 }
 
 /*
  * Respond to a CommitPoint message from the relay.
+ * After the command has exited, the relay is finished once its
+ * commit point covers all the I/O we relayed.
  * Returns true on success, false on error.
  */
 static bool
-handle_commit_point(TimeSpec *commit_point, struct connection_closure *closure)
+handle_commit_point(TimeSpec *commit_point, struct relay_closure *relay_closure)
 {
+    struct connection_closure *closure = relay_closure->parent;
     debug_decl(handle_commit_point, SUDO_DEBUG_UTIL);
 
     if (closure->state < RUNNING) {
@@ -546,48 +1055,37 @@ handle_commit_point(TimeSpec *commit_point, struct connection_closure *closure)
 	debug_return_bool(false);
     }
 
-    /* Pass commit point from relay to client. */
-    debug_return_bool(schedule_commit_point(commit_point, closure));
+    relay_closure->commit_point.tv_sec = commit_point->tv_sec;
+    relay_closure->commit_point.tv_nsec = commit_point->tv_nsec;
+    if (closure->state == EXITED && sudo_timespeccmp(
+	    &relay_closure->commit_point, &closure->elapsed_time, >=))
+	relay_closure->finished = true;
+
+    debug_return_bool(true);
 }
 
 /*
  * Respond to a LogId message from the relay.
- * Always returns true.
+ * The client gets a log ID once every relay has sent one.
+ * Returns true on success, false on error.
  */
 static bool
-handle_log_id(char *id, struct connection_closure *closure)
+handle_log_id(char *id, struct relay_closure *relay_closure)
 {
-    char *new_id;
-    bool ret = false;
-    int len;
+    struct connection_closure *closure = relay_closure->parent;
     debug_decl(handle_log_id, SUDO_DEBUG_UTIL);
 
     sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
-	"log ID %s from relay %s (%s)", id,
-	closure->relay_closure->relay_name.name,
-	closure->relay_closure->relay_name.ipaddr);
-
-    /* No client connection when replaying a journaled entry. */
-    if (closure->write_ev == NULL)
-	debug_return_bool(true);
+	"log ID %s from relay %s (%s)", id, relay_closure->relay_name.name,
+	relay_closure->relay_name.ipaddr);
 
-    /* Generate a new log ID that includes the relay host. */
-    len = asprintf(&new_id, "%s/%s", id,
-	closure->relay_closure->relay_name.name);
-    if (len != -1) {
-	if (fmt_log_id_message(id, closure)) {
-	    if (sudo_ev_add(closure->evbase, closure->write_ev,
-		    logsrvd_conf_relay_timeout(), false) == -1) {
-		sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
-		    "unable to add server write event");
-	    } else {
-		ret = true;
-	    }
-	}
-	free(new_id);
+    free(relay_closure->log_id);
+    if ((relay_closure->log_id = strdup(id)) == NULL) {
+	closure->errstr = _("unable to allocate memory");
+	debug_return_bool(false);
     }
 
-    debug_return_bool(ret);
+    debug_return_bool(relay_send_log_id(closure));
 }
 
 /*
@@ -595,9 +1093,8 @@ handle_log_id(char *id, struct connection_closure *closure)
  * Always returns false.
  */
 static bool
-handle_server_error(char *errmsg, struct connection_closure *closure)
+handle_server_error(char *errmsg, struct relay_closure *relay_closure)
 {
-    struct relay_closure *relay_closure = closure->relay_closure;
     debug_decl(handle_server_error, SUDO_DEBUG_UTIL);
 
     sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
@@ -606,13 +1103,7 @@ handle_server_error(char *errmsg, struct connection_closure *closure)
 	errmsg);
 
     /* Server will drop connection after the error message. */
-    sudo_ev_del(closure->evbase, closure->relay_closure->read_ev);
-    sudo_ev_del(closure->evbase, closure->relay_closure->write_ev);
-
-    if (!schedule_error_message(errmsg, closure))
-	debug_return_bool(false);
-
-    debug_return_bool(true);
+    debug_return_bool(false);
 }
 
 /*
@@ -620,9 +1111,8 @@ handle_server_error(char *errmsg, struct connection_closure *closure)
  * Always returns false.
  */
 static bool
-handle_server_abort(char *errmsg, struct connection_closure *closure)
+handle_server_abort(char *errmsg, struct relay_closure *relay_closure)
 {
-    struct relay_closure *relay_closure = closure->relay_closure;
     debug_decl(handle_server_abort, SUDO_DEBUG_UTIL);
 
     sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
@@ -630,21 +1120,23 @@ handle_server_abort(char *errmsg, struct connection_closure *closure)
 	relay_closure->relay_name.name, relay_closure->relay_name.ipaddr,
 	errmsg);
 
-    if (!schedule_error_message(errmsg, closure))
-	debug_return_bool(false);
-
-    debug_return_bool(true);
+    debug_return_bool(false);
 }
 
 /*
  * Respond to a ServerMessage from the relay.
- * Returns true on success, false on error.
+ * Returns true on success.  On error, the relay is dropped or the
+ * error is sent to the client and false is returned, in which case
+ * relay_closure must no longer be used.
  */
 static bool
-handle_server_message(uint8_t *buf, size_t len, struct connection_closure *closure)
+handle_server_message(uint8_t *buf, size_t len,
+    struct relay_closure *relay_closure)
 {
+    struct connection_closure *closure = relay_closure->parent;
+    const char *errstr = NULL;
     ServerMessage *msg;
-    bool ret = false;
+    bool ret = false, fatal = false;
     debug_decl(handle_server_message, SUDO_DEBUG_UTIL);
 
     sudo_debug_printf(SUDO_DEBUG_INFO, "%s: unpacking ServerMessage", __func__);
@@ -652,27 +1144,33 @@ handle_server_message(uint8_t *buf, size_t len, struct connection_closure *closu
     if (msg == NULL) {
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 	    "unable to unpack ServerMessage size %zu", len);
+	relay_failed(relay_closure, closure->errstr);
 	debug_return_bool(false);
     }
 
     switch (msg->type_case) {
     case SERVER_MESSAGE__TYPE_HELLO:
-	if ((ret = handle_server_hello(msg->u.hello, closure))) {
-	    /* Relay server said hello, start talking to client. */
-	    ret = start_protocol(closure);
+	if ((ret = handle_server_hello(msg->u.hello, relay_closure))) {
+	    /* Once all relay servers said hello, start talking to client. */
+	    fatal = !relay_check_ready(closure);
 	}
 	break;
     case SERVER_MESSAGE__TYPE_COMMIT_POINT:
-	ret = handle_commit_point(msg->u.commit_point, closure);
+	if ((ret = handle_commit_point(msg->u.commit_point, relay_closure))) {
+	    /* Pass commit point from the relays to the client. */
+	    fatal = !relay_update_commit(closure);
+	}
 	break;
     case SERVER_MESSAGE__TYPE_LOG_ID:
-	ret = handle_log_id(msg->u.log_id, closure);
+	ret = handle_log_id(msg->u.log_id, relay_closure);
 	break;
     case SERVER_MESSAGE__TYPE_ERROR:
-	ret = handle_server_error(msg->u.error, closure);
+	ret = handle_server_error(msg->u.error, relay_closure);
+	errstr = msg->u.error;
 	break;
     case SERVER_MESSAGE__TYPE_ABORT:
-	ret = handle_server_abort(msg->u.abort, closure);
+	ret = handle_server_abort(msg->u.abort, relay_closure);
+	errstr = msg->u.abort;
 	break;
     default:
 	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
@@ -681,21 +1179,208 @@ handle_server_message(uint8_t *buf, size_t len, struct connection_closure *closu
 	break;
     }
 
+    if (fatal) {
+	/* Error talking to the client, not the relay. */
+	if (!schedule_error_message(closure->errstr, closure))
+	    connection_close(closure);
+	ret = false;
+    } else if (!ret) {
+	/* The error message is formatted before msg is freed. */
+	relay_failed(relay_closure, errstr ? errstr : closure->errstr);
+    }
+
     server_message__free_unpacked(msg, NULL);
     debug_return_bool(ret);
 }
 
+/*
+ * Resume reading from the relay after an injected delay.
+ * Buffered TLS data may not trigger a read event so read directly.
+ */
+static void
+relay_fault_read_cb(int unused, int what, void *v)
+{
+    struct relay_closure *relay_closure = v;
+    struct connection_closure *closure = relay_closure->parent;
+    debug_decl(relay_fault_read_cb, SUDO_DEBUG_UTIL);
+
+    if (relay_closure->sock == -1)
+	debug_return;
+    if (sudo_ev_add(closure->evbase, relay_closure->read_ev, NULL, false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add server read event");
+	relay_failed(relay_closure, _("unable to allocate memory"));
+	debug_return;
+    }
+    relay_closure->fault_read_resume = true;
+    relay_server_msg_cb(relay_closure->sock, SUDO_EV_READ, relay_closure);
+
+    debug_return;
+}
+
+/*
+ * Resume writing to the relay after an injected delay.
+ */
+static void
+relay_fault_write_cb(int unused, int what, void *v)
+{
+    struct relay_closure *relay_closure = v;
+    struct connection_closure *closure = relay_closure->parent;
+    debug_decl(relay_fault_write_cb, SUDO_DEBUG_UTIL);
+
+    if (relay_closure->sock == -1 || TAILQ_EMPTY(&relay_closure->write_bufs))
+	debug_return;
+    if (sudo_ev_add(closure->evbase, relay_closure->write_ev, NULL, false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add server write event");
+	relay_failed(relay_closure, _("unable to allocate memory"));
+	debug_return;
+    }
+    relay_closure->fault_write_resume = true;
+
+    debug_return;
+}
+
+/*
+ * Test mode: apply injected faults to a relay read or write.
+ * An injected delay disables the I/O event and arms a timer to
+ * resume it, the event loop keeps running in the meantime.
+ * If lenp is NULL the transfer length will not be shortened.
+ * Returns 1 if the operation was deferred, -1 with errno set
+ * for an injected error, else 0.
+ */
+static int
+relay_fault(struct relay_closure *relay_closure, bool writing, size_t *lenp)
+{
+    struct connection_closure *closure = relay_closure->parent;
+    struct sudo_event **evp;
+    struct iolog_fault fault;
+    bool *resume;
+    debug_decl(relay_fault, SUDO_DEBUG_UTIL);
+
+    if (!iolog_fault_enabled)
+	debug_return_int(0);
+
+    /* The delay for this operation has already been applied. */
+    resume = writing ? &relay_closure->fault_write_resume :
+	&relay_closure->fault_read_resume;
+    if (*resume) {
+	*resume = false;
+	debug_return_int(0);
+    }
+
+    iolog_fault_check(writing ? IOLOG_FAULT_RELAY_SEND : IOLOG_FAULT_RELAY_RECV,
+	lenp ? *lenp : 0, &fault);
+    if (fault.errnum != 0) {
+	errno = fault.errnum;
+	debug_return_int(-1);
+    }
+    if (lenp != NULL)
+	*lenp = fault.len;
+
+    if (sudo_timespecisset(&fault.delay)) {
+	evp = writing ? &relay_closure->fault_write_ev :
+	    &relay_closure->fault_read_ev;
+	if (*evp == NULL) {
+	    *evp = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT, writing ?
+		relay_fault_write_cb : relay_fault_read_cb, relay_closure);
+	    if (*evp == NULL) {
+		errno = ENOMEM;
+		debug_return_int(-1);
+	    }
+	}
+	if (sudo_ev_add(closure->evbase, *evp, &fault.delay, false) == -1) {
+	    errno = ENOMEM;
+	    debug_return_int(-1);
+	}
+	sudo_ev_del(closure->evbase,
+	    writing ? relay_closure->write_ev : relay_closure->read_ev);
+	debug_return_int(1);
+    }
+
+    debug_return_int(0);
+}
+
+/*
+ * Unpack and handle each complete ServerMessage in the read buffer.
+ * Returns false on error, in which case relay_closure may have been freed.
+ */
+static bool
+relay_dispatch(struct relay_closure *relay_closure)
+{
+    struct connection_closure *closure = relay_closure->parent;
+    struct connection_buffer *buf = &relay_closure->read_buf;
+    uint32_t msg_len;
+    debug_decl(relay_dispatch, SUDO_DEBUG_UTIL);
+
+    while (buf->len - buf->off >= sizeof(msg_len)) {
+	/* Read wire message size (uint32_t in network byte order). */
+	memcpy(&msg_len, buf->data + buf->off, sizeof(msg_len));
+	msg_len = ntohl(msg_len);
+
+	if (msg_len > MESSAGE_SIZE_MAX) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"server message too large: %u", msg_len);
+	    closure->errstr = _("server message too large");
+	    goto send_error;
+	}
+
+	if (msg_len + sizeof(msg_len) > buf->len - buf->off) {
+	    /* Incomplete message, we'll read the rest next time. */
+	    if (!expand_buf(buf, msg_len + sizeof(msg_len))) {
+		closure->errstr = _("unable to allocate memory");
+		goto send_error;
+	    }
+	    debug_return_bool(true);
+	}
+
+	/* Parse ServerMessage (could be zero bytes). */
+	sudo_debug_printf(SUDO_DEBUG_INFO,
+	    "%s: parsing ServerMessage, size %u", __func__, msg_len);
+	buf->off += sizeof(msg_len);
+	if (!handle_server_message(buf->data + buf->off, msg_len, relay_closure)) {
+	    /* Relay closure may have been freed. */
+	    debug_return_bool(false);
+	}
+	buf->off += msg_len;
+    }
+    buf->len -= buf->off;
+    buf->off = 0;
+    debug_return_bool(true);
+
+send_error:
+    /* Drop the relay or send the client an error message. */
+    relay_failed(relay_closure, closure->errstr);
+    debug_return_bool(false);
+}
+
+/*
+ * Handle messages the standby pool read before the connection was
+ * taken, there may be no further read event to trigger it.
+ */
+static void
+relay_buffered_cb(int unused, int what, void *v)
+{
+    struct relay_closure *relay_closure = v;
+    debug_decl(relay_buffered_cb, SUDO_DEBUG_UTIL);
+
+    relay_dispatch(relay_closure);
+
+    debug_return;
+}
+
 /*
  * Read and unpack a ServerMessage from the relay (read callback).
  */
 static void
 relay_server_msg_cb(int fd, int what, void *v)
 {
-    struct connection_closure *closure = v;
-    struct relay_closure *relay_closure = closure->relay_closure;
+    struct relay_closure *relay_closure = v;
+    struct connection_closure *closure = relay_closure->parent;
     struct connection_buffer *buf = &relay_closure->read_buf;
+    size_t readlen;
     ssize_t nread;
-    uint32_t msg_len;
+    int fault;
     debug_decl(relay_server_msg_cb, SUDO_DEBUG_UTIL);
 
     /* For TLS we may need to read as part of SSL_write(). */
@@ -713,13 +1398,21 @@ relay_server_msg_cb(int fd, int what, void *v)
         goto send_error;
     }
 
+    readlen = buf->size - buf->len;
+    fault = relay_fault(relay_closure, false, &readlen);
+    if (fault == 1)
+	debug_return;
+
+    if (fault == -1) {
+	nread = -1;
+    } else
 #if defined(HAVE_OPENSSL)
     if (relay_closure->tls_client.ssl != NULL) {
 	SSL *ssl = relay_closure->tls_client.ssl;
 	sudo_debug_printf(SUDO_DEBUG_INFO,
 	    "%s: ServerMessage from relay %s (%s) [TLS]", __func__,
 	    relay_closure->relay_name.name, relay_closure->relay_name.ipaddr);
-        nread = SSL_read(ssl, buf->data + buf->len, buf->size - buf->len);
+        nread = SSL_read(ssl, buf->data + buf->len, readlen);
         if (nread <= 0) {
 	    const char *errstr;
 	    int err;
@@ -804,7 +1497,7 @@ relay_server_msg_cb(int fd, int what, void *v)
 	sudo_debug_printf(SUDO_DEBUG_INFO,
 	    "%s: ServerMessage from relay %s (%s)", __func__,
 	    relay_closure->relay_name.name, relay_closure->relay_name.ipaddr);
-	nread = read(fd, buf->data + buf->len, buf->size - buf->len);
+	nread = read(fd, buf->data + buf->len, readlen);
     }
 
     sudo_debug_printf(SUDO_DEBUG_INFO,
@@ -834,58 +1527,19 @@ relay_server_msg_cb(int fd, int what, void *v)
 	    closure->errstr = _("relay server closed connection");
 	    goto send_error;
 	}
-	if (closure->sock == -1)
+	if (closure->sock == -1 && !relay_open(closure))
 	    connection_close(closure);
 	debug_return;
     default:
 	break;
     }
     buf->len += nread;
-
-    while (buf->len - buf->off >= sizeof(msg_len)) {
-	/* Read wire message size (uint32_t in network byte order). */
-	memcpy(&msg_len, buf->data + buf->off, sizeof(msg_len));
-	msg_len = ntohl(msg_len);
-
-	if (msg_len > MESSAGE_SIZE_MAX) {
-	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
-		"server message too large: %u", msg_len);
-	    closure->errstr = _("server message too large");
-	    goto send_error;
-	}
-
-	if (msg_len + sizeof(msg_len) > buf->len - buf->off) {
-	    /* Incomplete message, we'll read the rest next time. */
-	    if (!expand_buf(buf, msg_len + sizeof(msg_len))) {
-		closure->errstr = _("unable to allocate memory");
-		goto send_error;
-	    }
-	    debug_return;
-	}
-
-	/* Parse ServerMessage (could be zero bytes). */
-	sudo_debug_printf(SUDO_DEBUG_INFO,
-	    "%s: parsing ServerMessage, size %u", __func__, msg_len);
-	buf->off += sizeof(msg_len);
-	if (!handle_server_message(buf->data + buf->off, msg_len, closure))
-	    goto send_error;
-	buf->off += msg_len;
-    }
-    buf->len -= buf->off;
-    buf->off = 0;
+    relay_dispatch(relay_closure);
     debug_return;
 
 send_error:
-    /*
-     * Try to send client an error message before closing connection.
-     * If we are already in an error state, just give up.
-     */
-    if (!schedule_error_message(closure->errstr, closure))
-	goto close_connection;
-    debug_return;
-
-close_connection:
-    connection_close(closure);
+    /* Drop the relay or send the client an error message. */
+    relay_failed(relay_closure, closure->errstr);
     debug_return;
 }
 
@@ -895,9 +1549,10 @@ close_connection:
 static void
 relay_client_msg_cb(int fd, int what, void *v)
 {
-    struct connection_closure *closure = v;
-    struct relay_closure *relay_closure = closure->relay_closure;
+    struct relay_closure *relay_closure = v;
+    struct connection_closure *closure = relay_closure->parent;
     struct connection_buffer *buf;
+    size_t writelen, *lenp;
     ssize_t nwritten;
     debug_decl(relay_client_msg_cb, SUDO_DEBUG_UTIL);
 
@@ -927,8 +1582,22 @@ relay_client_msg_cb(int fd, int what, void *v)
         goto close_connection;
     }
 
-    sudo_debug_printf(SUDO_DEBUG_INFO, "%s: sending %u bytes to server %s (%s)",
-	__func__, buf->len - buf->off, relay_closure->relay_name.name,
+    writelen = buf->len - buf->off;
+    lenp = &writelen;
+#if defined(HAVE_OPENSSL)
+    /* SSL_write() must be retried with the same length, don't shorten it. */
+    if (relay_closure->tls_client.ssl != NULL)
+	lenp = NULL;
+#endif
+    switch (relay_fault(relay_closure, true, lenp)) {
+    case 1:
+	debug_return;
+    case -1:
+	goto fault_error;
+    }
+
+    sudo_debug_printf(SUDO_DEBUG_INFO, "%s: sending %zu bytes to server %s (%s)",
+	__func__, writelen, relay_closure->relay_name.name,
 	relay_closure->relay_name.ipaddr);
 
 #if defined(HAVE_OPENSSL)
@@ -953,6 +1622,8 @@ relay_client_msg_cb(int fd, int what, void *v)
 			closure->errstr = _("relay server closed connection");
 			goto send_error;
 		    }
+		    if (closure->sock == -1 && !relay_open(closure))
+			connection_close(closure);
 		    debug_return;
                 case SSL_ERROR_WANT_READ:
                     /* ssl wants to read, read event always active */
@@ -987,8 +1658,11 @@ relay_client_msg_cb(int fd, int what, void *v)
     } else
 #endif
     {
-	nwritten = write(fd, buf->data + buf->off, buf->len - buf->off);
+	nwritten = write(fd, buf->data + buf->off, writelen);
 	if (nwritten == -1) {
+	    /* A TCP Fast Open connect may still be in progress. */
+	    if (errno == EAGAIN || errno == EINPROGRESS)
+		debug_return;
 	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
 		"write to %s (%s)", relay_closure->relay_name.name,
 		relay_closure->relay_name.ipaddr);
@@ -1004,6 +1678,8 @@ relay_client_msg_cb(int fd, int what, void *v)
 	    "%s: finished sending %u bytes to server", __func__, buf->len);
 	buf->off = 0;
 	buf->len = 0;
+	if (buf->trace_seq != 0)
+	    trace_forwarded(closure, buf->trace_seq);
 	TAILQ_REMOVE(&relay_closure->write_bufs, buf, entries);
 	TAILQ_INSERT_TAIL(&closure->free_bufs, buf, entries);
 	if (TAILQ_EMPTY(&relay_closure->write_bufs))
@@ -1011,13 +1687,15 @@ relay_client_msg_cb(int fd, int what, void *v)
     }
     debug_return;
 
+fault_error:
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	"injected error writing to %s (%s)", relay_closure->relay_name.name,
+	relay_closure->relay_name.ipaddr);
+    closure->errstr = _("error writing to relay");
+
 send_error:
-    /*
-     * Try to send client an error message before closing connection.
-     * If we are already in an error state, just give up.
-     */
-    if (!schedule_error_message(closure->errstr, closure))
-	goto close_connection;
+    /* Drop the relay or send the client an error message. */
+    relay_failed(relay_closure, closure->errstr);
     debug_return;
 
 close_connection:
@@ -1027,25 +1705,35 @@ close_connection:
 
 /* Begin the conversation with the relay host. */
 static bool
-start_relay(int sock, struct connection_closure *closure)
+start_relay(int sock, struct relay_closure *relay_closure)
 {
-    struct relay_closure *relay_closure = closure->relay_closure;
     debug_decl(start_relay, SUDO_DEBUG_UTIL);
 
-    /* No longer need the connect event. */
-    sudo_ev_free(relay_closure->connect_ev);
-    relay_closure->connect_ev = NULL;
-
     /* Allocate relay read/write events now that we know the socket. */
     relay_closure->read_ev = sudo_ev_alloc(sock, SUDO_EV_READ|SUDO_EV_PERSIST,
-	relay_server_msg_cb, closure);
+	relay_server_msg_cb, relay_closure);
     relay_closure->write_ev = sudo_ev_alloc(sock, SUDO_EV_WRITE|SUDO_EV_PERSIST,
-	relay_client_msg_cb, closure);
+	relay_client_msg_cb, relay_closure);
     if (relay_closure->read_ev == NULL || relay_closure->write_ev == NULL)
 	debug_return_bool(false);
 
+    /* A standby connection may have read the ServerHello already. */
+    if (relay_closure->read_buf.len != 0) {
+	struct timespec zero = { 0, 0 };
+
+	relay_closure->buffered_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT,
+	    relay_buffered_cb, relay_closure);
+	if (relay_closure->buffered_ev == NULL || sudo_ev_add(
+		relay_closure->parent->evbase, relay_closure->buffered_ev,
+		&zero, false) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to add buffered message event");
+	    debug_return_bool(false);
+	}
+    }
+
     /* Start communication with the relay server by saying hello. */
-    debug_return_bool(fmt_client_hello(closure));
+    debug_return_bool(fmt_client_hello(relay_closure));
 }
 
 /*
@@ -1058,12 +1746,22 @@ relay_accept(AcceptMessage *msg, uint8_t *buf, size_t len,
     struct relay_closure *relay_closure = closure->relay_closure;
     const char *source = closure->journal_path ? closure->journal_path :
 	closure->ipaddr;
+    uint8_t *traced_buf;
+    size_t traced_len;
+    bool ret;
     debug_decl(relay_accept, SUDO_DEBUG_UTIL);
 
     sudo_debug_printf(SUDO_DEBUG_INFO,
 	"%s: relaying AcceptMessage from %s to %s (%s)", __func__, source,
 	relay_closure->relay_name.name, relay_closure->relay_name.ipaddr);
 
+    /* Pass the trace context on with this hop as the parent. */
+    if ((traced_buf = trace_pack_accept(msg, closure, &traced_len)) != NULL) {
+	ret = relay_enqueue_write(traced_buf, traced_len, closure);
+	free(traced_buf);
+	debug_return_bool(ret);
+    }
+
     debug_return_bool(relay_enqueue_write(buf, len, closure));
 }
 
@@ -1106,48 +1804,125 @@ relay_exit(ExitMessage *msg, uint8_t *buf, size_t len,
 }
 
 /*
- * Relay a RestartMessage from the client to the relay server.
- * We must rebuild the packed message because the log_id is modified.
+ * Split a log ID returned by relay_send_log_id() in place and find
+ * the entry for each relay.  A log ID from before replication, which
+ * matches no relay, belongs to the primary.
+ * Returns the number of relays with a log ID.
+ */
+static unsigned int
+relay_split_log_id(char *log_id, struct connection_closure *closure,
+    const char *ids[RELAY_REPLICAS_MAX])
+{
+    char *hosts[RELAY_REPLICAS_MAX], *entries[RELAY_REPLICAS_MAX];
+    struct relay_closure *relay_closure;
+    unsigned int i, n, nentries = 0, nfound = 0;
+    char *cp, *ep;
+
+    for (cp = log_id; cp != NULL && nentries < RELAY_REPLICAS_MAX; cp = ep) {
+	if ((ep = strchr(cp, RELAY_LOG_ID_SEP)) != NULL)
+	    *ep++ = '\0';
+	entries[nentries] = cp;
+	if ((cp = strrchr(cp, '/')) != NULL && cp != entries[nentries]) {
+	    hosts[nentries] = cp + 1;
+	    nentries++;
+	}
+    }
+
+    n = 0;
+    TAILQ_FOREACH(relay_closure, &closure->relay_closures, entries) {
+	if (n == RELAY_REPLICAS_MAX)
+	    break;
+	ids[n] = NULL;
+	for (i = 0; i < nentries; i++) {
+	    if (entries[i] == NULL)
+		continue;
+	    if (strcmp(hosts[i], relay_host(relay_closure)) == 0) {
+		hosts[i][-1] = '\0';
+		ids[n] = entries[i];
+		entries[i] = NULL;
+		nfound++;
+		break;
+	    }
+	}
+	n++;
+    }
+
+    return nfound;
+}
+
+/*
+ * Relay a RestartMessage from the client to the relay servers.
+ * Each relay gets its own log ID, see relay_send_log_id().
+ * Relays that don't know the log are left out of the session.
  */
 static bool
 relay_restart(RestartMessage *msg, uint8_t *buf, size_t len,
     struct connection_closure *closure)
 {
-    struct relay_closure *relay_closure = closure->relay_closure;
+    const unsigned int quorum = logsrvd_conf_relay_commit_quorum();
+    struct relay_closure *relay_closure, *next;
     const char *source = closure->journal_path ? closure->journal_path :
 	closure->ipaddr;
     struct sudo_event_base *evbase = closure->evbase;
     ClientMessage client_msg = CLIENT_MESSAGE__INIT;
     RestartMessage restart_msg = *msg;
-    char *cp;
-    bool ret;
+    const char *ids[RELAY_REPLICAS_MAX];
+    unsigned int n, nfound;
+    char *log_id;
+    bool ret = false;
     debug_decl(relay_restart, SUDO_DEBUG_UTIL);
 
-    sudo_debug_printf(SUDO_DEBUG_INFO,
-	"%s: relaying RestartMessage from %s to %s (%s)", __func__, source,
-	relay_closure->relay_name.name, relay_closure->relay_name.ipaddr);
+    if ((log_id = strdup(msg->log_id)) == NULL) {
+	closure->errstr = _("unable to allocate memory");
+	debug_return_bool(false);
+    }
+    nfound = relay_split_log_id(log_id, closure, ids);
+    if (nfound == 0 && strchr(msg->log_id, RELAY_LOG_ID_SEP) == NULL) {
+	/* Log ID from before replication. */
+	ids[0] = msg->log_id;
+	for (n = 1; n < RELAY_REPLICAS_MAX; n++)
+	    ids[n] = NULL;
+	nfound = 1;
+    }
+    if (nfound < quorum) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "log ID %s known to %u relays, quorum is %u", msg->log_id,
+	    nfound, quorum);
+	closure->errstr = _("unable to restart log");
+	goto done;
+    }
 
-    /*
-     * We prepend "relayhost/" to the log ID before relaying it to
-     * the client.  Perform the reverse operation before passing the
-     * log ID to the relay host.
-     */
-    if ((cp = strchr(restart_msg.log_id, '/')) != NULL) {
-	if (cp != restart_msg.log_id)
-	    restart_msg.log_id = cp + 1;
+    if (msg->resume_point != NULL) {
+	closure->elapsed_time.tv_sec = msg->resume_point->tv_sec;
+	closure->elapsed_time.tv_nsec = msg->resume_point->tv_nsec;
     }
 
     client_msg.u.restart_msg = &restart_msg;
     client_msg.type_case = CLIENT_MESSAGE__TYPE_RESTART_MSG;
-    ret = fmt_client_message(closure, &client_msg);
-    if (ret) {
+    n = 0;
+    TAILQ_FOREACH_SAFE(relay_closure, &closure->relay_closures, entries, next) {
+	if (n == RELAY_REPLICAS_MAX || ids[n] == NULL) {
+	    relay_drop(relay_closure, "unknown log ID");
+	    n++;
+	    continue;
+	}
+	restart_msg.log_id = (char *)ids[n++];
+	sudo_debug_printf(SUDO_DEBUG_INFO,
+	    "%s: relaying RestartMessage from %s to %s (%s)", __func__,
+	    source, relay_closure->relay_name.name,
+	    relay_closure->relay_name.ipaddr);
+	if (!fmt_client_message(relay_closure, &client_msg))
+	    goto done;
 	if (sudo_ev_add(evbase, relay_closure->write_ev, NULL, false) == -1) {
 	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
 		"unable to add server write event");
-	    ret = false;
+	    goto done;
 	}
     }
+    ret = true;
 
+done:
+    free(log_id);
     debug_return_bool(ret);
 }
 
@@ -1190,6 +1965,8 @@ relay_suspend(CommandSuspend *msg, uint8_t *buf, size_t len,
 	"%s: relaying CommandSuspend from %s to %s (%s)", __func__, source,
 	relay_closure->relay_name.name, relay_closure->relay_name.ipaddr);
 
+    /* Track elapsed time to know when the final commit point arrives. */
+    update_elapsed_time(msg->delay, &closure->elapsed_time);
     ret = relay_enqueue_write(buf, len, closure);
 
     debug_return_bool(ret);
@@ -1212,6 +1989,7 @@ relay_winsize(ChangeWindowSize *msg, uint8_t *buf, size_t len,
 	"%s: relaying ChangeWindowSize from %s to %s (%s)", __func__, source,
 	relay_closure->relay_name.name, relay_closure->relay_name.ipaddr);
 
+    update_elapsed_time(msg->delay, &closure->elapsed_time);
     ret = relay_enqueue_write(buf, len, closure);
 
     debug_return_bool(ret);
@@ -1227,6 +2005,7 @@ relay_iobuf(int iofd, IoBuffer *iobuf, uint8_t *buf, size_t len,
     struct relay_closure *relay_closure = closure->relay_closure;
     const char *source = closure->journal_path ? closure->journal_path :
 	closure->ipaddr;
+    struct connection_buffer *wbuf;
     bool ret;
     debug_decl(relay_iobuf, SUDO_DEBUG_UTIL);
 
@@ -1234,7 +2013,17 @@ relay_iobuf(int iofd, IoBuffer *iobuf, uint8_t *buf, size_t len,
 	"%s: relaying IoBuffer from %s to %s (%s)", __func__, source,
 	relay_closure->relay_name.name, relay_closure->relay_name.ipaddr);
 
+    update_elapsed_time(iobuf->delay, &closure->elapsed_time);
     ret = relay_enqueue_write(buf, len, closure);
+    if (ret && closure->trace != NULL) {
+	/* Tag each relay's copy so the trace can tell when it was sent. */
+	TAILQ_FOREACH(relay_closure, &closure->relay_closures, entries) {
+	    wbuf = TAILQ_LAST(&relay_closure->write_bufs,
+		connection_buffer_list);
+	    if (wbuf != NULL)
+		wbuf->trace_seq = trace_enqueue(closure);
+	}
+    }
 
     debug_return_bool(ret);
 }
@@ -1245,15 +2034,17 @@ relay_iobuf(int iofd, IoBuffer *iobuf, uint8_t *buf, size_t len,
 bool
 relay_shutdown(struct connection_closure *closure)
 {
-    struct relay_closure *relay_closure = closure->relay_closure;
+    struct relay_closure *relay_closure;
     debug_decl(relay_shutdown, SUDO_DEBUG_UTIL);
 
-    /* Close connection unless relay events are pending. */
-    if (!sudo_ev_pending(relay_closure->read_ev, SUDO_EV_READ, NULL) &&
-	    !sudo_ev_pending(relay_closure->write_ev, SUDO_EV_WRITE, NULL) &&
-	    TAILQ_EMPTY(&relay_closure->write_bufs)) {
-	connection_close(closure);
+    /* Close connection unless events are pending for any relay. */
+    TAILQ_FOREACH(relay_closure, &closure->relay_closures, entries) {
+	if (sudo_ev_pending(relay_closure->read_ev, SUDO_EV_READ, NULL) ||
+		sudo_ev_pending(relay_closure->write_ev, SUDO_EV_WRITE, NULL) ||
+		!TAILQ_EMPTY(&relay_closure->write_bufs))
+	    debug_return_bool(true);
     }
+    connection_close(closure);
 
     debug_return_bool(true);
 }
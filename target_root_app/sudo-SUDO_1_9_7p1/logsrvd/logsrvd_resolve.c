@@ -0,0 +1,597 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_event.h"
+#include "sudo_eventlog.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrvd.h"
+
+/*
+ * Relay host names are resolved when the configuration is read.  To
+ * follow address changes without a SIGHUP, a child process looks them
+ * up again every resolve_interval seconds, and sooner after a relay
+ * connection fails.  The DNS TTL is not available via getaddrinfo(3).
+ * The results are sent back over a pipe so the event loop never blocks
+ * on DNS.  If the addresses have changed, the relay address list is
+ * replaced; connections using the old list keep a reference to it.
+ */
+
+/* Sent for each relay_host setting, followed by naddrs addresses. */
+struct resolve_result {
+    int naddrs;			/* -1 if the lookup failed */
+};
+
+struct resolve_addr {
+    union sockaddr_union sa_un;
+    socklen_t sa_size;
+};
+
+static struct resolve_state {
+    struct sudo_event_base *evbase;
+    struct sudo_event *timer_ev;
+    struct sudo_event *read_ev;
+    struct server_address_list *relays;	/* list being looked up */
+    struct timespec last;		/* start of the last lookup */
+    char *buf;
+    size_t len;
+    size_t size;
+    pid_t child;
+    int fd;
+    unsigned long long lookups;
+    unsigned long long changes;
+    unsigned long long failures;
+} resolve = { NULL, NULL, NULL, NULL, { 0, 0 }, NULL, 0, 0, -1, -1 };
+
+static bool
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *cp = buf;
+    ssize_t nwritten;
+
+    while (len > 0) {
+	nwritten = write(fd, cp, len);
+	if (nwritten == -1) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	cp += nwritten;
+	len -= nwritten;
+    }
+    return true;
+}
+
+/*
+ * Look up each relay_host setting in relays, writing the results to fd.
+ * The addresses for a setting are adjacent and share the same sa_str.
+ * Runs in the child process.
+ */
+static int
+resolve_child(int fd, struct server_address_list *relays)
+{
+    struct server_address *addr, *res;
+    struct server_address_list *tmp;
+    struct resolve_result result;
+    struct resolve_addr ra;
+    const char *sa_str = NULL;
+
+    TAILQ_FOREACH(addr, relays, entries) {
+	if (addr->sa_str == sa_str)
+	    continue;
+	sa_str = addr->sa_str;
+
+	result.naddrs = -1;
+	tmp = address_list_alloc();
+	if (tmp != NULL && address_list_resolve(tmp, sa_str)) {
+	    result.naddrs = 0;
+	    TAILQ_FOREACH(res, tmp, entries)
+		result.naddrs++;
+	}
+	if (!write_all(fd, &result, sizeof(result)))
+	    return EXIT_FAILURE;
+	if (result.naddrs > 0) {
+	    TAILQ_FOREACH(res, tmp, entries) {
+		memset(&ra, 0, sizeof(ra));
+		memcpy(&ra.sa_un, &res->sa_un, res->sa_size);
+		ra.sa_size = res->sa_size;
+		if (!write_all(fd, &ra, sizeof(ra)))
+		    return EXIT_FAILURE;
+	    }
+	}
+	if (tmp != NULL)
+	    address_list_delref(tmp);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Append a copy of tmpl using the specified socket address.
+ */
+static bool
+resolve_append(struct server_address_list *al, struct server_address *tmpl,
+    const union sockaddr_union *sa_un, socklen_t sa_size)
+{
+    struct server_address *addr;
+    debug_decl(resolve_append, SUDO_DEBUG_UTIL);
+
+    if ((addr = malloc(sizeof(*addr))) == NULL)
+	debug_return_bool(false);
+    addr->sa_str = sudo_rcstr_addref(tmpl->sa_str);
+    addr->sa_host = sudo_rcstr_addref(tmpl->sa_host);
+    memcpy(&addr->sa_un, sa_un, sa_size);
+    addr->sa_size = sa_size;
+    addr->tls = tmpl->tls;
+    TAILQ_INSERT_TAIL(al, addr, entries);
+
+    debug_return_bool(true);
+}
+
+static bool
+address_list_equal(struct server_address_list *a,
+    struct server_address_list *b)
+{
+    struct server_address *aa = TAILQ_FIRST(a), *ba = TAILQ_FIRST(b);
+
+    while (aa != NULL && ba != NULL) {
+	if (aa->sa_str != ba->sa_str || aa->sa_size != ba->sa_size)
+	    return false;
+	if (memcmp(&aa->sa_un, &ba->sa_un, aa->sa_size) != 0)
+	    return false;
+	aa = TAILQ_NEXT(aa, entries);
+	ba = TAILQ_NEXT(ba, entries);
+    }
+    return aa == ba;
+}
+
+/*
+ * Build a new relay address list from the lookup results.  If a
+ * lookup failed, the old addresses for that relay_host are kept.
+ * The new list only replaces the old one if something changed.
+ */
+static void
+resolve_update(void)
+{
+    struct server_address_list *relays = resolve.relays, *fresh;
+    struct server_address *addr, *first;
+    struct resolve_result result;
+    struct resolve_addr ra;
+    size_t off = 0;
+    int i;
+    debug_decl(resolve_update, SUDO_DEBUG_UTIL);
+
+    if ((fresh = address_list_alloc()) == NULL)
+	goto bad;
+
+    addr = TAILQ_FIRST(relays);
+    while ((first = addr) != NULL) {
+	if (resolve.len - off < sizeof(result))
+	    goto truncated;
+	memcpy(&result, resolve.buf + off, sizeof(result));
+	off += sizeof(result);
+
+	if (result.naddrs <= 0) {
+	    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+		"unable to resolve %s, keeping old addresses", first->sa_str);
+	    while (addr != NULL && addr->sa_str == first->sa_str) {
+		if (!resolve_append(fresh, first, &addr->sa_un, addr->sa_size))
+		    goto bad;
+		addr = TAILQ_NEXT(addr, entries);
+	    }
+	    continue;
+	}
+
+	if ((resolve.len - off) / sizeof(ra) < (size_t)result.naddrs)
+	    goto truncated;
+	for (i = 0; i < result.naddrs; i++) {
+	    memcpy(&ra, resolve.buf + off, sizeof(ra));
+	    off += sizeof(ra);
+	    if (ra.sa_size > sizeof(ra.sa_un))
+		goto truncated;
+	    if (!resolve_append(fresh, first, &ra.sa_un, ra.sa_size))
+		goto bad;
+	}
+	while (addr != NULL && addr->sa_str == first->sa_str)
+	    addr = TAILQ_NEXT(addr, entries);
+    }
+
+    if (address_list_equal(relays, fresh)) {
+	sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	    "relay addresses unchanged");
+	address_list_delref(fresh);
+	debug_return;
+    }
+
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"relay addresses changed, updating");
+    resolve.changes++;
+    logsrvd_conf_relay_set_address(fresh);
+
+    /* Standby connections may be to addresses no longer in use. */
+    logsrvd_standby_reload();
+    debug_return;
+
+truncated:
+    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	"truncated relay lookup results (%zu bytes)", resolve.len);
+bad:
+    resolve.failures++;
+    if (fresh != NULL)
+	address_list_delref(fresh);
+    debug_return;
+}
+
+static void
+resolve_schedule(time_t secs)
+{
+    struct timespec tv = { secs, 0 };
+    debug_decl(resolve_schedule, SUDO_DEBUG_UTIL);
+
+    if (resolve.timer_ev == NULL || secs == 0)
+	debug_return;
+    if (sudo_ev_add(resolve.evbase, resolve.timer_ev, &tv, false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add relay lookup event");
+    }
+
+    debug_return;
+}
+
+/*
+ * Done reading lookup results from the child, apply them if complete
+ * and the configuration has not been reloaded in the mean time.
+ */
+static void
+resolve_finish(bool complete)
+{
+    debug_decl(resolve_finish, SUDO_DEBUG_UTIL);
+
+    sudo_ev_free(resolve.read_ev);
+    resolve.read_ev = NULL;
+    close(resolve.fd);
+    resolve.fd = -1;
+
+    if (!complete) {
+	resolve.failures++;
+    } else if (resolve.relays == logsrvd_conf_relay_address()) {
+	resolve_update();
+    }
+
+    free(resolve.buf);
+    resolve.buf = NULL;
+    resolve.len = resolve.size = 0;
+    address_list_delref(resolve.relays);
+    resolve.relays = NULL;
+
+    resolve_schedule(logsrvd_conf_relay_resolve_interval());
+
+    debug_return;
+}
+
+static void
+resolve_read_cb(int fd, int what, void *v)
+{
+    ssize_t nread;
+    debug_decl(resolve_read_cb, SUDO_DEBUG_UTIL);
+
+    if (resolve.len == resolve.size) {
+	size_t newsize = resolve.size + 4096;
+	char *newbuf;
+
+	if ((newbuf = realloc(resolve.buf, newsize)) == NULL) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to allocate memory");
+	    resolve_finish(false);
+	    debug_return;
+	}
+	resolve.buf = newbuf;
+	resolve.size = newsize;
+    }
+
+    nread = read(fd, resolve.buf + resolve.len, resolve.size - resolve.len);
+    switch (nread) {
+    case -1:
+	if (errno == EAGAIN || errno == EINTR)
+	    break;
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to read relay lookup results");
+	resolve_finish(false);
+	break;
+    case 0:
+	resolve_finish(true);
+	break;
+    default:
+	resolve.len += nread;
+	break;
+    }
+
+    debug_return;
+}
+
+/*
+ * Start looking up the relay host names in a child process.
+ * Returns false if no lookup was started.
+ */
+static bool
+resolve_start(void)
+{
+    struct server_address_list *relays = logsrvd_conf_relay_address();
+    int flags, pfd[2];
+    pid_t pid;
+    debug_decl(resolve_start, SUDO_DEBUG_UTIL);
+
+    if (resolve.fd != -1 || resolve.child != -1 || TAILQ_EMPTY(relays))
+	debug_return_bool(false);
+
+    if (pipe(pfd) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to create pipe");
+	resolve.failures++;
+	debug_return_bool(false);
+    }
+    sudo_gettime_mono(&resolve.last);
+
+    switch (pid = sudo_debug_fork()) {
+    case -1:
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to fork relay lookup process");
+	close(pfd[0]);
+	close(pfd[1]);
+	resolve.failures++;
+	debug_return_bool(false);
+    case 0:
+	/*
+	 * The child must not keep the server's listeners and client
+	 * connections open, or signal the server's event loop.
+	 */
+	if (pfd[1] != STDERR_FILENO + 1) {
+	    if (dup2(pfd[1], STDERR_FILENO + 1) == -1)
+		_exit(EXIT_FAILURE);
+	}
+	closefrom(STDERR_FILENO + 2);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	_exit(resolve_child(STDERR_FILENO + 1, relays));
+    default:
+	break;
+    }
+    close(pfd[1]);
+    resolve.child = pid;
+    resolve.fd = pfd[0];
+    resolve.lookups++;
+
+    flags = fcntl(resolve.fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(resolve.fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+	    fcntl(resolve.fd, F_SETFD, FD_CLOEXEC) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to set flags on relay lookup pipe");
+    }
+    resolve.read_ev = sudo_ev_alloc(resolve.fd, SUDO_EV_READ|SUDO_EV_PERSIST,
+	resolve_read_cb, NULL);
+    if (resolve.read_ev == NULL ||
+	    sudo_ev_add(resolve.evbase, resolve.read_ev, NULL, false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add relay lookup read event");
+	sudo_ev_free(resolve.read_ev);
+	resolve.read_ev = NULL;
+	close(resolve.fd);
+	resolve.fd = -1;
+	resolve.failures++;
+	debug_return_bool(false);
+    }
+    address_list_addref(relays);
+    resolve.relays = relays;
+
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"started relay lookup process %d", (int)pid);
+    debug_return_bool(true);
+}
+
+static void
+resolve_timer_cb(int unused, int what, void *v)
+{
+    debug_decl(resolve_timer_cb, SUDO_DEBUG_UTIL);
+
+    /* On success, the next lookup is scheduled when this one finishes. */
+    if (!resolve_start())
+	resolve_schedule(logsrvd_conf_relay_resolve_interval());
+
+    debug_return;
+}
+
+/*
+ * A relay connection failed, the address may be stale.  Look up the
+ * relay host names again, at most once every RELAY_RESOLVE_MIN seconds.
+ */
+void
+logsrvd_resolve_retry(void)
+{
+    struct timespec delay, now, pending;
+    debug_decl(logsrvd_resolve_retry, SUDO_DEBUG_UTIL);
+
+    if (resolve.timer_ev == NULL || resolve.fd != -1)
+	debug_return;
+    if (logsrvd_conf_relay_resolve_interval() == 0)
+	debug_return;
+
+    sudo_gettime_mono(&now);
+    delay.tv_sec = RELAY_RESOLVE_MIN;
+    delay.tv_nsec = 0;
+    sudo_timespecadd(&resolve.last, &delay, &delay);
+    sudo_timespecsub(&delay, &now, &delay);
+    if (delay.tv_sec < 0)
+	sudo_timespecclear(&delay);
+
+    if (sudo_ev_pending(resolve.timer_ev, SUDO_EV_TIMEOUT, &pending)) {
+	if (sudo_timespeccmp(&pending, &delay, <=))
+	    debug_return;
+    }
+    if (sudo_ev_add(resolve.evbase, resolve.timer_ev, &delay, false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add relay lookup event");
+    }
+
+    debug_return;
+}
+
+/*
+ * Collect the lookup process.  Called when SIGCHLD is received.
+ */
+void
+logsrvd_resolve_reap(void)
+{
+    int status;
+    pid_t pid;
+    debug_decl(logsrvd_resolve_reap, SUDO_DEBUG_UTIL);
+
+    if (resolve.child == -1)
+	debug_return;
+    do {
+	pid = waitpid(resolve.child, &status, WNOHANG);
+    } while (pid == -1 && errno == EINTR);
+    if (pid != resolve.child)
+	debug_return;
+    resolve.child = -1;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "relay lookup process failed, status 0x%x", status);
+    }
+
+    debug_return;
+}
+
+/*
+ * Restart the lookup schedule after the configuration has been read.
+ * Results from a lookup still in progress will be ignored.
+ */
+void
+logsrvd_resolve_reload(void)
+{
+    debug_decl(logsrvd_resolve_reload, SUDO_DEBUG_UTIL);
+
+    if (resolve.timer_ev == NULL)
+	debug_return;
+    sudo_ev_del(resolve.evbase, resolve.timer_ev);
+    resolve_schedule(logsrvd_conf_relay_resolve_interval());
+
+    debug_return;
+}
+
+bool
+logsrvd_resolve_init(struct sudo_event_base *evbase)
+{
+    debug_decl(logsrvd_resolve_init, SUDO_DEBUG_UTIL);
+
+    resolve.evbase = evbase;
+    resolve.timer_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT, resolve_timer_cb,
+	NULL);
+    if (resolve.timer_ev == NULL)
+	debug_return_bool(false);
+    resolve_schedule(logsrvd_conf_relay_resolve_interval());
+
+    debug_return_bool(true);
+}
+
+void
+logsrvd_resolve_close(void)
+{
+    int status;
+    debug_decl(logsrvd_resolve_close, SUDO_DEBUG_UTIL);
+
+    if (resolve.child != -1) {
+	kill(resolve.child, SIGTERM);
+	while (waitpid(resolve.child, &status, 0) == -1 && errno == EINTR)
+	    continue;
+	resolve.child = -1;
+    }
+    if (resolve.fd != -1) {
+	sudo_ev_free(resolve.read_ev);
+	resolve.read_ev = NULL;
+	close(resolve.fd);
+	resolve.fd = -1;
+    }
+    if (resolve.relays != NULL) {
+	address_list_delref(resolve.relays);
+	resolve.relays = NULL;
+    }
+    free(resolve.buf);
+    resolve.buf = NULL;
+    resolve.len = resolve.size = 0;
+    sudo_ev_free(resolve.timer_ev);
+    resolve.timer_ev = NULL;
+
+    debug_return;
+}
+
+void
+logsrvd_resolve_dump(void)
+{
+    debug_decl(logsrvd_resolve_dump, SUDO_DEBUG_UTIL);
+
+    if (resolve.lookups == 0 && resolve.child == -1)
+	debug_return;
+
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"relay host lookups: %llu started, %llu changed, %llu failed",
+	resolve.lookups, resolve.changes, resolve.failures);
+    if (resolve.child != -1) {
+	sudo_debug_printf(SUDO_DEBUG_INFO,
+	    "  lookup process %d running", (int)resolve.child);
+    }
+
+    debug_return;
+}
@@ -0,0 +1,523 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_event.h"
+#include "sudo_eventlog.h"
+#include "sudo_gettext.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrvd.h"
+
+/*
+ * When a client drops an I/O log session before it has finished,
+ * the open I/O log state is kept for a grace period.  If the client
+ * reconnects with a RestartMessage for the same log, the session
+ * continues with the same file handles and compressor state.
+ *
+ * The client resumes from the last commit point it received, which
+ * is usually behind what we have written.  The file offsets at each
+ * commit point we send are recorded so that plain, uncompressed logs
+ * can be truncated back to the resume point.  Compressed, staged and
+ * digested streams carry state that truncating the file cannot rewind,
+ * so sessions using them are never cached; they are reopened and the
+ * timing file replayed instead.
+ */
+
+/* Upper bound on cached sessions, each one holds open descriptors. */
+#define RESUME_CACHE_MAX	256
+
+/* Descriptors held by a cached session: the streams and the directory. */
+#define RESUME_ENTRY_FDS	(IOFD_MAX + 1)
+
+struct resume_entry {
+    TAILQ_ENTRY(resume_entry) entries;
+    struct sudo_event *expire_ev;
+    struct eventlog *evlog;
+    struct timespec elapsed_time;
+    struct iolog_file iolog_files[IOFD_MAX];
+    struct resume_point resume_points[RESUME_POINTS_MAX];
+    unsigned int nresume_points;
+    int iolog_dir_fd;
+    bool iolog_dir_synced;
+};
+TAILQ_HEAD(resume_entry_list, resume_entry);
+
+static struct resume_entry_list resume_cache =
+    TAILQ_HEAD_INITIALIZER(resume_cache);
+static unsigned int resume_cache_len;
+
+static struct resume_stats {
+    unsigned long long stashed;
+    unsigned long long restarts;
+    unsigned long long hits;
+    unsigned long long rewound;
+    unsigned long long misses;
+    unsigned long long expired;
+    unsigned long long evicted;
+} resume_stats;
+
+/*
+ * Move the I/O log state from closure to entry or, if restore is true,
+ * from entry back to closure.  The source is left without any state.
+ * Only sessions whose streams are all plain files are cached, so there
+ * is no compressor, staging or digest state to move.
+ */
+static void
+resume_move(struct resume_entry *entry, struct connection_closure *closure,
+    bool restore)
+{
+    debug_decl(resume_move, SUDO_DEBUG_UTIL);
+
+    if (restore) {
+	closure->evlog = entry->evlog;
+	closure->elapsed_time = entry->elapsed_time;
+	memcpy(closure->iolog_files, entry->iolog_files,
+	    sizeof(closure->iolog_files));
+	memcpy(closure->resume_points, entry->resume_points,
+	    sizeof(closure->resume_points));
+	closure->nresume_points = entry->nresume_points;
+	closure->iolog_dir_fd = entry->iolog_dir_fd;
+	closure->iolog_dir_synced = entry->iolog_dir_synced;
+
+	entry->evlog = NULL;
+	memset(entry->iolog_files, 0, sizeof(entry->iolog_files));
+	entry->iolog_dir_fd = -1;
+    } else {
+	entry->evlog = closure->evlog;
+	entry->elapsed_time = closure->elapsed_time;
+	memcpy(entry->iolog_files, closure->iolog_files,
+	    sizeof(entry->iolog_files));
+	memcpy(entry->resume_points, closure->resume_points,
+	    sizeof(entry->resume_points));
+	entry->nresume_points = closure->nresume_points;
+	entry->iolog_dir_fd = closure->iolog_dir_fd;
+	entry->iolog_dir_synced = closure->iolog_dir_synced;
+
+	closure->evlog = NULL;
+	memset(closure->iolog_files, 0, sizeof(closure->iolog_files));
+	closure->nresume_points = 0;
+	closure->iolog_dir_fd = -1;
+    }
+
+    debug_return;
+}
+
+/*
+ * Remove an entry from the cache, close its I/O log files and free it.
+ */
+static void
+resume_entry_free(struct resume_entry *entry)
+{
+    const char *errstr;
+    int iofd;
+    debug_decl(resume_entry_free, SUDO_DEBUG_UTIL);
+
+    TAILQ_REMOVE(&resume_cache, entry, entries);
+    resume_cache_len--;
+
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	if (!entry->iolog_files[iofd].enabled)
+	    continue;
+	if (!iolog_close(&entry->iolog_files[iofd], &errstr)) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"error closing iofd %d: %s", iofd, errstr);
+	}
+    }
+    if (entry->iolog_dir_fd != -1)
+	close(entry->iolog_dir_fd);
+    eventlog_free(entry->evlog);
+    sudo_ev_free(entry->expire_ev);
+    free(entry);
+
+    debug_return;
+}
+
+/*
+ * The grace period has passed without a restart, close the log.
+ */
+static void
+resume_expire_cb(int unused, int what, void *v)
+{
+    struct resume_entry *entry = v;
+    debug_decl(resume_expire_cb, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"no restart for %s, closing", entry->evlog->iolog_path);
+    resume_stats.expired++;
+    resume_entry_free(entry);
+
+    debug_return;
+}
+
+/*
+ * Write buffered I/O log data to the kernel so the log on disk
+ * is current while the session is cached.
+ */
+static bool
+resume_flush(struct connection_closure *closure)
+{
+    int iofd;
+    debug_decl(resume_flush, SUDO_DEBUG_UTIL);
+
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	struct iolog_file *iol = &closure->iolog_files[iofd];
+
+	if (!iol->enabled)
+	    continue;
+	if (fflush(iol->fd.f) != 0)
+	    debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Record the I/O log file offsets at the commit point about to be
+ * sent to the client.  Called after the files have been flushed.
+ */
+void
+resume_cache_mark(struct connection_closure *closure)
+{
+    struct resume_point *rp;
+    int iofd;
+    debug_decl(resume_cache_mark, SUDO_DEBUG_UTIL);
+
+    if (logsrvd_conf_server_resume_timeout() == NULL ||
+	    closure->cms != &cms_local || !closure->log_io)
+	debug_return;
+
+    /* Only the most recent commit points are kept. */
+    if (closure->nresume_points == RESUME_POINTS_MAX) {
+	memmove(closure->resume_points, closure->resume_points + 1,
+	    sizeof(*rp) * (RESUME_POINTS_MAX - 1));
+	closure->nresume_points--;
+    }
+    rp = &closure->resume_points[closure->nresume_points++];
+    rp->elapsed_time = closure->elapsed_time;
+
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	struct iolog_file *iol = &closure->iolog_files[iofd];
+
+	rp->offsets[iofd] = -1;
+	if (!iol->enabled) {
+	    rp->offsets[iofd] = 0;
+	    continue;
+	}
+	/*
+	 * Compressed and staged streams carry state that cannot be
+	 * rewound by truncating the file, nor can the running digest.
+	 */
+	if (iol->compressed || closure->iolog_direct[iofd] != NULL ||
+		closure->iolog_dedup[iofd] != NULL ||
+		closure->iolog_dict[iofd] != NULL ||
+		closure->iolog_digest != NULL)
+	    continue;
+	rp->offsets[iofd] = ftello(iol->fd.f);
+    }
+
+    debug_return;
+}
+
+/*
+ * Returns true if every I/O log stream of the connection can be
+ * truncated back to a commit point, see resume_cache_mark().
+ */
+static bool
+resume_rewindable(struct connection_closure *closure)
+{
+    int iofd;
+    debug_decl(resume_rewindable, SUDO_DEBUG_UTIL);
+
+    if (closure->iolog_digest != NULL)
+	debug_return_bool(false);
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	if (!closure->iolog_files[iofd].enabled)
+	    continue;
+	if (closure->iolog_files[iofd].compressed ||
+		closure->iolog_direct[iofd] != NULL ||
+		closure->iolog_dedup[iofd] != NULL ||
+		closure->iolog_dict[iofd] != NULL)
+	    debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * The number of sessions that may be cached.  Cached sessions may use
+ * at most a quarter of the descriptor limit so there is always room
+ * for new connections and the logs they open.
+ */
+static unsigned int
+resume_cache_max(void)
+{
+    struct rlimit rl;
+    rlim_t max;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == RLIM_INFINITY)
+	return RESUME_CACHE_MAX;
+    max = rl.rlim_cur / 4 / RESUME_ENTRY_FDS;
+    return max < RESUME_CACHE_MAX ? (unsigned int)max : RESUME_CACHE_MAX;
+}
+
+/*
+ * Truncate the I/O log files of a cached session back to the offsets
+ * recorded at a commit point.  Returns false if a stream cannot be
+ * rewound, the entry must then be discarded.
+ */
+static bool
+resume_rewind(struct resume_entry *entry, const struct resume_point *rp)
+{
+    int iofd;
+    debug_decl(resume_rewind, SUDO_DEBUG_UTIL);
+
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	if (entry->iolog_files[iofd].enabled && rp->offsets[iofd] == -1)
+	    debug_return_bool(false);
+    }
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	FILE *fp = entry->iolog_files[iofd].fd.f;
+
+	if (!entry->iolog_files[iofd].enabled)
+	    continue;
+	if (fflush(fp) != 0 || ftruncate(fileno(fp), rp->offsets[iofd]) == -1 ||
+		fseeko(fp, rp->offsets[iofd], SEEK_SET) == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to rewind %s/%s to %lld", entry->evlog->iolog_path,
+		iolog_fd_to_name(iofd), (long long)rp->offsets[iofd]);
+	    debug_return_bool(false);
+	}
+    }
+    entry->elapsed_time = rp->elapsed_time;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Take over the I/O log state of a local connection that was
+ * dropped before the command finished.
+ * Returns true if the state was cached, else false, in which case
+ * the caller closes the log as usual.
+ */
+bool
+resume_cache_stash(struct connection_closure *closure)
+{
+    struct timespec *timeout = logsrvd_conf_server_resume_timeout();
+    struct resume_entry *entry;
+    unsigned int cache_max;
+    debug_decl(resume_cache_stash, SUDO_DEBUG_UTIL);
+
+    if (timeout == NULL || closure->cms != &cms_local || !closure->log_io)
+	debug_return_bool(false);
+    if (closure->state != RUNNING || closure->error)
+	debug_return_bool(false);
+    if (closure->evlog == NULL || closure->evlog->iolog_path == NULL ||
+	    closure->iolog_dir_fd == -1)
+	debug_return_bool(false);
+
+    /*
+     * The client resumes from its last commit point, which is almost
+     * never exactly where we stopped, so a log we cannot rewind would
+     * hold its descriptors for nothing.
+     */
+    if (!resume_rewindable(closure)) {
+	sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	    "%s cannot be rewound, not caching", closure->evlog->iolog_path);
+	debug_return_bool(false);
+    }
+    if ((cache_max = resume_cache_max()) == 0) {
+	sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	    "descriptor limit too low, not caching %s",
+	    closure->evlog->iolog_path);
+	debug_return_bool(false);
+    }
+
+    if (!resume_flush(closure)) {
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+	    "unable to flush %s, not caching", closure->evlog->iolog_path);
+	debug_return_bool(false);
+    }
+
+    if ((entry = calloc(1, sizeof(*entry))) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "calloc(1, %zu)", sizeof(*entry));
+	debug_return_bool(false);
+    }
+    entry->iolog_dir_fd = -1;
+    entry->expire_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT, resume_expire_cb,
+	entry);
+    if (entry->expire_ev == NULL) {
+	free(entry);
+	debug_return_bool(false);
+    }
+    if (sudo_ev_add(closure->evbase, entry->expire_ev, timeout, false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add resume expire event");
+	sudo_ev_free(entry->expire_ev);
+	free(entry);
+	debug_return_bool(false);
+    }
+
+    /* Make room by closing the oldest sessions. */
+    while (resume_cache_len >= cache_max) {
+	resume_stats.evicted++;
+	resume_entry_free(TAILQ_FIRST(&resume_cache));
+    }
+
+    resume_move(entry, closure, false);
+    TAILQ_INSERT_TAIL(&resume_cache, entry, entries);
+    resume_cache_len++;
+    resume_stats.stashed++;
+
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"caching %s at [%lld, %ld] for restart", entry->evlog->iolog_path,
+	(long long)entry->elapsed_time.tv_sec, entry->elapsed_time.tv_nsec);
+
+    debug_return_bool(true);
+}
+
+/*
+ * Resume a cached session for log_id if we have written exactly up
+ * to the target or can rewind to it.  A cached session at any other
+ * position is closed so the caller can reopen the log from disk.
+ * Returns true if the I/O log state was restored to closure.
+ */
+bool
+resume_cache_restore(const char *log_id, const struct timespec *target,
+    struct connection_closure *closure)
+{
+    struct resume_entry *entry;
+    unsigned int i;
+    debug_decl(resume_cache_restore, SUDO_DEBUG_UTIL);
+
+    if (logsrvd_conf_server_resume_timeout() != NULL)
+	resume_stats.restarts++;
+
+    TAILQ_FOREACH(entry, &resume_cache, entries) {
+	if (strcmp(entry->evlog->iolog_path, log_id) == 0)
+	    break;
+    }
+    if (entry == NULL) {
+	if (logsrvd_conf_server_resume_timeout() != NULL)
+	    resume_stats.misses++;
+	debug_return_bool(false);
+    }
+
+    if (sudo_timespeccmp(&entry->elapsed_time, target, ==)) {
+	resume_stats.hits++;
+    } else {
+	/* Look for the commit point the client is resuming from. */
+	for (i = 0; i < entry->nresume_points; i++) {
+	    if (sudo_timespeccmp(&entry->resume_points[i].elapsed_time,
+		    target, ==))
+		break;
+	}
+	if (i == entry->nresume_points ||
+		!resume_rewind(entry, &entry->resume_points[i])) {
+	    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+		"cached %s at [%lld, %ld], restart at [%lld, %ld]",
+		log_id, (long long)entry->elapsed_time.tv_sec,
+		entry->elapsed_time.tv_nsec, (long long)target->tv_sec,
+		target->tv_nsec);
+	    resume_stats.misses++;
+	    resume_entry_free(entry);
+	    debug_return_bool(false);
+	}
+	/* Later commit points are past the new end of the log. */
+	entry->nresume_points = i + 1;
+	resume_stats.rewound++;
+    }
+
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"resuming cached %s at [%lld, %ld]", log_id,
+	(long long)target->tv_sec, target->tv_nsec);
+    resume_move(entry, closure, true);
+    resume_entry_free(entry);
+
+    debug_return_bool(true);
+}
+
+/*
+ * Close all cached sessions, used at shutdown.
+ */
+void
+resume_cache_flush(void)
+{
+    struct resume_entry *entry;
+    debug_decl(resume_cache_flush, SUDO_DEBUG_UTIL);
+
+    while ((entry = TAILQ_FIRST(&resume_cache)) != NULL)
+	resume_entry_free(entry);
+
+    debug_return;
+}
+
+void
+resume_cache_dump(void)
+{
+    debug_decl(resume_cache_dump, SUDO_DEBUG_UTIL);
+
+    if (logsrvd_conf_server_resume_timeout() == NULL &&
+	    resume_stats.stashed == 0)
+	debug_return;
+
+    /* Rewound sessions are hits too, misses include evicted sessions. */
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"resume cache: %u sessions, %llu cached, %llu restarts, "
+	"%llu resumed (%llu rewound), %llu missed, %.1f%% hit rate, "
+	"%llu expired, %llu evicted", resume_cache_len, resume_stats.stashed,
+	resume_stats.restarts, resume_stats.hits + resume_stats.rewound,
+	resume_stats.rewound, resume_stats.misses, resume_stats.restarts ?
+	(resume_stats.hits + resume_stats.rewound) * 100.0 /
+	resume_stats.restarts : 0.0, resume_stats.expired,
+	resume_stats.evicted);
+
+    debug_return;
+}
@@ -0,0 +1,741 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <limits.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(HAVE_OPENSSL)
+# include <openssl/ssl.h>
+# include <openssl/err.h>
+#endif
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_event.h"
+#include "sudo_eventlog.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrvd.h"
+
+/*
+ * A small pool of connections to the relay hosts that have already
+ * completed the TCP (and TLS) handshake.  A new session takes one of
+ * these instead of connecting, so it can start relaying immediately.
+ * The pool is topped up in the background, cycling through the relay
+ * addresses so that replicas can find standby connections to different
+ * hosts.  The relay sends its ServerHello as soon as it accepts the
+ * connection; it is read into a buffer that is handed over with the
+ * connection, so that a read event notices when the relay closes it.
+ */
+
+struct standby_conn {
+    TAILQ_ENTRY(standby_conn) entries;
+    struct server_address_list *relays;	/* list addr belongs to */
+    struct server_address *addr;
+    struct sudo_event *ev;
+    struct connection_buffer read_buf;
+    struct timespec expires;
+    struct peer_info name;
+#if defined(HAVE_OPENSSL)
+    SSL *ssl;
+#endif
+    int sock;
+    bool ready;
+};
+TAILQ_HEAD(standby_list, standby_conn);
+
+static struct standby_list standby_conns =
+    TAILQ_HEAD_INITIALIZER(standby_conns);
+static struct sudo_event_base *standby_evbase;
+static struct sudo_event *refill_ev;
+static struct server_address_list *standby_relays;
+static struct server_address *standby_last;	/* last address used */
+static unsigned int standby_count;		/* connecting or ready */
+static unsigned int standby_failures;		/* consecutive failures */
+
+static struct standby_stats {
+    unsigned long long taken;
+    unsigned long long missed;
+    unsigned long long expired;
+    unsigned long long closed;
+    unsigned long long failed;
+} stats;
+
+static void standby_ready(struct standby_conn *conn);
+
+static unsigned int
+address_count(struct server_address_list *relays)
+{
+    struct server_address *addr;
+    unsigned int count = 0;
+
+    TAILQ_FOREACH(addr, relays, entries)
+	count++;
+    return count;
+}
+
+static void
+standby_free(struct standby_conn *conn)
+{
+    debug_decl(standby_free, SUDO_DEBUG_UTIL);
+
+#if defined(HAVE_OPENSSL)
+    if (conn->ssl != NULL) {
+	SSL_shutdown(conn->ssl);
+	SSL_free(conn->ssl);
+    }
+#endif
+    sudo_ev_free(conn->ev);
+    free(conn->read_buf.data);
+    if (conn->sock != -1)
+	close(conn->sock);
+    sudo_rcstr_delref(conn->name.name);
+    if (conn->relays != NULL)
+	address_list_delref(conn->relays);
+    free(conn);
+
+    debug_return;
+}
+
+/*
+ * Remove a connection from the pool and free it.
+ */
+static void
+standby_discard(struct standby_conn *conn)
+{
+    debug_decl(standby_discard, SUDO_DEBUG_UTIL);
+
+    TAILQ_REMOVE(&standby_conns, conn, entries);
+    standby_count--;
+    standby_free(conn);
+
+    debug_return;
+}
+
+/*
+ * Schedule the pool to be topped up.  Once a connection to every
+ * relay address has failed in a row, wait for the relay retry interval.
+ */
+static void
+standby_schedule(void)
+{
+    struct timespec timeout = { 0, 0 };
+    debug_decl(standby_schedule, SUDO_DEBUG_UTIL);
+
+    if (refill_ev == NULL || logsrvd_conf_relay_standby() == 0)
+	debug_return;
+    if (sudo_ev_pending(refill_ev, SUDO_EV_TIMEOUT, NULL))
+	debug_return;
+
+    if (standby_failures >= address_count(logsrvd_conf_relay_address()))
+	timeout.tv_sec = logsrvd_conf_relay_retry_interval();
+    if (sudo_ev_add(standby_evbase, refill_ev, &timeout, false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add standby refill event");
+    }
+
+    debug_return;
+}
+
+/*
+ * A standby connection could not be established.
+ */
+static void
+standby_failed(struct standby_conn *conn, const char *errstr)
+{
+    debug_decl(standby_failed, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+	"unable to establish standby connection to %s (%s): %s",
+	conn->name.name, conn->name.ipaddr, errstr);
+    stats.failed++;
+    standby_failures++;
+    standby_discard(conn);
+    standby_schedule();
+    logsrvd_resolve_retry();
+
+    debug_return;
+}
+
+/*
+ * The connection sat idle for too long, replace it with a new one.
+ */
+static void
+standby_expire(struct standby_conn *conn)
+{
+    debug_decl(standby_expire, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"standby connection to %s (%s) expired", conn->name.name,
+	conn->name.ipaddr);
+    stats.expired++;
+    standby_discard(conn);
+    standby_schedule();
+
+    debug_return;
+}
+
+/*
+ * The relay closed the connection (or it failed), replace it now
+ * rather than waiting for it to expire.
+ */
+static void
+standby_closed(struct standby_conn *conn, const char *errstr)
+{
+    debug_decl(standby_closed, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"standby connection to %s (%s) closed by relay: %s",
+	conn->name.name, conn->name.ipaddr, errstr);
+    stats.closed++;
+    standby_discard(conn);
+    standby_schedule();
+
+    debug_return;
+}
+
+/*
+ * Read what the relay sends on a ready connection, normally just the
+ * ServerHello, so the read event only fires again when there is more
+ * data or the relay closes the connection.
+ */
+static void
+standby_read_cb(int sock, int what, void *v)
+{
+    struct standby_conn *conn = v;
+    struct connection_buffer *buf = &conn->read_buf;
+    struct timespec now, timeout;
+    ssize_t nread;
+    debug_decl(standby_read_cb, SUDO_DEBUG_UTIL);
+
+    if (what == SUDO_EV_TIMEOUT) {
+	standby_expire(conn);
+	debug_return;
+    }
+    if (buf->len == buf->size) {
+	standby_closed(conn, "unexpected data from relay");
+	debug_return;
+    }
+
+#if defined(HAVE_OPENSSL)
+    if (conn->ssl != NULL) {
+	const char *errstr;
+	int ret;
+
+	ret = SSL_read(conn->ssl, buf->data + buf->len, buf->size - buf->len);
+	nread = ret;
+	if (ret <= 0) {
+	    switch (SSL_get_error(conn->ssl, ret)) {
+	    case SSL_ERROR_ZERO_RETURN:
+		nread = 0;
+		break;
+	    case SSL_ERROR_WANT_READ:
+		/* Only a TLS record, such as a session ticket, was read. */
+		errno = EAGAIN;
+		nread = -1;
+		break;
+	    case SSL_ERROR_SYSCALL:
+		/* EOF or errno is set, handled below. */
+		nread = ret == 0 ? 0 : -1;
+		break;
+	    default:
+		errstr = ERR_reason_error_string(ERR_get_error());
+		standby_closed(conn, errstr ? errstr : "TLS error");
+		debug_return;
+	    }
+	}
+    } else
+#endif
+    {
+	nread = read(sock, buf->data + buf->len, buf->size - buf->len);
+    }
+
+    switch (nread) {
+    case -1:
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	    break;
+	standby_closed(conn, strerror(errno));
+	debug_return;
+    case 0:
+	standby_closed(conn, "EOF");
+	debug_return;
+    default:
+	buf->len += nread;
+	break;
+    }
+
+    /* Keep the original expiry time. */
+    sudo_gettime_mono(&now);
+    if (sudo_timespeccmp(&now, &conn->expires, >=)) {
+	standby_expire(conn);
+	debug_return;
+    }
+    sudo_timespecsub(&conn->expires, &now, &timeout);
+    if (sudo_ev_add(standby_evbase, conn->ev, &timeout, false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add standby read event");
+	standby_discard(conn);
+	standby_schedule();
+    }
+
+    debug_return;
+}
+
+#if defined(HAVE_OPENSSL)
+static void
+standby_tls_cb(int sock, int what, void *v)
+{
+    struct standby_conn *conn = v;
+    const struct timespec *timeout = logsrvd_conf_relay_connect_timeout();
+    const char *errstr;
+    short events;
+    int ret;
+    debug_decl(standby_tls_cb, SUDO_DEBUG_UTIL);
+
+    if (what == SUDO_EV_TIMEOUT) {
+	standby_failed(conn, "TLS handshake timeout");
+	debug_return;
+    }
+
+    ret = SSL_connect(conn->ssl);
+    if (ret == 1) {
+	standby_ready(conn);
+	debug_return;
+    }
+    switch (SSL_get_error(conn->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+	events = SUDO_EV_READ;
+	break;
+    case SSL_ERROR_WANT_WRITE:
+	events = SUDO_EV_WRITE;
+	break;
+    case SSL_ERROR_SYSCALL:
+	standby_failed(conn, strerror(errno));
+	debug_return;
+    default:
+	errstr = ERR_reason_error_string(ERR_get_error());
+	standby_failed(conn, errstr ? errstr : "TLS handshake failed");
+	debug_return;
+    }
+    if (sudo_ev_set(conn->ev, sock, events, standby_tls_cb, conn) == -1 ||
+	    sudo_ev_add(standby_evbase, conn->ev, timeout, false) == -1) {
+	standby_failed(conn, "unable to add event to queue");
+    }
+
+    debug_return;
+}
+
+/*
+ * Start the TLS handshake with the relay.
+ * Returns false on error.
+ */
+static bool
+standby_tls_start(struct standby_conn *conn)
+{
+    debug_decl(standby_tls_start, SUDO_DEBUG_UTIL);
+
+    if ((conn->ssl = SSL_new(logsrvd_relay_tls_ctx())) == NULL)
+	debug_return_bool(false);
+    if (SSL_set_ex_data(conn->ssl, 1, &conn->name) <= 0)
+	debug_return_bool(false);
+    if (SSL_set_fd(conn->ssl, conn->sock) <= 0)
+	debug_return_bool(false);
+
+    if (conn->ev == NULL) {
+	conn->ev = sudo_ev_alloc(conn->sock, SUDO_EV_WRITE, standby_tls_cb,
+	    conn);
+	if (conn->ev == NULL)
+	    debug_return_bool(false);
+    } else if (sudo_ev_set(conn->ev, conn->sock, SUDO_EV_WRITE,
+	    standby_tls_cb, conn) == -1) {
+	debug_return_bool(false);
+    }
+    if (sudo_ev_add(standby_evbase, conn->ev, NULL, false) == -1)
+	debug_return_bool(false);
+
+    debug_return_bool(true);
+}
+#endif /* HAVE_OPENSSL */
+
+/*
+ * The connection (and TLS handshake) is complete, the connection
+ * may now be handed out.  It is replaced after RELAY_STANDBY_IDLE_MAX
+ * seconds so that middleboxes and the relay do not see it go stale,
+ * or as soon as the relay closes it.
+ */
+static void
+standby_ready(struct standby_conn *conn)
+{
+    struct timespec timeout = { RELAY_STANDBY_IDLE_MAX, 0 };
+    debug_decl(standby_ready, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	"standby connection to %s (%s) ready", conn->name.name,
+	conn->name.ipaddr);
+    conn->ready = true;
+    standby_failures = 0;
+
+    /* Same size as the relay read buffer it will be swapped with. */
+    conn->read_buf.size = 8 * 1024;
+    conn->read_buf.data = malloc(conn->read_buf.size);
+    if (conn->read_buf.data == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate standby read buffer");
+	standby_discard(conn);
+	debug_return;
+    }
+
+    if (conn->ev == NULL) {
+	conn->ev = sudo_ev_alloc(conn->sock, SUDO_EV_READ, standby_read_cb,
+	    conn);
+    } else if (sudo_ev_set(conn->ev, conn->sock, SUDO_EV_READ,
+	    standby_read_cb, conn) == -1) {
+	sudo_ev_free(conn->ev);
+	conn->ev = NULL;
+    }
+    sudo_gettime_mono(&conn->expires);
+    sudo_timespecadd(&conn->expires, &timeout, &conn->expires);
+    if (conn->ev == NULL ||
+	    sudo_ev_add(standby_evbase, conn->ev, &timeout, false) == -1) {
+	/* Without an expiry event the connection may go stale. */
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add standby read event");
+	standby_discard(conn);
+    }
+
+    debug_return;
+}
+
+/*
+ * The TCP connection is up, start TLS or mark the connection ready.
+ */
+static void
+standby_connected(struct standby_conn *conn)
+{
+    debug_decl(standby_connected, SUDO_DEBUG_UTIL);
+
+#if defined(HAVE_OPENSSL)
+    if (conn->addr->tls) {
+	if (!standby_tls_start(conn))
+	    standby_failed(conn, "unable to start TLS handshake");
+	debug_return;
+    }
+#endif
+    standby_ready(conn);
+
+    debug_return;
+}
+
+static void
+standby_connect_cb(int sock, int what, void *v)
+{
+    struct standby_conn *conn = v;
+    int errnum, optval, ret;
+    socklen_t optlen = sizeof(optval);
+    debug_decl(standby_connect_cb, SUDO_DEBUG_UTIL);
+
+    if (what == SUDO_EV_TIMEOUT) {
+	errnum = ETIMEDOUT;
+    } else {
+	ret = getsockopt(sock, SOL_SOCKET, SO_ERROR, &optval, &optlen);
+	errnum = ret == 0 ? optval : errno;
+    }
+    if (errnum != 0) {
+	standby_failed(conn, strerror(errnum));
+	debug_return;
+    }
+    standby_connected(conn);
+
+    debug_return;
+}
+
+/*
+ * Start a standby connection to the relay address after the one
+ * used last.  Fast Open is not used; a deferred connection would not
+ * actually be established until the session sends its first message.
+ * Returns false if the connection could not be started.
+ */
+static bool
+standby_connect(struct server_address_list *relays)
+{
+    struct standby_conn *conn;
+    struct server_address *addr = NULL;
+    bool connected;
+    debug_decl(standby_connect, SUDO_DEBUG_UTIL);
+
+    /* Start over if the configuration has been reloaded. */
+    if (standby_relays != relays) {
+	if (standby_relays != NULL)
+	    address_list_delref(standby_relays);
+	address_list_addref(relays);
+	standby_relays = relays;
+	standby_last = NULL;
+    }
+    if (standby_last != NULL)
+	addr = TAILQ_NEXT(standby_last, entries);
+    if (addr == NULL)
+	addr = TAILQ_FIRST(relays);
+    if (addr == NULL)
+	debug_return_bool(false);
+    standby_last = addr;
+
+    if ((conn = calloc(1, sizeof(*conn))) == NULL)
+	debug_return_bool(false);
+    conn->addr = addr;
+    conn->relays = relays;
+    address_list_addref(relays);
+    (void)relay_format_addr(addr, conn->name.ipaddr,
+	sizeof(conn->name.ipaddr));
+    conn->name.name = sudo_rcstr_addref(addr->sa_host);
+
+    conn->sock = relay_connect_start(addr, false, &connected);
+    if (conn->sock == -1) {
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to connect to relay %s", addr->sa_str);
+	stats.failed++;
+	standby_free(conn);
+	debug_return_bool(false);
+    }
+    TAILQ_INSERT_TAIL(&standby_conns, conn, entries);
+    standby_count++;
+
+    if (connected) {
+	standby_connected(conn);
+	debug_return_bool(true);
+    }
+    conn->ev = sudo_ev_alloc(conn->sock, SUDO_EV_WRITE, standby_connect_cb,
+	conn);
+    if (conn->ev == NULL || sudo_ev_add(standby_evbase, conn->ev,
+	    logsrvd_conf_relay_connect_timeout(), false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add standby connect event");
+	standby_discard(conn);
+	debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
+static void
+standby_refill_cb(int unused, int what, void *v)
+{
+    struct server_address_list *relays = logsrvd_conf_relay_address();
+    const unsigned int wanted = logsrvd_conf_relay_standby();
+    const unsigned int naddrs = address_count(relays);
+    debug_decl(standby_refill_cb, SUDO_DEBUG_UTIL);
+
+    /* We have waited out the retry interval, try every address again. */
+    if (standby_failures >= naddrs)
+	standby_failures = 0;
+
+    while (standby_count < wanted && standby_failures < naddrs) {
+	if (!standby_connect(relays))
+	    standby_failures++;
+    }
+    if (standby_count < wanted)
+	standby_schedule();
+
+    debug_return;
+}
+
+/*
+ * Returns true if the relay has not closed the connection since
+ * the read event last ran.  Only peek so no data is lost.
+ */
+static bool
+standby_alive(struct standby_conn *conn)
+{
+    char ch;
+    ssize_t nread;
+    debug_decl(standby_alive, SUDO_DEBUG_UTIL);
+
+    nread = recv(conn->sock, &ch, 1, MSG_PEEK);
+    if (nread == 0)
+	debug_return_bool(false);
+    if (nread == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+	debug_return_bool(false);
+    debug_return_bool(true);
+}
+
+/*
+ * Hand a ready standby connection to a relay host not used by another
+ * replica over to relay_closure.  The socket, relay address, TLS state
+ * and any data read are moved; the caller then starts the relay protocol.
+ * Returns true if a connection was found, else false.
+ */
+bool
+logsrvd_standby_take(struct relay_closure *relay_closure)
+{
+    struct standby_conn *conn, *next;
+    struct connection_buffer tmp;
+    debug_decl(logsrvd_standby_take, SUDO_DEBUG_UTIL);
+
+    if (logsrvd_conf_relay_standby() == 0)
+	debug_return_bool(false);
+
+    TAILQ_FOREACH_SAFE(conn, &standby_conns, entries, next) {
+	if (!conn->ready || conn->relays != relay_closure->relays)
+	    continue;
+	if (relay_host_in_use(relay_closure, conn->addr))
+	    continue;
+	if (!standby_alive(conn)) {
+	    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+		"standby connection to %s (%s) closed by relay",
+		conn->name.name, conn->name.ipaddr);
+	    stats.closed++;
+	    standby_discard(conn);
+	    continue;
+	}
+
+	sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+	    "using standby connection to %s (%s)", conn->name.name,
+	    conn->name.ipaddr);
+	relay_closure->sock = conn->sock;
+	relay_closure->relay_addr = conn->addr;
+	relay_closure->relay_tried = conn->addr;
+	relay_closure->relay_name = conn->name;
+	conn->sock = -1;
+	conn->name.name = NULL;
+
+	/* Hand over the ServerHello read so far. */
+	tmp = relay_closure->read_buf;
+	relay_closure->read_buf = conn->read_buf;
+	conn->read_buf = tmp;
+#if defined(HAVE_OPENSSL)
+	if (conn->ssl != NULL) {
+	    /* Peer info must outlive the SSL object. */
+	    SSL_set_ex_data(conn->ssl, 1, &relay_closure->relay_name);
+	    relay_closure->tls_client.ssl = conn->ssl;
+	    conn->ssl = NULL;
+	}
+#endif
+	standby_discard(conn);
+	stats.taken++;
+	standby_schedule();
+	debug_return_bool(true);
+    }
+
+    stats.missed++;
+    standby_schedule();
+    debug_return_bool(false);
+}
+
+/*
+ * Drop all standby connections, the relay hosts or TLS settings may
+ * have changed.  The pool is refilled using the new configuration.
+ */
+void
+logsrvd_standby_reload(void)
+{
+    struct standby_conn *conn;
+    debug_decl(logsrvd_standby_reload, SUDO_DEBUG_UTIL);
+
+    while ((conn = TAILQ_FIRST(&standby_conns)) != NULL)
+	standby_discard(conn);
+    standby_failures = 0;
+    if (refill_ev != NULL)
+	sudo_ev_del(standby_evbase, refill_ev);
+    standby_schedule();
+
+    debug_return;
+}
+
+bool
+logsrvd_standby_init(struct sudo_event_base *evbase)
+{
+    debug_decl(logsrvd_standby_init, SUDO_DEBUG_UTIL);
+
+    standby_evbase = evbase;
+    refill_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT, standby_refill_cb, NULL);
+    if (refill_ev == NULL)
+	debug_return_bool(false);
+    standby_schedule();
+
+    debug_return_bool(true);
+}
+
+void
+logsrvd_standby_close(void)
+{
+    struct standby_conn *conn;
+    debug_decl(logsrvd_standby_close, SUDO_DEBUG_UTIL);
+
+    while ((conn = TAILQ_FIRST(&standby_conns)) != NULL)
+	standby_discard(conn);
+    sudo_ev_free(refill_ev);
+    refill_ev = NULL;
+    if (standby_relays != NULL) {
+	address_list_delref(standby_relays);
+	standby_relays = NULL;
+    }
+    standby_last = NULL;
+
+    debug_return;
+}
+
+void
+logsrvd_standby_dump(void)
+{
+    struct standby_conn *conn;
+    unsigned int nready = 0;
+    debug_decl(logsrvd_standby_dump, SUDO_DEBUG_UTIL);
+
+    if (logsrvd_conf_relay_standby() == 0 && TAILQ_EMPTY(&standby_conns))
+	debug_return;
+
+    TAILQ_FOREACH(conn, &standby_conns, entries) {
+	if (conn->ready)
+	    nready++;
+    }
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"standby relay connections: %u ready, %u connecting, "
+	"%llu taken, %llu missed, %llu expired, %llu closed, %llu failed",
+	nready, standby_count - nready, stats.taken, stats.missed,
+	stats.expired, stats.closed, stats.failed);
+    TAILQ_FOREACH(conn, &standby_conns, entries) {
+	sudo_debug_printf(SUDO_DEBUG_INFO, "  %s (%s)%s", conn->name.name,
+	    conn->name.ipaddr, conn->ready ? "" : " connecting");
+    }
+
+    debug_return;
+}
@@ -0,0 +1,304 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_STATVFS_H
+# include <sys/statvfs.h>
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_event.h"
+#include "sudo_eventlog.h"
+#include "sudo_gettext.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrvd.h"
+
+/*
+ * Free space and write latency for a storage volume.
+ * The latency is an exponentially weighted moving average in microseconds
+ * of the time taken to flush (or, with commit_sync, sync) a session's
+ * logs at each commit point.  Individual writes only fill the stdio or
+ * zlib buffers so timing them would not reflect the disk.
+ */
+struct storage_volume {
+    const char *name;
+    enum storage_state state;
+    unsigned int free_pct;
+    unsigned long long latency;
+    unsigned long long nwrites;
+    unsigned long long transitions;
+};
+
+static struct storage_volume volumes[STORAGE_NVOLUMES] = {
+    { "iolog_dir", STORAGE_OK, 100 },
+    { "relay_dir", STORAGE_OK, 100 }
+};
+
+static struct sudo_event *storage_ev;
+
+static const char *
+storage_state_name(enum storage_state state)
+{
+    switch (state) {
+    case STORAGE_OK:
+	return "ok";
+    case STORAGE_SOFT:
+	return "soft limit";
+    case STORAGE_HARD:
+	return "hard limit";
+    default:
+	return "unknown";
+    }
+}
+
+/*
+ * Fill in dir with the static part of path, before any escape sequences.
+ * For example, "/var/log/sudo-io/%{user}" becomes "/var/log/sudo-io".
+ */
+bool
+storage_base_dir(const char *path, char *dir, size_t dirsize)
+{
+    const char *cp;
+    size_t len;
+    debug_decl(storage_base_dir, SUDO_DEBUG_UTIL);
+
+    if (path == NULL)
+	debug_return_bool(false);
+    cp = strchr(path, '%');
+    len = cp ? (size_t)(cp - path) : strlen(path);
+    if (cp != NULL) {
+	/* Trim back to the last complete path component. */
+	while (len > 1 && path[len - 1] != '/')
+	    len--;
+    }
+    while (len > 1 && path[len - 1] == '/')
+	len--;
+    if (len == 0 || len >= dirsize)
+	debug_return_bool(false);
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+
+    debug_return_bool(true);
+}
+
+#ifdef HAVE_SYS_STATVFS_H
+/*
+ * Compute the percentage of free space on the volume containing path.
+ * Returns -1 if it cannot be determined.
+ */
+static int
+storage_free_pct(const char *path)
+{
+    char dir[PATH_MAX];
+    struct statvfs sv;
+    debug_decl(storage_free_pct, SUDO_DEBUG_UTIL);
+
+    if (!storage_base_dir(path, dir, sizeof(dir)))
+	debug_return_int(-1);
+    if (statvfs(dir, &sv) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to statvfs %s", dir);
+	debug_return_int(-1);
+    }
+    if (sv.f_blocks == 0)
+	debug_return_int(-1);
+    debug_return_int((int)((unsigned long long)sv.f_bavail * 100 /
+	sv.f_blocks));
+}
+#else
+static int
+storage_free_pct(const char *path)
+{
+    return -1;
+}
+#endif /* HAVE_SYS_STATVFS_H */
+
+/*
+ * Update the state of a volume based on its free space and write latency.
+ */
+static void
+storage_update(enum storage_volume_id id, const char *path)
+{
+    struct storage_volume *vol = &volumes[id];
+    const unsigned int soft = logsrvd_conf_server_free_space_soft();
+    const unsigned int hard = logsrvd_conf_server_free_space_hard();
+    const unsigned int max_latency = logsrvd_conf_server_write_latency_max();
+    enum storage_state state = STORAGE_OK;
+    int pct;
+    debug_decl(storage_update, SUDO_DEBUG_UTIL);
+
+    if ((pct = storage_free_pct(path)) != -1) {
+	vol->free_pct = pct;
+	if (hard != 0 && vol->free_pct < hard)
+	    state = STORAGE_HARD;
+	else if (soft != 0 && vol->free_pct < soft)
+	    state = STORAGE_SOFT;
+    }
+    if (state == STORAGE_OK && max_latency != 0 &&
+	    vol->latency > (unsigned long long)max_latency * 1000) {
+	state = STORAGE_SOFT;
+    }
+
+    if (state != vol->state) {
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+	    "%s %s: %s -> %s (%u%% free, %llu usec write latency)", vol->name,
+	    path, storage_state_name(vol->state), storage_state_name(state),
+	    vol->free_pct, vol->latency);
+	vol->state = state;
+	vol->transitions++;
+    }
+
+    debug_return;
+}
+
+/*
+ * Periodically check the iolog and relay directories.
+ */
+static void
+storage_check_cb(int unused, int what, void *v)
+{
+    struct sudo_event_base *evbase = v;
+    struct timespec tv = { STORAGE_CHECK_INTERVAL, 0 };
+    debug_decl(storage_check_cb, SUDO_DEBUG_UTIL);
+
+    storage_update(STORAGE_IOLOG_DIR, logsrvd_conf_iolog_dir());
+    storage_update(STORAGE_RELAY_DIR, logsrvd_conf_relay_dir());
+
+    if (sudo_ev_add(evbase, storage_ev, &tv, false) == -1) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to add storage check event");
+    }
+
+    debug_return;
+}
+
+/*
+ * Start monitoring storage, checking immediately.
+ */
+bool
+storage_monitor_init(struct sudo_event_base *evbase)
+{
+    debug_decl(storage_monitor_init, SUDO_DEBUG_UTIL);
+
+    if (storage_ev == NULL) {
+	storage_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT, storage_check_cb,
+	    evbase);
+	if (storage_ev == NULL)
+	    debug_return_bool(false);
+    }
+    storage_check_cb(-1, SUDO_EV_TIMEOUT, evbase);
+
+    debug_return_bool(true);
+}
+
+/*
+ * Record the time it took to flush a session's logs to a volume.
+ */
+void
+storage_record_write(enum storage_volume_id id, const struct timespec *start)
+{
+    struct storage_volume *vol = &volumes[id];
+    struct timespec now, elapsed;
+    unsigned long long usec;
+
+    sudo_gettime_mono(&now);
+    sudo_timespecsub(&now, start, &elapsed);
+    usec = (unsigned long long)elapsed.tv_sec * 1000000 +
+	elapsed.tv_nsec / 1000;
+    vol->latency = vol->nwrites++ ? (vol->latency * 7 + usec) / 8 : usec;
+}
+
+enum storage_state
+storage_state(enum storage_volume_id id)
+{
+    return volumes[id].state;
+}
+
+/*
+ * If the volume is over a soft or hard limit, returns true and
+ * sets delay to how long to stop reading from the client.
+ * A session cannot move to a different volume once it has started
+ * storing data, so over the hard limit existing sessions are stalled
+ * until space is freed.  Only new sessions are diverted or refused.
+ */
+bool
+storage_backpressure(enum storage_volume_id id, struct timespec *delay)
+{
+    debug_decl(storage_backpressure, SUDO_DEBUG_UTIL);
+
+    switch (volumes[id].state) {
+    case STORAGE_SOFT:
+	delay->tv_sec = 0;
+	delay->tv_nsec = STORAGE_SOFT_DELAY_MSEC * 1000000;
+	break;
+    case STORAGE_HARD:
+	delay->tv_sec = STORAGE_CHECK_INTERVAL;
+	delay->tv_nsec = 0;
+	break;
+    default:
+	debug_return_bool(false);
+    }
+    debug_return_bool(true);
+}
+
+/*
+ * Dump storage state to the debug file.
+ */
+void
+storage_dump(void)
+{
+    int i;
+    debug_decl(storage_dump, SUDO_DEBUG_UTIL);
+
+    sudo_debug_printf(SUDO_DEBUG_INFO, "storage:");
+    for (i = 0; i < STORAGE_NVOLUMES; i++) {
+	struct storage_volume *vol = &volumes[i];
+
+	sudo_debug_printf(SUDO_DEBUG_INFO,
+	    "  %s: %s, %u%% free, %llu usec write latency, %llu transitions",
+	    vol->name, storage_state_name(vol->state), vol->free_pct,
+	    vol->latency, vol->transitions);
+    }
+
+    debug_return;
+}
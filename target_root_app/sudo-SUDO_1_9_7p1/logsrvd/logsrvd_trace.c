@@ -0,0 +1,703 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_debug.h"
+#include "sudo_event.h"
+#include "sudo_eventlog.h"
+#include "sudo_iolog.h"
+#include "sudo_json.h"
+#include "sudo_queue.h"
+#include "sudo_rand.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrvd.h"
+
+/*
+ * Per-session latency tracing across relay chains.
+ *
+ * The trace context is carried in the AcceptMessage as a "trace_context"
+ * InfoMessage in W3C traceparent format:
+ *     00-<32 hex digit trace ID>-<16 hex digit parent span ID>-<flags>
+ * Servers that do not trace ignore it like any other unknown key.
+ * Each hop records one span per session with the time from receiving
+ * an I/O buffer until it had been written to every relay (queue) and
+ * until the commit point covering it was sent back (commit).  When
+ * relaying, the context is passed on with this hop's span as parent,
+ * so the difference between adjacent hops' commit latency is the time
+ * spent in that hop.  Finished spans are appended to the trace_file
+ * as one JSON object per line.
+ *
+ * Every stride'th I/O buffer is sampled.  When the samples waiting for
+ * a commit point no longer fit, the stride is doubled and the samples
+ * not on it are dropped, so the samples stay spread evenly over the
+ * commit interval however fast I/O buffers arrive.  The stride is
+ * halved again at a commit point if few samples are left waiting.
+ * The relay write buffers of a sampled I/O buffer are tagged with
+ * its sequence number.
+ */
+
+#define TRACE_CONTEXT_KEY	"trace_context"
+#define TRACE_CONTEXT_LEN	(2 + 1 + 32 + 1 + 16 + 1 + 2)
+
+/* Maximum number of sampled I/O buffers waiting for a commit point. */
+#define TRACE_SAMPLES_MAX	128
+
+struct trace_sample {
+    unsigned long long seq;	/* I/O buffer sequence number, from 1 */
+    unsigned int pending;	/* relay write buffers not yet written */
+    struct timespec elapsed;	/* session time of the I/O buffer */
+    struct timespec received;
+    struct timespec forwarded;	/* last relay write buffer written */
+};
+
+struct trace_latency {
+    unsigned long long count;
+    unsigned long long min_usec;
+    unsigned long long max_usec;
+    unsigned long long sum_usec;
+};
+
+struct session_trace {
+    uint8_t trace_id[16];
+    uint8_t span_id[8];
+    uint8_t parent_id[8];
+    bool has_parent;
+    struct timespec start_real;
+    struct timespec start;
+    struct timespec elapsed;
+    struct trace_latency queue;
+    struct trace_latency commit;
+    unsigned long long iobufs;
+    unsigned long long unsampled;
+    unsigned long long stride;
+    unsigned int head;
+    unsigned int count;
+    struct trace_sample samples[TRACE_SAMPLES_MAX];
+};
+
+static struct trace_stats {
+    unsigned long long sessions;
+    unsigned long long spans;
+    unsigned long long errors;
+} trace_stats;
+
+static FILE *trace_fp;
+static char *trace_host;
+
+static bool
+parse_hex(const char *str, uint8_t *dst, size_t len)
+{
+    bool nonzero = false;
+    size_t i;
+    int ch;
+
+    for (i = 0; i < len; i++) {
+	if ((ch = sudo_hexchar(str + (i * 2))) == -1)
+	    return false;
+	dst[i] = (uint8_t)ch;
+	if (ch != 0)
+	    nonzero = true;
+    }
+    /* All-zero IDs are invalid. */
+    return nonzero;
+}
+
+static void
+format_hex(const uint8_t *src, size_t len, char *dst)
+{
+    const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	*dst++ = hex[src[i] >> 4];
+	*dst++ = hex[src[i] & 0x0f];
+    }
+    *dst = '\0';
+}
+
+/*
+ * Parse a version 00 traceparent string.
+ * Returns true if valid, else false.
+ */
+static bool
+parse_context(const char *str, struct session_trace *trace)
+{
+    debug_decl(parse_context, SUDO_DEBUG_UTIL);
+
+    if (strlen(str) != TRACE_CONTEXT_LEN || strncmp(str, "00-", 3) != 0)
+	debug_return_bool(false);
+    if (str[35] != '-' || str[52] != '-')
+	debug_return_bool(false);
+    if (!parse_hex(str + 3, trace->trace_id, sizeof(trace->trace_id)))
+	debug_return_bool(false);
+    if (!parse_hex(str + 36, trace->parent_id, sizeof(trace->parent_id)))
+	debug_return_bool(false);
+    trace->has_parent = true;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Start tracing the session if the AcceptMessage includes a trace
+ * context or trace_sessions is enabled.  Tracing is only done when
+ * a trace_file is configured.
+ */
+void
+trace_accept(AcceptMessage *msg, struct connection_closure *closure)
+{
+    struct session_trace *trace;
+    const char *context = NULL;
+    size_t i;
+    debug_decl(trace_accept, SUDO_DEBUG_UTIL);
+
+    if (logsrvd_conf_server_trace_file() == NULL || closure->trace != NULL)
+	debug_return;
+
+    for (i = 0; i < msg->n_info_msgs; i++) {
+	InfoMessage *info = msg->info_msgs[i];
+	if (strcmp(info->key, TRACE_CONTEXT_KEY) == 0) {
+	    if (info->value_case == INFO_MESSAGE__VALUE_STRVAL)
+		context = info->u.strval;
+	    break;
+	}
+    }
+    if (context == NULL && !logsrvd_conf_server_trace_sessions())
+	debug_return;
+
+    if ((trace = calloc(1, sizeof(*trace))) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	debug_return;
+    }
+    if (context != NULL && !parse_context(context, trace)) {
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+	    "invalid trace context \"%s\" from %s", context, closure->ipaddr);
+	if (!logsrvd_conf_server_trace_sessions()) {
+	    free(trace);
+	    debug_return;
+	}
+	/* Start a new trace instead. */
+	trace->has_parent = false;
+    }
+    if (!trace->has_parent)
+	arc4random_buf(trace->trace_id, sizeof(trace->trace_id));
+    arc4random_buf(trace->span_id, sizeof(trace->span_id));
+    trace->stride = 1;
+    sudo_gettime_real(&trace->start_real);
+    sudo_gettime_mono(&trace->start);
+
+    closure->trace = trace;
+    trace_stats.sessions++;
+
+    debug_return;
+}
+
+/*
+ * Pack a copy of the AcceptMessage with this hop as the parent span
+ * for relaying.  Returns NULL if the session is not being traced or
+ * on error, in which case the original message should be relayed.
+ */
+uint8_t *
+trace_pack_accept(AcceptMessage *msg, struct connection_closure *closure,
+    size_t *lenp)
+{
+    struct session_trace *trace = closure->trace;
+    ClientMessage client_msg = CLIENT_MESSAGE__INIT;
+    InfoMessage context_info = INFO_MESSAGE__INIT;
+    char context[TRACE_CONTEXT_LEN + 1];
+    AcceptMessage accept_msg = *msg;
+    InfoMessage **info_msgs;
+    uint8_t *buf = NULL;
+    size_t i, n = 0, len;
+    debug_decl(trace_pack_accept, SUDO_DEBUG_UTIL);
+
+    if (trace == NULL)
+	debug_return_ptr(NULL);
+
+    /* Replace any existing trace context with our own. */
+    info_msgs = reallocarray(NULL, msg->n_info_msgs + 1, sizeof(*info_msgs));
+    if (info_msgs == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	debug_return_ptr(NULL);
+    }
+    for (i = 0; i < msg->n_info_msgs; i++) {
+	if (strcmp(msg->info_msgs[i]->key, TRACE_CONTEXT_KEY) != 0)
+	    info_msgs[n++] = msg->info_msgs[i];
+    }
+    memcpy(context, "00-", 3);
+    format_hex(trace->trace_id, sizeof(trace->trace_id), context + 3);
+    context[35] = '-';
+    format_hex(trace->span_id, sizeof(trace->span_id), context + 36);
+    memcpy(context + 52, "-01", 4);
+    context_info.key = (char *)TRACE_CONTEXT_KEY;
+    context_info.u.strval = context;
+    context_info.value_case = INFO_MESSAGE__VALUE_STRVAL;
+    info_msgs[n++] = &context_info;
+
+    accept_msg.info_msgs = info_msgs;
+    accept_msg.n_info_msgs = n;
+    client_msg.u.accept_msg = &accept_msg;
+    client_msg.type_case = CLIENT_MESSAGE__TYPE_ACCEPT_MSG;
+
+    len = client_message__get_packed_size(&client_msg);
+    if (len > MESSAGE_SIZE_MAX) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "client message too large: %zu", len);
+	goto done;
+    }
+    if ((buf = malloc(len)) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+	    "unable to allocate memory");
+	goto done;
+    }
+    client_message__pack(&client_msg, buf);
+    *lenp = len;
+
+done:
+    free(info_msgs);
+    debug_return_ptr(buf);
+}
+
+/*
+ * The samples no longer fit, double the stride until they do,
+ * dropping the samples that are not on it.
+ */
+static void
+trace_thin(struct session_trace *trace)
+{
+    struct trace_sample *sample;
+    unsigned int i, n;
+    debug_decl(trace_thin, SUDO_DEBUG_UTIL);
+
+    while (trace->count == TRACE_SAMPLES_MAX) {
+	trace->stride *= 2;
+	for (i = n = 0; i < trace->count; i++) {
+	    sample = &trace->samples[(trace->head + i) % TRACE_SAMPLES_MAX];
+	    if (sample->seq % trace->stride != 0) {
+		trace->unsampled++;
+		continue;
+	    }
+	    trace->samples[(trace->head + n) % TRACE_SAMPLES_MAX] = *sample;
+	    n++;
+	}
+	trace->count = n;
+    }
+
+    debug_return;
+}
+
+/*
+ * Advance the session time by delay.  The arrival of a sampled I/O
+ * buffer is recorded until the commit point that covers it is sent.
+ */
+void
+trace_delay(TimeSpec *delay, bool iobuf, struct connection_closure *closure)
+{
+    struct session_trace *trace = closure->trace;
+    struct trace_sample *sample;
+    debug_decl(trace_delay, SUDO_DEBUG_UTIL);
+
+    if (trace == NULL || delay == NULL)
+	debug_return;
+
+    update_elapsed_time(delay, &trace->elapsed);
+    if (!iobuf)
+	debug_return;
+
+    trace->iobufs++;
+    if (trace->count == TRACE_SAMPLES_MAX)
+	trace_thin(trace);
+    if (trace->iobufs % trace->stride != 0) {
+	trace->unsampled++;
+	debug_return;
+    }
+    sample = &trace->samples[(trace->head + trace->count) % TRACE_SAMPLES_MAX];
+    trace->count++;
+    sample->seq = trace->iobufs;
+    sample->pending = 0;
+    sample->elapsed = trace->elapsed;
+    sudo_gettime_mono(&sample->received);
+    sudo_timespecclear(&sample->forwarded);
+
+    debug_return;
+}
+
+/*
+ * Find the waiting sample with sequence number seq, samples are
+ * kept in order.  Returns NULL if it has been committed or dropped.
+ */
+static struct trace_sample *
+trace_find(struct session_trace *trace, unsigned long long seq)
+{
+    struct trace_sample *sample;
+    unsigned int i;
+
+    for (i = 0; i < trace->count; i++) {
+	sample = &trace->samples[(trace->head + i) % TRACE_SAMPLES_MAX];
+	if (sample->seq == seq)
+	    return sample;
+	if (sample->seq > seq)
+	    break;
+    }
+    return NULL;
+}
+
+/*
+ * The I/O buffer just received is being queued for a relay.
+ * Returns the sequence number to tag the write buffer with,
+ * or 0 if the I/O buffer is not sampled.
+ */
+unsigned long long
+trace_enqueue(struct connection_closure *closure)
+{
+    struct session_trace *trace = closure->trace;
+    struct trace_sample *sample;
+
+    if (trace == NULL || trace->count == 0)
+	return 0;
+
+    sample = &trace->samples[
+	(trace->head + trace->count - 1) % TRACE_SAMPLES_MAX];
+    if (sample->seq != trace->iobufs)
+	return 0;
+    sample->pending++;
+    return sample->seq;
+}
+
+/*
+ * The last byte of a tagged relay write buffer has been written.
+ */
+void
+trace_forwarded(struct connection_closure *closure, unsigned long long seq)
+{
+    struct trace_sample *sample;
+    debug_decl(trace_forwarded, SUDO_DEBUG_UTIL);
+
+    if (closure->trace == NULL)
+	debug_return;
+
+    if ((sample = trace_find(closure->trace, seq)) != NULL) {
+	if (sample->pending > 0)
+	    sample->pending--;
+	sudo_gettime_mono(&sample->forwarded);
+    }
+
+    debug_return;
+}
+
+/*
+ * A tagged relay write buffer was discarded when its relay failed,
+ * the sample is complete once the remaining relays have written it.
+ */
+void
+trace_unqueued(struct connection_closure *closure, unsigned long long seq)
+{
+    struct trace_sample *sample;
+    debug_decl(trace_unqueued, SUDO_DEBUG_UTIL);
+
+    if (closure->trace == NULL)
+	debug_return;
+
+    if ((sample = trace_find(closure->trace, seq)) != NULL) {
+	if (sample->pending > 0)
+	    sample->pending--;
+    }
+
+    debug_return;
+}
+
+static void
+trace_latency_add(struct trace_latency *lat, const struct timespec *start,
+    const struct timespec *end)
+{
+    struct timespec diff;
+    unsigned long long usec;
+
+    sudo_timespecsub(end, start, &diff);
+    if (diff.tv_sec < 0)
+	sudo_timespecclear(&diff);
+    usec = (unsigned long long)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+
+    if (lat->count == 0 || usec < lat->min_usec)
+	lat->min_usec = usec;
+    if (usec > lat->max_usec)
+	lat->max_usec = usec;
+    lat->sum_usec += usec;
+    lat->count++;
+}
+
+/*
+ * A commit point is being sent to the client, account for the
+ * sampled I/O buffers it covers.
+ */
+void
+trace_commit(TimeSpec *commit_point, struct connection_closure *closure)
+{
+    struct session_trace *trace = closure->trace;
+    struct trace_sample *sample;
+    struct timespec cp, now;
+    debug_decl(trace_commit, SUDO_DEBUG_UTIL);
+
+    if (trace == NULL)
+	debug_return;
+
+    cp.tv_sec = commit_point->tv_sec;
+    cp.tv_nsec = commit_point->tv_nsec;
+    sudo_gettime_mono(&now);
+    while (trace->count > 0) {
+	sample = &trace->samples[trace->head];
+	if (sudo_timespeccmp(&sample->elapsed, &cp, >))
+	    break;
+	if (sample->pending == 0 && sudo_timespecisset(&sample->forwarded)) {
+	    trace_latency_add(&trace->queue, &sample->received,
+		&sample->forwarded);
+	}
+	trace_latency_add(&trace->commit, &sample->received, &now);
+	trace->head = (trace->head + 1) % TRACE_SAMPLES_MAX;
+	trace->count--;
+    }
+
+    /* Sample more densely again once the I/O buffer rate drops. */
+    if (trace->stride > 1 && trace->count < TRACE_SAMPLES_MAX / 4)
+	trace->stride /= 2;
+
+    debug_return;
+}
+
+static FILE *
+trace_open(void)
+{
+    const char *path = logsrvd_conf_server_trace_file();
+    int fd;
+    debug_decl(trace_open, SUDO_DEBUG_UTIL);
+
+    if (trace_fp != NULL || path == NULL)
+	debug_return_ptr(trace_fp);
+
+    fd = open(path, O_WRONLY|O_APPEND|O_CREAT, S_IRUSR|S_IWUSR);
+    if (fd == -1 || (trace_fp = fdopen(fd, "a")) == NULL) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open trace file %s", path);
+	if (fd != -1)
+	    close(fd);
+    }
+    debug_return_ptr(trace_fp);
+}
+
+static bool
+add_latency(struct json_container *json, const char *name,
+    struct trace_latency *lat)
+{
+    struct json_value json_value;
+    debug_decl(add_latency, SUDO_DEBUG_UTIL);
+
+    if (lat->count == 0)
+	debug_return_bool(true);
+
+    if (!sudo_json_open_object(json, name))
+	debug_return_bool(false);
+    json_value.type = JSON_NUMBER;
+    json_value.u.number = (long long)lat->count;
+    if (!sudo_json_add_value(json, "count", &json_value))
+	debug_return_bool(false);
+    json_value.u.number = (long long)lat->min_usec;
+    if (!sudo_json_add_value(json, "min", &json_value))
+	debug_return_bool(false);
+    json_value.u.number = (long long)(lat->sum_usec / lat->count);
+    if (!sudo_json_add_value(json, "avg", &json_value))
+	debug_return_bool(false);
+    json_value.u.number = (long long)lat->max_usec;
+    if (!sudo_json_add_value(json, "max", &json_value))
+	debug_return_bool(false);
+    debug_return_bool(sudo_json_close_object(json));
+}
+
+/*
+ * Write the session's span to the trace file as a single line.
+ */
+static bool
+trace_write(struct session_trace *trace, struct connection_closure *closure)
+{
+    struct relay_closure *relay_closure = closure->relay_closure;
+    char trace_id[33], span_id[17], parent_id[17];
+    struct json_container json;
+    struct json_value json_value;
+    struct timespec now, duration;
+    bool ret = false;
+    FILE *fp;
+    debug_decl(trace_write, SUDO_DEBUG_UTIL);
+
+    if ((fp = trace_open()) == NULL)
+	debug_return_bool(false);
+    if (trace_host == NULL && (trace_host = sudo_gethostname()) == NULL)
+	debug_return_bool(false);
+    if (!sudo_json_init(&json, 0, true, false))
+	debug_return_bool(false);
+
+    sudo_gettime_mono(&now);
+    sudo_timespecsub(&now, &trace->start, &duration);
+    format_hex(trace->trace_id, sizeof(trace->trace_id), trace_id);
+    format_hex(trace->span_id, sizeof(trace->span_id), span_id);
+
+    json_value.type = JSON_STRING;
+    json_value.u.string = trace_id;
+    if (!sudo_json_add_value(&json, "trace_id", &json_value))
+	goto done;
+    json_value.u.string = span_id;
+    if (!sudo_json_add_value(&json, "span_id", &json_value))
+	goto done;
+    if (trace->has_parent) {
+	format_hex(trace->parent_id, sizeof(trace->parent_id), parent_id);
+	json_value.u.string = parent_id;
+	if (!sudo_json_add_value(&json, "parent_id", &json_value))
+	    goto done;
+    }
+    json_value.u.string = trace_host;
+    if (!sudo_json_add_value(&json, "host", &json_value))
+	goto done;
+    json_value.u.string = closure->journal_path ? closure->journal_path :
+	closure->ipaddr;
+    if (!sudo_json_add_value(&json, "source", &json_value))
+	goto done;
+    if (relay_closure != NULL && relay_closure->relay_name.name != NULL) {
+	json_value.u.string = relay_closure->relay_name.name;
+	if (!sudo_json_add_value(&json, "relay", &json_value))
+	    goto done;
+    }
+
+    json_value.type = JSON_NUMBER;
+    json_value.u.number = (long long)trace->start_real.tv_sec * 1000000 +
+	trace->start_real.tv_nsec / 1000;
+    if (!sudo_json_add_value(&json, "start_usec", &json_value))
+	goto done;
+    json_value.u.number = (long long)duration.tv_sec * 1000000 +
+	duration.tv_nsec / 1000;
+    if (!sudo_json_add_value(&json, "duration_usec", &json_value))
+	goto done;
+    json_value.u.number = (long long)trace->iobufs;
+    if (!sudo_json_add_value(&json, "iobufs", &json_value))
+	goto done;
+    json_value.u.number = (long long)trace->unsampled;
+    if (!sudo_json_add_value(&json, "unsampled", &json_value))
+	goto done;
+    if (!add_latency(&json, "queue_usec", &trace->queue))
+	goto done;
+    if (!add_latency(&json, "commit_usec", &trace->commit))
+	goto done;
+
+    fprintf(fp, "{%s}\n", sudo_json_get_buf(&json));
+    if (fflush(fp) != 0) {
+	sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to write trace file %s", logsrvd_conf_server_trace_file());
+	goto done;
+    }
+    ret = true;
+
+done:
+    sudo_json_free(&json);
+    debug_return_bool(ret);
+}
+
+/*
+ * Write the span for a traced session and free its trace state.
+ */
+void
+trace_close(struct connection_closure *closure)
+{
+    struct session_trace *trace = closure->trace;
+    debug_decl(trace_close, SUDO_DEBUG_UTIL);
+
+    if (trace == NULL)
+	debug_return;
+
+    if (trace_write(trace, closure))
+	trace_stats.spans++;
+    else
+	trace_stats.errors++;
+    free(trace);
+    closure->trace = NULL;
+
+    debug_return;
+}
+
+/*
+ * Close the trace file after the configuration has been read so
+ * that it may be rotated, or moved by changing trace_file.
+ */
+void
+trace_reload(void)
+{
+    debug_decl(trace_reload, SUDO_DEBUG_UTIL);
+
+    if (trace_fp != NULL) {
+	if (fclose(trace_fp) != 0) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+		"unable to close trace file");
+	}
+	trace_fp = NULL;
+    }
+
+    debug_return;
+}
+
+void
+trace_dump(void)
+{
+    debug_decl(trace_dump, SUDO_DEBUG_UTIL);
+
+    if (logsrvd_conf_server_trace_file() == NULL && trace_stats.sessions == 0)
+	debug_return;
+
+    sudo_debug_printf(SUDO_DEBUG_INFO,
+	"latency tracing %s: %llu sessions, %llu spans, %llu errors",
+	logsrvd_conf_server_trace_file() ? logsrvd_conf_server_trace_file() :
+	"(disabled)", trace_stats.sessions, trace_stats.spans,
+	trace_stats.errors);
+
+    debug_return;
+}
@@ -0,0 +1,173 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sudo_compat.h"
+#include "sudo_fatal.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrv_util.h"
+#include "regress/bench/bench_util.h"
+
+/*
+ * Compare protobuf-c with the specialized IoBuffer codec.
+ */
+
+sudo_dso_public int main(int argc, char *argv[]);
+
+struct iobuf_bench {
+    struct timespec delay;
+    const uint8_t *data;
+    size_t datalen;
+    uint8_t *out;
+    size_t outlen;
+};
+
+static void
+bench_protobuf_unpack(void *v)
+{
+    struct iobuf_bench *ib = v;
+    ClientMessage *msg;
+
+    msg = client_message__unpack(NULL, ib->outlen, ib->out);
+    if (msg == NULL)
+	sudo_fatalx("unable to unpack ClientMessage");
+    bench_sink += msg->u.ttyout_buf->data.len;
+    client_message__free_unpacked(msg, NULL);
+}
+
+static void
+bench_iobuf_decode(void *v)
+{
+    struct iobuf_bench *ib = v;
+    struct iobuf_view view;
+
+    if (!iobuf_decode(ib->out, ib->outlen, &view))
+	sudo_fatalx("unable to decode IoBuffer");
+    bench_sink += view.len;
+}
+
+static void
+bench_protobuf_pack(void *v)
+{
+    struct iobuf_bench *ib = v;
+    ClientMessage client_msg = CLIENT_MESSAGE__INIT;
+    IoBuffer iobuf_msg = IO_BUFFER__INIT;
+    TimeSpec ts = TIME_SPEC__INIT;
+
+    /* Same work as the old sendlog fmt_io_buf(). */
+    ts.tv_sec = ib->delay.tv_sec;
+    ts.tv_nsec = ib->delay.tv_nsec;
+    iobuf_msg.delay = &ts;
+    iobuf_msg.data.data = (uint8_t *)ib->data;
+    iobuf_msg.data.len = ib->datalen;
+    client_msg.u.ttyout_buf = &iobuf_msg;
+    client_msg.type_case = CLIENT_MESSAGE__TYPE_TTYOUT_BUF;
+    bench_sink += client_message__get_packed_size(&client_msg);
+    bench_sink += client_message__pack(&client_msg, ib->out);
+}
+
+static void
+bench_iobuf_pack(void *v)
+{
+    struct iobuf_bench *ib = v;
+
+    bench_sink += iobuf_packed_size(&ib->delay, ib->datalen);
+    bench_sink += iobuf_pack(CLIENT_MESSAGE__TYPE_TTYOUT_BUF, &ib->delay,
+	ib->data, ib->datalen, ib->out);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const size_t sizes[] = { 16, 256, 4096, 65536 };
+    struct iobuf_bench ib;
+    uint8_t *data, *out, *pbout;
+    size_t i, maxlen;
+    char name[64];
+
+    bench_init(argc, argv);
+
+    memset(&ib, 0, sizeof(ib));
+    ib.delay.tv_nsec = 123456789;
+    maxlen = sizes[nitems(sizes) - 1];
+    data = malloc(maxlen);
+    out = malloc(iobuf_packed_size(&ib.delay, maxlen));
+    pbout = malloc(iobuf_packed_size(&ib.delay, maxlen));
+    if (data == NULL || out == NULL || pbout == NULL)
+	sudo_fatalx("unable to allocate memory");
+    for (i = 0; i < maxlen; i++)
+	data[i] = (uint8_t)(' ' + i % 95);
+    ib.data = data;
+
+    for (i = 0; i < nitems(sizes); i++) {
+	ib.datalen = sizes[i];
+
+	/* The two encoders must agree byte for byte. */
+	ib.out = pbout;
+	bench_protobuf_pack(&ib);
+	ib.out = out;
+	ib.outlen = iobuf_pack(CLIENT_MESSAGE__TYPE_TTYOUT_BUF, &ib.delay,
+	    ib.data, ib.datalen, ib.out);
+	if (ib.outlen != iobuf_packed_size(&ib.delay, ib.datalen) ||
+		memcmp(out, pbout, ib.outlen) != 0)
+	    sudo_fatalx("IoBuffer encoding mismatch for %zu bytes", ib.datalen);
+
+	(void)snprintf(name, sizeof(name), "iobuf/encode/protobuf-c/%zu",
+	    ib.datalen);
+	bench_run(name, ib.datalen, bench_protobuf_pack, &ib);
+	(void)snprintf(name, sizeof(name), "iobuf/encode/specialized/%zu",
+	    ib.datalen);
+	bench_run(name, ib.datalen, bench_iobuf_pack, &ib);
+
+	/* Both encoders leave the same bytes in out to decode. */
+	(void)snprintf(name, sizeof(name), "iobuf/decode/protobuf-c/%zu",
+	    ib.datalen);
+	bench_run(name, ib.datalen, bench_protobuf_unpack, &ib);
+	(void)snprintf(name, sizeof(name), "iobuf/decode/specialized/%zu",
+	    ib.datalen);
+	bench_run(name, ib.datalen, bench_iobuf_decode, &ib);
+    }
+
+    free(data);
+    free(out);
+    free(pbout);
+
+    return bench_finish();
+}
@@ -0,0 +1,297 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * This is an open source non-commercial project. Dear PVS-Studio, please check it.
+ * PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sudo_compat.h"
+#include "sudo_eventlog.h"
+#include "sudo_fatal.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrvd.h"
+#include "regress/bench/bench_util.h"
+
+/*
+ * Microbenchmarks for the logsrvd message handling hot paths.
+ */
+
+sudo_dso_public int main(int argc, char *argv[]);
+
+#define FRAMING_NMSGS	256
+
+struct evlog_bench {
+    TimeSpec submit_time;
+    InfoMessage **info_msgs;
+    size_t n_info_msgs;
+};
+
+struct framing_bench {
+    struct connection_buffer buf;
+    uint8_t *stream;
+    size_t stream_len;
+    size_t readlen;
+};
+
+static void
+bench_evlog_new(void *v)
+{
+    struct evlog_bench *eb = v;
+    struct eventlog *evlog;
+
+    evlog = evlog_new(&eb->submit_time, eb->info_msgs, eb->n_info_msgs,
+	"192.0.2.1");
+    if (evlog == NULL)
+	sudo_fatalx("unable to build eventlog from InfoMessages");
+    bench_sink += evlog->columns;
+    eventlog_free(evlog);
+}
+
+/*
+ * The InfoMessages a sudoers front end typically sends in an AcceptMessage.
+ */
+static void
+fill_info_msgs(struct evlog_bench *eb)
+{
+    static char *runargv[] = { "make", "-j8", "install" };
+    static char *runenv[] = {
+	"HOME=/root", "LOGNAME=root", "MAIL=/var/mail/root",
+	"PATH=/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin",
+	"SHELL=/bin/sh", "SUDO_COMMAND=/usr/bin/make -j8 install",
+	"SUDO_GID=20", "SUDO_UID=1000", "SUDO_USER=millert",
+	"TERM=xterm-256color", "USER=root"
+    };
+    static const struct {
+	const char *key;
+	const char *strval;
+	int64_t numval;
+    } info[] = {
+	{ "columns", NULL, 80 },
+	{ "command", "/usr/bin/make", 0 },
+	{ "lines", NULL, 24 },
+	{ "runargv", NULL, 0 },
+	{ "runenv", NULL, 0 },
+	{ "rungid", NULL, 0 },
+	{ "rungroup", "wheel", 0 },
+	{ "runuid", NULL, 0 },
+	{ "runuser", "root", 0 },
+	{ "submitcwd", "/home/millert/src/sudo", 0 },
+	{ "submitgroup", "staff", 0 },
+	{ "submithost", "build.example.com", 0 },
+	{ "submituser", "millert", 0 },
+	{ "ttyname", "/dev/pts/3", 0 }
+    };
+    static InfoMessage__StringList argv_list, env_list;
+    static InfoMessage info_store[nitems(info)];
+    static InfoMessage *info_msgs[nitems(info)];
+    TimeSpec submit_time = TIME_SPEC__INIT;
+    size_t n;
+
+    info_message__string_list__init(&argv_list);
+    argv_list.strings = runargv;
+    argv_list.n_strings = nitems(runargv);
+    info_message__string_list__init(&env_list);
+    env_list.strings = runenv;
+    env_list.n_strings = nitems(runenv);
+
+    for (n = 0; n < nitems(info); n++) {
+	InfoMessage *info_msg = &info_store[n];
+
+	info_message__init(info_msg);
+	info_msg->key = (char *)info[n].key;
+	if (info[n].strval != NULL) {
+	    info_msg->u.strval = (char *)info[n].strval;
+	    info_msg->value_case = INFO_MESSAGE__VALUE_STRVAL;
+	} else if (strcmp(info[n].key, "runargv") == 0) {
+	    info_msg->u.strlistval = &argv_list;
+	    info_msg->value_case = INFO_MESSAGE__VALUE_STRLISTVAL;
+	} else if (strcmp(info[n].key, "runenv") == 0) {
+	    info_msg->u.strlistval = &env_list;
+	    info_msg->value_case = INFO_MESSAGE__VALUE_STRLISTVAL;
+	} else {
+	    info_msg->u.numval = info[n].numval;
+	    info_msg->value_case = INFO_MESSAGE__VALUE_NUMVAL;
+	}
+	info_msgs[n] = info_msg;
+    }
+
+    submit_time.tv_sec = 1623700000;
+    submit_time.tv_nsec = 123456789;
+    eb->submit_time = submit_time;
+    eb->info_msgs = info_msgs;
+    eb->n_info_msgs = nitems(info_msgs);
+}
+
+/*
+ * Dispatch a single ClientMessage the way handle_client_message() does.
+ */
+static bool
+framing_dispatch(uint8_t *data, uint32_t len, void *v)
+{
+    struct iobuf_view view;
+    ClientMessage *msg;
+
+    if (iobuf_decode(data, len, &view)) {
+	bench_sink += view.len;
+	return true;
+    }
+    msg = client_message__unpack(NULL, len, data);
+    if (msg == NULL)
+	sudo_fatalx("unable to unpack ClientMessage size %u", len);
+    bench_sink += msg->type_case;
+    client_message__free_unpacked(msg, NULL);
+    return true;
+}
+
+/*
+ * Push a stream of length-prefixed ClientMessages through the
+ * buffering and framing used by client_msg_cb(), without a socket.
+ * Each simulated read returns at most readlen bytes.
+ */
+static void
+bench_framing(void *v)
+{
+    struct framing_bench *fb = v;
+    struct connection_buffer *buf = &fb->buf;
+    const char *errstr = NULL;
+    size_t nread, off = 0;
+
+    while (off < fb->stream_len) {
+	nread = MIN(fb->readlen, buf->size - buf->len);
+	nread = MIN(nread, fb->stream_len - off);
+	memcpy(buf->data + buf->len, fb->stream + off, nread);
+	buf->len += nread;
+	off += nread;
+
+	if (!dispatch_frames(buf, framing_dispatch, NULL, &errstr))
+	    sudo_fatalx("%s", errstr ? errstr : "unable to frame messages");
+    }
+}
+
+/*
+ * Build a stream of terminal output with the occasional window
+ * size change, framed as it would be on the wire.
+ */
+static void
+fill_stream(struct framing_bench *fb)
+{
+    static const size_t sizes[] = { 16, 80, 512, 4096 };
+    const struct timespec delay = { 0, 250000 };
+    ClientMessage client_msg = CLIENT_MESSAGE__INIT;
+    ChangeWindowSize winsize_msg = CHANGE_WINDOW_SIZE__INIT;
+    TimeSpec ts = TIME_SPEC__INIT;
+    size_t i, len, maxlen;
+    uint32_t msg_len;
+    uint8_t *data, *cp;
+
+    data = malloc(sizes[nitems(sizes) - 1]);
+    if (data == NULL)
+	sudo_fatalx("%s: %s", __func__, "unable to allocate memory");
+    for (i = 0; i < sizes[nitems(sizes) - 1]; i++)
+	data[i] = (uint8_t)(' ' + i % 95);
+
+    ts.tv_sec = delay.tv_sec;
+    ts.tv_nsec = delay.tv_nsec;
+    winsize_msg.delay = &ts;
+    winsize_msg.rows = 24;
+    winsize_msg.cols = 80;
+    client_msg.u.winsize_event = &winsize_msg;
+    client_msg.type_case = CLIENT_MESSAGE__TYPE_WINSIZE_EVENT;
+
+    /* Size the stream generously, every message fits in the largest. */
+    maxlen = sizeof(msg_len) + client_message__get_packed_size(&client_msg) +
+	iobuf_packed_size(&delay, sizes[nitems(sizes) - 1]);
+    if ((fb->stream = malloc(FRAMING_NMSGS * maxlen)) == NULL)
+	sudo_fatalx("%s: %s", __func__, "unable to allocate memory");
+
+    cp = fb->stream;
+    for (i = 0; i < FRAMING_NMSGS; i++) {
+	if (i % 64 == 63) {
+	    len = client_message__pack(&client_msg, cp + sizeof(msg_len));
+	} else {
+	    len = iobuf_pack(CLIENT_MESSAGE__TYPE_TTYOUT_BUF, &delay, data,
+		sizes[i % nitems(sizes)], cp + sizeof(msg_len));
+	}
+	msg_len = htonl((uint32_t)len);
+	memcpy(cp, &msg_len, sizeof(msg_len));
+	cp += sizeof(msg_len) + len;
+    }
+    fb->stream_len = (size_t)(cp - fb->stream);
+    free(data);
+
+    /* Same initial size as a client connection. */
+    fb->buf.size = 64 * 1024;
+    if ((fb->buf.data = malloc(fb->buf.size)) == NULL)
+	sudo_fatalx("%s: %s", __func__, "unable to allocate memory");
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const size_t readlens[] = { 1448, 65536 };
+    struct framing_bench fb;
+    struct evlog_bench eb;
+    char name[64];
+    size_t i;
+
+    bench_init(argc, argv);
+
+    /* Converting an AcceptMessage's InfoMessages to a struct eventlog. */
+    fill_info_msgs(&eb);
+    bench_run("evlog_new/accept", 0, bench_evlog_new, &eb);
+
+    /* Receiving ClientMessages, one TCP segment or a full buffer at a time. */
+    memset(&fb, 0, sizeof(fb));
+    fill_stream(&fb);
+    for (i = 0; i < nitems(readlens); i++) {
+	fb.readlen = readlens[i];
+	(void)snprintf(name, sizeof(name), "client_msg_cb/framing/%zu",
+	    fb.readlen);
+	bench_run(name, fb.stream_len, bench_framing, &fb);
+    }
+    free(fb.stream);
+    free(fb.buf.data);
+
+    return bench_finish();
+}
@@ -0,0 +1,294 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sudo_compat.h"
+#include "sudo_fatal.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "evstore.h"
+#include "logsrv_util.h"
+
+sudo_dso_public int main(int argc, char *argv[]);
+
+static int ntests, errors;
+
+struct interval_test {
+    const char *str;
+    bool valid;
+    time_t result;
+};
+
+static struct interval_test interval_data[] = {
+    { "0", true, 0 },
+    { "90", true, 90 },
+    { "90s", true, 90 },
+    { "30m", true, 30 * 60 },
+    { "12h", true, 12 * 60 * 60 },
+    { "7d", true, 7 * 24 * 60 * 60 },
+    { "", false, 0 },
+    { "d", false, 0 },
+    { "7w", false, 0 },
+    { "-5m", false, 0 },
+    { "5 m", false, 0 },
+    { "99999999999999999999d", false, 0 }
+};
+
+static bool
+count_cb(const struct evstore_event *event, void *closure)
+{
+    (*(unsigned int *)closure)++;
+    return true;
+}
+
+/*
+ * Add nrows events starting at time start with the given user.
+ * Every third event is a reject.
+ */
+static void
+add_events(struct evstore_block *block, time_t start, unsigned int nrows,
+    const char *user)
+{
+    struct evstore_event event;
+    unsigned int i;
+
+    for (i = 0; i < nrows; i++) {
+	memset(&event, 0, sizeof(event));
+	event.event_time.tv_sec = start + i;
+	event.type = (i % 3) == 2 ? EVSTORE_REJECT : EVSTORE_ACCEPT;
+	event.strings[EVSTORE_COL_USER] = user;
+	event.strings[EVSTORE_COL_HOST] = "host.example.com";
+	event.strings[EVSTORE_COL_RUNUSER] = "root";
+	event.strings[EVSTORE_COL_COMMAND] = (i & 1) ? "/bin/ls" : "/bin/id";
+	if (!evstore_block_add(block, &event))
+	    sudo_fatalx("unable to add event");
+    }
+}
+
+static void
+write_block(struct evstore_block *block, int fd, time_t start,
+    unsigned int nrows, const char *user)
+{
+    add_events(block, start, nrows, user);
+    if (!evstore_block_write(block, fd))
+	sudo_fatal("unable to write event store block");
+}
+
+static void
+check_scan(int fd, const char *desc, const struct evstore_filter *filter,
+    unsigned int expected, unsigned long long expected_skipped)
+{
+    struct evstore_scan_stats stats;
+    unsigned int count = 0;
+
+    memset(&stats, 0, sizeof(stats));
+    ntests++;
+    if (lseek(fd, 0, SEEK_SET) == -1)
+	sudo_fatal("lseek");
+    if (!evstore_scan(fd, filter, count_cb, &count, &stats)) {
+	sudo_warnx("%s: scan failed", desc);
+	errors++;
+	return;
+    }
+    if (count != expected) {
+	sudo_warnx("%s: expected %u events, got %u", desc, expected, count);
+	errors++;
+    }
+    if (stats.blocks_skipped != expected_skipped) {
+	sudo_warnx("%s: expected %llu skipped blocks, got %llu", desc,
+	    expected_skipped, stats.blocks_skipped);
+	errors++;
+    }
+}
+
+static void
+check_size(int fd, const char *desc, off_t expected)
+{
+    struct stat sb;
+
+    ntests++;
+    if (fstat(fd, &sb) == -1)
+	sudo_fatal("fstat");
+    if (sb.st_size != expected) {
+	sudo_warnx("%s: expected size %lld, got %lld", desc,
+	    (long long)expected, (long long)sb.st_size);
+	errors++;
+    }
+}
+
+static void
+init_filter(struct evstore_filter *filter)
+{
+    memset(filter, 0, sizeof(*filter));
+    filter->type = -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char path[] = "/tmp/check_evstore.XXXXXX";
+    struct evstore_filter filter;
+    struct evstore_block *block;
+    struct rlimit rl, orl;
+    struct stat sb;
+    off_t good_size;
+    time_t result;
+    size_t i;
+    int fd;
+
+    initprogname(argc > 0 ? argv[0] : "check_evstore");
+
+    /* Interval parsing shared by sudo_evquery and sudo_chunkgc. */
+    for (i = 0; i < nitems(interval_data); i++) {
+	struct interval_test *test = &interval_data[i];
+	bool valid;
+
+	ntests++;
+	result = -1;
+	valid = parse_interval(test->str, &result);
+	if (valid != test->valid) {
+	    sudo_warnx("parse_interval(\"%s\"): expected %s", test->str,
+		test->valid ? "success" : "failure");
+	    errors++;
+	} else if (valid && result != test->result) {
+	    sudo_warnx("parse_interval(\"%s\"): expected %lld, got %lld",
+		test->str, (long long)test->result, (long long)result);
+	    errors++;
+	}
+    }
+
+    /* sudo_logsrvd appends to the event store. */
+    if ((fd = mkstemp(path)) == -1)
+	sudo_fatal("%s", path);
+    unlink(path);
+    if (fcntl(fd, F_SETFL, O_APPEND) == -1)
+	sudo_fatal("%s", path);
+    if ((block = evstore_block_alloc()) == NULL)
+	sudo_fatalx("unable to allocate event store block");
+
+    /* Two blocks with disjoint time ranges and users. */
+    write_block(block, fd, 1000, 12, "alice");
+    write_block(block, fd, 2000, 6, "bob");
+
+    init_filter(&filter);
+    check_scan(fd, "all events", &filter, 18, 0);
+
+    init_filter(&filter);
+    filter.start = 1500;
+    check_scan(fd, "start time", &filter, 6, 1);
+
+    init_filter(&filter);
+    filter.end = 1005;
+    check_scan(fd, "end time", &filter, 6, 1);
+
+    init_filter(&filter);
+    filter.type = EVSTORE_REJECT;
+    check_scan(fd, "rejects", &filter, 6, 0);
+
+    init_filter(&filter);
+    filter.strings[EVSTORE_COL_USER] = "bob";
+    check_scan(fd, "user bob", &filter, 6, 1);
+
+    init_filter(&filter);
+    filter.strings[EVSTORE_COL_USER] = "alice";
+    filter.strings[EVSTORE_COL_COMMAND] = "/bin/ls";
+    check_scan(fd, "alice running ls", &filter, 6, 1);
+
+    init_filter(&filter);
+    filter.strings[EVSTORE_COL_USER] = "mallory";
+    check_scan(fd, "unknown user", &filter, 0, 2);
+
+    /* A block torn by a crash is trimmed and later blocks are readable. */
+    if (fstat(fd, &sb) == -1)
+	sudo_fatal("fstat");
+    good_size = sb.st_size;
+    write_block(block, fd, 3000, 4, "carol");
+    if (ftruncate(fd, good_size + EVSTORE_HEADER_SIZE + 3) == -1)
+	sudo_fatal("ftruncate");
+    ntests++;
+    if (!evstore_trim(fd)) {
+	sudo_warnx("unable to trim torn block");
+	errors++;
+    }
+    check_size(fd, "trim torn block", good_size);
+    ntests++;
+    if (!evstore_trim(fd)) {
+	sudo_warnx("unable to trim intact file");
+	errors++;
+    }
+    check_size(fd, "trim intact file", good_size);
+    write_block(block, fd, 4000, 3, "dave");
+    init_filter(&filter);
+    check_scan(fd, "block after torn block", &filter, 21, 0);
+
+    /* A failed write does not leave part of the block behind. */
+    if (fstat(fd, &sb) == -1)
+	sudo_fatal("fstat");
+    good_size = sb.st_size;
+    if (getrlimit(RLIMIT_FSIZE, &orl) == -1)
+	sudo_fatal("getrlimit");
+    rl = orl;
+    rl.rlim_cur = good_size + EVSTORE_HEADER_SIZE + 3;
+    (void)signal(SIGXFSZ, SIG_IGN);
+    if (setrlimit(RLIMIT_FSIZE, &rl) == -1)
+	sudo_fatal("setrlimit");
+    add_events(block, 5000, 8, "erin");
+    ntests++;
+    if (evstore_block_write(block, fd)) {
+	sudo_warnx("write past the file size limit succeeded");
+	errors++;
+    }
+    if (setrlimit(RLIMIT_FSIZE, &orl) == -1)
+	sudo_fatal("setrlimit");
+    check_size(fd, "failed write", good_size);
+    evstore_block_free(block);
+    if ((block = evstore_block_alloc()) == NULL)
+	sudo_fatalx("unable to allocate event store block");
+    write_block(block, fd, 6000, 2, "frank");
+    init_filter(&filter);
+    check_scan(fd, "block after failed write", &filter, 23, 0);
+
+    evstore_block_free(block);
+    close(fd);
+
+    if (ntests != 0) {
+	printf("%s: %d tests run, %d errors, %d%% success rate\n",
+	    getprogname(), ntests, errors, (ntests - errors) * 100 / ntests);
+    }
+    exit(errors);
+}
@@ -0,0 +1,134 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sudo_compat.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrv_util.h"
+
+/*
+ * Differential fuzzer for the hand-written IoBuffer decoder.
+ * Any message iobuf_decode() accepts must decode identically with
+ * protobuf-c, and any IoBuffer protobuf-c can decode must take the
+ * fast path once it has been re-encoded in canonical form.  Unknown
+ * fields are preserved by protobuf-c when re-encoding, those messages
+ * are never canonical.
+ */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static IoBuffer *
+msg_iobuf(ClientMessage *msg)
+{
+    switch (msg->type_case) {
+    case CLIENT_MESSAGE__TYPE_TTYIN_BUF:
+	return msg->u.ttyin_buf;
+    case CLIENT_MESSAGE__TYPE_TTYOUT_BUF:
+	return msg->u.ttyout_buf;
+    case CLIENT_MESSAGE__TYPE_STDIN_BUF:
+	return msg->u.stdin_buf;
+    case CLIENT_MESSAGE__TYPE_STDOUT_BUF:
+	return msg->u.stdout_buf;
+    case CLIENT_MESSAGE__TYPE_STDERR_BUF:
+	return msg->u.stderr_buf;
+    default:
+	return NULL;
+    }
+}
+
+/*
+ * Abort if the view does not match what protobuf-c decoded.
+ */
+static void
+compare(const struct iobuf_view *view, ClientMessage *msg)
+{
+    IoBuffer *iobuf = msg_iobuf(msg);
+
+    if (iobuf == NULL || (int)msg->type_case != view->type_case)
+	abort();
+    if (iobuf->delay == NULL || iobuf->delay->tv_sec != view->delay_sec ||
+	    iobuf->delay->tv_nsec != view->delay_nsec)
+	abort();
+    if (iobuf->data.len != view->len)
+	abort();
+    if (view->len != 0 && memcmp(iobuf->data.data, view->data, view->len) != 0)
+	abort();
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct iobuf_view view;
+    ClientMessage *msg;
+    IoBuffer *iobuf;
+    uint8_t *buf;
+    size_t len;
+    bool decoded;
+
+    decoded = iobuf_decode(data, size, &view);
+    msg = client_message__unpack(NULL, size, data);
+    if (msg == NULL) {
+	/* protobuf-c rejected it, so must we. */
+	if (decoded)
+	    abort();
+	return 0;
+    }
+    if (decoded)
+	compare(&view, msg);
+
+    /* The canonical encoding of an IoBuffer must take the fast path. */
+    iobuf = msg_iobuf(msg);
+    if (iobuf != NULL && iobuf->delay != NULL &&
+	    msg->base.n_unknown_fields == 0 &&
+	    iobuf->base.n_unknown_fields == 0 &&
+	    iobuf->delay->base.n_unknown_fields == 0) {
+	len = client_message__get_packed_size(msg);
+	if ((buf = malloc(len)) != NULL) {
+	    client_message__pack(msg, buf);
+	    if (!iobuf_decode(buf, len, &view))
+		abort();
+	    compare(&view, msg);
+	    free(buf);
+	}
+    }
+    client_message__free_unpacked(msg, NULL);
+
+    return 0;
+}
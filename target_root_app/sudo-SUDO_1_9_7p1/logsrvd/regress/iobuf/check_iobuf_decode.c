@@ -0,0 +1,269 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sudo_compat.h"
+#include "sudo_fatal.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrv_util.h"
+
+/*
+ * Check that iobuf_decode() and client_message__unpack() agree on
+ * every message the fast path accepts, and that it falls back to
+ * protobuf-c for everything that is not in canonical form.
+ */
+
+sudo_dso_public int main(int argc, char *argv[]);
+
+static int ntests, errors;
+
+struct decode_test {
+    const char *name;
+    const char *buf;
+    size_t len;
+    bool decoded;
+};
+
+/*
+ * Hand-encoded ClientMessages.  Field 7 (0x3a) is ttyout_buf, the
+ * IoBuffer holds delay (0x0a) and data (0x12), the TimeSpec holds
+ * tv_sec (0x08) and tv_nsec (0x10).
+ */
+#define T(n, b, d)	{ n, b, sizeof(b) - 1, d }
+static struct decode_test decode_data[] = {
+    T("canonical", "\x3a\x08\x0a\x02\x08\x01\x12\x02hi", true),
+    T("no data", "\x3a\x04\x0a\x02\x08\x01", true),
+    T("empty delay", "\x3a\x06\x0a\x00\x12\x02hi", true),
+    T("zero tv_sec", "\x3a\x0a\x0a\x04\x08\x00\x10\x05\x12\x02hi", true),
+    T("data before delay", "\x3a\x08\x12\x02hi\x0a\x02\x08\x01", true),
+    T("nsec before sec", "\x3a\x0a\x0a\x04\x10\x05\x08\x01\x12\x02hi", true),
+    T("negative tv_sec",
+	"\x3a\x11\x0a\x0b\x08\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01"
+	"\x12\x02hi", true),
+    T("64-bit tv_nsec", "\x3a\x0c\x0a\x06\x10\x85\x80\x80\x80\x10\x12\x02hi",
+	true),
+    T("overlong key", "\xba\x80\x00\x08\x0a\x02\x08\x01\x12\x02hi", true),
+    T("overlong length", "\x3a\x88\x00\x0a\x02\x08\x01\x12\x02hi", true),
+    T("overlong tv_sec", "\x3a\x09\x0a\x03\x08\x81\x00\x12\x02hi", true),
+    T("overlong data length", "\x3a\x09\x0a\x02\x08\x01\x12\x82\x00hi",
+	true),
+    T("11-byte varint",
+	"\x3a\x12\x0a\x0c\x08\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01"
+	"\x12\x02hi", false),
+    T("repeated delay", "\x3a\x0c\x0a\x02\x08\x01\x0a\x02\x08\x02\x12\x02hi",
+	false),
+    T("repeated data", "\x3a\x0c\x0a\x02\x08\x01\x12\x02hi\x12\x02hi",
+	false),
+    T("repeated tv_sec", "\x3a\x0a\x0a\x04\x08\x01\x08\x02\x12\x02hi",
+	false),
+    T("repeated tv_nsec", "\x3a\x08\x0a\x04\x10\x01\x10\x02\x12\x00",
+	false),
+    T("repeated IoBuffer", "\x3a\x04\x0a\x02\x08\x01\x3a\x04\x0a\x02\x08\x02",
+	false),
+    T("unknown field", "\x3a\x0a\x0a\x02\x08\x01\x12\x02hi\x18\x01", false),
+    T("unknown TimeSpec field", "\x3a\x06\x0a\x04\x08\x01\x18\x01", false),
+    T("delay wrong wire type", "\x3a\x04\x08\x01\x12\x00", false),
+    T("no delay", "\x3a\x04\x12\x02hi", false),
+    T("trailing byte", "\x3a\x04\x0a\x02\x08\x01\x00", false),
+    T("IoBuffer past end", "\x3a\x09\x0a\x02\x08\x01\x12\x02hi", false),
+    T("data past end", "\x3a\x08\x0a\x02\x08\x01\x12\x03hi", false),
+    T("delay past end", "\x3a\x04\x0a\x04\x08\x01", false),
+    T("truncated key", "\xba", false),
+    T("truncated length", "\x3a\x80", false),
+    T("ChangeWindowSize", "\x5a\x06\x0a\x00\x10\x18\x18\x50", false),
+    T("empty message", "", false)
+};
+#undef T
+
+static IoBuffer *
+msg_iobuf(ClientMessage *msg)
+{
+    switch (msg->type_case) {
+    case CLIENT_MESSAGE__TYPE_TTYIN_BUF:
+	return msg->u.ttyin_buf;
+    case CLIENT_MESSAGE__TYPE_TTYOUT_BUF:
+	return msg->u.ttyout_buf;
+    case CLIENT_MESSAGE__TYPE_STDIN_BUF:
+	return msg->u.stdin_buf;
+    case CLIENT_MESSAGE__TYPE_STDOUT_BUF:
+	return msg->u.stdout_buf;
+    case CLIENT_MESSAGE__TYPE_STDERR_BUF:
+	return msg->u.stderr_buf;
+    default:
+	return NULL;
+    }
+}
+
+/*
+ * Decode buf with both decoders and compare the results.
+ */
+static void
+check_decode(const char *name, const uint8_t *buf, size_t len, bool expected)
+{
+    struct iobuf_view view;
+    ClientMessage *msg;
+    IoBuffer *iobuf;
+    bool decoded;
+
+    ntests++;
+    decoded = iobuf_decode(buf, len, &view);
+    if (decoded != expected) {
+	sudo_warnx("%s: iobuf_decode: expected %s", name,
+	    expected ? "success" : "failure");
+	errors++;
+	return;
+    }
+    if (!decoded)
+	return;
+
+    msg = client_message__unpack(NULL, len, buf);
+    if (msg == NULL) {
+	sudo_warnx("%s: decoded but client_message__unpack failed", name);
+	errors++;
+	return;
+    }
+    iobuf = msg_iobuf(msg);
+    if (iobuf == NULL || (int)msg->type_case != view.type_case) {
+	sudo_warnx("%s: type %d, protobuf-c type %d", name, view.type_case,
+	    (int)msg->type_case);
+	errors++;
+    } else if (iobuf->delay == NULL ||
+	    iobuf->delay->tv_sec != view.delay_sec ||
+	    iobuf->delay->tv_nsec != view.delay_nsec) {
+	sudo_warnx("%s: delay [%lld, %d] does not match protobuf-c", name,
+	    (long long)view.delay_sec, (int)view.delay_nsec);
+	errors++;
+    } else if (iobuf->data.len != view.len || (view.len != 0 &&
+	    memcmp(iobuf->data.data, view.data, view.len) != 0)) {
+	sudo_warnx("%s: data (%zu bytes) does not match protobuf-c", name,
+	    view.len);
+	errors++;
+    }
+    client_message__free_unpacked(msg, NULL);
+}
+
+/*
+ * Messages from iobuf_pack() must match protobuf-c byte for byte and
+ * take the fast path, no prefix of one may be decoded.
+ */
+static void
+check_pack(int type_case, const struct timespec *delay, size_t len)
+{
+    static uint8_t data[300];
+    ClientMessage msg = CLIENT_MESSAGE__INIT;
+    IoBuffer iobuf = IO_BUFFER__INIT;
+    TimeSpec ts = TIME_SPEC__INIT;
+    uint8_t *buf, *pbuf;
+    size_t n, size, psize;
+    char name[64];
+
+    (void)snprintf(name, sizeof(name), "pack %d [%lld, %ld] %zu",
+	type_case, (long long)delay->tv_sec, delay->tv_nsec, len);
+    for (n = 0; n < len; n++)
+	data[n] = (uint8_t)n;
+
+    size = iobuf_packed_size(delay, len);
+    if ((buf = malloc(size)) == NULL)
+	sudo_fatalx("%s: %s", __func__, "unable to allocate memory");
+    ntests++;
+    if (iobuf_pack(type_case, delay, data, len, buf) != size) {
+	sudo_warnx("%s: size mismatch", name);
+	errors++;
+    }
+
+    ts.tv_sec = delay->tv_sec;
+    ts.tv_nsec = (int32_t)delay->tv_nsec;
+    iobuf.delay = &ts;
+    iobuf.data.data = data;
+    iobuf.data.len = len;
+    msg.type_case = type_case;
+    msg.u.ttyin_buf = &iobuf;
+    psize = client_message__get_packed_size(&msg);
+    if ((pbuf = malloc(psize)) == NULL)
+	sudo_fatalx("%s: %s", __func__, "unable to allocate memory");
+    client_message__pack(&msg, pbuf);
+    ntests++;
+    if (psize != size || memcmp(buf, pbuf, size) != 0) {
+	sudo_warnx("%s: does not match client_message__pack", name);
+	errors++;
+    }
+
+    check_decode(name, buf, size, true);
+    for (n = 0; n < size; n++)
+	check_decode(name, buf, n, false);
+
+    free(pbuf);
+    free(buf);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const struct timespec delays[] = {
+	{ 0, 0 }, { 1, 0 }, { 0, 999999999 }, { 1234567890, 5 }, { -1, 0 }
+    };
+    static const size_t lengths[] = { 0, 1, 127, 128, 300 };
+    size_t i, j, k;
+    int type_case;
+
+    initprogname(argc > 0 ? argv[0] : "check_iobuf_decode");
+
+    for (i = 0; i < nitems(decode_data); i++) {
+	struct decode_test *test = &decode_data[i];
+
+	check_decode(test->name, (const uint8_t *)test->buf, test->len,
+	    test->decoded);
+    }
+
+    for (type_case = CLIENT_MESSAGE__TYPE_TTYIN_BUF;
+	    type_case <= CLIENT_MESSAGE__TYPE_STDERR_BUF; type_case++) {
+	for (j = 0; j < nitems(delays); j++) {
+	    for (k = 0; k < nitems(lengths); k++)
+		check_pack(type_case, &delays[j], lengths[k]);
+	}
+    }
+
+    if (ntests != 0) {
+	printf("%s: %d tests run, %d errors, %d%% success rate\n",
+	    getprogname(), ntests, errors, (ntests - errors) * 100 / ntests);
+    }
+
+    exit(errors);
+}
@@ -252,6 +252,18 @@ read_io_buf(struct client_closure *closure)
 	debug_return_bool(false);
     }
 
+    /* Uncompressed logs are sent directly from the mapping. */
+    if (closure->iolog_maps[timing->event].base != NULL) {
+	closure->iobuf = mapped_file_next(&closure->iolog_maps[timing->event],
+	    timing->u.nbytes);
+	if (closure->iobuf == NULL) {
+	    sudo_warnx(U_("unable to read %s/%s: %s"), iolog_dir,
+		iolog_fd_to_name(timing->event), U_("premature EOF"));
+	    debug_return_bool(false);
+	}
+	debug_return_bool(true);
+    }
+
     /* Expand buf as needed. */
     if (timing->u.nbytes > closure->bufsize) {
 	free(closure->buf);
@@ -270,9 +282,40 @@ read_io_buf(struct client_closure *closure)
 	    iolog_fd_to_name(timing->event), errstr);
 	debug_return_bool(false);
     }
+    closure->iobuf = (uint8_t *)closure->buf;
     debug_return_bool(true);
 }
 
+/*
+ * Map the uncompressed I/O log files, starting at the current
+ * position (which may be a restart point).  Files that cannot
+ * be mapped are read via iolog_read() instead.
+ */
+static void
+map_io_logs(struct client_closure *closure)
+{
+    int iofd;
+    debug_decl(map_io_logs, SUDO_DEBUG_UTIL);
+
+    for (iofd = 0; iofd < IOFD_TIMING; iofd++) {
+	struct iolog_file *iol = &closure->iolog_files[iofd];
+	off_t pos;
+
+	if (!iol->enabled || iol->compressed)
+	    continue;
+	if ((pos = iolog_seek(iol, 0, SEEK_CUR)) == -1)
+	    continue;
+	if (!mapped_file_open(&closure->iolog_maps[iofd], fileno(iol->fd.f),
+		pos)) {
+	    sudo_debug_printf(SUDO_DEBUG_INFO|SUDO_DEBUG_LINENO,
+		"reading %s/%s without mmap", iolog_dir,
+		iolog_fd_to_name(iofd));
+	}
+    }
+
+    debug_return;
+}
+
 /*
  * Format a ClientMessage and store the wire format message in buf.
  * Returns true on success, false on failure.
@@ -287,8 +330,8 @@ fmt_client_message(struct connection_buffer *buf, ClientMessage *msg)
 
     len = client_message__get_packed_size(msg);
     if (len > MESSAGE_SIZE_MAX) {
-    	sudo_warnx(U_("client message too large: %zu"), len);
-        goto done;
+	sudo_warnx(U_("client message too large: %zu"), len);
+	goto done;
     }
     /* Wire message size is used for length encoding, precedes message. */
     msg_len = htonl((uint32_t)len);
@@ -707,33 +750,51 @@ static bool
 fmt_io_buf(int type, struct client_closure *closure,
     struct connection_buffer *buf)
 {
-    ClientMessage client_msg = CLIENT_MESSAGE__INIT;
-    IoBuffer iobuf_msg = IO_BUFFER__INIT;
-    TimeSpec delay = TIME_SPEC__INIT;
+    const struct timespec *delay = &closure->timing.delay;
+    uint32_t msg_len;
+    size_t datalen, len;
     bool ret = false;
     debug_decl(fmt_io_buf, SUDO_DEBUG_UTIL);
 
     if (!read_io_buf(closure))
 	goto done;
+    datalen = closure->timing.u.nbytes;
 
-    /* Fill in IoBuffer. */
-    /* TODO: split buffer if it is too large */
-    delay.tv_sec = closure->timing.delay.tv_sec;
-    delay.tv_nsec = closure->timing.delay.tv_nsec;
-    iobuf_msg.delay = &delay;
-    iobuf_msg.data.data = (void *)closure->buf;
-    iobuf_msg.data.len = closure->timing.u.nbytes;
+    /*
+     * IoBuffers are encoded directly instead of via protobuf-c,
+     * the output is the same as client_message__pack().
+     * TODO: split buffer if it is too large
+     */
+    len = iobuf_packed_size(delay, datalen);
+    if (len > MESSAGE_SIZE_MAX) {
+	sudo_warnx(U_("client message too large: %zu"), len);
+	goto done;
+    }
 
     sudo_debug_printf(SUDO_DEBUG_INFO,
 	"%s: sending IoBuffer length %zu, type %d, size %zu", __func__,
-	iobuf_msg.data.len, type, io_buffer__get_packed_size(&iobuf_msg));
+	datalen, type, len);
 
-    /* Send ClientMessage, it doesn't matter which IoBuffer we set. */
-    client_msg.u.ttyout_buf = &iobuf_msg;
-    client_msg.type_case = type;
-    if (!fmt_client_message(buf, &client_msg))
-        goto done;
+    /* Wire message size is used for length encoding, precedes message. */
+    msg_len = htonl((uint32_t)len);
+    len += sizeof(msg_len);
 
+    /* Resize buffer as needed. */
+    if (len > buf->size) {
+	free(buf->data);
+	buf->size = sudo_pow2_roundup(len);
+	if ((buf->data = malloc(buf->size)) == NULL) {
+	    sudo_debug_printf(SUDO_DEBUG_ERROR|SUDO_DEBUG_LINENO,
+		"unable to malloc %u", buf->size);
+	    buf->size = 0;
+	    goto done;
+	}
+    }
+
+    memcpy(buf->data, &msg_len, sizeof(msg_len));
+    iobuf_pack(type, delay, closure->iobuf, datalen,
+	buf->data + sizeof(msg_len));
+    buf->len = len;
     ret = true;
 
 done:
@@ -789,6 +850,7 @@ fmt_suspend(struct client_closure *closure, struct connection_buffer *buf)
     CommandSuspend suspend_msg = COMMAND_SUSPEND__INIT;
     TimeSpec delay = TIME_SPEC__INIT;
     struct timing_closure *timing = &closure->timing;
+    char signame[SIG2STR_MAX];
     bool ret = false;
     debug_decl(fmt_suspend, SUDO_DEBUG_UTIL);
 
@@ -796,9 +858,9 @@ fmt_suspend(struct client_closure *closure, struct connection_buffer *buf)
     delay.tv_sec = timing->delay.tv_sec;
     delay.tv_nsec = timing->delay.tv_nsec;
     suspend_msg.delay = &delay;
-    if (sig2str(timing->u.signo, closure->buf) == -1)
+    if (sig2str(timing->u.signo, signame) == -1)
 	goto done;
-    suspend_msg.signal = closure->buf;
+    suspend_msg.signal = signame;
 
     sudo_debug_printf(SUDO_DEBUG_INFO,
     	"%s: sending CommandSuspend, SIG%s", __func__, suspend_msg.signal);
@@ -1374,6 +1436,7 @@ parse_timespec(struct timespec *ts, char *strval)
 static void
 client_closure_free(struct client_closure *closure)
 {
+    int i;
     debug_decl(connection_closure_free, SUDO_DEBUG_UTIL);
 
     if (closure != NULL) {
@@ -1390,6 +1453,8 @@ client_closure_free(struct client_closure *closure)
         free(closure->read_buf.data);
         free(closure->write_buf.data);
         free(closure->buf);
+	for (i = 0; i < IOFD_MAX; i++)
+	    mapped_file_close(&closure->iolog_maps[i]);
         close(closure->sock);
         free(closure);
     }
@@ -1653,6 +1718,7 @@ main(int argc, char *argv[])
 		    &closure->elapsed, &closure->restart))
                 goto bad;
         }
+	map_io_logs(closure);
 
 #if defined(HAVE_OPENSSL)
 	if (cert != NULL) {
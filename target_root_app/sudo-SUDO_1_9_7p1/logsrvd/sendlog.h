@@ -66,8 +66,10 @@ struct client_closure {
     struct sudo_event *write_ev;
     struct eventlog *evlog;
     struct iolog_file iolog_files[IOFD_MAX];
+    struct mapped_file iolog_maps[IOFD_MAX];
     const char *iolog_id;
     char *reject_reason;
+    const uint8_t *iobuf; /* current I/O buffer, in buf or a mapping */
     char *buf; /* XXX */
     size_t bufsize; /* XXX */
     enum client_state state;
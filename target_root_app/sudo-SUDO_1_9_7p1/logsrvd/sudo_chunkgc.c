@@ -0,0 +1,273 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Remove unreferenced chunks from a sudo_logsrvd chunk store.
+ *
+ * Each I/O log that uses a chunk holds a hard link to it, so a chunk
+ * whose link count has dropped to one is only referenced by the store
+ * itself.  Chunks are removed once they have been unreferenced for
+ * longer than the grace period, which must exceed the time it takes
+ * sudo_logsrvd to link a newly stored chunk into an I/O log.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_GETOPT_LONG
+# include <getopt.h>
+# else
+# include "compat/getopt.h"
+#endif /* HAVE_GETOPT_LONG */
+
+#include "sudo_compat.h"
+#include "sudo_conf.h"
+#include "sudo_debug.h"
+#include "sudo_fatal.h"
+#include "sudo_gettext.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "iolog_chunks.h"
+#include "logsrv_util.h"
+
+#define DEFAULT_GRACE	(60 * 60)
+
+struct chunkgc_stats {
+    unsigned long long chunks;
+    unsigned long long removed;
+    unsigned long long tmpfiles;
+    unsigned long long bytes;
+};
+
+static bool dryrun;
+static bool verbose;
+
+static void
+usage(bool fatal)
+{
+    fprintf(stderr, "usage: %s [-nvV] [-g grace] /path/to/store\n",
+	getprogname());
+    if (fatal)
+	exit(EXIT_FAILURE);
+}
+
+static void
+help(void)
+{
+    printf("%s - %s\n\n", getprogname(),
+	_("remove unreferenced chunks from a sudo_logsrvd chunk store"));
+    usage(false);
+    printf("\n%s\n", _("Options:"));
+    printf("  -g, --grace           %s\n",
+	_("only remove chunks unreferenced for this long"));
+    printf("      --help            %s\n",
+	_("display help message and exit"));
+    printf("  -n, --dry-run         %s\n",
+	_("show what would be removed without removing it"));
+    printf("  -v, --verbose         %s\n",
+	_("display statistics"));
+    printf("  -V, --version         %s\n",
+	_("display version information and exit"));
+    putchar('\n');
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Remove unreferenced chunks and stale temporary files from
+ * one subdirectory of the store.
+ */
+static bool
+collect_dir(const char *store, int dfd, const char *subdir, time_t cutoff,
+    struct chunkgc_stats *stats)
+{
+    struct dirent *dp;
+    struct stat sb;
+    bool ret = true;
+    DIR *dirp;
+    int fd;
+    debug_decl(collect_dir, SUDO_DEBUG_UTIL);
+
+    fd = openat(dfd, subdir, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+    if (fd == -1 || (dirp = fdopendir(fd)) == NULL) {
+	sudo_warn("%s/%s", store, subdir);
+	if (fd != -1)
+	    close(fd);
+	debug_return_bool(false);
+    }
+    while ((dp = readdir(dirp)) != NULL) {
+	const bool tmpfile = dp->d_name[0] == '.';
+
+	if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+	    continue;
+	if (!tmpfile && strlen(dp->d_name) != IOLOG_CHUNK_NAME_LEN)
+	    continue;
+	if (fstatat(fd, dp->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+	    if (errno != ENOENT) {
+		sudo_warn("%s/%s/%s", store, subdir, dp->d_name);
+		ret = false;
+	    }
+	    continue;
+	}
+	if (!S_ISREG(sb.st_mode))
+	    continue;
+	if (!tmpfile)
+	    stats->chunks++;
+
+	/* The ctime changes whenever a link is added or removed. */
+	if ((!tmpfile && sb.st_nlink != 1) || sb.st_ctime > cutoff)
+	    continue;
+	if (verbose || dryrun)
+	    printf("%s/%s/%s\n", store, subdir, dp->d_name);
+	if (!dryrun && unlinkat(fd, dp->d_name, 0) == -1) {
+	    if (errno != ENOENT) {
+		sudo_warn("%s/%s/%s", store, subdir, dp->d_name);
+		ret = false;
+	    }
+	    continue;
+	}
+	if (tmpfile) {
+	    stats->tmpfiles++;
+	} else {
+	    stats->removed++;
+	    stats->bytes += sb.st_size;
+	}
+    }
+    closedir(dirp);
+
+    debug_return_bool(ret);
+}
+
+static bool
+collect_store(const char *store, time_t cutoff, struct chunkgc_stats *stats)
+{
+    struct dirent *dp;
+    bool ret = true;
+    DIR *dirp;
+    debug_decl(collect_store, SUDO_DEBUG_UTIL);
+
+    if ((dirp = opendir(store)) == NULL) {
+	sudo_warn("%s", store);
+	debug_return_bool(false);
+    }
+    while ((dp = readdir(dirp)) != NULL) {
+	/* Chunks live in subdirectories named for their first byte. */
+	if (strlen(dp->d_name) != 2 || !isxdigit((unsigned char)dp->d_name[0])
+		|| !isxdigit((unsigned char)dp->d_name[1]))
+	    continue;
+	if (!collect_dir(store, dirfd(dirp), dp->d_name, cutoff, stats))
+	    ret = false;
+    }
+    closedir(dirp);
+
+    debug_return_bool(ret);
+}
+
+static const char short_opts[] = "g:nvV";
+static struct option long_opts[] = {
+    { "dry-run",	no_argument,		NULL,	'n' },
+    { "grace",		required_argument,	NULL,	'g' },
+    { "help",		no_argument,		NULL,	1 },
+    { "verbose",	no_argument,		NULL,	'v' },
+    { "version",	no_argument,		NULL,	'V' },
+    { NULL,		no_argument,		NULL,	0 },
+};
+
+sudo_dso_public int main(int argc, char *argv[]);
+
+int
+main(int argc, char *argv[])
+{
+    struct chunkgc_stats stats;
+    time_t grace = DEFAULT_GRACE;
+    int ch;
+    debug_decl_vars(main, SUDO_DEBUG_MAIN);
+
+    initprogname(argc > 0 ? argv[0] : "sudo_chunkgc");
+    setlocale(LC_ALL, "");
+    bindtextdomain("sudo", LOCALEDIR); /* XXX - add logsrvd domain */
+    textdomain("sudo");
+
+    /* Read sudo.conf and initialize the debug subsystem. */
+    if (sudo_conf_read(NULL, SUDO_CONF_DEBUG) == -1)
+        exit(EXIT_FAILURE);
+    sudo_debug_register(getprogname(), NULL, NULL,
+        sudo_conf_debug_files(getprogname()));
+
+    memset(&stats, 0, sizeof(stats));
+
+    while ((ch = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+	switch (ch) {
+	case 'g':
+	    if (!parse_interval(optarg, &grace)) {
+		sudo_warnx(U_("invalid interval: %s"), optarg);
+		usage(true);
+	    }
+	    break;
+	case 'n':
+	    dryrun = true;
+	    break;
+	case 'v':
+	    verbose = true;
+	    break;
+	case 1:
+	    help();
+	    break;
+	case 'V':
+	    (void)printf(_("%s version %s\n"), getprogname(),
+		PACKAGE_VERSION);
+	    return 0;
+	default:
+	    usage(true);
+	}
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1)
+	usage(true);
+
+    if (!collect_store(argv[0], time(NULL) - grace, &stats))
+	debug_return_int(EXIT_FAILURE);
+
+    if (verbose) {
+	fprintf(stderr, "chunks: %llu scanned, %llu %s (%llu bytes)\n",
+	    stats.chunks, stats.removed, dryrun ? "unreferenced" : "removed",
+	    stats.bytes);
+	fprintf(stderr, "temporary files: %llu %s\n", stats.tmpfiles,
+	    dryrun ? "stale" : "removed");
+    }
+
+    debug_return_int(EXIT_SUCCESS);
+}
@@ -0,0 +1,381 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_GETOPT_LONG
+# include <getopt.h>
+# else
+# include "compat/getopt.h"
+#endif /* HAVE_GETOPT_LONG */
+
+#include "sudo_compat.h"
+#include "sudo_conf.h"
+#include "sudo_debug.h"
+#include "sudo_fatal.h"
+#include "sudo_gettext.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "evstore.h"
+#include "logsrv_util.h"
+
+#define SECS_PER_DAY	(24 * 60 * 60)
+
+static bool verbose;
+
+static void
+usage(bool fatal)
+{
+    fprintf(stderr, "usage: %s [-vV] [-c command] [-e end] [-H host] "
+	"[-r runuser] [-s start] [-t type] [-u user] /path/to/store\n",
+	getprogname());
+    if (fatal)
+	exit(EXIT_FAILURE);
+}
+
+static void
+help(void)
+{
+    printf("%s - %s\n\n", getprogname(),
+	_("query the sudo_logsrvd event store"));
+    usage(false);
+    printf("\n%s\n", _("Options:"));
+    printf("      --help            %s\n",
+	_("display help message and exit"));
+    printf("  -c, --command         %s\n",
+	_("only show events for this command"));
+    printf("  -e, --end             %s\n",
+	_("only show events before this time"));
+    printf("  -H, --host            %s\n",
+	_("only show events from this host"));
+    printf("  -r, --runuser         %s\n",
+	_("only show events run as this user"));
+    printf("  -s, --start           %s\n",
+	_("only show events after this time"));
+    printf("  -t, --type            %s\n",
+	_("only show accept, reject or alert events"));
+    printf("  -u, --user            %s\n",
+	_("only show events for this user"));
+    printf("  -v, --verbose         %s\n",
+	_("display scan statistics"));
+    printf("  -V, --version         %s\n",
+	_("display version information and exit"));
+    putchar('\n');
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Parse a time as either seconds since the epoch or an interval
+ * before the current time, e.g. "30m", "12h" or "7d".
+ */
+static bool
+parse_time(const char *str, time_t now, time_t *result)
+{
+    const char *errstr;
+    size_t len = strlen(str);
+    time_t interval;
+    debug_decl(parse_time, SUDO_DEBUG_UTIL);
+
+    if (len == 0)
+	debug_return_bool(false);
+    if (isdigit((unsigned char)str[len - 1])) {
+	*result = sudo_strtonum(str, 0, LLONG_MAX, &errstr);
+	debug_return_bool(errstr == NULL);
+    }
+    if (!parse_interval(str, &interval))
+	debug_return_bool(false);
+    *result = now - interval;
+    debug_return_bool(true);
+}
+
+/*
+ * Convert a partition file name (YYYYMMDD.sev) to the start of its
+ * UTC day.  Returns false if the name is not a partition.
+ */
+static bool
+partition_day(const char *name, time_t *day)
+{
+    long long era, yoe, doy;
+    int i, y, m, d;
+
+    for (i = 0; i < 8; i++) {
+	if (!isdigit((unsigned char)name[i]))
+	    return false;
+    }
+    if (strcmp(name + 8, EVSTORE_SUFFIX) != 0)
+	return false;
+    y = (name[0] - '0') * 1000 + (name[1] - '0') * 100 +
+	(name[2] - '0') * 10 + (name[3] - '0');
+    m = (name[4] - '0') * 10 + (name[5] - '0');
+    d = (name[6] - '0') * 10 + (name[7] - '0');
+    if (m < 1 || m > 12 || d < 1 || d > 31)
+	return false;
+
+    /* Days since the epoch in the proleptic Gregorian calendar. */
+    if (m <= 2)
+	y--;
+    era = y / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    *day = (time_t)((era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy -
+	719468) * SECS_PER_DAY);
+    return true;
+}
+
+static int
+compare_names(const void *v1, const void *v2)
+{
+    const char * const *n1 = v1;
+    const char * const *n2 = v2;
+
+    return strcmp(*n1, *n2);
+}
+
+/*
+ * Print a matching event as a tab-separated line.
+ */
+static bool
+print_event(const struct evstore_event *event, void *closure)
+{
+    char tbuf[sizeof("YYYY-MM-DDTHH:MM:SSZ")];
+    struct tm tm;
+    int col;
+
+    if (gmtime_r(&event->event_time.tv_sec, &tm) == NULL ||
+	    strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%SZ", &tm) == 0)
+	strlcpy(tbuf, "-", sizeof(tbuf));
+    printf("%s\t%s", tbuf, evstore_type_name(event->type));
+    for (col = 0; col < EVSTORE_NCOLS; col++) {
+	const char *str = event->strings[col];
+	printf("\t%s", str != NULL ? str : "-");
+    }
+    putchar('\n');
+    return true;
+}
+
+/*
+ * Scan the partitions in dir that overlap the filter's time range,
+ * oldest first.
+ */
+static bool
+query_store(const char *dir, const struct evstore_filter *filter,
+    struct evstore_scan_stats *stats)
+{
+    char path[PATH_MAX], **names = NULL;
+    size_t i, nnames = 0, names_size = 0;
+    unsigned int skipped = 0;
+    struct dirent *dent;
+    bool ret = true;
+    DIR *dirp;
+    time_t day;
+    int fd, len;
+    debug_decl(query_store, SUDO_DEBUG_UTIL);
+
+    if ((dirp = opendir(dir)) == NULL) {
+	sudo_warn("%s", dir);
+	debug_return_bool(false);
+    }
+    while ((dent = readdir(dirp)) != NULL) {
+	if (!partition_day(dent->d_name, &day))
+	    continue;
+	/* Partition pruning. */
+	if ((filter->start != 0 && day + SECS_PER_DAY <= filter->start) ||
+		(filter->end != 0 && day > filter->end)) {
+	    skipped++;
+	    continue;
+	}
+	if (nnames == names_size) {
+	    char **tmp;
+
+	    names_size = names_size ? names_size * 2 : 32;
+	    tmp = reallocarray(names, names_size, sizeof(char *));
+	    if (tmp == NULL) {
+		sudo_fatalx(U_("%s: %s"), __func__,
+		    U_("unable to allocate memory"));
+	    }
+	    names = tmp;
+	}
+	if ((names[nnames] = strdup(dent->d_name)) == NULL) {
+	    sudo_fatalx(U_("%s: %s"), __func__,
+		U_("unable to allocate memory"));
+	}
+	nnames++;
+    }
+    closedir(dirp);
+
+    if (nnames != 0)
+	qsort(names, nnames, sizeof(char *), compare_names);
+    for (i = 0; i < nnames; i++) {
+	len = snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+	if (len < 0 || len >= ssizeof(path)) {
+	    errno = ENAMETOOLONG;
+	    sudo_warn("%s/%s", dir, names[i]);
+	    ret = false;
+	    continue;
+	}
+	if ((fd = open(path, O_RDONLY)) == -1) {
+	    sudo_warn("%s", path);
+	    ret = false;
+	    continue;
+	}
+	if (!evstore_scan(fd, filter, print_event, NULL, stats)) {
+	    sudo_warnx(U_("%s: corrupt event store"), path);
+	    ret = false;
+	}
+	close(fd);
+    }
+
+    if (verbose) {
+	fprintf(stderr, "partitions: %zu scanned, %u skipped\n", nnames,
+	    skipped);
+    }
+
+    for (i = 0; i < nnames; i++)
+	free(names[i]);
+    free(names);
+    debug_return_bool(ret);
+}
+
+static const char short_opts[] = "c:e:H:r:s:t:u:vV";
+static struct option long_opts[] = {
+    { "command",	required_argument,	NULL,	'c' },
+    { "end",		required_argument,	NULL,	'e' },
+    { "help",		no_argument,		NULL,	1 },
+    { "host",		required_argument,	NULL,	'H' },
+    { "runuser",	required_argument,	NULL,	'r' },
+    { "start",		required_argument,	NULL,	's' },
+    { "type",		required_argument,	NULL,	't' },
+    { "user",		required_argument,	NULL,	'u' },
+    { "verbose",	no_argument,		NULL,	'v' },
+    { "version",	no_argument,		NULL,	'V' },
+    { NULL,		no_argument,		NULL,	0 },
+};
+
+sudo_dso_public int main(int argc, char *argv[]);
+
+int
+main(int argc, char *argv[])
+{
+    struct evstore_filter filter;
+    struct evstore_scan_stats stats;
+    time_t now = time(NULL);
+    int ch, type;
+    debug_decl_vars(main, SUDO_DEBUG_MAIN);
+
+    initprogname(argc > 0 ? argv[0] : "sudo_evquery");
+    setlocale(LC_ALL, "");
+    bindtextdomain("sudo", LOCALEDIR); /* XXX - add logsrvd domain */
+    textdomain("sudo");
+
+    /* Read sudo.conf and initialize the debug subsystem. */
+    if (sudo_conf_read(NULL, SUDO_CONF_DEBUG) == -1)
+        exit(EXIT_FAILURE);
+    sudo_debug_register(getprogname(), NULL, NULL,
+        sudo_conf_debug_files(getprogname()));
+
+    memset(&filter, 0, sizeof(filter));
+    memset(&stats, 0, sizeof(stats));
+    filter.type = -1;
+
+    while ((ch = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+	switch (ch) {
+	case 'c':
+	    filter.strings[EVSTORE_COL_COMMAND] = optarg;
+	    break;
+	case 'e':
+	    if (!parse_time(optarg, now, &filter.end)) {
+		sudo_warnx(U_("invalid time: %s"), optarg);
+		usage(true);
+	    }
+	    break;
+	case 'H':
+	    filter.strings[EVSTORE_COL_HOST] = optarg;
+	    break;
+	case 'r':
+	    filter.strings[EVSTORE_COL_RUNUSER] = optarg;
+	    break;
+	case 's':
+	    if (!parse_time(optarg, now, &filter.start)) {
+		sudo_warnx(U_("invalid time: %s"), optarg);
+		usage(true);
+	    }
+	    break;
+	case 't':
+	    for (type = 0; type < EVSTORE_NTYPES; type++) {
+		if (strcmp(optarg, evstore_type_name(type)) == 0)
+		    break;
+	    }
+	    if (type == EVSTORE_NTYPES) {
+		sudo_warnx(U_("invalid event type: %s"), optarg);
+		usage(true);
+	    }
+	    filter.type = type;
+	    break;
+	case 'u':
+	    filter.strings[EVSTORE_COL_USER] = optarg;
+	    break;
+	case 'v':
+	    verbose = true;
+	    break;
+	case 1:
+	    help();
+	    break;
+	case 'V':
+	    (void)printf(_("%s version %s\n"), getprogname(),
+		PACKAGE_VERSION);
+	    return 0;
+	default:
+	    usage(true);
+	}
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1)
+	usage(true);
+
+    if (!query_store(argv[0], &filter, &stats))
+	debug_return_int(EXIT_FAILURE);
+
+    if (verbose) {
+	fprintf(stderr, "blocks: %llu scanned, %llu skipped\n",
+	    stats.blocks, stats.blocks_skipped);
+	fprintf(stderr, "events: %llu scanned, %llu matched\n",
+	    stats.rows, stats.rows_matched);
+    }
+
+    debug_return_int(EXIT_SUCCESS);
+}
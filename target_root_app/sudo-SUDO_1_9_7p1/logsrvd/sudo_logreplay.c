@@ -0,0 +1,1359 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Replay sudo_logsrvd traffic captures against a test server.
+ *
+ * Each capture is sent over its own connection, with messages spaced
+ * as they originally arrived, optionally sped up.  Captures start at
+ * their original offsets from the earliest one.  The latency of each
+ * message the server acknowledges is measured from when the last byte
+ * of the message was sent until the response arrives:
+ *
+ *   ClientHello				ServerHello
+ *   AcceptMessage (with I/O)			log_id
+ *   IoBuffer, ChangeWindowSize,		first commit_point at or
+ *     CommandSuspend, ExitMessage		past the message's time
+ *
+ * The server sends commit points every ACK_FREQUENCY (10) seconds,
+ * so the latency of a message acknowledged by a periodic commit point
+ * is mostly the time left until the next one, not server latency.
+ * These are reported separately from the messages the server responds
+ * to immediately (ExitMessage gets its own commit point).  For each
+ * commit point, the "commit lag" is also measured from when the newest
+ * message it covers was sent.  Under sustained traffic, this shows how
+ * far the server is behind the client.
+ *
+ * Captures are sent in the clear, the test server must have a
+ * listener without TLS.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef HAVE_GETADDRINFO
+# include "compat/getaddrinfo.h"
+#endif
+#ifdef HAVE_GETOPT_LONG
+# include <getopt.h>
+# else
+# include "compat/getopt.h"
+#endif /* HAVE_GETOPT_LONG */
+
+#include "sudo_compat.h"
+#include "sudo_conf.h"
+#include "sudo_debug.h"
+#include "sudo_event.h"
+#include "sudo_fatal.h"
+#include "sudo_gettext.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "log_server.pb-c.h"
+#include "logsrv_util.h"
+#include "capture.h"
+
+/* Maximum amount of unsent data queued per connection. */
+#define REPLAY_QUEUE_MAX	(256 * 1024)
+
+/* How long to wait for outstanding responses after the last message. */
+#define REPLAY_DRAIN_TIMEOUT	30
+
+enum replay_type {
+    REPLAY_HELLO,
+    REPLAY_ACCEPT,
+    REPLAY_REJECT,
+    REPLAY_EXIT,
+    REPLAY_RESTART,
+    REPLAY_ALERT,
+    REPLAY_IOBUF,
+    REPLAY_WINSIZE,
+    REPLAY_SUSPEND,
+    REPLAY_OTHER,
+    REPLAY_NTYPES
+};
+
+/* How the server acknowledges a message type. */
+enum replay_ack {
+    ACK_NONE,
+    ACK_RESPONSE,		/* by an immediate response */
+    ACK_COMMIT			/* by the next periodic commit point */
+};
+
+/* Per message type counters and latency samples (in nanoseconds). */
+struct replay_stats {
+    const char *name;
+    enum replay_ack ack;
+    unsigned long long count;
+    unsigned long long bytes;
+    uint64_t *samples;
+    size_t nsamples;
+    size_t samples_size;
+};
+
+static struct replay_stats replay_stats[REPLAY_NTYPES] = {
+    { "ClientHello", ACK_RESPONSE },
+    { "AcceptMessage", ACK_RESPONSE },
+    { "RejectMessage", ACK_NONE },
+    { "ExitMessage", ACK_RESPONSE },
+    { "RestartMessage", ACK_NONE },
+    { "AlertMessage", ACK_NONE },
+    { "IoBuffer", ACK_COMMIT },
+    { "ChangeWindowSize", ACK_COMMIT },
+    { "CommandSuspend", ACK_COMMIT },
+    { "other", ACK_NONE }
+};
+
+/* Time from sending the newest message a commit point covers. */
+static struct replay_stats commit_lag = { "commit lag", ACK_COMMIT };
+
+/* A message waiting for a response from the server. */
+struct replay_pending {
+    enum replay_type type;
+    unsigned long long end;	/* stream offset just past the message */
+    struct timespec elapsed;	/* I/O time, for commit points */
+    struct timespec sent;	/* when the last byte was sent */
+};
+
+/* A capture to be replayed, in order of original start time. */
+struct replay_capture {
+    const char *path;
+    struct timespec start;	/* wall clock time of the first message */
+};
+
+struct replay_closure {
+    TAILQ_ENTRY(replay_closure) entries;
+    const char *path;
+    FILE *fp;
+    int sock;
+    struct sudo_event_base *evbase;
+    struct sudo_event *read_ev;
+    struct sudo_event *write_ev;
+    struct sudo_event *timer_ev;
+    struct connection_buffer read_buf;
+    struct connection_buffer write_buf;
+    struct timespec start;	/* when replay of this capture started */
+    struct timespec next_due;	/* when the next record is due */
+    struct timespec elapsed;	/* I/O time sent, as in a commit point */
+    unsigned long long queued;	/* bytes added to write_buf */
+    unsigned long long sent;	/* bytes sent to the server */
+    uint32_t next_len;		/* length of the next ClientMessage */
+    bool have_next;
+    bool eof;
+    bool log_io;
+    bool draining;
+    struct replay_pending *hello;
+    struct replay_pending *log_id;
+    struct replay_pending *pending;
+    size_t pending_head;
+    size_t pending_sent;	/* first pending entry not yet fully sent */
+    size_t pending_len;
+    size_t pending_size;
+};
+
+TAILQ_HEAD(replay_list, replay_closure);
+static struct replay_list connections = TAILQ_HEAD_INITIALIZER(connections);
+
+static struct peer_info server_info = { "localhost" };
+static const char *port;
+static unsigned int speed = 1;		/* 0 means as fast as possible */
+static unsigned int max_conns;		/* 0 means no limit */
+static struct replay_capture *captures;
+static size_t ncaptures;
+static size_t next_capture;
+static unsigned int active_conns;
+static unsigned int failed_conns;
+static struct timespec replay_start;
+static struct sudo_event *launch_ev;
+
+static void replay_launch(struct sudo_event_base *evbase);
+static void replay_finish(struct replay_closure *closure, bool failed);
+
+static void
+usage(bool fatal)
+{
+    fprintf(stderr, "usage: %s [-V] [-c connections] [-h host] [-p port] "
+	"[-P server-pid] [-s speed] capture ...\n", getprogname());
+    if (fatal)
+	exit(EXIT_FAILURE);
+}
+
+static void
+help(void)
+{
+    printf("%s - %s\n\n", getprogname(),
+	_("replay sudo_logsrvd traffic captures against a server"));
+    usage(false);
+    printf("\n%s\n", _("Options:"));
+    printf("  -c, --connections     %s\n",
+	_("maximum number of concurrent connections"));
+    printf("  -h, --host            %s\n",
+	_("host to send captures to"));
+    printf("      --help            %s\n",
+	_("display help message and exit"));
+    printf("  -p, --port            %s\n",
+	_("port to use when connecting to host"));
+    printf("  -P, --server-pid      %s\n",
+	_("report CPU time used by this server process"));
+    printf("  -s, --speed           %s\n",
+	_("speed up replay by this factor, or \"max\""));
+    printf("  -V, --version         %s\n",
+	_("display version information and exit"));
+    putchar('\n');
+    exit(EXIT_SUCCESS);
+}
+
+static uint32_t
+get_u32(const uint8_t *cp)
+{
+    return ((uint32_t)cp[0] << 24) | ((uint32_t)cp[1] << 16) |
+	((uint32_t)cp[2] << 8) | (uint32_t)cp[3];
+}
+
+/*
+ * Connect to specified host:port
+ * If host has multiple addresses, the first one that connects is used.
+ * Returns open socket or -1 on error.
+ */
+static int
+connect_server(struct peer_info *server, const char *port)
+{
+    struct addrinfo hints, *res, *res0;
+    const char *cause = "getaddrinfo";
+    int error, sock, save_errno;
+    debug_decl(connect_server, SUDO_DEBUG_UTIL);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    error = getaddrinfo(server->name, port, &hints, &res0);
+    if (error != 0) {
+	sudo_warnx(U_("unable to look up %s:%s: %s"), server->name, port,
+	    gai_strerror(error));
+	debug_return_int(-1);
+    }
+
+    sock = -1;
+    for (res = res0; res; res = res->ai_next) {
+	sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (sock == -1) {
+	    cause = "socket";
+	    continue;
+	}
+	if (connect(sock, res->ai_addr, res->ai_addrlen) == -1) {
+	    cause = "connect";
+	    save_errno = errno;
+	    close(sock);
+	    errno = save_errno;
+	    sock = -1;
+	    continue;
+	}
+	break;	/* success */
+    }
+    freeaddrinfo(res0);
+
+    if (sock != -1) {
+	int flags = fcntl(sock, F_GETFL, 0);
+	if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+	    cause = "fcntl(O_NONBLOCK)";
+	    save_errno = errno;
+	    close(sock);
+	    errno = save_errno;
+	    sock = -1;
+	}
+    }
+    if (sock == -1)
+	sudo_warn("%s", cause);
+
+    debug_return_int(sock);
+}
+
+/*
+ * Read and check a capture file header, storing the capture start time.
+ */
+static bool
+read_capture_header(FILE *fp, const char *path, struct timespec *start)
+{
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    debug_decl(read_capture_header, SUDO_DEBUG_UTIL);
+
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header)) {
+	sudo_warnx(U_("%s: not a sudo_logsrvd capture file"), path);
+	debug_return_bool(false);
+    }
+    if (get_u32(header) != CAPTURE_MAGIC) {
+	sudo_warnx(U_("%s: not a sudo_logsrvd capture file"), path);
+	debug_return_bool(false);
+    }
+    if (get_u32(header + 4) != CAPTURE_VERSION) {
+	sudo_warnx(U_("%s: unsupported capture version %u"), path,
+	    get_u32(header + 4));
+	debug_return_bool(false);
+    }
+    start->tv_sec = (time_t)(((uint64_t)get_u32(header + 8) << 32) |
+	get_u32(header + 12));
+    start->tv_nsec = get_u32(header + 16);
+
+    debug_return_bool(true);
+}
+
+static int
+capture_compare(const void *v1, const void *v2)
+{
+    const struct replay_capture *c1 = v1;
+    const struct replay_capture *c2 = v2;
+
+    if (sudo_timespeccmp(&c1->start, &c2->start, <))
+	return -1;
+    if (sudo_timespeccmp(&c1->start, &c2->start, >))
+	return 1;
+    return 0;
+}
+
+/*
+ * Scale an offset in the capture to the replay speed.
+ */
+static void
+scale_offset(struct timespec *ts)
+{
+    unsigned long long nsec;
+
+    if (speed == 1)
+	return;
+    if (speed == 0) {
+	sudo_timespecclear(ts);
+	return;
+    }
+    nsec = (unsigned long long)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+    nsec /= speed;
+    ts->tv_sec = nsec / 1000000000ULL;
+    ts->tv_nsec = nsec % 1000000000ULL;
+}
+
+static bool
+add_sample(struct replay_stats *stats, const struct timespec *sent,
+    const struct timespec *now)
+{
+    struct timespec delta;
+    debug_decl(add_sample, SUDO_DEBUG_UTIL);
+
+    if (!sudo_timespecisset(sent))
+	debug_return_bool(true);
+
+    if (stats->nsamples == stats->samples_size) {
+	size_t new_size = stats->samples_size ? stats->samples_size * 2 : 1024;
+	uint64_t *samples = reallocarray(stats->samples, new_size,
+	    sizeof(*samples));
+	if (samples == NULL) {
+	    sudo_warnx(U_("%s: %s"), __func__, U_("unable to allocate memory"));
+	    debug_return_bool(false);
+	}
+	stats->samples = samples;
+	stats->samples_size = new_size;
+    }
+    sudo_timespecsub(now, sent, &delta);
+    stats->samples[stats->nsamples++] =
+	(uint64_t)delta.tv_sec * 1000000000ULL + delta.tv_nsec;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Add a message to the queue of messages acknowledged by commit points.
+ */
+static struct replay_pending *
+pending_push(struct replay_closure *closure, enum replay_type type)
+{
+    struct replay_pending *pending;
+    debug_decl(pending_push, SUDO_DEBUG_UTIL);
+
+    if (closure->pending_len == closure->pending_size) {
+	if (closure->pending_head > 0) {
+	    /* Reclaim space used by acknowledged messages. */
+	    memmove(closure->pending, closure->pending + closure->pending_head,
+		(closure->pending_len - closure->pending_head) *
+		sizeof(*closure->pending));
+	    closure->pending_len -= closure->pending_head;
+	    closure->pending_sent -= closure->pending_head;
+	    closure->pending_head = 0;
+	}
+	if (closure->pending_len == closure->pending_size) {
+	    size_t new_size = closure->pending_size ?
+		closure->pending_size * 2 : 64;
+	    pending = reallocarray(closure->pending, new_size,
+		sizeof(*pending));
+	    if (pending == NULL) {
+		sudo_warnx(U_("%s: %s"), __func__,
+		    U_("unable to allocate memory"));
+		debug_return_ptr(NULL);
+	    }
+	    closure->pending = pending;
+	    closure->pending_size = new_size;
+	}
+    }
+    pending = &closure->pending[closure->pending_len++];
+    pending->type = type;
+    pending->end = closure->queued;
+    pending->elapsed = closure->elapsed;
+    sudo_timespecclear(&pending->sent);
+
+    debug_return_ptr(pending);
+}
+
+static void
+add_delay(struct replay_closure *closure, TimeSpec *delay)
+{
+    if (delay != NULL) {
+	struct timespec ts;
+
+	ts.tv_sec = delay->tv_sec;
+	ts.tv_nsec = delay->tv_nsec;
+	sudo_timespecadd(&closure->elapsed, &ts, &closure->elapsed);
+    }
+}
+
+/*
+ * Account for a message that has just been queued and note which
+ * response from the server, if any, acknowledges it.
+ */
+static bool
+account_message(struct replay_closure *closure, const uint8_t *buf,
+    uint32_t len)
+{
+    enum replay_type type = REPLAY_OTHER;
+    ClientMessage *msg;
+    bool ack = false;
+    debug_decl(account_message, SUDO_DEBUG_UTIL);
+
+    msg = client_message__unpack(NULL, len, buf);
+    if (msg != NULL) {
+	switch (msg->type_case) {
+	case CLIENT_MESSAGE__TYPE_HELLO_MSG:
+	    type = REPLAY_HELLO;
+	    break;
+	case CLIENT_MESSAGE__TYPE_ACCEPT_MSG:
+	    type = REPLAY_ACCEPT;
+	    closure->log_io = msg->u.accept_msg->expect_iobufs;
+	    break;
+	case CLIENT_MESSAGE__TYPE_REJECT_MSG:
+	    type = REPLAY_REJECT;
+	    break;
+	case CLIENT_MESSAGE__TYPE_EXIT_MSG:
+	    type = REPLAY_EXIT;
+	    ack = closure->log_io;
+	    break;
+	case CLIENT_MESSAGE__TYPE_RESTART_MSG:
+	    type = REPLAY_RESTART;
+	    closure->log_io = true;
+	    if (msg->u.restart_msg->resume_point != NULL) {
+		closure->elapsed.tv_sec =
+		    msg->u.restart_msg->resume_point->tv_sec;
+		closure->elapsed.tv_nsec =
+		    msg->u.restart_msg->resume_point->tv_nsec;
+	    }
+	    break;
+	case CLIENT_MESSAGE__TYPE_ALERT_MSG:
+	    type = REPLAY_ALERT;
+	    break;
+	case CLIENT_MESSAGE__TYPE_TTYIN_BUF:
+	    add_delay(closure, msg->u.ttyin_buf->delay);
+	    type = REPLAY_IOBUF;
+	    ack = true;
+	    break;
+	case CLIENT_MESSAGE__TYPE_TTYOUT_BUF:
+	    add_delay(closure, msg->u.ttyout_buf->delay);
+	    type = REPLAY_IOBUF;
+	    ack = true;
+	    break;
+	case CLIENT_MESSAGE__TYPE_STDIN_BUF:
+	    add_delay(closure, msg->u.stdin_buf->delay);
+	    type = REPLAY_IOBUF;
+	    ack = true;
+	    break;
+	case CLIENT_MESSAGE__TYPE_STDOUT_BUF:
+	    add_delay(closure, msg->u.stdout_buf->delay);
+	    type = REPLAY_IOBUF;
+	    ack = true;
+	    break;
+	case CLIENT_MESSAGE__TYPE_STDERR_BUF:
+	    add_delay(closure, msg->u.stderr_buf->delay);
+	    type = REPLAY_IOBUF;
+	    ack = true;
+	    break;
+	case CLIENT_MESSAGE__TYPE_WINSIZE_EVENT:
+	    add_delay(closure, msg->u.winsize_event->delay);
+	    type = REPLAY_WINSIZE;
+	    ack = true;
+	    break;
+	case CLIENT_MESSAGE__TYPE_SUSPEND_EVENT:
+	    add_delay(closure, msg->u.suspend_event->delay);
+	    type = REPLAY_SUSPEND;
+	    ack = true;
+	    break;
+	default:
+	    break;
+	}
+	client_message__free_unpacked(msg, NULL);
+    } else {
+	sudo_warnx(U_("%s: unable to unpack ClientMessage size %u"),
+	    closure->path, len);
+    }
+
+    replay_stats[type].count++;
+    replay_stats[type].bytes += len + sizeof(uint32_t);
+
+    if (type == REPLAY_HELLO || (type == REPLAY_ACCEPT && closure->log_io)) {
+	struct replay_pending *pending = malloc(sizeof(*pending));
+	if (pending == NULL) {
+	    sudo_warnx(U_("%s: %s"), __func__, U_("unable to allocate memory"));
+	    debug_return_bool(false);
+	}
+	pending->type = type;
+	pending->end = closure->queued;
+	sudo_timespecclear(&pending->sent);
+	if (type == REPLAY_HELLO) {
+	    free(closure->hello);
+	    closure->hello = pending;
+	} else {
+	    free(closure->log_id);
+	    closure->log_id = pending;
+	}
+    } else if (ack) {
+	if (pending_push(closure, type) == NULL)
+	    debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Read the time stamp and length of the next capture record.
+ */
+static bool
+read_record_header(struct replay_closure *closure)
+{
+    uint8_t record[CAPTURE_RECORD_SIZE + sizeof(uint32_t)];
+    struct timespec offset;
+    size_t nread;
+    debug_decl(read_record_header, SUDO_DEBUG_UTIL);
+
+    nread = fread(record, 1, sizeof(record), closure->fp);
+    if (nread != sizeof(record)) {
+	if (nread != 0 || ferror(closure->fp))
+	    sudo_warnx(U_("%s: truncated capture file"), closure->path);
+	closure->eof = true;
+	debug_return_bool(true);
+    }
+    offset.tv_sec = get_u32(record);
+    offset.tv_nsec = get_u32(record + 4);
+    closure->next_len = get_u32(record + 8);
+    if (offset.tv_nsec >= 1000000000 || closure->next_len > MESSAGE_SIZE_MAX) {
+	sudo_warnx(U_("%s: invalid capture record"), closure->path);
+	debug_return_bool(false);
+    }
+    scale_offset(&offset);
+    sudo_timespecadd(&closure->start, &offset, &closure->next_due);
+    closure->have_next = true;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Make room for len more bytes at the end of buf.
+ */
+static bool
+reserve_buf(struct connection_buffer *buf, unsigned int len)
+{
+    debug_decl(reserve_buf, SUDO_DEBUG_UTIL);
+
+    if (buf->len + len > buf->size && buf->off > 0) {
+	memmove(buf->data, buf->data + buf->off, buf->len - buf->off);
+	buf->len -= buf->off;
+	buf->off = 0;
+    }
+    if (buf->len + len > buf->size) {
+	unsigned int new_size = sudo_pow2_roundup(buf->len + len);
+	uint8_t *data = realloc(buf->data, new_size);
+	if (data == NULL) {
+	    sudo_warnx(U_("%s: %s"), __func__, U_("unable to allocate memory"));
+	    debug_return_bool(false);
+	}
+	buf->data = data;
+	buf->size = new_size;
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Queue all records that are due, then wait for the write event or
+ * the next record's time.
+ */
+static bool
+replay_fill(struct replay_closure *closure)
+{
+    struct connection_buffer *buf = &closure->write_buf;
+    struct timespec now;
+    debug_decl(replay_fill, SUDO_DEBUG_UTIL);
+
+    sudo_gettime_mono(&now);
+    while (!closure->eof) {
+	uint32_t msg_len;
+
+	if (!closure->have_next) {
+	    if (!read_record_header(closure))
+		debug_return_bool(false);
+	    continue;
+	}
+	if (sudo_timespeccmp(&closure->next_due, &now, >)) {
+	    struct timespec delay;
+
+	    sudo_timespecsub(&closure->next_due, &now, &delay);
+	    if (sudo_ev_add(closure->evbase, closure->timer_ev, &delay,
+		    false) == -1) {
+		sudo_warnx("%s", U_("unable to add event to queue"));
+		debug_return_bool(false);
+	    }
+	    break;
+	}
+	if (buf->len - buf->off >= REPLAY_QUEUE_MAX)
+	    break;
+
+	/* Queue the message as it was framed on the wire. */
+	if (!reserve_buf(buf, closure->next_len + sizeof(msg_len)))
+	    debug_return_bool(false);
+	msg_len = htonl(closure->next_len);
+	memcpy(buf->data + buf->len, &msg_len, sizeof(msg_len));
+	if (fread(buf->data + buf->len + sizeof(msg_len), 1, closure->next_len,
+		closure->fp) != closure->next_len) {
+	    sudo_warnx(U_("%s: truncated capture file"), closure->path);
+	    closure->eof = true;
+	    break;
+	}
+	closure->queued += closure->next_len + sizeof(msg_len);
+	if (!account_message(closure, buf->data + buf->len + sizeof(msg_len),
+		closure->next_len))
+	    debug_return_bool(false);
+	buf->len += closure->next_len + sizeof(msg_len);
+	closure->have_next = false;
+    }
+
+    if (buf->len != buf->off) {
+	if (sudo_ev_add(closure->evbase, closure->write_ev, NULL,
+		false) == -1) {
+	    sudo_warnx("%s", U_("unable to add event to queue"));
+	    debug_return_bool(false);
+	}
+    } else if (closure->eof && !closure->draining) {
+	/* Everything sent, wait for the remaining responses. */
+	struct timespec timeout = { REPLAY_DRAIN_TIMEOUT, 0 };
+
+	closure->draining = true;
+	if (sudo_ev_add(closure->evbase, closure->read_ev, &timeout,
+		false) == -1) {
+	    sudo_warnx("%s", U_("unable to add event to queue"));
+	    debug_return_bool(false);
+	}
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * True if all messages have been sent and acknowledged.
+ */
+static bool
+replay_done(struct replay_closure *closure)
+{
+    return closure->draining && closure->hello == NULL &&
+	closure->log_id == NULL &&
+	closure->pending_head == closure->pending_len;
+}
+
+/*
+ * Record the send time of messages whose last byte has been sent.
+ */
+static void
+mark_sent(struct replay_closure *closure)
+{
+    struct timespec now;
+
+    sudo_gettime_mono(&now);
+    if (closure->hello != NULL && !sudo_timespecisset(&closure->hello->sent) &&
+	    closure->hello->end <= closure->sent)
+	closure->hello->sent = now;
+    if (closure->log_id != NULL &&
+	    !sudo_timespecisset(&closure->log_id->sent) &&
+	    closure->log_id->end <= closure->sent)
+	closure->log_id->sent = now;
+    while (closure->pending_sent < closure->pending_len &&
+	    closure->pending[closure->pending_sent].end <= closure->sent) {
+	closure->pending[closure->pending_sent++].sent = now;
+    }
+}
+
+/*
+ * Match a ServerMessage to the messages it acknowledges.
+ */
+static bool
+handle_server_message(uint8_t *buf, size_t len,
+    struct replay_closure *closure)
+{
+    struct replay_pending *pending, *newest;
+    struct timespec now, committed;
+    ServerMessage *msg;
+    bool ret = true;
+    debug_decl(handle_server_message, SUDO_DEBUG_UTIL);
+
+    msg = server_message__unpack(NULL, len, buf);
+    if (msg == NULL) {
+	sudo_warnx("%s", U_("unable to unpack ServerMessage"));
+	debug_return_bool(false);
+    }
+
+    sudo_gettime_mono(&now);
+    switch (msg->type_case) {
+    case SERVER_MESSAGE__TYPE_HELLO:
+	if (closure->hello != NULL) {
+	    ret = add_sample(&replay_stats[REPLAY_HELLO],
+		&closure->hello->sent, &now);
+	    free(closure->hello);
+	    closure->hello = NULL;
+	}
+	break;
+    case SERVER_MESSAGE__TYPE_LOG_ID:
+	if (closure->log_id != NULL) {
+	    ret = add_sample(&replay_stats[REPLAY_ACCEPT],
+		&closure->log_id->sent, &now);
+	    free(closure->log_id);
+	    closure->log_id = NULL;
+	}
+	break;
+    case SERVER_MESSAGE__TYPE_COMMIT_POINT:
+	committed.tv_sec = msg->u.commit_point->tv_sec;
+	committed.tv_nsec = msg->u.commit_point->tv_nsec;
+	newest = NULL;
+	while (ret && closure->pending_head < closure->pending_sent) {
+	    pending = &closure->pending[closure->pending_head];
+	    if (sudo_timespeccmp(&pending->elapsed, &committed, >))
+		break;
+	    ret = add_sample(&replay_stats[pending->type], &pending->sent,
+		&now);
+	    newest = pending;
+	    closure->pending_head++;
+	}
+	if (ret && newest != NULL)
+	    ret = add_sample(&commit_lag, &newest->sent, &now);
+	break;
+    case SERVER_MESSAGE__TYPE_ERROR:
+	sudo_warnx(U_("%s: error message received from server: %s"),
+	    closure->path, msg->u.error);
+	ret = false;
+	break;
+    case SERVER_MESSAGE__TYPE_ABORT:
+	sudo_warnx(U_("%s: abort message received from server: %s"),
+	    closure->path, msg->u.abort);
+	ret = false;
+	break;
+    default:
+	break;
+    }
+
+    server_message__free_unpacked(msg, NULL);
+    debug_return_bool(ret);
+}
+
+/*
+ * Read and unpack ServerMessages (read callback).
+ */
+static void
+server_msg_cb(int fd, int what, void *v)
+{
+    struct replay_closure *closure = v;
+    struct connection_buffer *buf = &closure->read_buf;
+    uint32_t msg_len;
+    ssize_t nread;
+    debug_decl(server_msg_cb, SUDO_DEBUG_UTIL);
+
+    if (what == SUDO_EV_TIMEOUT) {
+	sudo_warnx(U_("%s: timeout waiting for server"), closure->path);
+	replay_finish(closure, true);
+	debug_return;
+    }
+
+    nread = recv(fd, buf->data + buf->len, buf->size - buf->len, 0);
+    switch (nread) {
+    case -1:
+	if (errno == EAGAIN || errno == EINTR)
+	    debug_return;
+	sudo_warn("recv");
+	replay_finish(closure, true);
+	debug_return;
+    case 0:
+	/* The server closes the connection when it is finished. */
+	replay_finish(closure, !closure->eof);
+	debug_return;
+    default:
+	break;
+    }
+    buf->len += nread;
+
+    while (buf->len - buf->off >= sizeof(msg_len)) {
+	memcpy(&msg_len, buf->data + buf->off, sizeof(msg_len));
+	msg_len = ntohl(msg_len);
+
+	if (msg_len > MESSAGE_SIZE_MAX) {
+	    sudo_warnx(U_("server message too large: %u"), msg_len);
+	    replay_finish(closure, true);
+	    debug_return;
+	}
+	if (msg_len + sizeof(msg_len) > buf->len - buf->off) {
+	    /* Incomplete message, we'll read the rest next time. */
+	    if (!reserve_buf(buf, msg_len + sizeof(msg_len))) {
+		replay_finish(closure, true);
+		debug_return;
+	    }
+	    debug_return;
+	}
+	buf->off += sizeof(msg_len);
+	if (!handle_server_message(buf->data + buf->off, msg_len, closure)) {
+	    replay_finish(closure, true);
+	    debug_return;
+	}
+	buf->off += msg_len;
+    }
+    buf->len -= buf->off;
+    buf->off = 0;
+
+    if (replay_done(closure))
+	replay_finish(closure, false);
+
+    debug_return;
+}
+
+/*
+ * Send queued ClientMessages to the server (write callback).
+ */
+static void
+client_msg_cb(int fd, int what, void *v)
+{
+    struct replay_closure *closure = v;
+    struct connection_buffer *buf = &closure->write_buf;
+    ssize_t nwritten;
+    debug_decl(client_msg_cb, SUDO_DEBUG_UTIL);
+
+    nwritten = send(fd, buf->data + buf->off, buf->len - buf->off, 0);
+    if (nwritten == -1) {
+	if (errno == EAGAIN || errno == EINTR)
+	    debug_return;
+	sudo_warn("send");
+	replay_finish(closure, true);
+	debug_return;
+    }
+    buf->off += nwritten;
+    closure->sent += nwritten;
+    mark_sent(closure);
+
+    if (buf->off == buf->len) {
+	buf->off = 0;
+	buf->len = 0;
+	sudo_ev_del(closure->evbase, closure->write_ev);
+    }
+    if (!replay_fill(closure)) {
+	replay_finish(closure, true);
+	debug_return;
+    }
+    if (replay_done(closure))
+	replay_finish(closure, false);
+
+    debug_return;
+}
+
+/*
+ * Queue records that have become due (timer callback).
+ */
+static void
+replay_timer_cb(int fd, int what, void *v)
+{
+    struct replay_closure *closure = v;
+    debug_decl(replay_timer_cb, SUDO_DEBUG_UTIL);
+
+    if (!replay_fill(closure))
+	replay_finish(closure, true);
+    else if (replay_done(closure))
+	replay_finish(closure, false);
+
+    debug_return;
+}
+
+static void
+replay_closure_free(struct replay_closure *closure)
+{
+    debug_decl(replay_closure_free, SUDO_DEBUG_UTIL);
+
+    if (closure->sock != -1)
+	close(closure->sock);
+    if (closure->fp != NULL)
+	fclose(closure->fp);
+    sudo_ev_free(closure->read_ev);
+    sudo_ev_free(closure->write_ev);
+    sudo_ev_free(closure->timer_ev);
+    free(closure->read_buf.data);
+    free(closure->write_buf.data);
+    free(closure->hello);
+    free(closure->log_id);
+    free(closure->pending);
+    free(closure);
+
+    debug_return;
+}
+
+/*
+ * Done with a capture, start the next one if we were at the
+ * connection limit.
+ */
+static void
+replay_finish(struct replay_closure *closure, bool failed)
+{
+    struct sudo_event_base *evbase = closure->evbase;
+    debug_decl(replay_finish, SUDO_DEBUG_UTIL);
+
+    if (failed)
+	failed_conns++;
+    TAILQ_REMOVE(&connections, closure, entries);
+    replay_closure_free(closure);
+    active_conns--;
+
+    replay_launch(evbase);
+
+    debug_return;
+}
+
+/*
+ * Connect to the server and start replaying a capture.
+ */
+static bool
+replay_start_capture(struct replay_capture *capture,
+    struct sudo_event_base *evbase)
+{
+    struct replay_closure *closure;
+    struct timespec start;
+    debug_decl(replay_start_capture, SUDO_DEBUG_UTIL);
+
+    if ((closure = calloc(1, sizeof(*closure))) == NULL) {
+	sudo_warnx(U_("%s: %s"), __func__, U_("unable to allocate memory"));
+	debug_return_bool(false);
+    }
+    closure->path = capture->path;
+    closure->evbase = evbase;
+    closure->sock = -1;
+    TAILQ_INSERT_TAIL(&connections, closure, entries);
+    active_conns++;
+
+    if ((closure->fp = fopen(capture->path, "r")) == NULL) {
+	sudo_warn("%s", capture->path);
+	goto bad;
+    }
+    if (!read_capture_header(closure->fp, capture->path, &start))
+	goto bad;
+    if ((closure->sock = connect_server(&server_info, port)) == -1)
+	goto bad;
+
+    closure->read_buf.size = 64 * 1024;
+    closure->read_buf.data = malloc(closure->read_buf.size);
+    if (closure->read_buf.data == NULL) {
+	sudo_warnx(U_("%s: %s"), __func__, U_("unable to allocate memory"));
+	goto bad;
+    }
+    closure->read_ev = sudo_ev_alloc(closure->sock,
+	SUDO_EV_READ|SUDO_EV_PERSIST, server_msg_cb, closure);
+    closure->write_ev = sudo_ev_alloc(closure->sock,
+	SUDO_EV_WRITE|SUDO_EV_PERSIST, client_msg_cb, closure);
+    closure->timer_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT, replay_timer_cb,
+	closure);
+    if (closure->read_ev == NULL || closure->write_ev == NULL ||
+	    closure->timer_ev == NULL) {
+	sudo_warnx(U_("%s: %s"), __func__, U_("unable to allocate memory"));
+	goto bad;
+    }
+    if (sudo_ev_add(evbase, closure->read_ev, NULL, false) == -1) {
+	sudo_warnx("%s", U_("unable to add event to queue"));
+	goto bad;
+    }
+
+    sudo_gettime_mono(&closure->start);
+    if (!replay_fill(closure))
+	goto bad;
+    if (replay_done(closure)) {
+	/* Nothing to send. */
+	TAILQ_REMOVE(&connections, closure, entries);
+	replay_closure_free(closure);
+	active_conns--;
+    }
+
+    debug_return_bool(true);
+bad:
+    failed_conns++;
+    TAILQ_REMOVE(&connections, closure, entries);
+    replay_closure_free(closure);
+    active_conns--;
+    debug_return_bool(false);
+}
+
+/*
+ * Start captures whose (scaled) start offset has been reached,
+ * subject to the connection limit.
+ */
+static void
+replay_launch(struct sudo_event_base *evbase)
+{
+    struct timespec now, due;
+    debug_decl(replay_launch, SUDO_DEBUG_UTIL);
+
+    while (next_capture < ncaptures) {
+	if (max_conns != 0 && active_conns >= max_conns)
+	    break;
+
+	sudo_timespecsub(&captures[next_capture].start, &captures[0].start,
+	    &due);
+	scale_offset(&due);
+	sudo_timespecadd(&replay_start, &due, &due);
+	sudo_gettime_mono(&now);
+	if (sudo_timespeccmp(&due, &now, >)) {
+	    sudo_timespecsub(&due, &now, &due);
+	    if (sudo_ev_add(evbase, launch_ev, &due, false) == -1)
+		sudo_fatalx("%s", U_("unable to add event to queue"));
+	    break;
+	}
+	(void)replay_start_capture(&captures[next_capture++], evbase);
+    }
+
+    if (next_capture == ncaptures && active_conns == 0)
+	sudo_ev_loopexit(evbase);
+
+    debug_return;
+}
+
+static void
+replay_launch_cb(int fd, int what, void *v)
+{
+    replay_launch(v);
+}
+
+static int
+sample_compare(const void *v1, const void *v2)
+{
+    const uint64_t s1 = *(const uint64_t *)v1;
+    const uint64_t s2 = *(const uint64_t *)v2;
+
+    return s1 < s2 ? -1 : s1 > s2;
+}
+
+static double
+sample_ms(struct replay_stats *stats, unsigned int percentile)
+{
+    size_t idx = (stats->nsamples - 1) * percentile / 100;
+    return stats->samples[idx] / 1000000.0;
+}
+
+/*
+ * Read user and system CPU time of a process from /proc.
+ */
+static bool
+process_cpu_time(pid_t pid, double *utime, double *stime)
+{
+    char path[PATH_MAX], buf[1024], *cp;
+    unsigned long long ut, st;
+    long ticks;
+    ssize_t nread;
+    int fd, len;
+    debug_decl(process_cpu_time, SUDO_DEBUG_UTIL);
+
+    len = snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if (len >= ssizeof(path))
+	debug_return_bool(false);
+    if ((fd = open(path, O_RDONLY)) == -1)
+	debug_return_bool(false);
+    nread = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (nread <= 0)
+	debug_return_bool(false);
+    buf[nread] = '\0';
+
+    /* Skip past the command name, which may contain spaces. */
+    if ((cp = strrchr(buf, ')')) == NULL)
+	debug_return_bool(false);
+    if (sscanf(cp + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+	    &ut, &st) != 2)
+	debug_return_bool(false);
+    if ((ticks = sysconf(_SC_CLK_TCK)) <= 0)
+	debug_return_bool(false);
+    *utime = (double)ut / ticks;
+    *stime = (double)st / ticks;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Display the count, bytes and latency percentiles of one stats row.
+ */
+static void
+print_row(struct replay_stats *stats)
+{
+    double total = 0;
+    size_t n;
+    debug_decl(print_row, SUDO_DEBUG_UTIL);
+
+    if (stats->count == 0 && stats->nsamples == 0)
+	debug_return;
+    printf("%-18s %9llu %12llu", stats->name, stats->count, stats->bytes);
+    if (stats->ack == ACK_NONE || stats->nsamples == 0) {
+	printf(" %9s\n", stats->ack != ACK_NONE ? "0" : "-");
+	debug_return;
+    }
+    qsort(stats->samples, stats->nsamples, sizeof(*stats->samples),
+	sample_compare);
+    for (n = 0; n < stats->nsamples; n++)
+	total += stats->samples[n];
+    printf(" %9zu %9.3f %9.3f %9.3f %9.3f %9.3f\n", stats->nsamples,
+	total / stats->nsamples / 1000000.0, sample_ms(stats, 50),
+	sample_ms(stats, 90), sample_ms(stats, 99), sample_ms(stats, 100));
+
+    debug_return;
+}
+
+static void
+report(const struct timespec *wall)
+{
+    unsigned long long messages = 0, bytes = 0;
+    double secs = wall->tv_sec + wall->tv_nsec / 1000000000.0;
+    int i;
+    debug_decl(report, SUDO_DEBUG_UTIL);
+
+    for (i = 0; i < REPLAY_NTYPES; i++) {
+	messages += replay_stats[i].count;
+	bytes += replay_stats[i].bytes;
+    }
+    printf("replayed %zu capture%s (%u failed) in %lld.%09ld seconds\n",
+	ncaptures, ncaptures == 1 ? "" : "s", failed_conns,
+	(long long)wall->tv_sec, wall->tv_nsec);
+    printf("sent %llu messages, %llu bytes", messages, bytes);
+    if (secs > 0)
+	printf(" (%.1f messages/s)", messages / secs);
+    putchar('\n');
+
+    printf("\n%-18s %9s %12s %9s %9s %9s %9s %9s %9s\n", "message", "count",
+	"bytes", "acked", "avg ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (i = 0; i < REPLAY_NTYPES; i++) {
+	if (replay_stats[i].ack != ACK_COMMIT)
+	    print_row(&replay_stats[i]);
+    }
+
+    /* Latency here is dominated by the server's commit interval. */
+    printf("\nacknowledged by commit points (sent every 10 seconds by default;"
+	"\nlatency includes the time until the next commit point)\n");
+    for (i = 0; i < REPLAY_NTYPES; i++) {
+	if (replay_stats[i].ack == ACK_COMMIT)
+	    print_row(&replay_stats[i]);
+    }
+    print_row(&commit_lag);
+
+    debug_return;
+}
+
+static const char short_opts[] = "c:h:p:P:s:V";
+static struct option long_opts[] = {
+    { "connections",	required_argument,	NULL,	'c' },
+    { "help",		no_argument,		NULL,	1 },
+    { "host",		required_argument,	NULL,	'h' },
+    { "port",		required_argument,	NULL,	'p' },
+    { "server-pid",	required_argument,	NULL,	'P' },
+    { "speed",		required_argument,	NULL,	's' },
+    { "version",	no_argument,		NULL,	'V' },
+    { NULL,		no_argument,		NULL,	0 },
+};
+
+sudo_dso_public int main(int argc, char *argv[]);
+
+int
+main(int argc, char *argv[])
+{
+    struct sudo_event_base *evbase;
+    struct timespec end, wall;
+    struct rusage ru;
+    double server_utime = 0, server_stime = 0, utime, stime;
+    bool server_cpu = false;
+    pid_t server_pid = 0;
+    const char *errstr;
+    size_t i;
+    int ch;
+    debug_decl_vars(main, SUDO_DEBUG_MAIN);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    initprogname(argc > 0 ? argv[0] : "sudo_logreplay");
+    setlocale(LC_ALL, "");
+    bindtextdomain("sudo", LOCALEDIR); /* XXX - add logsrvd domain */
+    textdomain("sudo");
+
+    /* Read sudo.conf and initialize the debug subsystem. */
+    if (sudo_conf_read(NULL, SUDO_CONF_DEBUG) == -1)
+        exit(EXIT_FAILURE);
+    sudo_debug_register(getprogname(), NULL, NULL,
+        sudo_conf_debug_files(getprogname()));
+
+    if (protobuf_c_version_number() < 1003000)
+	sudo_fatalx("%s", U_("Protobuf-C version 1.3 or higher required"));
+
+    while ((ch = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+	switch (ch) {
+	case 'c':
+	    max_conns = sudo_strtonum(optarg, 1, INT_MAX, &errstr);
+	    if (errstr != NULL) {
+		sudo_warnx(U_("%s: %s"), optarg, U_(errstr));
+		usage(true);
+	    }
+	    break;
+	case 'h':
+	    server_info.name = optarg;
+	    break;
+	case 'p':
+	    port = optarg;
+	    break;
+	case 'P':
+	    server_pid = sudo_strtonum(optarg, 1, INT_MAX, &errstr);
+	    if (errstr != NULL) {
+		sudo_warnx(U_("%s: %s"), optarg, U_(errstr));
+		usage(true);
+	    }
+	    break;
+	case 's':
+	    if (strcmp(optarg, "max") == 0) {
+		speed = 0;
+		break;
+	    }
+	    speed = sudo_strtonum(optarg, 1, 1000000, &errstr);
+	    if (errstr != NULL) {
+		sudo_warnx(U_("%s: %s"), optarg, U_(errstr));
+		usage(true);
+	    }
+	    break;
+	case 1:
+	    help();
+	    break;
+	case 'V':
+	    (void)printf(_("%s version %s\n"), getprogname(),
+		PACKAGE_VERSION);
+	    return 0;
+	default:
+	    usage(true);
+	}
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc == 0)
+	usage(true);
+    if (port == NULL)
+	port = DEFAULT_PORT;
+
+    /* Order captures by the time they were originally started. */
+    captures = reallocarray(NULL, argc, sizeof(*captures));
+    if (captures == NULL)
+	sudo_fatalx(U_("%s: %s"), __func__, U_("unable to allocate memory"));
+    for (i = 0; i < (size_t)argc; i++) {
+	FILE *fp = fopen(argv[i], "r");
+
+	if (fp == NULL) {
+	    sudo_warn("%s", argv[i]);
+	    continue;
+	}
+	if (read_capture_header(fp, argv[i], &captures[ncaptures].start))
+	    captures[ncaptures++].path = argv[i];
+	fclose(fp);
+    }
+    if (ncaptures == 0)
+	debug_return_int(EXIT_FAILURE);
+    qsort(captures, ncaptures, sizeof(*captures), capture_compare);
+
+    if ((evbase = sudo_ev_base_alloc()) == NULL)
+	sudo_fatal(NULL);
+    launch_ev = sudo_ev_alloc(-1, SUDO_EV_TIMEOUT, replay_launch_cb, evbase);
+    if (launch_ev == NULL)
+	sudo_fatal(NULL);
+
+    if (server_pid != 0) {
+	server_cpu = process_cpu_time(server_pid, &server_utime,
+	    &server_stime);
+	if (!server_cpu) {
+	    sudo_warnx(U_("unable to read CPU time of process %d"),
+		(int)server_pid);
+	}
+    }
+
+    sudo_gettime_mono(&replay_start);
+    replay_launch(evbase);
+    sudo_ev_dispatch(evbase);
+    sudo_gettime_mono(&end);
+    sudo_timespecsub(&end, &replay_start, &wall);
+
+    report(&wall);
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+	printf("\nclient CPU time: user %lld.%06ld, system %lld.%06ld\n",
+	    (long long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec,
+	    (long long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec);
+    }
+    if (server_cpu && process_cpu_time(server_pid, &utime, &stime)) {
+	printf("server CPU time: user %.2f, system %.2f (pid %d)\n",
+	    utime - server_utime, stime - server_stime, (int)server_pid);
+    }
+
+    sudo_ev_free(launch_ev);
+    sudo_ev_base_free(evbase);
+    for (i = 0; i < REPLAY_NTYPES; i++)
+	free(replay_stats[i].samples);
+    free(captures);
+
+    debug_return_int(failed_conns ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,1435 @@
+/*
+ * SPDX-License-Identifier: ISC
+ *
+ * Copyright (c) 2021 Todd C. Miller <Todd.Miller@sudo.ws>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Verify, and optionally repair, the I/O logs in a sudo_logsrvd log tree.
+ *
+ * Every session directory (one containing a "timing" file) is checked
+ * to make sure each record in the timing file is complete, parses and
+ * refers to data that is actually present in the corresponding I/O log
+ * stream.  Compressed streams must be decompressed to find their length,
+ * so sessions are handed out to a pool of worker processes.
+ *
+ * If the session has a "digest" file, the data in each stream is also
+ * checked against its chunk digests and hash chain.  Chains keyed with
+ * iolog_digest_key can only be checked when the same key is given
+ * with -k, in which case unkeyed chains are treated as damaged.
+ *
+ * A damaged session is repaired by truncating the timing file and the
+ * I/O log streams to the last consistent record.  Plain files are
+ * truncated in place; compressed, chunked or corrupt streams are copied
+ * to a temporary directory and renamed over the original.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#ifdef HAVE_STDBOOL_H
+# include <stdbool.h>
+#else
+# include "compat/stdbool.h"
+#endif /* HAVE_STDBOOL_H */
+#if defined(HAVE_STDINT_H)
+# include <stdint.h>
+#elif defined(HAVE_INTTYPES_H)
+# include <inttypes.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_GETOPT_LONG
+# include <getopt.h>
+# else
+# include "compat/getopt.h"
+#endif /* HAVE_GETOPT_LONG */
+
+#include "sudo_compat.h"
+#include "sudo_conf.h"
+#include "sudo_debug.h"
+#include "sudo_digest.h"
+#include "sudo_fatal.h"
+#include "sudo_gettext.h"
+#include "sudo_iolog.h"
+#include "sudo_queue.h"
+#include "sudo_util.h"
+
+#include "logsrv_util.h"
+#include "iolog_ctx.h"
+#include "iolog_digest.h"
+#include "iolog_json.h"
+
+/* Sessions with a writable timing file modified this recently are live. */
+#define DEFAULT_GRACE	(60 * 60)
+
+/* Upper bound on the number of worker processes. */
+#define MAX_JOBS	256
+
+struct verify_stats {
+    unsigned long long sessions;
+    unsigned long long active;
+    unsigned long long damaged;
+    unsigned long long repaired;
+    unsigned long long errors;
+};
+
+struct session_check {
+    struct iolog_file files[IOFD_MAX];
+    off_t size[IOFD_MAX];	/* uncompressed length of each stream */
+    off_t good[IOFD_MAX];	/* length referenced by consistent records */
+    bool rewrite[IOFD_MAX];	/* stream cannot be truncated in place */
+    bool corrupt[IOFD_MAX];	/* stream could not be read to the end */
+    struct iolog_timing_parser parser; /* per-session timing parser */
+    unsigned long long records;	/* number of consistent records */
+    const char *reason;		/* why the session is damaged */
+    int iofd;			/* stream the reason refers to, or -1 */
+};
+
+struct verify_worker {
+    pid_t pid;
+    int fd;			/* write end of the session pipe */
+};
+
+static struct verify_worker workers[MAX_JOBS];
+static struct verify_stats stats;
+static unsigned int nworkers;
+static unsigned int next_worker;
+static int report_fd = STDOUT_FILENO;
+static time_t grace_cutoff;
+static bool repair;
+static bool verbose;
+
+static void
+usage(bool fatal)
+{
+    fprintf(stderr, "usage: %s [-rvV] [-g grace] [-j jobs] [-k keyfile] "
+	"[-o report] dir ...\n", getprogname());
+    if (fatal)
+	exit(EXIT_FAILURE);
+}
+
+static void
+help(void)
+{
+    printf("%s - %s\n\n", getprogname(),
+	_("verify and repair sudo_logsrvd I/O logs"));
+    usage(false);
+    printf("\n%s\n", _("Options:"));
+    printf("  -g, --grace           %s\n",
+	_("seconds since a live session was last written"));
+    printf("      --help            %s\n",
+	_("display help message and exit"));
+    printf("  -j, --jobs            %s\n",
+	_("number of worker processes"));
+    printf("  -k, --key             %s\n",
+	_("verify keyed digests with the key in the specified file"));
+    printf("  -o, --output          %s\n",
+	_("append the report to the specified file"));
+    printf("  -r, --repair          %s\n",
+	_("truncate damaged sessions to the last consistent record"));
+    printf("  -v, --verbose         %s\n",
+	_("report sessions that are intact or in progress"));
+    printf("  -V, --version         %s\n",
+	_("display version information and exit"));
+    putchar('\n');
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Write a line to the report.  Each line is written with a single
+ * write(2) so lines from different workers are not interleaved.
+ */
+static void
+report(const char *fmt, ...)
+{
+    char line[PATH_MAX + 256];
+    va_list ap;
+    int len;
+    debug_decl(report, SUDO_DEBUG_UTIL);
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+	debug_return;
+    if (len >= ssizeof(line) - 1)
+	len = sizeof(line) - 2;
+    line[len++] = '\n';
+    if (write(report_fd, line, len) == -1)
+	sudo_warn("%s", U_("unable to write report"));
+
+    debug_return;
+}
+
+/*
+ * Returns true if the I/O log stream is an uncompressed regular file.
+ * Chunked and dictionary streams have no underlying file descriptor.
+ */
+static bool
+stream_stat(struct iolog_file *iol, struct stat *sb)
+{
+    int fd = -1;
+    debug_decl(stream_stat, SUDO_DEBUG_UTIL);
+
+    if (!iol->compressed)
+	fd = fileno(iol->fd.f);
+    if (fd == -1 || fstat(fd, sb) == -1)
+	debug_return_bool(false);
+    debug_return_bool(S_ISREG(sb->st_mode));
+}
+
+/*
+ * Find the uncompressed length of an I/O log stream.  The length of
+ * a plain file comes from fstat(2), anything else must be read.
+ */
+static void
+stream_size(struct session_check *check, int iofd)
+{
+    struct iolog_file *iol = &check->files[iofd];
+    char buf[64 * 1024];
+    const char *errstr;
+    struct stat sb;
+    ssize_t nread;
+    debug_decl(stream_size, SUDO_DEBUG_UTIL);
+
+    if (stream_stat(iol, &sb)) {
+	check->size[iofd] = sb.st_size;
+
+	/* Don't truncate data that is shared with another file. */
+	check->rewrite[iofd] = sb.st_nlink != 1;
+	debug_return;
+    }
+
+    /* Compressed, chunked or dictionary stream. */
+    check->rewrite[iofd] = true;
+    for (;;) {
+	nread = iolog_read(iol, buf, sizeof(buf), &errstr);
+	if (nread == 0)
+	    break;
+	if (nread == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+		"%s: unable to read to the end: %s", iolog_fd_to_name(iofd),
+		errstr);
+	    check->corrupt[iofd] = true;
+	    break;
+	}
+	check->size[iofd] += nread;
+    }
+
+    debug_return;
+}
+
+/*
+ * Check a single timing record against the I/O log streams.
+ * Returns false if the record is not consistent.
+ */
+static bool
+check_record(struct session_check *check, const char *line, size_t len)
+{
+    struct timing_closure timing;
+    debug_decl(check_record, SUDO_DEBUG_UTIL);
+
+    memset(&timing, 0, sizeof(timing));
+    timing.decimal = ".";
+    if (!iolog_parse_timing_r(&check->parser, line, &timing)) {
+	check->reason = N_("invalid timing record");
+	debug_return_bool(false);
+    }
+    if (timing.event < IOFD_TIMING) {
+	if (!check->files[timing.event].enabled) {
+	    check->reason = N_("missing I/O log file");
+	    check->iofd = timing.event;
+	    debug_return_bool(false);
+	}
+	if ((off_t)timing.u.nbytes >
+		check->size[timing.event] - check->good[timing.event]) {
+	    check->reason = N_("missing I/O log data");
+	    check->iofd = timing.event;
+	    debug_return_bool(false);
+	}
+	check->good[timing.event] += timing.u.nbytes;
+    }
+    check->good[IOFD_TIMING] += len;
+    check->records++;
+
+    debug_return_bool(true);
+}
+
+/*
+ * Read the timing file, stopping at the first record that is
+ * incomplete, invalid or refers to data that is not present.
+ */
+static void
+scan_timing(struct session_check *check)
+{
+    struct iolog_file *iol = &check->files[IOFD_TIMING];
+    char buf[64 * 1024], *cp, *ep;
+    const char *errstr;
+    size_t len = 0;
+    ssize_t nread;
+    debug_decl(scan_timing, SUDO_DEBUG_UTIL);
+
+    for (;;) {
+	nread = iolog_read(iol, buf + len, sizeof(buf) - len, &errstr);
+	if (nread == -1) {
+	    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+		"timing: unable to read to the end: %s", errstr);
+	    check->corrupt[IOFD_TIMING] = true;
+	    check->reason = N_("unable to read timing file");
+	    break;
+	}
+	if (nread == 0) {
+	    /* A partial line is left over from an interrupted write. */
+	    if (len != 0)
+		check->reason = N_("incomplete timing record");
+	    break;
+	}
+	len += nread;
+
+	for (cp = buf; (ep = memchr(cp, '\n', len - (cp - buf))) != NULL;
+		cp = ep + 1) {
+	    *ep = '\0';
+	    if (!check_record(check, cp, (ep - cp) + 1))
+		debug_return;
+	}
+	len -= cp - buf;
+	if (len == sizeof(buf)) {
+	    check->reason = N_("invalid timing record");
+	    break;
+	}
+	memmove(buf, cp, len);
+    }
+
+    debug_return;
+}
+
+/*
+ * Per-stream state used when checking the digest file.
+ */
+struct digest_stream {
+    struct iolog_file iol;
+    struct sudo_digest *ctx;	/* digest of the current chunk */
+    unsigned long long offset;	/* number of bytes hashed */
+    unsigned long long chunks;	/* number of checkpoints verified */
+    unsigned char chain[IOLOG_DIGEST_MAX_LEN];
+};
+
+/*
+ * Open an I/O log stream for hashing, if not already open.
+ */
+static bool
+digest_stream_open(int dfd, struct digest_stream *ds, int iofd)
+{
+    debug_decl(digest_stream_open, SUDO_DEBUG_UTIL);
+
+    if (ds->ctx != NULL)
+	debug_return_bool(true);
+    if ((ds->ctx = sudo_digest_alloc(IOLOG_DIGEST_TYPE)) == NULL) {
+	sudo_warnx(U_("%s: %s"), __func__, U_("unable to allocate memory"));
+	debug_return_bool(false);
+    }
+    ds->iol.enabled = true;
+    if (!iolog_open(&ds->iol, dfd, iofd, "r")) {
+	sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO|SUDO_DEBUG_ERRNO,
+	    "unable to open %s", iolog_fd_to_name(iofd));
+	debug_return_bool(false);
+    }
+
+    debug_return_bool(true);
+}
+
+/*
+ * Hash the next len bytes of an I/O log stream.
+ * Returns false if the stream ends first.
+ */
+static bool
+digest_stream_hash(struct digest_stream *ds, size_t len, unsigned char *md)
+{
+    char buf[64 * 1024];
+    const char *errstr;
+    ssize_t nread;
+    debug_decl(digest_stream_hash, SUDO_DEBUG_UTIL);
+
+    while (len > 0) {
+	nread = iolog_read(&ds->iol, buf, MIN(len, sizeof(buf)), &errstr);
+	if (nread <= 0) {
+	    sudo_debug_printf(SUDO_DEBUG_WARN|SUDO_DEBUG_LINENO,
+		"short read at %llu: %s", ds->offset,
+		nread == 0 ? "end of file" : errstr);
+	    debug_return_bool(false);
+	}
+	sudo_digest_update(ds->ctx, buf, nread);
+	ds->offset += nread;
+	len -= nread;
+    }
+    sudo_digest_final(ds->ctx, md);
+    sudo_digest_reset(ds->ctx);
+
+    debug_return_bool(true);
+}
+
+/*
+ * Find the named member of a JSON object with the specified type.
+ */
+static struct json_item *
+digest_json_lookup(struct json_object *object, const char *name,
+    enum json_value_type type)
+{
+    struct json_item *item;
+    debug_decl(digest_json_lookup, SUDO_DEBUG_UTIL);
+
+    TAILQ_FOREACH(item, &object->items, entries) {
+	if (item->name != NULL && strcmp(item->name, name) == 0)
+	    debug_return_ptr(item->type == type ? item : NULL);
+    }
+    debug_return_ptr(NULL);
+}
+
+/*
+ * Check the "digest" object in log.json against the final state of
+ * each stream and, for a keyed log, check the seal.  Returns false
+ * if the log was never sealed, which happens when sudo_logsrvd exits
+ * before the command does.
+ */
+static bool
+verify_digest_seal(int dfd, struct digest_stream *streams, bool keyed,
+    struct sudo_digest *ctx, struct session_check *check)
+{
+    char hex[IOLOG_DIGEST_MAX_LEN * 2 + 1];
+    char seal[IOFD_MAX * (64 + IOLOG_DIGEST_MAX_LEN * 2)];
+    unsigned char mac[IOLOG_DIGEST_MAX_LEN];
+    const int md_len = sudo_digest_getlen(IOLOG_DIGEST_TYPE);
+    struct json_item *item, *length, *chunks, *chain;
+    struct json_object root, *digest;
+    size_t seal_len = 0;
+    bool ret = false;
+    int fd, iofd, len;
+    FILE *fp;
+    debug_decl(verify_digest_seal, SUDO_DEBUG_UTIL);
+
+    fd = openat(dfd, "log.json", O_RDONLY|O_NOFOLLOW);
+    if (fd == -1 || (fp = fdopen(fd, "r")) == NULL) {
+	if (fd != -1)
+	    close(fd);
+	debug_return_bool(false);
+    }
+    if (!iolog_parse_json(fp, "log.json", &root)) {
+	fclose(fp);
+	debug_return_bool(false);
+    }
+    fclose(fp);
+
+    /* The first object holds all the actual data. */
+    item = TAILQ_FIRST(&root.items);
+    if (item == NULL || item->type != JSON_OBJECT)
+	goto done;
+    item = digest_json_lookup(&item->u.child, "digest", JSON_OBJECT);
+    if (item == NULL)
+	goto done;
+    digest = &item->u.child;
+    ret = true;
+
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	struct digest_stream *ds = &streams[iofd];
+	char ch;
+
+	item = digest_json_lookup(digest, iolog_fd_to_name(iofd), JSON_OBJECT);
+	if (item == NULL) {
+	    if (ds->ctx != NULL) {
+		check->reason = N_("I/O log stream missing from digest");
+		check->iofd = iofd;
+		goto done;
+	    }
+	    continue;
+	}
+	length = digest_json_lookup(&item->u.child, "length", JSON_NUMBER);
+	chunks = digest_json_lookup(&item->u.child, "chunks", JSON_NUMBER);
+	chain = digest_json_lookup(&item->u.child, "chain", JSON_STRING);
+	if (length == NULL || chunks == NULL || chain == NULL) {
+	    check->reason = N_("invalid digest in log.json");
+	    check->iofd = iofd;
+	    goto done;
+	}
+
+	/* The sealed length must be the end of the stream. */
+	if (!digest_stream_open(dfd, ds, iofd) ||
+		iolog_read(&ds->iol, &ch, 1, NULL) != 0 ||
+		(unsigned long long)length->u.number != ds->offset ||
+		(unsigned long long)chunks->u.number != ds->chunks) {
+	    check->reason = N_("I/O log length does not match digest");
+	    check->iofd = iofd;
+	    goto done;
+	}
+	iolog_digest_to_hex(ds->chain, md_len, hex);
+	if ((!keyed || iolog_digest_keyed()) &&
+		strcmp(chain->u.string, hex) != 0) {
+	    check->reason = N_("digest chain mismatch");
+	    check->iofd = iofd;
+	    goto done;
+	}
+
+	len = snprintf(seal + seal_len, sizeof(seal) - seal_len,
+	    IOLOG_DIGEST_SEAL_FMT, iofd, ds->offset, ds->chunks,
+	    chain->u.string);
+	if (len < 0 || (size_t)len >= sizeof(seal) - seal_len) {
+	    check->reason = N_("invalid digest in log.json");
+	    check->iofd = iofd;
+	    goto done;
+	}
+	seal_len += len;
+    }
+
+    item = digest_json_lookup(digest, "keyed", JSON_BOOL);
+    if (keyed != (item != NULL && item->u.boolean)) {
+	check->reason = N_("invalid digest in log.json");
+	goto done;
+    }
+    if (keyed && iolog_digest_keyed()) {
+	item = digest_json_lookup(digest, "seal", JSON_STRING);
+	iolog_digest_mac(ctx, seal, mac);
+	iolog_digest_to_hex(mac, md_len, hex);
+	if (item == NULL || strcmp(item->u.string, hex) != 0) {
+	    check->reason = N_("digest seal mismatch");
+	    goto done;
+	}
+    }
+
+done:
+    free_json_items(&root.items);
+    debug_return_bool(ret);
+}
+
+/*
+ * Recompute the chunk digests and hash chain of each stream and
+ * compare them to the checkpoints in the digest file and the final
+ * values stored in log.json.  A keyed chain can only be checked if
+ * the key was specified with -k; if it was, an unkeyed chain is
+ * rejected since anyone with write access could have rebuilt it.
+ * Returns a note for the report, or NULL if there is no digest.
+ */
+static const char *
+verify_digest(int dfd, struct session_check *check)
+{
+    struct digest_stream streams[IOFD_MAX];
+    struct sudo_digest *chain_ctx = NULL;
+    char md_hex[IOLOG_DIGEST_MAX_LEN * 2 + 1];
+    char chain_hex[IOLOG_DIGEST_MAX_LEN * 2 + 1];
+    char hex[IOLOG_DIGEST_MAX_LEN * 2 + 1];
+    unsigned char md[IOLOG_DIGEST_MAX_LEN];
+    const int md_len = sudo_digest_getlen(IOLOG_DIGEST_TYPE);
+    char name[16], flags[16];
+    const char *note = NULL;
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t linelen;
+    bool keyed = false;
+    int chunk_size, fd, iofd, n;
+    FILE *fp = NULL;
+    debug_decl(verify_digest, SUDO_DEBUG_UTIL);
+
+    memset(streams, 0, sizeof(streams));
+
+    fd = openat(dfd, IOLOG_DIGEST_FILE, O_RDONLY|O_NOFOLLOW);
+    if (fd == -1 || (fp = fdopen(fd, "r")) == NULL) {
+	if (fd != -1)
+	    close(fd);
+	/* Without a digest file there is nothing to check against. */
+	if (iolog_digest_keyed())
+	    check->reason = N_("missing digest file");
+	debug_return_const_str(NULL);
+    }
+    if ((chain_ctx = sudo_digest_alloc(IOLOG_DIGEST_TYPE)) == NULL) {
+	sudo_warnx(U_("%s: %s"), __func__, U_("unable to allocate memory"));
+	goto done;
+    }
+
+    /* The header is the algorithm, chunk size and an optional flag. */
+    linelen = getdelim(&line, &linesize, '\n', fp);
+    n = linelen == -1 ? 0 :
+	sscanf(line, "%15s %d %15s", name, &chunk_size, flags);
+    if (n < 2 || strcmp(name, IOLOG_DIGEST_NAME) != 0 ||
+	    chunk_size != IOLOG_DIGEST_CHUNK ||
+	    (n == 3 && strcmp(flags, IOLOG_DIGEST_KEYED) != 0)) {
+	check->reason = N_("invalid digest file");
+	goto done;
+    }
+    keyed = n == 3;
+    if (!keyed && iolog_digest_keyed()) {
+	check->reason = N_("digest chain is not keyed");
+	goto done;
+    }
+
+    while ((linelen = getdelim(&line, &linesize, '\n', fp)) != -1) {
+	unsigned long long chunk, offset;
+	struct digest_stream *ds;
+	size_t length;
+
+	/* A partial checkpoint is left over from an interrupted write. */
+	if (line[linelen - 1] != '\n')
+	    break;
+	if (sscanf(line, "%d %llu %llu %zu %128s %128s", &iofd, &chunk,
+		&offset, &length, md_hex, chain_hex) != 6 ||
+		iofd < 0 || iofd >= IOFD_MAX || length == 0 ||
+		length > IOLOG_DIGEST_CHUNK) {
+	    check->reason = N_("invalid digest file");
+	    goto done;
+	}
+	ds = &streams[iofd];
+	check->iofd = iofd;
+	if (!digest_stream_open(dfd, ds, iofd)) {
+	    check->reason = N_("missing I/O log file");
+	    goto done;
+	}
+	if (chunk != ds->chunks || offset != ds->offset) {
+	    check->reason = N_("digest checkpoint out of sequence");
+	    goto done;
+	}
+	if (!digest_stream_hash(ds, length, md)) {
+	    check->reason = N_("missing I/O log data");
+	    goto done;
+	}
+	iolog_digest_to_hex(md, md_len, hex);
+	if (strcmp(md_hex, hex) != 0) {
+	    check->reason = N_("I/O log data does not match digest");
+	    goto done;
+	}
+	iolog_digest_chain(chain_ctx, ds->chain, md, ds->chain);
+	iolog_digest_to_hex(ds->chain, md_len, hex);
+	if ((!keyed || iolog_digest_keyed()) && strcmp(chain_hex, hex) != 0) {
+	    check->reason = N_("digest chain mismatch");
+	    goto done;
+	}
+	ds->chunks++;
+    }
+    check->iofd = -1;
+
+    if (!verify_digest_seal(dfd, streams, keyed, chain_ctx, check)) {
+	if (check->reason == NULL)
+	    note = U_("digest not sealed");
+    } else if (keyed && !iolog_digest_keyed()) {
+	note = U_("digest key not specified");
+    } else {
+	note = keyed ? U_("keyed digest ok") : U_("digest ok");
+    }
+
+done:
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	if (streams[iofd].ctx != NULL) {
+	    sudo_digest_free(streams[iofd].ctx);
+	    if (streams[iofd].iol.enabled)
+		iolog_close(&streams[iofd].iol, NULL);
+	}
+    }
+    if (chain_ctx != NULL)
+	sudo_digest_free(chain_ctx);
+    if (fp != NULL)
+	fclose(fp);
+    free(line);
+    debug_return_const_str(note);
+}
+
+/*
+ * Truncate a plain I/O log file in place and sync it to disk.
+ */
+static bool
+truncate_stream(int dfd, const char *path, int iofd, off_t len)
+{
+    const char *name = iolog_fd_to_name(iofd);
+    bool ret = true;
+    int fd;
+    debug_decl(truncate_stream, SUDO_DEBUG_UTIL);
+
+    fd = openat(dfd, name, O_WRONLY|O_NOFOLLOW);
+    if (fd == -1 || ftruncate(fd, len) == -1 || fsync(fd) == -1) {
+	sudo_warn(U_("unable to truncate %s/%s"), path, name);
+	ret = false;
+    }
+    if (fd != -1)
+	close(fd);
+
+    debug_return_bool(ret);
+}
+
+/*
+ * Copy the first len bytes of an I/O log stream into a new file in
+ * tmpdir, preserving compression, mode and ownership.  Chunked and
+ * dictionary streams are written back as plain (or gzip) files.
+ */
+static bool
+copy_stream(int dfd, int tmpdir_fd, const char *path, int iofd, off_t len)
+{
+    const char *name = iolog_fd_to_name(iofd);
+    struct iolog_ctx ctx = iolog_default_ctx;
+    struct iolog_file src, dst;
+    char buf[64 * 1024];
+    const char *errstr = NULL;
+    struct stat sb;
+    bool ret = false;
+    ssize_t nread;
+    int fd;
+    debug_decl(copy_stream, SUDO_DEBUG_UTIL);
+
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    src.enabled = true;
+    dst.enabled = true;
+    if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1 ||
+	    !iolog_ctx_open(&ctx, &src, dfd, iofd, "r")) {
+	sudo_warn(U_("unable to open %s/%s"), path, name);
+	debug_return_bool(false);
+    }
+    /* Keep the original compression without changing the global setting. */
+    iolog_ctx_set_compress(&ctx, src.compressed);
+    if (!iolog_ctx_open(&ctx, &dst, tmpdir_fd, iofd, "w")) {
+	sudo_warn(U_("unable to create %s/%s"), path, name);
+	goto done;
+    }
+
+    while (len > 0) {
+	const size_t toread = len < ssizeof(buf) ? (size_t)len : sizeof(buf);
+
+	/* Unlike iolog_copy(), a short stream must not loop forever. */
+	nread = iolog_read(&src, buf, toread, &errstr);
+	if (nread <= 0) {
+	    if (nread == 0)
+		errstr = U_("unexpected end of file");
+	    goto done;
+	}
+	if (iolog_write(&dst, buf, nread, &errstr) == -1)
+	    goto done;
+	len -= nread;
+    }
+    if (!iolog_close(&dst, &errstr)) {
+	dst.enabled = false;
+	goto done;
+    }
+    dst.enabled = false;
+
+    /* The copy must be on disk before it replaces the original. */
+    fd = openat(tmpdir_fd, name, O_WRONLY|O_NOFOLLOW);
+    if (fd == -1 || fsync(fd) == -1) {
+	errstr = strerror(errno);
+	if (fd != -1)
+	    close(fd);
+	goto done;
+    }
+    close(fd);
+
+    /* The write bits on the timing file mark a session in progress. */
+    if (fchmodat(tmpdir_fd, name, sb.st_mode & (S_IRWXU|S_IRWXG|S_IRWXO),
+	    0) == -1 || fchownat(tmpdir_fd, name, sb.st_uid, sb.st_gid,
+	    AT_SYMLINK_NOFOLLOW) == -1) {
+	errstr = strerror(errno);
+	goto done;
+    }
+    ret = true;
+
+done:
+    if (!ret && errstr != NULL)
+	sudo_warnx(U_("unable to copy %s/%s: %s"), path, name, errstr);
+    if (dst.enabled)
+	iolog_close(&dst, NULL);
+    iolog_close(&src, NULL);
+    debug_return_bool(ret);
+}
+
+/*
+ * Drop checkpoints for data that was removed from the "digest" file.
+ * The digest object in log.json, if any, no longer matches and is
+ * left for sudo_logsrvd to rebuild when the session is restarted.
+ */
+static bool
+trim_digest(int dfd, const char *path, const off_t *good)
+{
+    char tmpfile[PATH_MAX], digest[PATH_MAX];
+    FILE *ifp = NULL, *ofp = NULL;
+    unsigned int lineno = 0;
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t linelen;
+    struct stat sb;
+    bool ret = false;
+    int fd, len;
+    debug_decl(trim_digest, SUDO_DEBUG_UTIL);
+
+    fd = openat(dfd, IOLOG_DIGEST_FILE, O_RDONLY|O_NOFOLLOW);
+    if (fd == -1) {
+	if (errno == ENOENT)
+	    debug_return_bool(true);
+	goto bad;
+    }
+    if (fstat(fd, &sb) == -1 || (ifp = fdopen(fd, "r")) == NULL) {
+	close(fd);
+	goto bad;
+    }
+
+    len = snprintf(digest, sizeof(digest), "%s/%s", path, IOLOG_DIGEST_FILE);
+    if (len < 0 || len >= ssizeof(digest)) {
+	errno = ENAMETOOLONG;
+	goto bad;
+    }
+    len = snprintf(tmpfile, sizeof(tmpfile), "%s.XXXXXX", digest);
+    if (len < 0 || len >= ssizeof(tmpfile)) {
+	errno = ENAMETOOLONG;
+	goto bad;
+    }
+    if ((fd = mkstemp(tmpfile)) == -1)
+	goto bad;
+    if ((ofp = fdopen(fd, "w")) == NULL) {
+	close(fd);
+	unlink(tmpfile);
+	goto bad;
+    }
+
+    while ((linelen = getdelim(&line, &linesize, '\n', ifp)) != -1) {
+	unsigned long long chunk, offset;
+	size_t length;
+	int iofd;
+
+	/* The first line is the header, the rest are checkpoints. */
+	if (lineno++ != 0) {
+	    if (line[linelen - 1] != '\n')
+		continue;
+	    if (sscanf(line, "%d %llu %llu %zu", &iofd, &chunk, &offset,
+		    &length) != 4 || iofd < 0 || iofd >= IOFD_MAX)
+		continue;
+	    if (offset + length > (unsigned long long)good[iofd])
+		continue;
+	}
+	if (fwrite(line, 1, linelen, ofp) != (size_t)linelen)
+	    break;
+    }
+    if (ferror(ifp) || fflush(ofp) != 0 || ferror(ofp) ||
+	    fsync(fileno(ofp)) == -1)
+	goto remove;
+    if (fchmod(fileno(ofp), sb.st_mode & (S_IRWXU|S_IRWXG|S_IRWXO)) == -1)
+	goto remove;
+    if (fchown(fileno(ofp), sb.st_uid, sb.st_gid) == -1)
+	goto remove;
+    if (rename(tmpfile, digest) == -1)
+	goto remove;
+    ret = true;
+
+remove:
+    if (!ret) {
+	const int serrno = errno;
+	unlink(tmpfile);
+	errno = serrno;
+    }
+bad:
+    if (!ret)
+	sudo_warn(U_("unable to trim %s/%s"), path, IOLOG_DIGEST_FILE);
+    if (ofp != NULL)
+	fclose(ofp);
+    if (ifp != NULL)
+	fclose(ifp);
+    free(line);
+    debug_return_bool(ret);
+}
+
+/*
+ * Truncate each stream to the data referenced by consistent records.
+ * The timing file and digest checkpoints are repaired first and synced
+ * to disk before any stream is shortened, so an interrupted repair
+ * never leaves records that refer to data past the end of a stream.
+ */
+static bool
+repair_session(int dfd, const char *path, struct session_check *check)
+{
+    static const int order[] = {
+	IOFD_TIMING, IOFD_STDIN, IOFD_STDOUT, IOFD_STDERR, IOFD_TTYIN,
+	IOFD_TTYOUT
+    };
+    char tmpdir[PATH_MAX], from[PATH_MAX], to[PATH_MAX];
+    int iofd, len, tmpdir_fd = -1;
+    const char *name;
+    bool ret = false;
+    size_t i;
+    debug_decl(repair_session, SUDO_DEBUG_UTIL);
+
+    for (i = 0; i < nitems(order); i++) {
+	iofd = order[i];
+
+	/* Records referring to the streams must be fixed first. */
+	if (i == 1 && !trim_digest(dfd, path, check->good))
+	    goto done;
+
+	if (!check->files[iofd].enabled)
+	    continue;
+	if (!check->corrupt[iofd] && check->size[iofd] == check->good[iofd])
+	    continue;
+
+	if (!check->rewrite[iofd] && !check->corrupt[iofd]) {
+	    if (!truncate_stream(dfd, path, iofd, check->good[iofd]))
+		goto done;
+	    continue;
+	}
+
+	/* Create the temporary directory on first use. */
+	if (tmpdir_fd == -1) {
+	    len = snprintf(tmpdir, sizeof(tmpdir), "%s/repair.XXXXXX", path);
+	    if (len < 0 || len >= ssizeof(tmpdir)) {
+		errno = ENAMETOOLONG;
+		sudo_warn("%s/repair.XXXXXX", path);
+		goto done;
+	    }
+	    if (!iolog_mkdtemp(tmpdir)) {
+		sudo_warn(U_("unable to mkdir %s"), tmpdir);
+		goto done;
+	    }
+	    tmpdir_fd = iolog_openat(AT_FDCWD, tmpdir, O_RDONLY);
+	    if (tmpdir_fd == -1) {
+		sudo_warn(U_("unable to open %s"), tmpdir);
+		rmdir(tmpdir);
+		goto done;
+	    }
+	}
+	if (!copy_stream(dfd, tmpdir_fd, path, iofd, check->good[iofd]))
+	    goto done;
+
+	name = iolog_fd_to_name(iofd);
+	len = snprintf(from, sizeof(from), "%s/%s", tmpdir, name);
+	if (len < 0 || len >= ssizeof(from)) {
+	    errno = ENAMETOOLONG;
+	    sudo_warn("%s/%s", tmpdir, name);
+	    goto done;
+	}
+	len = snprintf(to, sizeof(to), "%s/%s", path, name);
+	if (len < 0 || len >= ssizeof(to)) {
+	    errno = ENAMETOOLONG;
+	    sudo_warn("%s/%s", path, name);
+	    goto done;
+	}
+	if (rename(from, to) == -1) {
+	    sudo_warn(U_("unable to rename %s to %s"), from, to);
+	    unlinkat(tmpdir_fd, name, 0);
+	    goto done;
+	}
+	/* Make the rename durable before the next stream is changed. */
+	if (fsync(dfd) == -1) {
+	    sudo_warn(U_("unable to sync %s"), path);
+	    goto done;
+	}
+    }
+
+    /* The trimmed digest file was renamed into place. */
+    if (fsync(dfd) == -1) {
+	sudo_warn(U_("unable to sync %s"), path);
+	goto done;
+    }
+    ret = true;
+
+done:
+    if (tmpdir_fd != -1) {
+	close(tmpdir_fd);
+	if (rmdir(tmpdir) == -1)
+	    sudo_warn(U_("unable to remove %s"), tmpdir);
+    }
+    debug_return_bool(ret);
+}
+
+/*
+ * Verify a single session directory, repairing it if requested.
+ */
+static void
+verify_session(const char *path)
+{
+    struct session_check check;
+    const char *note = NULL;
+    struct stat sb;
+    bool repaired = false;
+    int dfd, iofd;
+    debug_decl(verify_session, SUDO_DEBUG_UTIL);
+
+    stats.sessions++;
+
+    dfd = iolog_openat(AT_FDCWD, path, O_RDONLY);
+    if (dfd == -1) {
+	sudo_warn(U_("unable to open %s"), path);
+	stats.errors++;
+	debug_return;
+    }
+
+    /* Skip sessions that sudo_logsrvd may still be writing to. */
+    if (fstatat(dfd, "timing", &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+	sudo_warn(U_("unable to stat %s/%s"), path, "timing");
+	stats.errors++;
+	goto done;
+    }
+    if (ISSET(sb.st_mode, S_IWUSR) && sb.st_mtime > grace_cutoff) {
+	stats.active++;
+	if (verbose)
+	    report("%s: %s", path, U_("in progress"));
+	goto done;
+    }
+
+    memset(&check, 0, sizeof(check));
+    check.iofd = -1;
+    if (!iolog_open_all(dfd, path, check.files, "r")) {
+	for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	    if (check.files[iofd].enabled)
+		iolog_close(&check.files[iofd], NULL);
+	}
+	stats.errors++;
+	goto done;
+    }
+    for (iofd = 0; iofd < IOFD_TIMING; iofd++) {
+	if (check.files[iofd].enabled)
+	    stream_size(&check, iofd);
+    }
+    check.rewrite[IOFD_TIMING] =
+	!stream_stat(&check.files[IOFD_TIMING], &sb) || sb.st_nlink != 1;
+    scan_timing(&check);
+    for (iofd = 0; iofd < IOFD_MAX; iofd++) {
+	if (check.files[iofd].enabled)
+	    iolog_close(&check.files[iofd], NULL);
+    }
+
+    /* The timing file ends at the last consistent record. */
+    check.size[IOFD_TIMING] = check.reason ? -1 : check.good[IOFD_TIMING];
+    if (check.reason == NULL) {
+	for (iofd = 0; iofd < IOFD_TIMING; iofd++) {
+	    if (!check.files[iofd].enabled)
+		continue;
+	    if (check.corrupt[iofd]) {
+		check.reason = N_("corrupt I/O log file");
+		check.iofd = iofd;
+		break;
+	    }
+	    if (check.size[iofd] != check.good[iofd]) {
+		check.reason = N_("unreferenced I/O log data");
+		check.iofd = iofd;
+		break;
+	    }
+	}
+    }
+    if (check.reason == NULL) {
+	note = verify_digest(dfd, &check);
+	if (check.reason != NULL) {
+	    /* Data that does not match its digest cannot be repaired. */
+	    stats.damaged++;
+	    report("%s: %s%s%s%s", path, _(check.reason),
+		check.iofd != -1 ? " (" : "",
+		check.iofd != -1 ? iolog_fd_to_name(check.iofd) : "",
+		check.iofd != -1 ? ")" : "");
+	    goto done;
+	}
+	if (verbose) {
+	    report("%s: %s, %llu records%s%s", path, U_("ok"), check.records,
+		note != NULL ? ", " : "", note != NULL ? note : "");
+	}
+	goto done;
+    }
+    stats.damaged++;
+
+    if (repair) {
+	if (repair_session(dfd, path, &check)) {
+	    stats.repaired++;
+	    repaired = true;
+	} else {
+	    stats.errors++;
+	}
+    }
+    report("%s: %s%s%s%s after record %llu%s", path, _(check.reason),
+	check.iofd != -1 ? " (" : "",
+	check.iofd != -1 ? iolog_fd_to_name(check.iofd) : "",
+	check.iofd != -1 ? ")" : "", check.records,
+	!repair ? "" : repaired ? U_(", repaired") : U_(", repair failed"));
+
+done:
+    close(dfd);
+    debug_return;
+}
+
+/*
+ * Worker process: verify each session path read from fd and send
+ * the totals to statsfd when the parent closes the pipe.
+ */
+static int
+worker_main(int fd, int statsfd)
+{
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t len;
+    FILE *fp;
+    debug_decl(worker_main, SUDO_DEBUG_UTIL);
+
+    memset(&stats, 0, sizeof(stats));
+    if ((fp = fdopen(fd, "r")) == NULL)
+	sudo_fatal(NULL);
+    while ((len = getdelim(&line, &linesize, '\n', fp)) != -1) {
+	if (len > 0 && line[len - 1] == '\n')
+	    line[--len] = '\0';
+	if (len != 0)
+	    verify_session(line);
+    }
+    fclose(fp);
+    free(line);
+
+    /* Small enough to be written atomically. */
+    if (write(statsfd, &stats, sizeof(stats)) != ssizeof(stats))
+	debug_return_int(EXIT_FAILURE);
+    debug_return_int(EXIT_SUCCESS);
+}
+
+/*
+ * Start the worker processes.  Each has its own pipe that the
+ * parent writes session paths to, one per line.
+ */
+static int
+start_workers(unsigned int jobs)
+{
+    int statsfd[2], pfd[2];
+    unsigned int i, j;
+    pid_t pid;
+    debug_decl(start_workers, SUDO_DEBUG_UTIL);
+
+    if (pipe(statsfd) == -1)
+	sudo_fatal("%s", U_("unable to create pipe"));
+
+    /* Don't let the workers flush our buffered output. */
+    fflush(stdout);
+    fflush(stderr);
+
+    for (i = 0; i < jobs; i++) {
+	if (pipe(pfd) == -1)
+	    sudo_fatal("%s", U_("unable to create pipe"));
+	switch (pid = sudo_debug_fork()) {
+	case -1:
+	    sudo_fatal("%s", U_("unable to fork"));
+	    break;
+	case 0:
+	    /* Child must not hold the other workers' pipes open. */
+	    for (j = 0; j < i; j++)
+		close(workers[j].fd);
+	    close(pfd[1]);
+	    close(statsfd[0]);
+	    _exit(worker_main(pfd[0], statsfd[1]));
+	default:
+	    break;
+	}
+	close(pfd[0]);
+	if (fcntl(pfd[1], F_SETFL, O_NONBLOCK) == -1)
+	    sudo_fatal("%s", U_("unable to set pipe to non-blocking"));
+	workers[i].pid = pid;
+	workers[i].fd = pfd[1];
+	nworkers++;
+    }
+    close(statsfd[1]);
+
+    debug_return_int(statsfd[0]);
+}
+
+/*
+ * Close the worker pipes, collect the workers' totals and wait for
+ * them to exit.
+ */
+static void
+finish_workers(int statsfd)
+{
+    struct verify_stats ws;
+    unsigned int i;
+    ssize_t nread;
+    int status;
+    debug_decl(finish_workers, SUDO_DEBUG_UTIL);
+
+    for (i = 0; i < nworkers; i++) {
+	if (workers[i].fd != -1)
+	    close(workers[i].fd);
+    }
+    for (;;) {
+	nread = read(statsfd, &ws, sizeof(ws));
+	if (nread == -1 && errno == EINTR)
+	    continue;
+	if (nread != ssizeof(ws))
+	    break;
+	stats.sessions += ws.sessions;
+	stats.active += ws.active;
+	stats.damaged += ws.damaged;
+	stats.repaired += ws.repaired;
+	stats.errors += ws.errors;
+    }
+    close(statsfd);
+
+    for (i = 0; i < nworkers; i++) {
+	while (waitpid(workers[i].pid, &status, 0) == -1) {
+	    if (errno != EINTR)
+		break;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	    sudo_warnx(U_("worker process %d failed"), (int)workers[i].pid);
+	    stats.errors++;
+	}
+    }
+
+    debug_return;
+}
+
+/*
+ * Hand a session off to the next worker whose pipe has room,
+ * or verify it directly if there are no workers.
+ */
+static void
+dispatch_session(const char *path)
+{
+    struct pollfd pfds[MAX_JOBS];
+    const size_t len = strlen(path);
+    char line[PIPE_BUF];
+    unsigned int i, live;
+    debug_decl(dispatch_session, SUDO_DEBUG_UTIL);
+
+    /* Lines no longer than PIPE_BUF are written atomically. */
+    if (nworkers == 0 || len >= sizeof(line)) {
+	verify_session(path);
+	debug_return;
+    }
+    memcpy(line, path, len);
+    line[len] = '\n';
+
+    for (;;) {
+	for (i = 0, live = 0; i < nworkers; i++) {
+	    struct verify_worker *w = &workers[next_worker];
+
+	    next_worker = (next_worker + 1) % nworkers;
+	    if (w->fd == -1)
+		continue;
+	    if (write(w->fd, line, len + 1) != -1)
+		debug_return;
+	    if (errno == EPIPE) {
+		/* Worker died, it will be reported when reaped. */
+		close(w->fd);
+		w->fd = -1;
+		continue;
+	    }
+	    if (errno != EAGAIN && errno != EINTR)
+		sudo_fatal("%s", U_("unable to write to worker"));
+	    live++;
+	}
+	if (live == 0) {
+	    verify_session(path);
+	    debug_return;
+	}
+
+	/* All pipes are full, wait for a worker to catch up. */
+	for (i = 0; i < nworkers; i++) {
+	    pfds[i].fd = workers[i].fd;
+	    pfds[i].events = POLLOUT;
+	    pfds[i].revents = 0;
+	}
+	if (poll(pfds, nworkers, -1) == -1 && errno != EINTR)
+	    sudo_fatal("poll");
+    }
+}
+
+/*
+ * Walk the log tree, dispatching each session directory.
+ * Session directories are not searched for nested sessions.
+ */
+static bool
+walk_dir(char *path, size_t pathlen)
+{
+    struct dirent *dp;
+    struct stat sb;
+    bool ret = true;
+    DIR *dirp;
+    size_t len;
+    int fd;
+    debug_decl(walk_dir, SUDO_DEBUG_UTIL);
+
+    fd = open(path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+    if (fd == -1) {
+	sudo_warn("%s", path);
+	debug_return_bool(false);
+    }
+    if (fstatat(fd, "timing", &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+	    S_ISREG(sb.st_mode)) {
+	close(fd);
+	dispatch_session(path);
+	debug_return_bool(true);
+    }
+    if ((dirp = fdopendir(fd)) == NULL) {
+	sudo_warn("%s", path);
+	close(fd);
+	debug_return_bool(false);
+    }
+    while ((dp = readdir(dirp)) != NULL) {
+	if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+	    continue;
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+	if (dp->d_type != DT_DIR && dp->d_type != DT_UNKNOWN)
+	    continue;
+#endif
+	if (fstatat(dirfd(dirp), dp->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1
+		|| !S_ISDIR(sb.st_mode))
+	    continue;
+
+	len = strlen(dp->d_name);
+	if (pathlen + 1 + len >= PATH_MAX) {
+	    errno = ENAMETOOLONG;
+	    sudo_warn("%s/%s", path, dp->d_name);
+	    ret = false;
+	    continue;
+	}
+	path[pathlen] = '/';
+	memcpy(path + pathlen + 1, dp->d_name, len + 1);
+	if (!walk_dir(path, pathlen + 1 + len))
+	    ret = false;
+	path[pathlen] = '\0';
+    }
+    closedir(dirp);
+
+    debug_return_bool(ret);
+}
+
+static const char short_opts[] = "g:j:k:o:rvV";
+static struct option long_opts[] = {
+    { "grace",		required_argument,	NULL,	'g' },
+    { "help",		no_argument,		NULL,	1 },
+    { "jobs",		required_argument,	NULL,	'j' },
+    { "key",		required_argument,	NULL,	'k' },
+    { "output",		required_argument,	NULL,	'o' },
+    { "repair",		no_argument,		NULL,	'r' },
+    { "verbose",	no_argument,		NULL,	'v' },
+    { "version",	no_argument,		NULL,	'V' },
+    { NULL,		no_argument,		NULL,	0 },
+};
+
+sudo_dso_public int main(int argc, char *argv[]);
+
+int
+main(int argc, char *argv[])
+{
+    char path[PATH_MAX];
+    time_t grace = DEFAULT_GRACE;
+    const char *errstr;
+    unsigned int jobs = 0;
+    bool ok = true;
+    int ch, i, statsfd = -1;
+    long ncpu;
+    size_t len;
+    debug_decl_vars(main, SUDO_DEBUG_MAIN);
+
+    initprogname(argc > 0 ? argv[0] : "sudo_logverify");
+    setlocale(LC_ALL, "");
+    bindtextdomain("sudo", LOCALEDIR); /* XXX - add logsrvd domain */
+    textdomain("sudo");
+
+    /* Read sudo.conf and initialize the debug subsystem. */
+    if (sudo_conf_read(NULL, SUDO_CONF_DEBUG) == -1)
+        exit(EXIT_FAILURE);
+    sudo_debug_register(getprogname(), NULL, NULL,
+        sudo_conf_debug_files(getprogname()));
+
+    while ((ch = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+	switch (ch) {
+	case 'g':
+	    grace = sudo_strtonum(optarg, 0, INT_MAX, &errstr);
+	    if (errstr != NULL) {
+		sudo_warnx(U_("%s: %s"), optarg, U_(errstr));
+		usage(true);
+	    }
+	    break;
+	case 'j':
+	    jobs = sudo_strtonum(optarg, 1, MAX_JOBS, &errstr);
+	    if (errstr != NULL) {
+		sudo_warnx(U_("%s: %s"), optarg, U_(errstr));
+		usage(true);
+	    }
+	    break;
+	case 'k':
+	    if (!iolog_digest_set_key(optarg))
+		usage(true);
+	    break;
+	case 'o':
+	    report_fd = open(optarg, O_WRONLY|O_APPEND|O_CREAT,
+		S_IRUSR|S_IWUSR);
+	    if (report_fd == -1)
+		sudo_fatal(U_("unable to open %s"), optarg);
+	    break;
+	case 'r':
+	    repair = true;
+	    break;
+	case 'v':
+	    verbose = true;
+	    break;
+	case 1:
+	    help();
+	    break;
+	case 'V':
+	    (void)printf(_("%s version %s\n"), getprogname(),
+		PACKAGE_VERSION);
+	    return 0;
+	default:
+	    usage(true);
+	}
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc == 0)
+	usage(true);
+
+    if (jobs == 0) {
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	jobs = ncpu > 0 ? (ncpu > MAX_JOBS ? MAX_JOBS : ncpu) : 1;
+    }
+    grace_cutoff = time(NULL) - grace;
+
+    /* A worker that exits early must not kill us. */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* With a single job there is nothing to gain from a worker. */
+    if (jobs > 1)
+	statsfd = start_workers(jobs);
+
+    for (i = 0; i < argc; i++) {
+	len = strlcpy(path, argv[i], sizeof(path));
+	if (len >= sizeof(path)) {
+	    errno = ENAMETOOLONG;
+	    sudo_warn("%s", argv[i]);
+	    ok = false;
+	    continue;
+	}
+	while (len > 1 && path[len - 1] == '/')
+	    path[--len] = '\0';
+	if (!walk_dir(path, len))
+	    ok = false;
+    }
+
+    if (statsfd != -1)
+	finish_workers(statsfd);
+
+    report("sessions: %llu checked, %llu in progress, %llu damaged, "
+	"%llu repaired, %llu errors", stats.sessions, stats.active,
+	stats.damaged, stats.repaired, stats.errors);
+
+    if (!ok || stats.errors != 0 || stats.damaged != stats.repaired)
+	debug_return_int(EXIT_FAILURE);
+    debug_return_int(EXIT_SUCCESS);
+}